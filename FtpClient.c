@@ -25,8 +25,11 @@
  */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <inttypes.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/unistd.h>
 #include "FtpClient.h"
@@ -34,6 +37,18 @@
 #include "netdb.h"
 
 #include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "bin_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#if FTP_CLIENT_TLS
+#include "mbedtls/ssl.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509_crt.h"
+#endif
 
 #if !defined FTP_CLIENT_DEFAULT_MODE
 #define FTP_CLIENT_DEFAULT_MODE			FTP_CLIENT_PASSIVE
@@ -43,6 +58,31 @@
 #define FTP_CLIENT_READ						1
 #define FTP_CLIENT_WRITE					2
 
+/* MODE B header descriptor bits (RFC 959 3.4.2) and largest block */
+#define FTP_CLIENT_BLOCK_EOF				0x40
+#define FTP_CLIENT_BLOCK_MARKER				0x10
+#define FTP_CLIENT_BLOCK_MAX				0xffff
+#define FTP_CLIENT_BLOCK_HEADER				3
+
+/* blockMode of a control connection */
+#define FTP_CLIENT_BLOCK_REFUSED			-1	/* server answered MODE B with 5xx */
+#define FTP_CLIENT_BLOCK_OFF				0
+#define FTP_CLIENT_BLOCK_WANTED				1	/* MODE B is sent before the next transfer */
+#define FTP_CLIENT_BLOCK_ON					2
+
+#if FTP_CLIENT_TLS
+/* TLS state shared by a control connection and its data connections */
+typedef struct
+{
+	mbedtls_entropy_context entropy;
+	mbedtls_ctr_drbg_context drbg;
+	mbedtls_ssl_config conf;
+	mbedtls_x509_crt ca;
+	mbedtls_ssl_session session;	/* control session, resumed by data connections */
+	int haveSession;
+} FtpClientTls_t;
+#endif
+
 struct NetBuf {
 	char* cput;
 	char* cget;
@@ -59,22 +99,83 @@ struct NetBuf {
 	unsigned long int xfered;
 	unsigned long int cbbytes;
 	unsigned long int xfered1;
+	unsigned long int rate;
+	unsigned long int burst;
+	int64_t tokens;
+	int64_t tstamp;
+	FtpClientTimings_t timings;
+	int sndbuf;
+	int rcvbuf;
+	int nodelayData;
+	int linger;
+	int blockMode;						/* control: FTP_CLIENT_BLOCK_* */
+	NetBuf_t* idleData;					/* control: MODE B data connection kept for the next transfer */
+	int block;							/* data: MODE B framing */
+	int blockLeft;						/* data: bytes left in the block being read */
+	int blockEof;						/* data: EOF block received or sent */
+	int blockBroken;					/* data: a block was cut short, the framing is lost */
+	char host[FTP_CLIENT_DNS_HOST_MAX];
+	#if FTP_CLIENT_TLS
+	FtpClientTls_t* tls;				/* control connection only */
+	mbedtls_ssl_context* ssl;			/* NULL while in plaintext */
+	int prot;							/* PROT P accepted, data connections use TLS */
+	#endif
 	char response[FTP_CLIENT_RESPONSE_BUFFER_SIZE];
 };
 
 static bool isInitilized = false;
 static FtpClient ftpClient_;
 
+/* resolved server addresses, kept in RTC memory across deep sleep */
+typedef struct
+{
+	char host[FTP_CLIENT_DNS_HOST_MAX];
+	uint32_t addr;
+	time_t expires;
+} DnsCacheEntry_t;
+
+RTC_DATA_ATTR static DnsCacheEntry_t dnsCache[FTP_CLIENT_DNS_CACHE_SIZE];
+
 /*Internal use functions*/
 static int socketWait(NetBuf_t* ctl);
 static int readResponse(char c, NetBuf_t* nControl);
 static int readLine(char* buffer, int max, NetBuf_t* ctl);
 static int sendCommand(const char* cmd, char expresp, NetBuf_t* nControl);
+static int buildCommand(char* buf, int max, NetBuf_t* nControl, const char* fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+static int replyCode(const char* line, char* sep);
+static int parsePasv(const char* response, unsigned char* addr);
 static int xfer(const char* localfile, const char* path,
 	NetBuf_t* nControl, int typ, int mode);
 static int openPort(NetBuf_t* nControl, NetBuf_t** nData, int mode, int dir);
 static int writeLine(const char* buf, int len, NetBuf_t* nData);
 static int acceptConnection(NetBuf_t* nData, NetBuf_t* nControl);
+static void rateWait(NetBuf_t* nData, int len);
+static int netRecv(NetBuf_t* nb, void* buf, int len);
+static int netSend(NetBuf_t* nb, const void* buf, int len);
+static void netClose(NetBuf_t* nb);
+static int recvAll(NetBuf_t* nb, void* buf, int len);
+static int sendBlockHeader(NetBuf_t* nb, int desc, int count);
+static int dataRecv(NetBuf_t* nb, void* buf, int len);
+static int dataSend(NetBuf_t* nb, const void* buf, int len);
+static void initData(NetBuf_t* nData, NetBuf_t* nControl, int dir);
+static void dropData(NetBuf_t* nData);
+static int idleDataAlive(NetBuf_t* nData);
+static int reuseData(const char* cmd, int mode, int dir, NetBuf_t* nControl, NetBuf_t** nData);
+static int closeBlockData(NetBuf_t* nData);
+#if FTP_CLIENT_TLS
+static int tlsBioSend(void* ctx, const unsigned char* buf, size_t len);
+static int tlsBioRecv(void* ctx, unsigned char* buf, size_t len);
+static int tlsHandshake(NetBuf_t* nb, NetBuf_t* nControl);
+static void tlsFree(NetBuf_t* nControl);
+#endif
+static void applyNoDelay(int handle, int on);
+static void applyKeepalive(int handle, int idle);
+static void applyDataOptions(int handle, NetBuf_t* nControl);
+static int resolveHost(const char* host, struct sockaddr_in* sin, int* cached);
+static void evictHost(const char* host);
+static int startConnect(const struct sockaddr_in* sin);
+static int openControl(const struct sockaddr_in* sin, int count, int* which);
 
 /*Miscellaneous Functions*/
 static int siteFtpClient(const char* cmd, NetBuf_t* nControl);
@@ -88,8 +189,13 @@ static int setCallbackFtpClient(const FtpClientCallbackOptions_t* opt, NetBuf_t*
 static int clearCallbackFtpClient(NetBuf_t* nControl);
 /*Server connection*/
 static int connectFtpClient(const char* host, uint16_t port, NetBuf_t** nControl);
+static int connectFallbackFtpClient(const char* host, uint16_t port,
+	const char* host2, uint16_t port2, NetBuf_t** nControl);
+static int getTimingsFtpClient(FtpClientTimings_t* timings, NetBuf_t* nControl);
+static int authTlsFtpClient(const char* caPem, NetBuf_t* nControl);
 static int loginFtpClient(const char* user, const char* pass, NetBuf_t* nControl);
 static void quitFtpClient(NetBuf_t* nControl);
+static void disconnectFtpClient(NetBuf_t* nControl);
 static int setOptionsFtpClient(int opt, long val, NetBuf_t* nControl);
 /*Directory Functions*/
 static int changeDirFtpClient(const char* path, NetBuf_t* nControl);
@@ -133,6 +239,15 @@ static int socketWait(NetBuf_t* ctl)
 
 	if ((ctl->dir == FTP_CLIENT_CONTROL) || (ctl->idlecb == NULL))
 		return 1;
+	/* a MODE B connection stays open after the EOF block, nothing more comes */
+	if (ctl->block && ctl->blockEof && (ctl->blockLeft == 0))
+		return 1;
+	#if FTP_CLIENT_TLS
+	/* decrypted bytes left in the TLS record do not show up in select */
+	if ((ctl->ssl != NULL) && (ctl->dir == FTP_CLIENT_READ)
+			&& (mbedtls_ssl_get_bytes_avail(ctl->ssl) > 0))
+		return 1;
+	#endif
 	if (ctl->dir == FTP_CLIENT_WRITE)
 		wfd = &fd;
 	else
@@ -145,8 +260,7 @@ static int socketWait(NetBuf_t* ctl)
 		rv = select((ctl->handle + 1), rfd, wfd, NULL, &tv);
 		if (rv == -1) {
 			rv = 0;
-			strncpy(ctl->ctrl->response, strerror(errno),
-						sizeof(ctl->ctrl->response));
+			snprintf(ctl->ctrl->response, sizeof(ctl->ctrl->response), "%s", strerror(errno));
 			break;
 		}
 		else if (rv > 0) {
@@ -160,6 +274,307 @@ static int socketWait(NetBuf_t* ctl)
 
 
 
+/*
+ * rateWait - token bucket pacing of a data connection
+ *
+ * Tokens are refilled from the elapsed esp_timer time and may go negative,
+ * the debt is paid by sleeping only once it is worth at least one tick.
+ * Oversleeping is credited back on the next call, so the long term rate is
+ * exact and no per-chunk delay is added while tokens are available.
+ */
+static void rateWait(NetBuf_t* nData, int len)
+{
+	NetBuf_t* ctl = nData->ctrl;
+	if ((ctl == NULL) || (ctl->rate == 0))
+		return;
+	int64_t burst = ctl->burst ? ctl->burst : ctl->rate / 10;
+	if (burst < FTP_CLIENT_BUFFER_SIZE)
+		burst = FTP_CLIENT_BUFFER_SIZE;
+	int64_t now = esp_timer_get_time();
+	ctl->tokens += (now - ctl->tstamp) * (int64_t)ctl->rate / 1000000;
+	ctl->tstamp = now;
+	if (ctl->tokens > burst)
+		ctl->tokens = burst;
+	ctl->tokens -= len;
+	if (ctl->tokens >= 0)
+		return;
+	int64_t waitUs = -ctl->tokens * 1000000 / (int64_t)ctl->rate;
+	if (waitUs >= portTICK_PERIOD_MS * 1000)
+		vTaskDelay(waitUs / 1000 / portTICK_PERIOD_MS);
+}
+
+
+
+/*
+ * netRecv - recv on a connection, through TLS once it is protected
+ *
+ * return -1 on error, 0 on end of stream or bytecount
+ */
+static int netRecv(NetBuf_t* nb, void* buf, int len)
+{
+	#if FTP_CLIENT_TLS
+	if (nb->ssl != NULL) {
+		int rv = mbedtls_ssl_read(nb->ssl, buf, len);
+		if (rv == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
+			return 0;
+		return (rv < 0) ? -1 : rv;
+	}
+	#endif
+	return recv(nb->handle, buf, len, 0);
+}
+
+
+
+/*
+ * netSend - send on a connection, through TLS once it is protected
+ *
+ * return -1 on error or bytecount
+ */
+static int netSend(NetBuf_t* nb, const void* buf, int len)
+{
+	#if FTP_CLIENT_TLS
+	if (nb->ssl != NULL) {
+		int w = 0;
+		while (w < len) {
+			int rv = mbedtls_ssl_write(nb->ssl, (const unsigned char*)buf + w, len - w);
+			if (rv < 0)
+				return -1;
+			w += rv;
+		}
+		return w;
+	}
+	#endif
+	return send(nb->handle, buf, len, 0);
+}
+
+
+
+/*
+ * netClose - end TLS on a connection and close its socket
+ */
+static void netClose(NetBuf_t* nb)
+{
+	#if FTP_CLIENT_TLS
+	if (nb->ssl != NULL) {
+		mbedtls_ssl_close_notify(nb->ssl);
+		mbedtls_ssl_free(nb->ssl);
+		free(nb->ssl);
+		nb->ssl = NULL;
+	}
+	#endif
+	if (nb->dir != FTP_CLIENT_CONTROL)
+		shutdown(nb->handle, 2);
+	closesocket(nb->handle);
+}
+
+
+
+/*
+ * recvAll - recv exactly len bytes
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int recvAll(NetBuf_t* nb, void* buf, int len)
+{
+	unsigned char* p = buf;
+	while (len > 0) {
+		int x = netRecv(nb, p, len);
+		if (x <= 0)
+			return 0;
+		p += x;
+		len -= x;
+	}
+	return 1;
+}
+
+
+
+/*
+ * sendBlockHeader - send a MODE B block header
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int sendBlockHeader(NetBuf_t* nb, int desc, int count)
+{
+	unsigned char h[FTP_CLIENT_BLOCK_HEADER];
+	h[0] = desc;
+	h[1] = (count >> 8) & 0xff;
+	h[2] = count & 0xff;
+	return netSend(nb, h, sizeof(h)) == sizeof(h);
+}
+
+
+
+/*
+ * dataRecv - recv on a data connection, without the MODE B block headers
+ *
+ * Restart markers are skipped, the EOF block ends the file.
+ *
+ * return -1 on error, 0 at the end of the file or bytecount
+ */
+static int dataRecv(NetBuf_t* nb, void* buf, int len)
+{
+	if (!nb->block)
+		return netRecv(nb, buf, len);
+	while (nb->blockLeft == 0) {
+		if (nb->blockEof)
+			return 0;
+		unsigned char h[FTP_CLIENT_BLOCK_HEADER];
+		if (!recvAll(nb, h, sizeof(h)))
+			return -1;
+		nb->blockLeft = (h[1] << 8) | h[2];
+		if (h[0] & FTP_CLIENT_BLOCK_EOF)
+			nb->blockEof = 1;
+		if (h[0] & FTP_CLIENT_BLOCK_MARKER) {
+			unsigned char marker[16];
+			while (nb->blockLeft > 0) {
+				int x = (nb->blockLeft > (int)sizeof(marker)) ? (int)sizeof(marker) : nb->blockLeft;
+				if (!recvAll(nb, marker, x))
+					return -1;
+				nb->blockLeft -= x;
+			}
+		}
+	}
+	if (len > nb->blockLeft)
+		len = nb->blockLeft;
+	int x = netRecv(nb, buf, len);
+	/* the connection must not end inside a block */
+	if (x <= 0)
+		return -1;
+	nb->blockLeft -= x;
+	return x;
+}
+
+
+
+/*
+ * dataSend - send on a data connection, one MODE B block per call
+ *
+ * return -1 on error or bytecount
+ */
+static int dataSend(NetBuf_t* nb, const void* buf, int len)
+{
+	if (!nb->block)
+		return netSend(nb, buf, len);
+	const char* p = buf;
+	int left = len;
+	while (left > 0) {
+		int x = (left > FTP_CLIENT_BLOCK_MAX) ? FTP_CLIENT_BLOCK_MAX : left;
+		if (!sendBlockHeader(nb, 0, x) || (netSend(nb, p, x) != x)) {
+			nb->blockBroken = 1;
+			return -1;
+		}
+		p += x;
+		left -= x;
+	}
+	return len;
+}
+
+
+
+#if FTP_CLIENT_TLS
+/*
+ * tlsBioSend/tlsBioRecv - mbedTLS transport on a blocking socket
+ *
+ * A receive timeout (SO_RCVTIMEO) is reported as an error, not WANT_READ,
+ * so a silent server does not hang the handshake.
+ */
+static int tlsBioSend(void* ctx, const unsigned char* buf, size_t len)
+{
+	int rv = send(*(int*)ctx, buf, len, 0);
+	if (rv < 0)
+		return MBEDTLS_ERR_NET_SEND_FAILED;
+	return rv;
+}
+
+static int tlsBioRecv(void* ctx, unsigned char* buf, size_t len)
+{
+	int rv = recv(*(int*)ctx, buf, len, 0);
+	if (rv < 0)
+		return MBEDTLS_ERR_NET_RECV_FAILED;
+	return rv;
+}
+
+
+
+/*
+ * tlsHandshake - start TLS on a connection of nControl
+ *
+ * The control connection's session is saved after its handshake and offered
+ * by every data connection; servers that demand session reuse on the data
+ * channel accept it and the handshake skips the key exchange.
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int tlsHandshake(NetBuf_t* nb, NetBuf_t* nControl)
+{
+	FtpClientTls_t* tls = nControl->tls;
+	mbedtls_ssl_context* ssl = calloc(1, sizeof(mbedtls_ssl_context));
+	if (ssl == NULL) {
+		strcpy(nControl->response, "FTP Client TLS: out of memory");
+		return 0;
+	}
+	mbedtls_ssl_init(ssl);
+	int rv = mbedtls_ssl_setup(ssl, &tls->conf);
+	if (rv == 0)
+		rv = mbedtls_ssl_set_hostname(ssl, nControl->host);
+	if ((rv == 0) && (nb != nControl) && tls->haveSession)
+		rv = mbedtls_ssl_set_session(ssl, &tls->session);
+	mbedtls_ssl_set_bio(ssl, &nb->handle, tlsBioSend, tlsBioRecv, NULL);
+	int64_t t0 = esp_timer_get_time();
+	while (rv == 0) {
+		rv = mbedtls_ssl_handshake(ssl);
+		if (rv == 0)
+			break;
+		if ((rv == MBEDTLS_ERR_SSL_WANT_READ) || (rv == MBEDTLS_ERR_SSL_WANT_WRITE))
+			rv = 0;
+	}
+	uint32_t us = esp_timer_get_time() - t0;
+	if (rv != 0) {
+		sprintf(nControl->response, "FTP Client TLS: handshake failed -0x%04x", -rv);
+		ESP_LOGE(__FUNCTION__, "%s", nControl->response);
+		mbedtls_ssl_free(ssl);
+		free(ssl);
+		return 0;
+	}
+	if (nb == nControl) {
+		nControl->timings.tlsUs = us;
+		mbedtls_ssl_session_free(&tls->session);
+		mbedtls_ssl_session_init(&tls->session);
+		tls->haveSession = (mbedtls_ssl_get_session(ssl, &tls->session) == 0);
+	}
+	else {
+		nControl->timings.dataTlsUs = us;
+		nControl->timings.dataTlsCount++;
+		if (us > nControl->timings.dataTlsMaxUs)
+			nControl->timings.dataTlsMaxUs = us;
+	}
+	nb->ssl = ssl;
+	return 1;
+}
+
+
+
+/*
+ * tlsFree - release the TLS state of a control connection
+ */
+static void tlsFree(NetBuf_t* nControl)
+{
+	FtpClientTls_t* tls = nControl->tls;
+	if (tls == NULL)
+		return;
+	mbedtls_ssl_session_free(&tls->session);
+	mbedtls_ssl_config_free(&tls->conf);
+	mbedtls_x509_crt_free(&tls->ca);
+	mbedtls_ctr_drbg_free(&tls->drbg);
+	mbedtls_entropy_free(&tls->entropy);
+	free(tls);
+	nControl->tls = NULL;
+}
+#endif
+
+
+
 /*
  * read a line of text
  *
@@ -177,7 +592,7 @@ static int readLine(char* buffer, int max, NetBuf_t* ctl)
 	int eof = 0;
 	while (1) {
 		if (ctl->cavail > 0) {
-			x = (max >= ctl->cavail) ? ctl->cavail : (max-1);
+			x = (max > ctl->cavail) ? ctl->cavail : (max-1);
 			end = memccpy(bp, ctl->cget, '\n',x);
 			if (end != NULL)
 				x = end - bp;
@@ -189,8 +604,8 @@ static int readLine(char* buffer, int max, NetBuf_t* ctl)
 			ctl->cavail -= x;
 			if (end != NULL)
 			{
-				bp -= 2;
-				if (strcmp(bp,"\r\n") == 0) {
+				if ((bp - buffer >= 2) && (strcmp(bp - 2, "\r\n") == 0)) {
+					bp -= 2;
 					*bp++ = '\n';
 					*bp++ = '\0';
 					--retval;
@@ -198,10 +613,9 @@ static int readLine(char* buffer, int max, NetBuf_t* ctl)
 				break;
 			}
 		}
-		if (max == 1) {
-			*buffer = '\0';
+		/* buffer full, the caller gets the line in pieces */
+		if (max == 1)
 			break;
-		}
 		if (ctl->cput == ctl->cget) {
 			ctl->cput = ctl->cget = ctl->buf;
 			ctl->cavail = 0;
@@ -214,7 +628,7 @@ static int readLine(char* buffer, int max, NetBuf_t* ctl)
 		}
 		if (!socketWait(ctl))
 			return retval;
-		if ((x = recv(ctl->handle, ctl->cput,ctl->cleft, 0)) == -1) {
+		if ((x = dataRecv(ctl, ctl->cput, ctl->cleft)) == -1) {
 			#if FTP_CLIENT_DEBUG
 			perror("FTP Client Error: realLine, read");
 			#endif
@@ -232,43 +646,95 @@ static int readLine(char* buffer, int max, NetBuf_t* ctl)
 
 
 
+/*
+ * replyCode - parse the reply code at the start of a line
+ *
+ * A reply line starts with three digits followed by ' ', '-' (more lines
+ * follow) or the end of the line. sep is set to that character.
+ *
+ * return the code, -1 if the line is not a reply
+ */
+static int replyCode(const char* line, char* sep)
+{
+	int code = 0;
+	for (int i = 0; i < 3; i++) {
+		if ((line[i] < '0') || (line[i] > '9'))
+			return -1;
+		code = code * 10 + (line[i] - '0');
+	}
+	if ((line[3] != ' ') && (line[3] != '-') && (line[3] != '\n') && (line[3] != '\0'))
+		return -1;
+	*sep = line[3];
+	return code;
+}
+
+
+
+/*
+ * readReplyLine - read one line of a reply into the response buffer
+ *
+ * The rest of a line longer than the buffer is read and dropped, up to
+ * FTP_CLIENT_REPLY_MAX_DISCARD bytes, so the next read starts on a new line.
+ *
+ * return length, -1 on error, timeout or an endless line
+ */
+static int readReplyLine(NetBuf_t* nControl)
+{
+	int l = readLine(nControl->response, FTP_CLIENT_RESPONSE_BUFFER_SIZE, nControl);
+	if (l <= 0)
+		return -1;
+	if (nControl->response[l - 1] != '\n') {
+		char skip[64];
+		int dropped = 0;
+		int n;
+		do {
+			n = readLine(skip, sizeof(skip), nControl);
+			if ((n <= 0) || ((dropped += n) > FTP_CLIENT_REPLY_MAX_DISCARD))
+				return -1;
+		} while (skip[n - 1] != '\n');
+	}
+	BIN_LOGD(__FUNCTION__, "FTP Client Response: %s", nControl->response);
+	return l;
+}
+
+
+
 /*
  * read a response from the server
  *
+ * A line that is not a reply means the control connection is out of step,
+ * it is left in the response buffer and the call fails. Multi-line replies
+ * are limited to FTP_CLIENT_REPLY_MAX_LINES lines.
+ *
  * return 0 if first char doesn't match
  * return 1 if first char matches
  */
 static int readResponse(char c, NetBuf_t* nControl)
 {
-	char match[5];
-	if (readLine(nControl->response,
-			FTP_CLIENT_RESPONSE_BUFFER_SIZE, nControl) == -1) {
+	char sep;
+	if (readReplyLine(nControl) == -1) {
 		#if FTP_CLIENT_DEBUG
 		perror("FTP Client Error: readResponse, read failed");
 		#endif
+		nControl->response[0] = '\0';
 		return 0;
 	}
-	#if FTP_CLIENT_DEBUG == 2
-	printf("FTP Client Response: %s\n\r", nControl->response);
-	#endif
-	if (nControl->response[3] == '-')
-	{
-		strncpy(match, nControl->response, 3);
-		match[3] = ' ';
-		match[4] = '\0';
-		do {
-			if (readLine(nControl->response,
-					FTP_CLIENT_RESPONSE_BUFFER_SIZE, nControl) == -1) {
-				#if FTP_CLIENT_DEBUG
-				perror("FTP Client Error: readResponse, read failed");
-				#endif
-				return 0;
-			}
-			#if FTP_CLIENT_DEBUG == 2
-			printf("FTP Client Response: %s\n\r", nControl->response);
+	int code = replyCode(nControl->response, &sep);
+	if (code == -1)
+		return 0;
+	int lines = 1;
+	while (sep == '-') {
+		if ((++lines > FTP_CLIENT_REPLY_MAX_LINES) || (readReplyLine(nControl) == -1)) {
+			#if FTP_CLIENT_DEBUG
+			perror("FTP Client Error: readResponse, bad multi-line reply");
 			#endif
+			nControl->response[0] = '\0';
+			return 0;
 		}
-		while (strncmp(nControl->response, match, 4));
+		/* text lines of a multi-line reply may look like anything */
+		char s;
+		if (replyCode(nControl->response, &s) == code)
+			sep = s;
 	}
 	if(nControl->response[0] == c)
 		return 1;
@@ -278,6 +744,34 @@ static int readResponse(char c, NetBuf_t* nControl)
 
 
 
+/*
+ * buildCommand - format a command for sendCommand into buf
+ *
+ * Fails when the command and CRLF do not fit into max bytes or when an
+ * argument contains CR or LF, which would send a second command. The
+ * response is then set to a 501 reply so callers treat it as permanent.
+ *
+ * return 1 if the command was built, 0 otherwise
+ */
+static int buildCommand(char* buf, int max, NetBuf_t* nControl, const char* fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int l = vsnprintf(buf, max, fmt, ap);
+	va_end(ap);
+	if ((l < 0) || (l + 3 > max)) {
+		strcpy(nControl->response, "501 FTP Client: command too long\n");
+		return 0;
+	}
+	if (strpbrk(buf, "\r\n") != NULL) {
+		strcpy(nControl->response, "501 FTP Client: CR/LF in command argument\n");
+		return 0;
+	}
+	return 1;
+}
+
+
+
 /*
  * sendCommand - send a command and wait for expected response
  *
@@ -288,16 +782,21 @@ static int sendCommand(const char* cmd, char expresp, NetBuf_t* nControl)
 	char buf[FTP_CLIENT_TEMP_BUFFER_SIZE];
 	if (nControl->dir != FTP_CLIENT_CONTROL)
 		return 0;
-	#if FTP_CLIENT_DEBUG == 2
-	printf("FTP Client sendCommand: %s\n\r", cmd);
-	#endif
-	if ((strlen(cmd) + 3) > sizeof(buf))
+	/* the password stays out of the log, it is uploaded with the clips */
+	BIN_LOGD(__FUNCTION__, "FTP Client sendCommand: %s",
+			strncmp(cmd, "PASS ", 5) ? cmd : "PASS ***");
+	int l = strlen(cmd);
+	if ((l + 3) > sizeof(buf)) {
+		strcpy(nControl->response, "501 FTP Client: command too long\n");
 		return 0;
-	sprintf(buf, "%s\r\n", cmd);
-	if (send(nControl->handle, buf, strlen(buf), 0) <= 0) {
+	}
+	memcpy(buf, cmd, l);
+	memcpy(buf + l, "\r\n", 3);
+	if (netSend(nControl, buf, l + 2) <= 0) {
 		#if FTP_CLIENT_DEBUG
 		perror("FTP Client sendCommand: write");
 		#endif
+		nControl->response[0] = '\0';
 		return 0;
 	}
 	return readResponse(expresp, nControl);
@@ -327,8 +826,7 @@ static int xfer(const char* localfile, const char* path,
 			ac[1] = 'b';
 		local = fopen(localfile, ac);
 		if (local == NULL) {
-			strncpy(nControl->response, strerror(errno),
-						sizeof(nControl->response));
+			snprintf(nControl->response, sizeof(nControl->response), "%s", strerror(errno));
 			return 0;
 		}
 	}
@@ -350,7 +848,7 @@ static int xfer(const char* localfile, const char* path,
 		while ((l = fread(dbuf, 1, FTP_CLIENT_BUFFER_SIZE, local)) > 0) {
 			int c = writeFtpClient(dbuf, l, nData);
 			if (c < l) {
-				printf("Ftp Client xfer short write: passed %d, wrote %d\n", l, c);
+				BIN_LOGW(__FUNCTION__, "Ftp Client xfer short write: passed %d, wrote %d", l, c);
 				rv = 0;
 				break;
 			}
@@ -380,6 +878,114 @@ static int xfer(const char* localfile, const char* path,
 
 
 
+/*
+ * applyNoDelay - switch Nagle off (on = 1) or on (on = 0)
+ */
+static void applyNoDelay(int handle, int on)
+{
+	if (setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1) {
+		#if FTP_CLIENT_DEBUG
+		perror("FTP Client: setsockopt TCP_NODELAY");
+		#endif
+	}
+}
+
+
+
+/*
+ * applyKeepalive - enable keepalive probes after idle seconds, 0 disables them
+ */
+static void applyKeepalive(int handle, int idle)
+{
+	int on = (idle > 0);
+	setsockopt(handle, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+	if (!on)
+		return;
+	int intvl = (idle >= 30) ? 10 : 5;
+	int cnt = 3;
+	setsockopt(handle, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+	setsockopt(handle, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+	setsockopt(handle, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+}
+
+
+
+/*
+ * applyDataOptions - apply the socket profile of nControl to a new data socket
+ *
+ * Options the stack was built without fail with ENOPROTOOPT and are skipped,
+ * the transfer goes on with the lwIP defaults.
+ */
+static void applyDataOptions(int handle, NetBuf_t* nControl)
+{
+	if (nControl->sndbuf > 0) {
+		if (setsockopt(handle, SOL_SOCKET, SO_SNDBUF, &nControl->sndbuf,
+				sizeof(nControl->sndbuf)) == -1) {
+			#if FTP_CLIENT_DEBUG
+			perror("FTP Client: setsockopt SO_SNDBUF");
+			#endif
+		}
+	}
+	if (nControl->rcvbuf > 0) {
+		if (setsockopt(handle, SOL_SOCKET, SO_RCVBUF, &nControl->rcvbuf,
+				sizeof(nControl->rcvbuf)) == -1) {
+			#if FTP_CLIENT_DEBUG
+			perror("FTP Client: setsockopt SO_RCVBUF");
+			#endif
+		}
+	}
+	if (nControl->nodelayData)
+		applyNoDelay(handle, 1);
+	if (nControl->linger >= 0) {
+		struct linger lg;
+		lg.l_onoff = 1;
+		lg.l_linger = nControl->linger;
+		if (setsockopt(handle, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg)) == -1) {
+			#if FTP_CLIENT_DEBUG
+			perror("FTP Client: setsockopt SO_LINGER");
+			#endif
+		}
+	}
+}
+
+
+
+/*
+ * parsePasv - parse h1,h2,h3,h4,p1,p2 of a 227 reply into addr
+ *
+ * The numbers are taken from the first digit after the reply code, with or
+ * without the parentheses, each has to be 0..255.
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int parsePasv(const char* response, unsigned char* addr)
+{
+	char sep;
+	if (replyCode(response, &sep) != 227)
+		return 0;
+	/* response[3] may be the terminator of a bare "227" */
+	const char* p = response + 3;
+	while ((*p != '\0') && ((*p < '0') || (*p > '9')))
+		p++;
+	for (int i = 0; i < 6; i++) {
+		if (i > 0 && *p++ != ',')
+			return 0;
+		int v = 0;
+		int digits = 0;
+		while ((*p >= '0') && (*p <= '9')) {
+			v = v * 10 + (*p++ - '0');
+			if (++digits > 3)
+				return 0;
+		}
+		if ((digits == 0) || (v > 255))
+			return 0;
+		addr[i] = v;
+	}
+	return 1;
+}
+
+
+
 /*
  * openPort - set up data connection
  *
@@ -410,18 +1016,15 @@ static int openPort(NetBuf_t* nControl, NetBuf_t** nData, int mode, int dir)
 		sin.in.sin_family = AF_INET;
 		if (!sendCommand("PASV", '2', nControl))
 			return -1;
-		char* cp = strchr(nControl->response,'(');
-		if (cp == NULL)
+		unsigned char v[6];
+		if (!parsePasv(nControl->response, v))
 			return -1;
-		cp++;
-		unsigned int v[6];
-		sscanf(cp,"%u,%u,%u,%u,%u,%u",&v[2],&v[3],&v[4],&v[5],&v[0],&v[1]);
-		sin.sa.sa_data[2] = v[2];
-		sin.sa.sa_data[3] = v[3];
-		sin.sa.sa_data[4] = v[4];
-		sin.sa.sa_data[5] = v[5];
-		sin.sa.sa_data[0] = v[0];
-		sin.sa.sa_data[1] = v[1];
+		sin.sa.sa_data[2] = v[0];
+		sin.sa.sa_data[3] = v[1];
+		sin.sa.sa_data[4] = v[2];
+		sin.sa.sa_data[5] = v[3];
+		sin.sa.sa_data[0] = v[4];
+		sin.sa.sa_data[1] = v[5];
 	}
 	else {
 		if(getsockname(nControl->handle, &sin.sa, &l) < 0) {
@@ -438,6 +1041,8 @@ static int openPort(NetBuf_t* nControl, NetBuf_t** nData, int mode, int dir)
 		#endif
 		return -1;
 	}
+	/* before connect/listen so the window is announced in the SYN */
+	applyDataOptions(sData, nControl);
 	if (nControl->cmode == FTP_CLIENT_PASSIVE) {
 		if (connect(sData, &sin.sa, sizeof(sin.sa)) == -1) {
 			#if FTP_CLIENT_DEBUG
@@ -466,7 +1071,7 @@ static int openPort(NetBuf_t* nControl, NetBuf_t** nData, int mode, int dir)
 		if (getsockname(sData, &sin.sa, &l) < 0)
 			return -1;
 		char buf[FTP_CLIENT_TEMP_BUFFER_SIZE];
-		sprintf(buf, "PORT %d,%d,%d,%d,%d,%d",
+		snprintf(buf, sizeof(buf), "PORT %d,%d,%d,%d,%d,%d",
 			(unsigned char) sin.sa.sa_data[2],
 			(unsigned char) sin.sa.sa_data[3],
 			(unsigned char) sin.sa.sa_data[4],
@@ -486,27 +1091,116 @@ static int openPort(NetBuf_t* nControl, NetBuf_t** nData, int mode, int dir)
 		closesocket(sData);
 		return -1;
 	}
-	if ((mode == 'A') && ((ctrl->buf = malloc(FTP_CLIENT_BUFFER_SIZE)) == NULL)) {
-		#if FTP_CLIENT_DEBUG
-		perror("FTP Client openPort: calloc ctrl->buf");
-		#endif
-		closesocket(sData);
-		free(ctrl);
+	if ((mode == 'A') && ((ctrl->buf = malloc(FTP_CLIENT_BUFFER_SIZE)) == NULL)) {
+		#if FTP_CLIENT_DEBUG
+		perror("FTP Client openPort: calloc ctrl->buf");
+		#endif
+		closesocket(sData);
+		free(ctrl);
+		return -1;
+	}
+	ctrl->handle = sData;
+	ctrl->block = (nControl->blockMode == FTP_CLIENT_BLOCK_ON);
+	initData(ctrl, nControl, dir);
+	nControl->timings.dataConnects++;
+	*nData = ctrl;
+	return 1;
+}
+
+
+
+/*
+ * initData - start a transfer on a new or kept data connection
+ */
+static void initData(NetBuf_t* nData, NetBuf_t* nControl, int dir)
+{
+	nData->dir = dir;
+	nData->idletime = nControl->idletime;
+	nData->idlearg = nControl->idlearg;
+	nData->xfered = 0;
+	nData->xfered1 = 0;
+	nData->cbbytes = nControl->cbbytes;
+	nData->ctrl = nControl;
+	nData->blockLeft = 0;
+	nData->blockEof = 0;
+	nData->blockBroken = 0;
+	nControl->tokens = 0;
+	nControl->tstamp = esp_timer_get_time();
+	if (nData->idletime.tv_sec || nData->idletime.tv_usec || nData->cbbytes)
+		nData->idlecb = nControl->idlecb;
+	else
+		nData->idlecb = NULL;
+	nControl->data = nData;
+}
+
+
+
+/*
+ * dropData - close a data connection and free it
+ */
+static void dropData(NetBuf_t* nData)
+{
+	if (nData->buf)
+		free(nData->buf);
+	netClose(nData);
+	free(nData);
+}
+
+
+
+/*
+ * idleDataAlive - check a kept MODE B data connection before it is reused
+ *
+ * Nothing is sent on an idle connection, so anything to read means the
+ * server closed or reset it.
+ *
+ * return 1 if it can be used, 0 otherwise
+ */
+static int idleDataAlive(NetBuf_t* nData)
+{
+	fd_set fd;
+	FD_ZERO(&fd);
+	FD_SET(nData->handle, &fd);
+	struct timeval tv = { 0, 0 };
+	return select(nData->handle + 1, &fd, NULL, NULL, &tv) == 0;
+}
+
+
+
+/*
+ * reuseData - issue a transfer command on the kept MODE B data connection
+ *
+ * The server answers 125 on an open data connection. A 425 means it has
+ * given the connection up, the caller then opens a new one.
+ *
+ * return 1 if successful, 0 on error, -1 to open a new data connection
+ */
+static int reuseData(const char* cmd, int mode, int dir, NetBuf_t* nControl, NetBuf_t** nData)
+{
+	NetBuf_t* ctrl = nControl->idleData;
+	nControl->idleData = NULL;
+	if (!idleDataAlive(ctrl)) {
+		dropData(ctrl);
+		return -1;
+	}
+	if ((mode == FTP_CLIENT_ASCII) && (ctrl->buf == NULL)
+			&& ((ctrl->buf = malloc(FTP_CLIENT_BUFFER_SIZE)) == NULL)) {
+		dropData(ctrl);
 		return -1;
 	}
-	ctrl->handle = sData;
-	ctrl->dir = dir;
-	ctrl->idletime = nControl->idletime;
-	ctrl->idlearg = nControl->idlearg;
-	ctrl->xfered = 0;
-	ctrl->xfered1 = 0;
-	ctrl->cbbytes = nControl->cbbytes;
-	ctrl->ctrl = nControl;
-	if (ctrl->idletime.tv_sec || ctrl->idletime.tv_usec || ctrl->cbbytes)
-		ctrl->idlecb = nControl->idlecb;
-	else
-		ctrl->idlecb = NULL;
-	nControl->data = ctrl;
+	if ((mode != FTP_CLIENT_ASCII) && (ctrl->buf != NULL)) {
+		free(ctrl->buf);
+		ctrl->buf = NULL;
+	}
+	ctrl->cput = ctrl->cget = ctrl->buf;
+	ctrl->cavail = 0;
+	initData(ctrl, nControl, dir);
+	if (!sendCommand(cmd, '1', nControl)) {
+		nControl->data = NULL;
+		dropData(ctrl);
+		return (strncmp(nControl->response, "425", 3) == 0) ? -1 : 0;
+	}
+	nControl->timings.dataReused++;
 	*nData = ctrl;
 	return 1;
 }
@@ -534,12 +1228,10 @@ static int writeLine(const char* buf, int len, NetBuf_t* nData)
 			if (nb == FTP_CLIENT_BUFFER_SIZE) {
 				if (!socketWait(nData))
 					return x;
-				w = send(nData->handle, nbp, FTP_CLIENT_BUFFER_SIZE, 0);
+				w = dataSend(nData, nbp, FTP_CLIENT_BUFFER_SIZE);
 				if (w != FTP_CLIENT_BUFFER_SIZE) {
-					#if FTP_CLIENT_DEBUG
-					printf("Ftp client write line: net_write(1) returned %d, errno = %d\n",
+					BIN_LOGW(__FUNCTION__, "Ftp client write line: net_write(1) returned %d, errno = %d",
 							w, errno);
-					#endif
 					return(-1);
 				}
 				nb = 0;
@@ -549,12 +1241,10 @@ static int writeLine(const char* buf, int len, NetBuf_t* nData)
 		if (nb == FTP_CLIENT_BUFFER_SIZE) {
 			if (!socketWait(nData))
 				return x;
-			w = send(nData->handle, nbp, FTP_CLIENT_BUFFER_SIZE, 0);
+			w = dataSend(nData, nbp, FTP_CLIENT_BUFFER_SIZE);
 			if (w != FTP_CLIENT_BUFFER_SIZE) {
-				#if FTP_CLIENT_DEBUG
-				printf("Ftp client write line: net_write(2) returned %d, errno = %d\n",
+				BIN_LOGW(__FUNCTION__, "Ftp client write line: net_write(2) returned %d, errno = %d",
 						w, errno);
-				#endif
 				return(-1);
 			}
 			nb = 0;
@@ -564,12 +1254,10 @@ static int writeLine(const char* buf, int len, NetBuf_t* nData)
 	if (nb){
 		if (!socketWait(nData))
 			return x;
-		w = send(nData->handle, nbp, nb, 0);
+		w = dataSend(nData, nbp, nb);
 		if (w != nb) {
-			#if FTP_CLIENT_DEBUG
-			printf("Ftp client write line: net_write(3) returned %d, errno = %d\n",
+			BIN_LOGW(__FUNCTION__, "Ftp client write line: net_write(3) returned %d, errno = %d",
 					w, errno);
-			#endif
 			return(-1);
 		}
 	}
@@ -598,8 +1286,7 @@ static int acceptConnection(NetBuf_t* nData, NetBuf_t* nControl)
 		i = nData->handle;
 	i = select(i+1, &mask, NULL, NULL, &tv);
 	if (i == -1) {
-		strncpy(nControl->response, strerror(errno),
-				sizeof(nControl->response));
+		snprintf(nControl->response, sizeof(nControl->response), "%s", strerror(errno));
 		closesocket(nData->handle);
 		nData->handle = 0;
 		rv = 0;
@@ -622,10 +1309,10 @@ static int acceptConnection(NetBuf_t* nData, NetBuf_t* nControl)
 			if (sData > 0) {
 				rv = 1;
 				nData->handle = sData;
+				applyDataOptions(sData, nControl);
 			}
 			else {
-				strncpy(nControl->response, strerror(i),
-								sizeof(nControl->response));
+				snprintf(nControl->response, sizeof(nControl->response), "%s", strerror(i));
 				nData->handle = 0;
 				rv = 0;
 			}
@@ -650,9 +1337,8 @@ static int acceptConnection(NetBuf_t* nData, NetBuf_t* nControl)
 static int siteFtpClient(const char* cmd, NetBuf_t* nControl)
 {
 	char buf[FTP_CLIENT_TEMP_BUFFER_SIZE];
-	if ((strlen(cmd) + 7) > sizeof(buf))
+	if (!buildCommand(buf, sizeof(buf), nControl, "SITE %s", cmd))
 		return 0;
-	sprintf(buf, "SITE %s", cmd);
 	if (!sendCommand(buf, '2', nControl))
 		return 0;
 	else
@@ -687,10 +1373,10 @@ static int getSysTypeFtpClient(char* buf, int max, NetBuf_t* nControl)
 {
 	if (!sendCommand("SYST", '2', nControl))
 		return 0;
-	char* s = &nControl->response[4];
+	char* s = &nControl->response[strnlen(nControl->response, 4)];
 	int l = max;
 	char* b = buf;
-	while ((--l) && (*s != ' '))
+	while ((--l) && (*s) && (*s != ' ') && (*s != '\n'))
 		*b++ = *s++;
 	*b++ = '\0';
 	return 1;
@@ -707,14 +1393,14 @@ static int getFileSizeFtpClient(const char* path,
 		unsigned int* size, char mode, NetBuf_t* nControl)
 {
 	char cmd[FTP_CLIENT_TEMP_BUFFER_SIZE];
-	if ((strlen(path) + 7) > sizeof(cmd))
+	if (!buildCommand(cmd, sizeof(cmd), nControl, "TYPE %c", mode))
 		return 0;
-	sprintf(cmd, "TYPE %c", mode);
 	if (!sendCommand(cmd, '2', nControl))
 		return 0;
 	int rv = 1;
-	sprintf(cmd,"SIZE %s", path);
-	if(!sendCommand(cmd, '2', nControl))
+	if (!buildCommand(cmd, sizeof(cmd), nControl, "SIZE %s", path))
+		rv = 0;
+	else if(!sendCommand(cmd, '2', nControl))
 		rv = 0;
 	else {
 		int resp;
@@ -738,14 +1424,15 @@ static int getModDateFtpClient(const char* path, char* dt,
 		int max, NetBuf_t* nControl)
 {
 	char buf[FTP_CLIENT_TEMP_BUFFER_SIZE];
-	if ((strlen(path) + 7) > sizeof(buf))
+	if (!buildCommand(buf, sizeof(buf), nControl, "MDTM %s", path))
 		return 0;
-	sprintf(buf, "MDTM %s", path);
 	int rv = 1;
 	if (!sendCommand(buf, '2', nControl))
 		rv = 0;
-	else
-		strncpy(dt, &nControl->response[4], max);
+	else if (max > 0) {
+		snprintf(dt, max, "%s", &nControl->response[strnlen(nControl->response, 4)]);
+		dt[strcspn(dt, "\n")] = '\0';
+	}
 	return rv;
 }
 
@@ -776,49 +1463,246 @@ static int clearCallbackFtpClient(NetBuf_t* nControl)
 
 
 /*
- * connect - connect to remote server
+ * resolveHost - fill in sin_addr from a dotted address, the RTC cache or DNS
  *
- * return 1 if connected, 0 if not
+ * return 1 if resolved, 0 otherwise
  */
-static int connectFtpClient(const char* host, uint16_t port, NetBuf_t** nControl)
+static int resolveHost(const char* host, struct sockaddr_in* sin, int* cached)
 {
-	ESP_LOGD(__FUNCTION__, "host=%s", host);
-	struct sockaddr_in sin;
-	memset(&sin,0, sizeof(sin));
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(port);
-	sin.sin_addr.s_addr = inet_addr(host);
-	ESP_LOGD(__FUNCTION__, "sin.sin_addr.s_addr=%"PRIx32, sin.sin_addr.s_addr);
-	if (sin.sin_addr.s_addr == 0xffffffff) {
-		struct hostent *hp;
-		hp = gethostbyname(host);
-		if (hp == NULL) {
-			#if FTP_CLIENT_DEBUG
-			perror("FTP Client Error: Connect, gethostbyname");
-			#endif
-			return 0;
+	*cached = 0;
+	sin->sin_addr.s_addr = inet_addr(host);
+	if (sin->sin_addr.s_addr != 0xffffffff)
+		return 1;
+	time_t now = time(NULL);
+	int slot = 0;
+	for (int i = 0; i < FTP_CLIENT_DNS_CACHE_SIZE; i++) {
+		if (strncmp(dnsCache[i].host, host, sizeof(dnsCache[i].host)) == 0) {
+			if (now < dnsCache[i].expires) {
+				sin->sin_addr.s_addr = dnsCache[i].addr;
+				*cached = 1;
+				return 1;
+			}
+			slot = i;
+			break;
 		}
-		struct ip4_addr *ip4_addr;
-		ip4_addr = (struct ip4_addr *)hp->h_addr;
-		sin.sin_addr.s_addr = ip4_addr->addr;
-		ESP_LOGD(__FUNCTION__, "sin.sin_addr.s_addr=%"PRIx32, sin.sin_addr.s_addr);
+		if (dnsCache[i].expires < dnsCache[slot].expires)
+			slot = i;
+	}
+	struct hostent *hp;
+	hp = gethostbyname(host);
+	if (hp == NULL) {
+		#if FTP_CLIENT_DEBUG
+		perror("FTP Client Error: Connect, gethostbyname");
+		#endif
+		return 0;
+	}
+	struct ip4_addr *ip4_addr;
+	ip4_addr = (struct ip4_addr *)hp->h_addr;
+	sin->sin_addr.s_addr = ip4_addr->addr;
+	ESP_LOGD(__FUNCTION__, "sin.sin_addr.s_addr=%"PRIx32, sin->sin_addr.s_addr);
+	if (strlen(host) < sizeof(dnsCache[slot].host)) {
+		strcpy(dnsCache[slot].host, host);
+		dnsCache[slot].addr = sin->sin_addr.s_addr;
+		dnsCache[slot].expires = now + FTP_CLIENT_DNS_TTL;
+	}
+	return 1;
+}
+
+
+
+/*
+ * evictHost - forget a cached address that did not answer
+ */
+static void evictHost(const char* host)
+{
+	for (int i = 0; i < FTP_CLIENT_DNS_CACHE_SIZE; i++) {
+		if (strncmp(dnsCache[i].host, host, sizeof(dnsCache[i].host)) == 0)
+			memset(&dnsCache[i], 0, sizeof(dnsCache[i]));
 	}
+}
+
 
+
+/*
+ * startConnect - begin a non-blocking connect
+ *
+ * return socket or -1
+ */
+static int startConnect(const struct sockaddr_in* sin)
+{
 	int sControl = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
 	ESP_LOGD(__FUNCTION__, "sControl=%d", sControl);
 	if (sControl == -1) {
 		#if FTP_CLIENT_DEBUG
 		perror("FTP Client Error: Connect, socket");
 		#endif
-		return 0;
+		return -1;
 	}
-	if(connect(sControl, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
+	fcntl(sControl, F_SETFL, fcntl(sControl, F_GETFL, 0) | O_NONBLOCK);
+	if ((connect(sControl, (const struct sockaddr *)sin, sizeof(*sin)) == -1)
+			&& (errno != EINPROGRESS)) {
 		#if FTP_CLIENT_DEBUG
 		perror("FTP Client Error: Connect, connect");
 		#endif
 		closesocket(sControl);
-		return 0;
+		return -1;
+	}
+	return sControl;
+}
+
+
+
+/*
+ * openControl - connect to the first of up to two servers that answers
+ *
+ * The second server is started once the first one failed or has not
+ * connected within FTP_CLIENT_FALLBACK_DELAY_MS, whichever socket connects
+ * first wins. Everything is bounded by FTP_CLIENT_CONNECT_TIMEOUT_MS.
+ *
+ * return connected blocking socket or -1
+ */
+static int openControl(const struct sockaddr_in* sin, int count, int* which)
+{
+	int fds[2] = {-1, -1};
+	int started = 0;
+	int failed = 0;
+	int sControl = -1;
+	int64_t start = esp_timer_get_time();
+	int64_t fallback = start + FTP_CLIENT_FALLBACK_DELAY_MS * 1000LL;
+	int64_t deadline = start + FTP_CLIENT_CONNECT_TIMEOUT_MS * 1000LL;
+
+	while (sControl == -1) {
+		int64_t now = esp_timer_get_time();
+		if (now >= deadline)
+			break;
+		if ((started < count) && ((failed == started) || (now >= fallback))) {
+			fds[started] = startConnect(&sin[started]);
+			if (fds[started] == -1)
+				failed++;
+			started++;
+			continue;
+		}
+		if (failed == count)
+			break;
+		fd_set wfd;
+		FD_ZERO(&wfd);
+		int maxfd = -1;
+		for (int i = 0; i < started; i++) {
+			if (fds[i] != -1) {
+				FD_SET(fds[i], &wfd);
+				if (fds[i] > maxfd)
+					maxfd = fds[i];
+			}
+		}
+		int64_t waitUs = deadline - now;
+		if ((started < count) && (fallback - now < waitUs))
+			waitUs = fallback - now;
+		struct timeval tv;
+		tv.tv_sec = waitUs / 1000000;
+		tv.tv_usec = waitUs % 1000000;
+		if (select(maxfd + 1, NULL, &wfd, NULL, &tv) == -1)
+			break;
+		for (int i = 0; i < started; i++) {
+			if ((fds[i] == -1) || !FD_ISSET(fds[i], &wfd))
+				continue;
+			int err = 0;
+			socklen_t l = sizeof(err);
+			getsockopt(fds[i], SOL_SOCKET, SO_ERROR, &err, &l);
+			if (err == 0) {
+				sControl = fds[i];
+				*which = i;
+				fds[i] = -1;
+				break;
+			}
+			closesocket(fds[i]);
+			fds[i] = -1;
+			failed++;
+		}
+	}
+	for (int i = 0; i < started; i++) {
+		if (fds[i] != -1)
+			closesocket(fds[i]);
+	}
+	if (sControl != -1)
+		fcntl(sControl, F_SETFL, fcntl(sControl, F_GETFL, 0) & ~O_NONBLOCK);
+	return sControl;
+}
+
+
+
+/*
+ * connect - connect to remote server
+ *
+ * return 1 if connected, 0 if not
+ */
+static int connectFtpClient(const char* host, uint16_t port, NetBuf_t** nControl)
+{
+	return connectFallbackFtpClient(host, port, NULL, 0, nControl);
+}
+
+
+
+/*
+ * connectFallback - connect to remote server, or to host2 if it does not answer
+ *
+ * return 1 if connected, 0 if not
+ */
+static int connectFallbackFtpClient(const char* host, uint16_t port,
+	const char* host2, uint16_t port2, NetBuf_t** nControl)
+{
+	ESP_LOGD(__FUNCTION__, "host=%s host2=%s", host, host2 ? host2 : "");
+	const char* hosts[2] = {host, host2};
+	uint16_t ports[2] = {port, port2};
+	struct sockaddr_in sin[2];
+	int index[2];
+	int cached[2] = {0, 0};
+	FtpClientTimings_t timings;
+	memset(&timings, 0, sizeof(timings));
+	int sControl = -1;
+
+	for (int attempt = 0; (attempt < 2) && (sControl == -1); attempt++) {
+		int count = 0;
+		int anyCached = 0;
+		int64_t t0 = esp_timer_get_time();
+		for (int i = 0; i < 2; i++) {
+			if (hosts[i] == NULL)
+				continue;
+			memset(&sin[count], 0, sizeof(sin[count]));
+			sin[count].sin_family = AF_INET;
+			sin[count].sin_port = htons(ports[i]);
+			if (!resolveHost(hosts[i], &sin[count], &cached[i]))
+				continue;
+			anyCached |= cached[i];
+			index[count++] = i;
+		}
+		int64_t t1 = esp_timer_get_time();
+		timings.dnsUs += t1 - t0;
+		timings.dnsCached = anyCached;
+		if (count == 0)
+			return 0;
+		int which = 0;
+		sControl = openControl(sin, count, &which);
+		timings.connectUs += esp_timer_get_time() - t1;
+		if (sControl != -1) {
+			timings.server = index[which];
+			break;
+		}
+		if (!anyCached)
+			break;
+		/* a cached address may be stale, resolve again once */
+		for (int i = 0; i < 2; i++) {
+			if (cached[i])
+				evictHost(hosts[i]);
+		}
 	}
+	if (sControl == -1)
+		return 0;
+
+	struct timeval rto;
+	rto.tv_sec = FTP_CLIENT_REPLY_TIMEOUT;
+	rto.tv_usec = 0;
+	setsockopt(sControl, SOL_SOCKET, SO_RCVTIMEO, &rto, sizeof(rto));
+
 	NetBuf_t* ctrl = calloc(1, sizeof(NetBuf_t));
 	if (ctrl == NULL) {
 		#if FTP_CLIENT_DEBUG
@@ -838,6 +1722,7 @@ static int connectFtpClient(const char* host, uint16_t port, NetBuf_t** nControl
 	}
 	ctrl->handle = sControl;
 	ctrl->dir = FTP_CLIENT_CONTROL;
+	strncpy(ctrl->host, hosts[timings.server], sizeof(ctrl->host) - 1);
 	ctrl->ctrl = NULL;
 	ctrl->data = NULL;
 	ctrl->cmode = FTP_CLIENT_DEFAULT_MODE;
@@ -847,16 +1732,125 @@ static int connectFtpClient(const char* host, uint16_t port, NetBuf_t** nControl
 	ctrl->xfered = 0;
 	ctrl->xfered1 = 0;
 	ctrl->cbbytes = 0;
+	ctrl->rate = 0;
+	ctrl->burst = 0;
+	ctrl->sndbuf = FTP_CLIENT_DEFAULT_SNDBUF;
+	ctrl->rcvbuf = FTP_CLIENT_DEFAULT_RCVBUF;
+	ctrl->nodelayData = FTP_CLIENT_DEFAULT_NODELAY_DATA;
+	ctrl->linger = FTP_CLIENT_DEFAULT_LINGER;
+	ctrl->blockMode = FTP_CLIENT_DEFAULT_BLOCKMODE ? FTP_CLIENT_BLOCK_WANTED : FTP_CLIENT_BLOCK_OFF;
+	ctrl->idleData = NULL;
+	applyNoDelay(sControl, FTP_CLIENT_DEFAULT_NODELAY_CONTROL);
+	applyKeepalive(sControl, FTP_CLIENT_DEFAULT_KEEPALIVE);
+	int64_t t2 = esp_timer_get_time();
 	if (readResponse('2', ctrl) == 0) {
 		closesocket(sControl);
 		free(ctrl->buf);
 		free(ctrl);
 		return 0;
 	}
+	timings.bannerUs = esp_timer_get_time() - t2;
+	ctrl->timings = timings;
 	*nControl = ctrl;
 	return 1;
 }
 
+
+
+/*
+ * getTimingsFtpClient - stage timings of the last connect and login
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int getTimingsFtpClient(FtpClientTimings_t* timings, NetBuf_t* nControl)
+{
+	if ((nControl == NULL) || (nControl->dir != FTP_CLIENT_CONTROL))
+		return 0;
+	memcpy(timings, &nControl->timings, sizeof(*timings));
+	return 1;
+}
+
+/*
+ * authTlsFtpClient - switch the control connection to TLS (explicit FTPS)
+ *
+ * Only AES cipher suites are offered so the bulk encryption runs on the
+ * ESP32 AES accelerator; SHA and the RSA/ECDHE math use the SHA and MPI
+ * accelerators through CONFIG_MBEDTLS_HARDWARE_*.
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int authTlsFtpClient(const char* caPem, NetBuf_t* nControl)
+{
+	#if FTP_CLIENT_TLS
+	static const int ciphersuites[] = {
+		MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+		MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+		MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+		MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA256,
+		MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA,
+		MBEDTLS_TLS_RSA_WITH_AES_128_GCM_SHA256,
+		MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA256,
+		MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA,
+		0
+	};
+	if ((nControl->dir != FTP_CLIENT_CONTROL) || (nControl->tls != NULL))
+		return 0;
+	if (!sendCommand("AUTH TLS", '2', nControl))
+		return 0;
+	FtpClientTls_t* tls = calloc(1, sizeof(FtpClientTls_t));
+	if (tls == NULL) {
+		strcpy(nControl->response, "FTP Client TLS: out of memory");
+		return 0;
+	}
+	mbedtls_entropy_init(&tls->entropy);
+	mbedtls_ctr_drbg_init(&tls->drbg);
+	mbedtls_ssl_config_init(&tls->conf);
+	mbedtls_x509_crt_init(&tls->ca);
+	mbedtls_ssl_session_init(&tls->session);
+	nControl->tls = tls;
+
+	int rv = mbedtls_ctr_drbg_seed(&tls->drbg, mbedtls_entropy_func,
+			&tls->entropy, NULL, 0);
+	if (rv == 0)
+		rv = mbedtls_ssl_config_defaults(&tls->conf, MBEDTLS_SSL_IS_CLIENT,
+				MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+	if ((rv == 0) && (caPem != NULL))
+		rv = mbedtls_x509_crt_parse(&tls->ca, (const unsigned char*)caPem,
+				strlen(caPem) + 1);
+	if (rv != 0) {
+		sprintf(nControl->response, "FTP Client TLS: setup failed -0x%04x", -rv);
+		tlsFree(nControl);
+		return 0;
+	}
+	mbedtls_ssl_conf_rng(&tls->conf, mbedtls_ctr_drbg_random, &tls->drbg);
+	mbedtls_ssl_conf_ciphersuites(&tls->conf, ciphersuites);
+	mbedtls_ssl_conf_min_version(&tls->conf, MBEDTLS_SSL_MAJOR_VERSION_3,
+			MBEDTLS_SSL_MINOR_VERSION_3);
+	if (caPem != NULL) {
+		mbedtls_ssl_conf_ca_chain(&tls->conf, &tls->ca, NULL);
+		mbedtls_ssl_conf_authmode(&tls->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+	}
+	else {
+		ESP_LOGW(__FUNCTION__, "no CA, server certificate is not verified");
+		mbedtls_ssl_conf_authmode(&tls->conf, MBEDTLS_SSL_VERIFY_NONE);
+	}
+	if (!tlsHandshake(nControl, nControl)) {
+		tlsFree(nControl);
+		return 0;
+	}
+	if (!sendCommand("PBSZ 0", '2', nControl) ||
+			!sendCommand("PROT P", '2', nControl))
+		return 0;
+	nControl->prot = 1;
+	return 1;
+	#else
+	strcpy(nControl->response, "FTP Client: built without FTP_CLIENT_TLS");
+	return 0;
+	#endif
+}
+
+
+
 /*
  * login - log in to remote server
  *
@@ -864,18 +1858,22 @@ static int connectFtpClient(const char* host, uint16_t port, NetBuf_t** nControl
  */
 static int loginFtpClient(const char* user, const char* pass, NetBuf_t* nControl)
 {
-	char tempbuf[64];
-	if (((strlen(user) + 7) > sizeof(tempbuf)) ||
-			((strlen(pass) + 7) > sizeof(tempbuf)))
+	char tempbuf[FTP_CLIENT_TEMP_BUFFER_SIZE];
+	if (!buildCommand(tempbuf, sizeof(tempbuf), nControl, "USER %s", user))
 		return 0;
-	sprintf(tempbuf,"USER %s",user);
+	int64_t t0 = esp_timer_get_time();
 	if (!sendCommand(tempbuf, '3', nControl)) {
+		nControl->timings.loginUs = esp_timer_get_time() - t0;
 		if (nControl->response[0] == '2')
 			return 1;
 		return 0;
 	}
-	sprintf(tempbuf, "PASS %s", pass);
-	return sendCommand(tempbuf, '2', nControl);
+	if (!buildCommand(tempbuf, sizeof(tempbuf), nControl, "PASS %s", pass))
+		return 0;
+	int rv = sendCommand(tempbuf, '2', nControl);
+	memset(tempbuf, 0, sizeof(tempbuf));
+	nControl->timings.loginUs = esp_timer_get_time() - t0;
+	return rv;
 }
 
 
@@ -889,7 +1887,38 @@ static void quitFtpClient(NetBuf_t* nControl)
 {
 	if (nControl->dir != FTP_CLIENT_CONTROL)
 		return;
+	if (nControl->idleData)
+		dropData(nControl->idleData);
 	sendCommand("QUIT", '2', nControl);
+	netClose(nControl);
+	#if FTP_CLIENT_TLS
+	tlsFree(nControl);
+	#endif
+	free(nControl->buf);
+	free(nControl);
+}
+
+
+
+/*
+ * disconnectFtpClient - drop a control connection without QUIT
+ *
+ * For a connection that is known to be dead, quitFtpClient would wait
+ * FTP_CLIENT_REPLY_TIMEOUT for the reply.
+ */
+static void disconnectFtpClient(NetBuf_t* nControl)
+{
+	if (nControl->dir != FTP_CLIENT_CONTROL)
+		return;
+	if (nControl->idleData)
+		dropData(nControl->idleData);
+	#if FTP_CLIENT_TLS
+	if (nControl->ssl != NULL) {
+		mbedtls_ssl_free(nControl->ssl);
+		free(nControl->ssl);
+	}
+	tlsFree(nControl);
+	#endif
 	closesocket(nControl->handle);
 	free(nControl->buf);
 	free(nControl);
@@ -947,6 +1976,101 @@ static int setOptionsFtpClient(int opt, long val, NetBuf_t* nControl)
 			nControl->cbbytes = (int) val;
 		}
 		break;
+
+		case FTP_CLIENT_RATELIMIT:
+		{
+			if (val >= 0) {
+				if ((nControl->dir != FTP_CLIENT_CONTROL) && nControl->ctrl)
+					nControl = nControl->ctrl;
+				/* Credit the time since the last chunk at the old rate, the
+				 * debt slept off at it would be charged again at the new one */
+				int64_t now = esp_timer_get_time();
+				nControl->tokens += (now - nControl->tstamp) * (int64_t)nControl->rate / 1000000;
+				nControl->tstamp = now;
+				nControl->rate = val;
+				rv = 1;
+			}
+		}
+		break;
+
+		case FTP_CLIENT_RATEBURST:
+		{
+			if (val >= 0) {
+				if ((nControl->dir != FTP_CLIENT_CONTROL) && nControl->ctrl)
+					nControl = nControl->ctrl;
+				nControl->burst = val;
+				rv = 1;
+			}
+		}
+		break;
+
+		case FTP_CLIENT_SNDBUF:
+		case FTP_CLIENT_RCVBUF:
+		{
+			if (val >= 0) {
+				if ((nControl->dir != FTP_CLIENT_CONTROL) && nControl->ctrl)
+					nControl = nControl->ctrl;
+				if (opt == FTP_CLIENT_SNDBUF)
+					nControl->sndbuf = (int) val;
+				else
+					nControl->rcvbuf = (int) val;
+				rv = 1;
+			}
+		}
+		break;
+
+		case FTP_CLIENT_NODELAY_DATA:
+		{
+			if ((nControl->dir != FTP_CLIENT_CONTROL) && nControl->ctrl)
+				nControl = nControl->ctrl;
+			nControl->nodelayData = (val != 0);
+			if (nControl->data)
+				applyNoDelay(nControl->data->handle, nControl->nodelayData);
+			rv = 1;
+		}
+		break;
+
+		case FTP_CLIENT_LINGER:
+		{
+			if ((nControl->dir != FTP_CLIENT_CONTROL) && nControl->ctrl)
+				nControl = nControl->ctrl;
+			nControl->linger = (val < 0) ? -1 : (int) val;
+			rv = 1;
+		}
+		break;
+
+		case FTP_CLIENT_BLOCKMODE:
+		{
+			if ((nControl->dir != FTP_CLIENT_CONTROL) && nControl->ctrl)
+				nControl = nControl->ctrl;
+			rv = 1;
+			if (val && (nControl->blockMode == FTP_CLIENT_BLOCK_OFF))
+				nControl->blockMode = FTP_CLIENT_BLOCK_WANTED;
+			else if (!val && (nControl->blockMode == FTP_CLIENT_BLOCK_ON)) {
+				if (nControl->idleData) {
+					dropData(nControl->idleData);
+					nControl->idleData = NULL;
+				}
+				rv = sendCommand("MODE S", '2', nControl);
+				nControl->blockMode = FTP_CLIENT_BLOCK_OFF;
+			}
+			else if (!val)
+				nControl->blockMode = FTP_CLIENT_BLOCK_OFF;
+		}
+		break;
+
+		case FTP_CLIENT_NODELAY_CONTROL:
+		case FTP_CLIENT_KEEPALIVE:
+		{
+			if ((nControl->dir != FTP_CLIENT_CONTROL) && nControl->ctrl)
+				nControl = nControl->ctrl;
+			if (opt == FTP_CLIENT_NODELAY_CONTROL)
+				applyNoDelay(nControl->handle, (val != 0));
+			else
+				applyKeepalive(nControl->handle, (val > 0) ? (int) val : 0);
+			rv = 1;
+		}
+		break;
 	}
 	return rv;
 }
@@ -961,9 +2085,8 @@ static int setOptionsFtpClient(int opt, long val, NetBuf_t* nControl)
 static int changeDirFtpClient(const char* path, NetBuf_t* nControl)
 {
 	char buf[FTP_CLIENT_TEMP_BUFFER_SIZE];
-	if ((strlen(path) + 6) > sizeof(buf))
+	if (!buildCommand(buf, sizeof(buf), nControl, "CWD %s", path))
 		return 0;
-	sprintf(buf, "CWD %s", path);
 	if (!sendCommand(buf, '2', nControl))
 		return 0;
 	else
@@ -980,9 +2103,8 @@ static int changeDirFtpClient(const char* path, NetBuf_t* nControl)
 static int makeDirFtpClient(const char* path, NetBuf_t* nControl)
 {
 	char buf[FTP_CLIENT_TEMP_BUFFER_SIZE];
-	if ((strlen(path) + 6) > sizeof(buf))
+	if (!buildCommand(buf, sizeof(buf), nControl, "MKD %s", path))
 		return 0;
-	sprintf(buf, "MKD %s", path);
 	if (!sendCommand(buf, '2', nControl))
 		return 0;
 	else
@@ -999,9 +2121,8 @@ static int makeDirFtpClient(const char* path, NetBuf_t* nControl)
 static int removeDirFtpClient(const char* path, NetBuf_t* nControl)
 {
 	char buf[FTP_CLIENT_TEMP_BUFFER_SIZE];
-	if ((strlen(path) + 6) > sizeof(buf))
+	if (!buildCommand(buf, sizeof(buf), nControl, "RMD %s", path))
 		return 0;
-	sprintf(buf, "RMD %s", path);
 	if (!sendCommand(buf,'2',nControl))
 		return 0;
 	else
@@ -1119,9 +2240,8 @@ static int putDataFtpClient(const char* inputfile, const char* path, char mode,
 static int deleteDataFtpClient(const char* fnm, NetBuf_t* nControl)
 {
 	char cmd[FTP_CLIENT_TEMP_BUFFER_SIZE];
-	if ((strlen(fnm) + 7) > sizeof(cmd))
+	if (!buildCommand(cmd, sizeof(cmd), nControl, "DELE %s", fnm))
 		return 0;
-	sprintf(cmd, "DELE %s", fnm);
 	if(!sendCommand(cmd, '2', nControl))
 		return 0;
 	else
@@ -1138,13 +2258,12 @@ static int deleteDataFtpClient(const char* fnm, NetBuf_t* nControl)
 static int renameFtpClient(const char* src, const char* dst, NetBuf_t* nControl)
 {
 	char cmd[FTP_CLIENT_TEMP_BUFFER_SIZE];
-	if (((strlen(src) + 7) > sizeof(cmd)) ||
-		((strlen(dst) + 7) > sizeof(cmd)))
+	if (!buildCommand(cmd, sizeof(cmd), nControl, "RNFR %s", src))
 		return 0;
-	sprintf(cmd, "RNFR %s", src);
 	if (!sendCommand(cmd, '3', nControl))
 		return 0;
-	sprintf(cmd,"RNTO %s",dst);
+	if (!buildCommand(cmd, sizeof(cmd), nControl, "RNTO %s", dst))
+		return 0;
 	if (!sendCommand(cmd, '2', nControl))
 		return 0;
 	else
@@ -1162,48 +2281,66 @@ static int accessFtpClient(const char* path, int typ, int mode, NetBuf_t* nContr
 	NetBuf_t** nData)
 {
 	if ((path == NULL) &&
-		((typ == FTP_CLIENT_FILE_WRITE) || (typ == FTP_CLIENT_FILE_READ))) {
+		((typ == FTP_CLIENT_FILE_WRITE) || (typ == FTP_CLIENT_FILE_READ) ||
+		(typ == FTP_CLIENT_FILE_APPEND))) {
 		sprintf(nControl->response,
 					"Missing path argument for file transfer\n");
 		return 0;
 	}
 	char buf[FTP_CLIENT_TEMP_BUFFER_SIZE];
-	sprintf(buf, "TYPE %c", mode);
+	if (!buildCommand(buf, sizeof(buf), nControl, "TYPE %c", mode))
+		return 0;
 	if (!sendCommand(buf, '2', nControl))
 		return 0;
+	if (nControl->blockMode == FTP_CLIENT_BLOCK_WANTED) {
+		if (sendCommand("MODE B", '2', nControl))
+			nControl->blockMode = FTP_CLIENT_BLOCK_ON;
+		else if (nControl->response[0] == '5')
+			nControl->blockMode = FTP_CLIENT_BLOCK_REFUSED;
+		else
+			return 0;
+	}
 	int dir;
+	const char* verb;
 	switch (typ) {
 		case FTP_CLIENT_DIR:
 		{
-			strcpy(buf, "NLST");
+			verb = "NLST";
 			dir = FTP_CLIENT_READ;
 		}
 		break;
 
 		case FTP_CLIENT_DIR_VERBOSE:
 		{
-			strcpy(buf, "LIST");
+			verb = "LIST";
 			dir = FTP_CLIENT_READ;
 		}
 		break;
 
 		case FTP_CLIENT_FILE_READ:
 		{
-			strcpy(buf, "RETR");
+			verb = "RETR";
 			dir = FTP_CLIENT_READ;
 		}
 		break;
 
 		case FTP_CLIENT_FILE_WRITE:
 		{
-			strcpy(buf, "STOR");
+			verb = "STOR";
+			dir = FTP_CLIENT_WRITE;
+		}
+		break;
+
+		case FTP_CLIENT_FILE_APPEND:
+		{
+			verb = "APPE";
 			dir = FTP_CLIENT_WRITE;
 		}
 		break;
 
 		case FTP_CLIENT_MLSD:
 		{
-			strcpy(buf, "MLSD");
+			verb = "MLSD";
 			dir = FTP_CLIENT_READ;
 		}
 		break;
@@ -1215,14 +2352,14 @@ static int accessFtpClient(const char* path, int typ, int mode, NetBuf_t* nContr
 		}
 	}
 
-	if (path != NULL) {
-		int i = strlen(buf);
-		buf[i++] = ' ';
-		if ((strlen(path) + i + 1) >= sizeof(buf))
-			return 0;
-		strcpy(&buf[i], path);
-	}
+	if (!buildCommand(buf, sizeof(buf), nControl, (path != NULL) ? "%s %s" : "%s", verb, path))
+		return 0;
 
+	if (nControl->idleData != NULL) {
+		int rv = reuseData(buf, mode, dir, nControl, nData);
+		if (rv >= 0)
+			return rv;
+	}
 	if (openPort(nControl, nData, mode, dir) == -1)
 		return 0;
 	if (!sendCommand(buf, '1', nControl)) {
@@ -1238,6 +2375,18 @@ static int accessFtpClient(const char* path, int typ, int mode, NetBuf_t* nContr
 			return 0;
 		}
 	}
+	#if FTP_CLIENT_TLS
+	if (nControl->prot && !tlsHandshake(*nData, nControl)) {
+		/* the server still sends the final reply of the aborted transfer */
+		char response[FTP_CLIENT_RESPONSE_BUFFER_SIZE];
+		strcpy(response, nControl->response);
+		closeFtpClient(*nData);
+		*nData = NULL;
+		nControl->data = NULL;
+		strcpy(nControl->response, response);
+		return 0;
+	}
+	#endif
 	return 1;
 }
 
@@ -1256,10 +2405,11 @@ static int readFtpClient(void* buf, int max, NetBuf_t* nData)
 		i = socketWait(nData);
 		if (i != 1)
 			return 0;
-		i = recv(nData->handle, buf, max, 0);
+		i = dataRecv(nData, buf, max);
 	}
 	if (i == -1)
 		return 0;
+	rateWait(nData, i);
 	nData->xfered += i;
 	if (nData->idlecb && nData->cbbytes) {
 		nData->xfered1 += i;
@@ -1280,11 +2430,12 @@ static int writeFtpClient(const void* buf, int len, NetBuf_t* nData)
 	int i = 0;
 	if (nData->dir != FTP_CLIENT_WRITE)
 		return 0;
+	rateWait(nData, len);
 	if (nData->buf)
 		i = writeLine(buf, len, nData);
 	else {
 		socketWait(nData);
-		i = send(nData->handle, buf, len, 0);
+		i = dataSend(nData, buf, len);
 	}
 	if (i == -1)
 		return 0;
@@ -1308,12 +2459,10 @@ static int closeFtpClient(NetBuf_t* nData)
 	{
 		case FTP_CLIENT_WRITE:
 		case FTP_CLIENT_READ:
-			if (nData->buf)
-				free(nData->buf);
-			shutdown(nData->handle, 2);
-			closesocket(nData->handle);
+			if (nData->block && nData->ctrl)
+				return closeBlockData(nData);
 			NetBuf_t* ctrl = nData->ctrl;
-			free(nData);
+			dropData(nData);
 			ctrl->data = NULL;
 			if (ctrl && ctrl->response[0] != '4' && ctrl->response[0] != '5')
 				return(readResponse('2', ctrl));
@@ -1324,7 +2473,12 @@ static int closeFtpClient(NetBuf_t* nData)
 				nData->ctrl = NULL;
 				closeFtpClient(nData->data);
 			}
-			closesocket(nData->handle);
+			if (nData->idleData)
+				dropData(nData->idleData);
+			netClose(nData);
+			#if FTP_CLIENT_TLS
+			tlsFree(nData);
+			#endif
 			free(nData);
 			return 0;
 	}
@@ -1333,6 +2487,44 @@ static int closeFtpClient(NetBuf_t* nData)
 
 
 
+/*
+ * closeBlockData - end a MODE B transfer and keep its data connection
+ *
+ * A write ends with the EOF block; a read is complete once the EOF block is
+ * consumed. After the 2xx reply the connection is parked for the next
+ * transfer. A read that stopped early still has data in flight and is
+ * closed as in stream mode. So is a write that failed inside a block: an EOF
+ * header after it would be taken for file data, the server must see the
+ * connection drop instead.
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int closeBlockData(NetBuf_t* nData)
+{
+	NetBuf_t* ctrl = nData->ctrl;
+	int keep;
+	if (nData->dir == FTP_CLIENT_WRITE)
+		keep = !nData->blockBroken
+			&& (nData->blockEof = sendBlockHeader(nData, FTP_CLIENT_BLOCK_EOF, 0));
+	else
+		keep = nData->blockEof && (nData->blockLeft == 0);
+	ctrl->data = NULL;
+	if (!keep)
+		dropData(nData);
+	int rv = 1;
+	if (ctrl->response[0] != '4' && ctrl->response[0] != '5')
+		rv = readResponse('2', ctrl);
+	if (keep) {
+		if (rv && (ctrl->response[0] == '2') && (ctrl->idleData == NULL))
+			ctrl->idleData = nData;
+		else
+			dropData(nData);
+	}
+	return rv;
+}
+
+
+
 FtpClient* getFtpClient(void)
 {
 	if(!isInitilized) {
@@ -1344,8 +2536,12 @@ FtpClient* getFtpClient(void)
 		ftpClient_.ftpClientSetCallback = setCallbackFtpClient;
 		ftpClient_.ftpClientClearCallback = clearCallbackFtpClient;
 		ftpClient_.ftpClientConnect = connectFtpClient;
+		ftpClient_.ftpClientConnectFallback = connectFallbackFtpClient;
+		ftpClient_.ftpClientGetTimings = getTimingsFtpClient;
+		ftpClient_.ftpClientAuthTls = authTlsFtpClient;
 		ftpClient_.ftpClientLogin = loginFtpClient;
 		ftpClient_.ftpClientQuit = quitFtpClient;
+		ftpClient_.ftpClientDisconnect = disconnectFtpClient;
 		ftpClient_.ftpClientSetOptions = setOptionsFtpClient;
 		ftpClient_.ftpClientChangeDir = changeDirFtpClient;
 		ftpClient_.ftpClientMakeDir = makeDirFtpClient;
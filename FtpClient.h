@@ -36,14 +36,38 @@ extern "C" {
 #define FTP_CLIENT_BUFFER_SIZE 				4096
 #define FTP_CLIENT_RESPONSE_BUFFER_SIZE 	1024
 #define FTP_CLIENT_TEMP_BUFFER_SIZE 		1024
+#define FTP_CLIENT_REPLY_MAX_LINES 			256		/* longest multi-line reply accepted */
+#define FTP_CLIENT_REPLY_MAX_DISCARD 		4096	/* bytes dropped from an overlong reply line */
 #define FTP_CLIENT_ACCEPT_TIMEOUT 			30
 
+/* connection establishment */
+#if !defined FTP_CLIENT_CONNECT_TIMEOUT_MS
+#define FTP_CLIENT_CONNECT_TIMEOUT_MS 		5000	/* deadline for the TCP connect */
+#endif
+#if !defined FTP_CLIENT_FALLBACK_DELAY_MS
+#define FTP_CLIENT_FALLBACK_DELAY_MS 		300		/* head start of the primary server */
+#endif
+#if !defined FTP_CLIENT_REPLY_TIMEOUT
+#define FTP_CLIENT_REPLY_TIMEOUT 			30		/* seconds to wait for a control reply */
+#endif
+#if !defined FTP_CLIENT_DNS_TTL
+#define FTP_CLIENT_DNS_TTL 					3600	/* seconds a cached address is used */
+#endif
+#define FTP_CLIENT_DNS_CACHE_SIZE 			2
+
+/* explicit FTPS (AUTH TLS) through mbedTLS */
+#if !defined FTP_CLIENT_TLS
+#define FTP_CLIENT_TLS 						1
+#endif
+#define FTP_CLIENT_DNS_HOST_MAX 			64
+
 /* FtpAccess() type codes */
 #define FTP_CLIENT_DIR 						1
 #define FTP_CLIENT_DIR_VERBOSE 				2
 #define FTP_CLIENT_FILE_READ 				3
 #define FTP_CLIENT_FILE_WRITE 				4
 #define FTP_CLIENT_MLSD 					5
+#define FTP_CLIENT_FILE_APPEND 				6
 
 /* FtpAccess() mode codes */
 #define FTP_CLIENT_ASCII 					'A'
@@ -61,11 +85,86 @@ extern "C" {
 #define FTP_CLIENT_IDLETIME 				3
 #define FTP_CLIENT_CALLBACKARG 				4
 #define FTP_CLIENT_CALLBACKBYTES 			5
+#define FTP_CLIENT_RATELIMIT 				6	/* data rate in bytes/s, 0 = unlimited */
+#define FTP_CLIENT_RATEBURST 				7	/* token bucket depth in bytes, 0 = rate/10 */
+#define FTP_CLIENT_SNDBUF 					8	/* data socket SO_SNDBUF in bytes, 0 = lwIP default */
+#define FTP_CLIENT_RCVBUF 					9	/* data socket SO_RCVBUF in bytes, 0 = lwIP default */
+#define FTP_CLIENT_NODELAY_CONTROL 			10	/* 1 disables Nagle on the control socket */
+#define FTP_CLIENT_NODELAY_DATA 			11	/* 1 disables Nagle on data sockets */
+#define FTP_CLIENT_KEEPALIVE 				12	/* control keepalive idle time in s, 0 = off */
+#define FTP_CLIENT_LINGER 					13	/* data socket linger in s, -1 = off */
+#define FTP_CLIENT_BLOCKMODE 				14	/* 1 asks for MODE B and keeps the data connection between transfers */
+
+/* socket profile of a new connection, see setOptionsFtpClient */
+#if !defined FTP_CLIENT_DEFAULT_SNDBUF
+#define FTP_CLIENT_DEFAULT_SNDBUF 			0
+#endif
+#if !defined FTP_CLIENT_DEFAULT_RCVBUF
+#define FTP_CLIENT_DEFAULT_RCVBUF 			0
+#endif
+#if !defined FTP_CLIENT_DEFAULT_NODELAY_CONTROL
+#define FTP_CLIENT_DEFAULT_NODELAY_CONTROL 	1	/* commands are single small writes */
+#endif
+#if !defined FTP_CLIENT_DEFAULT_NODELAY_DATA
+#define FTP_CLIENT_DEFAULT_NODELAY_DATA 	0	/* bulk transfers want full segments */
+#endif
+#if !defined FTP_CLIENT_DEFAULT_KEEPALIVE
+#define FTP_CLIENT_DEFAULT_KEEPALIVE 		60	/* keeps NAT state of an idle control session during long transfers */
+#endif
+#if !defined FTP_CLIENT_DEFAULT_LINGER
+#define FTP_CLIENT_DEFAULT_LINGER 			-1
+#endif
+#if !defined FTP_CLIENT_DEFAULT_BLOCKMODE
+#define FTP_CLIENT_DEFAULT_BLOCKMODE 		0
+#endif
 
 typedef struct NetBuf NetBuf_t;
 
+/*
+ * FTP_CLIENT_RATELIMIT and FTP_CLIENT_RATEBURST may also be set on a data
+ * connection (e.g. from the bytes callback), they always apply to its control
+ * connection and take effect on the next read or write.
+ *
+ * FTP_CLIENT_SNDBUF, FTP_CLIENT_RCVBUF, FTP_CLIENT_NODELAY_DATA and
+ * FTP_CLIENT_LINGER apply to data connections opened afterwards, buffer sizes
+ * need CONFIG_LWIP_SO_RCVBUF (lwIP sizes the send buffer from
+ * CONFIG_LWIP_TCP_SND_BUF_DEFAULT only) and linger needs CONFIG_LWIP_SO_LINGER.
+ * FTP_CLIENT_NODELAY_CONTROL and FTP_CLIENT_KEEPALIVE change the open control
+ * socket at once.
+ *
+ * ftpClientAuthTls is called between connect and login. It upgrades the
+ * control connection with AUTH TLS and protects data connections with
+ * PBSZ 0 / PROT P. Data connections resume the TLS session of the control
+ * connection, so they only need an abbreviated handshake. caPem verifies the
+ * server certificate; when it is NULL the server is not authenticated.
+ *
+ * With FTP_CLIENT_BLOCKMODE the next transfer sends MODE B. When the server
+ * accepts it, every file ends with an EOF block header instead of a closed
+ * socket, so the data connection stays open and the following RETR/STOR/APPE
+ * go over it without PASV, TCP handshake or slow start. A server that refuses
+ * MODE B (5xx) gets stream mode from then on. When the server has closed the
+ * kept connection, or answers 425 on it, the transfer opens a new one with
+ * PASV, still in MODE B. Neither is an error for the caller.
+ */
+
 typedef int (*FtpClientCallback_t)(NetBuf_t* nControl, uint32_t xfered, void* arg);
 
+typedef struct
+{
+	uint32_t dnsUs;						/* name resolution, 0 on a cache hit */
+	uint32_t connectUs;					/* TCP connect */
+	uint32_t bannerUs;					/* waiting for the 220 banner */
+	uint32_t loginUs;					/* USER/PASS */
+	uint32_t tlsUs;						/* control channel TLS handshake */
+	uint32_t dataTlsUs;					/* last data channel TLS handshake */
+	uint32_t dataTlsMaxUs;				/* slowest data channel TLS handshake */
+	uint32_t dataTlsCount;				/* data channel TLS handshakes */
+	int server;							/* 0 primary, 1 fallback */
+	int dnsCached;						/* address came from the RTC cache */
+	uint32_t dataConnects;				/* data connections opened */
+	uint32_t dataReused;				/* transfers on a kept MODE B data connection */
+} FtpClientTimings_t;
+
 typedef struct
 {
 	FtpClientCallback_t cbFunc;			/* function to call */
@@ -88,8 +187,13 @@ typedef struct
 	int (*ftpClientClearCallback)(NetBuf_t* nControl);
 	/*Server connection*/
 	int (*ftpClientConnect)(const char* host, uint16_t port, NetBuf_t** nControl);
+	int (*ftpClientConnectFallback)(const char* host, uint16_t port,
+			const char* host2, uint16_t port2, NetBuf_t** nControl);
+	int (*ftpClientGetTimings)(FtpClientTimings_t* timings, NetBuf_t* nControl);
+	int (*ftpClientAuthTls)(const char* caPem, NetBuf_t* nControl);
 	int (*ftpClientLogin)(const char* user, const char* pass, NetBuf_t* nControl);
 	void (*ftpClientQuit)(NetBuf_t* nControl);
+	void (*ftpClientDisconnect)(NetBuf_t* nControl);
 	int (*ftpClientSetOptions)(int opt, long val, NetBuf_t* nControl);
 	/*Directory Functions*/
 	int (*ftpClientChangeDir)(const char* path, NetBuf_t* nControl);
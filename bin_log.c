@@ -0,0 +1,407 @@
+/*
+ * bin_log - binary, deferred log for the hot paths
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_sleep.h"
+#include "esp_heap_caps.h"
+#include "esp_ota_ops.h"
+#include "esp_cpu.h"
+#include "bin_log.h"
+
+static const char *TAG = "BIN_LOG";
+
+#define BIN_LOG_RTC_MAGIC                   0x424c4731      /* "BLG1" */
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    len;
+    uint32_t    sum;                        /* Of len, dropped and data */
+    uint32_t    dropped;
+    uint8_t     elf_sha256[BIN_LOG_SHA_LEN];
+    uint8_t     data[BIN_LOG_RTC_BYTES];
+} bin_log_rtc_t;
+
+typedef struct {
+    bin_log_record_t    rec;
+    uint32_t            args[2];
+} bin_log_mark_t;
+
+/* Survives deep sleep and software resets */
+RTC_NOINIT_ATTR static bin_log_rtc_t s_rtc;
+
+static struct {
+    bin_log_cfg_t       cfg;
+    portMUX_TYPE        mux;                /* Guards head, tail and the counters */
+    SemaphoreHandle_t   drain_lock;
+    uint8_t             *ring;
+    uint32_t            size;
+    uint32_t            head;               /* Free running, ring offset is % size */
+    uint32_t            tail;
+    uint32_t            dropped;            /* Since the last drain */
+    uint8_t             elf_sha256[BIN_LOG_SHA_LEN];
+    bin_log_stats_t     stats;
+} s_log = {
+    .mux = portMUX_INITIALIZER_UNLOCKED,
+};
+
+static void _print(esp_log_level_t level, const char *tag, const char *fmt, va_list ap)
+{
+    static const char letter[] = "NEWIDV";
+    printf("%c (%u) %s: ", letter[level <= ESP_LOG_VERBOSE ? level : 0], (unsigned)esp_log_timestamp(), tag);
+    vprintf(fmt, ap);
+    printf("\n");
+}
+
+/* Arguments of fmt packed into out, as tools/bin_log_decode.py reads them back */
+static int _pack(uint8_t *out, const char *fmt, va_list ap)
+{
+    int n = 0;
+    for (const char *p = fmt; *p; p++) {
+        if (*p != '%' || *++p == '%') {
+            continue;
+        }
+        while (*p && strchr("-+ #0", *p)) {
+            p++;
+        }
+        for (int field = 0; field < 2; field++) {
+            if (*p == '*') {
+                int v = va_arg(ap, int);
+                if (n + 4 <= BIN_LOG_MAX_ARGS) {
+                    memcpy(out + n, &v, 4);
+                    n += 4;
+                }
+                p++;
+            }
+            while (*p >= '0' && *p <= '9') {
+                p++;
+            }
+            if (field == 0 && *p == '.') {
+                p++;
+            } else {
+                break;
+            }
+        }
+        int longs = 0;
+        while (*p && strchr("hlLjzt", *p)) {
+            longs += (*p == 'l') + 2 * (*p == 'j' || *p == 'L');
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        if (*p == 's') {
+            const char *s = va_arg(ap, const char *);
+            if (s == NULL) {
+                s = "(null)";
+            }
+            int len = strnlen(s, BIN_LOG_MAX_STR);
+            int need = (1 + len + 3) & ~3;
+            if (n + need > BIN_LOG_MAX_ARGS) {
+                len = BIN_LOG_MAX_ARGS - n - 1;
+                need = BIN_LOG_MAX_ARGS - n;
+                if (len < 0) {
+                    break;
+                }
+            }
+            memset(out + n, 0, need);
+            out[n] = len;
+            memcpy(out + n + 1, s, len);
+            n += need;
+        } else if (strchr("feEgGaA", *p)) {
+            double v = va_arg(ap, double);
+            if (n + 8 <= BIN_LOG_MAX_ARGS) {
+                memcpy(out + n, &v, 8);
+                n += 8;
+            }
+        } else if (longs >= 2) {
+            uint64_t v = va_arg(ap, uint64_t);
+            if (n + 8 <= BIN_LOG_MAX_ARGS) {
+                memcpy(out + n, &v, 8);
+                n += 8;
+            }
+        } else {
+            uint32_t v = va_arg(ap, uint32_t);
+            if (n + 4 <= BIN_LOG_MAX_ARGS) {
+                memcpy(out + n, &v, 4);
+                n += 4;
+            }
+        }
+    }
+    return n;
+}
+
+static void _ring_put(uint32_t pos, const void *src, uint32_t len)
+{
+    uint32_t off = pos % s_log.size;
+    uint32_t first = len < s_log.size - off ? len : s_log.size - off;
+    memcpy(s_log.ring + off, src, first);
+    memcpy(s_log.ring, (const uint8_t *)src + first, len - first);
+}
+
+static void _ring_get(uint32_t pos, void *dst, uint32_t len)
+{
+    uint32_t off = pos % s_log.size;
+    uint32_t first = len < s_log.size - off ? len : s_log.size - off;
+    memcpy(dst, s_log.ring + off, first);
+    memcpy((uint8_t *)dst + first, s_log.ring, len - first);
+}
+
+static void _push(const bin_log_record_t *rec)
+{
+    uint32_t len = sizeof(*rec) + rec->len;
+    portENTER_CRITICAL(&s_log.mux);
+    if (s_log.head - s_log.tail + len > s_log.size) {
+        s_log.dropped++;
+        s_log.stats.dropped++;
+    } else {
+        _ring_put(s_log.head, rec, len);
+        s_log.head += len;
+        s_log.stats.records++;
+    }
+    portEXIT_CRITICAL(&s_log.mux);
+}
+
+static void _mark(bin_log_mark_t *m, uint32_t mark, uint32_t a, uint32_t b)
+{
+    memset(m, 0, sizeof(*m));
+    m->rec.fmt = mark;
+    m->rec.ms = esp_log_timestamp();
+    m->rec.len = sizeof(m->args);
+    m->args[0] = a;
+    m->args[1] = b;
+}
+
+static uint32_t _rtc_sum(void)
+{
+    uint32_t sum = s_rtc.len ^ (s_rtc.dropped << 16);
+    for (uint32_t i = 0; i < s_rtc.len && i < BIN_LOG_RTC_BYTES; i++) {
+        sum = sum * 31 + s_rtc.data[i];
+    }
+    return sum;
+}
+
+static void _restore(void)
+{
+    if (s_rtc.magic != BIN_LOG_RTC_MAGIC || s_rtc.len > BIN_LOG_RTC_BYTES
+        || s_rtc.len > s_log.size || s_rtc.sum != _rtc_sum()) {
+        s_rtc.magic = 0;
+        return;
+    }
+    if (memcmp(s_rtc.elf_sha256, s_log.elf_sha256, BIN_LOG_SHA_LEN) != 0) {
+        /* Written by other firmware, the format addresses mean nothing here */
+        ESP_LOGW(TAG, "Dropping %u bytes saved by other firmware", (unsigned)s_rtc.len);
+    } else {
+        memcpy(s_log.ring, s_rtc.data, s_rtc.len);
+        s_log.head = s_rtc.len;
+        s_log.dropped = s_rtc.dropped;
+        s_log.stats.dropped = s_rtc.dropped;
+        s_log.stats.restored_bytes = s_rtc.len;
+    }
+    s_rtc.magic = 0;
+}
+
+esp_err_t bin_log_init(const bin_log_cfg_t *config)
+{
+    if (s_log.ring) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (config->ring_bytes < BIN_LOG_RTC_BYTES) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_log.drain_lock = xSemaphoreCreateMutex();
+    if (s_log.drain_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    uint8_t *ring = heap_caps_malloc(config->ring_bytes, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (ring == NULL) {
+        ESP_LOGE(TAG, "No PSRAM for a %d byte ring, printing instead", config->ring_bytes);
+        vSemaphoreDelete(s_log.drain_lock);
+        s_log.drain_lock = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    s_log.cfg = *config;
+    s_log.size = config->ring_bytes;
+    memcpy(s_log.elf_sha256, esp_ota_get_app_description()->app_elf_sha256, BIN_LOG_SHA_LEN);
+    s_log.ring = ring;
+    _restore();
+    bin_log_mark_t boot;
+    _mark(&boot, BIN_LOG_MARK_BOOT, esp_reset_reason(), esp_sleep_get_wakeup_cause());
+    _push(&boot.rec);
+    return ESP_OK;
+}
+
+void bin_log_write(esp_log_level_t level, const char *tag, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    if ((s_log.ring == NULL || s_log.cfg.echo) && level <= BIN_LOG_PRINT_LEVEL) {
+        va_list copy;
+        va_copy(copy, ap);
+        _print(level, tag, fmt, copy);
+        va_end(copy);
+    }
+    if (s_log.ring && level <= s_log.cfg.level) {
+        uint32_t words[(sizeof(bin_log_record_t) + BIN_LOG_MAX_ARGS) / 4];
+        bin_log_record_t *rec = (bin_log_record_t *)words;
+        rec->len = (_pack((uint8_t *)(rec + 1), fmt, ap) + 3) & ~3;
+        rec->fmt = (uint32_t)(uintptr_t)fmt;
+        rec->tag = (uint32_t)(uintptr_t)tag;
+        rec->ms = esp_log_timestamp();
+        rec->level = level;
+        rec->reserved = 0;
+        _push(rec);
+    }
+    va_end(ap);
+}
+
+esp_err_t bin_log_drain(const char *path)
+{
+    if (s_log.ring == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(s_log.drain_lock, portMAX_DELAY);
+    /* Writers only add behind head, [tail, head) stays as it is until tail moves */
+    portENTER_CRITICAL(&s_log.mux);
+    uint32_t tail = s_log.tail;
+    uint32_t head = s_log.head;
+    uint32_t dropped = s_log.dropped;
+    s_log.dropped = 0;
+    portEXIT_CRITICAL(&s_log.mux);
+    if (head == tail && dropped == 0) {
+        xSemaphoreGive(s_log.drain_lock);
+        return ESP_ERR_NOT_FOUND;
+    }
+    /* The marks go to the file directly, a full ring must not lose them */
+    bin_log_mark_t marks[2];
+    int mark_count = 0;
+    if (dropped) {
+        _mark(&marks[mark_count++], BIN_LOG_MARK_DROPPED, dropped, 0);
+    }
+    _mark(&marks[mark_count++], BIN_LOG_MARK_SYNC, (uint32_t)time(NULL), 0);
+
+    FILE *fp = fopen(path, "ab");
+    if (fp == NULL) {
+        ESP_LOGE(TAG, "Failed to open %s", path);
+        portENTER_CRITICAL(&s_log.mux);
+        s_log.dropped += dropped;
+        portEXIT_CRITICAL(&s_log.mux);
+        xSemaphoreGive(s_log.drain_lock);
+        return ESP_FAIL;
+    }
+    bool ok = fseek(fp, 0, SEEK_END) == 0;
+    if (ok && ftell(fp) == 0) {
+        bin_log_file_header_t h = {
+            .version = BIN_LOG_VERSION,
+            .header_size = sizeof(bin_log_file_header_t),
+        };
+        memcpy(h.magic, BIN_LOG_MAGIC, 4);
+        memcpy(h.elf_sha256, s_log.elf_sha256, BIN_LOG_SHA_LEN);
+        ok = fwrite(&h, 1, sizeof(h), fp) == sizeof(h);
+    }
+    uint32_t len = head - tail;
+    uint32_t off = tail % s_log.size;
+    uint32_t first = len < s_log.size - off ? len : s_log.size - off;
+    ok = ok && fwrite(s_log.ring + off, 1, first, fp) == first;
+    ok = ok && fwrite(s_log.ring, 1, len - first, fp) == len - first;
+    ok = ok && fwrite(marks, sizeof(marks[0]), mark_count, fp) == (size_t)mark_count;
+    /* fclose() flushes to the card, it must not run with the spinlock held */
+    ok = fclose(fp) == 0 && ok;
+    esp_err_t ret = ESP_OK;
+    portENTER_CRITICAL(&s_log.mux);
+    if (ok) {
+        s_log.tail = head;
+        s_log.stats.drained_bytes += len + mark_count * sizeof(marks[0]);
+    } else {
+        /* Left in the ring for the next drain */
+        s_log.dropped += dropped;
+        ret = ESP_FAIL;
+    }
+    portEXIT_CRITICAL(&s_log.mux);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write %s", path);
+    }
+    xSemaphoreGive(s_log.drain_lock);
+    return ret;
+}
+
+void bin_log_suspend(void)
+{
+    if (s_log.ring == NULL) {
+        return;
+    }
+    bin_log_mark_t sync;
+    _mark(&sync, BIN_LOG_MARK_SYNC, (uint32_t)time(NULL), 0);
+    portENTER_CRITICAL(&s_log.mux);
+    uint32_t tail = s_log.tail;
+    uint32_t dropped = s_log.dropped;
+    /* The oldest records go first, the sync mark always fits */
+    while (s_log.head - tail + sizeof(sync) > BIN_LOG_RTC_BYTES) {
+        bin_log_record_t rec;
+        _ring_get(tail, &rec, sizeof(rec));
+        tail += sizeof(rec) + rec.len;
+        dropped++;
+    }
+    uint32_t len = s_log.head - tail;
+    _ring_get(tail, s_rtc.data, len);
+    memcpy(s_rtc.data + len, &sync, sizeof(sync));
+    s_rtc.len = len + sizeof(sync);
+    s_rtc.dropped = dropped;
+    memcpy(s_rtc.elf_sha256, s_log.elf_sha256, BIN_LOG_SHA_LEN);
+    s_rtc.sum = _rtc_sum();
+    s_rtc.magic = BIN_LOG_RTC_MAGIC;
+    portEXIT_CRITICAL(&s_log.mux);
+}
+
+void bin_log_get_stats(bin_log_stats_t *stats)
+{
+    portENTER_CRITICAL(&s_log.mux);
+    memcpy(stats, &s_log.stats, sizeof(*stats));
+    stats->used_bytes = s_log.head - s_log.tail;
+    portEXIT_CRITICAL(&s_log.mux);
+}
+
+void bin_log_log_stats(void)
+{
+    if (s_log.ring == NULL) {
+        return;
+    }
+    bin_log_stats_t st;
+    bin_log_get_stats(&st);
+    ESP_LOGI(TAG, "%u records, %u dropped, %u bytes restored from RTC, %" PRIu64 " drained, %u of %u in the ring",
+             st.records, st.dropped, st.restored_bytes, st.drained_bytes,
+             st.used_bytes, (unsigned)s_log.size);
+}
+
+void bin_log_bench(int calls)
+{
+    if (calls <= 0) {
+        return;
+    }
+    int64_t start = esp_timer_get_time();
+    uint32_t cycles = esp_cpu_get_ccount();
+    for (int i = 0; i < calls; i++) {
+        BIN_LOGI(TAG, "[ * ] Recording ... %d", i);
+    }
+    uint32_t bin_cycles = (esp_cpu_get_ccount() - cycles) / calls;
+    uint32_t bin_ns = (esp_timer_get_time() - start) * 1000 / calls;
+    start = esp_timer_get_time();
+    cycles = esp_cpu_get_ccount();
+    for (int i = 0; i < calls; i++) {
+        ESP_LOGI(TAG, "[ * ] Recording ... %d", i);
+    }
+    uint32_t esp_cycles = (esp_cpu_get_ccount() - cycles) / calls;
+    uint32_t esp_ns = (esp_timer_get_time() - start) * 1000 / calls;
+    ESP_LOGI(TAG, "Per call over %d calls: BIN_LOGI %u ns (%u cycles)%s, ESP_LOGI %u ns (%u cycles)",
+             calls, bin_ns, bin_cycles, s_log.ring ? "" : " without a ring", esp_ns, esp_cycles);
+}
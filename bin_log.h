@@ -0,0 +1,146 @@
+/*
+ * bin_log - binary, deferred log for the hot paths
+ *
+ * ESP_LOGI formats on the calling task and waits for the UART, and whatever
+ * it printed is gone after deep sleep. BIN_LOGI() and friends keep only what
+ * is needed to print the line later:
+ *
+ *   - the address of the format and of the tag. Both have to be string
+ *     literals (or TAG / __FUNCTION__), which stay in flash, so the same
+ *     firmware ELF turns them back into text
+ *   - esp_log_timestamp() and the level
+ *   - the arguments, packed as the format says: 4 bytes for int, long and
+ *     pointers, 8 for long long and double, %s copied (at most
+ *     BIN_LOG_MAX_STR bytes)
+ *
+ * Records go into a ring in PSRAM, a full ring drops new records and counts
+ * them. bin_log_drain() appends the ring to a file on the card, e.g. next to
+ * the clip so it is uploaded with it. bin_log_suspend() before deep sleep
+ * copies what was not drained (the newest BIN_LOG_RTC_BYTES) into RTC memory,
+ * bin_log_init() of the next boot puts it back in front.
+ *
+ * A boot mark (reset reason, wakeup cause) starts the records of every boot,
+ * a sync mark (time(NULL) at drain or sleep) ties their timestamps to the
+ * wall clock. tools/bin_log_decode.py prints a file with the ELF of the
+ * firmware that wrote it; the file header holds the start of its SHA-256.
+ *
+ * Before bin_log_init(), or when it failed, records up to
+ * BIN_LOG_PRINT_LEVEL are printed as ESP_LOG would.
+ */
+
+#ifndef BIN_LOG_H_
+#define BIN_LOG_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_log.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BIN_LOG_MAGIC                       "BLG1"
+#define BIN_LOG_VERSION                     1
+#define BIN_LOG_SHA_LEN                     8
+
+/* Argument bytes of one record, later arguments are left out */
+#define BIN_LOG_MAX_ARGS                    64
+/* Longest %s kept */
+#define BIN_LOG_MAX_STR                     48
+
+/* Not drained records kept across deep sleep */
+#if !defined BIN_LOG_RTC_BYTES
+#define BIN_LOG_RTC_BYTES                   2048
+#endif
+
+/* Printed instead of recorded without a ring */
+#if !defined BIN_LOG_PRINT_LEVEL
+#define BIN_LOG_PRINT_LEVEL                 ESP_LOG_INFO
+#endif
+
+/* fmt of the marks, below any flash address */
+#define BIN_LOG_MARK_BOOT                   1       /* reset reason, wakeup cause */
+#define BIN_LOG_MARK_SYNC                   2       /* time(NULL) at the timestamp of the mark */
+#define BIN_LOG_MARK_DROPPED                3       /* records lost since the last drain */
+
+typedef struct {
+    char        magic[4];               /* BIN_LOG_MAGIC */
+    uint16_t    version;
+    uint16_t    header_size;            /* Records start here */
+    uint8_t     elf_sha256[BIN_LOG_SHA_LEN];
+} bin_log_file_header_t;
+
+typedef struct {
+    uint32_t    fmt;                    /* Address of the format, or BIN_LOG_MARK_* */
+    uint32_t    tag;                    /* Address of the tag, 0 for marks */
+    uint32_t    ms;                     /* esp_log_timestamp() */
+    uint16_t    len;                    /* Argument bytes that follow, a multiple of 4 */
+    uint8_t     level;                  /* esp_log_level_t */
+    uint8_t     reserved;
+} bin_log_record_t;
+
+typedef struct {
+    int             ring_bytes;         /* PSRAM ring */
+    esp_log_level_t level;              /* Records above this level are not kept */
+    bool            echo;               /* Print records up to BIN_LOG_PRINT_LEVEL as well */
+} bin_log_cfg_t;
+
+#define BIN_LOG_CFG_DEFAULT() {                     \
+    .ring_bytes = 32 * 1024,                        \
+    .level = ESP_LOG_DEBUG,                         \
+    .echo = false,                                  \
+}
+
+typedef struct {
+    uint32_t    records;
+    uint32_t    dropped;                /* Ring full, or cut from the RTC copy */
+    uint32_t    restored_bytes;         /* Put back from RTC memory at init */
+    uint64_t    drained_bytes;
+    uint32_t    used_bytes;             /* In the ring now */
+} bin_log_stats_t;
+
+#define BIN_LOGE(tag, fmt, ...)             bin_log_write(ESP_LOG_ERROR, tag, fmt, ##__VA_ARGS__)
+#define BIN_LOGW(tag, fmt, ...)             bin_log_write(ESP_LOG_WARN, tag, fmt, ##__VA_ARGS__)
+#define BIN_LOGI(tag, fmt, ...)             bin_log_write(ESP_LOG_INFO, tag, fmt, ##__VA_ARGS__)
+#define BIN_LOGD(tag, fmt, ...)             bin_log_write(ESP_LOG_DEBUG, tag, fmt, ##__VA_ARGS__)
+
+/**
+ * @brief  Allocate the ring, take back the records saved before deep sleep
+ *         and add the boot mark
+ */
+esp_err_t bin_log_init(const bin_log_cfg_t *config);
+
+/**
+ * @brief  Record one line, fmt and tag must stay valid (string literals)
+ */
+void bin_log_write(esp_log_level_t level, const char *tag, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/**
+ * @brief  Add a sync mark and append the ring to path, written with a file
+ *         header when it is new. ESP_ERR_NOT_FOUND when nothing was recorded
+ *         since the last drain.
+ */
+esp_err_t bin_log_drain(const char *path);
+
+/**
+ * @brief  Add a sync mark and keep the newest records not drained in RTC
+ *         memory. Call right before esp_deep_sleep_start() / esp_restart().
+ */
+void bin_log_suspend(void);
+
+void bin_log_get_stats(bin_log_stats_t *stats);
+void bin_log_log_stats(void);
+
+/**
+ * @brief  Time calls BIN_LOGI() against the same ESP_LOGI() and print the
+ *         cost of one call of each
+ */
+void bin_log_bench(int calls);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BIN_LOG_H_ */
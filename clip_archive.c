@@ -0,0 +1,174 @@
+/*
+ * clip_archive - many clips uploaded as one tar stream
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "audio_mem.h"
+#include "clip_archive.h"
+
+static const char *TAG = "CLIP_ARCHIVE";
+
+/* ustar header fields used here, offsets into the 512 byte block */
+#define TAR_NAME        0
+#define TAR_NAME_SIZE   100
+#define TAR_MODE        100
+#define TAR_UID         108
+#define TAR_GID         116
+#define TAR_SIZE        124
+#define TAR_MTIME       136
+#define TAR_CHKSUM      148
+#define TAR_TYPEFLAG    156
+#define TAR_MAGIC       257
+#define TAR_VERSION     263
+
+static const char *_basename(const char *path)
+{
+    const char *base = strrchr(path, '/');
+    return base ? base + 1 : path;
+}
+
+static bool _header(uint8_t *h, const char *name, const struct stat *st)
+{
+    if (strlen(name) >= TAR_NAME_SIZE) {
+        return false;
+    }
+    memset(h, 0, CLIP_ARCHIVE_BLOCK_SIZE);
+    strcpy((char *)h + TAR_NAME, name);
+    snprintf((char *)h + TAR_MODE, 8, "%07o", 0644);
+    snprintf((char *)h + TAR_UID, 8, "%07o", 0);
+    snprintf((char *)h + TAR_GID, 8, "%07o", 0);
+    snprintf((char *)h + TAR_SIZE, 12, "%011lo", (unsigned long)st->st_size);
+    snprintf((char *)h + TAR_MTIME, 12, "%011lo", (unsigned long)st->st_mtime);
+    h[TAR_TYPEFLAG] = '0';
+    memcpy(h + TAR_MAGIC, "ustar", 6);
+    memcpy(h + TAR_VERSION, "00", 2);
+    /* Checksum is taken with its own field as spaces, stored as 6 digits, NUL, space */
+    memset(h + TAR_CHKSUM, ' ', 8);
+    unsigned sum = 0;
+    for (int i = 0; i < CLIP_ARCHIVE_BLOCK_SIZE; i++) {
+        sum += h[i];
+    }
+    snprintf((char *)h + TAR_CHKSUM, 7, "%06o", sum);
+    return true;
+}
+
+static bool _write(NetBuf_t *data, const uint8_t *buf, int len, clip_archive_stats_t *st)
+{
+    if (getFtpClient()->ftpClientWrite(buf, len, data) < len) {
+        return false;
+    }
+    st->wire_bytes += len;
+    return true;
+}
+
+/* Header, contents and padding of one member, false when the stream is broken */
+static bool _put_member(NetBuf_t *data, const char *path, const struct stat *st,
+                        uint8_t *buf, clip_archive_stats_t *stats)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        ESP_LOGE(TAG, "Cannot open %s", path);
+        return false;
+    }
+    _header(buf, _basename(path), st);
+    bool ok = _write(data, buf, CLIP_ARCHIVE_BLOCK_SIZE, stats);
+    size_t left = st->st_size;
+    while (ok && left > 0) {
+        size_t n = fread(buf, 1, left < FTP_CLIENT_BUFFER_SIZE ? left : FTP_CLIENT_BUFFER_SIZE, f);
+        if (n == 0) {
+            ESP_LOGE(TAG, "%s ended %u bytes early", path, (unsigned)left);
+            ok = false;
+            break;
+        }
+        ok = _write(data, buf, n, stats);
+        left -= n;
+    }
+    fclose(f);
+    int pad = (CLIP_ARCHIVE_BLOCK_SIZE - st->st_size % CLIP_ARCHIVE_BLOCK_SIZE) % CLIP_ARCHIVE_BLOCK_SIZE;
+    if (ok && pad) {
+        memset(buf, 0, pad);
+        ok = _write(data, buf, pad, stats);
+    }
+    if (ok) {
+        stats->files++;
+        stats->bytes += st->st_size;
+    }
+    return ok;
+}
+
+esp_err_t clip_archive_put(NetBuf_t *ctrl, const char *remote, const char *const *paths, int count,
+                           bool *included, clip_archive_stats_t *stats)
+{
+    clip_archive_stats_t st = { 0 };
+    int64_t start = esp_timer_get_time();
+    if (included) {
+        memset(included, 0, count * sizeof(*included));
+    }
+    int present = 0;
+    for (int i = 0; i < count; i++) {
+        struct stat s;
+        if (stat(paths[i], &s) == 0 && strlen(_basename(paths[i])) < TAR_NAME_SIZE) {
+            present++;
+        }
+    }
+    if (present == 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    uint8_t *buf = audio_malloc(FTP_CLIENT_BUFFER_SIZE);
+    if (buf == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    FtpClient *ftp = getFtpClient();
+    NetBuf_t *data = NULL;
+    if (!ftp->ftpClientAccess(remote, FTP_CLIENT_FILE_WRITE, FTP_CLIENT_BINARY, ctrl, &data)) {
+        ESP_LOGE(TAG, "STOR %s failed: %s", remote, ftp->ftpClientGetLastResponse(ctrl));
+        audio_free(buf);
+        return ESP_FAIL;
+    }
+    bool ok = true;
+    for (int i = 0; ok && i < count; i++) {
+        struct stat s;
+        if (stat(paths[i], &s) != 0 || strlen(_basename(paths[i])) >= TAR_NAME_SIZE) {
+            ESP_LOGW(TAG, "Skipping %s", paths[i]);
+            continue;
+        }
+        ok = _put_member(data, paths[i], &s, buf, &st);
+        if (ok && included) {
+            included[i] = true;
+        }
+    }
+    if (ok) {
+        memset(buf, 0, 2 * CLIP_ARCHIVE_BLOCK_SIZE);
+        ok = _write(data, buf, 2 * CLIP_ARCHIVE_BLOCK_SIZE, &st);
+    }
+    audio_free(buf);
+    if (!ftp->ftpClientClose(data) || !ok) {
+        ESP_LOGE(TAG, "Archive %s failed after %d clips: %s", remote, st.files,
+                 ftp->ftpClientGetLastResponse(ctrl));
+        if (included) {
+            memset(included, 0, count * sizeof(*included));
+        }
+        return ESP_FAIL;
+    }
+    st.elapsed_us = esp_timer_get_time() - start;
+    if (stats) {
+        *stats = st;
+    }
+    return ESP_OK;
+}
+
+void clip_archive_log_stats(const char *label, const clip_archive_stats_t *stats)
+{
+    if (stats->elapsed_us <= 0) {
+        return;
+    }
+    ESP_LOGI(TAG, "%s: %d clips, %" PRIu64 " bytes in %" PRId64 " ms, %.2f files/s, %.3f MB/s (%u%% tar overhead)",
+             label, stats->files, stats->bytes, stats->elapsed_us / 1000,
+             stats->files * 1e6 / stats->elapsed_us, stats->bytes / (double)stats->elapsed_us,
+             stats->bytes ? (unsigned)((stats->wire_bytes - stats->bytes) * 100 / stats->bytes) : 0);
+}
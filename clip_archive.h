@@ -0,0 +1,60 @@
+/*
+ * clip_archive - many clips uploaded as one tar stream
+ *
+ * Every STOR costs a PASV round trip, a new data connection with its own TCP
+ * slow start and the 150/226 replies, which for 10 s clips is about as long
+ * as sending the audio. clip_archive_put() writes the clips into a single
+ * STOR as a POSIX ustar archive instead: a 512 byte header per clip, the clip
+ * itself padded to 512 bytes and two zero blocks at the end. The NAS unpacks
+ * it with plain `tar -xf`; members carry the clip's base name, size and
+ * modification time.
+ *
+ * A clip that cannot be stat()ed is left out (and not counted); a read error
+ * after its header went out aborts the archive, since the sizes in the stream
+ * can no longer be met.
+ */
+
+#ifndef CLIP_ARCHIVE_H_
+#define CLIP_ARCHIVE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "FtpClient.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CLIP_ARCHIVE_BLOCK_SIZE             512
+
+typedef struct {
+    int      files;             /* Clips in the archive */
+    uint64_t bytes;             /* Clip payload, without tar headers and padding */
+    uint64_t wire_bytes;        /* Everything sent on the data connection */
+    int64_t  elapsed_us;        /* From STOR to the final reply */
+} clip_archive_stats_t;
+
+/**
+ * @brief  STOR the files in paths as one tar archive named remote
+ *
+ * @param  included   optional, count entries set to true for the clips that
+ *                    went into the archive
+ * @param  stats      optional
+ *
+ * @return ESP_OK when the server confirmed the archive, ESP_ERR_NOT_FOUND when
+ *         none of the files exists, ESP_FAIL otherwise
+ */
+esp_err_t clip_archive_put(NetBuf_t *ctrl, const char *remote, const char *const *paths, int count,
+                           bool *included, clip_archive_stats_t *stats);
+
+/**
+ * @brief  Log files per second and MB/s of a transfer under label
+ */
+void clip_archive_log_stats(const char *label, const clip_archive_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CLIP_ARCHIVE_H_ */
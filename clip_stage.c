@@ -0,0 +1,255 @@
+/*
+ * clip_stage - PSRAM staging of finished clips for online sites
+ *
+ * The arena is used as a ring: clips are placed at head, behind the oldest
+ * live clip, wrapping to the start when the end has no room. A clip released
+ * out of order leaves a hole until the clips before it are gone too.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "clip_stage.h"
+
+static const char *TAG = "CLIP_STAGE";
+
+typedef enum {
+    CLIP_FREE = 0,
+    CLIP_WRITING,
+    CLIP_READY,
+    CLIP_TAKEN,
+} clip_state_t;
+
+struct clip_stage_clip {
+    char            path[CLIP_STAGE_PATH_MAX];
+    clip_state_t    state;
+    uint32_t        seq;            /* Allocation order */
+    size_t          offset;
+    size_t          capacity;
+    size_t          size;
+};
+
+static struct {
+    uint8_t             *arena;
+    size_t              size;
+    size_t              head;
+    size_t              used;
+    uint32_t            seq;
+    clip_stage_clip_t   clips[CLIP_STAGE_MAX_CLIPS];
+    SemaphoreHandle_t   lock;
+    clip_stage_stats_t  stats;
+} s_stage;
+
+static clip_stage_clip_t *_oldest(void)
+{
+    clip_stage_clip_t *oldest = NULL;
+    for (int i = 0; i < CLIP_STAGE_MAX_CLIPS; i++) {
+        clip_stage_clip_t *c = &s_stage.clips[i];
+        if (c->state != CLIP_FREE && (oldest == NULL || (int32_t)(c->seq - oldest->seq) < 0)) {
+            oldest = c;
+        }
+    }
+    return oldest;
+}
+
+/* Offset for capacity bytes behind head, -1 when they do not fit */
+static long _place(size_t capacity)
+{
+    clip_stage_clip_t *oldest = _oldest();
+    if (oldest == NULL) {
+        s_stage.head = 0;
+        return capacity <= s_stage.size ? 0 : -1;
+    }
+    size_t tail = oldest->offset;
+    if (s_stage.head > tail) {
+        if (s_stage.size - s_stage.head >= capacity) {
+            return s_stage.head;
+        }
+        return tail >= capacity ? 0 : -1;
+    }
+    return tail - s_stage.head >= capacity ? (long)s_stage.head : -1;
+}
+
+static void _release(clip_stage_clip_t *clip)
+{
+    xSemaphoreTake(s_stage.lock, portMAX_DELAY);
+    s_stage.used -= clip->capacity;
+    clip->state = CLIP_FREE;
+    if (_oldest() == NULL) {
+        s_stage.head = 0;
+    }
+    xSemaphoreGive(s_stage.lock);
+}
+
+esp_err_t clip_stage_init(size_t arena_size)
+{
+    if (s_stage.arena) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    arena_size &= ~(size_t)3;
+    s_stage.lock = xSemaphoreCreateMutex();
+    if (s_stage.lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    s_stage.arena = heap_caps_malloc(arena_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (s_stage.arena == NULL) {
+        ESP_LOGE(TAG, "No PSRAM for a %u byte arena", (unsigned)arena_size);
+        vSemaphoreDelete(s_stage.lock);
+        s_stage.lock = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    s_stage.size = arena_size;
+    s_stage.stats.arena_size = arena_size;
+    ESP_LOGI(TAG, "Arena of %u bytes in PSRAM", (unsigned)arena_size);
+    return ESP_OK;
+}
+
+clip_stage_clip_t *clip_stage_alloc(const char *path, size_t capacity)
+{
+    if (s_stage.arena == NULL || strlen(path) >= CLIP_STAGE_PATH_MAX) {
+        return NULL;
+    }
+    capacity = (capacity + 3) & ~(size_t)3;
+    clip_stage_clip_t *clip = NULL;
+    xSemaphoreTake(s_stage.lock, portMAX_DELAY);
+    long offset = _place(capacity);
+    for (int i = 0; offset >= 0 && i < CLIP_STAGE_MAX_CLIPS; i++) {
+        if (s_stage.clips[i].state == CLIP_FREE) {
+            clip = &s_stage.clips[i];
+            break;
+        }
+    }
+    if (clip) {
+        strcpy(clip->path, path);
+        clip->state = CLIP_WRITING;
+        clip->seq = s_stage.seq++;
+        clip->offset = offset;
+        clip->capacity = capacity;
+        clip->size = 0;
+        s_stage.head = offset + capacity;
+        s_stage.used += capacity;
+        if (s_stage.used > s_stage.stats.arena_peak) {
+            s_stage.stats.arena_peak = s_stage.used;
+        }
+    } else {
+        s_stage.stats.spilled_full++;
+    }
+    xSemaphoreGive(s_stage.lock);
+    if (clip == NULL) {
+        ESP_LOGW(TAG, "Arena full (%u of %u bytes used), %s goes to the card",
+                 (unsigned)s_stage.used, (unsigned)s_stage.size, path);
+    }
+    return clip;
+}
+
+uint8_t *clip_stage_data(clip_stage_clip_t *clip, size_t *capacity)
+{
+    *capacity = clip->capacity;
+    return s_stage.arena + clip->offset;
+}
+
+void clip_stage_commit(clip_stage_clip_t *clip, size_t size)
+{
+    xSemaphoreTake(s_stage.lock, portMAX_DELAY);
+    clip->size = size;
+    clip->state = CLIP_READY;
+    s_stage.stats.staged++;
+    xSemaphoreGive(s_stage.lock);
+}
+
+clip_stage_clip_t *clip_stage_take(const char *path, const uint8_t **data, size_t *size)
+{
+    if (s_stage.arena == NULL) {
+        return NULL;
+    }
+    clip_stage_clip_t *clip = NULL;
+    xSemaphoreTake(s_stage.lock, portMAX_DELAY);
+    for (int i = 0; i < CLIP_STAGE_MAX_CLIPS; i++) {
+        clip_stage_clip_t *c = &s_stage.clips[i];
+        if (c->state == CLIP_READY && strcmp(c->path, path) == 0) {
+            c->state = CLIP_TAKEN;
+            clip = c;
+            break;
+        }
+    }
+    xSemaphoreGive(s_stage.lock);
+    if (clip) {
+        *data = s_stage.arena + clip->offset;
+        *size = clip->size;
+    }
+    return clip;
+}
+
+void clip_stage_uploaded(clip_stage_clip_t *clip)
+{
+    s_stage.stats.uploaded++;
+    s_stage.stats.bytes_uploaded += clip->size;
+    _release(clip);
+}
+
+void clip_stage_put_back(clip_stage_clip_t *clip)
+{
+    xSemaphoreTake(s_stage.lock, portMAX_DELAY);
+    clip->state = CLIP_READY;
+    xSemaphoreGive(s_stage.lock);
+}
+
+esp_err_t clip_stage_spill(clip_stage_clip_t *clip)
+{
+    esp_err_t ret = ESP_OK;
+    FILE *f = fopen(clip->path, "wb");
+    if (f == NULL || fwrite(s_stage.arena + clip->offset, 1, clip->size, f) != clip->size) {
+        ESP_LOGE(TAG, "Failed to spill %s, clip lost", clip->path);
+        ret = ESP_FAIL;
+    }
+    if (f) {
+        fclose(f);
+    }
+    if (ret == ESP_OK) {
+        s_stage.stats.spilled_offline++;
+        s_stage.stats.bytes_spilled += clip->size;
+        ESP_LOGI(TAG, "Spilled %s (%u bytes)", clip->path, (unsigned)clip->size);
+    }
+    _release(clip);
+    return ret;
+}
+
+int clip_stage_spill_all(void)
+{
+    int count = 0;
+    for (int i = 0; s_stage.arena && i < CLIP_STAGE_MAX_CLIPS; i++) {
+        clip_stage_clip_t *clip = &s_stage.clips[i];
+        xSemaphoreTake(s_stage.lock, portMAX_DELAY);
+        bool ready = clip->state == CLIP_READY;
+        if (ready) {
+            clip->state = CLIP_TAKEN;
+        }
+        xSemaphoreGive(s_stage.lock);
+        if (ready && clip_stage_spill(clip) == ESP_OK) {
+            count++;
+        }
+    }
+    return count;
+}
+
+void clip_stage_get_stats(clip_stage_stats_t *stats)
+{
+    memcpy(stats, &s_stage.stats, sizeof(*stats));
+}
+
+void clip_stage_log_stats(void)
+{
+    clip_stage_stats_t st;
+    clip_stage_get_stats(&st);
+    uint32_t total = st.uploaded + st.spilled_full + st.spilled_offline;
+    if (total == 0) {
+        return;
+    }
+    ESP_LOGI(TAG, "%u clips: %u from memory (hit %u%%), %u spilled full, %u spilled offline (spill %u%%), peak %u of %u bytes",
+             total, st.uploaded, st.uploaded * 100 / total, st.spilled_full, st.spilled_offline,
+             (st.spilled_full + st.spilled_offline) * 100 / total,
+             (unsigned)st.arena_peak, (unsigned)st.arena_size);
+}
@@ -0,0 +1,101 @@
+/*
+ * clip_stage - PSRAM staging of finished clips for online sites
+ *
+ * A single arena in PSRAM holds whole clips under their SD card name, so a
+ * segment can go from sd_wav_writer straight to the FTP data connection
+ * without touching the card. Clips are carved out of the arena in FIFO order
+ * and released when uploaded. A clip spills to the card (same path) only when
+ * the arena has no room for the next segment or the NAS cannot be reached;
+ * clip_stage_spill_all() saves the rest before deep sleep.
+ *
+ * Stats: hit rate = uploaded / (uploaded + spilled_full + spilled_offline),
+ * spill rate is the rest.
+ */
+
+#ifndef CLIP_STAGE_H_
+#define CLIP_STAGE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CLIP_STAGE_MAX_CLIPS                8
+#define CLIP_STAGE_PATH_MAX                 128
+
+/* Room kept behind the audio for trailer chunks */
+#define CLIP_STAGE_TRAILER_RESERVE          (4 * 1024)
+
+typedef struct clip_stage_clip clip_stage_clip_t;
+
+typedef struct {
+    uint32_t staged;            /* Clips written to the arena */
+    uint32_t uploaded;          /* Clips uploaded from the arena */
+    uint32_t spilled_full;      /* Segments written to the card because the arena was full */
+    uint32_t spilled_offline;   /* Staged clips moved to the card because the NAS was unreachable */
+    uint64_t bytes_uploaded;
+    uint64_t bytes_spilled;
+    size_t   arena_size;
+    size_t   arena_peak;        /* Most bytes in use at once */
+} clip_stage_stats_t;
+
+/**
+ * @brief  Allocate the arena, arena_size is rounded down to 4 bytes
+ */
+esp_err_t clip_stage_init(size_t arena_size);
+
+/**
+ * @brief  Reserve capacity bytes for the clip that would be written to path.
+ *         Returns NULL when the arena is full (counted as spilled_full, the
+ *         caller writes to the card instead) or not initialised.
+ */
+clip_stage_clip_t *clip_stage_alloc(const char *path, size_t capacity);
+
+/**
+ * @brief  Buffer of a clip being written and its capacity
+ */
+uint8_t *clip_stage_data(clip_stage_clip_t *clip, size_t *capacity);
+
+/**
+ * @brief  Mark the clip complete with size bytes, it can be found from now on
+ */
+void clip_stage_commit(clip_stage_clip_t *clip, size_t size);
+
+/**
+ * @brief  Take the complete clip staged for path, NULL if it is on the card.
+ *         The clip stays reserved until clip_stage_uploaded() or clip_stage_spill().
+ */
+clip_stage_clip_t *clip_stage_take(const char *path, const uint8_t **data, size_t *size);
+
+/**
+ * @brief  Release a taken clip after a successful upload
+ */
+void clip_stage_uploaded(clip_stage_clip_t *clip);
+
+/**
+ * @brief  Return a taken clip to the arena, e.g. after a transient error
+ */
+void clip_stage_put_back(clip_stage_clip_t *clip);
+
+/**
+ * @brief  Write a taken clip to its path on the card and release it
+ */
+esp_err_t clip_stage_spill(clip_stage_clip_t *clip);
+
+/**
+ * @brief  Spill every complete clip, call before deep sleep
+ */
+int clip_stage_spill_all(void);
+
+void clip_stage_get_stats(clip_stage_stats_t *stats);
+void clip_stage_log_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CLIP_STAGE_H_ */
@@ -0,0 +1,696 @@
+/*
+ * clip_store - date-sharded clip layout on the SD card with an on-card index
+ *
+ * Records are 64 bytes, so none straddles a sector and a state update or an
+ * append touches a single sector.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "clip_store.h"
+
+static const char *TAG = "CLIP_STORE";
+
+#define CLIP_STORE_MAGIC                    0x434c4958      /* "CLIX" */
+#define CLIP_STORE_TMP_NAME                 "clips.tmp"
+#define CLIP_STORE_BLOCK                    8               /* Records per read, one sector */
+#define CLIP_STORE_MIGRATE_BATCH            32
+#define CLIP_STORE_STATE_OFFSET             8
+#define CLIP_STORE_CLASS(score)             ((score) * CLIP_STORE_CLASSES / 256)
+
+/* Cursors: first record of each kind, records when there is none */
+#define CLIP_STORE_CURSOR_LIVE              0               /* Not DELETED */
+#define CLIP_STORE_CURSOR_PENDING           1               /* RECORDING or PENDING */
+#define CLIP_STORE_CURSOR_CLASS             2               /* + class: not DELETED, in that score class */
+#define CLIP_STORE_CURSORS                  (CLIP_STORE_CURSOR_CLASS + CLIP_STORE_CLASSES)
+
+typedef struct {
+    uint32_t    time;
+    uint32_t    size;
+    uint8_t     state;
+    uint8_t     check;                      /* XOR of every byte but state and check */
+    uint8_t     score;
+    uint8_t     reserved;
+    char        name[CLIP_STORE_NAME_MAX];  /* Path under root */
+} clip_store_record_t;
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    records;                    /* Index length the hints belong to */
+    uint32_t    last_time;                  /* Last record, so the index of another */
+    uint8_t     last_check;                 /* card with as many records does not match */
+    uint32_t    cursor[CLIP_STORE_CURSORS];
+} clip_store_hint_t;
+
+RTC_DATA_ATTR static clip_store_hint_t s_hint;
+
+static struct {
+    char                root[CLIP_STORE_PATH_MAX - CLIP_STORE_NAME_MAX];
+    FILE                *f;
+    uint32_t            records;
+    uint32_t            last_time;          /* Of the last record, for the hint */
+    uint8_t             last_check;
+    uint32_t            cursor[CLIP_STORE_CURSORS];
+    char                day[12];            /* Last day directory made, "YYYY/MM/DD" */
+    SemaphoreHandle_t   lock;
+} s_store;
+
+static uint8_t _check(const clip_store_record_t *r)
+{
+    const uint8_t *p = (const uint8_t *)r;
+    uint8_t x = 0x5a;
+    for (int i = 0; i < sizeof(*r); i++) {
+        if (i != CLIP_STORE_STATE_OFFSET && i != CLIP_STORE_STATE_OFFSET + 1) {
+            x ^= p[i];
+        }
+    }
+    return x;
+}
+
+static bool _valid(const clip_store_record_t *r)
+{
+    return r->check == _check(r) && r->name[0] && memchr(r->name, '\0', sizeof(r->name))
+           && r->state <= CLIP_STORE_DELETED;
+}
+
+/* "YYYY.MM.DD.HH.MM.SS.ext" */
+static bool _parse_name(const char *base, struct tm *tm)
+{
+    int n = 0;
+    memset(tm, 0, sizeof(*tm));
+    if (!isdigit((unsigned char)base[0])
+        || sscanf(base, "%4d.%2d.%2d.%2d.%2d.%2d%n", &tm->tm_year, &tm->tm_mon, &tm->tm_mday,
+                  &tm->tm_hour, &tm->tm_min, &tm->tm_sec, &n) != 6
+        || n != 19 || base[19] != '.' || strlen(base) > 19 + 5) {
+        return false;
+    }
+    tm->tm_year -= 1900;
+    tm->tm_mon -= 1;
+    tm->tm_isdst = -1;
+    return true;
+}
+
+static bool _digits(const char *s, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (!isdigit((unsigned char)s[i])) {
+            return false;
+        }
+    }
+    return s[count] == '\0';
+}
+
+/* Path under root, NULL when path is not below it */
+static const char *_name_of(const char *path)
+{
+    size_t len = strlen(s_store.root);
+    if (strncmp(path, s_store.root, len) != 0 || path[len] != '/') {
+        return NULL;
+    }
+    return path + len + 1;
+}
+
+/* Create the day directory of name ("YYYY/MM/DD/...") */
+static esp_err_t _make_day(const char *name)
+{
+    if (strncmp(s_store.day, name, 10) == 0) {
+        return ESP_OK;
+    }
+    static const int levels[] = { 4, 7, 10 };
+    for (int i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+        char dir[CLIP_STORE_PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s/%.*s", s_store.root, levels[i], name);
+        if (mkdir(dir, 0775) != 0 && errno != EEXIST) {
+            ESP_LOGE(TAG, "Failed to create %s (%d)", dir, errno);
+            return ESP_FAIL;
+        }
+    }
+    memcpy(s_store.day, name, 10);
+    s_store.day[10] = '\0';
+    return ESP_OK;
+}
+
+static int _read(uint32_t first, clip_store_record_t *buf, int count)
+{
+    if (first >= s_store.records) {
+        return 0;
+    }
+    if (count > s_store.records - first) {
+        count = s_store.records - first;
+    }
+    if (fseek(s_store.f, (long)first * sizeof(*buf), SEEK_SET) != 0) {
+        return 0;
+    }
+    return fread(buf, sizeof(*buf), count, s_store.f);
+}
+
+static esp_err_t _sync(FILE *f)
+{
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static bool _match(const clip_store_record_t *r, int cursor)
+{
+    if (!_valid(r)) {
+        return false;
+    }
+    if (cursor == CLIP_STORE_CURSOR_PENDING) {
+        /* A clip being recorded becomes PENDING in place, the cursor must not pass it */
+        return r->state <= CLIP_STORE_PENDING;
+    }
+    return r->state != CLIP_STORE_DELETED
+           && (cursor == CLIP_STORE_CURSOR_LIVE || CLIP_STORE_CLASS(r->score) == cursor - CLIP_STORE_CURSOR_CLASS);
+}
+
+/* A torn record at the end (power loss) is overwritten */
+static esp_err_t _append(const clip_store_record_t *r)
+{
+    if (fseek(s_store.f, (long)s_store.records * sizeof(*r), SEEK_SET) != 0
+        || fwrite(r, sizeof(*r), 1, s_store.f) != 1 || _sync(s_store.f) != ESP_OK) {
+        ESP_LOGE(TAG, "Index append failed (%d)", errno);
+        return ESP_FAIL;
+    }
+    s_store.last_time = r->time;
+    s_store.last_check = r->check;
+    /* A cursor with nothing to point at stays behind the last record */
+    for (int k = 0; k < CLIP_STORE_CURSORS; k++) {
+        if (s_store.cursor[k] == s_store.records && !_match(r, k)) {
+            s_store.cursor[k]++;
+        }
+    }
+    s_store.records++;
+    return ESP_OK;
+}
+
+/* Replace the last record, a clip_store_open() one, with the finished clip */
+static esp_err_t _finish(const clip_store_record_t *r)
+{
+    uint32_t record = s_store.records - 1;
+    if (fseek(s_store.f, (long)record * sizeof(*r), SEEK_SET) != 0
+        || fwrite(r, sizeof(*r), 1, s_store.f) != 1 || _sync(s_store.f) != ESP_OK) {
+        ESP_LOGE(TAG, "Index update failed (%d)", errno);
+        return ESP_FAIL;
+    }
+    s_store.last_time = r->time;
+    s_store.last_check = r->check;
+    /* The score may have moved it to another class; a cursor past it had nothing to point at */
+    for (int k = 0; k < CLIP_STORE_CURSORS; k++) {
+        if (s_store.cursor[k] > record && _match(r, k)) {
+            s_store.cursor[k] = record;
+        } else if (s_store.cursor[k] == record && !_match(r, k)) {
+            s_store.cursor[k] = s_store.records;
+        }
+    }
+    return ESP_OK;
+}
+
+/* Last record, if it is a clip still RECORDING */
+static bool _recording(clip_store_record_t *r)
+{
+    return s_store.records > 0 && _read(s_store.records - 1, r, 1) == 1
+           && _valid(r) && r->state == CLIP_STORE_RECORDING;
+}
+
+/* Count the records and take the last one, a torn tail is not counted */
+static void _load_tail(void)
+{
+    clip_store_record_t r;
+    s_store.records = 0;
+    if (fseek(s_store.f, 0, SEEK_END) == 0) {
+        s_store.records = ftell(s_store.f) / sizeof(r);
+    }
+    s_store.last_time = 0;
+    s_store.last_check = 0;
+    if (_read(s_store.records - 1, &r, 1) == 1) {
+        s_store.last_time = r.time;
+        s_store.last_check = r.check;
+    }
+}
+
+static void _save_hint(void)
+{
+    s_hint.magic = CLIP_STORE_MAGIC;
+    s_hint.records = s_store.records;
+    s_hint.last_time = s_store.last_time;
+    s_hint.last_check = s_store.last_check;
+    memcpy(s_hint.cursor, s_store.cursor, sizeof(s_hint.cursor));
+}
+
+static bool _hint_matches(void)
+{
+    return s_hint.magic == CLIP_STORE_MAGIC && s_hint.records == s_store.records
+           && s_hint.last_time == s_store.last_time && s_hint.last_check == s_store.last_check;
+}
+
+/* Move cursor k forward to the next record it matches */
+static void _advance(int k)
+{
+    clip_store_record_t buf[CLIP_STORE_BLOCK];
+    int n;
+    while ((n = _read(s_store.cursor[k], buf, CLIP_STORE_BLOCK)) > 0) {
+        for (int i = 0; i < n; i++) {
+            if (_match(&buf[i], k)) {
+                return;
+            }
+            s_store.cursor[k]++;
+        }
+    }
+    s_store.cursor[k] = s_store.records;
+}
+
+/* Set every cursor in one pass over the index */
+static void _rescan(void)
+{
+    clip_store_record_t buf[CLIP_STORE_BLOCK];
+    int open = CLIP_STORE_CURSORS;
+    int n;
+    for (int k = 0; k < CLIP_STORE_CURSORS; k++) {
+        s_store.cursor[k] = s_store.records;
+    }
+    for (uint32_t rec = 0; open > 0 && (n = _read(rec, buf, CLIP_STORE_BLOCK)) > 0; rec += n) {
+        for (int i = 0; i < n; i++) {
+            for (int k = 0; k < CLIP_STORE_CURSORS; k++) {
+                if (s_store.cursor[k] == s_store.records && _match(&buf[i], k)) {
+                    s_store.cursor[k] = rec + i;
+                    open--;
+                }
+            }
+        }
+    }
+}
+
+static void _entry(uint32_t record, const clip_store_record_t *r, clip_store_entry_t *entry)
+{
+    entry->record = record;
+    entry->time = r->time;
+    entry->size = r->size;
+    entry->state = r->state;
+    entry->score = r->score;
+    snprintf(entry->path, sizeof(entry->path), "%s/%s", s_store.root, r->name);
+}
+
+static esp_err_t _record(const char *name, clip_store_state_t state, uint8_t score, clip_store_record_t *r)
+{
+    struct tm tm;
+    const char *base = strrchr(name, '/');
+    if (strlen(name) >= CLIP_STORE_NAME_MAX || !_parse_name(base ? base + 1 : name, &tm)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    char path[CLIP_STORE_PATH_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", s_store.root, name);
+    memset(r, 0, sizeof(*r));
+    r->time = mktime(&tm);
+    /* Nothing to stat before the file is created */
+    r->size = state != CLIP_STORE_RECORDING && stat(path, &st) == 0 ? st.st_size : 0;
+    r->state = state;
+    r->score = score;
+    strcpy(r->name, name);
+    r->check = _check(r);
+    return ESP_OK;
+}
+
+static esp_err_t _add(const char *name, clip_store_state_t state, uint8_t score)
+{
+    clip_store_record_t r;
+    esp_err_t ret = _record(name, state, score, &r);
+    return ret == ESP_OK ? _append(&r) : ret;
+}
+
+/* Move clips of the flat layout into their day directory */
+static int _migrate_flat(void)
+{
+    int moved = 0;
+    while (1) {
+        char names[CLIP_STORE_MIGRATE_BATCH][32];
+        int n = 0;
+        struct tm tm;
+        DIR *dir = opendir(s_store.root);
+        if (dir == NULL) {
+            break;
+        }
+        struct dirent *e;
+        while (n < CLIP_STORE_MIGRATE_BATCH && (e = readdir(dir)) != NULL) {
+            if (strlen(e->d_name) < sizeof(names[0]) && _parse_name(e->d_name, &tm)) {
+                strcpy(names[n++], e->d_name);
+            }
+        }
+        closedir(dir);
+        for (int i = 0; i < n; i++) {
+            char name[CLIP_STORE_NAME_MAX];
+            char from[CLIP_STORE_PATH_MAX];
+            char to[CLIP_STORE_PATH_MAX];
+            _parse_name(names[i], &tm);
+            strftime(name, sizeof(name), "%Y/%m/%d/", &tm);
+            strcat(name, names[i]);
+            if (snprintf(from, sizeof(from), "%s/%s", s_store.root, names[i]) >= (int)sizeof(from)
+                || snprintf(to, sizeof(to), "%s/%s", s_store.root, name) >= (int)sizeof(to)
+                || _make_day(name) != ESP_OK || rename(from, to) != 0) {
+                /* Leave the rest where it is rather than retry the same file forever */
+                ESP_LOGE(TAG, "Failed to move %s to %s (%d)", from, to, errno);
+                return moved;
+            }
+            moved++;
+        }
+        if (n < CLIP_STORE_MIGRATE_BATCH) {
+            break;
+        }
+    }
+    return moved;
+}
+
+/* Add every clip below rel (depth 0: root, 1: year, 2: month, 3: day) as PENDING */
+static int _add_dir(const char *rel, int depth)
+{
+    static const int digits[] = { 4, 2, 2 };
+    char dir[CLIP_STORE_PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s%s%s", s_store.root, rel[0] ? "/" : "", rel);
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return 0;
+    }
+    int count = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        char name[CLIP_STORE_NAME_MAX];
+        if (snprintf(name, sizeof(name), "%s%s%s", rel, rel[0] ? "/" : "", e->d_name) >= sizeof(name)) {
+            continue;
+        }
+        if (depth < 3) {
+            if (_digits(e->d_name, digits[depth])) {
+                count += _add_dir(name, depth + 1);
+            }
+        } else if (_add(name, CLIP_STORE_PENDING, CLIP_STORE_SCORE_UNKNOWN) == ESP_OK) {
+            count++;
+        }
+    }
+    closedir(d);
+    return count;
+}
+
+/* Drop the deleted records in front of the index */
+static void _compact(void)
+{
+    if (s_store.cursor[CLIP_STORE_CURSOR_LIVE] < CLIP_STORE_COMPACT_RECORDS) {
+        return;
+    }
+    char index[CLIP_STORE_PATH_MAX];
+    char tmp[CLIP_STORE_PATH_MAX];
+    snprintf(index, sizeof(index), "%s/%s", s_store.root, CLIP_STORE_INDEX_NAME);
+    snprintf(tmp, sizeof(tmp), "%s/%s", s_store.root, CLIP_STORE_TMP_NAME);
+    FILE *out = fopen(tmp, "wb");
+    if (out == NULL) {
+        return;
+    }
+    int64_t start = esp_timer_get_time();
+    uint32_t kept = 0;
+    bool ok = true;
+    clip_store_record_t buf[CLIP_STORE_BLOCK];
+    int n;
+    for (uint32_t rec = s_store.cursor[CLIP_STORE_CURSOR_LIVE]; ok && (n = _read(rec, buf, CLIP_STORE_BLOCK)) > 0; rec += n) {
+        for (int i = 0; ok && i < n; i++) {
+            if (_valid(&buf[i]) && buf[i].state != CLIP_STORE_DELETED) {
+                ok = fwrite(&buf[i], sizeof(buf[i]), 1, out) == 1;
+                kept++;
+            }
+        }
+    }
+    ok = ok && _sync(out) == ESP_OK;
+    fclose(out);
+    if (!ok) {
+        ESP_LOGW(TAG, "Compaction failed, keeping the index as it is");
+        unlink(tmp);
+        return;
+    }
+    /* FAT rename does not replace, clip_store_init() finishes a rename cut short */
+    fclose(s_store.f);
+    unlink(index);
+    rename(tmp, index);
+    s_store.f = fopen(index, "r+b");
+    ESP_LOGI(TAG, "Compacted index: %u of %u records kept, %lld ms", (unsigned)kept,
+             (unsigned)s_store.records, (long long)(esp_timer_get_time() - start) / 1000);
+    s_store.records = 0;
+    if (s_store.f) {
+        _load_tail();
+    }
+    _rescan();
+}
+
+esp_err_t clip_store_init(const char *root)
+{
+    if (s_store.lock) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (strlen(root) >= sizeof(s_store.root)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_store.lock = xSemaphoreCreateMutex();
+    if (s_store.lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    strcpy(s_store.root, root);
+
+    int64_t start = esp_timer_get_time();
+    char index[CLIP_STORE_PATH_MAX];
+    char tmp[CLIP_STORE_PATH_MAX];
+    struct stat st;
+    snprintf(index, sizeof(index), "%s/%s", root, CLIP_STORE_INDEX_NAME);
+    snprintf(tmp, sizeof(tmp), "%s/%s", root, CLIP_STORE_TMP_NAME);
+    if (stat(index, &st) != 0 && stat(tmp, &st) == 0) {
+        rename(tmp, index);
+    }
+    bool rebuilt = false;
+    s_store.f = fopen(index, "r+b");
+    if (s_store.f == NULL) {
+        s_store.f = fopen(index, "w+b");
+        if (s_store.f == NULL) {
+            ESP_LOGE(TAG, "Cannot create %s, clips are not indexed", index);
+            return ESP_FAIL;
+        }
+        rebuilt = true;
+        int moved = _migrate_flat();
+        int added = _add_dir("", 0);
+        ESP_LOGI(TAG, "Rebuilt %s: %d clips, %d moved out of %s", index, added, moved, root);
+    }
+    _load_tail();
+    if (!rebuilt && _hint_matches()) {
+        memcpy(s_store.cursor, s_hint.cursor, sizeof(s_store.cursor));
+    } else {
+        /* Cold boot or the card was changed: one pass over the index */
+        _rescan();
+    }
+    _compact();
+    _save_hint();
+    ESP_LOGI(TAG, "%u records, first live %u, first pending %u, %lld ms", (unsigned)s_store.records,
+             (unsigned)s_store.cursor[CLIP_STORE_CURSOR_LIVE], (unsigned)s_store.cursor[CLIP_STORE_CURSOR_PENDING],
+             (long long)(esp_timer_get_time() - start) / 1000);
+    return s_store.f ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t clip_store_path(time_t t, const char *ext, char *path, size_t len)
+{
+    if (s_store.lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    struct tm tm;
+    char name[CLIP_STORE_NAME_MAX];
+    localtime_r(&t, &tm);
+    size_t n = strftime(name, sizeof(name), "%Y/%m/%d/%Y.%m.%d.%H.%M.%S", &tm);
+    if (n == 0 || n + strlen(ext) >= sizeof(name)
+        || snprintf(path, len, "%s/%s%s", s_store.root, name, ext) >= len) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    xSemaphoreTake(s_store.lock, portMAX_DELAY);
+    esp_err_t ret = _make_day(name);
+    xSemaphoreGive(s_store.lock);
+    return ret;
+}
+
+esp_err_t clip_store_open(const char *path)
+{
+    if (s_store.f == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    const char *name = _name_of(path);
+    if (name == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    xSemaphoreTake(s_store.lock, portMAX_DELAY);
+    esp_err_t ret = _add(name, CLIP_STORE_RECORDING, CLIP_STORE_SCORE_UNKNOWN);
+    _save_hint();
+    xSemaphoreGive(s_store.lock);
+    return ret;
+}
+
+esp_err_t clip_store_add(const char *path, uint8_t score)
+{
+    if (s_store.f == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    const char *name = _name_of(path);
+    if (name == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    clip_store_record_t last;
+    clip_store_record_t r;
+    xSemaphoreTake(s_store.lock, portMAX_DELAY);
+    esp_err_t ret = _record(name, CLIP_STORE_PENDING, score, &r);
+    if (ret == ESP_OK) {
+        ret = _recording(&last) && strcmp(last.name, name) == 0 ? _finish(&r) : _append(&r);
+    }
+    _save_hint();
+    xSemaphoreGive(s_store.lock);
+    return ret;
+}
+
+esp_err_t clip_store_interrupted(clip_store_entry_t *entry)
+{
+    if (s_store.f == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    clip_store_record_t r;
+    xSemaphoreTake(s_store.lock, portMAX_DELAY);
+    if (_recording(&r)) {
+        _entry(s_store.records - 1, &r, entry);
+        ret = ESP_OK;
+    }
+    xSemaphoreGive(s_store.lock);
+    return ret;
+}
+
+esp_err_t clip_store_find(const char *path, clip_store_entry_t *entry)
+{
+    if (s_store.f == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    const char *name = _name_of(path);
+    if (name == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    clip_store_record_t buf[CLIP_STORE_BLOCK];
+    xSemaphoreTake(s_store.lock, portMAX_DELAY);
+    uint32_t low = s_store.cursor[CLIP_STORE_CURSOR_LIVE];
+    if (s_store.records > CLIP_STORE_FIND_RECORDS && low < s_store.records - CLIP_STORE_FIND_RECORDS) {
+        low = s_store.records - CLIP_STORE_FIND_RECORDS;
+    }
+    /* Newest first, a clip just closed is in the last block */
+    for (uint32_t end = s_store.records; ret != ESP_OK && end > low; ) {
+        uint32_t first = end - low > CLIP_STORE_BLOCK ? end - CLIP_STORE_BLOCK : low;
+        int n = _read(first, buf, end - first);
+        if (n <= 0) {
+            break;
+        }
+        for (int i = n - 1; i >= 0; i--) {
+            if (_valid(&buf[i]) && strcmp(buf[i].name, name) == 0) {
+                _entry(first + i, &buf[i], entry);
+                ret = ESP_OK;
+                break;
+            }
+        }
+        end = first;
+    }
+    xSemaphoreGive(s_store.lock);
+    return ret;
+}
+
+esp_err_t clip_store_set_state(const clip_store_entry_t *entry, clip_store_state_t state)
+{
+    if (s_store.f == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    const char *name = _name_of(entry->path);
+    clip_store_record_t r;
+    esp_err_t ret = ESP_OK;
+    xSemaphoreTake(s_store.lock, portMAX_DELAY);
+    if (name == NULL || _read(entry->record, &r, 1) != 1 || !_valid(&r) || strcmp(r.name, name) != 0) {
+        ret = ESP_ERR_NOT_FOUND;
+    } else if (state < r.state) {
+        ret = ESP_ERR_INVALID_ARG;
+    } else if (state != r.state) {
+        uint8_t b = state;
+        if (fseek(s_store.f, (long)entry->record * sizeof(r) + CLIP_STORE_STATE_OFFSET, SEEK_SET) != 0
+            || fwrite(&b, 1, 1, s_store.f) != 1 || _sync(s_store.f) != ESP_OK) {
+            ESP_LOGE(TAG, "Index update failed (%d)", errno);
+            ret = ESP_FAIL;
+        } else {
+            r.state = state;
+            for (int k = 0; k < CLIP_STORE_CURSORS; k++) {
+                if (s_store.cursor[k] == entry->record && !_match(&r, k)) {
+                    _advance(k);
+                }
+            }
+            _save_hint();
+        }
+    }
+    xSemaphoreGive(s_store.lock);
+    return ret;
+}
+
+void clip_store_uploaded(const char *path, bool removed)
+{
+    clip_store_entry_t entry;
+    if (clip_store_find(path, &entry) == ESP_OK) {
+        clip_store_set_state(&entry, removed ? CLIP_STORE_DELETED : CLIP_STORE_UPLOADED);
+    }
+}
+
+int clip_store_list(clip_store_state_t state, clip_store_entry_t *entries, int max)
+{
+    if (s_store.f == NULL) {
+        return 0;
+    }
+    int count = 0;
+    clip_store_record_t buf[CLIP_STORE_BLOCK];
+    xSemaphoreTake(s_store.lock, portMAX_DELAY);
+    uint32_t rec = s_store.cursor[state == CLIP_STORE_PENDING ? CLIP_STORE_CURSOR_PENDING : CLIP_STORE_CURSOR_LIVE];
+    int n;
+    while (count < max && (n = _read(rec, buf, CLIP_STORE_BLOCK)) > 0) {
+        for (int i = 0; i < n && count < max; i++) {
+            if (_valid(&buf[i]) && buf[i].state == state) {
+                _entry(rec + i, &buf[i], &entries[count++]);
+            }
+        }
+        rec += n;
+    }
+    xSemaphoreGive(s_store.lock);
+    return count;
+}
+
+esp_err_t clip_store_victim(bool by_score, time_t newest, clip_store_entry_t *entry)
+{
+    if (s_store.f == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    clip_store_record_t r;
+    xSemaphoreTake(s_store.lock, portMAX_DELAY);
+    /* Records are in recording order, the first of a cursor is its oldest */
+    int first = by_score ? CLIP_STORE_CURSOR_CLASS : CLIP_STORE_CURSOR_LIVE;
+    int last = by_score ? CLIP_STORE_CURSORS : CLIP_STORE_CURSOR_LIVE + 1;
+    for (int k = first; ret != ESP_OK && k < last; k++) {
+        uint32_t rec = s_store.cursor[k];
+        /* The clip being recorded is the newest, nothing older is left in k */
+        if (_read(rec, &r, 1) == 1 && _match(&r, k) && r.state != CLIP_STORE_RECORDING
+            && (time_t)r.time <= newest) {
+            _entry(rec, &r, entry);
+            ret = ESP_OK;
+        }
+    }
+    xSemaphoreGive(s_store.lock);
+    return ret;
+}
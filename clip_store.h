@@ -0,0 +1,151 @@
+/*
+ * clip_store - date-sharded clip layout on the SD card with an on-card index
+ *
+ * FAT looks names up by scanning the directory, so one flat /sdcard with
+ * months of clips makes every fopen, create and unlink slower (each long name
+ * takes several entries). Clips go to root/YYYY/MM/DD/ instead, a day of 47 s
+ * clips with their .mel files is a few thousand entries at most.
+ *
+ * root/clips.idx lists every clip in the order it was added, one fixed size
+ * record (time, path under root, size, state, score) each, so the uploader
+ * and retention find clips without reading a directory:
+ *
+ *   - new clips are appended, a torn record at the end is overwritten by the
+ *     next append
+ *   - the state only moves forward (RECORDING -> PENDING -> UPLOADED ->
+ *     DELETED) and is rewritten in place, one byte in one sector
+ *   - clip_store_open() appends a RECORDING record before the writer creates
+ *     the file, clip_store_add() of the same clip (the next clip added)
+ *     replaces it. After power loss the last record is still RECORDING and
+ *     clip_store_interrupted() returns it with one record read, no scan.
+ *   - cursors to the first PENDING record, the first live record and the
+ *     first live record of each score class are kept in RTC memory; scans
+ *     start there and only ever move them forward, so finding the oldest
+ *     clip of a class is one record read. After a cold boot, or when the
+ *     index (length and last record) is not the one they were saved for,
+ *     one sequential read of the index sets them again.
+ *   - at init, an index with more than CLIP_STORE_COMPACT_RECORDS deleted
+ *     records in front is rewritten without them
+ *
+ * Without an index (first boot with this firmware, new card) clips in the old
+ * flat layout are moved into their day directory and the index is rebuilt
+ * from the day directories, every clip PENDING.
+ *
+ * Size is 0 for a clip added while it was still in the clip_stage arena. The
+ * score (0 ... 255, higher is worth keeping longer) is given by the caller,
+ * e.g. the loudness of the clip; retention evicts lower classes first.
+ */
+
+#ifndef CLIP_STORE_H_
+#define CLIP_STORE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CLIP_STORE_INDEX_NAME               "clips.idx"
+#define CLIP_STORE_NAME_MAX                 52      /* Path under root, "YYYY/MM/DD/YYYY.MM.DD.HH.MM.SS.wav" */
+#define CLIP_STORE_PATH_MAX                 96
+
+/* Rewrite the index at init when this many deleted records lead it */
+#if !defined CLIP_STORE_COMPACT_RECORDS
+#define CLIP_STORE_COMPACT_RECORDS          2048
+#endif
+
+/* Score classes with a victim cursor each, score * CLIP_STORE_CLASSES / 256 */
+#define CLIP_STORE_CLASSES                  4
+/* Score of clips nothing is known about (rebuilt index, segments) */
+#define CLIP_STORE_SCORE_UNKNOWN            128
+
+/* clip_store_find() looks at this many of the newest records */
+#if !defined CLIP_STORE_FIND_RECORDS
+#define CLIP_STORE_FIND_RECORDS             512
+#endif
+
+typedef enum {
+    CLIP_STORE_RECORDING = 0,       /* Being written, may be cut short */
+    CLIP_STORE_PENDING,             /* On the card or in the arena, not on the NAS yet */
+    CLIP_STORE_UPLOADED,            /* On the card and on the NAS */
+    CLIP_STORE_DELETED,             /* Not on the card */
+} clip_store_state_t;
+
+typedef struct {
+    uint32_t            record;     /* Position in the index */
+    time_t              time;       /* Start of the clip */
+    uint32_t            size;
+    clip_store_state_t  state;
+    uint8_t             score;
+    char                path[CLIP_STORE_PATH_MAX];
+} clip_store_entry_t;
+
+/**
+ * @brief  Open (or rebuild) the index under root, e.g. "/sdcard". Call after
+ *         the card is mounted and the clock is set.
+ */
+esp_err_t clip_store_init(const char *root);
+
+/**
+ * @brief  Path of a new clip started at t with extension ext (".wav"),
+ *         creating its day directory. Works after a clip_store_init() that
+ *         could not open the index too.
+ */
+esp_err_t clip_store_path(time_t t, const char *ext, char *path, size_t len);
+
+/**
+ * @brief  Append a clip about to be recorded as RECORDING
+ */
+esp_err_t clip_store_open(const char *path);
+
+/**
+ * @brief  Add a finished clip as PENDING, in place of its RECORDING record
+ *         when that is the last one
+ */
+esp_err_t clip_store_add(const char *path, uint8_t score);
+
+/**
+ * @brief  Clip whose recording was cut short: the last record when it is
+ *         still RECORDING. Call before the next clip_store_open();
+ *         clip_store_add() of it makes it PENDING. ESP_ERR_NOT_FOUND when the
+ *         last clip was finished.
+ */
+esp_err_t clip_store_interrupted(clip_store_entry_t *entry);
+
+/**
+ * @brief  Newest record of path among the last CLIP_STORE_FIND_RECORDS
+ */
+esp_err_t clip_store_find(const char *path, clip_store_entry_t *entry);
+
+/**
+ * @brief  Move entry forward to state, ESP_ERR_INVALID_ARG for a step back
+ */
+esp_err_t clip_store_set_state(const clip_store_entry_t *entry, clip_store_state_t state);
+
+/**
+ * @brief  Mark path UPLOADED, or DELETED when it is no longer on the card.
+ *         Paths the index does not know are ignored.
+ */
+void clip_store_uploaded(const char *path, bool removed);
+
+/**
+ * @brief  Oldest clips in state, at most max, oldest first. Returns the count.
+ */
+int clip_store_list(clip_store_state_t state, clip_store_entry_t *entries, int max);
+
+/**
+ * @brief  Next clip to evict that started at or before newest: the oldest live
+ *         clip, or with by_score the oldest of the lowest score class that
+ *         has one. ESP_ERR_NOT_FOUND when every candidate is newer.
+ */
+esp_err_t clip_store_victim(bool by_score, time_t newest, clip_store_entry_t *entry);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CLIP_STORE_H_ */
@@ -0,0 +1,293 @@
+/*
+ * cycle_prof - CPU cycles per audio frame for each stage of the pipeline
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "audio_mem.h"
+#include "task_plan.h"
+#include "cycle_prof.h"
+
+static const char *TAG = "CYCLE_PROF";
+
+typedef struct {
+    char                name[CYCLE_PROF_NAME_LEN];
+    cycle_prof_stats_t  core[portNUM_PROCESSORS];   /* Written by the element task on that core only */
+} cycle_prof_probe_t;
+
+typedef struct {
+    char                name[CYCLE_PROF_NAME_LEN];
+    TaskHandle_t        handle;                     /* At the last reset, NULL when not running */
+    uint32_t            run_start;
+} cycle_prof_task_t;
+
+static portMUX_TYPE s_probe_mux = portMUX_INITIALIZER_UNLOCKED;
+static cycle_prof_probe_t s_probes[CYCLE_PROF_MAX_PROBES];
+static int s_probe_count;
+
+static struct {
+    cycle_prof_cfg_t    cfg;
+    SemaphoreHandle_t   lock;
+    TaskHandle_t        task;
+    int                 period_ms;
+    int64_t             start_us;
+    cycle_prof_task_t   tasks[CYCLE_PROF_MAX_TASKS];
+    int                 task_count;
+} s_prof;
+
+esp_err_t cycle_prof_init(const cycle_prof_cfg_t *config)
+{
+    if (s_prof.lock) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (config->sample_rate <= 0 || config->cpu_mhz <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_prof.lock = xSemaphoreCreateMutex();
+    if (s_prof.lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    s_prof.cfg = *config;
+    s_prof.start_us = esp_timer_get_time();
+    return ESP_OK;
+}
+
+int cycle_prof_probe(const char *name)
+{
+    int probe = -1;
+    portENTER_CRITICAL(&s_probe_mux);
+    for (int i = 0; i < s_probe_count; i++) {
+        if (strncmp(s_probes[i].name, name, CYCLE_PROF_NAME_LEN - 1) == 0) {
+            probe = i;
+            break;
+        }
+    }
+    if (probe < 0 && s_probe_count < CYCLE_PROF_MAX_PROBES) {
+        probe = s_probe_count++;
+        snprintf(s_probes[probe].name, CYCLE_PROF_NAME_LEN, "%s", name);
+    }
+    portEXIT_CRITICAL(&s_probe_mux);
+    return probe;
+}
+
+void cycle_prof_end(int probe, uint32_t start, uint32_t frames)
+{
+    uint32_t cycles = esp_cpu_get_ccount() - start;
+    if (probe < 0 || probe >= CYCLE_PROF_MAX_PROBES || frames == 0) {
+        return;
+    }
+    cycle_prof_stats_t *st = &s_probes[probe].core[xPortGetCoreID()];
+    uint32_t per_frame = cycles / frames;
+    int bucket = per_frame ? 31 - __builtin_clz(per_frame) : 0;
+    if (bucket >= CYCLE_PROF_BUCKETS) {
+        bucket = CYCLE_PROF_BUCKETS - 1;
+    }
+    st->calls++;
+    st->frames += frames;
+    st->cycles += cycles;
+    st->hist[bucket]++;
+    if (per_frame > st->max_per_frame) {
+        st->max_per_frame = per_frame;
+    }
+}
+
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+/* Run time of every task, caller frees */
+static TaskStatus_t *_task_state(int *count)
+{
+    int max = uxTaskGetNumberOfTasks() + 4;
+    TaskStatus_t *tasks = audio_calloc(max, sizeof(TaskStatus_t));
+    if (tasks == NULL) {
+        *count = 0;
+        return NULL;
+    }
+    *count = uxTaskGetSystemState(tasks, max, NULL);
+    return tasks;
+}
+
+static const TaskStatus_t *_task_find(const TaskStatus_t *tasks, int count, const char *name)
+{
+    for (int i = 0; i < count; i++) {
+        if (strncmp(tasks[i].pcTaskName, name, CYCLE_PROF_NAME_LEN - 1) == 0) {
+            return &tasks[i];
+        }
+    }
+    return NULL;
+}
+#endif
+
+esp_err_t cycle_prof_watch(const char *name)
+{
+    if (s_prof.lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(s_prof.lock, portMAX_DELAY);
+    if (s_prof.task_count == CYCLE_PROF_MAX_TASKS) {
+        xSemaphoreGive(s_prof.lock);
+        return ESP_ERR_NO_MEM;
+    }
+    cycle_prof_task_t *t = &s_prof.tasks[s_prof.task_count++];
+    memset(t, 0, sizeof(*t));
+    snprintf(t->name, CYCLE_PROF_NAME_LEN, "%s", name);
+    xSemaphoreGive(s_prof.lock);
+    return ESP_OK;
+}
+
+static void _reset(void)
+{
+    for (int i = 0; i < s_probe_count; i++) {
+        memset(s_probes[i].core, 0, sizeof(s_probes[i].core));
+    }
+    s_prof.start_us = esp_timer_get_time();
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    int count;
+    TaskStatus_t *tasks = _task_state(&count);
+    for (int i = 0; i < s_prof.task_count; i++) {
+        const TaskStatus_t *ts = _task_find(tasks, count, s_prof.tasks[i].name);
+        s_prof.tasks[i].handle = ts ? ts->xHandle : NULL;
+        s_prof.tasks[i].run_start = ts ? ts->ulRunTimeCounter : 0;
+    }
+    audio_free(tasks);
+#endif
+}
+
+void cycle_prof_reset(void)
+{
+    if (s_prof.lock == NULL) {
+        return;
+    }
+    xSemaphoreTake(s_prof.lock, portMAX_DELAY);
+    _reset();
+    xSemaphoreGive(s_prof.lock);
+}
+
+esp_err_t cycle_prof_get_stats(int probe, cycle_prof_stats_t *stats)
+{
+    if (probe < 0 || probe >= s_probe_count) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(stats, 0, sizeof(*stats));
+    for (int c = 0; c < portNUM_PROCESSORS; c++) {
+        const cycle_prof_stats_t *st = &s_probes[probe].core[c];
+        stats->calls += st->calls;
+        stats->frames += st->frames;
+        stats->cycles += st->cycles;
+        if (st->max_per_frame > stats->max_per_frame) {
+            stats->max_per_frame = st->max_per_frame;
+        }
+        for (int b = 0; b < CYCLE_PROF_BUCKETS; b++) {
+            stats->hist[b] += st->hist[b];
+        }
+    }
+    return ESP_OK;
+}
+
+/* Per mille of one core at mhz for cycles over wall_us */
+static uint32_t _load(uint64_t cycles, int64_t wall_us, int mhz)
+{
+    return cycles * 1000 / ((uint64_t)wall_us * mhz);
+}
+
+static void _log_load(const char *kind, const char *name, uint64_t cycles, uint64_t frames,
+                      uint32_t max, uint32_t p99, int64_t wall_us)
+{
+    char tail[40] = "";
+    if (max) {
+        snprintf(tail, sizeof(tail), ", max %u, p99 < %u", (unsigned)max, (unsigned)p99);
+    }
+    uint32_t now = _load(cycles, wall_us, s_prof.cfg.cpu_mhz);
+    uint32_t at160 = _load(cycles, wall_us, 160);
+    uint32_t at80 = _load(cycles, wall_us, 80);
+    ESP_LOGI(TAG, "  %s %-12s %6u cycles/frame%s; %u.%u%% at %d MHz, %u.%u%% at 160, %u.%u%% at 80",
+             kind, name, (unsigned)(frames ? cycles / frames : 0), tail,
+             (unsigned)now / 10, (unsigned)now % 10, s_prof.cfg.cpu_mhz,
+             (unsigned)at160 / 10, (unsigned)at160 % 10, (unsigned)at80 / 10, (unsigned)at80 % 10);
+}
+
+static void _log(void)
+{
+    int64_t wall_us = esp_timer_get_time() - s_prof.start_us;
+    if (wall_us <= 0) {
+        return;
+    }
+    ESP_LOGI(TAG, "Cycles per audio frame over %lld ms, %d Hz:", (long long)(wall_us / 1000), s_prof.cfg.sample_rate);
+    for (int i = 0; i < s_probe_count; i++) {
+        cycle_prof_stats_t st;
+        cycle_prof_get_stats(i, &st);
+        if (st.calls == 0) {
+            continue;
+        }
+        /* Upper edge of the bucket the 99th percentile call falls in */
+        uint32_t seen = 0;
+        int b = 0;
+        while (b < CYCLE_PROF_BUCKETS - 1 && (seen += st.hist[b]) < st.calls - st.calls / 100) {
+            b++;
+        }
+        _log_load("probe", s_probes[i].name, st.cycles, st.frames, st.max_per_frame, 2u << b, wall_us);
+    }
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    uint64_t frames = (uint64_t)wall_us * s_prof.cfg.sample_rate / 1000000;
+    int count;
+    TaskStatus_t *tasks = _task_state(&count);
+    uint64_t total = 0;
+    for (int i = 0; i < s_prof.task_count; i++) {
+        cycle_prof_task_t *t = &s_prof.tasks[i];
+        const TaskStatus_t *ts = _task_find(tasks, count, t->name);
+        if (ts == NULL) {
+            continue;
+        }
+        /* A task started after the reset (the pipeline runs later) counts from 0 */
+        uint32_t run_us = ts->ulRunTimeCounter - (ts->xHandle == t->handle ? t->run_start : 0);
+        uint64_t cycles = (uint64_t)run_us * s_prof.cfg.cpu_mhz;
+        total += cycles;
+        _log_load("task ", t->name, cycles, frames, 0, 0, wall_us);
+    }
+    audio_free(tasks);
+    if (s_prof.task_count) {
+        _log_load("total", "tasks", total, frames, 0, 0, wall_us);
+    }
+#else
+    if (s_prof.task_count) {
+        ESP_LOGI(TAG, "Task cycles need CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS");
+    }
+#endif
+}
+
+void cycle_prof_log(void)
+{
+    if (s_prof.lock == NULL) {
+        return;
+    }
+    xSemaphoreTake(s_prof.lock, portMAX_DELAY);
+    _log();
+    xSemaphoreGive(s_prof.lock);
+}
+
+static void _cycle_prof_task(void *arg)
+{
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(s_prof.period_ms));
+        /* Windows stay short, the run time counters are 32 bit microseconds */
+        xSemaphoreTake(s_prof.lock, portMAX_DELAY);
+        _log();
+        _reset();
+        xSemaphoreGive(s_prof.lock);
+    }
+}
+
+esp_err_t cycle_prof_start(int period_ms)
+{
+    if (s_prof.lock == NULL || s_prof.task || period_ms <= 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_prof.period_ms = period_ms;
+    if (task_plan_create(TASK_ROLE_COMPRESS, _cycle_prof_task, "cycle_prof", 3 * 1024, NULL, &s_prof.task) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,120 @@
+/*
+ * cycle_prof - CPU cycles per audio frame for each stage of the pipeline
+ *
+ * Tells how much headroom the audio path has before the CPU clock can be
+ * dropped from 240 to 160 or 80 MHz. Two sources:
+ *
+ *   probes   CYCLE_PROF_BEGIN() / CYCLE_PROF_END() around the work of an
+ *            element (esp_cpu_get_ccount(), no time base involved). Used in
+ *            sd_wav_writer, feature_extractor and sim_source. Keep waits on
+ *            ring buffers and the card out of the bracket: the cycle counter
+ *            keeps running while the task is blocked.
+ *   tasks    cycle_prof_watch() of an element task by name ("i2s", "wav",
+ *            "wav_file" as registered in the pipeline). The process callbacks
+ *            of the ADF elements (i2s_stream, wav_encoder) cannot be wrapped,
+ *            their cost comes from the FreeRTOS run time of the task instead
+ *            (needs CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS), which leaves
+ *            blocked time out, converted to cycles at cpu_mhz.
+ *
+ * Every probe has one slot per core, written only by the task of the element
+ * on that core, so probes take no lock and no atomic. The log reads the slots
+ * as they are; a call in progress may be missed. Each slot keeps a histogram
+ * of cycles per frame in powers of two.
+ *
+ * Task frames are the wall time times sample_rate (the pipeline runs at the
+ * capture rate). The log gives, since cycle_prof_reset(), cycles per frame and
+ * the share of one core at cpu_mhz, 160 and 80 MHz, scaled linearly (flash
+ * and PSRAM wait states make the lower clocks a little better than that).
+ */
+
+#ifndef CYCLE_PROF_H_
+#define CYCLE_PROF_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_cpu.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* 0 compiles the probes out of the elements */
+#if !defined CYCLE_PROF_ENABLE
+#define CYCLE_PROF_ENABLE                   1
+#endif
+
+#define CYCLE_PROF_MAX_PROBES               8
+#define CYCLE_PROF_MAX_TASKS                8
+#define CYCLE_PROF_NAME_LEN                 16
+/* Histogram buckets, bucket n counts calls of 2^n ... 2^(n+1)-1 cycles per frame */
+#define CYCLE_PROF_BUCKETS                  24
+
+#if CYCLE_PROF_ENABLE
+#define CYCLE_PROF_BEGIN()                  esp_cpu_get_ccount()
+#define CYCLE_PROF_END(probe, start, frames) cycle_prof_end(probe, start, frames)
+#else
+#define CYCLE_PROF_BEGIN()                  0
+#define CYCLE_PROF_END(probe, start, frames) ((void)(start))
+#endif
+
+typedef struct {
+    int         sample_rate;            /* Frames per second of the pipeline */
+    int         cpu_mhz;                /* Clock the tasks run at, TASK_PLAN_CPU_FREQ_MHZ */
+} cycle_prof_cfg_t;
+
+typedef struct {
+    uint32_t    calls;
+    uint64_t    frames;
+    uint64_t    cycles;
+    uint32_t    max_per_frame;          /* Cycles per frame of the worst call */
+    uint32_t    hist[CYCLE_PROF_BUCKETS];
+} cycle_prof_stats_t;
+
+esp_err_t cycle_prof_init(const cycle_prof_cfg_t *config);
+
+/**
+ * @brief  Probe named name, the same one when it already exists (an element
+ *         created again). -1 when all CYCLE_PROF_MAX_PROBES are taken,
+ *         cycle_prof_end() ignores it.
+ */
+int cycle_prof_probe(const char *name);
+
+/**
+ * @brief  Add one call of frames audio frames that started at start
+ *         (CYCLE_PROF_BEGIN()) on the current core
+ */
+void cycle_prof_end(int probe, uint32_t start, uint32_t frames);
+
+/**
+ * @brief  Report the run time of task name (an element task) too
+ */
+esp_err_t cycle_prof_watch(const char *name);
+
+/**
+ * @brief  Clear the probes and start the task window now, e.g. when a
+ *         recording starts
+ */
+void cycle_prof_reset(void);
+
+/**
+ * @brief  Stats of probe, all cores added up
+ */
+esp_err_t cycle_prof_get_stats(int probe, cycle_prof_stats_t *stats);
+
+/**
+ * @brief  Print everything since cycle_prof_reset()
+ */
+void cycle_prof_log(void);
+
+/**
+ * @brief  cycle_prof_log() and cycle_prof_reset() every period_ms from a task
+ *         of the compress role. For long recordings: the task run time
+ *         counters are 32 bit microseconds and wrap after 71 minutes.
+ */
+esp_err_t cycle_prof_start(int period_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CYCLE_PROF_H_ */
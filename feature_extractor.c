@@ -0,0 +1,475 @@
+/*
+ * feature_extractor - mel band energy element
+ *
+ * Per frame of fft_size samples (hop fft_size / 2, first channel only):
+ *   Hann window, block floating point normalisation, Q15 radix-2 FFT with
+ *   1/2 scaling per stage, |X|^2 in 32 bits, sparse Q15 triangular mel
+ *   weights accumulated in 64 bits. Only the per-band sums are converted to
+ *   float, averaged over frames_per_record frames and written as 0.5 dB steps.
+ *
+ * FEATURE_EXTRACTOR_USE_ESP_DSP switches the FFT to esp-dsp's dsps_fft2r_sc16
+ * kernel (same Q15 format and scaling) when that component is in the build.
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "audio_element.h"
+#include "feature_extractor.h"
+#include "cycle_prof.h"
+
+#if !defined FEATURE_EXTRACTOR_USE_ESP_DSP
+#define FEATURE_EXTRACTOR_USE_ESP_DSP       0
+#endif
+
+#if FEATURE_EXTRACTOR_USE_ESP_DSP
+#include "dsps_fft2r.h"
+#endif
+
+static const char *TAG = "FEATURE_EXTRACTOR";
+
+#define FEATURE_EXTRACTOR_BUFFER_LEN        (4096)
+#define FEATURE_EXTRACTOR_VERSION           1
+#define FEATURE_EXTRACTOR_DB_FLOOR          (-30)
+
+typedef struct {
+    uint16_t                bin;            /* First FFT bin of the band */
+    uint16_t                len;            /* Bins in the band */
+    uint16_t                weight;         /* Offset in weights[] */
+} feature_band_t;
+
+typedef struct {
+    FILE                    *fp;
+    int                     fft_size;
+    int                     mel_bands;
+    int                     fmin_hz;        /* As configured, the header holds the values in use */
+    int                     fmax_hz;
+    int                     frames_per_record;
+    int16_t                 *frame;         /* Last fft_size samples */
+    int                     fill;
+    int16_t                 *window;        /* Hann, Q15 */
+    int16_t                 *twiddle;       /* cos, -sin pairs, Q15 */
+    int16_t                 *cplx;          /* FFT work buffer, re/im pairs */
+    uint16_t                *weights;       /* Q15 triangle weights of all bands */
+    feature_band_t          bands[FEATURE_EXTRACTOR_MAX_BANDS];
+    float                   acc[FEATURE_EXTRACTOR_MAX_BANDS];
+    int                     acc_frames;
+    feature_extractor_header_t header;
+    feature_extractor_stats_t stats;
+    int                     prof;           /* cycle_prof probe */
+} feature_extractor_t;
+
+static float _hz_to_mel(float hz)
+{
+    return 2595.0f * log10f(1.0f + hz / 700.0f);
+}
+
+static float _mel_to_hz(float mel)
+{
+    return 700.0f * (powf(10.0f, mel / 2595.0f) - 1.0f);
+}
+
+static void _free_tables(feature_extractor_t *fe)
+{
+    audio_free(fe->frame);
+    audio_free(fe->window);
+    audio_free(fe->twiddle);
+    audio_free(fe->cplx);
+    audio_free(fe->weights);
+    fe->frame = NULL;
+    fe->window = NULL;
+    fe->twiddle = NULL;
+    fe->cplx = NULL;
+    fe->weights = NULL;
+}
+
+static esp_err_t _build_tables(feature_extractor_t *fe, int sample_rate, int fmin_hz, int fmax_hz)
+{
+    int n = fe->fft_size;
+    fe->frame = audio_calloc(n, sizeof(int16_t));
+    fe->window = audio_calloc(n, sizeof(int16_t));
+    fe->twiddle = audio_calloc(n, sizeof(int16_t));
+    fe->cplx = audio_calloc(2 * n, sizeof(int16_t));
+    /* Neighbouring triangles overlap by half, so every bin is in at most two bands */
+    fe->weights = audio_calloc(n + fe->mel_bands, sizeof(uint16_t));
+    if (!fe->frame || !fe->window || !fe->twiddle || !fe->cplx || !fe->weights) {
+        _free_tables(fe);
+        return ESP_ERR_NO_MEM;
+    }
+    for (int i = 0; i < n; i++) {
+        fe->window[i] = (int16_t)(32767.0f * 0.5f * (1.0f - cosf(2.0f * (float)M_PI * i / n)));
+    }
+    for (int i = 0; i < n / 2; i++) {
+        fe->twiddle[2 * i] = (int16_t)lrintf(32767.0f * cosf(2.0f * (float)M_PI * i / n));
+        fe->twiddle[2 * i + 1] = (int16_t)lrintf(-32767.0f * sinf(2.0f * (float)M_PI * i / n));
+    }
+
+    float mel_lo = _hz_to_mel(fmin_hz);
+    float mel_hi = _hz_to_mel(fmax_hz);
+    float bin_hz = (float)sample_rate / n;
+    int used = 0;
+    for (int m = 0; m < fe->mel_bands; m++) {
+        float f0 = _mel_to_hz(mel_lo + (mel_hi - mel_lo) * m / (fe->mel_bands + 1));
+        float f1 = _mel_to_hz(mel_lo + (mel_hi - mel_lo) * (m + 1) / (fe->mel_bands + 1));
+        float f2 = _mel_to_hz(mel_lo + (mel_hi - mel_lo) * (m + 2) / (fe->mel_bands + 1));
+        int lo = (int)ceilf(f0 / bin_hz);
+        int hi = (int)floorf(f2 / bin_hz);
+        if (hi > n / 2) {
+            hi = n / 2;
+        }
+        feature_band_t *b = &fe->bands[m];
+        b->weight = used;
+        if (hi <= lo) {
+            /* Band narrower than a bin: take the bin nearest to its centre */
+            b->bin = (uint16_t)lrintf(f1 / bin_hz);
+            b->len = 1;
+            fe->weights[used++] = 32767;
+            continue;
+        }
+        b->bin = lo;
+        b->len = 0;
+        for (int k = lo; k <= hi; k++) {
+            float f = k * bin_hz;
+            float w = f <= f1 ? (f - f0) / (f1 - f0) : (f2 - f) / (f2 - f1);
+            fe->weights[used++] = (uint16_t)lrintf(32767.0f * (w < 0 ? 0 : w));
+            b->len++;
+        }
+    }
+    return ESP_OK;
+}
+
+#if !FEATURE_EXTRACTOR_USE_ESP_DSP
+/* In place, x is n re/im pairs, result is X / n */
+static void _fft_q15(int16_t *x, const int16_t *tw, int n)
+{
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            int16_t r = x[2 * i], m = x[2 * i + 1];
+            x[2 * i] = x[2 * j];
+            x[2 * i + 1] = x[2 * j + 1];
+            x[2 * j] = r;
+            x[2 * j + 1] = m;
+        }
+    }
+    for (int half = 1, step = n / 2; half < n; half <<= 1, step >>= 1) {
+        for (int i = 0; i < n; i += 2 * half) {
+            for (int k = 0; k < half; k++) {
+                int32_t wr = tw[2 * k * step];
+                int32_t wi = tw[2 * k * step + 1];
+                int16_t *a = &x[2 * (i + k)];
+                int16_t *b = &x[2 * (i + k + half)];
+                int32_t tr = (b[0] * wr - b[1] * wi) >> 15;
+                int32_t ti = (b[0] * wi + b[1] * wr) >> 15;
+                int32_t ar = a[0];
+                int32_t ai = a[1];
+                a[0] = (int16_t)((ar + tr) >> 1);
+                a[1] = (int16_t)((ai + ti) >> 1);
+                b[0] = (int16_t)((ar - tr) >> 1);
+                b[1] = (int16_t)((ai - ti) >> 1);
+            }
+        }
+    }
+}
+#endif
+
+static esp_err_t _write_record(feature_extractor_t *fe)
+{
+    uint8_t rec[FEATURE_EXTRACTOR_MAX_BANDS];
+    for (int m = 0; m < fe->mel_bands; m++) {
+        float e = fe->acc[m] / fe->acc_frames;
+        float q = e > 0 ? 2.0f * (10.0f * log10f(e) - FEATURE_EXTRACTOR_DB_FLOOR) : 0;
+        rec[m] = q <= 0 ? 0 : q >= 255 ? 255 : (uint8_t)lrintf(q);
+        if (rec[m] > fe->stats.peak) {
+            fe->stats.peak = rec[m];
+        }
+        fe->acc[m] = 0;
+    }
+    fe->acc_frames = 0;
+    if (fwrite(rec, 1, fe->mel_bands, fe->fp) != (size_t)fe->mel_bands) {
+        ESP_LOGE(TAG, "Feature write failed");
+        return ESP_FAIL;
+    }
+    fe->stats.records++;
+    fe->stats.out_bytes += fe->mel_bands;
+    return ESP_OK;
+}
+
+static esp_err_t _process_frame(feature_extractor_t *fe)
+{
+    int64_t start = esp_timer_get_time();
+    int n = fe->fft_size;
+    /*
+     * Block floating point: scale quiet frames up so the FFT keeps its
+     * resolution. The shift is taken from the full windowed product and
+     * applied before it is rounded to 16 bits, so the window does not
+     * drop the low bits of a quiet frame first.
+     */
+    int32_t peak = 0;
+    for (int i = 0; i < n; i++) {
+        int32_t p = fe->frame[i] * fe->window[i];
+        p = p < 0 ? -p : p;
+        peak = p > peak ? p : peak;
+    }
+    int shift = 0;
+    while (shift < 15 && peak < (1 << (28 - shift))) {
+        shift++;
+    }
+    for (int i = 0; i < n; i++) {
+        fe->cplx[2 * i] = (int16_t)((fe->frame[i] * fe->window[i]) >> (15 - shift));
+        fe->cplx[2 * i + 1] = 0;
+    }
+#if FEATURE_EXTRACTOR_USE_ESP_DSP
+    dsps_fft2r_sc16(fe->cplx, n);
+    dsps_bit_rev_sc16_ansi(fe->cplx, n);
+#else
+    _fft_q15(fe->cplx, fe->twiddle, n);
+#endif
+    float scale = ldexpf(1.0f / 32768.0f, -2 * shift);
+    for (int m = 0; m < fe->mel_bands; m++) {
+        const feature_band_t *b = &fe->bands[m];
+        const uint16_t *w = &fe->weights[b->weight];
+        const int16_t *x = &fe->cplx[2 * b->bin];
+        uint64_t sum = 0;
+        for (int k = 0; k < b->len; k++, x += 2) {
+            uint32_t p = (uint32_t)(x[0] * x[0]) + (uint32_t)(x[1] * x[1]);
+            sum += (uint64_t)p * w[k];
+        }
+        fe->acc[m] += (float)sum * scale;
+    }
+    fe->stats.frames++;
+    esp_err_t ret = ESP_OK;
+    if (++fe->acc_frames == fe->frames_per_record) {
+        ret = _write_record(fe);
+    }
+    uint32_t us = (uint32_t)(esp_timer_get_time() - start);
+    fe->stats.total_us += us;
+    if (us > fe->stats.max_us) {
+        fe->stats.max_us = us;
+    }
+    return ret;
+}
+
+static esp_err_t _feature_extractor_open(audio_element_handle_t self)
+{
+    feature_extractor_t *fe = (feature_extractor_t *)audio_element_getdata(self);
+    if (fe->fp) {
+        ESP_LOGE(TAG, "Already opened");
+        return ESP_FAIL;
+    }
+    audio_element_info_t info = {0};
+    audio_element_getinfo(self, &info);
+    if (info.bits != 16 || info.channels < 1 || info.sample_rates <= 0) {
+        ESP_LOGE(TAG, "Unsupported format %d Hz, %d bits, %d ch", info.sample_rates, info.bits, info.channels);
+        return ESP_FAIL;
+    }
+    const char *uri = audio_element_get_uri(self);
+    if (uri == NULL) {
+        ESP_LOGE(TAG, "No feature file set");
+        return ESP_FAIL;
+    }
+    int fmax_hz = fe->fmax_hz;
+    int fmin_hz = fe->fmin_hz;
+    if (fmax_hz <= 0 || fmax_hz > info.sample_rates / 2) {
+        fmax_hz = info.sample_rates / 2;
+    }
+    if (fmin_hz < 0 || fmin_hz >= fmax_hz) {
+        fmin_hz = 0;
+    }
+    if (_build_tables(fe, info.sample_rates, fmin_hz, fmax_hz) != ESP_OK) {
+        ESP_LOGE(TAG, "No memory for %d point FFT", fe->fft_size);
+        return ESP_ERR_NO_MEM;
+    }
+#if FEATURE_EXTRACTOR_USE_ESP_DSP
+    if (dsps_fft2r_init_sc16(NULL, fe->fft_size) != ESP_OK) {
+        ESP_LOGE(TAG, "dsps_fft2r_init_sc16 failed");
+        _free_tables(fe);
+        return ESP_FAIL;
+    }
+#endif
+    fe->fp = fopen(uri, "wb");
+    if (fe->fp == NULL) {
+        ESP_LOGE(TAG, "Failed to open %s", uri);
+        _free_tables(fe);
+        return ESP_FAIL;
+    }
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    feature_extractor_header_t *h = &fe->header;
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, "MELF", 4);
+    h->version = FEATURE_EXTRACTOR_VERSION;
+    h->mel_bands = fe->mel_bands;
+    h->sample_rate = info.sample_rates;
+    h->fft_size = fe->fft_size;
+    h->hop = fe->fft_size / 2;
+    h->frames_per_record = fe->frames_per_record;
+    h->db_floor = FEATURE_EXTRACTOR_DB_FLOOR;
+    h->fmin_hz = fmin_hz;
+    h->fmax_hz = fmax_hz;
+    h->start_sec = (uint32_t)tv.tv_sec;
+    h->start_ms = (uint16_t)(tv.tv_usec / 1000);
+    if (fwrite(h, 1, sizeof(*h), fe->fp) != sizeof(*h)) {
+        ESP_LOGE(TAG, "Failed to write header of %s", uri);
+        fclose(fe->fp);
+        fe->fp = NULL;
+        _free_tables(fe);
+        return ESP_FAIL;
+    }
+    fe->fill = 0;
+    fe->acc_frames = 0;
+    memset(fe->acc, 0, sizeof(fe->acc));
+    memset(&fe->stats, 0, sizeof(fe->stats));
+    fe->stats.out_bytes = sizeof(*h);
+    ESP_LOGI(TAG, "%s: %d point FFT, %d bands %d-%d Hz, %d frames per record",
+             uri, fe->fft_size, fe->mel_bands, fmin_hz, fmax_hz, fe->frames_per_record);
+    return ESP_OK;
+}
+
+static int _feature_extractor_write(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *context)
+{
+    feature_extractor_t *fe = (feature_extractor_t *)audio_element_getdata(self);
+    audio_element_info_t info;
+    audio_element_getinfo(self, &info);
+    uint32_t prof_start = CYCLE_PROF_BEGIN();
+    const int16_t *pcm = (const int16_t *)buffer;
+    int samples = len / (2 * info.channels);
+    int hop = fe->fft_size / 2;
+    for (int i = 0; i < samples; i++) {
+        fe->frame[fe->fill++] = pcm[i * info.channels];
+        if (fe->fill == fe->fft_size) {
+            if (_process_frame(fe) != ESP_OK) {
+                return AEL_IO_FAIL;
+            }
+            memmove(fe->frame, fe->frame + hop, (fe->fft_size - hop) * sizeof(int16_t));
+            fe->fill = fe->fft_size - hop;
+        }
+    }
+    fe->stats.in_bytes += len;
+    info.byte_pos += len;
+    audio_element_setinfo(self, &info);
+    CYCLE_PROF_END(fe->prof, prof_start, samples);
+    return len;
+}
+
+static int _feature_extractor_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    int r_size = audio_element_input(self, in_buffer, in_len);
+    int w_size = 0;
+    if (r_size > 0) {
+        w_size = audio_element_output(self, in_buffer, r_size);
+    } else {
+        w_size = r_size;
+    }
+    return w_size;
+}
+
+static esp_err_t _feature_extractor_close(audio_element_handle_t self)
+{
+    feature_extractor_t *fe = (feature_extractor_t *)audio_element_getdata(self);
+    if (fe->fp) {
+        if (fe->acc_frames) {
+            _write_record(fe);
+        }
+        fe->header.records = fe->stats.records;
+        if (fseek(fe->fp, 0, SEEK_SET) != 0
+            || fwrite(&fe->header, 1, sizeof(fe->header), fe->fp) != sizeof(fe->header)) {
+            ESP_LOGE(TAG, "Failed to update header");
+        }
+        fclose(fe->fp);
+        fe->fp = NULL;
+    }
+    _free_tables(fe);
+
+    if (AEL_STATE_PAUSED != audio_element_get_state(self)) {
+        audio_element_info_t info;
+        audio_element_getinfo(self, &info);
+        info.byte_pos = 0;
+        audio_element_setinfo(self, &info);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t _feature_extractor_destroy(audio_element_handle_t self)
+{
+    feature_extractor_t *fe = (feature_extractor_t *)audio_element_getdata(self);
+    _free_tables(fe);
+    audio_free(fe);
+    return ESP_OK;
+}
+
+esp_err_t feature_extractor_get_stats(audio_element_handle_t self, feature_extractor_stats_t *stats)
+{
+    feature_extractor_t *fe = (feature_extractor_t *)audio_element_getdata(self);
+    if (fe == NULL || stats == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(stats, &fe->stats, sizeof(*stats));
+    return ESP_OK;
+}
+
+void feature_extractor_log_stats(audio_element_handle_t self)
+{
+    feature_extractor_stats_t stats;
+    if (feature_extractor_get_stats(self, &stats) != ESP_OK || stats.frames == 0) {
+        return;
+    }
+    ESP_LOGI(TAG, "%u frames, %u records, avg %" PRIu64 " us, max %u us per frame, %" PRIu64 " -> %" PRIu64 " bytes",
+             stats.frames, stats.records, stats.total_us / stats.frames, stats.max_us,
+             stats.in_bytes, stats.out_bytes);
+}
+
+audio_element_handle_t feature_extractor_init(feature_extractor_cfg_t *config)
+{
+    int n = config->fft_size;
+    if (n < 64 || n > FEATURE_EXTRACTOR_MAX_FFT_SIZE || (n & (n - 1))) {
+        ESP_LOGE(TAG, "fft_size %d must be a power of two in [64, %d]", n, FEATURE_EXTRACTOR_MAX_FFT_SIZE);
+        return NULL;
+    }
+    if (config->mel_bands < 1 || config->mel_bands > FEATURE_EXTRACTOR_MAX_BANDS) {
+        ESP_LOGE(TAG, "mel_bands %d out of range", config->mel_bands);
+        return NULL;
+    }
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    feature_extractor_t *fe = audio_calloc(1, sizeof(feature_extractor_t));
+    AUDIO_MEM_CHECK(TAG, fe, return NULL);
+
+    cfg.open = _feature_extractor_open;
+    cfg.close = _feature_extractor_close;
+    cfg.process = _feature_extractor_process;
+    cfg.destroy = _feature_extractor_destroy;
+    cfg.write = _feature_extractor_write;
+    cfg.task_stack = config->task_stack;
+    cfg.task_prio = config->task_prio;
+    cfg.task_core = config->task_core;
+    cfg.stack_in_ext = config->ext_stack;
+    cfg.buffer_len = FEATURE_EXTRACTOR_BUFFER_LEN;
+    cfg.tag = "feature";
+
+    fe->fft_size = n;
+    fe->mel_bands = config->mel_bands;
+    fe->fmin_hz = config->fmin_hz;
+    fe->fmax_hz = config->fmax_hz;
+    fe->frames_per_record = config->frames_per_record > 0 ? config->frames_per_record : 1;
+    fe->prof = cycle_prof_probe("feature");
+
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, {
+        audio_free(fe);
+        return NULL;
+    });
+    audio_element_setdata(el, fe);
+    return el;
+}
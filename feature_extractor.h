@@ -0,0 +1,101 @@
+/*
+ * feature_extractor - mel band energy element
+ *
+ * Turns 16-bit PCM into log mel band energies with a fixed-point (Q15)
+ * radix-2 FFT and writes them to a compact feature file next to the clip.
+ * Fed from the i2s reader's multi-output ring buffer it runs alongside the
+ * WAV path; linked after the reader it can also replace it.
+ *
+ * File layout (little endian):
+ *   feature_extractor_header_t
+ *   records of mel_bands bytes, one per frames_per_record FFT frames:
+ *     q = 2 * (10 * log10(mean band energy) - db_floor), 0.5 dB steps
+ *
+ * Band edges are mel spaced between fmin_hz and fmax_hz with triangular
+ * filters (mel = 2595 * log10(1 + f / 700)), the same as most reference
+ * implementations, so NAS-side tools can rebuild them from the header.
+ */
+
+#ifndef FEATURE_EXTRACTOR_H_
+#define FEATURE_EXTRACTOR_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FEATURE_EXTRACTOR_MAX_FFT_SIZE      2048
+#define FEATURE_EXTRACTOR_MAX_BANDS         64
+
+typedef struct __attribute__((packed)) {
+    char     magic[4];              /* "MELF" */
+    uint16_t version;               /* 1 */
+    uint16_t mel_bands;
+    uint32_t sample_rate;
+    uint16_t fft_size;
+    uint16_t hop;                   /* Samples between FFT frames */
+    uint16_t frames_per_record;
+    int16_t  db_floor;              /* dB of q = 0 */
+    uint16_t fmin_hz;
+    uint16_t fmax_hz;
+    uint32_t start_sec;             /* Unix time of the first sample */
+    uint16_t start_ms;
+    uint16_t reserved;
+    uint32_t records;               /* Patched on close */
+} feature_extractor_header_t;
+
+typedef struct {
+    int     task_stack;
+    int     task_core;
+    int     task_prio;
+    bool    ext_stack;
+    int     fft_size;               /* Power of two, <= FEATURE_EXTRACTOR_MAX_FFT_SIZE */
+    int     mel_bands;              /* <= FEATURE_EXTRACTOR_MAX_BANDS */
+    int     fmin_hz;
+    int     fmax_hz;                /* 0 = sample_rate / 2 */
+    int     frames_per_record;      /* FFT frames averaged into one record */
+} feature_extractor_cfg_t;
+
+#define FEATURE_EXTRACTOR_TASK_STACK        (4 * 1024)
+
+#define FEATURE_EXTRACTOR_CFG_DEFAULT() {           \
+    .task_stack = FEATURE_EXTRACTOR_TASK_STACK,     \
+    .task_core = 0,                                 \
+    .task_prio = 3,                                 \
+    .ext_stack = false,                             \
+    .fft_size = 1024,                               \
+    .mel_bands = 40,                                \
+    .fmin_hz = 50,                                  \
+    .fmax_hz = 0,                                   \
+    .frames_per_record = 4,                         \
+}
+
+typedef struct {
+    uint32_t frames;                /* FFT frames computed */
+    uint32_t records;               /* Records written */
+    uint64_t total_us;              /* Time spent per frame (window, FFT, mel, log) */
+    uint32_t max_us;
+    uint64_t in_bytes;              /* PCM consumed */
+    uint64_t out_bytes;             /* Feature file size */
+    uint8_t  peak;                  /* Loudest band of any record, same scale as the records */
+} feature_extractor_stats_t;
+
+/**
+ * @brief  Create the element, the feature file is set with
+ *         audio_element_set_uri() ("/sdcard/xxx.mel") and the PCM format with
+ *         audio_element_setinfo() before it runs
+ */
+audio_element_handle_t feature_extractor_init(feature_extractor_cfg_t *config);
+
+esp_err_t feature_extractor_get_stats(audio_element_handle_t self, feature_extractor_stats_t *stats);
+
+void feature_extractor_log_stats(audio_element_handle_t self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FEATURE_EXTRACTOR_H_ */
@@ -0,0 +1,88 @@
+/*
+ * ftp_fetch - stream a remote file from the NAS over RETR
+ */
+
+#include <string.h>
+#include "esp_log.h"
+#include "audio_mem.h"
+#include "ftp_fetch.h"
+
+static const char *TAG = "FTP_FETCH";
+
+typedef struct {
+    char    *buf;
+    size_t  max;
+    size_t  len;
+} ftp_fetch_buffer_t;
+
+esp_err_t ftp_fetch(NetBuf_t *ctrl, const char *remote, ftp_fetch_sink_t sink, void *ctx, size_t *total)
+{
+    FtpClient *ftp = getFtpClient();
+    NetBuf_t *data = NULL;
+    if (!ftp->ftpClientAccess(remote, FTP_CLIENT_FILE_READ, FTP_CLIENT_BINARY, ctrl, &data)) {
+        const char *resp = ftp->ftpClientGetLastResponse(ctrl);
+        if (resp && strncmp(resp, "550", 3) == 0) {
+            return ESP_ERR_NOT_FOUND;
+        }
+        ESP_LOGE(TAG, "RETR %s failed: %s", remote, resp ? resp : "");
+        return ESP_FAIL;
+    }
+    uint8_t *buf = audio_malloc(FTP_CLIENT_BUFFER_SIZE);
+    if (buf == NULL) {
+        ftp->ftpClientClose(data);
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t ret = ESP_OK;
+    size_t received = 0;
+    int n;
+    /* 0 is both end of file and a broken transfer, the final reply tells them apart */
+    while ((n = ftp->ftpClientRead(buf, FTP_CLIENT_BUFFER_SIZE, data)) > 0) {
+        received += n;
+        ret = sink(buf, n, ctx);
+        if (ret != ESP_OK) {
+            break;
+        }
+    }
+    audio_free(buf);
+    if (!ftp->ftpClientClose(data) && ret == ESP_OK) {
+        ESP_LOGE(TAG, "RETR %s broke off after %u bytes: %s", remote, (unsigned)received,
+                 ftp->ftpClientGetLastResponse(ctrl));
+        ret = ESP_FAIL;
+    }
+    if (total) {
+        *total = received;
+    }
+    return ret;
+}
+
+static esp_err_t _buffer_sink(const uint8_t *data, int len, void *ctx)
+{
+    ftp_fetch_buffer_t *b = ctx;
+    if (b->len + len >= b->max) {
+        /* Keep what fits, callers may only need the start (a digest line) */
+        memcpy(b->buf + b->len, data, b->max - 1 - b->len);
+        b->len = b->max - 1;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(b->buf + b->len, data, len);
+    b->len += len;
+    return ESP_OK;
+}
+
+esp_err_t ftp_fetch_to_buffer(NetBuf_t *ctrl, const char *remote, char *buf, size_t max, size_t *len)
+{
+    if (max == 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    ftp_fetch_buffer_t b = {
+        .buf = buf,
+        .max = max,
+        .len = 0,
+    };
+    esp_err_t ret = ftp_fetch(ctrl, remote, _buffer_sink, &b, NULL);
+    buf[b.len] = '\0';
+    if (len) {
+        *len = b.len;
+    }
+    return ret;
+}
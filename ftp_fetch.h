@@ -0,0 +1,48 @@
+/*
+ * ftp_fetch - stream a remote file from the NAS over RETR
+ *
+ * Data goes from the data connection to a sink callback in the order it
+ * arrives, at most FTP_CLIENT_BUFFER_SIZE bytes at a time, without a copy on
+ * the SD card. ftp_fetch_to_buffer() reads small files (site config, image
+ * digests) into RAM.
+ */
+
+#ifndef FTP_FETCH_H_
+#define FTP_FETCH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "FtpClient.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief  Receives the file piece by piece, anything but ESP_OK aborts the transfer
+ */
+typedef esp_err_t (*ftp_fetch_sink_t)(const uint8_t *data, int len, void *ctx);
+
+/**
+ * @brief  RETR remote into sink
+ *
+ * @return ESP_OK               whole file delivered, total set to its size (may be NULL)
+ *         ESP_ERR_NOT_FOUND    server has no such file (550)
+ *         ESP_FAIL             transfer failed
+ *         other                error returned by the sink
+ */
+esp_err_t ftp_fetch(NetBuf_t *ctrl, const char *remote, ftp_fetch_sink_t sink, void *ctx, size_t *total);
+
+/**
+ * @brief  RETR remote into buf, NUL terminated. ESP_ERR_INVALID_SIZE when the
+ *         file does not fit into max - 1 bytes, buf then holds its first
+ *         max - 1 bytes.
+ */
+esp_err_t ftp_fetch_to_buffer(NetBuf_t *ctrl, const char *remote, char *buf, size_t max, size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FTP_FETCH_H_ */
@@ -0,0 +1,199 @@
+/*
+ * ftp_retry - bounded retry around FtpClient uploads
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "ftp_retry.h"
+
+static const char *TAG = "FTP_RETRY";
+
+struct ftp_retry {
+    ftp_retry_cfg_t     cfg;
+    NetBuf_t            *ctrl;
+    int64_t             deadline_us;
+    bool                rejected;       /* Login refused, do not try again this cycle */
+    ftp_retry_stats_t   stats;
+};
+
+ftp_retry_class_t ftp_retry_classify(int ok, const char *response)
+{
+    if (response == NULL || !isdigit((unsigned char)response[0])) {
+        return ok ? FTP_RETRY_OK : FTP_RETRY_RECONNECT;
+    }
+    if (strncmp(response, "421", 3) == 0) {
+        return FTP_RETRY_RECONNECT;
+    }
+    switch (response[0]) {
+        case '1':
+        case '2':
+        case '3':
+            return ok ? FTP_RETRY_OK : FTP_RETRY_TRANSIENT;
+        case '4':
+            return FTP_RETRY_TRANSIENT;
+        default:
+            return FTP_RETRY_PERMANENT;
+    }
+}
+
+int ftp_retry_backoff_ms(int attempt, int base_ms, int max_ms)
+{
+    int delay = base_ms;
+    for (int i = 1; i < attempt && delay < max_ms; i++) {
+        delay *= 2;
+    }
+    if (delay > max_ms) {
+        delay = max_ms;
+    }
+    return delay / 2 + (int)(esp_random() % (uint32_t)(delay / 2 + 1));
+}
+
+static bool _budget_left(ftp_retry_handle_t h, int delay_ms)
+{
+    return esp_timer_get_time() + delay_ms * 1000LL < h->deadline_us;
+}
+
+static void _drop_session(ftp_retry_handle_t h, bool dead)
+{
+    if (h->ctrl == NULL) {
+        return;
+    }
+    if (dead) {
+        getFtpClient()->ftpClientDisconnect(h->ctrl);
+    } else {
+        getFtpClient()->ftpClientQuit(h->ctrl);
+    }
+    h->ctrl = NULL;
+}
+
+ftp_retry_handle_t ftp_retry_init(const ftp_retry_cfg_t *config)
+{
+    ftp_retry_handle_t h = audio_calloc(1, sizeof(struct ftp_retry));
+    AUDIO_MEM_CHECK(TAG, h, return NULL);
+    h->cfg = *config;
+    if (h->cfg.max_attempts < 1) {
+        h->cfg.max_attempts = 1;
+    }
+    h->deadline_us = esp_timer_get_time() + h->cfg.budget_ms * 1000LL;
+    return h;
+}
+
+NetBuf_t *ftp_retry_session(ftp_retry_handle_t h)
+{
+    if (h->ctrl || h->rejected) {
+        return h->ctrl;
+    }
+    FtpClient *ftp = getFtpClient();
+    for (int attempt = 1; attempt <= h->cfg.max_attempts; attempt++) {
+        if (attempt > 1) {
+            int delay = ftp_retry_backoff_ms(attempt - 1, h->cfg.base_delay_ms, h->cfg.max_delay_ms);
+            if (!_budget_left(h, delay)) {
+                break;
+            }
+            ESP_LOGW(TAG, "Reconnect in %d ms (attempt %d/%d)", delay, attempt, h->cfg.max_attempts);
+            vTaskDelay(pdMS_TO_TICKS(delay));
+        }
+        h->stats.attempts++;
+        if (!ftp->ftpClientConnectFallback(h->cfg.server, h->cfg.port, h->cfg.server2, h->cfg.port2, &h->ctrl)) {
+            ESP_LOGE(TAG, "Connect to %s:%d failed", h->cfg.server, h->cfg.port);
+            h->ctrl = NULL;
+            h->stats.reconnects++;
+            continue;
+        }
+        int ok = 1;
+        if (h->cfg.tls) {
+            ok = ftp->ftpClientAuthTls(h->cfg.ca_pem, h->ctrl);
+        }
+        if (ok) {
+            ok = ftp->ftpClientLogin(h->cfg.user, h->cfg.pass, h->ctrl);
+        }
+        ftp_retry_class_t cls = ftp_retry_classify(ok, ftp->ftpClientGetLastResponse(h->ctrl));
+        if (cls == FTP_RETRY_OK) {
+            if (h->cfg.session_cb) {
+                h->cfg.session_cb(h->ctrl, h->cfg.session_ctx);
+            }
+            return h->ctrl;
+        }
+        ESP_LOGE(TAG, "Login failed: %s", ftp->ftpClientGetLastResponse(h->ctrl));
+        _drop_session(h, cls == FTP_RETRY_RECONNECT);
+        if (cls == FTP_RETRY_PERMANENT) {
+            h->stats.permanent++;
+            h->rejected = true;
+            break;
+        }
+        h->stats.transient++;
+    }
+    return NULL;
+}
+
+esp_err_t ftp_retry_put(ftp_retry_handle_t h, const char *local, const char *remote)
+{
+    struct stat st;
+    if (stat(local, &st) != 0) {
+        ESP_LOGE(TAG, "Missing %s", local);
+        return ESP_ERR_NOT_FOUND;
+    }
+    FtpClient *ftp = getFtpClient();
+    for (int attempt = 1; attempt <= h->cfg.max_attempts; attempt++) {
+        if (attempt > 1) {
+            int delay = ftp_retry_backoff_ms(attempt - 1, h->cfg.base_delay_ms, h->cfg.max_delay_ms);
+            if (!_budget_left(h, delay)) {
+                ESP_LOGW(TAG, "Time budget used up, %s stays on the card", local);
+                return ESP_ERR_TIMEOUT;
+            }
+            ESP_LOGW(TAG, "Retry %s in %d ms (attempt %d/%d)", remote, delay, attempt, h->cfg.max_attempts);
+            vTaskDelay(pdMS_TO_TICKS(delay));
+        }
+        NetBuf_t *ctrl = ftp_retry_session(h);
+        if (ctrl == NULL) {
+            return h->rejected ? ESP_FAIL : ESP_ERR_TIMEOUT;
+        }
+        h->stats.attempts++;
+        int ok = ftp->ftpClientPut(local, remote, FTP_CLIENT_BINARY, ctrl);
+        char *resp = ftp->ftpClientGetLastResponse(ctrl);
+        ftp_retry_class_t cls = ftp_retry_classify(ok, resp);
+        switch (cls) {
+            case FTP_RETRY_OK:
+                ESP_LOGI(TAG, "Uploaded %s -> %s (%ld bytes)", local, remote, (long)st.st_size);
+                return ESP_OK;
+            case FTP_RETRY_PERMANENT:
+                ESP_LOGE(TAG, "Upload %s refused: %s", remote, resp);
+                h->stats.permanent++;
+                return ESP_FAIL;
+            case FTP_RETRY_TRANSIENT:
+                ESP_LOGW(TAG, "Upload %s failed: %s", remote, resp);
+                h->stats.transient++;
+                break;
+            case FTP_RETRY_RECONNECT:
+                ESP_LOGW(TAG, "Upload %s lost the connection: %s", remote, (resp && resp[0]) ? resp : "no reply");
+                h->stats.reconnects++;
+                _drop_session(h, true);
+                break;
+        }
+    }
+    ESP_LOGW(TAG, "Giving up on %s for now, it stays on the card", local);
+    return ESP_ERR_TIMEOUT;
+}
+
+void ftp_retry_get_stats(ftp_retry_handle_t h, ftp_retry_stats_t *stats)
+{
+    memcpy(stats, &h->stats, sizeof(*stats));
+}
+
+void ftp_retry_deinit(ftp_retry_handle_t h)
+{
+    if (h == NULL) {
+        return;
+    }
+    _drop_session(h, false);
+    audio_free(h);
+}
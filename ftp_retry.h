@@ -0,0 +1,121 @@
+/*
+ * ftp_retry - bounded retry around FtpClient uploads
+ *
+ * Replaces the reboot-on-any-error handling of the upload path. Replies are
+ * classified: 4xx and lost connections are retried with exponential backoff
+ * and jitter (a dead control channel is reconnected first), 5xx replies are
+ * permanent for that request and not retried. When the attempts or the time
+ * budget run out the caller keeps the file on the card and tries again in the
+ * next cycle.
+ */
+
+#ifndef FTP_RETRY_H_
+#define FTP_RETRY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "FtpClient.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    FTP_RETRY_OK = 0,
+    FTP_RETRY_TRANSIENT,        /* 4xx reply: same session, try again later */
+    FTP_RETRY_RECONNECT,        /* 421, socket error or no reply: new session, then try again */
+    FTP_RETRY_PERMANENT,        /* 5xx reply: this request will not succeed */
+} ftp_retry_class_t;
+
+/**
+ * @brief  Called after every successful login, e.g. to set FTP_CLIENT_RATELIMIT
+ *         or log the connect timings
+ */
+typedef void (*ftp_retry_session_cb_t)(NetBuf_t *ctrl, void *ctx);
+
+typedef struct {
+    const char  *server;
+    uint16_t    port;
+    const char  *server2;       /* Fallback server, may be NULL */
+    uint16_t    port2;
+    const char  *user;
+    const char  *pass;
+    bool        tls;            /* AUTH TLS before login, a server without TLS counts as permanent */
+    const char  *ca_pem;        /* Server CA for tls, NULL skips verification */
+    int         max_attempts;   /* Per operation */
+    int         base_delay_ms;  /* Backoff before the second attempt */
+    int         max_delay_ms;   /* Backoff cap */
+    int         budget_ms;      /* Give up on new attempts after this long since ftp_retry_init() */
+    ftp_retry_session_cb_t session_cb;  /* May be NULL */
+    void        *session_ctx;
+} ftp_retry_cfg_t;
+
+#define FTP_RETRY_CFG_DEFAULT() {       \
+    .server = NULL,                     \
+    .port = 21,                         \
+    .server2 = NULL,                    \
+    .port2 = 21,                        \
+    .user = NULL,                       \
+    .pass = NULL,                       \
+    .tls = false,                       \
+    .ca_pem = NULL,                     \
+    .max_attempts = 4,                  \
+    .base_delay_ms = 1000,              \
+    .max_delay_ms = 30 * 1000,          \
+    .budget_ms = 3 * 60 * 1000,         \
+    .session_cb = NULL,                 \
+    .session_ctx = NULL,                \
+}
+
+typedef struct {
+    uint32_t attempts;
+    uint32_t reconnects;
+    uint32_t transient;
+    uint32_t permanent;
+} ftp_retry_stats_t;
+
+typedef struct ftp_retry *ftp_retry_handle_t;
+
+/**
+ * @brief  Classify the outcome of an FtpClient call from its return value and
+ *         the last reply on the control connection
+ */
+ftp_retry_class_t ftp_retry_classify(int ok, const char *response);
+
+/**
+ * @brief  Delay before retry number attempt (1 = first retry): exponential
+ *         from base_ms, capped at max_ms, uniformly jittered in [d/2, d]
+ */
+int ftp_retry_backoff_ms(int attempt, int base_ms, int max_ms);
+
+ftp_retry_handle_t ftp_retry_init(const ftp_retry_cfg_t *config);
+
+/**
+ * @brief  Logged in control connection, connecting with retries if needed.
+ *         Returns NULL when the server stays unreachable or rejects the login.
+ */
+NetBuf_t *ftp_retry_session(ftp_retry_handle_t h);
+
+/**
+ * @brief  Upload local to remote with retries
+ *
+ * @return ESP_OK               uploaded
+ *         ESP_ERR_NOT_FOUND    local file missing
+ *         ESP_ERR_TIMEOUT      attempts or budget used up, keep the file for the next cycle
+ *         ESP_FAIL             permanent error, retrying the same upload will not help
+ */
+esp_err_t ftp_retry_put(ftp_retry_handle_t h, const char *local, const char *remote);
+
+void ftp_retry_get_stats(ftp_retry_handle_t h, ftp_retry_stats_t *stats);
+
+/**
+ * @brief  Quit the session and free the handle
+ */
+void ftp_retry_deinit(ftp_retry_handle_t h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FTP_RETRY_H_ */
@@ -0,0 +1,890 @@
+/*
+ * ftp_loopback - minimal FTP server on 127.0.0.1 for the host build
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "ftp_loopback.h"
+
+static const char *TAG = "FTP_LOOPBACK";
+
+/* Longest command line, longer ones are answered 500 and dropped */
+#define FTP_LOOPBACK_LINE_MAX               512
+
+/* Wait for the client to open the data connection */
+#define FTP_LOOPBACK_ACCEPT_MS              5000
+
+#define FTP_LOOPBACK_BUF_SIZE               (64 * 1024)
+
+/* Control connections served at once, e.g. upload_worker next to live_upload */
+#define FTP_LOOPBACK_SESSIONS               8
+
+/* MODE B header descriptor bits (RFC 959 3.4.2) and largest block */
+#define FTP_LOOPBACK_BLOCK_EOF              0x40
+#define FTP_LOOPBACK_BLOCK_MARKER           0x10
+#define FTP_LOOPBACK_BLOCK_MAX              0xffff
+
+/* With delay_ms: the server's data receive buffer (Linux doubles it), and
+   the window sent per round trip when the kernel does not report the peer's */
+#define FTP_LOOPBACK_DELAY_RCVBUF           4096
+#define FTP_LOOPBACK_DELAY_WINDOW           (64 * 1024)
+
+struct ftp_loopback {
+    ftp_loopback_cfg_t      cfg;
+    char                    root[256];
+    int                     listen_fd;
+    uint16_t                port;
+    pthread_t               thread;
+    pthread_mutex_t         lock;
+    struct {
+        struct ftp_loopback *srv;
+        pthread_t           thread;
+        int                 fd;             /* Control connection, -1 once the session ended */
+        bool                started;        /* thread is to be joined */
+    } slot[FTP_LOOPBACK_SESSIONS];
+    bool                    quit;
+    ftp_loopback_stats_t    stats;
+    SSL_CTX                 *tls;           /* NULL without cfg.tls */
+    char                    ca_pem[2048];   /* The self-signed certificate */
+};
+
+typedef struct {
+    struct ftp_loopback *srv;
+    int     fd;
+    char    in[FTP_LOOPBACK_LINE_MAX * 2];
+    int     in_len;
+    int     pasv_fd;                        /* Listening data socket after PASV */
+    bool    block;                          /* MODE B */
+    int     data_fd;                        /* MODE B data connection kept after its EOF block, -1 none */
+    int     data_uses;                      /* Transfers on data_fd */
+    char    cwd[256];
+    bool    logged_in;
+    char    user[64];
+    SSL     *ssl;                           /* Control connection after AUTH TLS */
+    SSL     *data_ssl;                      /* TLS of the transfer's data connection or of data_fd */
+    bool    prot;                           /* PROT P, data connections use TLS */
+    int     window;                         /* delay_ms: bytes still sent before the next round trip */
+} session_t;
+
+/* recv/send on a connection, through TLS once it is protected. 0 only for
+   the end of the stream, with TLS that is the peer's close_notify */
+static int _recv(SSL *ssl, int fd, void *buf, int len)
+{
+    if (ssl) {
+        int n = SSL_read(ssl, buf, len);
+        if (n <= 0) {
+            n = SSL_get_error(ssl, n) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+            ERR_clear_error();
+        }
+        return n;
+    }
+    return recv(fd, buf, len, 0);
+}
+
+static int _send(SSL *ssl, int fd, const void *buf, int len)
+{
+    if (ssl) {
+        int n = SSL_write(ssl, buf, len);
+        if (n <= 0) {
+            ERR_clear_error();
+            return -1;
+        }
+        return n;
+    }
+    return send(fd, buf, len, MSG_NOSIGNAL);
+}
+
+/* Server side handshake on fd, NULL when it fails */
+static SSL *_tls_accept(struct ftp_loopback *srv, int fd)
+{
+    SSL *ssl = SSL_new(srv->tls);
+    if (ssl == NULL || SSL_set_fd(ssl, fd) != 1 || SSL_accept(ssl) != 1) {
+        ESP_LOGW(TAG, "TLS handshake failed: %s", ERR_reason_error_string(ERR_peek_error()));
+        ERR_clear_error();
+        SSL_free(ssl);
+        return NULL;
+    }
+    return ssl;
+}
+
+/* Ends TLS with close_notify, the socket stays open */
+static void _tls_close(SSL **ssl)
+{
+    if (*ssl) {
+        SSL_shutdown(*ssl);
+        ERR_clear_error();
+        SSL_free(*ssl);
+        *ssl = NULL;
+    }
+}
+
+/* One round trip of delay_ms each way */
+static void _round_trip(struct ftp_loopback *srv)
+{
+    if (srv->cfg.delay_ms > 0) {
+        usleep(2 * srv->cfg.delay_ms * 1000);
+    }
+}
+
+/*
+ * Data connection reads and writes under delay_ms. Once what was in flight
+ * has been read, the next window arrives a round trip later. Writes send
+ * the client's advertised receive window, then wait a round trip for it to
+ * open again.
+ */
+static int _data_recv(session_t *s, int fd, void *buf, int len)
+{
+    if (s->srv->cfg.delay_ms > 0 && (s->data_ssl == NULL || SSL_pending(s->data_ssl) == 0)) {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, 0) == 0) {
+            _round_trip(s->srv);
+        }
+    }
+    return _recv(s->data_ssl, fd, buf, len);
+}
+
+static int _peer_window(int fd)
+{
+    struct tcp_info ti = {0};
+    socklen_t len = sizeof(ti);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) != 0 || ti.tcpi_snd_wnd == 0) {
+        return FTP_LOOPBACK_DELAY_WINDOW;
+    }
+    return ti.tcpi_snd_wnd;
+}
+
+static int _data_send(session_t *s, int fd, const void *buf, int len)
+{
+    if (s->srv->cfg.delay_ms <= 0) {
+        return _send(s->data_ssl, fd, buf, len);
+    }
+    int sent = 0;
+    while (sent < len) {
+        if (s->window <= 0) {
+            _round_trip(s->srv);
+            s->window = _peer_window(fd);
+        }
+        int n = len - sent < s->window ? len - sent : s->window;
+        if (_send(s->data_ssl, fd, (const char *)buf + sent, n) != n) {
+            return -1;
+        }
+        sent += n;
+        s->window -= n;
+    }
+    return sent;
+}
+
+static void _reply(session_t *s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void _reply(session_t *s, const char *fmt, ...)
+{
+    char line[FTP_LOOPBACK_LINE_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line) - 2, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    if (n > (int)sizeof(line) - 3) {
+        n = sizeof(line) - 3;
+    }
+    memcpy(line + n, "\r\n", 2);
+    _round_trip(s->srv);
+    _send(s->ssl, s->fd, line, n + 2);
+}
+
+/* Next CRLF (or LF) terminated line without the terminator, -1 on EOF */
+static int _read_line(session_t *s, char *line, int max)
+{
+    while (1) {
+        char *eol = memchr(s->in, '\n', s->in_len);
+        if (eol) {
+            int len = eol - s->in;
+            int copy = len;
+            if (copy > 0 && s->in[copy - 1] == '\r') {
+                copy--;
+            }
+            if (copy >= max) {
+                copy = max - 1;
+            }
+            memcpy(line, s->in, copy);
+            line[copy] = 0;
+            s->in_len -= len + 1;
+            memmove(s->in, eol + 1, s->in_len);
+            return copy;
+        }
+        if (s->in_len == sizeof(s->in)) {
+            /* Overlong line, drop what we have and resync on the next LF */
+            s->in_len = 0;
+            _reply(s, "500 Line too long");
+        }
+        if (s->data_fd >= 0 && s->srv->cfg.block_idle_ms > 0 && (s->ssl == NULL || SSL_pending(s->ssl) == 0)) {
+            /* Servers time out an idle kept data connection */
+            struct pollfd pfd = {.fd = s->fd, .events = POLLIN};
+            if (poll(&pfd, 1, s->srv->cfg.block_idle_ms) == 0) {
+                _tls_close(&s->data_ssl);
+                close(s->data_fd);
+                s->data_fd = -1;
+            }
+        }
+        int n = _recv(s->ssl, s->fd, s->in + s->in_len, sizeof(s->in) - s->in_len);
+        if (n <= 0) {
+            return -1;
+        }
+        s->in_len += n;
+    }
+}
+
+/* Remote path to a host path under root, false if it leaves the root */
+static bool _local_path(struct ftp_loopback *srv, session_t *s, const char *arg, char *out, size_t len)
+{
+    char rel[512];
+    if (arg[0] == '/') {
+        snprintf(rel, sizeof(rel), "%s", arg);
+    } else {
+        snprintf(rel, sizeof(rel), "%s/%s", s->cwd, arg);
+    }
+    if (strstr(rel, "..")) {
+        return false;
+    }
+    int n = snprintf(out, len, "%s%s", srv->root, rel);
+    return n > 0 && (size_t)n < len;
+}
+
+static void _mkdirs(char *path)
+{
+    for (char *p = path + 1; *p; p++) {
+        if (*p == '/') {
+            *p = 0;
+            mkdir(path, 0755);
+            *p = '/';
+        }
+    }
+}
+
+static int _recv_all(session_t *s, int fd, void *buf, int len)
+{
+    int got = 0;
+    while (got < len) {
+        int n = _data_recv(s, fd, (char *)buf + got, len - got);
+        if (n <= 0) {
+            return -1;
+        }
+        got += n;
+    }
+    return got;
+}
+
+static bool _send_block(session_t *s, int fd, int desc, const void *data, int len)
+{
+    uint8_t h[3] = {desc, len >> 8, len & 0xff};
+    return _data_send(s, fd, h, sizeof(h)) == sizeof(h)
+           && (len == 0 || _data_send(s, fd, data, len) == len);
+}
+
+static void _drop_data(session_t *s)
+{
+    if (s->data_fd >= 0) {
+        _tls_close(&s->data_ssl);
+        close(s->data_fd);
+        s->data_fd = -1;
+    }
+}
+
+static int _accept_data(session_t *s)
+{
+    if (s->pasv_fd < 0) {
+        return -1;
+    }
+    struct pollfd pfd = {.fd = s->pasv_fd, .events = POLLIN};
+    int fd = -1;
+    if (poll(&pfd, 1, FTP_LOOPBACK_ACCEPT_MS) == 1) {
+        fd = accept(s->pasv_fd, NULL, NULL);
+    }
+    close(s->pasv_fd);
+    s->pasv_fd = -1;
+    return fd;
+}
+
+/*
+ * TLS on a new data connection after PROT P. With tls_require_reuse the
+ * handshake has to resume the session of the control connection, as
+ * vsftpd's require_ssl_reuse demands. false after the 522.
+ */
+static bool _data_tls(struct ftp_loopback *srv, session_t *s, int fd)
+{
+    /* A client that never starts the handshake does not hold the session */
+    struct timeval tv = {.tv_sec = FTP_LOOPBACK_ACCEPT_MS / 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    SSL *ssl = _tls_accept(srv, fd);
+    bool resumed = ssl && SSL_session_reused(ssl);
+    tv.tv_sec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    pthread_mutex_lock(&srv->lock);
+    srv->stats.tls_handshakes += ssl != NULL;
+    srv->stats.tls_resumed += resumed;
+    pthread_mutex_unlock(&srv->lock);
+    if (ssl == NULL || (srv->cfg.tls_require_reuse && !resumed)) {
+        SSL_free(ssl);
+        close(fd);
+        _reply(s, ssl ? "522 SSL connection failed: session reuse required" : "522 SSL connection failed");
+        return false;
+    }
+    s->data_ssl = ssl;
+    return true;
+}
+
+/*
+ * Data connection for a transfer and its preliminary reply: the one PASV
+ * opened, else the kept MODE B one. -1 after the 425.
+ */
+static int _open_data(struct ftp_loopback *srv, session_t *s, const char *arg)
+{
+    int fd = -1;
+    if (s->pasv_fd < 0 && s->data_fd >= 0
+        && (srv->cfg.block_reuse_max == 0 || s->data_uses < srv->cfg.block_reuse_max)) {
+        fd = s->data_fd;
+        s->data_uses++;
+        pthread_mutex_lock(&srv->lock);
+        srv->stats.data_reused++;
+        pthread_mutex_unlock(&srv->lock);
+        _reply(s, "125 Data connection already open; transfer starting for %s", arg);
+        return fd;
+    }
+    /* A new one replaces the kept connection */
+    _drop_data(s);
+    fd = _accept_data(s);
+    if (fd < 0) {
+        _reply(s, "425 No data connection");
+        return -1;
+    }
+    s->data_uses = 1;
+    pthread_mutex_lock(&srv->lock);
+    srv->stats.data_connects++;
+    pthread_mutex_unlock(&srv->lock);
+    _reply(s, "150 Opening BINARY mode data connection for %s", arg);
+    if (s->prot && !_data_tls(srv, s, fd)) {
+        return -1;
+    }
+    return fd;
+}
+
+/* Keep a MODE B connection that ended with its EOF block, close anything else */
+static void _close_data(session_t *s, int fd, bool keep)
+{
+    if (keep && s->block) {
+        s->data_fd = fd;
+    } else {
+        _tls_close(&s->data_ssl);
+        close(fd);
+        if (fd == s->data_fd) {
+            s->data_fd = -1;
+        }
+    }
+}
+
+static void _pasv(session_t *s)
+{
+    if (s->pasv_fd >= 0) {
+        close(s->pasv_fd);
+    }
+    s->pasv_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = 0,
+    };
+    socklen_t alen = sizeof(addr);
+    if (s->pasv_fd >= 0 && s->srv->cfg.delay_ms > 0) {
+        /* Set before listen, the data connection inherits it */
+        int size = FTP_LOOPBACK_DELAY_RCVBUF;
+        setsockopt(s->pasv_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    if (s->pasv_fd < 0 || bind(s->pasv_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(s->pasv_fd, 1) != 0 || getsockname(s->pasv_fd, (struct sockaddr *)&addr, &alen) != 0) {
+        if (s->pasv_fd >= 0) {
+            close(s->pasv_fd);
+            s->pasv_fd = -1;
+        }
+        _reply(s, "425 Can't open data connection");
+        return;
+    }
+    uint16_t port = ntohs(addr.sin_port);
+    _reply(s, "227 Entering Passive Mode (127,0,0,1,%d,%d)", port >> 8, port & 0xff);
+}
+
+static void _store(struct ftp_loopback *srv, session_t *s, const char *arg, bool append)
+{
+    char path[512];
+    int file = -1;
+    if (srv->cfg.root) {
+        if (!_local_path(srv, s, arg, path, sizeof(path))) {
+            _reply(s, "553 Bad file name");
+            return;
+        }
+        _mkdirs(path);
+        file = open(path, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644);
+        if (file < 0) {
+            _reply(s, "553 %s", strerror(errno));
+            return;
+        }
+    }
+    int data = _open_data(srv, s, arg);
+    if (data < 0) {
+        if (file >= 0) {
+            close(file);
+        }
+        return;
+    }
+    char buf[FTP_LOOPBACK_BUF_SIZE];
+    int64_t start = esp_timer_get_time();
+    uint64_t total = 0;
+    bool failed = false;
+    bool complete = false;
+    if (s->block) {
+        /* Blocks until the EOF block, the connection ending before it aborts */
+        uint8_t h[3];
+        while (!complete && _recv_all(s, data, h, sizeof(h)) > 0) {
+            int left = (h[1] << 8) | h[2];
+            int n = 0;
+            while (left > 0
+                   && (n = _data_recv(s, data, buf, left < (int)sizeof(buf) ? left : (int)sizeof(buf))) > 0) {
+                left -= n;
+                if (h[0] & FTP_LOOPBACK_BLOCK_MARKER) {
+                    continue;
+                }
+                total += n;
+                if (file >= 0 && write(file, buf, n) != n) {
+                    failed = true;
+                }
+            }
+            if (left > 0) {
+                break;
+            }
+            complete = (h[0] & FTP_LOOPBACK_BLOCK_EOF) != 0;
+        }
+    } else {
+        int n;
+        while ((n = _data_recv(s, data, buf, sizeof(buf))) > 0) {
+            total += n;
+            if (file >= 0 && write(file, buf, n) != n) {
+                failed = true;
+            }
+        }
+        complete = n == 0;
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+    _close_data(s, data, complete);
+    if (file >= 0 && close(file) != 0) {
+        failed = true;
+    }
+    pthread_mutex_lock(&srv->lock);
+    srv->stats.bytes_in += total;
+    srv->stats.transfer_us += elapsed;
+    if (!complete) {
+        srv->stats.aborted++;
+    } else if (!failed) {
+        srv->stats.stored++;
+    }
+    pthread_mutex_unlock(&srv->lock);
+    if (failed) {
+        _reply(s, "451 Local write error");
+    } else if (!complete) {
+        _reply(s, "426 Connection closed, transfer aborted");
+    } else {
+        _reply(s, "226 Transfer complete");
+    }
+}
+
+static void _retrieve(struct ftp_loopback *srv, session_t *s, const char *arg)
+{
+    char path[512];
+    int file = -1;
+    if (srv->cfg.root && _local_path(srv, s, arg, path, sizeof(path))) {
+        file = open(path, O_RDONLY);
+    }
+    if (file < 0) {
+        _reply(s, "550 %s: No such file", arg);
+        return;
+    }
+    int data = _open_data(srv, s, arg);
+    if (data < 0) {
+        close(file);
+        return;
+    }
+    char buf[FTP_LOOPBACK_BUF_SIZE];
+    /* A MODE B block carries at most 64 KiB - 1 */
+    int chunk = s->block ? FTP_LOOPBACK_BLOCK_MAX : (int)sizeof(buf);
+    /* The first window goes out with the 150 */
+    s->window = srv->cfg.delay_ms > 0 ? _peer_window(data) : 0;
+    uint64_t total = 0;
+    bool failed = false;
+    int n;
+    while (!failed && (n = read(file, buf, chunk)) > 0) {
+        failed = s->block ? !_send_block(s, data, 0, buf, n) : _data_send(s, data, buf, n) != n;
+        total += n;
+    }
+    if (!failed && s->block) {
+        failed = !_send_block(s, data, FTP_LOOPBACK_BLOCK_EOF, NULL, 0);
+    }
+    close(file);
+    _close_data(s, data, !failed);
+    pthread_mutex_lock(&srv->lock);
+    srv->stats.bytes_out += total;
+    pthread_mutex_unlock(&srv->lock);
+    _reply(s, failed ? "426 Transfer aborted" : "226 Transfer complete");
+}
+
+static bool _quitting(struct ftp_loopback *srv)
+{
+    pthread_mutex_lock(&srv->lock);
+    bool quit = srv->quit;
+    pthread_mutex_unlock(&srv->lock);
+    return quit;
+}
+
+static void _session(struct ftp_loopback *srv, int fd)
+{
+    session_t s = {
+        .srv = srv,
+        .fd = fd,
+        .pasv_fd = -1,
+        .data_fd = -1,
+        .cwd = "",
+    };
+    char line[FTP_LOOPBACK_LINE_MAX];
+    _reply(&s, "220 ftp_loopback ready");
+    while (!_quitting(srv) && _read_line(&s, line, sizeof(line)) >= 0) {
+        ESP_LOGD(TAG, "<- %s", line);
+        char *arg = strchr(line, ' ');
+        if (arg) {
+            *arg++ = 0;
+        } else {
+            arg = line + strlen(line);
+        }
+        if (strcasecmp(line, "USER") == 0) {
+            snprintf(s.user, sizeof(s.user), "%s", arg);
+            s.logged_in = false;
+            _reply(&s, "331 Password required for %s", s.user);
+        } else if (strcasecmp(line, "PASS") == 0) {
+            if ((srv->cfg.user && strcmp(srv->cfg.user, s.user) != 0)
+                || (srv->cfg.pass && strcmp(srv->cfg.pass, arg) != 0)) {
+                _reply(&s, "530 Login incorrect");
+            } else {
+                s.logged_in = true;
+                _reply(&s, "230 User %s logged in", s.user);
+            }
+        } else if (strcasecmp(line, "QUIT") == 0) {
+            _reply(&s, "221 Goodbye");
+            break;
+        } else if (strcasecmp(line, "NOOP") == 0) {
+            _reply(&s, "200 NOOP ok");
+        } else if (strcasecmp(line, "SYST") == 0) {
+            _reply(&s, "215 UNIX Type: L8");
+        } else if (strcasecmp(line, "AUTH") == 0) {
+            if (srv->tls == NULL || strcasecmp(arg, "TLS") != 0) {
+                _reply(&s, "504 AUTH %s not supported", arg);
+            } else if (s.ssl) {
+                _reply(&s, "503 Already using TLS");
+            } else {
+                _reply(&s, "234 AUTH TLS successful");
+                if ((s.ssl = _tls_accept(srv, fd)) == NULL) {
+                    break;
+                }
+            }
+        } else if (strcasecmp(line, "PBSZ") == 0) {
+            _reply(&s, s.ssl ? "200 PBSZ=0" : "503 PBSZ needs AUTH first");
+        } else if (strcasecmp(line, "PROT") == 0) {
+            if (s.ssl == NULL) {
+                _reply(&s, "503 PROT needs AUTH first");
+            } else if (strcasecmp(arg, "P") == 0 || strcasecmp(arg, "C") == 0) {
+                s.prot = strcasecmp(arg, "P") == 0;
+                _reply(&s, "200 Protection level set to %s", arg);
+            } else {
+                _reply(&s, "536 PROT %s not supported", arg);
+            }
+        } else if (!s.logged_in) {
+            _reply(&s, "530 Please login with USER and PASS");
+        } else if (strcasecmp(line, "TYPE") == 0) {
+            _reply(&s, "200 Type set to %s", arg);
+        } else if (strcasecmp(line, "MODE") == 0) {
+            if (strcasecmp(arg, "S") == 0) {
+                s.block = false;
+                _drop_data(&s);
+                _reply(&s, "200 Mode set to S");
+            } else if (strcasecmp(arg, "B") == 0 && !srv->cfg.no_mode_b) {
+                s.block = true;
+                _reply(&s, "200 Mode set to B");
+            } else {
+                _reply(&s, "504 Mode %s not implemented", arg);
+            }
+        } else if (strcasecmp(line, "PASV") == 0) {
+            _pasv(&s);
+        } else if (strcasecmp(line, "STOR") == 0 || strcasecmp(line, "APPE") == 0) {
+            _store(srv, &s, arg, strcasecmp(line, "APPE") == 0);
+        } else if (strcasecmp(line, "RETR") == 0) {
+            _retrieve(srv, &s, arg);
+        } else if (strcasecmp(line, "SIZE") == 0) {
+            char path[512];
+            struct stat st;
+            if (srv->cfg.root && _local_path(srv, &s, arg, path, sizeof(path)) && stat(path, &st) == 0) {
+                _reply(&s, "213 %lld", (long long)st.st_size);
+            } else {
+                _reply(&s, "550 %s: No such file", arg);
+            }
+        } else if (strcasecmp(line, "MKD") == 0) {
+            char path[512];
+            if (srv->cfg.root && _local_path(srv, &s, arg, path, sizeof(path))) {
+                mkdir(path, 0755);
+            }
+            _reply(&s, "257 \"%s\" created", arg);
+        } else if (strcasecmp(line, "CWD") == 0) {
+            if (strstr(arg, "..") || strlen(s.cwd) + strlen(arg) + 2 > sizeof(s.cwd)) {
+                _reply(&s, "550 %s: No such directory", arg);
+            } else {
+                if (arg[0] == '/') {
+                    snprintf(s.cwd, sizeof(s.cwd), "%s", strcmp(arg, "/") == 0 ? "" : arg);
+                } else {
+                    strcat(s.cwd, "/");
+                    strcat(s.cwd, arg);
+                }
+                _reply(&s, "250 CWD command successful");
+            }
+        } else if (strcasecmp(line, "PWD") == 0) {
+            _reply(&s, "257 \"%s\" is current directory", s.cwd[0] ? s.cwd : "/");
+        } else if (strcasecmp(line, "DELE") == 0) {
+            char path[512];
+            if (srv->cfg.root && _local_path(srv, &s, arg, path, sizeof(path)) && unlink(path) == 0) {
+                _reply(&s, "250 DELE command successful");
+            } else {
+                _reply(&s, "550 %s: No such file", arg);
+            }
+        } else {
+            _reply(&s, "502 %s not implemented", line);
+        }
+    }
+    if (s.pasv_fd >= 0) {
+        close(s.pasv_fd);
+    }
+    _drop_data(&s);
+    _tls_close(&s.ssl);
+}
+
+static void *_session_thread(void *arg)
+{
+    struct ftp_loopback *srv = *(struct ftp_loopback **)arg;
+    int i = (int)((char *)arg - (char *)srv->slot) / (int)sizeof(srv->slot[0]);
+    pthread_mutex_lock(&srv->lock);
+    int fd = srv->slot[i].fd;
+    pthread_mutex_unlock(&srv->lock);
+    _session(srv, fd);
+    pthread_mutex_lock(&srv->lock);
+    srv->slot[i].fd = -1;
+    pthread_mutex_unlock(&srv->lock);
+    close(fd);
+    return NULL;
+}
+
+static void *_server_thread(void *arg)
+{
+    struct ftp_loopback *srv = arg;
+    while (!_quitting(srv)) {
+        int fd = accept(srv->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        /* 150 and 226 go out back to back, Nagle would hold the 226 for the delayed ACK */
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        int i;
+        pthread_mutex_lock(&srv->lock);
+        for (i = 0; i < FTP_LOOPBACK_SESSIONS; i++) {
+            if (srv->slot[i].started && srv->slot[i].fd < 0) {
+                pthread_join(srv->slot[i].thread, NULL);
+                srv->slot[i].started = false;
+            }
+            if (!srv->slot[i].started) {
+                break;
+            }
+        }
+        if (i < FTP_LOOPBACK_SESSIONS) {
+            srv->slot[i].fd = fd;
+            srv->slot[i].started = pthread_create(&srv->slot[i].thread, NULL, _session_thread, &srv->slot[i]) == 0;
+            srv->stats.sessions += srv->slot[i].started;
+        }
+        bool started = i < FTP_LOOPBACK_SESSIONS && srv->slot[i].started;
+        pthread_mutex_unlock(&srv->lock);
+        if (!started) {
+            const char busy[] = "421 Too many connections\r\n";
+            send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL);
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+/* Self-signed P-256 certificate for 127.0.0.1, its PEM is the client's CA */
+static bool _tls_init(struct ftp_loopback *srv)
+{
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *crt = X509_new();
+    bool ok = key && crt;
+    if (ok) {
+        X509_set_version(crt, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(crt), 1);
+        X509_gmtime_adj(X509_getm_notBefore(crt), -3600);
+        X509_gmtime_adj(X509_getm_notAfter(crt), 7 * 86400);
+        X509_set_pubkey(crt, key);
+        X509_NAME *name = X509_get_subject_name(crt);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"ftp_loopback", -1, -1, 0);
+        X509_set_issuer_name(crt, name);
+        X509V3_CTX v3;
+        X509V3_set_ctx_nodb(&v3);
+        X509V3_set_ctx(&v3, crt, crt, NULL, NULL, 0);
+        static const struct {
+            int         nid;
+            const char  *value;
+        } ext[] = {
+            { NID_basic_constraints, "critical,CA:TRUE" },
+            { NID_subject_alt_name, "IP:127.0.0.1" },
+        };
+        for (size_t i = 0; ok && i < sizeof(ext) / sizeof(ext[0]); i++) {
+            X509_EXTENSION *e = X509V3_EXT_conf_nid(NULL, &v3, ext[i].nid, ext[i].value);
+            ok = e && X509_add_ext(crt, e, -1) == 1;
+            X509_EXTENSION_free(e);
+        }
+        ok = ok && X509_sign(crt, key, EVP_sha256()) > 0;
+    }
+    srv->tls = ok ? SSL_CTX_new(TLS_server_method()) : NULL;
+    ok = srv->tls && SSL_CTX_use_certificate(srv->tls, crt) == 1 && SSL_CTX_use_PrivateKey(srv->tls, key) == 1
+         && SSL_CTX_set_session_id_context(srv->tls, (const unsigned char *)"ftp_loopback", 12) == 1;
+    BIO *mem = BIO_new(BIO_s_mem());
+    if (ok && mem && PEM_write_bio_X509(mem, crt) == 1) {
+        int n = BIO_read(mem, srv->ca_pem, sizeof(srv->ca_pem) - 1);
+        srv->ca_pem[n > 0 ? n : 0] = '\0';
+        ok = n > 0;
+    }
+    BIO_free(mem);
+    X509_free(crt);
+    EVP_PKEY_free(key);
+    if (!ok) {
+        ESP_LOGE(TAG, "TLS setup failed: %s", ERR_reason_error_string(ERR_peek_error()));
+        ERR_clear_error();
+    }
+    return ok;
+}
+
+ftp_loopback_handle_t ftp_loopback_start(const ftp_loopback_cfg_t *config)
+{
+    struct ftp_loopback *srv = calloc(1, sizeof(*srv));
+    if (srv == NULL) {
+        return NULL;
+    }
+    srv->cfg = *config;
+    for (int i = 0; i < FTP_LOOPBACK_SESSIONS; i++) {
+        srv->slot[i].srv = srv;
+        srv->slot[i].fd = -1;
+    }
+    if (config->root) {
+        snprintf(srv->root, sizeof(srv->root), "%s", config->root);
+        mkdir(srv->root, 0755);
+    }
+    pthread_mutex_init(&srv->lock, NULL);
+    srv->listen_fd = -1;
+    if (config->tls && !_tls_init(srv)) {
+        goto _fail;
+    }
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = 0,
+    };
+    socklen_t alen = sizeof(addr);
+    srv->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (srv->listen_fd < 0 || bind(srv->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(srv->listen_fd, 4) != 0 || getsockname(srv->listen_fd, (struct sockaddr *)&addr, &alen) != 0) {
+        ESP_LOGE(TAG, "Listen failed: %s", strerror(errno));
+        goto _fail;
+    }
+    srv->port = ntohs(addr.sin_port);
+    if (pthread_create(&srv->thread, NULL, _server_thread, srv) != 0) {
+        goto _fail;
+    }
+    ESP_LOGI(TAG, "Listening on 127.0.0.1:%u, %s", srv->port, srv->cfg.root ? srv->root : "data dropped");
+    return srv;
+_fail:
+    if (srv->listen_fd >= 0) {
+        close(srv->listen_fd);
+    }
+    SSL_CTX_free(srv->tls);
+    pthread_mutex_destroy(&srv->lock);
+    free(srv);
+    return NULL;
+}
+
+uint16_t ftp_loopback_port(ftp_loopback_handle_t srv)
+{
+    return srv->port;
+}
+
+const char *ftp_loopback_tls_ca(ftp_loopback_handle_t srv)
+{
+    return srv->tls ? srv->ca_pem : NULL;
+}
+
+void ftp_loopback_get_stats(ftp_loopback_handle_t srv, ftp_loopback_stats_t *stats)
+{
+    pthread_mutex_lock(&srv->lock);
+    *stats = srv->stats;
+    pthread_mutex_unlock(&srv->lock);
+}
+
+void ftp_loopback_stop(ftp_loopback_handle_t srv)
+{
+    if (srv == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&srv->lock);
+    srv->quit = true;
+    shutdown(srv->listen_fd, SHUT_RDWR);
+    pthread_mutex_unlock(&srv->lock);
+    pthread_join(srv->thread, NULL);
+    /* The accept loop is gone, nothing starts a session any more */
+    for (int i = 0; i < FTP_LOOPBACK_SESSIONS; i++) {
+        pthread_mutex_lock(&srv->lock);
+        if (srv->slot[i].fd >= 0) {
+            shutdown(srv->slot[i].fd, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&srv->lock);
+        if (srv->slot[i].started) {
+            pthread_join(srv->slot[i].thread, NULL);
+        }
+    }
+    close(srv->listen_fd);
+    SSL_CTX_free(srv->tls);
+    pthread_mutex_destroy(&srv->lock);
+    free(srv);
+}
@@ -0,0 +1,100 @@
+/*
+ * ftp_loopback - minimal FTP server on 127.0.0.1 for the host build
+ *
+ * Enough of RFC 959 for FtpClient: USER/PASS, TYPE, MODE S and B, PASV,
+ * STOR/APPE/RETR, SIZE, MKD/CWD/PWD/DELE and QUIT. Up to 8 control connections
+ * at once, each on its own thread, on an ephemeral port. Stored files go under
+ * root, or are counted and dropped when root is NULL.
+ *
+ * In MODE B a data connection stays open after the EOF block. A transfer
+ * command without a PASV before it goes over that connection (125), or gets
+ * 425 when there is none. no_mode_b, block_idle_ms and block_reuse_max make
+ * the server behave like the ones the client has to fall back from.
+ *
+ * With tls the server answers AUTH TLS, PBSZ and PROT P/C (RFC 4217) with a
+ * self-signed certificate for 127.0.0.1 made at start; ftp_loopback_tls_ca()
+ * is the PEM to verify it with. Data connections after PROT P handshake
+ * after the 150. tls_require_reuse refuses those that do not resume the
+ * control connection's session, like vsftpd with require_ssl_reuse.
+ *
+ * delay_ms stands in for `tc qdisc add dev lo root netem delay <ms>`: each
+ * reply goes out a round trip (2 x delay_ms) after its command, and a data
+ * connection moves a window per round trip. On STOR the server's receive
+ * buffer is kept small, so the window is what the client's SO_SNDBUF holds;
+ * RETR sends the client's advertised window, which follows its SO_RCVBUF.
+ */
+
+#ifndef FTP_LOOPBACK_H_
+#define FTP_LOOPBACK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    const char  *root;              /* Directory for stored files, NULL drops the data */
+    const char  *user;              /* Login accepted, NULL accepts any */
+    const char  *pass;
+    bool        no_mode_b;          /* Answer MODE B with 504 */
+    int         block_idle_ms;      /* Close a kept data connection idle this long, 0 never */
+    int         block_reuse_max;    /* Transfers per data connection, then 425 on reuse, 0 no limit */
+    bool        tls;                /* Offer AUTH TLS */
+    bool        tls_require_reuse;  /* 522 on a data connection that did not resume the session */
+    int         delay_ms;           /* One way delay added to both connections, 0 none */
+} ftp_loopback_cfg_t;
+
+#define FTP_LOOPBACK_CFG_DEFAULT() {        \
+    .root = NULL,                           \
+    .user = NULL,                           \
+    .pass = NULL,                           \
+    .no_mode_b = false,                     \
+    .block_idle_ms = 0,                     \
+    .block_reuse_max = 0,                   \
+    .tls = false,                           \
+    .tls_require_reuse = false,             \
+    .delay_ms = 0,                          \
+}
+
+typedef struct {
+    uint32_t sessions;              /* Control connections accepted */
+    uint32_t stored;                /* STOR/APPE completed */
+    uint32_t aborted;               /* STOR/APPE whose data connection ended early */
+    uint32_t data_connects;         /* Data connections accepted */
+    uint32_t data_reused;           /* Transfers on a kept MODE B data connection */
+    uint64_t bytes_in;              /* Data received */
+    uint64_t bytes_out;             /* Data sent by RETR */
+    int64_t  transfer_us;           /* Time from data accept to EOF, all STOR/APPE */
+    uint32_t tls_handshakes;        /* Data connections protected by PROT P */
+    uint32_t tls_resumed;           /* Of those, handshakes that resumed a session */
+} ftp_loopback_stats_t;
+
+typedef struct ftp_loopback *ftp_loopback_handle_t;
+
+ftp_loopback_handle_t ftp_loopback_start(const ftp_loopback_cfg_t *config);
+
+/**
+ * @brief  Port the server listens on, connect to 127.0.0.1
+ */
+uint16_t ftp_loopback_port(ftp_loopback_handle_t srv);
+
+/**
+ * @brief  PEM of the server certificate, NULL without tls
+ */
+const char *ftp_loopback_tls_ca(ftp_loopback_handle_t srv);
+
+void ftp_loopback_get_stats(ftp_loopback_handle_t srv, ftp_loopback_stats_t *stats);
+
+/**
+ * @brief  Close the listening socket and all sessions, join the threads
+ */
+void ftp_loopback_stop(ftp_loopback_handle_t srv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FTP_LOOPBACK_H_ */
@@ -0,0 +1,439 @@
+/*
+ * record_host - the record -> encode -> write -> upload flow of app_main on
+ * the host
+ *
+ * sim_source -> wav_encoder -> sd_wav_writer into ./sdcard with clip_store,
+ * pipeline_monitor and cycle_prof as on the board, then ftp_retry uploads the
+ * clip to ftp_loopback (files under ./nas). Prints the sim_source report
+ * (real-time factor, source -> writer latency, CPU by task, heap low water),
+ * the cycle_prof stages, the upload throughput, the end-to-end latency from
+ * the last sample captured to the clip on the server, and the peak RSS.
+ *
+ * With --live MS, live_upload APPEnds the audio to <clip>.live.wav on the
+ * server in chunks of MS while recording, and reports the latency from a
+ * chunk reaching the writer to its 226.
+ *
+ * With --tls the server offers AUTH TLS and requires session reuse on data
+ * connections; ftp_retry and live_upload protect control and data with it,
+ * verifying the server certificate.
+ *
+ * The stress options load the recording as CONCURRENT_UPLOAD does on the
+ * board. --cpu-mhz locks the clock through task_plan_set_cpu_freq(), and the
+ * element shim stretches each process() call to that clock. --upload-kib puts
+ * a backlog clip of that size on the card, which upload_worker sends during
+ * the recording, paced to last as long, pausing on writer pressure.
+ *
+ *   record_host [--seconds N] [--realtime] [--live MS [--live-max-ms N]]
+ *               [--tls] [--cpu-mhz MHZ] [--upload-kib N] [--max-drops N]
+ *               [--fixture file.wav] [--verbose]
+ *
+ * Exits non-zero when the clip does not reach the server intact, with --live
+ * when a chunk was lost or took longer than --live-max-ms, with --upload-kib
+ * when the backlog was not uploaded, and with --max-drops when the source
+ * dropped audio (pipeline_monitor or sim_source) more often.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_cpu.h"
+#include "esp_heap_caps.h"
+#include "audio_error.h"
+#include "audio_element.h"
+#include "audio_pipeline.h"
+#include "wav_encoder.h"
+#include "sim_source.h"
+#include "sd_wav_writer.h"
+#include "pipeline_monitor.h"
+#include "cycle_prof.h"
+#include "clip_store.h"
+#include "ftp_retry.h"
+#include "live_upload.h"
+#include "upload_worker.h"
+#include "task_plan.h"
+#include "ftp_loopback.h"
+
+static const char *TAG = "RECORD_HOST";
+
+#define HOST_SDCARD                         "sdcard"
+#define HOST_NAS_ROOT                       "nas"
+#define HOST_UPLOAD_DIR                     "/record"
+#define HOST_FTP_USER                       "esp32"
+#define HOST_FTP_PASS                       "esp32"
+#define HOST_BACKLOG                        HOST_SDCARD "/backlog.wav"
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [--seconds N] [--realtime] [--live MS [--live-max-ms N]] [--tls] [--cpu-mhz MHZ] "
+            "[--upload-kib N] [--max-drops N] [--fixture file.wav] [--verbose]\n", prog);
+}
+
+static long file_size(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+/* As sim_writer_tap() of app_main: source -> writer latency, then the live copy */
+static void host_writer_tap(const char *uri, const audio_element_info_t *info, const void *data, int len, void *ctx)
+{
+    sim_source_tap(uri, info, data, len, ctx);
+    live_upload_tap(uri, info, data, len, NULL);
+}
+
+/* As writer_pressure() of app_main: element 1 is wav_encoder, its output feeds the writer */
+static int host_writer_pressure(void *ctx)
+{
+    return pipeline_monitor_fill_percent((pipeline_monitor_handle_t)ctx, 1);
+}
+
+static long host_upload_rate(void *ctx)
+{
+    return *(long *)ctx;
+}
+
+/* A clip left from the last wake-up, for upload_worker to send while recording */
+static bool make_backlog(const char *path, long bytes)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        return false;
+    }
+    static char buf[4096];
+    for (long left = bytes; left > 0; left -= sizeof(buf)) {
+        memset(buf, (int)(left & 0xff), sizeof(buf));
+        fwrite(buf, 1, left < (long)sizeof(buf) ? left : (long)sizeof(buf), f);
+    }
+    return fclose(f) == 0;
+}
+
+/* As ftp_session_ready() of app_main, where the connect time goes */
+static void ftp_session_ready(NetBuf_t *ctrl, void *ctx)
+{
+    FtpClientTimings_t timings;
+    if (getFtpClient()->ftpClientGetTimings(&timings, ctrl)) {
+        ESP_LOGI(TAG, "ftp server %d: dns %" PRIu32 " us, connect %" PRIu32 " us, banner %" PRIu32 " us, login %" PRIu32 " us",
+                 timings.server, timings.dnsUs, timings.connectUs, timings.bannerUs, timings.loginUs);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int seconds = 10;
+    bool realtime = false;
+    const char *fixture = NULL;
+    int live_ms = 0;
+    int live_max_ms = 0;
+    bool tls = false;
+    int cpu_mhz = 0;
+    long upload_kib = 0;
+    int max_drops = -1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--realtime") == 0) {
+            realtime = true;
+        } else if (strcmp(argv[i], "--live") == 0 && i + 1 < argc) {
+            live_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--live-max-ms") == 0 && i + 1 < argc) {
+            live_max_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tls") == 0) {
+            tls = true;
+        } else if (strcmp(argv[i], "--cpu-mhz") == 0 && i + 1 < argc) {
+            cpu_mhz = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--upload-kib") == 0 && i + 1 < argc) {
+            upload_kib = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--max-drops") == 0 && i + 1 < argc) {
+            max_drops = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--fixture") == 0 && i + 1 < argc) {
+            fixture = argv[++i];
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            esp_log_level_set("*", ESP_LOG_DEBUG);
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (seconds <= 0 || live_ms < 0 || cpu_mhz < 0 || upload_kib < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    mkdir(HOST_SDCARD, 0755);
+    /* A peer that is gone gets close_notify written to it */
+    signal(SIGPIPE, SIG_IGN);
+    if (cpu_mhz > 0 && task_plan_set_cpu_freq(cpu_mhz) != ESP_OK) {
+        return 1;
+    }
+    long backlog_size = upload_kib * 1024;
+    if (backlog_size > 0 && !make_backlog(HOST_BACKLOG, backlog_size)) {
+        return 1;
+    }
+
+    ftp_loopback_cfg_t nas_cfg = FTP_LOOPBACK_CFG_DEFAULT();
+    nas_cfg.root = HOST_NAS_ROOT;
+    nas_cfg.user = HOST_FTP_USER;
+    nas_cfg.pass = HOST_FTP_PASS;
+    nas_cfg.tls = tls;
+    nas_cfg.tls_require_reuse = tls;
+    ftp_loopback_handle_t nas = ftp_loopback_start(&nas_cfg);
+    if (nas == NULL) {
+        return 1;
+    }
+
+    clip_store_init(HOST_SDCARD);
+    clip_store_entry_t interrupted;
+    if (clip_store_interrupted(&interrupted) == ESP_OK) {
+        if (sd_wav_writer_recover(interrupted.path, NULL) == ESP_ERR_NOT_FOUND) {
+            clip_store_set_state(&interrupted, CLIP_STORE_DELETED);
+        } else {
+            clip_store_add(interrupted.path, CLIP_STORE_SCORE_UNKNOWN);
+        }
+    }
+
+    ESP_LOGI(TAG, "[3.0] Create audio pipeline for recording");
+    audio_pipeline_cfg_t pipeline_cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
+    audio_pipeline_handle_t pipeline = audio_pipeline_init(&pipeline_cfg);
+    mem_assert(pipeline);
+
+    sim_source_cfg_t sim_cfg = SIM_SOURCE_CFG_DEFAULT();
+    sim_cfg.fixture = fixture;
+    sim_cfg.realtime = realtime;
+    sim_cfg.duration_ms = seconds * 1000;
+    audio_element_handle_t source = sim_source_init(&sim_cfg);
+    mem_assert(source);
+
+    wav_encoder_cfg_t wav_cfg = DEFAULT_WAV_ENCODER_CONFIG();
+    audio_element_handle_t encoder = wav_encoder_init(&wav_cfg);
+    mem_assert(encoder);
+
+    sd_wav_writer_cfg_t writer_cfg = SD_WAV_WRITER_CFG_DEFAULT();
+    writer_cfg.expected_seconds = seconds;
+    writer_cfg.checkpoint_ms = 1000;
+    writer_cfg.container = true;
+    writer_cfg.device_id = "record_host";
+    writer_cfg.tap_cb = host_writer_tap;
+    writer_cfg.tap_ctx = source;
+    audio_element_handle_t writer = sd_wav_writer_init(&writer_cfg);
+    mem_assert(writer);
+
+    char filename[64];
+    clip_store_path(time(NULL), ".wav", filename, sizeof(filename));
+    clip_store_open(filename);
+    ESP_LOGI(TAG, "[3.4] File name: %s", filename);
+
+    if (live_ms > 0) {
+        live_upload_cfg_t live_cfg = {
+            .server = "127.0.0.1",
+            .port = ftp_loopback_port(nas),
+            .user = HOST_FTP_USER,
+            .pass = HOST_FTP_PASS,
+            .remote_dir = HOST_UPLOAD_DIR,
+            .block_mode = true,
+            .chunk_ms = live_ms,
+            .queue_bytes = 768 * 1024,
+            .tls = tls,
+            .ca_pem = ftp_loopback_tls_ca(nas),
+        };
+        if (live_upload_start(&live_cfg) != ESP_OK) {
+            return 1;
+        }
+    }
+
+    audio_element_info_t info = AUDIO_ELEMENT_INFO_DEFAULT();
+    audio_element_getinfo(source, &info);
+    audio_element_setinfo(writer, &info);
+    cycle_prof_cfg_t prof_cfg = {
+        .sample_rate = info.sample_rates,
+        .cpu_mhz = HOST_CPU_MHZ,
+    };
+    if (cycle_prof_init(&prof_cfg) == ESP_OK) {
+        cycle_prof_watch("i2s");
+        cycle_prof_watch("wav");
+        cycle_prof_watch("wav_file");
+    }
+
+    audio_pipeline_register(pipeline, source, "i2s");
+    audio_pipeline_register(pipeline, encoder, "wav");
+    audio_pipeline_register(pipeline, writer, "wav_file");
+    const char *link_wav[3] = {"i2s", "wav", "wav_file"};
+    audio_pipeline_link(pipeline, &link_wav[0], 3);
+
+    pipeline_monitor_cfg_t monitor_cfg = PIPELINE_MONITOR_CFG_DEFAULT();
+    monitor_cfg.writer = writer;
+    pipeline_monitor_handle_t monitor = pipeline_monitor_init(&monitor_cfg);
+    pipeline_monitor_add(monitor, source);
+    pipeline_monitor_add(monitor, encoder);
+
+    audio_element_set_uri(writer, filename);
+
+    long upload_rate = backlog_size / seconds;
+    if (backlog_size > 0) {
+        upload_worker_cfg_t upload_cfg = {
+            .server = "127.0.0.1",
+            .port = ftp_loopback_port(nas),
+            .user = HOST_FTP_USER,
+            .pass = HOST_FTP_PASS,
+            .tls = tls,
+            .ca_pem = ftp_loopback_tls_ca(nas),
+            .remote_dir = HOST_UPLOAD_DIR,
+            .delete_after_upload = true,
+            .pressure_cb = host_writer_pressure,
+            .pressure_ctx = monitor,
+            .pressure_high = 50,
+            .pressure_low = 25,
+            .rate_cb = host_upload_rate,
+            .rate_ctx = &upload_rate,
+        };
+        if (upload_worker_start(&upload_cfg) != ESP_OK || upload_worker_enqueue(HOST_BACKLOG) != ESP_OK) {
+            return 1;
+        }
+    }
+
+    ESP_LOGI(TAG, "[5.0] Start audio_pipeline, %d s of %s audio at %d MHz", seconds, realtime ? "paced" : "unpaced",
+             cpu_mhz ? cpu_mhz : HOST_CPU_MHZ);
+    int64_t run_us = esp_timer_get_time();
+    audio_pipeline_run(pipeline);
+    pipeline_monitor_start(monitor);
+    cycle_prof_reset();
+
+    /* The source finishes after duration_ms, the writer after the last byte */
+    audio_element_wait_for_stop(writer);
+    int64_t recorded_us = esp_timer_get_time();
+    pipeline_monitor_stop(monitor);
+    int64_t live_idle_us = 0;
+    if (live_ms > 0) {
+        /* segment_done() of app_main does this when the writer closes the file */
+        live_upload_file_done(filename);
+        live_upload_wait_idle(pdMS_TO_TICKS(30 * 1000));
+        live_idle_us = esp_timer_get_time() - recorded_us;
+    }
+    bool backlog_ok = true;
+    if (backlog_size > 0) {
+        /* As after the last segment of app_main: no more pausing, drain the queue */
+        upload_worker_set_pressure(NULL, NULL);
+        upload_worker_wait_idle(pdMS_TO_TICKS(30 * 1000));
+        upload_worker_stats_t up;
+        upload_worker_get_stats(&up);
+        long nas_size = file_size(HOST_NAS_ROOT HOST_UPLOAD_DIR "/backlog.wav");
+        ESP_LOGI(TAG, "Backlog %ld KB at %ld KB/s during the recording: %" PRIu32 " uploaded, %" PRIu32 " failed, "
+                 "paused %" PRIu32 " time(s) for the writer", upload_kib, upload_rate / 1024, up.uploaded, up.failed,
+                 up.throttled);
+        backlog_ok = up.uploaded == 1 && up.failed == 0 && nas_size == backlog_size;
+    }
+
+    audio_pipeline_stop(pipeline);
+    audio_pipeline_wait_for_stop(pipeline);
+    bool recorded = audio_element_get_state(writer) == AEL_STATE_FINISHED;
+    clip_store_add(filename, CLIP_STORE_SCORE_UNKNOWN);
+
+    sim_source_stats_t sim_stats;
+    sim_source_get_stats(source, &sim_stats);
+    uint32_t monitor_drops = pipeline_monitor_get_drops(monitor);
+    bool drops_ok = max_drops < 0 || monitor_drops + sim_stats.drops <= (uint32_t)max_drops;
+    ESP_LOGI(TAG, "Drops: %" PRIu32 " ring buffer overrun(s) at the source, %" PRIu32 " missed DMA buffer(s)",
+             monitor_drops, sim_stats.drops);
+
+    /* Before terminate, the element tasks still hold their run time */
+    pipeline_monitor_log(monitor);
+    sim_source_log_report(source);
+    cycle_prof_log();
+    sd_wav_writer_log_stats(writer);
+    audio_pipeline_terminate(pipeline);
+    audio_pipeline_unregister_more(pipeline, source, encoder, writer, NULL);
+
+    ftp_retry_cfg_t retry_cfg = FTP_RETRY_CFG_DEFAULT();
+    retry_cfg.server = "127.0.0.1";
+    retry_cfg.port = ftp_loopback_port(nas);
+    retry_cfg.user = HOST_FTP_USER;
+    retry_cfg.pass = HOST_FTP_PASS;
+    retry_cfg.max_attempts = 2;
+    retry_cfg.base_delay_ms = 100;
+    retry_cfg.budget_ms = 30 * 1000;
+    retry_cfg.session_cb = ftp_session_ready;
+    retry_cfg.tls = tls;
+    retry_cfg.ca_pem = ftp_loopback_tls_ca(nas);
+    ftp_retry_handle_t ftp_retry = ftp_retry_init(&retry_cfg);
+    mem_assert(ftp_retry);
+
+    char remote[128];
+    const char *base = strrchr(filename, '/');
+    snprintf(remote, sizeof(remote), "%s/%s", HOST_UPLOAD_DIR, base ? base + 1 : filename);
+    long local_size = file_size(filename);
+    int64_t put_us = esp_timer_get_time();
+    esp_err_t upload_ret = ftp_retry_put(ftp_retry, filename, remote);
+    int64_t done_us = esp_timer_get_time();
+    ftp_retry_deinit(ftp_retry);
+
+    char nas_path[192];
+    snprintf(nas_path, sizeof(nas_path), "%s%s", HOST_NAS_ROOT, remote);
+    bool intact = upload_ret == ESP_OK && local_size > 0 && file_size(nas_path) == local_size;
+    if (intact && unlink(filename) == 0) {
+        clip_store_uploaded(filename, true);
+    }
+
+    bool live_ok = true;
+    if (live_ms > 0) {
+        live_upload_stats_t live;
+        live_upload_get_stats(&live);
+        live_upload_log_stats();
+        /* <clip without .wav>.live.wav */
+        const char *name = strrchr(filename, '/');
+        name = name ? name + 1 : filename;
+        char live_path[192];
+        snprintf(live_path, sizeof(live_path), "%s%s/%.*s%s", HOST_NAS_ROOT, HOST_UPLOAD_DIR,
+                 (int)strlen(name) - 4, name, LIVE_UPLOAD_SUFFIX);
+        long live_size = file_size(live_path);
+        ESP_LOGI(TAG, "Live copy %ld bytes, writer stop -> last chunk on server %" PRId64 " ms", live_size,
+                 live_idle_us / 1000);
+        /* wait_idle returned only after the last APPE's 226, the file must be complete */
+        live_ok = live.failed == 0 && live.overflows == 0 && live.chunks > 0
+                  && live_size == (long)(44 + live.bytes)
+                  && (live_max_ms == 0 || live.latency_max_ms <= (uint32_t)live_max_ms);
+    }
+
+    ftp_loopback_stats_t nas_stats;
+    ftp_loopback_get_stats(nas, &nas_stats);
+    int64_t put_us_total = done_us - put_us;
+    ESP_LOGI(TAG, "Upload %s: %ld bytes in %" PRId64 " us, %" PRId64 " KB/s (server receive %" PRId64 " us)",
+             esp_err_to_name(upload_ret), local_size, put_us_total,
+             put_us_total > 0 ? (int64_t)local_size * 1000000 / 1024 / put_us_total : 0, nas_stats.transfer_us);
+    if (tls) {
+        ESP_LOGI(TAG, "TLS: %" PRIu32 " data handshakes, %" PRIu32 " resumed", nas_stats.tls_handshakes,
+                 nas_stats.tls_resumed);
+    }
+    ESP_LOGI(TAG, "End to end: %d s of audio, run -> written %" PRId64 " ms, last sample -> on server %" PRId64 " us",
+             seconds, (recorded_us - run_us) / 1000, done_us - recorded_us);
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    ESP_LOGI(TAG, "Peak heap internal %u of %u, PSRAM %u of %u bytes; process max RSS %ld KB",
+             (unsigned)(HOST_HEAP_INTERNAL_BYTES - heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL)),
+             (unsigned)HOST_HEAP_INTERNAL_BYTES,
+             (unsigned)(HOST_HEAP_SPIRAM_BYTES - heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM)),
+             (unsigned)HOST_HEAP_SPIRAM_BYTES, ru.ru_maxrss);
+
+    pipeline_monitor_deinit(monitor);
+    audio_pipeline_deinit(pipeline);
+    audio_element_deinit(source);
+    audio_element_deinit(encoder);
+    audio_element_deinit(writer);
+    ftp_loopback_stop(nas);
+
+    if (!recorded || !intact || !live_ok || !backlog_ok || !drops_ok) {
+        ESP_LOGE(TAG, "%s", !recorded ? "Recording did not finish"
+                 : !intact ? "Clip did not reach the server intact"
+                 : !live_ok ? "Live copy incomplete or late"
+                 : !backlog_ok ? "Backlog not uploaded during the recording" : "Audio dropped");
+        return 1;
+    }
+    return 0;
+}
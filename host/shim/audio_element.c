@@ -0,0 +1,568 @@
+/*
+ * audio_element, audio_pipeline and wav_encoder for the host build
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_cpu.h"
+#include "esp_pm.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "audio_element.h"
+#include "audio_pipeline.h"
+#include "wav_encoder.h"
+
+static const char *TAG = "HOST_AEL";
+
+struct audio_element {
+    audio_element_cfg_t     cfg;
+    char                    tag[24];
+    void                    *data;
+    audio_element_info_t    info;
+    char                    *uri;
+    ringbuf_handle_t        in_rb;
+    ringbuf_handle_t        out_rb;
+    ringbuf_handle_t        multi_out[AUDIO_ELEMENT_MAX_MULTI_OUT];
+    int                     out_rb_size;
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;
+    audio_element_state_t   state;
+    bool                    task_alive;     /* Task created and not terminated */
+    bool                    running;        /* Between run() and the end of processing */
+    bool                    start;          /* run() request for the task */
+    bool                    stopping;
+    bool                    quit;
+};
+
+audio_element_handle_t audio_element_init(audio_element_cfg_t *config)
+{
+    audio_element_handle_t el = audio_calloc(1, sizeof(struct audio_element));
+    AUDIO_MEM_CHECK(TAG, el, return NULL);
+    el->cfg = *config;
+    if (el->cfg.buffer_len <= 0) {
+        el->cfg.buffer_len = DEFAULT_ELEMENT_BUFFER_LENGTH;
+    }
+    el->out_rb_size = config->out_rb_size > 0 ? config->out_rb_size : DEFAULT_ELEMENT_RINGBUF_SIZE;
+    el->data = config->data;
+    snprintf(el->tag, sizeof(el->tag), "%s", config->tag ? config->tag : "unknown");
+    audio_element_info_t info = AUDIO_ELEMENT_INFO_DEFAULT();
+    el->info = info;
+    el->state = AEL_STATE_INIT;
+    pthread_mutex_init(&el->lock, NULL);
+    pthread_cond_init(&el->cond, NULL);
+    return el;
+}
+
+esp_err_t audio_element_deinit(audio_element_handle_t el)
+{
+    audio_element_terminate(el);
+    if (el->cfg.destroy) {
+        el->cfg.destroy(el);
+    }
+    pthread_mutex_destroy(&el->lock);
+    pthread_cond_destroy(&el->cond);
+    audio_free(el->uri);
+    audio_free(el);
+    return ESP_OK;
+}
+
+esp_err_t audio_element_setdata(audio_element_handle_t el, void *data)
+{
+    el->data = data;
+    return ESP_OK;
+}
+
+void *audio_element_getdata(audio_element_handle_t el)
+{
+    return el->data;
+}
+
+esp_err_t audio_element_set_tag(audio_element_handle_t el, const char *tag)
+{
+    snprintf(el->tag, sizeof(el->tag), "%s", tag);
+    return ESP_OK;
+}
+
+char *audio_element_get_tag(audio_element_handle_t el)
+{
+    return el->tag;
+}
+
+esp_err_t audio_element_setinfo(audio_element_handle_t el, audio_element_info_t *info)
+{
+    pthread_mutex_lock(&el->lock);
+    char *uri = el->info.uri;
+    el->info = *info;
+    el->info.uri = uri;
+    pthread_mutex_unlock(&el->lock);
+    return ESP_OK;
+}
+
+esp_err_t audio_element_getinfo(audio_element_handle_t el, audio_element_info_t *info)
+{
+    pthread_mutex_lock(&el->lock);
+    *info = el->info;
+    pthread_mutex_unlock(&el->lock);
+    return ESP_OK;
+}
+
+esp_err_t audio_element_set_uri(audio_element_handle_t el, const char *uri)
+{
+    char *copy = NULL;
+    if (uri) {
+        copy = audio_malloc(strlen(uri) + 1);
+        AUDIO_MEM_CHECK(TAG, copy, return ESP_ERR_NO_MEM);
+        strcpy(copy, uri);
+    }
+    pthread_mutex_lock(&el->lock);
+    audio_free(el->uri);
+    el->uri = copy;
+    el->info.uri = copy;
+    pthread_mutex_unlock(&el->lock);
+    return ESP_OK;
+}
+
+char *audio_element_get_uri(audio_element_handle_t el)
+{
+    return el->uri;
+}
+
+audio_element_state_t audio_element_get_state(audio_element_handle_t el)
+{
+    pthread_mutex_lock(&el->lock);
+    audio_element_state_t state = el->state;
+    pthread_mutex_unlock(&el->lock);
+    return state;
+}
+
+esp_err_t audio_element_set_input_ringbuf(audio_element_handle_t el, ringbuf_handle_t rb)
+{
+    el->in_rb = rb;
+    return ESP_OK;
+}
+
+ringbuf_handle_t audio_element_get_input_ringbuf(audio_element_handle_t el)
+{
+    return el->in_rb;
+}
+
+esp_err_t audio_element_set_output_ringbuf(audio_element_handle_t el, ringbuf_handle_t rb)
+{
+    el->out_rb = rb;
+    return ESP_OK;
+}
+
+ringbuf_handle_t audio_element_get_output_ringbuf(audio_element_handle_t el)
+{
+    return el->out_rb;
+}
+
+esp_err_t audio_element_set_output_ringbuf_size(audio_element_handle_t el, int rb_size)
+{
+    if (rb_size <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    el->out_rb_size = rb_size;
+    return ESP_OK;
+}
+
+int audio_element_get_output_ringbuf_size(audio_element_handle_t el)
+{
+    return el->out_rb_size;
+}
+
+esp_err_t audio_element_set_multi_output_ringbuf(audio_element_handle_t el, ringbuf_handle_t rb, int index)
+{
+    if (index < 0 || index >= el->cfg.multi_out_rb_num || index >= AUDIO_ELEMENT_MAX_MULTI_OUT) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    el->multi_out[index] = rb;
+    return ESP_OK;
+}
+
+esp_err_t audio_element_set_ringbuf_done(audio_element_handle_t el)
+{
+    if (el->out_rb) {
+        rb_done_write(el->out_rb);
+    }
+    return ESP_OK;
+}
+
+int audio_element_input(audio_element_handle_t el, char *buffer, int wanted_size)
+{
+    if (el->cfg.read) {
+        return el->cfg.read(el, buffer, wanted_size, portMAX_DELAY, NULL);
+    }
+    if (el->in_rb) {
+        /* RB_DONE, RB_ABORT and RB_TIMEOUT have the values of the AEL_IO_* codes */
+        return rb_read(el->in_rb, buffer, wanted_size, portMAX_DELAY);
+    }
+    ESP_LOGE(TAG, "[%s] has no input", el->tag);
+    return AEL_IO_FAIL;
+}
+
+int audio_element_output(audio_element_handle_t el, char *buffer, int write_size)
+{
+    if (el->cfg.write) {
+        return el->cfg.write(el, buffer, write_size, portMAX_DELAY, NULL);
+    }
+    if (el->out_rb) {
+        return rb_write(el->out_rb, buffer, write_size, portMAX_DELAY);
+    }
+    ESP_LOGE(TAG, "[%s] has no output", el->tag);
+    return AEL_IO_FAIL;
+}
+
+int audio_element_multi_output(audio_element_handle_t el, char *buffer, int wanted_size, TickType_t ticks_to_wait)
+{
+    int ret = ESP_OK;
+    for (int i = 0; i < el->cfg.multi_out_rb_num && i < AUDIO_ELEMENT_MAX_MULTI_OUT; i++) {
+        if (el->multi_out[i]) {
+            ret |= rb_write(el->multi_out[i], buffer, wanted_size, ticks_to_wait);
+        }
+    }
+    return ret;
+}
+
+static void _set_state(audio_element_handle_t el, audio_element_state_t state)
+{
+    pthread_mutex_lock(&el->lock);
+    el->state = state;
+    pthread_cond_broadcast(&el->cond);
+    pthread_mutex_unlock(&el->lock);
+}
+
+/* open, process until done, fail or abort, close */
+static audio_element_state_t _element_run_once(audio_element_handle_t el, char *buf)
+{
+    if (el->cfg.open && el->cfg.open(el) != ESP_OK) {
+        ESP_LOGE(TAG, "[%s] open failed", el->tag);
+        return AEL_STATE_ERROR;
+    }
+    _set_state(el, AEL_STATE_RUNNING);
+    audio_element_state_t end;
+    while (1) {
+        uint32_t start = esp_cpu_get_ccount();
+        int ret = el->cfg.process(el, buf, el->cfg.buffer_len);
+        host_cpu_stretch(start);
+        if (ret > 0 || ret == AEL_IO_TIMEOUT) {
+            continue;
+        }
+        end = ret == AEL_IO_DONE || ret == AEL_IO_OK ? AEL_STATE_FINISHED
+              : ret == AEL_IO_ABORT ? AEL_STATE_STOPPED : AEL_STATE_ERROR;
+        break;
+    }
+    if (el->cfg.close) {
+        el->cfg.close(el);
+    }
+    return end;
+}
+
+/*
+ * As in ADF the task outlives a run and waits for the next one, so its run
+ * time stays visible to uxTaskGetSystemState() until terminate
+ */
+static void _element_task(void *arg)
+{
+    audio_element_handle_t el = arg;
+    char *buf = audio_malloc(el->cfg.buffer_len);
+    pthread_mutex_lock(&el->lock);
+    while (1) {
+        while (!el->start && !el->quit) {
+            pthread_cond_wait(&el->cond, &el->lock);
+        }
+        if (el->quit) {
+            break;
+        }
+        el->start = false;
+        pthread_mutex_unlock(&el->lock);
+
+        audio_element_state_t end = buf ? _element_run_once(el, buf) : AEL_STATE_ERROR;
+        /* The next element reads what is left and finishes too */
+        if (el->out_rb) {
+            rb_done_write(el->out_rb);
+        }
+        for (int i = 0; i < AUDIO_ELEMENT_MAX_MULTI_OUT; i++) {
+            if (el->multi_out[i]) {
+                rb_done_write(el->multi_out[i]);
+            }
+        }
+
+        pthread_mutex_lock(&el->lock);
+        el->state = el->stopping ? AEL_STATE_STOPPED : end;
+        el->running = false;
+        pthread_cond_broadcast(&el->cond);
+    }
+    el->task_alive = false;
+    pthread_cond_broadcast(&el->cond);
+    pthread_mutex_unlock(&el->lock);
+    audio_free(buf);
+    vTaskDelete(NULL);
+}
+
+esp_err_t audio_element_run(audio_element_handle_t el)
+{
+    pthread_mutex_lock(&el->lock);
+    if (el->running) {
+        pthread_mutex_unlock(&el->lock);
+        return ESP_OK;
+    }
+    bool create = !el->task_alive;
+    el->task_alive = true;
+    el->quit = false;
+    el->running = true;
+    el->start = true;
+    el->stopping = false;
+    el->state = AEL_STATE_INITIALIZING;
+    pthread_cond_broadcast(&el->cond);
+    pthread_mutex_unlock(&el->lock);
+    if (create && xTaskCreatePinnedToCore(_element_task, el->tag, el->cfg.task_stack, el, el->cfg.task_prio,
+                                          NULL, el->cfg.task_core) != pdPASS) {
+        pthread_mutex_lock(&el->lock);
+        el->task_alive = false;
+        el->running = false;
+        el->state = AEL_STATE_ERROR;
+        pthread_cond_broadcast(&el->cond);
+        pthread_mutex_unlock(&el->lock);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/* The task starts processing right away, there is no paused start */
+esp_err_t audio_element_resume(audio_element_handle_t el, float wait_for_rb_threshold, TickType_t timeout)
+{
+    return ESP_OK;
+}
+
+esp_err_t audio_element_stop(audio_element_handle_t el)
+{
+    pthread_mutex_lock(&el->lock);
+    bool running = el->running;
+    el->stopping = running;
+    pthread_mutex_unlock(&el->lock);
+    if (running) {
+        if (el->in_rb) {
+            rb_abort(el->in_rb);
+        }
+        if (el->out_rb) {
+            rb_abort(el->out_rb);
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t audio_element_wait_for_stop_ms(audio_element_handle_t el, TickType_t ticks_to_wait)
+{
+    struct timespec ts;
+    uint64_t ms = (uint64_t)ticks_to_wait * portTICK_PERIOD_MS;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    esp_err_t ret = ESP_OK;
+    pthread_mutex_lock(&el->lock);
+    while (el->running) {
+        if (ticks_to_wait == portMAX_DELAY) {
+            pthread_cond_wait(&el->cond, &el->lock);
+        } else if (pthread_cond_timedwait(&el->cond, &el->lock, &ts) != 0 && el->running) {
+            ret = ESP_FAIL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&el->lock);
+    return ret;
+}
+
+esp_err_t audio_element_wait_for_stop(audio_element_handle_t el)
+{
+    return audio_element_wait_for_stop_ms(el, portMAX_DELAY);
+}
+
+esp_err_t audio_element_terminate(audio_element_handle_t el)
+{
+    audio_element_stop(el);
+    audio_element_wait_for_stop(el);
+    pthread_mutex_lock(&el->lock);
+    el->quit = true;
+    pthread_cond_broadcast(&el->cond);
+    while (el->task_alive) {
+        pthread_cond_wait(&el->cond, &el->lock);
+    }
+    pthread_mutex_unlock(&el->lock);
+    return ESP_OK;
+}
+
+/* ---- audio_pipeline ---- */
+
+struct audio_pipeline {
+    int                     rb_size;
+    audio_element_handle_t  el[AUDIO_PIPELINE_MAX_ELEMENTS];
+    int                     count;
+    audio_element_handle_t  linked[AUDIO_PIPELINE_MAX_ELEMENTS];
+    int                     linked_count;
+    ringbuf_handle_t        rb[AUDIO_PIPELINE_MAX_ELEMENTS];
+};
+
+audio_pipeline_handle_t audio_pipeline_init(audio_pipeline_cfg_t *config)
+{
+    audio_pipeline_handle_t p = audio_calloc(1, sizeof(struct audio_pipeline));
+    AUDIO_MEM_CHECK(TAG, p, return NULL);
+    p->rb_size = config->rb_size;
+    return p;
+}
+
+esp_err_t audio_pipeline_register(audio_pipeline_handle_t p, audio_element_handle_t el, const char *name)
+{
+    if (p->count == AUDIO_PIPELINE_MAX_ELEMENTS) {
+        return ESP_ERR_NO_MEM;
+    }
+    audio_element_set_tag(el, name);
+    p->el[p->count++] = el;
+    return ESP_OK;
+}
+
+esp_err_t audio_pipeline_unregister(audio_pipeline_handle_t p, audio_element_handle_t el)
+{
+    for (int i = 0; i < p->count; i++) {
+        if (p->el[i] == el) {
+            memmove(&p->el[i], &p->el[i + 1], (p->count - i - 1) * sizeof(p->el[0]));
+            p->count--;
+            return ESP_OK;
+        }
+    }
+    return ESP_FAIL;
+}
+
+esp_err_t audio_pipeline_unregister_more(audio_pipeline_handle_t p, audio_element_handle_t element_1, ...)
+{
+    va_list ap;
+    va_start(ap, element_1);
+    for (audio_element_handle_t el = element_1; el; el = va_arg(ap, audio_element_handle_t)) {
+        audio_pipeline_unregister(p, el);
+    }
+    va_end(ap);
+    return ESP_OK;
+}
+
+static void _unlink(audio_pipeline_handle_t p)
+{
+    for (int i = 0; i + 1 < p->linked_count; i++) {
+        audio_element_set_output_ringbuf(p->linked[i], NULL);
+        audio_element_set_input_ringbuf(p->linked[i + 1], NULL);
+        rb_destroy(p->rb[i]);
+        p->rb[i] = NULL;
+    }
+    p->linked_count = 0;
+}
+
+esp_err_t audio_pipeline_link(audio_pipeline_handle_t p, const char *link_tag[], int link_num)
+{
+    _unlink(p);
+    for (int i = 0; i < link_num; i++) {
+        audio_element_handle_t el = NULL;
+        for (int j = 0; j < p->count; j++) {
+            if (strcmp(audio_element_get_tag(p->el[j]), link_tag[i]) == 0) {
+                el = p->el[j];
+                break;
+            }
+        }
+        if (el == NULL) {
+            ESP_LOGE(TAG, "No element %s registered", link_tag[i]);
+            _unlink(p);
+            return ESP_FAIL;
+        }
+        p->linked[p->linked_count++] = el;
+        if (i > 0) {
+            audio_element_handle_t prev = p->linked[i - 1];
+            ringbuf_handle_t rb = rb_create(audio_element_get_output_ringbuf_size(prev), 1);
+            AUDIO_MEM_CHECK(TAG, rb, {
+                _unlink(p);
+                return ESP_ERR_NO_MEM;
+            });
+            p->rb[i - 1] = rb;
+            audio_element_set_output_ringbuf(prev, rb);
+            audio_element_set_input_ringbuf(el, rb);
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t audio_pipeline_run(audio_pipeline_handle_t p)
+{
+    for (int i = 0; i + 1 < p->linked_count; i++) {
+        rb_reset(p->rb[i]);
+    }
+    /* Consumers first, the source starts into an empty chain */
+    for (int i = p->linked_count - 1; i >= 0; i--) {
+        if (audio_element_run(p->linked[i]) != ESP_OK) {
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t audio_pipeline_stop(audio_pipeline_handle_t p)
+{
+    for (int i = 0; i < p->linked_count; i++) {
+        audio_element_stop(p->linked[i]);
+    }
+    return ESP_OK;
+}
+
+esp_err_t audio_pipeline_wait_for_stop(audio_pipeline_handle_t p)
+{
+    for (int i = 0; i < p->linked_count; i++) {
+        audio_element_wait_for_stop(p->linked[i]);
+    }
+    return ESP_OK;
+}
+
+esp_err_t audio_pipeline_terminate(audio_pipeline_handle_t p)
+{
+    audio_pipeline_stop(p);
+    return audio_pipeline_wait_for_stop(p);
+}
+
+esp_err_t audio_pipeline_deinit(audio_pipeline_handle_t p)
+{
+    audio_pipeline_terminate(p);
+    _unlink(p);
+    /* As in ADF, elements still registered go with the pipeline */
+    for (int i = 0; i < p->count; i++) {
+        audio_element_deinit(p->el[i]);
+    }
+    audio_free(p);
+    return ESP_OK;
+}
+
+/* ---- wav_encoder ---- */
+
+static int _wav_encoder_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    int r_size = audio_element_input(self, in_buffer, in_len);
+    if (r_size <= 0) {
+        return r_size;
+    }
+    return audio_element_output(self, in_buffer, r_size);
+}
+
+audio_element_handle_t wav_encoder_init(wav_encoder_cfg_t *config)
+{
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.process = _wav_encoder_process;
+    cfg.task_stack = config->task_stack;
+    cfg.task_prio = config->task_prio;
+    cfg.task_core = config->task_core;
+    cfg.out_rb_size = config->out_rb_size;
+    cfg.stack_in_ext = config->stack_in_ext;
+    cfg.tag = "wav";
+    return audio_element_init(&cfg);
+}
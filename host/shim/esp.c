@@ -0,0 +1,500 @@
+/*
+ * ESP-IDF system services for the host build: log, esp_timer, heap_caps,
+ * cycle counter and the odds and ends of esp_system
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_system.h"
+#include "esp_sleep.h"
+#include "esp_ota_ops.h"
+#include "nvs.h"
+#include "esp_cpu.h"
+#include "esp_pm.h"
+
+static const char *TAG = "HOST_ESP";
+
+#define HOST_LOG_TAGS                       32
+#define HOST_HEAP_MAGIC                     0x48454150      /* "HEAP" */
+
+static struct timespec s_start;
+
+__attribute__((constructor)) static void _start_clock(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &s_start);
+}
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)(now.tv_sec - s_start.tv_sec) * 1000000 + (now.tv_nsec - s_start.tv_nsec) / 1000;
+}
+
+/* ---- esp_log ---- */
+
+static struct {
+    pthread_mutex_t     lock;
+    int                 count;
+    char                tag[HOST_LOG_TAGS][24];
+    esp_log_level_t     level[HOST_LOG_TAGS];
+    esp_log_level_t     all;
+} s_log = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .all = HOST_LOG_DEFAULT_LEVEL,
+};
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+    pthread_mutex_lock(&s_log.lock);
+    if (strcmp(tag, "*") == 0) {
+        s_log.all = level;
+        s_log.count = 0;
+    } else {
+        int i = 0;
+        while (i < s_log.count && strcmp(s_log.tag[i], tag) != 0) {
+            i++;
+        }
+        if (i < HOST_LOG_TAGS) {
+            snprintf(s_log.tag[i], sizeof(s_log.tag[i]), "%s", tag);
+            s_log.level[i] = level;
+            if (i == s_log.count) {
+                s_log.count++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&s_log.lock);
+}
+
+uint32_t esp_log_timestamp(void)
+{
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+    static const char letter[] = "NEWIDV";
+    pthread_mutex_lock(&s_log.lock);
+    esp_log_level_t max = s_log.all;
+    for (int i = 0; i < s_log.count; i++) {
+        if (strcmp(s_log.tag[i], tag) == 0) {
+            max = s_log.level[i];
+            break;
+        }
+    }
+    if (level <= max && level > ESP_LOG_NONE) {
+        va_list ap;
+        va_start(ap, format);
+        printf("%c (%u) %s: ", letter[level], (unsigned)esp_log_timestamp(), tag);
+        vprintf(format, ap);
+        putchar('\n');
+        va_end(ap);
+    }
+    pthread_mutex_unlock(&s_log.lock);
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    switch (code) {
+    case ESP_OK:                    return "ESP_OK";
+    case ESP_FAIL:                  return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:            return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:       return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:     return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:      return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:         return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED:     return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT:           return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_INVALID_RESPONSE:  return "ESP_ERR_INVALID_RESPONSE";
+    case ESP_ERR_INVALID_CRC:       return "ESP_ERR_INVALID_CRC";
+    case ESP_ERR_INVALID_VERSION:   return "ESP_ERR_INVALID_VERSION";
+    case ESP_ERR_NVS_NOT_FOUND:     return "ESP_ERR_NVS_NOT_FOUND";
+    case ESP_ERR_NVS_TYPE_MISMATCH: return "ESP_ERR_NVS_TYPE_MISMATCH";
+    case ESP_ERR_NVS_READ_ONLY:     return "ESP_ERR_NVS_READ_ONLY";
+    case ESP_ERR_NVS_NOT_ENOUGH_SPACE: return "ESP_ERR_NVS_NOT_ENOUGH_SPACE";
+    case ESP_ERR_NVS_INVALID_HANDLE: return "ESP_ERR_NVS_INVALID_HANDLE";
+    case ESP_ERR_NVS_INVALID_LENGTH: return "ESP_ERR_NVS_INVALID_LENGTH";
+    case ESP_ERR_OTA_PARTITION_CONFLICT: return "ESP_ERR_OTA_PARTITION_CONFLICT";
+    case ESP_ERR_OTA_SELECT_INFO_INVALID: return "ESP_ERR_OTA_SELECT_INFO_INVALID";
+    case ESP_ERR_OTA_VALIDATE_FAILED: return "ESP_ERR_OTA_VALIDATE_FAILED";
+    default:                        return "UNKNOWN ERROR";
+    }
+}
+
+/* ---- esp_timer ---- */
+
+struct host_timer {
+    esp_timer_create_args_t args;
+    pthread_t           thread;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    bool                armed;
+    bool                periodic;
+    bool                quit;
+    uint64_t            period_us;
+    int64_t             due_us;
+};
+
+static void _due_to_timespec(int64_t due_us, struct timespec *ts)
+{
+    ts->tv_sec = s_start.tv_sec + due_us / 1000000;
+    ts->tv_nsec = s_start.tv_nsec + (due_us % 1000000) * 1000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static void *_timer_main(void *arg)
+{
+    struct host_timer *t = arg;
+    pthread_mutex_lock(&t->lock);
+    while (!t->quit) {
+        if (!t->armed) {
+            pthread_cond_wait(&t->cond, &t->lock);
+            continue;
+        }
+        if (esp_timer_get_time() < t->due_us) {
+            struct timespec ts;
+            _due_to_timespec(t->due_us, &ts);
+            pthread_cond_timedwait(&t->cond, &t->lock, &ts);
+            continue;
+        }
+        if (t->periodic) {
+            t->due_us += t->period_us;
+        } else {
+            t->armed = false;
+        }
+        pthread_mutex_unlock(&t->lock);
+        t->args.callback(t->args.arg);
+        pthread_mutex_lock(&t->lock);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out_handle)
+{
+    if (args == NULL || args->callback == NULL || out_handle == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    struct host_timer *t = calloc(1, sizeof(*t));
+    if (t == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    t->args = *args;
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&t->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&t->thread, NULL, _timer_main, t) != 0) {
+        free(t);
+        return ESP_ERR_NO_MEM;
+    }
+    *out_handle = t;
+    return ESP_OK;
+}
+
+static esp_err_t _timer_start(esp_timer_handle_t t, uint64_t us, bool periodic)
+{
+    pthread_mutex_lock(&t->lock);
+    esp_err_t ret = ESP_ERR_INVALID_STATE;
+    if (!t->armed) {
+        t->armed = true;
+        t->periodic = periodic;
+        t->period_us = us;
+        t->due_us = esp_timer_get_time() + us;
+        pthread_cond_signal(&t->cond);
+        ret = ESP_OK;
+    }
+    pthread_mutex_unlock(&t->lock);
+    return ret;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    return _timer_start(timer, timeout_us, false);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+    return _timer_start(timer, period_us, true);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t t)
+{
+    pthread_mutex_lock(&t->lock);
+    esp_err_t ret = t->armed ? ESP_OK : ESP_ERR_INVALID_STATE;
+    t->armed = false;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    return ret;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t t)
+{
+    if (t == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&t->lock);
+    if (t->armed) {
+        pthread_mutex_unlock(&t->lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    t->quit = true;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->thread, NULL);
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->cond);
+    free(t);
+    return ESP_OK;
+}
+
+/* ---- heap_caps ---- */
+
+typedef struct {
+    size_t      size;
+    uint32_t    pool;
+    uint32_t    magic;
+} __attribute__((aligned(16))) host_block_t;
+
+#define HOST_POOL_INTERNAL                  0
+#define HOST_POOL_SPIRAM                    1
+
+static struct {
+    pthread_mutex_t     lock;
+    size_t              used[2];
+    size_t              peak[2];
+} s_heap = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static const size_t s_pool_size[2] = { HOST_HEAP_INTERNAL_BYTES, HOST_HEAP_SPIRAM_BYTES };
+
+static int _pool(uint32_t caps)
+{
+    return (caps & MALLOC_CAP_SPIRAM) ? HOST_POOL_SPIRAM : HOST_POOL_INTERNAL;
+}
+
+/* Count size against pool, false when the board would be out of memory */
+static bool _reserve(int pool, size_t size)
+{
+    bool ok = false;
+    pthread_mutex_lock(&s_heap.lock);
+    if (s_heap.used[pool] + size <= s_pool_size[pool]) {
+        s_heap.used[pool] += size;
+        if (s_heap.used[pool] > s_heap.peak[pool]) {
+            s_heap.peak[pool] = s_heap.used[pool];
+        }
+        ok = true;
+    }
+    pthread_mutex_unlock(&s_heap.lock);
+    return ok;
+}
+
+static void _release(int pool, size_t size)
+{
+    pthread_mutex_lock(&s_heap.lock);
+    s_heap.used[pool] -= size;
+    pthread_mutex_unlock(&s_heap.lock);
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+    int pool = _pool(caps);
+    if (!_reserve(pool, size)) {
+        return NULL;
+    }
+    host_block_t *b = malloc(sizeof(*b) + size);
+    if (b == NULL) {
+        _release(pool, size);
+        return NULL;
+    }
+    b->size = size;
+    b->pool = pool;
+    b->magic = HOST_HEAP_MAGIC;
+    return b + 1;
+}
+
+void *heap_caps_calloc(size_t n, size_t size, uint32_t caps)
+{
+    if (size && n > SIZE_MAX / size) {
+        return NULL;
+    }
+    void *p = heap_caps_malloc(n * size, caps);
+    if (p) {
+        memset(p, 0, n * size);
+    }
+    return p;
+}
+
+static host_block_t *_block(void *ptr)
+{
+    host_block_t *b = (host_block_t *)ptr - 1;
+    if (b->magic != HOST_HEAP_MAGIC) {
+        ESP_LOGE(TAG, "heap_caps_free() of %p, not from heap_caps_malloc()", ptr);
+        abort();
+    }
+    return b;
+}
+
+void heap_caps_free(void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    host_block_t *b = _block(ptr);
+    _release(b->pool, b->size);
+    b->magic = 0;
+    free(b);
+}
+
+void *heap_caps_realloc(void *ptr, size_t size, uint32_t caps)
+{
+    if (ptr == NULL) {
+        return heap_caps_malloc(size, caps);
+    }
+    if (size == 0) {
+        heap_caps_free(ptr);
+        return NULL;
+    }
+    host_block_t *b = _block(ptr);
+    void *p = heap_caps_malloc(size, caps);
+    if (p) {
+        memcpy(p, ptr, b->size < size ? b->size : size);
+        heap_caps_free(ptr);
+    }
+    return p;
+}
+
+static size_t _free_size(uint32_t caps, const size_t *used)
+{
+    size_t free_size = 0;
+    pthread_mutex_lock(&s_heap.lock);
+    for (int pool = 0; pool < 2; pool++) {
+        bool wanted = (caps & MALLOC_CAP_SPIRAM) ? pool == HOST_POOL_SPIRAM
+                      : (caps & (MALLOC_CAP_INTERNAL | MALLOC_CAP_DMA)) ? pool == HOST_POOL_INTERNAL : true;
+        if (wanted) {
+            free_size += s_pool_size[pool] - used[pool];
+        }
+    }
+    pthread_mutex_unlock(&s_heap.lock);
+    return free_size;
+}
+
+size_t heap_caps_get_free_size(uint32_t caps)
+{
+    return _free_size(caps, s_heap.used);
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps)
+{
+    return _free_size(caps, s_heap.peak);
+}
+
+/* The host does not fragment the pools, the whole free size is one block */
+size_t heap_caps_get_largest_free_block(uint32_t caps)
+{
+    return _free_size(caps, s_heap.used);
+}
+
+/* ---- esp_cpu, esp_pm ---- */
+
+uint32_t esp_cpu_get_ccount(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint32_t)(((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) * HOST_CPU_MHZ / 1000);
+}
+
+/* Set before the element tasks start, as app_main does through task_plan */
+static int s_cpu_mhz;
+
+esp_err_t esp_pm_configure(const void *config)
+{
+    const esp_pm_config_esp32_t *pm = config;
+    if (pm == NULL || pm->max_freq_mhz <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_cpu_mhz = pm->max_freq_mhz;
+    return ESP_OK;
+}
+
+int host_cpu_freq_mhz(void)
+{
+    return s_cpu_mhz;
+}
+
+void host_cpu_stretch(uint32_t start_ccount)
+{
+    int mhz = host_cpu_freq_mhz();
+    if (mhz <= 0 || mhz >= HOST_CPU_MHZ) {
+        return;
+    }
+    uint32_t cycles = esp_cpu_get_ccount() - start_ccount;
+    uint32_t end = start_ccount + (uint32_t)((uint64_t)cycles * HOST_CPU_MHZ / mhz);
+    while ((int32_t)(esp_cpu_get_ccount() - end) < 0) {
+    }
+}
+
+/* ---- esp_system, esp_sleep, esp_ota_ops ---- */
+
+uint32_t esp_random(void)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static uint64_t state;
+    pthread_mutex_lock(&lock);
+    if (state == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        state = ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec ^ 0x9e3779b97f4a7c15ull;
+    }
+    /* xorshift64* */
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    uint32_t r = (uint32_t)((state * 0x2545f4914f6cdd1dull) >> 32);
+    pthread_mutex_unlock(&lock);
+    return r;
+}
+
+esp_reset_reason_t esp_reset_reason(void)
+{
+    return ESP_RST_POWERON;
+}
+
+void esp_restart(void)
+{
+    ESP_LOGE(TAG, "esp_restart(), exiting");
+    fflush(stdout);
+    exit(EXIT_FAILURE);
+}
+
+esp_sleep_source_t esp_sleep_get_wakeup_cause(void)
+{
+    return ESP_SLEEP_WAKEUP_UNDEFINED;
+}
+
+const esp_app_desc_t *esp_ota_get_app_description(void)
+{
+    static const esp_app_desc_t desc = {
+        .magic_word = 0xabcd5432,
+        .version = "host",
+        .project_name = "record_host",
+        .idf_ver = "host",
+    };
+    return &desc;
+}
@@ -0,0 +1,253 @@
+/*
+ * FatFs for the host build
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "ff.h"
+
+static FATFS s_fs = {
+    .fs_type = 3,                           /* FS_FAT32 */
+    .pdrv = 0,
+    .csize = FF_HOST_CLUSTER_SECTORS,
+    .ssize = FF_MAX_SS,
+};
+
+/* "0:/a/b" or "/a/b" to FF_HOST_ROOT "/a/b" */
+static FRESULT _host_path(const TCHAR *path, char *out, size_t len)
+{
+    if (path[0] >= '0' && path[0] <= '9' && path[1] == ':') {
+        if (path[0] != '0') {
+            return FR_INVALID_DRIVE;
+        }
+        path += 2;
+    }
+    int n = snprintf(out, len, "%s%s%s", FF_HOST_ROOT, path[0] == '/' ? "" : "/", path);
+    return n > 0 && (size_t)n < len ? FR_OK : FR_INVALID_NAME;
+}
+
+static FRESULT _errno_result(int err)
+{
+    switch (err) {
+    case ENOENT:
+        return FR_NO_FILE;
+    case ENOTDIR:
+        return FR_NO_PATH;
+    case EEXIST:
+        return FR_EXIST;
+    case EACCES:
+    case EPERM:
+    case EISDIR:
+        return FR_DENIED;
+    case ENOSPC:
+        return FR_DENIED;
+    case EMFILE:
+    case ENFILE:
+        return FR_TOO_MANY_OPEN_FILES;
+    case ENAMETOOLONG:
+        return FR_INVALID_NAME;
+    default:
+        return FR_DISK_ERR;
+    }
+}
+
+FRESULT f_open(FIL *fp, const TCHAR *path, BYTE mode)
+{
+    char host[256];
+    memset(fp, 0, sizeof(*fp));
+    fp->fd = -1;
+    FRESULT res = _host_path(path, host, sizeof(host));
+    if (res != FR_OK) {
+        return res;
+    }
+    int flags = (mode & FA_WRITE) ? ((mode & FA_READ) ? O_RDWR : O_WRONLY) : O_RDONLY;
+    if ((mode & FA_OPEN_APPEND) == FA_OPEN_APPEND || (mode & FA_OPEN_ALWAYS)) {
+        flags |= O_CREAT;
+    } else if (mode & FA_CREATE_ALWAYS) {
+        flags |= O_CREAT | O_TRUNC;
+    } else if (mode & FA_CREATE_NEW) {
+        flags |= O_CREAT | O_EXCL;
+    }
+    int fd = open(host, flags, 0644);
+    if (fd < 0) {
+        return _errno_result(errno);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size > (off_t)UINT32_MAX) {
+        close(fd);
+        return FR_DISK_ERR;
+    }
+    fp->fd = fd;
+    fp->flag = mode;
+    fp->obj.fs = &s_fs;
+    fp->obj.id = 1;
+    fp->obj.objsize = (FSIZE_t)st.st_size;
+    if ((mode & FA_OPEN_APPEND) == FA_OPEN_APPEND) {
+        fp->fptr = fp->obj.objsize;
+    }
+    return FR_OK;
+}
+
+FRESULT f_close(FIL *fp)
+{
+    if (fp->obj.fs == NULL || fp->fd < 0) {
+        return FR_INVALID_OBJECT;
+    }
+    int ret = close(fp->fd);
+    fp->fd = -1;
+    fp->obj.fs = NULL;
+    return ret == 0 ? FR_OK : FR_DISK_ERR;
+}
+
+FRESULT f_read(FIL *fp, void *buff, UINT btr, UINT *br)
+{
+    *br = 0;
+    if (fp->obj.fs == NULL) {
+        return FR_INVALID_OBJECT;
+    }
+    if (!(fp->flag & FA_READ)) {
+        return FR_DENIED;
+    }
+    if (btr > fp->obj.objsize - fp->fptr) {
+        btr = fp->obj.objsize - fp->fptr;
+    }
+    while (*br < btr) {
+        ssize_t n = pread(fp->fd, (char *)buff + *br, btr - *br, fp->fptr);
+        if (n < 0) {
+            fp->err = 1;
+            return FR_DISK_ERR;
+        }
+        if (n == 0) {
+            break;
+        }
+        *br += n;
+        fp->fptr += n;
+    }
+    return FR_OK;
+}
+
+FRESULT f_write(FIL *fp, const void *buff, UINT btw, UINT *bw)
+{
+    *bw = 0;
+    if (fp->obj.fs == NULL) {
+        return FR_INVALID_OBJECT;
+    }
+    if (!(fp->flag & FA_WRITE)) {
+        return FR_DENIED;
+    }
+    /* FatFs stops short at 4 GiB - 1, the caller sees *bw < btw */
+    if (btw > UINT32_MAX - fp->fptr) {
+        btw = UINT32_MAX - fp->fptr;
+    }
+    while (*bw < btw) {
+        ssize_t n = pwrite(fp->fd, (const char *)buff + *bw, btw - *bw, fp->fptr);
+        if (n < 0) {
+            if (errno == ENOSPC) {
+                break;
+            }
+            fp->err = 1;
+            return FR_DISK_ERR;
+        }
+        *bw += n;
+        fp->fptr += n;
+    }
+    if (fp->fptr > fp->obj.objsize) {
+        fp->obj.objsize = fp->fptr;
+    }
+    return FR_OK;
+}
+
+FRESULT f_lseek(FIL *fp, FSIZE_t ofs)
+{
+    if (fp->obj.fs == NULL) {
+        return FR_INVALID_OBJECT;
+    }
+    /* As FatFs, seeking past the end of a writable file extends it */
+    if (ofs > fp->obj.objsize) {
+        if (!(fp->flag & FA_WRITE)) {
+            ofs = fp->obj.objsize;
+        } else {
+            if (ftruncate(fp->fd, ofs) != 0) {
+                return _errno_result(errno);
+            }
+            fp->obj.objsize = ofs;
+        }
+    }
+    fp->fptr = ofs;
+    return FR_OK;
+}
+
+FRESULT f_truncate(FIL *fp)
+{
+    if (fp->obj.fs == NULL) {
+        return FR_INVALID_OBJECT;
+    }
+    if (!(fp->flag & FA_WRITE)) {
+        return FR_DENIED;
+    }
+    if (ftruncate(fp->fd, fp->fptr) != 0) {
+        return _errno_result(errno);
+    }
+    fp->obj.objsize = fp->fptr;
+    return FR_OK;
+}
+
+FRESULT f_sync(FIL *fp)
+{
+    if (fp->obj.fs == NULL) {
+        return FR_INVALID_OBJECT;
+    }
+    return fdatasync(fp->fd) == 0 ? FR_OK : FR_DISK_ERR;
+}
+
+/* opt 1 allocates now; only an empty file can be expanded, as in FatFs */
+FRESULT f_expand(FIL *fp, FSIZE_t fsz, BYTE opt)
+{
+    if (fp->obj.fs == NULL) {
+        return FR_INVALID_OBJECT;
+    }
+    if (fsz == 0 || fp->obj.objsize != 0 || !(fp->flag & FA_WRITE)) {
+        return FR_DENIED;
+    }
+    if (opt) {
+        int err = posix_fallocate(fp->fd, 0, fsz);
+        if (err == ENOSPC) {
+            return FR_DENIED;
+        }
+        if (err != 0 && ftruncate(fp->fd, fsz) != 0) {
+            return _errno_result(errno);
+        }
+        fp->obj.objsize = fsz;
+    }
+    return FR_OK;
+}
+
+FRESULT f_unlink(const TCHAR *path)
+{
+    char host[256];
+    FRESULT res = _host_path(path, host, sizeof(host));
+    if (res != FR_OK) {
+        return res;
+    }
+    return unlink(host) == 0 ? FR_OK : _errno_result(errno);
+}
+
+FRESULT f_getfree(const TCHAR *path, DWORD *nclst, FATFS **fatfs)
+{
+    struct statvfs st;
+    if (statvfs(FF_HOST_ROOT, &st) != 0) {
+        return FR_NOT_READY;
+    }
+    uint64_t cluster = (uint64_t)s_fs.csize * s_fs.ssize;
+    uint64_t free_clst = (uint64_t)st.f_bavail * st.f_frsize / cluster;
+    uint64_t total_clst = (uint64_t)st.f_blocks * st.f_frsize / cluster;
+    s_fs.n_fatent = (DWORD)(total_clst > UINT32_MAX - 2 ? UINT32_MAX : total_clst + 2);
+    *nclst = (DWORD)(free_clst > UINT32_MAX ? UINT32_MAX : free_clst);
+    *fatfs = &s_fs;
+    return FR_OK;
+}
@@ -0,0 +1,452 @@
+/*
+ * FreeRTOS for the host build - tasks, semaphores and queues on pthreads
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char *TAG = "HOST_RTOS";
+
+struct host_task {
+    pthread_t           thread;
+    char                name[configMAX_TASK_NAME_LEN];
+    TaskFunction_t      fn;
+    void                *arg;
+    UBaseType_t         prio;
+    BaseType_t          core;
+    UBaseType_t         number;
+    uint32_t            stack;
+    clockid_t           clock;              /* CPU time of the thread */
+    bool                started;            /* clock is set */
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    uint32_t            notify;
+    struct host_task    *next;
+};
+
+struct host_sem {
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    UBaseType_t         count;
+    UBaseType_t         max;
+};
+
+struct host_queue {
+    pthread_mutex_t     lock;
+    pthread_cond_t      not_empty;
+    pthread_cond_t      not_full;
+    uint8_t             *items;
+    UBaseType_t         length;
+    UBaseType_t         item_size;
+    UBaseType_t         head;
+    UBaseType_t         count;
+};
+
+static struct {
+    pthread_mutex_t     lock;
+    struct host_task    *tasks;
+    UBaseType_t         count;
+    UBaseType_t         numbers;
+} s_rtos = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread struct host_task *s_self;
+
+__thread int port_critical_nesting;
+
+/* Condition variables wait on CLOCK_MONOTONIC, like esp_timer_get_time() */
+static void _cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static void _deadline(TickType_t ticks, struct timespec *ts)
+{
+    uint64_t ms = (uint64_t)ticks * portTICK_PERIOD_MS;
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/* Wait on cond until ready() or ticks pass, lock held. false on timeout. */
+static bool _wait(pthread_cond_t *cond, pthread_mutex_t *lock, TickType_t ticks, bool (*ready)(void *), void *ctx)
+{
+    struct timespec ts;
+    if (ticks != portMAX_DELAY) {
+        _deadline(ticks, &ts);
+    }
+    while (!ready(ctx)) {
+        if (ticks == 0) {
+            return false;
+        }
+        if (ticks == portMAX_DELAY) {
+            pthread_cond_wait(cond, lock);
+        } else if (pthread_cond_timedwait(cond, lock, &ts) == ETIMEDOUT) {
+            return ready(ctx);
+        }
+    }
+    return true;
+}
+
+BaseType_t xPortGetCoreID(void)
+{
+    if (s_self == NULL || s_self->core == tskNO_AFFINITY) {
+        return 0;
+    }
+    return s_self->core % portNUM_PROCESSORS;
+}
+
+static void _unlink(struct host_task *task)
+{
+    pthread_mutex_lock(&s_rtos.lock);
+    for (struct host_task **p = &s_rtos.tasks; *p; p = &(*p)->next) {
+        if (*p == task) {
+            *p = task->next;
+            s_rtos.count--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s_rtos.lock);
+}
+
+static void *_task_main(void *arg)
+{
+    struct host_task *task = arg;
+    s_self = task;
+    pthread_mutex_lock(&s_rtos.lock);
+    task->started = pthread_getcpuclockid(pthread_self(), &task->clock) == 0;
+    pthread_mutex_unlock(&s_rtos.lock);
+    task->fn(task->arg);
+    /* A FreeRTOS task must not return, the board would abort */
+    ESP_LOGE(TAG, "Task %s returned without vTaskDelete()", task->name);
+    vTaskDelete(NULL);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                                   UBaseType_t prio, TaskHandle_t *handle, BaseType_t core)
+{
+    struct host_task *task = calloc(1, sizeof(*task));
+    if (task == NULL) {
+        return pdFAIL;
+    }
+    snprintf(task->name, sizeof(task->name), "%s", name ? name : "");
+    task->fn = fn;
+    task->arg = arg;
+    task->prio = prio;
+    task->core = core;
+    task->stack = stack;
+    pthread_mutex_init(&task->lock, NULL);
+    _cond_init(&task->cond);
+
+    pthread_mutex_lock(&s_rtos.lock);
+    task->number = ++s_rtos.numbers;
+    task->next = s_rtos.tasks;
+    s_rtos.tasks = task;
+    s_rtos.count++;
+    pthread_mutex_unlock(&s_rtos.lock);
+
+    /* The handle is valid before the task runs, as on the board */
+    if (handle) {
+        *handle = task;
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&task->thread, &attr, _task_main, task);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        _unlink(task);
+        if (handle) {
+            *handle = NULL;
+        }
+        free(task);
+        return pdFAIL;
+    }
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                       UBaseType_t prio, TaskHandle_t *handle)
+{
+    return xTaskCreatePinnedToCore(fn, name, stack, arg, prio, handle, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task != NULL && task != s_self) {
+        ESP_LOGE(TAG, "vTaskDelete() of another task is not supported on the host");
+        abort();
+    }
+    if (s_self == NULL) {
+        ESP_LOGE(TAG, "vTaskDelete(NULL) outside a task");
+        abort();
+    }
+    task = s_self;
+    _unlink(task);
+    s_self = NULL;
+    pthread_mutex_destroy(&task->lock);
+    pthread_cond_destroy(&task->cond);
+    free(task);
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    if (ticks == 0) {
+        sched_yield();
+        return;
+    }
+    uint64_t ms = (uint64_t)ticks * portTICK_PERIOD_MS;
+    struct timespec ts = {
+        .tv_sec = ms / 1000,
+        .tv_nsec = (ms % 1000) * 1000000,
+    };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)(esp_timer_get_time() / 1000 / portTICK_PERIOD_MS);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return s_self;
+}
+
+char *pcTaskGetName(TaskHandle_t task)
+{
+    task = task ? task : s_self;
+    return task ? task->name : "main";
+}
+
+UBaseType_t uxTaskGetNumberOfTasks(void)
+{
+    pthread_mutex_lock(&s_rtos.lock);
+    UBaseType_t count = s_rtos.count;
+    pthread_mutex_unlock(&s_rtos.lock);
+    return count;
+}
+
+UBaseType_t uxTaskGetSystemState(TaskStatus_t *tasks, UBaseType_t max, uint32_t *total_run_time)
+{
+    UBaseType_t n = 0;
+    pthread_mutex_lock(&s_rtos.lock);
+    for (struct host_task *t = s_rtos.tasks; t && n < max; t = t->next) {
+        struct timespec ts = {0};
+        if (t->started) {
+            clock_gettime(t->clock, &ts);
+        }
+        TaskStatus_t *st = &tasks[n++];
+        memset(st, 0, sizeof(*st));
+        st->xHandle = t;
+        st->pcTaskName = t->name;
+        st->xTaskNumber = t->number;
+        st->eCurrentState = t == s_self ? eRunning : eReady;
+        st->uxCurrentPriority = t->prio;
+        st->uxBasePriority = t->prio;
+        st->ulRunTimeCounter = (uint32_t)((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+        st->usStackHighWaterMark = t->stack;
+        st->xCoreID = t->core;
+    }
+    pthread_mutex_unlock(&s_rtos.lock);
+    if (total_run_time) {
+        *total_run_time = (uint32_t)esp_timer_get_time();
+    }
+    return n;
+}
+
+static bool _notified(void *ctx)
+{
+    return ((struct host_task *)ctx)->notify > 0;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    struct host_task *task = s_self;
+    if (task == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&task->lock);
+    _wait(&task->cond, &task->lock, ticks, _notified, task);
+    uint32_t value = task->notify;
+    if (value) {
+        task->notify = clear ? 0 : value - 1;
+    }
+    pthread_mutex_unlock(&task->lock);
+    return value;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&task->lock);
+    task->notify++;
+    pthread_cond_signal(&task->cond);
+    pthread_mutex_unlock(&task->lock);
+    return pdPASS;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial)
+{
+    struct host_sem *sem = calloc(1, sizeof(*sem));
+    if (sem == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&sem->lock, NULL);
+    _cond_init(&sem->cond);
+    sem->max = max;
+    sem->count = initial;
+    return sem;
+}
+
+static bool _sem_ready(void *ctx)
+{
+    return ((struct host_sem *)ctx)->count > 0;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    pthread_mutex_lock(&sem->lock);
+    bool ok = _wait(&sem->cond, &sem->lock, ticks, _sem_ready, sem);
+    if (ok) {
+        sem->count--;
+    }
+    pthread_mutex_unlock(&sem->lock);
+    return ok ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    BaseType_t ret = pdFALSE;
+    pthread_mutex_lock(&sem->lock);
+    if (sem->count < sem->max) {
+        sem->count++;
+        pthread_cond_signal(&sem->cond);
+        ret = pdTRUE;
+    }
+    pthread_mutex_unlock(&sem->lock);
+    return ret;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+    if (sem == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&sem->lock);
+    pthread_cond_destroy(&sem->cond);
+    free(sem);
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    struct host_queue *q = calloc(1, sizeof(*q));
+    if (q == NULL) {
+        return NULL;
+    }
+    q->items = calloc(length, item_size);
+    if (q->items == NULL) {
+        free(q);
+        return NULL;
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    _cond_init(&q->not_empty);
+    _cond_init(&q->not_full);
+    q->length = length;
+    q->item_size = item_size;
+    return q;
+}
+
+static bool _queue_has_room(void *ctx)
+{
+    struct host_queue *q = ctx;
+    return q->count < q->length;
+}
+
+static bool _queue_has_item(void *ctx)
+{
+    return ((struct host_queue *)ctx)->count > 0;
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks)
+{
+    pthread_mutex_lock(&q->lock);
+    bool ok = _wait(&q->not_full, &q->lock, ticks, _queue_has_room, q);
+    if (ok) {
+        memcpy(q->items + ((q->head + q->count) % q->length) * q->item_size, item, q->item_size);
+        q->count++;
+        pthread_cond_signal(&q->not_empty);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok ? pdTRUE : errQUEUE_FULL;
+}
+
+static BaseType_t _queue_get(QueueHandle_t q, void *item, TickType_t ticks, bool remove)
+{
+    pthread_mutex_lock(&q->lock);
+    bool ok = _wait(&q->not_empty, &q->lock, ticks, _queue_has_item, q);
+    if (ok) {
+        memcpy(item, q->items + q->head * q->item_size, q->item_size);
+        if (remove) {
+            q->head = (q->head + 1) % q->length;
+            q->count--;
+            pthread_cond_signal(&q->not_full);
+        } else {
+            /* Others waiting to peek or receive see it too */
+            pthread_cond_signal(&q->not_empty);
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks)
+{
+    return _queue_get(q, item, ticks, true);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t q, void *item, TickType_t ticks)
+{
+    return _queue_get(q, item, ticks, false);
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+    pthread_mutex_lock(&q->lock);
+    UBaseType_t count = q->count;
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
+
+void vQueueDelete(QueueHandle_t q)
+{
+    if (q == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    free(q->items);
+    free(q);
+}
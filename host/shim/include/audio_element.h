@@ -0,0 +1,152 @@
+/*
+ * audio_element for the host build
+ *
+ * The ADF element model on a shim task: run() starts a task that opens the
+ * element and calls process until it returns done, fail or abort, closes it
+ * and marks its output ring buffer done. audio_element_input() and
+ * audio_element_output() go to the read / write callback when there is one,
+ * else to the ring buffers. Events and commands are left out; the state is
+ * polled and stop() aborts the ring buffers of the element.
+ */
+
+#ifndef HOST_AUDIO_ELEMENT_H_
+#define HOST_AUDIO_ELEMENT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+#include "ringbuf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct audio_element *audio_element_handle_t;
+
+typedef enum {
+    AEL_IO_OK           = ESP_OK,
+    AEL_IO_FAIL         = ESP_FAIL,
+    AEL_IO_DONE         = -2,
+    AEL_IO_ABORT        = -3,
+    AEL_IO_TIMEOUT      = -4,
+    AEL_PROCESS_FAIL    = -5,
+} audio_element_err_t;
+
+typedef enum {
+    AEL_STATE_NONE          = 0,
+    AEL_STATE_INIT,
+    AEL_STATE_INITIALIZING,
+    AEL_STATE_RUNNING,
+    AEL_STATE_PAUSED,
+    AEL_STATE_STOPPED,
+    AEL_STATE_FINISHED,
+    AEL_STATE_ERROR,
+} audio_element_state_t;
+
+typedef struct {
+    int         sample_rates;
+    int         channels;
+    int         bits;
+    int         bps;
+    int64_t     byte_pos;
+    int64_t     total_bytes;
+    int         duration;
+    char        *uri;
+    int         codec_fmt;
+} audio_element_info_t;
+
+#define AUDIO_ELEMENT_INFO_DEFAULT() {              \
+    .sample_rates = 44100,                          \
+    .channels = 2,                                  \
+    .bits = 16,                                     \
+    .bps = 0,                                       \
+    .byte_pos = 0,                                  \
+    .total_bytes = 0,                               \
+    .duration = 0,                                  \
+    .uri = NULL,                                    \
+    .codec_fmt = 0,                                 \
+}
+
+typedef esp_err_t (*el_io_func)(audio_element_handle_t self);
+typedef int (*process_func)(audio_element_handle_t self, char *el_buffer, int el_buf_len);
+typedef int (*stream_func)(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *context);
+
+#define AUDIO_ELEMENT_MAX_MULTI_OUT         2
+
+typedef struct {
+    el_io_func      open;
+    process_func    process;
+    el_io_func      close;
+    el_io_func      destroy;
+    stream_func     read;
+    stream_func     write;
+    int             buffer_len;
+    int             task_stack;
+    int             task_prio;
+    int             task_core;
+    int             out_rb_size;
+    void            *data;
+    const char      *tag;
+    bool            stack_in_ext;
+    int             multi_in_rb_num;
+    int             multi_out_rb_num;
+} audio_element_cfg_t;
+
+#define DEFAULT_ELEMENT_RINGBUF_SIZE        (8 * 1024)
+#define DEFAULT_ELEMENT_BUFFER_LENGTH       (1024)
+#define DEFAULT_ELEMENT_STACK_SIZE          (2 * 1024)
+#define DEFAULT_ELEMENT_TASK_PRIO           (5)
+#define DEFAULT_ELEMENT_TASK_CORE           (0)
+
+#define DEFAULT_AUDIO_ELEMENT_CONFIG() {            \
+    .buffer_len = DEFAULT_ELEMENT_BUFFER_LENGTH,    \
+    .task_stack = DEFAULT_ELEMENT_STACK_SIZE,       \
+    .task_prio = DEFAULT_ELEMENT_TASK_PRIO,         \
+    .task_core = DEFAULT_ELEMENT_TASK_CORE,         \
+    .multi_in_rb_num = 0,                           \
+    .multi_out_rb_num = 0,                          \
+}
+
+audio_element_handle_t audio_element_init(audio_element_cfg_t *config);
+esp_err_t audio_element_deinit(audio_element_handle_t el);
+
+esp_err_t audio_element_setdata(audio_element_handle_t el, void *data);
+void *audio_element_getdata(audio_element_handle_t el);
+esp_err_t audio_element_set_tag(audio_element_handle_t el, const char *tag);
+char *audio_element_get_tag(audio_element_handle_t el);
+esp_err_t audio_element_setinfo(audio_element_handle_t el, audio_element_info_t *info);
+esp_err_t audio_element_getinfo(audio_element_handle_t el, audio_element_info_t *info);
+esp_err_t audio_element_set_uri(audio_element_handle_t el, const char *uri);
+char *audio_element_get_uri(audio_element_handle_t el);
+audio_element_state_t audio_element_get_state(audio_element_handle_t el);
+
+esp_err_t audio_element_set_input_ringbuf(audio_element_handle_t el, ringbuf_handle_t rb);
+ringbuf_handle_t audio_element_get_input_ringbuf(audio_element_handle_t el);
+esp_err_t audio_element_set_output_ringbuf(audio_element_handle_t el, ringbuf_handle_t rb);
+ringbuf_handle_t audio_element_get_output_ringbuf(audio_element_handle_t el);
+esp_err_t audio_element_set_output_ringbuf_size(audio_element_handle_t el, int rb_size);
+int audio_element_get_output_ringbuf_size(audio_element_handle_t el);
+esp_err_t audio_element_set_multi_output_ringbuf(audio_element_handle_t el, ringbuf_handle_t rb, int index);
+esp_err_t audio_element_set_ringbuf_done(audio_element_handle_t el);
+
+/**
+ * @brief  Read from the read callback or the input ring buffer, RB_* codes
+ *         come back as the matching AEL_IO_*
+ */
+int audio_element_input(audio_element_handle_t el, char *buffer, int wanted_size);
+int audio_element_output(audio_element_handle_t el, char *buffer, int write_size);
+int audio_element_multi_output(audio_element_handle_t el, char *buffer, int wanted_size, TickType_t ticks_to_wait);
+
+esp_err_t audio_element_run(audio_element_handle_t el);
+esp_err_t audio_element_resume(audio_element_handle_t el, float wait_for_rb_threshold, TickType_t timeout);
+esp_err_t audio_element_stop(audio_element_handle_t el);
+esp_err_t audio_element_wait_for_stop(audio_element_handle_t el);
+esp_err_t audio_element_wait_for_stop_ms(audio_element_handle_t el, TickType_t ticks_to_wait);
+esp_err_t audio_element_terminate(audio_element_handle_t el);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_AUDIO_ELEMENT_H_ */
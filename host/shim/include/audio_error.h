@@ -0,0 +1,22 @@
+/*
+ * audio_error for the host build, the ADF check macros
+ */
+
+#ifndef HOST_AUDIO_ERROR_H_
+#define HOST_AUDIO_ERROR_H_
+
+#include <assert.h>
+#include "esp_log.h"
+
+#define AUDIO_CHECK(TAG, a, action, msg) if (!(a)) {                            \
+        ESP_LOGE(TAG, "%s:%d (%s): %s", __FILE__, __LINE__, __FUNCTION__, msg); \
+        action;                                                                 \
+    }
+
+#define AUDIO_MEM_CHECK(TAG, a, action)     AUDIO_CHECK(TAG, a, action, "Memory exhausted")
+#define AUDIO_NULL_CHECK(TAG, a, action)    AUDIO_CHECK(TAG, a, action, "Got NULL Pointer")
+#define AUDIO_ERROR(TAG, str)               ESP_LOGE(TAG, "%s:%d (%s): %s", __FILE__, __LINE__, __FUNCTION__, str)
+
+#define mem_assert(x)                       assert(x)
+
+#endif /* HOST_AUDIO_ERROR_H_ */
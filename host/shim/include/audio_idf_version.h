@@ -0,0 +1,12 @@
+/*
+ * audio_idf_version for the host build, the IDF release the firmware is
+ * built with
+ */
+
+#ifndef HOST_AUDIO_IDF_VERSION_H_
+#define HOST_AUDIO_IDF_VERSION_H_
+
+#define ESP_IDF_VERSION_VAL(major, minor, patch)    (((major) << 16) | ((minor) << 8) | (patch))
+#define ESP_IDF_VERSION                             ESP_IDF_VERSION_VAL(4, 4, 0)
+
+#endif /* HOST_AUDIO_IDF_VERSION_H_ */
@@ -0,0 +1,26 @@
+/*
+ * audio_mem for the host build, ADF puts these in PSRAM with
+ * CONFIG_SPIRAM_BOOT_INIT, so they count against it here
+ */
+
+#ifndef HOST_AUDIO_MEM_H_
+#define HOST_AUDIO_MEM_H_
+
+#include <stddef.h>
+#include "esp_heap_caps.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define audio_malloc(size)                  heap_caps_malloc(size, MALLOC_CAP_SPIRAM)
+#define audio_calloc(n, size)               heap_caps_calloc(n, size, MALLOC_CAP_SPIRAM)
+#define audio_realloc(ptr, size)            heap_caps_realloc(ptr, size, MALLOC_CAP_SPIRAM)
+#define audio_calloc_inner(n, size)         heap_caps_calloc(n, size, MALLOC_CAP_INTERNAL)
+#define audio_free(ptr)                     heap_caps_free(ptr)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_AUDIO_MEM_H_ */
@@ -0,0 +1,14 @@
+/*
+ * esp_attr for the host build, memory placement means nothing on the host
+ */
+
+#ifndef HOST_ESP_ATTR_H_
+#define HOST_ESP_ATTR_H_
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+#define RTC_DATA_ATTR
+#define RTC_NOINIT_ATTR
+#define EXT_RAM_ATTR
+
+#endif /* HOST_ESP_ATTR_H_ */
@@ -0,0 +1,26 @@
+/*
+ * esp_cpu for the host build
+ *
+ * The cycle count is the CPU time of the calling thread in nanoseconds, so
+ * cycle_prof reads a 1000 MHz core and, unlike the board, leaves out the time
+ * a thread was blocked.
+ */
+
+#ifndef HOST_ESP_CPU_H_
+#define HOST_ESP_CPU_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HOST_CPU_MHZ                        1000
+
+uint32_t esp_cpu_get_ccount(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_ESP_CPU_H_ */
@@ -0,0 +1,46 @@
+/*
+ * heap_caps for the host build
+ *
+ * Allocations are counted against an internal heap and a PSRAM of the size
+ * the board has, so free, minimum free (peak use) and largest block read as
+ * they would on the board; the memory itself comes from malloc().
+ */
+
+#ifndef HOST_ESP_HEAP_CAPS_H_
+#define HOST_ESP_HEAP_CAPS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MALLOC_CAP_EXEC                     (1 << 0)
+#define MALLOC_CAP_32BIT                    (1 << 1)
+#define MALLOC_CAP_8BIT                     (1 << 2)
+#define MALLOC_CAP_DMA                      (1 << 3)
+#define MALLOC_CAP_SPIRAM                   (1 << 10)
+#define MALLOC_CAP_INTERNAL                 (1 << 11)
+#define MALLOC_CAP_DEFAULT                  (1 << 12)
+
+#if !defined HOST_HEAP_INTERNAL_BYTES
+#define HOST_HEAP_INTERNAL_BYTES            (300 * 1024)
+#endif
+#if !defined HOST_HEAP_SPIRAM_BYTES
+#define HOST_HEAP_SPIRAM_BYTES              (4 * 1024 * 1024)
+#endif
+
+void *heap_caps_malloc(size_t size, uint32_t caps);
+void *heap_caps_calloc(size_t n, size_t size, uint32_t caps);
+void *heap_caps_realloc(void *ptr, size_t size, uint32_t caps);
+void heap_caps_free(void *ptr);
+size_t heap_caps_get_free_size(uint32_t caps);
+size_t heap_caps_get_minimum_free_size(uint32_t caps);
+size_t heap_caps_get_largest_free_block(uint32_t caps);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_ESP_HEAP_CAPS_H_ */
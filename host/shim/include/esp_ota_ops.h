@@ -0,0 +1,81 @@
+/*
+ * esp_ota_ops for the host build: the application description, and the two
+ * OTA slots of partitions.csv in a flash image file with the bootloader's
+ * rollback (CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE)
+ *
+ * host_ota_flash_open() creates the file and boots ota_0 as a valid image.
+ * host_ota_restart() does what the bootloader does on the next reset: a new
+ * image boots once as pending verify; one still pending verify is aborted
+ * and the previous slot boots again.
+ */
+
+#ifndef HOST_ESP_OTA_OPS_H_
+#define HOST_ESP_OTA_OPS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ESP_ERR_OTA_BASE                    0x1500
+#define ESP_ERR_OTA_PARTITION_CONFLICT      (ESP_ERR_OTA_BASE + 0x01)
+#define ESP_ERR_OTA_SELECT_INFO_INVALID     (ESP_ERR_OTA_BASE + 0x02)
+#define ESP_ERR_OTA_VALIDATE_FAILED         (ESP_ERR_OTA_BASE + 0x03)
+
+#define OTA_SIZE_UNKNOWN                    0xffffffff
+/* First byte of an app image */
+#define HOST_OTA_IMAGE_MAGIC                0xE9
+
+typedef uint32_t esp_ota_handle_t;
+
+typedef enum {
+    ESP_OTA_IMG_NEW             = 0x0U,
+    ESP_OTA_IMG_PENDING_VERIFY  = 0x1U,
+    ESP_OTA_IMG_VALID           = 0x2U,
+    ESP_OTA_IMG_INVALID         = 0x3U,
+    ESP_OTA_IMG_ABORTED         = 0x4U,
+    ESP_OTA_IMG_UNDEFINED       = 0xFFFFFFFFU,
+} esp_ota_img_states_t;
+
+typedef struct {
+    uint32_t    magic_word;
+    uint32_t    secure_version;
+    uint32_t    reserv1[2];
+    char        version[32];
+    char        project_name[32];
+    char        time[16];
+    char        date[16];
+    char        idf_ver[32];
+    uint8_t     app_elf_sha256[32];
+    uint32_t    reserv2[20];
+} esp_app_desc_t;
+
+const esp_app_desc_t *esp_ota_get_app_description(void);
+
+const esp_partition_t *esp_ota_get_running_partition(void);
+const esp_partition_t *esp_ota_get_boot_partition(void);
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from);
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t image_size, esp_ota_handle_t *out_handle);
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data, size_t size);
+esp_err_t esp_ota_end(esp_ota_handle_t handle);
+esp_err_t esp_ota_abort(esp_ota_handle_t handle);
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition);
+esp_err_t esp_ota_get_state_partition(const esp_partition_t *partition, esp_ota_img_states_t *ota_state);
+esp_err_t esp_ota_mark_app_valid_cancel_rollback(void);
+
+/* Host only */
+esp_err_t host_ota_flash_open(const char *path);
+void host_ota_flash_close(void);
+void host_ota_restart(void);
+/* esp_ota_begin() calls without an esp_ota_end() or esp_ota_abort() */
+int host_ota_open_handles(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_ESP_OTA_OPS_H_ */
@@ -0,0 +1,26 @@
+/*
+ * esp_partition for the host build, the partition record only
+ */
+
+#ifndef HOST_ESP_PARTITION_H_
+#define HOST_ESP_PARTITION_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint32_t    address;
+    uint32_t    size;
+    char        label[17];
+    bool        encrypted;
+} esp_partition_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_ESP_PARTITION_H_ */
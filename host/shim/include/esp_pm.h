@@ -0,0 +1,39 @@
+/*
+ * esp_pm for the host build
+ *
+ * The host runs at its own clock. esp_pm_configure() keeps max_freq_mhz, and
+ * audio elements then stretch each process() call to the time its cycles
+ * would take at that clock (see esp_cpu.h for what a host cycle is).
+ */
+
+#ifndef HOST_ESP_PM_H_
+#define HOST_ESP_PM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    int     max_freq_mhz;
+    int     min_freq_mhz;
+    bool    light_sleep_enable;
+} esp_pm_config_esp32_t;
+
+esp_err_t esp_pm_configure(const void *config);
+
+/* Host only */
+/* Clock set by esp_pm_configure(), 0 before the first call */
+int host_cpu_freq_mhz(void);
+/* Spin until the calling thread's work since start_ccount has taken as long
+   as it would at that clock, one host cycle counting as one cycle there */
+void host_cpu_stretch(uint32_t start_ccount);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_ESP_PM_H_ */
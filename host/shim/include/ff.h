@@ -0,0 +1,112 @@
+/*
+ * FatFs for the host build, files in a local directory
+ *
+ * Drive "0:" is the directory FF_HOST_ROOT, the same one the VFS prefix
+ * (SD_WAV_WRITER_VFS_PREFIX) names, so fopen() and f_open() see the same
+ * files as on the card. FATFS reports FF_HOST_CLUSTER_SECTORS sectors of
+ * FF_MAX_SS bytes per cluster; f_expand() reserves the space with
+ * posix_fallocate() and sets the size as FatFs does.
+ */
+
+#ifndef HOST_FF_H_
+#define HOST_FF_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if !defined FF_HOST_ROOT
+#define FF_HOST_ROOT                        "sdcard"
+#endif
+/* 32 KiB clusters, what a card formatted by the IDF gets */
+#if !defined FF_HOST_CLUSTER_SECTORS
+#define FF_HOST_CLUSTER_SECTORS             64
+#endif
+
+#define FF_MIN_SS                           512
+#define FF_MAX_SS                           512
+
+typedef unsigned int                        UINT;
+typedef uint8_t                             BYTE;
+typedef uint16_t                            WORD;
+typedef uint32_t                            DWORD;
+typedef uint64_t                            QWORD;
+typedef DWORD                               FSIZE_t;
+typedef char                                TCHAR;
+
+typedef enum {
+    FR_OK = 0,
+    FR_DISK_ERR,
+    FR_INT_ERR,
+    FR_NOT_READY,
+    FR_NO_FILE,
+    FR_NO_PATH,
+    FR_INVALID_NAME,
+    FR_DENIED,
+    FR_EXIST,
+    FR_INVALID_OBJECT,
+    FR_WRITE_PROTECTED,
+    FR_INVALID_DRIVE,
+    FR_NOT_ENABLED,
+    FR_NO_FILESYSTEM,
+    FR_MKFS_ABORTED,
+    FR_TIMEOUT,
+    FR_LOCKED,
+    FR_NOT_ENOUGH_CORE,
+    FR_TOO_MANY_OPEN_FILES,
+    FR_INVALID_PARAMETER,
+} FRESULT;
+
+typedef struct {
+    BYTE    fs_type;
+    BYTE    pdrv;
+    WORD    csize;                          /* Sectors per cluster */
+    WORD    ssize;                          /* Bytes per sector */
+    DWORD   n_fatent;
+} FATFS;
+
+typedef struct {
+    FATFS   *fs;
+    WORD    id;
+    FSIZE_t objsize;
+} FFOBJID;
+
+typedef struct {
+    FFOBJID obj;
+    BYTE    flag;
+    BYTE    err;
+    FSIZE_t fptr;
+    int     fd;                             /* Host file */
+} FIL;
+
+#define FA_READ                             0x01
+#define FA_WRITE                            0x02
+#define FA_OPEN_EXISTING                    0x00
+#define FA_CREATE_NEW                       0x04
+#define FA_CREATE_ALWAYS                    0x08
+#define FA_OPEN_ALWAYS                      0x10
+#define FA_OPEN_APPEND                      0x30
+
+#define f_size(fp)                          ((fp)->obj.objsize)
+#define f_tell(fp)                          ((fp)->fptr)
+#define f_eof(fp)                           ((int)((fp)->fptr == (fp)->obj.objsize))
+#define f_rewind(fp)                        f_lseek((fp), 0)
+
+FRESULT f_open(FIL *fp, const TCHAR *path, BYTE mode);
+FRESULT f_close(FIL *fp);
+FRESULT f_read(FIL *fp, void *buff, UINT btr, UINT *br);
+FRESULT f_write(FIL *fp, const void *buff, UINT btw, UINT *bw);
+FRESULT f_lseek(FIL *fp, FSIZE_t ofs);
+FRESULT f_truncate(FIL *fp);
+FRESULT f_sync(FIL *fp);
+FRESULT f_expand(FIL *fp, FSIZE_t fsz, BYTE opt);
+FRESULT f_unlink(const TCHAR *path);
+FRESULT f_getfree(const TCHAR *path, DWORD *nclst, FATFS **fatfs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_FF_H_ */
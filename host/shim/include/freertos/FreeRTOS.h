@@ -0,0 +1,71 @@
+/*
+ * FreeRTOS for the host build - tasks are pthreads, a tick is 1 ms
+ *
+ * Only what the modules use. Priorities and core affinity are kept for the
+ * reports but not enforced, a critical section is a recursive mutex.
+ */
+
+#ifndef HOST_FREERTOS_H_
+#define HOST_FREERTOS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int                                 BaseType_t;
+typedef unsigned int                        UBaseType_t;
+typedef uint32_t                            TickType_t;
+
+#define pdTRUE                              1
+#define pdFALSE                             0
+#define pdPASS                              pdTRUE
+#define pdFAIL                              pdFALSE
+#define errQUEUE_FULL                       pdFALSE
+
+#define configTICK_RATE_HZ                  1000
+#define configMAX_TASK_NAME_LEN             16
+#define portMAX_DELAY                       ((TickType_t)0xffffffff)
+#define portTICK_PERIOD_MS                  (1000 / configTICK_RATE_HZ)
+#define portTICK_RATE_MS                    portTICK_PERIOD_MS
+#define pdMS_TO_TICKS(ms)                   ((TickType_t)((uint64_t)(ms) * configTICK_RATE_HZ / 1000))
+#define portNUM_PROCESSORS                  2
+#define tskNO_AFFINITY                      0x7fffffff
+
+typedef struct {
+    pthread_mutex_t m;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED        { PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP }
+/* Critical sections the calling thread is in, as the port counts them */
+extern __thread int port_critical_nesting;
+
+#define portENTER_CRITICAL(mux)             do { pthread_mutex_lock(&(mux)->m); port_critical_nesting++; } while (0)
+#define portEXIT_CRITICAL(mux)              do { port_critical_nesting--; pthread_mutex_unlock(&(mux)->m); } while (0)
+#define portENTER_CRITICAL_ISR(mux)         portENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL_ISR(mux)          portEXIT_CRITICAL(mux)
+
+/**
+ * @brief  Core the calling task was created on, 0 for threads the shim did
+ *         not create
+ */
+BaseType_t xPortGetCoreID(void);
+
+/**
+ * @brief  False inside a critical section, where the ESP32 must not block,
+ *         wait for a flash or SD write, or yield
+ */
+static inline bool xPortCanYield(void)
+{
+    return port_critical_nesting == 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_FREERTOS_H_ */
@@ -0,0 +1,28 @@
+/*
+ * mbedtls/ctr_drbg for the host build, on OpenSSL's RAND_bytes()
+ */
+
+#ifndef HOST_MBEDTLS_CTR_DRBG_H_
+#define HOST_MBEDTLS_CTR_DRBG_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    int seeded;
+} mbedtls_ctr_drbg_context;
+
+void mbedtls_ctr_drbg_init(mbedtls_ctr_drbg_context *ctx);
+void mbedtls_ctr_drbg_free(mbedtls_ctr_drbg_context *ctx);
+int mbedtls_ctr_drbg_seed(mbedtls_ctr_drbg_context *ctx, int (*f_entropy)(void *, unsigned char *, size_t),
+                          void *p_entropy, const unsigned char *custom, size_t len);
+int mbedtls_ctr_drbg_random(void *p_rng, unsigned char *output, size_t output_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_MBEDTLS_CTR_DRBG_H_ */
@@ -0,0 +1,26 @@
+/*
+ * mbedtls/entropy for the host build, OpenSSL seeds its own generator
+ */
+
+#ifndef HOST_MBEDTLS_ENTROPY_H_
+#define HOST_MBEDTLS_ENTROPY_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    int unused;
+} mbedtls_entropy_context;
+
+void mbedtls_entropy_init(mbedtls_entropy_context *ctx);
+void mbedtls_entropy_free(mbedtls_entropy_context *ctx);
+int mbedtls_entropy_func(void *data, unsigned char *output, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_MBEDTLS_ENTROPY_H_ */
@@ -0,0 +1,12 @@
+/*
+ * mbedtls/net_sockets for the host build: the error codes FtpClient's BIO
+ * callbacks return
+ */
+
+#ifndef HOST_MBEDTLS_NET_SOCKETS_H_
+#define HOST_MBEDTLS_NET_SOCKETS_H_
+
+#define MBEDTLS_ERR_NET_RECV_FAILED         -0x004C
+#define MBEDTLS_ERR_NET_SEND_FAILED         -0x004E
+
+#endif /* HOST_MBEDTLS_NET_SOCKETS_H_ */
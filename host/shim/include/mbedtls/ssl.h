@@ -0,0 +1,107 @@
+/*
+ * mbedtls/ssl for the host build, on OpenSSL's libssl (link OpenSSL::SSL)
+ *
+ * The client side FtpClient uses: a config with cipher suites, minimum
+ * version, CA chain and verify mode; a context on send/recv callbacks; the
+ * session saved after a handshake and offered by the next one. Like the
+ * mbedTLS 2.x of ESP-IDF 4.4 it speaks TLS 1.2 at most, so resumption uses
+ * the session ID or ticket of the full handshake as on the board.
+ */
+
+#ifndef HOST_MBEDTLS_SSL_H_
+#define HOST_MBEDTLS_SSL_H_
+
+#include <stddef.h>
+#include <openssl/ssl.h>
+#include "mbedtls/x509_crt.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE -0x7080
+#define MBEDTLS_ERR_SSL_BAD_INPUT_DATA      -0x7100
+#define MBEDTLS_ERR_SSL_CONN_EOF            -0x7280
+#define MBEDTLS_ERR_SSL_FATAL_ALERT_MESSAGE -0x7780
+#define MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY   -0x7880
+#define MBEDTLS_ERR_SSL_ALLOC_FAILED        -0x7F00
+#define MBEDTLS_ERR_SSL_INTERNAL_ERROR      -0x6C00
+#define MBEDTLS_ERR_SSL_WANT_WRITE          -0x6880
+#define MBEDTLS_ERR_SSL_WANT_READ           -0x6900
+
+#define MBEDTLS_SSL_IS_CLIENT               0
+#define MBEDTLS_SSL_IS_SERVER               1
+#define MBEDTLS_SSL_TRANSPORT_STREAM        0
+#define MBEDTLS_SSL_PRESET_DEFAULT          0
+#define MBEDTLS_SSL_MAJOR_VERSION_3         3
+#define MBEDTLS_SSL_MINOR_VERSION_1         1
+#define MBEDTLS_SSL_MINOR_VERSION_2         2
+#define MBEDTLS_SSL_MINOR_VERSION_3         3
+#define MBEDTLS_SSL_VERIFY_NONE             0
+#define MBEDTLS_SSL_VERIFY_OPTIONAL         1
+#define MBEDTLS_SSL_VERIFY_REQUIRED         2
+
+/* IANA numbers, as mbedTLS uses them */
+#define MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA                0x2F
+#define MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA256             0x3C
+#define MBEDTLS_TLS_RSA_WITH_AES_128_GCM_SHA256             0x9C
+#define MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA          0xC013
+#define MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA256       0xC027
+#define MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256     0xC02B
+#define MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256       0xC02F
+#define MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384       0xC030
+
+typedef int mbedtls_ssl_send_t(void *ctx, const unsigned char *buf, size_t len);
+typedef int mbedtls_ssl_recv_t(void *ctx, unsigned char *buf, size_t len);
+
+typedef struct {
+    SSL_CTX     *ctx;
+    int         endpoint;
+    int         authmode;
+    int         (*f_rng)(void *, unsigned char *, size_t);
+    void        *p_rng;
+} mbedtls_ssl_config;
+
+typedef struct {
+    SSL_SESSION *session;
+} mbedtls_ssl_session;
+
+typedef struct {
+    SSL                         *ssl;
+    const mbedtls_ssl_config    *conf;
+    mbedtls_ssl_send_t          *f_send;
+    mbedtls_ssl_recv_t          *f_recv;
+    void                        *p_bio;
+} mbedtls_ssl_context;
+
+void mbedtls_ssl_config_init(mbedtls_ssl_config *conf);
+int mbedtls_ssl_config_defaults(mbedtls_ssl_config *conf, int endpoint, int transport, int preset);
+void mbedtls_ssl_config_free(mbedtls_ssl_config *conf);
+void mbedtls_ssl_conf_rng(mbedtls_ssl_config *conf, int (*f_rng)(void *, unsigned char *, size_t), void *p_rng);
+void mbedtls_ssl_conf_ciphersuites(mbedtls_ssl_config *conf, const int *ciphersuites);
+void mbedtls_ssl_conf_min_version(mbedtls_ssl_config *conf, int major, int minor);
+void mbedtls_ssl_conf_ca_chain(mbedtls_ssl_config *conf, mbedtls_x509_crt *ca_chain, void *ca_crl);
+void mbedtls_ssl_conf_authmode(mbedtls_ssl_config *conf, int authmode);
+
+void mbedtls_ssl_session_init(mbedtls_ssl_session *session);
+void mbedtls_ssl_session_free(mbedtls_ssl_session *session);
+
+void mbedtls_ssl_init(mbedtls_ssl_context *ssl);
+int mbedtls_ssl_setup(mbedtls_ssl_context *ssl, const mbedtls_ssl_config *conf);
+int mbedtls_ssl_set_hostname(mbedtls_ssl_context *ssl, const char *hostname);
+int mbedtls_ssl_set_session(mbedtls_ssl_context *ssl, const mbedtls_ssl_session *session);
+int mbedtls_ssl_get_session(const mbedtls_ssl_context *ssl, mbedtls_ssl_session *session);
+void mbedtls_ssl_set_bio(mbedtls_ssl_context *ssl, void *p_bio, mbedtls_ssl_send_t *f_send,
+                         mbedtls_ssl_recv_t *f_recv, void *f_recv_timeout);
+int mbedtls_ssl_handshake(mbedtls_ssl_context *ssl);
+int mbedtls_ssl_read(mbedtls_ssl_context *ssl, unsigned char *buf, size_t len);
+int mbedtls_ssl_write(mbedtls_ssl_context *ssl, const unsigned char *buf, size_t len);
+size_t mbedtls_ssl_get_bytes_avail(const mbedtls_ssl_context *ssl);
+int mbedtls_ssl_close_notify(mbedtls_ssl_context *ssl);
+void mbedtls_ssl_free(mbedtls_ssl_context *ssl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_MBEDTLS_SSL_H_ */
@@ -0,0 +1,35 @@
+/*
+ * mbedtls/x509_crt for the host build: a PEM chain parsed by OpenSSL
+ */
+
+#ifndef HOST_MBEDTLS_X509_CRT_H_
+#define HOST_MBEDTLS_X509_CRT_H_
+
+#include <stddef.h>
+#include <openssl/x509.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MBEDTLS_ERR_X509_INVALID_FORMAT     -0x2180
+#define MBEDTLS_ERR_X509_CERT_VERIFY_FAILED -0x2700
+
+typedef struct {
+    STACK_OF(X509)  *certs;
+} mbedtls_x509_crt;
+
+void mbedtls_x509_crt_init(mbedtls_x509_crt *crt);
+void mbedtls_x509_crt_free(mbedtls_x509_crt *crt);
+
+/**
+ * @brief  Add the certificates of a PEM buffer (buflen counts the NUL) or of
+ *         one DER certificate
+ */
+int mbedtls_x509_crt_parse(mbedtls_x509_crt *chain, const unsigned char *buf, size_t buflen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_MBEDTLS_X509_CRT_H_ */
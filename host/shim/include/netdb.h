@@ -0,0 +1,23 @@
+/*
+ * netdb.h for the host build
+ *
+ * lwIP's netdb.h brings in the socket, TCP option, inet and errno
+ * declarations the FTP client uses; the host splits them over several
+ * headers, so this pulls them in together, with lwIP's ip4_addr.
+ */
+
+#ifndef HOST_NETDB_H_
+#define HOST_NETDB_H_
+
+#include_next <netdb.h>
+#include <stdint.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+struct ip4_addr {
+    uint32_t addr;
+};
+
+#endif /* HOST_NETDB_H_ */
@@ -0,0 +1,43 @@
+/*
+ * ringbuf for the host build, ADF's byte ring buffer on a mutex and two
+ * condition variables
+ *
+ * rb_read() and rb_write() block until all of len is moved, the ring is
+ * marked done (read) or aborted, or ticks pass, and return what was moved
+ * when that is not 0, else the RB_* code.
+ */
+
+#ifndef HOST_RINGBUF_H_
+#define HOST_RINGBUF_H_
+
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RB_OK                               (ESP_OK)
+#define RB_FAIL                             (ESP_FAIL)
+#define RB_DONE                             (-2)
+#define RB_ABORT                            (-3)
+#define RB_TIMEOUT                          (-4)
+
+typedef struct ringbuf *ringbuf_handle_t;
+
+ringbuf_handle_t rb_create(int block_size, int n_blocks);
+esp_err_t rb_destroy(ringbuf_handle_t rb);
+esp_err_t rb_abort(ringbuf_handle_t rb);
+esp_err_t rb_reset(ringbuf_handle_t rb);
+int rb_bytes_available(ringbuf_handle_t rb);
+int rb_bytes_filled(ringbuf_handle_t rb);
+int rb_get_size(ringbuf_handle_t rb);
+int rb_read(ringbuf_handle_t rb, char *buf, int len, TickType_t ticks_to_wait);
+int rb_write(ringbuf_handle_t rb, char *buf, int len, TickType_t ticks_to_wait);
+esp_err_t rb_done_write(ringbuf_handle_t rb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_RINGBUF_H_ */
@@ -0,0 +1,42 @@
+/*
+ * wav_encoder for the host build, ADF's encoder passes PCM through unchanged
+ * (the writer makes the header), so this one does too
+ */
+
+#ifndef HOST_WAV_ENCODER_H_
+#define HOST_WAV_ENCODER_H_
+
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    int     out_rb_size;
+    int     task_stack;
+    int     task_core;
+    int     task_prio;
+    bool    stack_in_ext;
+} wav_encoder_cfg_t;
+
+#define WAV_ENCODER_TASK_STACK              (3 * 1024)
+#define WAV_ENCODER_TASK_CORE               (0)
+#define WAV_ENCODER_TASK_PRIO               (5)
+#define WAV_ENCODER_RINGBUFFER_SIZE         (8 * 1024)
+
+#define DEFAULT_WAV_ENCODER_CONFIG() {              \
+    .out_rb_size = WAV_ENCODER_RINGBUFFER_SIZE,     \
+    .task_stack = WAV_ENCODER_TASK_STACK,           \
+    .task_core = WAV_ENCODER_TASK_CORE,             \
+    .task_prio = WAV_ENCODER_TASK_PRIO,             \
+    .stack_in_ext = true,                           \
+}
+
+audio_element_handle_t wav_encoder_init(wav_encoder_cfg_t *config);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_WAV_ENCODER_H_ */
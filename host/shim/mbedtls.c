@@ -0,0 +1,359 @@
+/*
+ * mbedTLS client API for the host build, on OpenSSL's libssl
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include "esp_log.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/ssl.h"
+
+static const char *TAG = "HOST_TLS";
+
+static BIO_METHOD *s_bio_method;
+static pthread_once_t s_bio_once = PTHREAD_ONCE_INIT;
+
+/* ---- entropy, ctr_drbg ---- */
+
+void mbedtls_entropy_init(mbedtls_entropy_context *ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_entropy_free(mbedtls_entropy_context *ctx)
+{
+}
+
+int mbedtls_entropy_func(void *data, unsigned char *output, size_t len)
+{
+    return RAND_bytes(output, len) == 1 ? 0 : -1;
+}
+
+void mbedtls_ctr_drbg_init(mbedtls_ctr_drbg_context *ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_ctr_drbg_free(mbedtls_ctr_drbg_context *ctx)
+{
+    ctx->seeded = 0;
+}
+
+int mbedtls_ctr_drbg_seed(mbedtls_ctr_drbg_context *ctx, int (*f_entropy)(void *, unsigned char *, size_t),
+                          void *p_entropy, const unsigned char *custom, size_t len)
+{
+    ctx->seeded = 1;
+    return 0;
+}
+
+int mbedtls_ctr_drbg_random(void *p_rng, unsigned char *output, size_t output_len)
+{
+    return RAND_bytes(output, output_len) == 1 ? 0 : -1;
+}
+
+/* ---- x509_crt ---- */
+
+void mbedtls_x509_crt_init(mbedtls_x509_crt *crt)
+{
+    crt->certs = NULL;
+}
+
+void mbedtls_x509_crt_free(mbedtls_x509_crt *crt)
+{
+    sk_X509_pop_free(crt->certs, X509_free);
+    crt->certs = NULL;
+}
+
+int mbedtls_x509_crt_parse(mbedtls_x509_crt *chain, const unsigned char *buf, size_t buflen)
+{
+    if (chain->certs == NULL && (chain->certs = sk_X509_new_null()) == NULL) {
+        return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+    }
+    int added = 0;
+    if (buflen > 0 && buf[buflen - 1] == '\0' && strstr((const char *)buf, "-----BEGIN CERTIFICATE-----")) {
+        BIO *mem = BIO_new_mem_buf(buf, buflen - 1);
+        X509 *crt;
+        while ((crt = PEM_read_bio_X509(mem, NULL, NULL, NULL)) != NULL) {
+            sk_X509_push(chain->certs, crt);
+            added++;
+        }
+        BIO_free(mem);
+    } else {
+        const unsigned char *p = buf;
+        X509 *crt = d2i_X509(NULL, &p, buflen);
+        if (crt) {
+            sk_X509_push(chain->certs, crt);
+            added++;
+        }
+    }
+    /* The PEM loop ends on an error */
+    ERR_clear_error();
+    return added ? 0 : MBEDTLS_ERR_X509_INVALID_FORMAT;
+}
+
+/* ---- ssl config ---- */
+
+void mbedtls_ssl_config_init(mbedtls_ssl_config *conf)
+{
+    memset(conf, 0, sizeof(*conf));
+}
+
+int mbedtls_ssl_config_defaults(mbedtls_ssl_config *conf, int endpoint, int transport, int preset)
+{
+    if (transport != MBEDTLS_SSL_TRANSPORT_STREAM) {
+        return MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE;
+    }
+    SSL_CTX_free(conf->ctx);
+    conf->ctx = SSL_CTX_new(endpoint == MBEDTLS_SSL_IS_CLIENT ? TLS_client_method() : TLS_server_method());
+    if (conf->ctx == NULL) {
+        return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+    }
+    conf->endpoint = endpoint;
+    /* mbedTLS 2.x has no TLS 1.3 */
+    SSL_CTX_set_max_proto_version(conf->ctx, TLS1_2_VERSION);
+    mbedtls_ssl_conf_authmode(conf, endpoint == MBEDTLS_SSL_IS_CLIENT ? MBEDTLS_SSL_VERIFY_REQUIRED
+                              : MBEDTLS_SSL_VERIFY_NONE);
+    return 0;
+}
+
+void mbedtls_ssl_config_free(mbedtls_ssl_config *conf)
+{
+    SSL_CTX_free(conf->ctx);
+    memset(conf, 0, sizeof(*conf));
+}
+
+void mbedtls_ssl_conf_rng(mbedtls_ssl_config *conf, int (*f_rng)(void *, unsigned char *, size_t), void *p_rng)
+{
+    conf->f_rng = f_rng;
+    conf->p_rng = p_rng;
+}
+
+/* IANA numbers to OpenSSL's names, those OpenSSL does not know are left out */
+void mbedtls_ssl_conf_ciphersuites(mbedtls_ssl_config *conf, const int *ciphersuites)
+{
+    char list[1024] = "";
+    SSL *ssl = SSL_new(conf->ctx);
+    for (int i = 0; ssl && ciphersuites[i]; i++) {
+        const unsigned char id[2] = { ciphersuites[i] >> 8, ciphersuites[i] & 0xff };
+        const SSL_CIPHER *c = SSL_CIPHER_find(ssl, id);
+        if (c && strlen(list) + strlen(SSL_CIPHER_get_name(c)) + 2 < sizeof(list)) {
+            if (list[0]) {
+                strcat(list, ":");
+            }
+            strcat(list, SSL_CIPHER_get_name(c));
+        }
+    }
+    SSL_free(ssl);
+    if (list[0] == '\0' || SSL_CTX_set_cipher_list(conf->ctx, list) != 1) {
+        ESP_LOGE(TAG, "No usable cipher suite in the list");
+        ERR_clear_error();
+    }
+}
+
+void mbedtls_ssl_conf_min_version(mbedtls_ssl_config *conf, int major, int minor)
+{
+    SSL_CTX_set_min_proto_version(conf->ctx, (major << 8) | minor);
+}
+
+void mbedtls_ssl_conf_ca_chain(mbedtls_ssl_config *conf, mbedtls_x509_crt *ca_chain, void *ca_crl)
+{
+    X509_STORE *store = SSL_CTX_get_cert_store(conf->ctx);
+    for (int i = 0; ca_chain->certs && i < sk_X509_num(ca_chain->certs); i++) {
+        X509_STORE_add_cert(store, sk_X509_value(ca_chain->certs, i));
+    }
+}
+
+/* OPTIONAL goes on after a failed verification like NONE */
+void mbedtls_ssl_conf_authmode(mbedtls_ssl_config *conf, int authmode)
+{
+    conf->authmode = authmode;
+    SSL_CTX_set_verify(conf->ctx, authmode == MBEDTLS_SSL_VERIFY_REQUIRED ? SSL_VERIFY_PEER : SSL_VERIFY_NONE, NULL);
+}
+
+/* ---- session ---- */
+
+void mbedtls_ssl_session_init(mbedtls_ssl_session *session)
+{
+    session->session = NULL;
+}
+
+void mbedtls_ssl_session_free(mbedtls_ssl_session *session)
+{
+    SSL_SESSION_free(session->session);
+    session->session = NULL;
+}
+
+/* ---- ssl context ---- */
+
+/* The transport of a context: its send/recv callbacks as an OpenSSL BIO */
+static int _bio_write(BIO *bio, const char *buf, int len)
+{
+    mbedtls_ssl_context *ssl = BIO_get_data(bio);
+    BIO_clear_retry_flags(bio);
+    int rv = ssl->f_send(ssl->p_bio, (const unsigned char *)buf, len);
+    if (rv == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        BIO_set_retry_write(bio);
+    }
+    return rv < 0 ? -1 : rv;
+}
+
+static int _bio_read(BIO *bio, char *buf, int len)
+{
+    mbedtls_ssl_context *ssl = BIO_get_data(bio);
+    BIO_clear_retry_flags(bio);
+    int rv = ssl->f_recv(ssl->p_bio, (unsigned char *)buf, len);
+    if (rv == MBEDTLS_ERR_SSL_WANT_READ) {
+        BIO_set_retry_read(bio);
+    }
+    return rv < 0 ? -1 : rv;
+}
+
+static long _bio_ctrl(BIO *bio, int cmd, long num, void *ptr)
+{
+    return cmd == BIO_CTRL_FLUSH ? 1 : 0;
+}
+
+static void _bio_method_init(void)
+{
+    s_bio_method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "mbedtls bio");
+    BIO_meth_set_write(s_bio_method, _bio_write);
+    BIO_meth_set_read(s_bio_method, _bio_read);
+    BIO_meth_set_ctrl(s_bio_method, _bio_ctrl);
+}
+
+/* OpenSSL's result of an SSL call to an mbedTLS error code */
+static int _error(mbedtls_ssl_context *ssl, int rv, const char *what)
+{
+    int err = SSL_get_error(ssl->ssl, rv);
+    unsigned long reason = ERR_peek_error();
+    int ret;
+    if (err == SSL_ERROR_WANT_READ) {
+        ret = MBEDTLS_ERR_SSL_WANT_READ;
+    } else if (err == SSL_ERROR_WANT_WRITE) {
+        ret = MBEDTLS_ERR_SSL_WANT_WRITE;
+    } else if (err == SSL_ERROR_ZERO_RETURN) {
+        ret = MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY;
+    } else if (SSL_get_verify_result(ssl->ssl) != X509_V_OK && !SSL_is_init_finished(ssl->ssl)) {
+        ESP_LOGW(TAG, "%s: %s", what, X509_verify_cert_error_string(SSL_get_verify_result(ssl->ssl)));
+        ret = MBEDTLS_ERR_X509_CERT_VERIFY_FAILED;
+    } else if (err == SSL_ERROR_SYSCALL || ERR_GET_REASON(reason) == SSL_R_UNEXPECTED_EOF_WHILE_READING) {
+        ret = MBEDTLS_ERR_SSL_CONN_EOF;
+    } else {
+        ESP_LOGW(TAG, "%s: %s", what, reason ? ERR_reason_error_string(reason) : "failed");
+        ret = MBEDTLS_ERR_SSL_FATAL_ALERT_MESSAGE;
+    }
+    ERR_clear_error();
+    return ret;
+}
+
+void mbedtls_ssl_init(mbedtls_ssl_context *ssl)
+{
+    memset(ssl, 0, sizeof(*ssl));
+}
+
+int mbedtls_ssl_setup(mbedtls_ssl_context *ssl, const mbedtls_ssl_config *conf)
+{
+    pthread_once(&s_bio_once, _bio_method_init);
+    ssl->conf = conf;
+    ssl->ssl = SSL_new(conf->ctx);
+    if (ssl->ssl == NULL) {
+        return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+    }
+    BIO *bio = BIO_new(s_bio_method);
+    if (bio == NULL) {
+        return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+    }
+    BIO_set_data(bio, ssl);
+    BIO_set_init(bio, 1);
+    SSL_set_bio(ssl->ssl, bio, bio);
+    if (conf->endpoint == MBEDTLS_SSL_IS_CLIENT) {
+        SSL_set_connect_state(ssl->ssl);
+    } else {
+        SSL_set_accept_state(ssl->ssl);
+    }
+    return 0;
+}
+
+/* SNI for a name, and the name or address the certificate has to carry */
+int mbedtls_ssl_set_hostname(mbedtls_ssl_context *ssl, const char *hostname)
+{
+    X509_VERIFY_PARAM *param = SSL_get0_param(ssl->ssl);
+    struct in_addr addr;
+    if (hostname == NULL) {
+        return 0;
+    }
+    if (inet_pton(AF_INET, hostname, &addr) == 1) {
+        return X509_VERIFY_PARAM_set1_ip_asc(param, hostname) == 1 ? 0 : MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+    }
+    if (SSL_set_tlsext_host_name(ssl->ssl, hostname) != 1 || X509_VERIFY_PARAM_set1_host(param, hostname, 0) != 1) {
+        return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+    }
+    return 0;
+}
+
+int mbedtls_ssl_set_session(mbedtls_ssl_context *ssl, const mbedtls_ssl_session *session)
+{
+    return session->session && SSL_set_session(ssl->ssl, session->session) == 1 ? 0 : MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+}
+
+int mbedtls_ssl_get_session(const mbedtls_ssl_context *ssl, mbedtls_ssl_session *session)
+{
+    SSL_SESSION_free(session->session);
+    session->session = SSL_get1_session(ssl->ssl);
+    return session->session ? 0 : MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+}
+
+void mbedtls_ssl_set_bio(mbedtls_ssl_context *ssl, void *p_bio, mbedtls_ssl_send_t *f_send,
+                         mbedtls_ssl_recv_t *f_recv, void *f_recv_timeout)
+{
+    ssl->p_bio = p_bio;
+    ssl->f_send = f_send;
+    ssl->f_recv = f_recv;
+}
+
+int mbedtls_ssl_handshake(mbedtls_ssl_context *ssl)
+{
+    ERR_clear_error();
+    int rv = SSL_do_handshake(ssl->ssl);
+    return rv == 1 ? 0 : _error(ssl, rv, "handshake");
+}
+
+int mbedtls_ssl_read(mbedtls_ssl_context *ssl, unsigned char *buf, size_t len)
+{
+    ERR_clear_error();
+    int rv = SSL_read(ssl->ssl, buf, len);
+    return rv > 0 ? rv : _error(ssl, rv, "read");
+}
+
+int mbedtls_ssl_write(mbedtls_ssl_context *ssl, const unsigned char *buf, size_t len)
+{
+    ERR_clear_error();
+    int rv = SSL_write(ssl->ssl, buf, len);
+    return rv > 0 ? rv : _error(ssl, rv, "write");
+}
+
+size_t mbedtls_ssl_get_bytes_avail(const mbedtls_ssl_context *ssl)
+{
+    return SSL_pending(ssl->ssl);
+}
+
+int mbedtls_ssl_close_notify(mbedtls_ssl_context *ssl)
+{
+    ERR_clear_error();
+    /* Sends the alert, does not wait for the peer's */
+    int rv = SSL_shutdown(ssl->ssl);
+    ERR_clear_error();
+    return rv < 0 ? MBEDTLS_ERR_SSL_INTERNAL_ERROR : 0;
+}
+
+void mbedtls_ssl_free(mbedtls_ssl_context *ssl)
+{
+    SSL_free(ssl->ssl);
+    memset(ssl, 0, sizeof(*ssl));
+}
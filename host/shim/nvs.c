@@ -0,0 +1,225 @@
+/*
+ * NVS for the host build
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include "nvs.h"
+
+#define HOST_NVS_ENTRIES                    64
+#define HOST_NVS_HANDLES                    8
+#define HOST_NVS_NAME_MAX                   16      /* Namespace and key, with the NUL */
+#define HOST_NVS_BLOB_MAX                   256
+
+typedef enum {
+    NVS_TYPE_U8 = 1,
+    NVS_TYPE_U32,
+    NVS_TYPE_BLOB,
+} nvs_type_t;
+
+typedef struct {
+    char        ns[HOST_NVS_NAME_MAX];
+    char        key[HOST_NVS_NAME_MAX];
+    nvs_type_t  type;
+    size_t      len;
+    uint8_t     value[HOST_NVS_BLOB_MAX];
+} nvs_entry_t;
+
+typedef struct {
+    char            ns[HOST_NVS_NAME_MAX];
+    nvs_open_mode_t mode;
+    bool            open;
+} nvs_open_t;
+
+static struct {
+    pthread_mutex_t lock;
+    nvs_entry_t     entry[HOST_NVS_ENTRIES];
+    nvs_open_t      handle[HOST_NVS_HANDLES];
+} s_nvs = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Handles are index + 1, 0 is never valid */
+static nvs_open_t *_handle(nvs_handle_t h)
+{
+    if (h == 0 || h > HOST_NVS_HANDLES || !s_nvs.handle[h - 1].open) {
+        return NULL;
+    }
+    return &s_nvs.handle[h - 1];
+}
+
+static nvs_entry_t *_find(const char *ns, const char *key)
+{
+    for (int i = 0; i < HOST_NVS_ENTRIES; i++) {
+        nvs_entry_t *e = &s_nvs.entry[i];
+        if (e->type && strcmp(e->ns, ns) == 0 && (key == NULL || strcmp(e->key, key) == 0)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static esp_err_t _set(nvs_handle_t h, const char *key, nvs_type_t type, const void *value, size_t len)
+{
+    if (strlen(key) >= HOST_NVS_NAME_MAX) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    if (len > HOST_NVS_BLOB_MAX) {
+        return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    }
+    pthread_mutex_lock(&s_nvs.lock);
+    esp_err_t ret = ESP_OK;
+    nvs_open_t *o = _handle(h);
+    nvs_entry_t *e = o ? _find(o->ns, key) : NULL;
+    if (o == NULL) {
+        ret = ESP_ERR_NVS_INVALID_HANDLE;
+    } else if (o->mode == NVS_READONLY) {
+        ret = ESP_ERR_NVS_READ_ONLY;
+    } else if (e == NULL) {
+        for (int i = 0; i < HOST_NVS_ENTRIES && e == NULL; i++) {
+            if (!s_nvs.entry[i].type) {
+                e = &s_nvs.entry[i];
+            }
+        }
+        if (e == NULL) {
+            ret = ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+        }
+    }
+    if (ret == ESP_OK) {
+        strcpy(e->ns, o->ns);
+        strcpy(e->key, key);
+        e->type = type;
+        e->len = len;
+        memcpy(e->value, value, len);
+    }
+    pthread_mutex_unlock(&s_nvs.lock);
+    return ret;
+}
+
+/* Blobs give their length in *len and take the buffer size from it */
+static esp_err_t _get(nvs_handle_t h, const char *key, nvs_type_t type, void *value, size_t *len)
+{
+    pthread_mutex_lock(&s_nvs.lock);
+    esp_err_t ret = ESP_OK;
+    nvs_open_t *o = _handle(h);
+    nvs_entry_t *e = o ? _find(o->ns, key) : NULL;
+    if (o == NULL) {
+        ret = ESP_ERR_NVS_INVALID_HANDLE;
+    } else if (e == NULL) {
+        ret = ESP_ERR_NVS_NOT_FOUND;
+    } else if (e->type != type) {
+        ret = ESP_ERR_NVS_TYPE_MISMATCH;
+    } else if (value != NULL && *len < e->len) {
+        ret = ESP_ERR_NVS_INVALID_LENGTH;
+    } else {
+        if (value != NULL) {
+            memcpy(value, e->value, e->len);
+        }
+        *len = e->len;
+    }
+    pthread_mutex_unlock(&s_nvs.lock);
+    return ret;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    if (strlen(name) >= HOST_NVS_NAME_MAX) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    pthread_mutex_lock(&s_nvs.lock);
+    esp_err_t ret = ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    /* A namespace nothing was written to does not exist for a read-only open */
+    if (open_mode == NVS_READONLY && _find(name, NULL) == NULL) {
+        ret = ESP_ERR_NVS_NOT_FOUND;
+    } else {
+        for (int i = 0; i < HOST_NVS_HANDLES; i++) {
+            if (!s_nvs.handle[i].open) {
+                strcpy(s_nvs.handle[i].ns, name);
+                s_nvs.handle[i].mode = open_mode;
+                s_nvs.handle[i].open = true;
+                *out_handle = i + 1;
+                ret = ESP_OK;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&s_nvs.lock);
+    return ret;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+    pthread_mutex_lock(&s_nvs.lock);
+    nvs_open_t *o = _handle(handle);
+    if (o) {
+        o->open = false;
+    }
+    pthread_mutex_unlock(&s_nvs.lock);
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    pthread_mutex_lock(&s_nvs.lock);
+    esp_err_t ret = _handle(handle) ? ESP_OK : ESP_ERR_NVS_INVALID_HANDLE;
+    pthread_mutex_unlock(&s_nvs.lock);
+    return ret;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    pthread_mutex_lock(&s_nvs.lock);
+    esp_err_t ret = ESP_OK;
+    nvs_open_t *o = _handle(handle);
+    nvs_entry_t *e = o ? _find(o->ns, key) : NULL;
+    if (o == NULL) {
+        ret = ESP_ERR_NVS_INVALID_HANDLE;
+    } else if (o->mode == NVS_READONLY) {
+        ret = ESP_ERR_NVS_READ_ONLY;
+    } else if (e == NULL) {
+        ret = ESP_ERR_NVS_NOT_FOUND;
+    } else {
+        e->type = 0;
+    }
+    pthread_mutex_unlock(&s_nvs.lock);
+    return ret;
+}
+
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char *key, uint8_t value)
+{
+    return _set(handle, key, NVS_TYPE_U8, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char *key, uint8_t *out_value)
+{
+    size_t len = sizeof(*out_value);
+    return _get(handle, key, NVS_TYPE_U8, out_value, &len);
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value)
+{
+    return _set(handle, key, NVS_TYPE_U32, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *out_value)
+{
+    size_t len = sizeof(*out_value);
+    return _get(handle, key, NVS_TYPE_U32, out_value, &len);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    return _set(handle, key, NVS_TYPE_BLOB, value, length);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    return _get(handle, key, NVS_TYPE_BLOB, out_value, length);
+}
+
+void host_nvs_erase_all(void)
+{
+    pthread_mutex_lock(&s_nvs.lock);
+    memset(s_nvs.entry, 0, sizeof(s_nvs.entry));
+    pthread_mutex_unlock(&s_nvs.lock);
+}
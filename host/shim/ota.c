@@ -0,0 +1,274 @@
+/*
+ * esp_ota_ops for the host build: the OTA slots of partitions.csv in a file
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+
+static const char *TAG = "HOST_OTA";
+
+#define HOST_OTA_SLOTS                      2
+#define HOST_OTA_FLASH_SIZE                 0x610000
+#define HOST_OTA_ERASE_SIZE                 4096
+
+typedef struct {
+    bool        open;
+    int         slot;
+    size_t      erased;
+    size_t      written;
+} ota_write_t;
+
+static const esp_partition_t s_part[HOST_OTA_SLOTS] = {
+    { .address = 0x10000, .size = 0x300000, .label = "ota_0" },
+    { .address = 0x310000, .size = 0x300000, .label = "ota_1" },
+};
+
+static struct {
+    pthread_mutex_t         lock;
+    FILE                    *flash;
+    int                     running;
+    int                     boot;               /* Slot otadata selects */
+    esp_ota_img_states_t    state[HOST_OTA_SLOTS];
+    ota_write_t             write[4];
+} s_ota = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int _slot(const esp_partition_t *p)
+{
+    for (int i = 0; i < HOST_OTA_SLOTS; i++) {
+        if (p == &s_part[i] || (p && p->address == s_part[i].address)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static ota_write_t *_write(esp_ota_handle_t h)
+{
+    if (h == 0 || h > sizeof(s_ota.write) / sizeof(s_ota.write[0]) || !s_ota.write[h - 1].open) {
+        return NULL;
+    }
+    return &s_ota.write[h - 1];
+}
+
+static bool _fill(uint32_t address, int c, size_t len)
+{
+    uint8_t buf[HOST_OTA_ERASE_SIZE];
+    memset(buf, c, sizeof(buf));
+    if (fseek(s_ota.flash, address, SEEK_SET) != 0) {
+        return false;
+    }
+    while (len > 0) {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (fwrite(buf, 1, n, s_ota.flash) != n) {
+            return false;
+        }
+        len -= n;
+    }
+    return true;
+}
+
+esp_err_t host_ota_flash_open(const char *path)
+{
+    host_ota_flash_close();
+    s_ota.flash = fopen(path, "w+b");
+    if (s_ota.flash == NULL || !_fill(0, 0xff, HOST_OTA_FLASH_SIZE)) {
+        ESP_LOGE(TAG, "Cannot create %s", path);
+        return ESP_FAIL;
+    }
+    /* Factory flashed ota_0 with a good image */
+    uint8_t magic = HOST_OTA_IMAGE_MAGIC;
+    fseek(s_ota.flash, s_part[0].address, SEEK_SET);
+    fwrite(&magic, 1, 1, s_ota.flash);
+    s_ota.running = 0;
+    s_ota.boot = 0;
+    s_ota.state[0] = ESP_OTA_IMG_VALID;
+    s_ota.state[1] = ESP_OTA_IMG_UNDEFINED;
+    memset(s_ota.write, 0, sizeof(s_ota.write));
+    return ESP_OK;
+}
+
+void host_ota_flash_close(void)
+{
+    if (s_ota.flash) {
+        fclose(s_ota.flash);
+        s_ota.flash = NULL;
+    }
+}
+
+void host_ota_restart(void)
+{
+    pthread_mutex_lock(&s_ota.lock);
+    memset(s_ota.write, 0, sizeof(s_ota.write));
+    int slot = s_ota.boot;
+    if (s_ota.state[slot] == ESP_OTA_IMG_PENDING_VERIFY) {
+        /* Booted once and never confirmed: roll back */
+        ESP_LOGW(TAG, "%s was not confirmed, rolling back", s_part[slot].label);
+        s_ota.state[slot] = ESP_OTA_IMG_ABORTED;
+        slot = s_ota.boot = !slot;
+    } else if (s_ota.state[slot] == ESP_OTA_IMG_NEW) {
+        s_ota.state[slot] = ESP_OTA_IMG_PENDING_VERIFY;
+    }
+    s_ota.running = slot;
+    pthread_mutex_unlock(&s_ota.lock);
+}
+
+int host_ota_open_handles(void)
+{
+    int n = 0;
+    for (size_t i = 0; i < sizeof(s_ota.write) / sizeof(s_ota.write[0]); i++) {
+        n += s_ota.write[i].open;
+    }
+    return n;
+}
+
+const esp_partition_t *esp_ota_get_running_partition(void)
+{
+    return &s_part[s_ota.running];
+}
+
+const esp_partition_t *esp_ota_get_boot_partition(void)
+{
+    return &s_part[s_ota.boot];
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from)
+{
+    int slot = _slot(start_from ? start_from : &s_part[s_ota.running]);
+    return slot < 0 ? NULL : &s_part[!slot];
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t image_size, esp_ota_handle_t *out_handle)
+{
+    int slot = _slot(partition);
+    if (slot < 0 || s_ota.flash == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (slot == s_ota.running) {
+        return ESP_ERR_OTA_PARTITION_CONFLICT;
+    }
+    if (image_size != OTA_SIZE_UNKNOWN && image_size > partition->size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    pthread_mutex_lock(&s_ota.lock);
+    esp_err_t ret = ESP_ERR_NO_MEM;
+    for (size_t i = 0; i < sizeof(s_ota.write) / sizeof(s_ota.write[0]); i++) {
+        if (!s_ota.write[i].open) {
+            size_t erase = image_size == OTA_SIZE_UNKNOWN ? partition->size
+                           : (image_size + HOST_OTA_ERASE_SIZE - 1) / HOST_OTA_ERASE_SIZE * HOST_OTA_ERASE_SIZE;
+            if (!_fill(partition->address, 0xff, erase)) {
+                ret = ESP_FAIL;
+                break;
+            }
+            s_ota.write[i] = (ota_write_t) {
+                .open = true,
+                .slot = slot,
+                .erased = erase,
+            };
+            /* Erased slot: no image, state cleared in otadata */
+            s_ota.state[slot] = ESP_OTA_IMG_UNDEFINED;
+            *out_handle = i + 1;
+            ret = ESP_OK;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s_ota.lock);
+    return ret;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data, size_t size)
+{
+    pthread_mutex_lock(&s_ota.lock);
+    esp_err_t ret = ESP_OK;
+    ota_write_t *w = _write(handle);
+    if (w == NULL) {
+        ret = ESP_ERR_INVALID_ARG;
+    } else if (w->written == 0 && size > 0 && ((const uint8_t *)data)[0] != HOST_OTA_IMAGE_MAGIC) {
+        ESP_LOGE(TAG, "OTA image has invalid magic byte (expected 0xE9, saw 0x%02x)", ((const uint8_t *)data)[0]);
+        ret = ESP_ERR_OTA_VALIDATE_FAILED;
+    } else if (w->written + size > s_part[w->slot].size) {
+        ret = ESP_ERR_INVALID_SIZE;
+    } else {
+        /* Past the erased part the sectors are erased as they are reached */
+        if (w->written + size > w->erased) {
+            size_t end = (w->written + size + HOST_OTA_ERASE_SIZE - 1) / HOST_OTA_ERASE_SIZE * HOST_OTA_ERASE_SIZE;
+            _fill(s_part[w->slot].address + w->erased, 0xff, end - w->erased);
+            w->erased = end;
+        }
+        if (fseek(s_ota.flash, s_part[w->slot].address + w->written, SEEK_SET) != 0
+            || fwrite(data, 1, size, s_ota.flash) != size) {
+            ret = ESP_FAIL;
+        } else {
+            w->written += size;
+        }
+    }
+    pthread_mutex_unlock(&s_ota.lock);
+    return ret;
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle)
+{
+    pthread_mutex_lock(&s_ota.lock);
+    ota_write_t *w = _write(handle);
+    esp_err_t ret = w == NULL ? ESP_ERR_NOT_FOUND : w->written == 0 ? ESP_ERR_OTA_VALIDATE_FAILED : ESP_OK;
+    if (w) {
+        fflush(s_ota.flash);
+        w->open = false;
+    }
+    pthread_mutex_unlock(&s_ota.lock);
+    return ret;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle)
+{
+    pthread_mutex_lock(&s_ota.lock);
+    ota_write_t *w = _write(handle);
+    if (w) {
+        w->open = false;
+    }
+    pthread_mutex_unlock(&s_ota.lock);
+    return w ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition)
+{
+    int slot = _slot(partition);
+    if (slot < 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    uint8_t magic = 0;
+    fseek(s_ota.flash, partition->address, SEEK_SET);
+    if (fread(&magic, 1, 1, s_ota.flash) != 1 || magic != HOST_OTA_IMAGE_MAGIC) {
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+    pthread_mutex_lock(&s_ota.lock);
+    s_ota.boot = slot;
+    if (slot != s_ota.running) {
+        s_ota.state[slot] = ESP_OTA_IMG_NEW;
+    }
+    pthread_mutex_unlock(&s_ota.lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_get_state_partition(const esp_partition_t *partition, esp_ota_img_states_t *ota_state)
+{
+    int slot = _slot(partition);
+    if (slot < 0 || s_ota.state[slot] == ESP_OTA_IMG_UNDEFINED) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    *ota_state = s_ota.state[slot];
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_valid_cancel_rollback(void)
+{
+    pthread_mutex_lock(&s_ota.lock);
+    s_ota.state[s_ota.running] = ESP_OTA_IMG_VALID;
+    s_ota.boot = s_ota.running;
+    pthread_mutex_unlock(&s_ota.lock);
+    return ESP_OK;
+}
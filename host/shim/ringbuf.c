@@ -0,0 +1,222 @@
+/*
+ * ringbuf for the host build
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "audio_mem.h"
+#include "ringbuf.h"
+
+struct ringbuf {
+    pthread_mutex_t     lock;
+    pthread_cond_t      can_read;
+    pthread_cond_t      can_write;
+    char                *buf;
+    int                 size;
+    int                 head;               /* Next byte to read */
+    int                 fill;
+    bool                done;               /* Writer finished, reads drain what is left */
+    bool                abort;
+};
+
+ringbuf_handle_t rb_create(int block_size, int n_blocks)
+{
+    if (block_size <= 0 || n_blocks <= 0) {
+        return NULL;
+    }
+    struct ringbuf *rb = audio_calloc(1, sizeof(*rb));
+    if (rb == NULL) {
+        return NULL;
+    }
+    rb->size = block_size * n_blocks;
+    rb->buf = audio_malloc(rb->size);
+    if (rb->buf == NULL) {
+        audio_free(rb);
+        return NULL;
+    }
+    pthread_mutex_init(&rb->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&rb->can_read, &attr);
+    pthread_cond_init(&rb->can_write, &attr);
+    pthread_condattr_destroy(&attr);
+    return rb;
+}
+
+esp_err_t rb_destroy(ringbuf_handle_t rb)
+{
+    if (rb == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_destroy(&rb->lock);
+    pthread_cond_destroy(&rb->can_read);
+    pthread_cond_destroy(&rb->can_write);
+    audio_free(rb->buf);
+    audio_free(rb);
+    return ESP_OK;
+}
+
+esp_err_t rb_abort(ringbuf_handle_t rb)
+{
+    pthread_mutex_lock(&rb->lock);
+    rb->abort = true;
+    pthread_cond_broadcast(&rb->can_read);
+    pthread_cond_broadcast(&rb->can_write);
+    pthread_mutex_unlock(&rb->lock);
+    return ESP_OK;
+}
+
+esp_err_t rb_reset(ringbuf_handle_t rb)
+{
+    pthread_mutex_lock(&rb->lock);
+    rb->head = 0;
+    rb->fill = 0;
+    rb->done = false;
+    rb->abort = false;
+    pthread_cond_broadcast(&rb->can_write);
+    pthread_mutex_unlock(&rb->lock);
+    return ESP_OK;
+}
+
+esp_err_t rb_done_write(ringbuf_handle_t rb)
+{
+    pthread_mutex_lock(&rb->lock);
+    rb->done = true;
+    pthread_cond_broadcast(&rb->can_read);
+    pthread_cond_broadcast(&rb->can_write);
+    pthread_mutex_unlock(&rb->lock);
+    return ESP_OK;
+}
+
+int rb_bytes_filled(ringbuf_handle_t rb)
+{
+    pthread_mutex_lock(&rb->lock);
+    int fill = rb->fill;
+    pthread_mutex_unlock(&rb->lock);
+    return fill;
+}
+
+int rb_bytes_available(ringbuf_handle_t rb)
+{
+    pthread_mutex_lock(&rb->lock);
+    int avail = rb->size - rb->fill;
+    pthread_mutex_unlock(&rb->lock);
+    return avail;
+}
+
+int rb_get_size(ringbuf_handle_t rb)
+{
+    return rb->size;
+}
+
+/* Wait on cond for up to ticks, false on timeout */
+static bool _wait(ringbuf_handle_t rb, pthread_cond_t *cond, TickType_t ticks, const struct timespec *deadline)
+{
+    if (ticks == 0) {
+        return false;
+    }
+    if (ticks == portMAX_DELAY) {
+        pthread_cond_wait(cond, &rb->lock);
+        return true;
+    }
+    return pthread_cond_timedwait(cond, &rb->lock, deadline) != ETIMEDOUT;
+}
+
+static void _deadline(TickType_t ticks, struct timespec *ts)
+{
+    uint64_t ms = (uint64_t)ticks * portTICK_PERIOD_MS;
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+int rb_read(ringbuf_handle_t rb, char *buf, int len, TickType_t ticks_to_wait)
+{
+    struct timespec deadline;
+    if (ticks_to_wait != portMAX_DELAY) {
+        _deadline(ticks_to_wait, &deadline);
+    }
+    int total = 0;
+    int ret = RB_OK;
+    pthread_mutex_lock(&rb->lock);
+    while (total < len) {
+        if (rb->abort) {
+            ret = RB_ABORT;
+            break;
+        }
+        if (rb->fill == 0) {
+            if (rb->done) {
+                ret = RB_DONE;
+                break;
+            }
+            if (!_wait(rb, &rb->can_read, ticks_to_wait, &deadline) && rb->fill == 0) {
+                ret = RB_TIMEOUT;
+                break;
+            }
+            continue;
+        }
+        int n = len - total;
+        if (n > rb->fill) {
+            n = rb->fill;
+        }
+        if (n > rb->size - rb->head) {
+            n = rb->size - rb->head;
+        }
+        memcpy(buf + total, rb->buf + rb->head, n);
+        rb->head = (rb->head + n) % rb->size;
+        rb->fill -= n;
+        total += n;
+        pthread_cond_broadcast(&rb->can_write);
+    }
+    pthread_mutex_unlock(&rb->lock);
+    return total > 0 ? total : ret;
+}
+
+int rb_write(ringbuf_handle_t rb, char *buf, int len, TickType_t ticks_to_wait)
+{
+    struct timespec deadline;
+    if (ticks_to_wait != portMAX_DELAY) {
+        _deadline(ticks_to_wait, &deadline);
+    }
+    int total = 0;
+    int ret = RB_OK;
+    pthread_mutex_lock(&rb->lock);
+    while (total < len) {
+        if (rb->abort) {
+            ret = RB_ABORT;
+            break;
+        }
+        if (rb->done) {
+            ret = RB_DONE;
+            break;
+        }
+        if (rb->fill == rb->size) {
+            if (!_wait(rb, &rb->can_write, ticks_to_wait, &deadline) && rb->fill == rb->size) {
+                ret = RB_TIMEOUT;
+                break;
+            }
+            continue;
+        }
+        int tail = (rb->head + rb->fill) % rb->size;
+        int n = len - total;
+        if (n > rb->size - rb->fill) {
+            n = rb->size - rb->fill;
+        }
+        if (n > rb->size - tail) {
+            n = rb->size - tail;
+        }
+        memcpy(rb->buf + tail, buf + total, n);
+        rb->fill += n;
+        total += n;
+        pthread_cond_broadcast(&rb->can_read);
+    }
+    pthread_mutex_unlock(&rb->lock);
+    return total > 0 ? total : ret;
+}
@@ -0,0 +1,81 @@
+/*
+ * ftp_reply_feed - a control connection that replays bytes, for the reply
+ * parser tests
+ *
+ * Include after FtpClient.c, the NetBuf is built by hand. The bytes are
+ * written into one end of a socketpair and that end is shut down, so the
+ * parser reads them as a server reply and then sees the connection close.
+ * Inputs larger than the socket buffer are written by a thread.
+ */
+
+#ifndef FTP_REPLY_FEED_H_
+#define FTP_REPLY_FEED_H_
+
+#include <pthread.h>
+#include <sys/socket.h>
+
+typedef struct {
+    NetBuf_t        *ctl;
+    int             peer;
+    const char      *data;
+    size_t          len;
+    pthread_t       writer;
+    bool            threaded;
+} ftp_reply_feed_t;
+
+static void *_feed_writer(void *arg)
+{
+    ftp_reply_feed_t *feed = arg;
+    size_t off = 0;
+    while (off < feed->len) {
+        ssize_t n = send(feed->peer, feed->data + off, feed->len - off, MSG_NOSIGNAL);
+        if (n <= 0) {
+            break;
+        }
+        off += n;
+    }
+    shutdown(feed->peer, SHUT_WR);
+    return NULL;
+}
+
+/* Control connection that reads data, then end of stream */
+static NetBuf_t *ftp_reply_feed_open(ftp_reply_feed_t *feed, const void *data, size_t len)
+{
+    int sv[2];
+    memset(feed, 0, sizeof(*feed));
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        return NULL;
+    }
+    NetBuf_t *ctl = calloc(1, sizeof(NetBuf_t));
+    ctl->buf = malloc(FTP_CLIENT_BUFFER_SIZE);
+    ctl->handle = sv[0];
+    ctl->dir = FTP_CLIENT_CONTROL;
+    ctl->cput = ctl->cget = ctl->buf;
+    ctl->cleft = FTP_CLIENT_BUFFER_SIZE;
+    feed->ctl = ctl;
+    feed->peer = sv[1];
+    feed->data = data;
+    feed->len = len;
+    /* Small inputs fit the socket buffer, no thread needed */
+    if (len <= 64 * 1024) {
+        _feed_writer(feed);
+    } else {
+        feed->threaded = pthread_create(&feed->writer, NULL, _feed_writer, feed) == 0;
+    }
+    return ctl;
+}
+
+static void ftp_reply_feed_close(ftp_reply_feed_t *feed)
+{
+    /* Unblocks a writer the parser stopped reading from */
+    shutdown(feed->ctl->handle, SHUT_RDWR);
+    if (feed->threaded) {
+        pthread_join(feed->writer, NULL);
+    }
+    close(feed->peer);
+    close(feed->ctl->handle);
+    free(feed->ctl->buf);
+    free(feed->ctl);
+}
+
+#endif /* FTP_REPLY_FEED_H_ */
@@ -0,0 +1,237 @@
+/*
+ * fuzz_ftp_reply - fuzz target for the FtpClient reply parser
+ *
+ * The input is replayed as the server side of a control connection and
+ * read with readResponse() until the connection ends, as a session would.
+ * Each reply is handed to replyCode() and parsePasv(), and the input is
+ * also used as a command argument for buildCommand(). Checked: the
+ * response stays terminated inside its buffer, the parser makes progress,
+ * a built command never holds CR or LF and leaves room for the CRLF.
+ *
+ * Built with -fsanitize=fuzzer under clang (FTP_REPLY_LIBFUZZER). Otherwise
+ * a main() replays the files and directories given, or runs random and
+ * mutated inputs from the seeds and reports inputs per second:
+ *
+ *   ftp_reply_replay [--iterations N] [--seed S] [file|dir ...]
+ */
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include "FtpClient.c"
+#include "ftp_reply_feed.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    ftp_reply_feed_t feed;
+    NetBuf_t *ctl = ftp_reply_feed_open(&feed, data, size);
+    if (ctl == NULL) {
+        return 0;
+    }
+    size_t calls = 0;
+    do {
+        readResponse('2', ctl);
+        if (memchr(ctl->response, '\0', FTP_CLIENT_RESPONSE_BUFFER_SIZE) == NULL) {
+            abort();
+        }
+        char sep;
+        unsigned char addr[6];
+        int code = replyCode(ctl->response, &sep);
+        if ((code != -1) && ((code < 0) || (code > 999))) {
+            abort();
+        }
+        parsePasv(ctl->response, addr);
+        /* Every call takes at least one byte off a stream that ends */
+        if (++calls > size + 1) {
+            abort();
+        }
+    } while (ctl->response[0] != '\0');
+    ftp_reply_feed_close(&feed);
+
+    /* The same bytes as a remote path */
+    char arg[FTP_CLIENT_TEMP_BUFFER_SIZE];
+    size_t n = size < sizeof(arg) - 1 ? size : sizeof(arg) - 1;
+    memcpy(arg, data, n);
+    arg[n] = '\0';
+    NetBuf_t cmd_ctl = {0};
+    char buf[FTP_CLIENT_TEMP_BUFFER_SIZE];
+    if (buildCommand(buf, sizeof(buf), &cmd_ctl, "STOR %s", arg)) {
+        if ((strpbrk(buf, "\r\n") != NULL) || (strlen(buf) + 3 > sizeof(buf))) {
+            abort();
+        }
+    } else if (strncmp(cmd_ctl.response, "501 ", 4) != 0) {
+        abort();
+    }
+    return 0;
+}
+
+#if !defined FTP_REPLY_LIBFUZZER
+
+typedef struct {
+    uint8_t     *data;
+    size_t      len;
+} seed_t;
+
+static seed_t *s_seeds;
+static int s_seed_count;
+
+static int add_file(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "%s: cannot open\n", path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    seed_t seed = { .data = malloc(len > 0 ? len : 1), .len = len > 0 ? len : 0 };
+    if (fread(seed.data, 1, seed.len, f) != seed.len) {
+        seed.len = 0;
+    }
+    fclose(f);
+    s_seeds = realloc(s_seeds, (s_seed_count + 1) * sizeof(seed_t));
+    s_seeds[s_seed_count++] = seed;
+    return 0;
+}
+
+static int add_path(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "%s: not found\n", path);
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return add_file(path);
+    }
+    DIR *dir = opendir(path);
+    struct dirent *de;
+    int ret = 0;
+    while (dir && (de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+        char file[1024];
+        snprintf(file, sizeof(file), "%s/%s", path, de->d_name);
+        ret |= add_file(file);
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    return ret;
+}
+
+/* Bytes the parser treats specially, weighted in the mutations */
+static const char s_dict[] = "0123456789 -,()\r\n\0x";
+
+static size_t mutate(uint8_t *out, size_t cap, const seed_t *seed, unsigned *rng)
+{
+    size_t len = seed ? seed->len : 0;
+    if (len > cap) {
+        len = cap;
+    }
+    if (seed) {
+        memcpy(out, seed->data, len);
+    }
+    int edits = 1 + rand_r(rng) % 8;
+    for (int i = 0; i < edits; i++) {
+        size_t pos = len ? rand_r(rng) % len : 0;
+        switch (rand_r(rng) % 5) {
+        case 0: /* Flip a byte */
+            if (len) {
+                out[pos] = rand_r(rng) % 2 ? (uint8_t)rand_r(rng) : s_dict[rand_r(rng) % (sizeof(s_dict) - 1)];
+            }
+            break;
+        case 1: /* Cut the input short */
+            len = pos;
+            break;
+        case 2: /* Insert a run of one byte, up to past the line limits */
+        {
+            size_t run = rand_r(rng) % 4 ? rand_r(rng) % 64 : rand_r(rng) % (FTP_CLIENT_RESPONSE_BUFFER_SIZE + FTP_CLIENT_REPLY_MAX_DISCARD + 64);
+            if (len + run > cap) {
+                run = cap - len;
+            }
+            memmove(out + pos + run, out + pos, len - pos);
+            memset(out + pos, s_dict[rand_r(rng) % (sizeof(s_dict) - 1)], run);
+            len += run;
+            break;
+        }
+        case 3: /* Repeat a line, for long multi-line replies */
+        {
+            uint8_t *nl = len ? memchr(out + pos, '\n', len - pos) : NULL;
+            if (nl) {
+                size_t line = nl + 1 - (out + pos);
+                int times = 1 + rand_r(rng) % 300;
+                for (int t = 0; t < times && len + line <= cap; t++) {
+                    memmove(out + pos + line, out + pos, len - pos);
+                    len += line;
+                }
+            }
+            break;
+        }
+        default: /* Insert a CR or LF */
+            if (len < cap) {
+                memmove(out + pos + 1, out + pos, len - pos);
+                out[pos] = rand_r(rng) % 2 ? '\r' : '\n';
+                len++;
+            }
+            break;
+        }
+    }
+    return len;
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = 0;
+    unsigned rng = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            rng = strtoul(argv[++i], NULL, 0);
+        } else if (add_path(argv[i]) != 0) {
+            return 2;
+        }
+    }
+
+    size_t bytes = 0;
+    double t0 = now_s();
+    for (int i = 0; i < s_seed_count; i++) {
+        LLVMFuzzerTestOneInput(s_seeds[i].data, s_seeds[i].len);
+        bytes += s_seeds[i].len;
+    }
+    double t = now_s() - t0;
+    printf("replayed %d inputs, %zu bytes in %.3f s\n", s_seed_count, bytes, t);
+
+    if (iterations > 0) {
+        size_t cap = 64 * 1024;
+        uint8_t *buf = malloc(cap);
+        bytes = 0;
+        t0 = now_s();
+        for (long i = 0; i < iterations; i++) {
+            const seed_t *seed = s_seed_count && rand_r(&rng) % 8 ? &s_seeds[rand_r(&rng) % s_seed_count] : NULL;
+            size_t len = mutate(buf, cap, seed, &rng);
+            LLVMFuzzerTestOneInput(buf, len);
+            bytes += len;
+        }
+        t = now_s() - t0;
+        printf("mutated %ld inputs, %.1f MB in %.3f s: %.0f inputs/s, %.1f MB/s\n",
+               iterations, bytes / 1048576.0, t, iterations / t, bytes / 1048576.0 / t);
+        free(buf);
+    }
+    for (int i = 0; i < s_seed_count; i++) {
+        free(s_seeds[i].data);
+    }
+    free(s_seeds);
+    return 0;
+}
+
+#endif /* FTP_REPLY_LIBFUZZER */
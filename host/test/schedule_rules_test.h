@@ -0,0 +1,7 @@
+/*
+ * schedule_rules_test - compiled-in table of test_schedule: daytime
+ * recording and no upload window, so SCHEDULE_UPLOAD has no rules until
+ * an override adds some
+ */
+
+SCHEDULE_RULE(SCHEDULE_RECORD, SCHEDULE_EVERY_DAY, 5, 0, 19, 0),
@@ -0,0 +1,348 @@
+/*
+ * test_bin_log - bin_log ring, drain file and RTC copy
+ *
+ * Records a known sequence and reads the drained file back the way
+ * tools/bin_log_decode.py does: file header, records with their packed
+ * arguments, the dropped and sync marks. Also checked: a full ring drops and
+ * counts, a failed drain keeps the records for the next one, what
+ * bin_log_suspend() saves comes back at the next init, and no file I/O runs
+ * inside the ring's critical section (on the ESP32 that trips the interrupt
+ * watchdog). The stress run has writer tasks record while another drains and
+ * checks every record lands in a file exactly once.
+ *
+ *   test_bin_log [--writers N] [--records N]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ftw.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+static int s_failed;
+static int s_run;
+
+#define CHECK(cond, ...) do {                               \
+    s_run++;                                                \
+    if (!(cond)) {                                          \
+        s_failed++;                                         \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+        printf(__VA_ARGS__);                                \
+        printf("\n");                                       \
+    }                                                       \
+} while (0)
+
+/* File I/O of bin_log.c, counted when it runs inside a critical section */
+static int s_io_in_critical;
+
+static FILE *checked_fopen(const char *path, const char *mode)
+{
+    s_io_in_critical += !xPortCanYield();
+    return fopen(path, mode);
+}
+
+static size_t checked_fwrite(const void *p, size_t size, size_t n, FILE *fp)
+{
+    s_io_in_critical += !xPortCanYield();
+    return fwrite(p, size, n, fp);
+}
+
+static int checked_fclose(FILE *fp)
+{
+    s_io_in_critical += !xPortCanYield();
+    return fclose(fp);
+}
+
+#define fopen                               checked_fopen
+#define fwrite                              checked_fwrite
+#define fclose                              checked_fclose
+#include "bin_log.c"
+#undef fopen
+#undef fwrite
+#undef fclose
+
+static const char *T = "TEST";
+
+static int _rm(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+/* Back to before bin_log_init(), s_rtc is left as a reset would leave it */
+static void reset(int ring_bytes)
+{
+    if (s_log.ring) {
+        heap_caps_free(s_log.ring);
+        vSemaphoreDelete(s_log.drain_lock);
+    }
+    pthread_mutex_t m = s_log.mux.m;
+    memset(&s_log, 0, sizeof(s_log));
+    s_log.mux.m = m;
+    bin_log_cfg_t cfg = BIN_LOG_CFG_DEFAULT();
+    cfg.ring_bytes = ring_bytes;
+    bin_log_init(&cfg);
+}
+
+typedef struct {
+    int     records;
+    int     marks[4];           /* By BIN_LOG_MARK_*, [0] unknown */
+    uint32_t dropped;           /* Sum of the dropped marks */
+    int     bad;                /* Records that do not parse */
+    uint32_t seq_sum;           /* Of the first argument of "seq" records */
+    int     seq_count;
+} parsed_t;
+
+static const char s_fmt_seq[] = "seq %u from %d";
+static const char s_fmt_mix[] = "%s: %d %llu %.2f %x";
+
+/* Read a drained file back, false when the header is missing or wrong */
+static bool parse(const char *path, parsed_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    bin_log_file_header_t h;
+    bool ok = fread(&h, sizeof(h), 1, fp) == 1 && memcmp(h.magic, BIN_LOG_MAGIC, 4) == 0
+              && h.version == BIN_LOG_VERSION && h.header_size == sizeof(h)
+              && memcmp(h.elf_sha256, s_log.elf_sha256, BIN_LOG_SHA_LEN) == 0;
+    bin_log_record_t rec;
+    uint8_t args[BIN_LOG_MAX_ARGS + 16];
+    while (ok && fread(&rec, sizeof(rec), 1, fp) == 1) {
+        if (rec.len > sizeof(args) || (rec.len & 3) || fread(args, 1, rec.len, fp) != rec.len) {
+            out->bad++;
+            break;
+        }
+        if (rec.fmt < 4) {
+            out->marks[rec.fmt]++;
+            if (rec.fmt == BIN_LOG_MARK_DROPPED) {
+                out->dropped += ((uint32_t *)args)[0];
+            }
+            continue;
+        }
+        out->records++;
+        if (rec.fmt == (uint32_t)(uintptr_t)s_fmt_seq) {
+            out->seq_sum += ((uint32_t *)args)[0];
+            out->seq_count++;
+        }
+    }
+    fclose(fp);
+    return ok;
+}
+
+static void test_format(const char *dir)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/format.blg", dir);
+    reset(32 * 1024);
+    BIN_LOGI(T, s_fmt_mix, "abc", -7, 1ULL << 40, 2.5, 0xbeef);
+    BIN_LOGW(T, "%s", "a string longer than BIN_LOG_MAX_STR is cut to it, the rest is not kept");
+    BIN_LOGD(T, "no arguments");
+    CHECK(bin_log_drain(path) == ESP_OK, "drain");
+    CHECK(bin_log_drain(path) == ESP_ERR_NOT_FOUND, "second drain with nothing recorded");
+
+    FILE *fp = fopen(path, "rb");
+    bin_log_file_header_t h;
+    bin_log_record_t rec;
+    uint8_t args[BIN_LOG_MAX_ARGS];
+    CHECK(fp && fread(&h, sizeof(h), 1, fp) == 1, "no file header");
+    /* Boot mark first */
+    CHECK(fread(&rec, sizeof(rec), 1, fp) == 1 && rec.fmt == BIN_LOG_MARK_BOOT && rec.len == 8, "boot mark");
+    fseek(fp, rec.len, SEEK_CUR);
+    CHECK(fread(&rec, sizeof(rec), 1, fp) == 1 && fread(args, 1, rec.len, fp) == rec.len, "first record");
+    CHECK(rec.fmt == (uint32_t)(uintptr_t)s_fmt_mix && rec.tag == (uint32_t)(uintptr_t)T
+          && rec.level == ESP_LOG_INFO, "record header");
+    /* %s: length byte and padding to 4, then 4 + 8 + 8 + 4 */
+    int32_t d;
+    uint64_t llu;
+    double f;
+    uint32_t x;
+    memcpy(&d, args + 4, 4);
+    memcpy(&llu, args + 8, 8);
+    memcpy(&f, args + 16, 8);
+    memcpy(&x, args + 24, 4);
+    CHECK(rec.len == 28 && args[0] == 3 && memcmp(args + 1, "abc", 3) == 0, "%%s packed as %u bytes", rec.len);
+    CHECK(d == -7 && llu == 1ULL << 40 && f == 2.5 && x == 0xbeef, "arguments %d %llu %f %x",
+          d, (unsigned long long)llu, f, x);
+    CHECK(fread(&rec, sizeof(rec), 1, fp) == 1 && fread(args, 1, rec.len, fp) == rec.len, "second record");
+    CHECK(args[0] == BIN_LOG_MAX_STR && rec.len == (1 + BIN_LOG_MAX_STR + 3) / 4 * 4, "long %%s kept %u bytes", args[0]);
+    CHECK(fread(&rec, sizeof(rec), 1, fp) == 1 && rec.len == 0 && rec.level == ESP_LOG_DEBUG, "record without arguments");
+    CHECK(fread(&rec, sizeof(rec), 1, fp) == 1 && rec.fmt == BIN_LOG_MARK_SYNC, "sync mark last");
+    fclose(fp);
+}
+
+static void test_full(const char *dir)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/full.blg", dir);
+    reset(BIN_LOG_RTC_BYTES);
+    int n = 1000;
+    for (int i = 0; i < n; i++) {
+        BIN_LOGI(T, s_fmt_seq, i, 0);
+    }
+    bin_log_stats_t st;
+    bin_log_get_stats(&st);
+    CHECK(st.dropped > 0 && st.records + st.dropped == (uint32_t)n + 1, "%u kept, %u dropped of %d", st.records,
+          st.dropped, n + 1);
+    CHECK(bin_log_drain(path) == ESP_OK, "drain");
+    parsed_t p;
+    CHECK(parse(path, &p) && p.bad == 0, "file does not parse");
+    CHECK(p.records + p.dropped == (uint32_t)n && p.marks[BIN_LOG_MARK_DROPPED] == 1,
+          "%d records and %u dropped in the file", p.records, p.dropped);
+    /* Room again after the drain */
+    BIN_LOGI(T, s_fmt_seq, n, 0);
+    bin_log_get_stats(&st);
+    CHECK(st.used_bytes > 0 && st.used_bytes < 64, "%u bytes used after the drain", st.used_bytes);
+}
+
+static void test_failed_drain(const char *dir)
+{
+    char path[256], bad[256];
+    snprintf(path, sizeof(path), "%s/failed.blg", dir);
+    snprintf(bad, sizeof(bad), "%s/missing/failed.blg", dir);
+    reset(BIN_LOG_RTC_BYTES);
+    for (int i = 0; i < 500; i++) {
+        BIN_LOGI(T, s_fmt_seq, i, 0);
+    }
+    bin_log_stats_t before, after;
+    bin_log_get_stats(&before);
+    CHECK(bin_log_drain(bad) == ESP_FAIL, "drain into a missing directory");
+    bin_log_get_stats(&after);
+    CHECK(after.used_bytes == before.used_bytes && s_log.dropped == before.dropped,
+          "failed drain lost records: %u -> %u bytes, %u dropped", before.used_bytes, after.used_bytes, s_log.dropped);
+    CHECK(bin_log_drain(path) == ESP_OK, "drain after the failure");
+    parsed_t p;
+    CHECK(parse(path, &p) && p.records + p.dropped == 500, "%d records, %u dropped", p.records, p.dropped);
+}
+
+static void test_suspend(const char *dir)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/suspend.blg", dir);
+    reset(32 * 1024);
+    for (int i = 0; i < 20; i++) {
+        BIN_LOGI(T, s_fmt_seq, i, 0);
+    }
+    bin_log_suspend();
+    /* Deep sleep: the ring is gone, s_rtc is not */
+    reset(32 * 1024);
+    bin_log_stats_t st;
+    bin_log_get_stats(&st);
+    CHECK(st.restored_bytes > 0, "nothing restored from RTC");
+    CHECK(bin_log_drain(path) == ESP_OK, "drain");
+    parsed_t p;
+    CHECK(parse(path, &p) && p.seq_count == 20 && p.seq_sum == 190, "%d of 20 records back", p.seq_count);
+    CHECK(p.marks[BIN_LOG_MARK_BOOT] == 2, "%d boot marks", p.marks[BIN_LOG_MARK_BOOT]);
+
+    /* Other firmware's records are not taken back */
+    reset(32 * 1024);
+    BIN_LOGI(T, s_fmt_seq, 1, 0);
+    bin_log_suspend();
+    s_rtc.elf_sha256[0] ^= 0xff;
+    s_rtc.sum = _rtc_sum();
+    reset(32 * 1024);
+    bin_log_get_stats(&st);
+    CHECK(st.restored_bytes == 0, "%u bytes of other firmware restored", st.restored_bytes);
+}
+
+typedef struct {
+    int             id;
+    int             records;
+    SemaphoreHandle_t done;
+} writer_t;
+
+static void _writer(void *arg)
+{
+    writer_t *w = arg;
+    for (int i = 0; i < w->records; i++) {
+        BIN_LOGI(T, s_fmt_seq, i, w->id);
+        if ((i & 255) == 0) {
+            vTaskDelay(0);
+        }
+    }
+    xSemaphoreGive(w->done);
+    vTaskDelete(NULL);
+}
+
+static void test_stress(const char *dir, int writers, int records)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/stress.blg", dir);
+    reset(32 * 1024);
+    bin_log_drain(path);
+    remove(path);
+
+    writer_t w[16];
+    SemaphoreHandle_t done = xSemaphoreCreateCounting(writers, 0);
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < writers; i++) {
+        w[i] = (writer_t){ .id = i, .records = records, .done = done };
+        xTaskCreate(_writer, "writer", 4096, &w[i], 5, NULL);
+    }
+    int drains = 0, finished = 0;
+    int64_t drain_us = 0, drain_max = 0;
+    while (finished < writers) {
+        while (finished < writers && xSemaphoreTake(done, 0) == pdTRUE) {
+            finished++;
+        }
+        int64_t t = esp_timer_get_time();
+        if (bin_log_drain(path) == ESP_OK) {
+            t = esp_timer_get_time() - t;
+            drain_us += t;
+            drain_max = t > drain_max ? t : drain_max;
+            drains++;
+        }
+        vTaskDelay(1);
+    }
+    bin_log_drain(path);
+    int64_t elapsed = esp_timer_get_time() - start;
+    vSemaphoreDelete(done);
+
+    parsed_t p;
+    bin_log_stats_t st;
+    bin_log_get_stats(&st);
+    CHECK(parse(path, &p) && p.bad == 0, "stress file does not parse");
+    uint32_t total = (uint32_t)writers * records;
+    CHECK(p.seq_count + p.dropped == total, "%d recorded + %u dropped of %u", p.seq_count, p.dropped, total);
+    CHECK(st.used_bytes == 0, "%u bytes left in the ring", st.used_bytes);
+    printf("  %-10s %8d %8u %8d %8u %10.0f %8.0f %8lld\n", "stress", writers, total, p.seq_count, p.dropped,
+           total * 1e6 / elapsed, drains ? (double)drain_us / drains : 0.0, (long long)drain_max);
+}
+
+int main(int argc, char **argv)
+{
+    int writers = 4;
+    int records = 50000;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--writers") == 0) {
+            writers = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--records") == 0) {
+            records = atoi(argv[i + 1]);
+        }
+    }
+    if (writers < 1 || writers > 16 || records < 1) {
+        fprintf(stderr, "usage: %s [--writers 1..16] [--records N]\n", argv[0]);
+        return 2;
+    }
+    char dir[] = "/tmp/bin_log.XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    test_format(dir);
+    test_full(dir);
+    test_failed_drain(dir);
+    test_suspend(dir);
+    printf("  %-10s %8s %8s %8s %8s %10s %8s %8s\n", "", "writers", "records", "in file", "dropped",
+           "records/s", "drain us", "max us");
+    test_stress(dir, writers, records);
+    CHECK(s_io_in_critical == 0, "%d file calls inside the critical section", s_io_in_critical);
+
+    nftw(dir, _rm, 16, FTW_DEPTH | FTW_PHYS);
+    printf("%d checks, %d failed\n", s_run, s_failed);
+    return s_failed ? 1 : 0;
+}
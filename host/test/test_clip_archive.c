@@ -0,0 +1,316 @@
+/*
+ * test_clip_archive - clip_archive_put() over the loopback server
+ *
+ * Uploads a batch of clips as one tar archive and with one STOR per clip,
+ * as the NAS app does with UPLOAD_ARCHIVE 1 and 0, and reports files/s,
+ * MB/s and the data connections each took. The archive the server stored
+ * is read back member by member: header checksum, name, size, contents,
+ * padding and the two zero blocks at the end. Then the cases the NAS app
+ * relies on to decide which clips it may delete:
+ *   - a clip missing from the card is left out and not marked included
+ *   - none of the clips present gives ESP_ERR_NOT_FOUND, nothing included
+ *   - a clip that ends early while its member is being sent aborts the
+ *     archive and clears included for every clip
+ *   - STOR refused by the server, nothing included
+ * and a whole archive on the same session after them.
+ *
+ *   test_clip_archive [--files N]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "esp_timer.h"
+#include "ftp_loopback.h"
+
+/* fread of s_short_path returns nothing, as a clip cut short on the card */
+static const char *s_short_path;
+static const char *s_fread_path;
+
+static FILE *short_fopen(const char *path, const char *mode)
+{
+    s_fread_path = path;
+    return fopen(path, mode);
+}
+
+static size_t short_fread(void *buf, size_t size, size_t n, FILE *f)
+{
+    if (s_short_path && strcmp(s_fread_path, s_short_path) == 0) {
+        return 0;
+    }
+    return fread(buf, size, n, f);
+}
+
+#define fopen                               short_fopen
+#define fread                               short_fread
+#include "clip_archive.c"
+#undef fopen
+#undef fread
+
+static int s_failed;
+static int s_run;
+
+#define CHECK(cond, ...) do {                               \
+    s_run++;                                                \
+    if (!(cond)) {                                          \
+        s_failed++;                                         \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+        printf(__VA_ARGS__);                                \
+        printf("\n");                                       \
+    }                                                       \
+} while (0)
+
+#define KIB                                 1024L
+#define MAX_FILES                           1000
+
+static char s_root[] = "/tmp/clip_archive.XXXXXX";
+static char s_card[64];
+static char s_nas[64];
+static char s_paths[MAX_FILES][96];
+static const char *s_path_list[MAX_FILES];
+static uint8_t s_buf[1024 * KIB];
+
+static int _rm(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+/* Content of clip i, so a member landing in another's place is caught */
+static void fill(int i, long size)
+{
+    for (long j = 0; j < size; j++) {
+        s_buf[j] = (uint8_t)(i * 31 + j * 7 + (j >> 11));
+    }
+}
+
+/* Clips 0 .. files-1 of size bytes on the card, plus the odd byte so no two sizes pad alike */
+static void make_clips(int files, long size)
+{
+    for (int i = 0; i < files; i++) {
+        long n = size + i;
+        snprintf(s_paths[i], sizeof(s_paths[i]), "%s/2026.10.19.06.%02d.%02d.wav", s_card, i / 60 % 60, i % 60);
+        s_path_list[i] = s_paths[i];
+        fill(i, n);
+        FILE *f = fopen(s_paths[i], "wb");
+        fwrite(s_buf, 1, n, f);
+        fclose(f);
+    }
+}
+
+static NetBuf_t *session(ftp_loopback_handle_t srv)
+{
+    FtpClient *ftp = getFtpClient();
+    NetBuf_t *ctrl = NULL;
+    if (!ftp->ftpClientConnect("127.0.0.1", ftp_loopback_port(srv), &ctrl)) {
+        return NULL;
+    }
+    if (!ftp->ftpClientLogin("test", "test", ctrl)) {
+        ftp->ftpClientQuit(ctrl);
+        return NULL;
+    }
+    return ctrl;
+}
+
+/* Walk the archive the server stored, every member has to be clip i with its contents */
+static bool check_tar(const char *name, int files, long size, uint64_t wire_bytes)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", s_nas, name);
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        printf("  %s not stored\n", name);
+        return false;
+    }
+    static uint8_t data[sizeof(s_buf)];
+    uint8_t h[CLIP_ARCHIVE_BLOCK_SIZE];
+    bool ok = true;
+    int i = 0;
+    for (; ok && i < files; i++) {
+        long n = size + i;
+        ok = fread(h, 1, sizeof(h), f) == sizeof(h);
+        unsigned sum = 0;
+        for (int j = 0; j < CLIP_ARCHIVE_BLOCK_SIZE; j++) {
+            sum += j >= TAR_CHKSUM && j < TAR_CHKSUM + 8 ? ' ' : h[j];
+        }
+        ok = ok && strtoul((char *)h + TAR_CHKSUM, NULL, 8) == sum
+             && strcmp((char *)h + TAR_NAME, _basename(s_paths[i])) == 0
+             && strtol((char *)h + TAR_SIZE, NULL, 8) == n
+             && memcmp(h + TAR_MAGIC, "ustar", 6) == 0 && h[TAR_TYPEFLAG] == '0';
+        long padded = (n + CLIP_ARCHIVE_BLOCK_SIZE - 1) / CLIP_ARCHIVE_BLOCK_SIZE * CLIP_ARCHIVE_BLOCK_SIZE;
+        ok = ok && fread(data, 1, padded, f) == (size_t)padded;
+        fill(i, n);
+        ok = ok && memcmp(data, s_buf, n) == 0;
+        for (long j = n; ok && j < padded; j++) {
+            ok = data[j] == 0;
+        }
+    }
+    uint8_t end[2 * CLIP_ARCHIVE_BLOCK_SIZE];
+    ok = ok && fread(end, 1, sizeof(end), f) == sizeof(end) && fgetc(f) == EOF;
+    for (int j = 0; ok && j < (int)sizeof(end); j++) {
+        ok = end[j] == 0;
+    }
+    ok = ok && ftell(f) == (long)wire_bytes;
+    fclose(f);
+    if (!ok) {
+        printf("  %s: member %d of %d does not match\n", name, i, files);
+    }
+    return ok;
+}
+
+/* One batch as a tar and as one STOR per clip, returns tar files/s over STOR files/s */
+static double bench(ftp_loopback_handle_t srv, long size, int files)
+{
+    FtpClient *ftp = getFtpClient();
+    make_clips(files, size);
+    NetBuf_t *ctrl = session(srv);
+    CHECK(ctrl != NULL, "session");
+    if (ctrl == NULL) {
+        return 0;
+    }
+    ftp_loopback_stats_t before, after;
+    ftp_loopback_get_stats(srv, &before);
+    static bool included[MAX_FILES];
+    clip_archive_stats_t tar;
+    char name[32];
+    snprintf(name, sizeof(name), "batch%ld.tar", size);
+    esp_err_t ret = clip_archive_put(ctrl, name, s_path_list, files, included, &tar);
+    ftp_loopback_get_stats(srv, &after);
+    uint32_t tar_connects = after.data_connects - before.data_connects;
+    int marked = 0;
+    for (int i = 0; i < files; i++) {
+        marked += included[i];
+    }
+    CHECK(ret == ESP_OK && tar.files == files && marked == files, "tar %ld B: %s, %d clips, %d included of %d",
+          size, esp_err_to_name(ret), tar.files, marked, files);
+    CHECK(check_tar(name, files, size, tar.wire_bytes), "tar %ld B: archive on the server", size);
+    CHECK(tar_connects == 1, "tar %ld B: %u data connections", size, tar_connects);
+
+    clip_archive_stats_t stor = { 0 };
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < files; i++) {
+        if (ftp->ftpClientPut(s_paths[i], _basename(s_paths[i]), FTP_CLIENT_BINARY, ctrl)) {
+            stor.files++;
+            stor.bytes += size + i;
+        }
+    }
+    stor.elapsed_us = esp_timer_get_time() - start;
+    stor.wire_bytes = stor.bytes;
+    ftp_loopback_get_stats(srv, &before);
+    uint32_t stor_connects = before.data_connects - after.data_connects;
+    ftp->ftpClientQuit(ctrl);
+    CHECK(stor.files == files, "STOR %ld B: %d of %d stored", size, stor.files, files);
+
+    double tar_fps = tar.files * 1e6 / tar.elapsed_us;
+    double stor_fps = stor.files * 1e6 / stor.elapsed_us;
+    printf("  %-4s %8ld %6d %10.1f %8.2f %8u %6.1f%%\n", "tar", size, files, tar_fps,
+           tar.bytes / (double)tar.elapsed_us, tar_connects, (tar.wire_bytes - tar.bytes) * 100.0 / tar.bytes);
+    printf("  %-4s %8ld %6d %10.1f %8.2f %8u %6.1f%%\n", "STOR", size, files, stor_fps,
+           stor.bytes / (double)stor.elapsed_us, stor_connects, 0.0);
+    for (int i = 0; i < files; i++) {
+        unlink(s_paths[i]);
+    }
+    return stor_fps > 0 ? tar_fps / stor_fps : 0;
+}
+
+/* The included[] cases, on a batch of 4 clips */
+static void test_included(ftp_loopback_handle_t srv)
+{
+    FtpClient *ftp = getFtpClient();
+    NetBuf_t *ctrl = session(srv);
+    CHECK(ctrl != NULL, "session");
+    if (ctrl == NULL) {
+        return;
+    }
+    bool included[4];
+    clip_archive_stats_t st;
+
+    make_clips(4, 3000);
+    unlink(s_paths[1]);
+    esp_err_t ret = clip_archive_put(ctrl, "missing.tar", s_path_list, 4, included, &st);
+    CHECK(ret == ESP_OK && st.files == 3, "one clip missing: %s, %d clips", esp_err_to_name(ret), st.files);
+    CHECK(included[0] && !included[1] && included[2] && included[3], "one clip missing: included %d%d%d%d",
+          included[0], included[1], included[2], included[3]);
+
+    for (int i = 0; i < 4; i++) {
+        unlink(s_paths[i]);
+    }
+    memset(included, 1, sizeof(included));
+    ret = clip_archive_put(ctrl, "none.tar", s_path_list, 4, included, NULL);
+    CHECK(ret == ESP_ERR_NOT_FOUND, "no clip on the card: %s", esp_err_to_name(ret));
+    CHECK(!included[0] && !included[1] && !included[2] && !included[3], "no clip on the card: something included");
+    char path[128];
+    struct stat sb;
+    snprintf(path, sizeof(path), "%s/none.tar", s_nas);
+    CHECK(stat(path, &sb) != 0, "no clip on the card: an archive was stored");
+
+    make_clips(4, 3000);
+    s_short_path = s_paths[2];
+    memset(included, 1, sizeof(included));
+    ret = clip_archive_put(ctrl, "short.tar", s_path_list, 4, included, NULL);
+    s_short_path = NULL;
+    CHECK(ret == ESP_FAIL, "clip ending early: %s", esp_err_to_name(ret));
+    CHECK(!included[0] && !included[1] && !included[2] && !included[3], "clip ending early: included %d%d%d%d",
+          included[0], included[1], included[2], included[3]);
+
+    /* The loopback server answers a name outside its root with 553 */
+    memset(included, 1, sizeof(included));
+    ret = clip_archive_put(ctrl, "../outside.tar", s_path_list, 4, included, NULL);
+    CHECK(ret == ESP_FAIL, "STOR refused: %s", esp_err_to_name(ret));
+    CHECK(!included[0] && !included[1] && !included[2] && !included[3], "STOR refused: something included");
+
+    ret = clip_archive_put(ctrl, "after.tar", s_path_list, 4, included, &st);
+    CHECK(ret == ESP_OK && st.files == 4 && check_tar("after.tar", 4, 3000, st.wire_bytes),
+          "archive after the failures: %s", esp_err_to_name(ret));
+    ftp->ftpClientQuit(ctrl);
+    for (int i = 0; i < 4; i++) {
+        unlink(s_paths[i]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int files = 100;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--files") == 0) {
+            files = atoi(argv[i + 1]);
+        }
+    }
+    if (files < 1 || files > MAX_FILES) {
+        fprintf(stderr, "usage: %s [--files 1..%d]\n", argv[0], MAX_FILES);
+        return 2;
+    }
+    if (mkdtemp(s_root) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(s_card, sizeof(s_card), "%s/sdcard", s_root);
+    snprintf(s_nas, sizeof(s_nas), "%s/nas", s_root);
+    mkdir(s_card, 0755);
+    mkdir(s_nas, 0755);
+    ftp_loopback_cfg_t cfg = FTP_LOOPBACK_CFG_DEFAULT();
+    cfg.root = s_nas;
+    ftp_loopback_handle_t srv = ftp_loopback_start(&cfg);
+    if (srv == NULL) {
+        return 1;
+    }
+
+    printf("  %-4s %8s %6s %10s %8s %8s %7s\n", "mode", "bytes", "files", "files/s", "MB/s", "connects", "tar");
+    /* A few seconds of audio, and 10 s at 44.1 kHz 16 bit mono as the NAS app records */
+    static const long sizes[] = {4 * KIB, 64 * KIB, 861 * KIB};
+    double gain[3];
+    for (int i = 0; i < 3; i++) {
+        gain[i] = bench(srv, sizes[i], i == 2 && files > 20 ? 20 : files);
+    }
+    /* Per-file setup is what the archive saves, it has to show on small clips */
+    CHECK(gain[0] > 1.0, "tar of %ld B clips is not faster than STOR (%.2fx)", sizes[0], gain[0]);
+    printf("  tar over STOR: %.2fx, %.2fx, %.2fx files/s\n", gain[0], gain[1], gain[2]);
+
+    test_included(srv);
+    ftp_loopback_stop(srv);
+    nftw(s_root, _rm, 16, FTW_DEPTH | FTW_PHYS);
+    printf("%d checks, %d failed\n", s_run, s_failed);
+    return s_failed ? 1 : 0;
+}
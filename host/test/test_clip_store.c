@@ -0,0 +1,503 @@
+/*
+ * test_clip_store - clip_store on a temporary directory
+ *
+ * A reboot is simulated by dropping the module state. The RTC hint is
+ * either kept (wake from deep sleep) or cleared (cold boot). Covered:
+ *   - record, finish, upload and evict, with the cursors checked after
+ *     every step against a full rescan of the index
+ *   - a clip cut short by power loss found again and finished in place
+ *   - a torn append at the end of the index, and a corrupt record inside it
+ *   - the RTC hint: used when it belongs to the index, not used for a
+ *     changed index or for the index of another card of the same length
+ *   - compaction of the deleted records in front, a compaction cut short
+ *     between unlink and rename, and a stale clips.tmp
+ *   - moving clips of the flat layout into day directories
+ * Then the benchmark: rebuild, cold and warm init, lookups and eviction
+ * on an index of --bench-files clips (100000 by default).
+ *
+ *   test_clip_store [--bench-files N]
+ */
+
+#include <ftw.h>
+#include <stdlib.h>
+#include "esp_timer.h"
+
+/* Small enough to compact in the tests */
+#define CLIP_STORE_COMPACT_RECORDS          64
+#include "clip_store.c"
+
+static int s_failed;
+static int s_run;
+
+#define CHECK(cond, ...) do {                               \
+    s_run++;                                                \
+    if (!(cond)) {                                          \
+        s_failed++;                                         \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+        printf(__VA_ARGS__);                                \
+        printf("\n");                                       \
+    }                                                       \
+} while (0)
+
+/* 2026-10-19 06:00:00 UTC, clips start every 48 s */
+#define T0                                  1792389600
+#define CLIP_SECONDS                        48
+/* What clip_store_init() accepts as its root */
+#define ROOT_MAX                            (CLIP_STORE_PATH_MAX - CLIP_STORE_NAME_MAX)
+
+static int _rm(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static void rm_rf(const char *path)
+{
+    nftw(path, _rm, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static char *make_root(char *buf, size_t len)
+{
+    const char *tmp = getenv("TMPDIR");
+    snprintf(buf, len, "%s/clips.XXXXXX", tmp && strlen(tmp) < 24 ? tmp : "/tmp");
+    return mkdtemp(buf);
+}
+
+/* Power off: the module forgets everything, RTC memory survives deep sleep only */
+static void reboot(bool keep_rtc)
+{
+    if (s_store.f) {
+        fclose(s_store.f);
+    }
+    if (s_store.lock) {
+        vSemaphoreDelete(s_store.lock);
+    }
+    memset(&s_store, 0, sizeof(s_store));
+    if (!keep_rtc) {
+        memset(&s_hint, 0, sizeof(s_hint));
+    }
+}
+
+static esp_err_t boot(const char *root, bool keep_rtc)
+{
+    reboot(keep_rtc);
+    return clip_store_init(root);
+}
+
+static void touch(const char *path, long size)
+{
+    FILE *f = fopen(path, "wb");
+    if (f) {
+        if (size > 0) {
+            fseek(f, size - 1, SEEK_SET);
+            fputc(0, f);
+        }
+        fclose(f);
+    }
+}
+
+static long file_size(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+/* Record clip i the way the recorder does: open, write, add */
+static void record(int i, uint8_t score, char *path)
+{
+    clip_store_path(T0 + (time_t)i * CLIP_SECONDS, ".wav", path, CLIP_STORE_PATH_MAX);
+    CHECK(clip_store_open(path) == ESP_OK, "open %s", path);
+    touch(path, 1000 + i);
+    CHECK(clip_store_add(path, score) == ESP_OK, "add %s", path);
+}
+
+/* The maintained cursors are what a full pass over the index finds */
+static void check_cursors(const char *where)
+{
+    uint32_t kept[CLIP_STORE_CURSORS];
+    memcpy(kept, s_store.cursor, sizeof(kept));
+    _rescan();
+    CHECK(memcmp(kept, s_store.cursor, sizeof(kept)) == 0,
+          "%s: cursors live %u pending %u, rescan live %u pending %u", where,
+          (unsigned)kept[CLIP_STORE_CURSOR_LIVE], (unsigned)kept[CLIP_STORE_CURSOR_PENDING],
+          (unsigned)s_store.cursor[CLIP_STORE_CURSOR_LIVE], (unsigned)s_store.cursor[CLIP_STORE_CURSOR_PENDING]);
+    memcpy(s_store.cursor, kept, sizeof(kept));
+}
+
+static int count(clip_store_state_t state)
+{
+    static clip_store_entry_t entries[256];
+    return clip_store_list(state, entries, 256);
+}
+
+static void test_lifecycle(void)
+{
+    char root[ROOT_MAX], path[CLIP_STORE_PATH_MAX];
+    make_root(root, sizeof(root));
+    CHECK(boot(root, false) == ESP_OK, "init on an empty card");
+    CHECK(s_store.records == 0, "%u records on an empty card", (unsigned)s_store.records);
+
+    char paths[10][CLIP_STORE_PATH_MAX];
+    for (int i = 0; i < 10; i++) {
+        record(i, i * 25, paths[i]);
+        check_cursors("record");
+    }
+    clip_store_entry_t e[16];
+    int n = clip_store_list(CLIP_STORE_PENDING, e, 16);
+    CHECK(n == 10, "%d pending", n);
+    CHECK(n > 0 && strcmp(e[0].path, paths[0]) == 0 && e[0].size == 1000 && e[0].time == T0,
+          "oldest %s %u", e[0].path, (unsigned)e[0].size);
+    CHECK(strstr(paths[0], "/2026/10/19/2026.10.19.06.00.00.wav") != NULL, "path %s", paths[0]);
+    clip_store_entry_t entry;
+    CHECK(clip_store_interrupted(&entry) == ESP_ERR_NOT_FOUND, "finished clip taken as interrupted");
+
+    /* Evict the oldest, then by score: 0 and 25 are class 0, 75 is class 1 */
+    CHECK(clip_store_victim(false, T0 + 3600, &entry) == ESP_OK && strcmp(entry.path, paths[0]) == 0,
+          "oldest victim %s", entry.path);
+    CHECK(clip_store_victim(false, T0 - 1, &entry) == ESP_ERR_NOT_FOUND, "victim newer than asked");
+    CHECK(clip_store_set_state(&e[0], CLIP_STORE_DELETED) == ESP_OK, "delete");
+    check_cursors("delete");
+    CHECK(clip_store_victim(true, T0 + 3600, &entry) == ESP_OK && strcmp(entry.path, paths[1]) == 0,
+          "score victim %s", entry.path);
+    CHECK(clip_store_set_state(&e[1], CLIP_STORE_DELETED) == ESP_OK, "delete");
+    CHECK(clip_store_set_state(&e[2], CLIP_STORE_DELETED) == ESP_OK, "delete");
+    CHECK(clip_store_victim(true, T0 + 3600, &entry) == ESP_OK && strcmp(entry.path, paths[3]) == 0,
+          "score victim after class 0 %s", entry.path);
+    check_cursors("score");
+
+    clip_store_uploaded(paths[5], false);
+    CHECK(clip_store_find(paths[5], &entry) == ESP_OK && entry.state == CLIP_STORE_UPLOADED, "uploaded");
+    CHECK(clip_store_set_state(&entry, CLIP_STORE_PENDING) == ESP_ERR_INVALID_ARG, "state moved back");
+    clip_store_uploaded(paths[5], true);
+    CHECK(clip_store_find(paths[5], &entry) == ESP_OK && entry.state == CLIP_STORE_DELETED, "removed");
+    clip_store_uploaded("/elsewhere/2026.10.19.06.00.00.wav", false);
+    CHECK(count(CLIP_STORE_PENDING) == 6 && count(CLIP_STORE_UPLOADED) == 0, "%d pending, %d uploaded",
+          count(CLIP_STORE_PENDING), count(CLIP_STORE_UPLOADED));
+    check_cursors("upload");
+
+    /* Names that are not clips, and paths outside the root */
+    snprintf(path, sizeof(path), "%s/2026/10/19/notes.txt", root);
+    CHECK(clip_store_open(path) == ESP_ERR_INVALID_ARG, "open of a non-clip name");
+    CHECK(clip_store_open("/elsewhere/2026.10.19.06.00.00.wav") == ESP_ERR_INVALID_ARG, "open outside the root");
+    reboot(false);
+    rm_rf(root);
+}
+
+static void test_interrupted(void)
+{
+    char root[ROOT_MAX], path[CLIP_STORE_PATH_MAX], done[CLIP_STORE_PATH_MAX];
+    make_root(root, sizeof(root));
+    boot(root, false);
+    record(0, 10, done);
+    clip_store_path(T0 + CLIP_SECONDS, ".wav", path, sizeof(path));
+    clip_store_open(path);
+    touch(path, 300);
+    check_cursors("open");
+    uint32_t records = s_store.records;
+
+    /* Power lost while recording, woken from deep sleep or cold */
+    for (int cold = 0; cold < 2; cold++) {
+        boot(root, !cold);
+        clip_store_entry_t entry;
+        CHECK(clip_store_interrupted(&entry) == ESP_OK && strcmp(entry.path, path) == 0
+              && entry.state == CLIP_STORE_RECORDING, "%s boot: interrupted %s", cold ? "cold" : "warm", entry.path);
+        CHECK(count(CLIP_STORE_PENDING) == 1, "%d pending with one recording", count(CLIP_STORE_PENDING));
+        CHECK(clip_store_victim(false, T0 + 3600, &entry) == ESP_OK && strcmp(entry.path, done) == 0,
+              "victim %s", entry.path);
+        check_cursors("interrupted");
+    }
+    clip_store_entry_t entry;
+    CHECK(clip_store_add(path, 200) == ESP_OK, "add the recovered clip");
+    CHECK(s_store.records == records, "recovered clip appended, %u records", (unsigned)s_store.records);
+    CHECK(clip_store_interrupted(&entry) == ESP_ERR_NOT_FOUND, "still interrupted");
+    CHECK(clip_store_find(path, &entry) == ESP_OK && entry.state == CLIP_STORE_PENDING && entry.size == 300
+          && entry.score == 200, "recovered clip %d %u %u", entry.state, (unsigned)entry.size, entry.score);
+    check_cursors("recovered");
+    reboot(false);
+    rm_rf(root);
+}
+
+static void test_torn(void)
+{
+    char root[ROOT_MAX], index[CLIP_STORE_PATH_MAX], paths[8][CLIP_STORE_PATH_MAX];
+    make_root(root, sizeof(root));
+    snprintf(index, sizeof(index), "%s/%s", root, CLIP_STORE_INDEX_NAME);
+    boot(root, false);
+    for (int i = 0; i < 6; i++) {
+        record(i, 128, paths[i]);
+    }
+
+    /* Power lost in the middle of an append: part of a record at the end */
+    clip_store_record_t torn;
+    _record("2026/10/19/2026.10.19.07.00.00.wav", CLIP_STORE_PENDING, 128, &torn);
+    FILE *f = fopen(index, "ab");
+    fwrite(&torn, 1, 40, f);
+    fclose(f);
+    for (int cold = 0; cold < 2; cold++) {
+        CHECK(boot(root, !cold) == ESP_OK, "init with a torn record");
+        CHECK(s_store.records == 6, "%s boot: %u records with a torn one", cold ? "cold" : "warm",
+              (unsigned)s_store.records);
+        clip_store_entry_t entry;
+        CHECK(clip_store_interrupted(&entry) == ESP_ERR_NOT_FOUND, "torn record taken as interrupted");
+    }
+    record(6, 128, paths[6]);
+    CHECK(file_size(index) == 7 * sizeof(clip_store_record_t), "torn record not overwritten: %ld bytes",
+          file_size(index));
+    CHECK(count(CLIP_STORE_PENDING) == 7, "%d pending after the torn record", count(CLIP_STORE_PENDING));
+
+    /* A record with a bad check (a sector written half) is skipped everywhere */
+    f = fopen(index, "r+b");
+    fseek(f, 0 * sizeof(clip_store_record_t) + 20, SEEK_SET);
+    fputc('#', f);
+    fclose(f);
+    boot(root, false);
+    clip_store_entry_t entry;
+    CHECK(count(CLIP_STORE_PENDING) == 6, "%d pending with a corrupt record", count(CLIP_STORE_PENDING));
+    CHECK(clip_store_find(paths[0], &entry) == ESP_ERR_NOT_FOUND, "corrupt record found");
+    CHECK(clip_store_victim(false, T0 + 3600, &entry) == ESP_OK && strcmp(entry.path, paths[1]) == 0,
+          "victim past the corrupt record %s", entry.path);
+    check_cursors("corrupt");
+    reboot(false);
+    rm_rf(root);
+}
+
+static void test_hint(void)
+{
+    char root[ROOT_MAX], other[ROOT_MAX], path[CLIP_STORE_PATH_MAX];
+    make_root(root, sizeof(root));
+    make_root(other, sizeof(other));
+    boot(root, false);
+    for (int i = 0; i < 20; i++) {
+        record(i, 128, path);
+    }
+    clip_store_entry_t e[4];
+    clip_store_list(CLIP_STORE_PENDING, e, 4);
+    for (int i = 0; i < 4; i++) {
+        clip_store_set_state(&e[i], CLIP_STORE_DELETED);
+    }
+    uint32_t live = s_store.cursor[CLIP_STORE_CURSOR_LIVE];
+    CHECK(live == 4, "first live %u", (unsigned)live);
+
+    /* Deep sleep: the cursors come from RTC memory, no pass over the index */
+    s_hint.cursor[CLIP_STORE_CURSOR_LIVE] = live + 1;
+    boot(root, true);
+    CHECK(s_store.cursor[CLIP_STORE_CURSOR_LIVE] == live + 1, "hint not used");
+
+    /* The index changed behind the hint: one more record */
+    clip_store_path(T0 + 20 * CLIP_SECONDS, ".wav", path, sizeof(path));
+    clip_store_add(path, 128);
+    s_hint.cursor[CLIP_STORE_CURSOR_LIVE] = live + 1;
+    s_hint.records--;
+    boot(root, true);
+    CHECK(s_store.cursor[CLIP_STORE_CURSOR_LIVE] == live, "hint for a shorter index used");
+
+    /* Another card with as many records, all pending: the hint is not its */
+    reboot(false);
+    clip_store_init(other);
+    for (int i = 0; i < 21; i++) {
+        record(1000 + i, 128, path);
+    }
+    boot(root, false);
+    CHECK(s_hint.records == 21, "%u records", (unsigned)s_hint.records);
+    boot(other, true);
+    CHECK(s_store.cursor[CLIP_STORE_CURSOR_LIVE] == 0 && s_store.cursor[CLIP_STORE_CURSOR_PENDING] == 0,
+          "hint of another card used: live %u, pending %u", (unsigned)s_store.cursor[CLIP_STORE_CURSOR_LIVE],
+          (unsigned)s_store.cursor[CLIP_STORE_CURSOR_PENDING]);
+    CHECK(count(CLIP_STORE_PENDING) == 21, "%d of 21 pending on the other card", count(CLIP_STORE_PENDING));
+    check_cursors("other card");
+    reboot(false);
+    rm_rf(root);
+    rm_rf(other);
+}
+
+static void test_compact(void)
+{
+    char root[ROOT_MAX], index[CLIP_STORE_PATH_MAX], tmp[CLIP_STORE_PATH_MAX], paths[100][CLIP_STORE_PATH_MAX];
+    make_root(root, sizeof(root));
+    snprintf(index, sizeof(index), "%s/%s", root, CLIP_STORE_INDEX_NAME);
+    snprintf(tmp, sizeof(tmp), "%s/%s", root, CLIP_STORE_TMP_NAME);
+    boot(root, false);
+    for (int i = 0; i < 100; i++) {
+        record(i, 128, paths[i]);
+    }
+    /* Evicted in order, as retention does, plus a few in the middle */
+    clip_store_entry_t entry;
+    for (int i = 0; i < 80; i++) {
+        clip_store_victim(false, T0 + 100 * CLIP_SECONDS, &entry);
+        clip_store_set_state(&entry, CLIP_STORE_DELETED);
+    }
+    clip_store_find(paths[90], &entry);
+    clip_store_set_state(&entry, CLIP_STORE_DELETED);
+    clip_store_find(paths[85], &entry);
+    clip_store_set_state(&entry, CLIP_STORE_UPLOADED);
+    check_cursors("evicted");
+    CHECK(s_store.cursor[CLIP_STORE_CURSOR_LIVE] == 80, "first live %u", (unsigned)s_store.cursor[CLIP_STORE_CURSOR_LIVE]);
+
+    /* Warm or cold, init drops the deleted records in front and in the middle */
+    boot(root, true);
+    CHECK(s_store.records == 19, "%u records after compaction", (unsigned)s_store.records);
+    CHECK(file_size(index) == 19 * sizeof(clip_store_record_t), "index of %ld bytes", file_size(index));
+    CHECK(file_size(tmp) == -1, "clips.tmp left behind");
+    CHECK(count(CLIP_STORE_PENDING) == 18 && count(CLIP_STORE_UPLOADED) == 1, "%d pending, %d uploaded",
+          count(CLIP_STORE_PENDING), count(CLIP_STORE_UPLOADED));
+    CHECK(clip_store_victim(false, T0 + 100 * CLIP_SECONDS, &entry) == ESP_OK && strcmp(entry.path, paths[80]) == 0
+          && entry.record == 0, "victim after compaction %s at %u", entry.path, (unsigned)entry.record);
+    CHECK(clip_store_find(paths[99], &entry) == ESP_OK && entry.record == 18, "newest at %u", (unsigned)entry.record);
+    check_cursors("compacted");
+    CHECK(boot(root, true) == ESP_OK && s_store.cursor[CLIP_STORE_CURSOR_LIVE] == 0, "hint after compaction");
+    check_cursors("hint after compaction");
+
+    /* Cut short between unlink and rename: only clips.tmp is there */
+    reboot(true);
+    rename(index, tmp);
+    CHECK(boot(root, true) == ESP_OK && s_store.records == 19, "compaction finished at init: %u records",
+          (unsigned)s_store.records);
+    CHECK(file_size(tmp) == -1 && file_size(index) > 0, "clips.tmp not renamed");
+
+    /* Cut short before the unlink: the index is whole, clips.tmp is ignored */
+    reboot(true);
+    touch(tmp, 100);
+    CHECK(boot(root, false) == ESP_OK && s_store.records == 19 && count(CLIP_STORE_PENDING) == 18,
+          "stale clips.tmp: %u records", (unsigned)s_store.records);
+    check_cursors("stale tmp");
+
+    /* Fewer deleted records in front than CLIP_STORE_COMPACT_RECORDS: left alone */
+    for (int i = 0; i < 10; i++) {
+        clip_store_victim(false, T0 + 100 * CLIP_SECONDS, &entry);
+        clip_store_set_state(&entry, CLIP_STORE_DELETED);
+    }
+    boot(root, false);
+    CHECK(s_store.records == 19, "compacted below the threshold: %u records", (unsigned)s_store.records);
+    reboot(false);
+    rm_rf(root);
+}
+
+static void test_migrate(void)
+{
+    char root[ROOT_MAX], path[CLIP_STORE_PATH_MAX];
+    make_root(root, sizeof(root));
+    /* More than one batch of the flat layout, plus files that are not clips */
+    for (int i = 0; i < CLIP_STORE_MIGRATE_BATCH + 8; i++) {
+        time_t t = T0 + (time_t)i * 3600;
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        char name[32];
+        strftime(name, sizeof(name), "%Y.%m.%d.%H.%M.%S.wav", &tm);
+        snprintf(path, sizeof(path), "%s/%s", root, name);
+        touch(path, 44);
+    }
+    snprintf(path, sizeof(path), "%s/notes.txt", root);
+    touch(path, 1);
+    snprintf(path, sizeof(path), "%s/2026.10.19.wav", root);
+    touch(path, 1);
+
+    CHECK(boot(root, false) == ESP_OK, "init on the flat layout");
+    int n = count(CLIP_STORE_PENDING);
+    CHECK(n == CLIP_STORE_MIGRATE_BATCH + 8, "%d clips indexed", n);
+    snprintf(path, sizeof(path), "%s/2026/10/20/2026.10.20.15.00.00.wav", root);
+    CHECK(file_size(path) == 44, "%s not moved", path);
+    snprintf(path, sizeof(path), "%s/2026.10.19.06.00.00.wav", root);
+    CHECK(file_size(path) == -1, "%s left in the root", path);
+    snprintf(path, sizeof(path), "%s/notes.txt", root);
+    CHECK(file_size(path) == 1, "notes.txt moved");
+    snprintf(path, sizeof(path), "%s/2026.10.19.wav", root);
+    CHECK(file_size(path) == 1, "2026.10.19.wav moved");
+    check_cursors("migrated");
+    reboot(false);
+    rm_rf(root);
+}
+
+static double ms_since(int64_t start)
+{
+    return (esp_timer_get_time() - start) / 1000.0;
+}
+
+static void bench(int files)
+{
+    char root[ROOT_MAX], path[CLIP_STORE_PATH_MAX];
+    make_root(root, sizeof(root));
+    reboot(false);
+    /* The layout only, so the rebuild at init is measured */
+    clip_store_init(root);
+    for (int i = 0; i < files; i++) {
+        clip_store_path(T0 + (time_t)i * CLIP_SECONDS, ".wav", path, sizeof(path));
+        touch(path, 0);
+    }
+    reboot(false);
+    snprintf(path, sizeof(path), "%s/%s", root, CLIP_STORE_INDEX_NAME);
+    unlink(path);
+    printf("\nclip_store, %d clips in %d day directories\n", files, files / (86400 / CLIP_SECONDS) + 1);
+
+    int64_t start = esp_timer_get_time();
+    clip_store_init(root);
+    printf("  rebuild from the day directories  %9.1f ms\n", ms_since(start));
+    CHECK(s_store.records == files, "%u of %d clips indexed", (unsigned)s_store.records, files);
+    start = esp_timer_get_time();
+    boot(root, false);
+    printf("  cold init, one pass               %9.1f ms\n", ms_since(start));
+    start = esp_timer_get_time();
+    boot(root, true);
+    printf("  warm init, RTC hint               %9.3f ms\n", ms_since(start));
+
+    /* The last record, what the uploader looks up after a put (a rebuild is in directory order) */
+    clip_store_entry_t entry, list[16];
+    clip_store_record_t last;
+    _read(s_store.records - 1, &last, 1);
+    snprintf(path, sizeof(path), "%s/%s", root, last.name);
+    CHECK(clip_store_find(path, &entry) == ESP_OK, "last record %s not found", path);
+    int reps = 1000;
+    start = esp_timer_get_time();
+    for (int i = 0; i < reps; i++) {
+        clip_store_find(path, &entry);
+    }
+    printf("  find the last record              %9.2f us\n", ms_since(start) * 1000 / reps);
+    start = esp_timer_get_time();
+    for (int i = 0; i < reps; i++) {
+        clip_store_list(CLIP_STORE_PENDING, list, 16);
+    }
+    printf("  list 16 oldest pending            %9.2f us\n", ms_since(start) * 1000 / reps);
+
+    /* Retention evicting 90% oldest first */
+    int evict = files / 10 * 9;
+    start = esp_timer_get_time();
+    for (int i = 0; i < evict; i++) {
+        if (clip_store_victim(false, T0 + (time_t)files * CLIP_SECONDS, &entry) != ESP_OK
+            || clip_store_set_state(&entry, CLIP_STORE_DELETED) != ESP_OK) {
+            break;
+        }
+    }
+    double ms = ms_since(start);
+    printf("  evict %6d, victim + delete     %9.2f us each\n", evict, ms * 1000 / evict);
+    CHECK(s_store.cursor[CLIP_STORE_CURSOR_LIVE] == evict, "first live %u after evicting %d",
+          (unsigned)s_store.cursor[CLIP_STORE_CURSOR_LIVE], evict);
+    start = esp_timer_get_time();
+    boot(root, true);
+    printf("  init compacting to %6d records %9.1f ms\n", (int)s_store.records, ms_since(start));
+    CHECK(s_store.records == files - evict, "%u records after compaction", (unsigned)s_store.records);
+    check_cursors("bench");
+    reboot(false);
+    rm_rf(root);
+}
+
+int main(int argc, char **argv)
+{
+    int files = 100000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench-files") == 0 && i + 1 < argc) {
+            files = atoi(argv[++i]);
+        }
+    }
+    setenv("TZ", "UTC", 1);
+    tzset();
+    esp_log_level_set("*", ESP_LOG_WARN);
+    test_lifecycle();
+    test_interrupted();
+    test_torn();
+    test_hint();
+    test_compact();
+    test_migrate();
+    if (files > 0) {
+        bench(files);
+    }
+    printf("%d checks, %d failed\n", s_run, s_failed);
+    return s_failed ? 1 : 0;
+}
@@ -0,0 +1,450 @@
+/*
+ * test_feature_fft - feature_extractor's fixed-point path against double
+ *
+ * _fft_q15() is compared bin by bin with a double precision FFT of the same
+ * input, at every supported size and from full scale down to a few LSB. Then
+ * _process_frame() (Q15 Hann window, block floating point shift, FFT, Q15 mel
+ * weights) is compared band by band in dB with a double precision mel
+ * filterbank. This is the error that lands in the .mel records. Also covered:
+ *   - the Q15 twiddle table against cos / -sin
+ *   - quiet frames keeping the accuracy of loud ones through the block
+ *     floating point shift, and the FFT without the shift for comparison
+ *   - the triangle weights of every band fitting weights[n + mel_bands],
+ *     and every band staying inside the FFT output, over a sweep of sizes,
+ *     band counts, sample rates and frequency ranges
+ */
+
+#include <complex.h>
+#include "feature_extractor.c"
+
+static int s_failed;
+static int s_run;
+
+#define CHECK(cond, ...) do {                               \
+    s_run++;                                                \
+    if (!(cond)) {                                          \
+        s_failed++;                                         \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+        printf(__VA_ARGS__);                                \
+        printf("\n");                                       \
+    }                                                       \
+} while (0)
+
+static uint32_t s_rng = 1;
+
+/* Uniform in [-1, 1) */
+static double rng_unit(void)
+{
+    s_rng = s_rng * 1664525u + 1013904223u;
+    return (double)(s_rng >> 8) / (1 << 23) - 1.0;
+}
+
+static void fft_ref(double complex *x, int n)
+{
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            double complex t = x[i];
+            x[i] = x[j];
+            x[j] = t;
+        }
+    }
+    for (int len = 2; len <= n; len <<= 1) {
+        for (int i = 0; i < n; i += len) {
+            for (int k = 0; k < len / 2; k++) {
+                double complex w = cexp(-2 * M_PI * I * k / len);
+                double complex a = x[i + k];
+                double complex b = x[i + k + len / 2] * w;
+                x[i + k] = a + b;
+                x[i + k + len / 2] = a - b;
+            }
+        }
+    }
+}
+
+static feature_extractor_t *fe_new(int fft_size, int mel_bands, int sample_rate, int fmin_hz, int fmax_hz)
+{
+    feature_extractor_t *fe = calloc(1, sizeof(feature_extractor_t));
+    fe->fft_size = fft_size;
+    fe->mel_bands = mel_bands;
+    fe->frames_per_record = 1 << 30;
+    if (_build_tables(fe, sample_rate, fmin_hz, fmax_hz) != ESP_OK) {
+        free(fe);
+        return NULL;
+    }
+    return fe;
+}
+
+static void fe_free(feature_extractor_t *fe)
+{
+    _free_tables(fe);
+    free(fe);
+}
+
+typedef enum {
+    SIG_SINE_ON_BIN,
+    SIG_SINE_OFF_BIN,
+    SIG_NOISE,
+    SIG_TWO_TONES,
+    SIG_IMPULSE,
+    SIG_DC,
+} signal_t;
+
+static const char *s_signal_names[] = {"sine on bin", "sine off bin", "noise", "two tones", "impulse", "dc"};
+
+/* n samples at peak amplitude a (int16 units) */
+static void make_signal(int16_t *x, int n, signal_t sig, double a)
+{
+    for (int i = 0; i < n; i++) {
+        double v;
+        switch (sig) {
+        case SIG_SINE_ON_BIN:
+            v = sin(2 * M_PI * (n / 16) * i / n);
+            break;
+        case SIG_SINE_OFF_BIN:
+            v = sin(2 * M_PI * (n / 10 + 0.37) * i / n + 0.3);
+            break;
+        case SIG_NOISE:
+            v = rng_unit();
+            break;
+        case SIG_TWO_TONES:
+            v = 0.9 * sin(2 * M_PI * (n / 32 + 0.25) * i / n) + 0.1 * sin(2 * M_PI * (n / 5 + 0.5) * i / n);
+            break;
+        case SIG_IMPULSE:
+            v = i == n / 3 ? 1 : 0;
+            break;
+        default:
+            v = 1;
+            break;
+        }
+        x[i] = (int16_t)lrint(a * v);
+    }
+}
+
+/* Signal to error ratio of the Q15 FFT of x over the double FFT, in dB */
+static double fft_snr(const int16_t *x, int n, const int16_t *tw)
+{
+    int16_t *q = malloc(2 * n * sizeof(int16_t));
+    double complex *r = malloc(n * sizeof(double complex));
+    for (int i = 0; i < n; i++) {
+        q[2 * i] = x[i];
+        q[2 * i + 1] = 0;
+        r[i] = x[i];
+    }
+    _fft_q15(q, tw, n);
+    fft_ref(r, n);
+    double sig = 0, err = 0;
+    for (int k = 0; k < n; k++) {
+        double complex ref = r[k] / n;
+        double complex e = (q[2 * k] + I * q[2 * k + 1]) - ref;
+        sig += creal(ref) * creal(ref) + cimag(ref) * cimag(ref);
+        err += creal(e) * creal(e) + cimag(e) * cimag(e);
+    }
+    free(q);
+    free(r);
+    return err > 0 ? 10 * log10(sig / err) : 200;
+}
+
+static void test_twiddles(void)
+{
+    for (int n = 16; n <= FEATURE_EXTRACTOR_MAX_FFT_SIZE; n <<= 1) {
+        feature_extractor_t *fe = fe_new(n, 1, 16000, 0, 8000);
+        double max_err = 0;
+        for (int i = 0; i < n / 2; i++) {
+            double c = 32767 * cos(2 * M_PI * i / n);
+            double s = -32767 * sin(2 * M_PI * i / n);
+            max_err = fmax(max_err, fmax(fabs(fe->twiddle[2 * i] - c), fabs(fe->twiddle[2 * i + 1] - s)));
+        }
+        /* Rounded to nearest, up to the precision of cosf / sinf */
+        CHECK(max_err <= 0.51, "n %d: twiddle off by %.2f LSB", n, max_err);
+        CHECK(fe->twiddle[0] == 32767 && fe->twiddle[1] == 0 && fe->twiddle[n / 2] == 0 && fe->twiddle[n / 2 + 1] == -32767,
+              "n %d: twiddles at 0 and pi/2", n);
+        fe_free(fe);
+    }
+}
+
+static void test_fft(void)
+{
+    printf("_fft_q15 against double, signal to error in dB (input peak 16384 as after the shift)\n");
+    printf("%6s", "n");
+    for (int s = 0; s <= SIG_DC; s++) {
+        printf(" %13s", s_signal_names[s]);
+    }
+    printf("\n");
+    for (int n = 16; n <= FEATURE_EXTRACTOR_MAX_FFT_SIZE; n <<= 1) {
+        feature_extractor_t *fe = fe_new(n, 1, 16000, 0, 8000);
+        int16_t *x = malloc(n * sizeof(int16_t));
+        printf("%6d", n);
+        for (int s = 0; s <= SIG_DC; s++) {
+            make_signal(x, n, s, 16383);
+            double snr = fft_snr(x, n, fe->twiddle);
+            printf(" %13.1f", snr);
+            /* Output power per bin is the input power / n, the rounding noise at most 4 LSB^2 */
+            double power = 0;
+            for (int i = 0; i < n; i++) {
+                power += (double)x[i] * x[i];
+            }
+            double floor_db = 10 * log10(power / n / n / 4);
+            CHECK(snr >= floor_db, "n %d %s: %.1f dB, expected %.1f", n, s_signal_names[s], snr, floor_db);
+        }
+        printf("\n");
+        free(x);
+        fe_free(fe);
+    }
+}
+
+/* The mel energy of every band in double: Hann, FFT, triangles */
+static void mel_ref(const int16_t *x, int n, int bands, int sample_rate, int fmin_hz, int fmax_hz, double *out)
+{
+    double complex *r = malloc(n * sizeof(double complex));
+    for (int i = 0; i < n; i++) {
+        r[i] = x[i] * 0.5 * (1 - cos(2 * M_PI * i / n));
+    }
+    fft_ref(r, n);
+    double bin_hz = (double)sample_rate / n;
+    double mel_lo = 2595 * log10(1 + fmin_hz / 700.0);
+    double mel_hi = 2595 * log10(1 + fmax_hz / 700.0);
+    for (int m = 0; m < bands; m++) {
+        double f[3];
+        for (int j = 0; j < 3; j++) {
+            f[j] = 700 * (pow(10, (mel_lo + (mel_hi - mel_lo) * (m + j) / (bands + 1)) / 2595) - 1);
+        }
+        double e = 0;
+        int hits = 0;
+        for (int k = 0; k <= n / 2; k++) {
+            double fk = k * bin_hz;
+            if (fk < f[0] || fk > f[2]) {
+                continue;
+            }
+            double w = fk <= f[1] ? (fk - f[0]) / (f[1] - f[0]) : (f[2] - fk) / (f[2] - f[1]);
+            double complex v = r[k] / n;
+            e += w * (creal(v) * creal(v) + cimag(v) * cimag(v));
+            hits++;
+        }
+        if (hits == 0) {
+            double complex v = r[(int)lrint(f[1] / bin_hz)] / n;
+            e = creal(v) * creal(v) + cimag(v) * cimag(v);
+        }
+        out[m] = e;
+    }
+    free(r);
+}
+
+/*
+ * Largest band error in dB over the bands within range_db of the loudest
+ * one. Quieter bands hold only window leakage and rounding noise.
+ */
+static double mel_error(feature_extractor_t *fe, const int16_t *x, int sample_rate, int fmin_hz, int fmax_hz,
+                        double range_db, int *compared)
+{
+    int n = fe->fft_size;
+    memcpy(fe->frame, x, n * sizeof(int16_t));
+    memset(fe->acc, 0, sizeof(fe->acc));
+    fe->acc_frames = 0;
+    _process_frame(fe);
+    double ref[FEATURE_EXTRACTOR_MAX_BANDS];
+    mel_ref(x, n, fe->mel_bands, sample_rate, fmin_hz, fmax_hz, ref);
+    double top = 0;
+    for (int m = 0; m < fe->mel_bands; m++) {
+        top = fmax(top, ref[m]);
+    }
+    double worst = 0;
+    *compared = 0;
+    for (int m = 0; m < fe->mel_bands; m++) {
+        if (ref[m] <= 0 || 10 * log10(top / ref[m]) > range_db) {
+            continue;
+        }
+        double err = fe->acc[m] > 0 ? 10 * log10(fe->acc[m] / ref[m]) : -200;
+        worst = fmax(worst, fabs(err));
+        (*compared)++;
+    }
+    return worst;
+}
+
+static void test_mel(void)
+{
+    const int rate = 16000, fmin = 50, fmax = 8000;
+    printf("\nmel bands against double, largest error in dB of the bands within 40 dB of the loudest\n");
+    printf("%6s %7s", "n", "dBFS");
+    for (int s = 0; s < SIG_DC; s++) {
+        printf(" %13s", s_signal_names[s]);
+    }
+    printf("\n");
+    for (int n = 256; n <= FEATURE_EXTRACTOR_MAX_FFT_SIZE; n <<= 1) {
+        feature_extractor_t *fe = fe_new(n, 40, rate, fmin, fmax);
+        int16_t *x = malloc(n * sizeof(int16_t));
+        /* Full scale down to peaks of 16 LSB: the shift keeps every level alike */
+        for (int dbfs = 0; dbfs >= -66; dbfs -= 22) {
+            printf("%6d %7d", n, dbfs);
+            /* DC has no energy above fmin, only rounding noise to compare */
+            for (int s = 0; s < SIG_DC; s++) {
+                make_signal(x, n, s, 32767 * pow(10, dbfs / 20.0));
+                int compared;
+                double err = mel_error(fe, x, rate, fmin, fmax, 40, &compared);
+                printf(" %13.3f", err);
+                CHECK(compared > 0, "n %d %d dBFS %s: no band compared", n, dbfs, s_signal_names[s]);
+                CHECK(err < 0.5, "n %d %d dBFS %s: %.3f dB off", n, dbfs, s_signal_names[s], err);
+            }
+            printf("\n");
+        }
+        free(x);
+        fe_free(fe);
+    }
+
+    /* Frames of silence give zero energy, not a NaN from the shift */
+    feature_extractor_t *fe = fe_new(1024, 40, rate, fmin, fmax);
+    memset(fe->frame, 0, 1024 * sizeof(int16_t));
+    memset(fe->acc, 0, sizeof(fe->acc));
+    _process_frame(fe);
+    float sum = 0;
+    for (int m = 0; m < 40; m++) {
+        sum += fe->acc[m];
+    }
+    CHECK(sum == 0, "silence gave %g", sum);
+    fe_free(fe);
+}
+
+/* Signal to error ratio of an FFT output over the double FFT of the exact input, in dB */
+static double snr_exact(const int16_t *out, const double *in, int n)
+{
+    double complex *r = malloc(n * sizeof(double complex));
+    for (int i = 0; i < n; i++) {
+        r[i] = in[i];
+    }
+    fft_ref(r, n);
+    double sig = 0, err = 0;
+    for (int k = 0; k < n; k++) {
+        double complex ref = r[k] / n;
+        double complex e = (out[2 * k] + I * out[2 * k + 1]) - ref;
+        sig += creal(ref) * creal(ref) + cimag(ref) * cimag(ref);
+        err += creal(e) * creal(e) + cimag(e) * cimag(e);
+    }
+    free(r);
+    return err > 0 ? 10 * log10(sig / err) : 200;
+}
+
+/*
+ * The shift: a noise frame at falling levels through _process_frame(),
+ * against the exact windowed frame. For comparison the FFT of the
+ * product rounded to 16 bits first, unshifted and shifted after the
+ * rounding. Without the shift a -60 dBFS frame keeps a few bits.
+ */
+static void test_block_floating_point(void)
+{
+    int n = 1024;
+    feature_extractor_t *fe = fe_new(n, 40, 16000, 50, 8000);
+    int16_t *q = malloc(2 * n * sizeof(int16_t));
+    double *exact = malloc(n * sizeof(double));
+    printf("\nnoise frame, FFT signal to error in dB against the exact windowed frame\n");
+    printf("%7s %6s %9s %9s %13s\n", "dBFS", "shift", "element", "unshifted", "shift after");
+    double ref_snr = 0;
+    for (int dbfs = 0; dbfs >= -84; dbfs -= 12) {
+        make_signal(fe->frame, n, SIG_NOISE, 32767 * pow(10, dbfs / 20.0));
+        int32_t peak = 0;
+        for (int i = 0; i < n; i++) {
+            int32_t p = fe->frame[i] * fe->window[i];
+            peak = abs(p) > peak ? abs(p) : peak;
+        }
+        /* Largest shift that keeps the FFT input under 16384 */
+        int shift = 0;
+        while (shift < 15 && (peak >> (15 - shift - 1)) < 16384) {
+            shift++;
+        }
+        for (int i = 0; i < n; i++) {
+            exact[i] = fe->frame[i] * fe->window[i] / 32768.0;
+        }
+        /* Rounded to 16 bits first, then shifted or not */
+        int rounded_peak = 0;
+        for (int i = 0; i < n; i++) {
+            q[2 * i] = (int16_t)((fe->frame[i] * fe->window[i]) >> 15);
+            q[2 * i + 1] = 0;
+            rounded_peak |= abs(q[2 * i]);
+        }
+        int late_shift = 0;
+        while (rounded_peak && (rounded_peak << (late_shift + 1)) < 16384) {
+            late_shift++;
+        }
+        _fft_q15(q, fe->twiddle, n);
+        double unshifted = snr_exact(q, exact, n);
+        for (int i = 0; i < n; i++) {
+            q[2 * i] = (int16_t)(((fe->frame[i] * fe->window[i]) >> 15) << late_shift);
+            q[2 * i + 1] = 0;
+        }
+        _fft_q15(q, fe->twiddle, n);
+        for (int i = 0; i < n; i++) {
+            exact[i] *= 1 << late_shift;
+        }
+        double late = snr_exact(q, exact, n);
+
+        memset(fe->acc, 0, sizeof(fe->acc));
+        _process_frame(fe);
+        for (int i = 0; i < n; i++) {
+            exact[i] = fe->frame[i] * fe->window[i] / 32768.0 * (1 << shift);
+        }
+        double element = snr_exact(fe->cplx, exact, n);
+        printf("%7d %6d %9.1f %9.1f %13.1f\n", dbfs, shift, element, unshifted, late);
+        if (dbfs == -12) {
+            ref_snr = element;
+        }
+        /* Normalised frames come out alike, within the factor of two of the shift */
+        CHECK(dbfs > -12 || element > ref_snr - 7, "%d dBFS: %.1f dB, %.1f at -12 dBFS", dbfs, element, ref_snr);
+        CHECK(element >= late - 0.5, "%d dBFS: %.1f dB, %.1f shifting after the rounding", dbfs, element, late);
+    }
+    free(q);
+    free(exact);
+    fe_free(fe);
+}
+
+/* weights[] holds n + mel_bands entries, every band has to fit */
+static void test_band_tables(void)
+{
+    static const int rates[] = {8000, 16000, 22050, 32000, 44100, 48000};
+    static const int fmins[] = {0, 20, 50, 300};
+    int configs = 0, worst_slack = 1 << 30;
+    for (int n = 64; n <= FEATURE_EXTRACTOR_MAX_FFT_SIZE; n <<= 1) {
+        for (int r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+            int fmaxs[] = {rates[r] / 2, 4000, rates[r] / 2 - 1};
+            for (int a = 0; a < sizeof(fmins) / sizeof(fmins[0]); a++) {
+                for (int b = 0; b < sizeof(fmaxs) / sizeof(fmaxs[0]); b++) {
+                    if (fmaxs[b] > rates[r] / 2 || fmins[a] >= fmaxs[b]) {
+                        continue;
+                    }
+                    for (int bands = 1; bands <= FEATURE_EXTRACTOR_MAX_BANDS; bands++) {
+                        feature_extractor_t *fe = fe_new(n, bands, rates[r], fmins[a], fmaxs[b]);
+                        int used = 0;
+                        bool inside = true;
+                        for (int m = 0; m < bands; m++) {
+                            const feature_band_t *band = &fe->bands[m];
+                            used = band->weight + band->len > used ? band->weight + band->len : used;
+                            inside &= band->len > 0 && band->bin + band->len - 1 <= n / 2;
+                        }
+                        configs++;
+                        int slack = n + bands - used;
+                        worst_slack = slack < worst_slack ? slack : worst_slack;
+                        CHECK(used <= n + bands, "n %d, %d bands, %d Hz, %d-%d Hz: %d weights for %d",
+                              n, bands, rates[r], fmins[a], fmaxs[b], used, n + bands);
+                        CHECK(inside, "n %d, %d bands, %d Hz, %d-%d Hz: band outside the FFT output",
+                              n, bands, rates[r], fmins[a], fmaxs[b]);
+                        fe_free(fe);
+                    }
+                }
+            }
+        }
+    }
+    printf("\nband tables: %d configurations, weights[] spare entries at least %d\n", configs, worst_slack);
+}
+
+int main(void)
+{
+    test_twiddles();
+    test_fft();
+    test_mel();
+    test_block_floating_point();
+    test_band_tables();
+    printf("%d checks, %d failed\n", s_run, s_failed);
+    return s_failed ? 1 : 0;
+}
@@ -0,0 +1,303 @@
+/*
+ * test_ftp_block - FTP_CLIENT_BLOCKMODE (MODE B) over the loopback server
+ *
+ * Stores a batch of small files in stream mode and in MODE B, reads them
+ * back and reports files/s with the data connections each needed. MODE B
+ * must carry the whole batch over one connection. Then the servers the
+ * client falls back from: one without MODE B, one that answers 425 after a
+ * few transfers on a connection, one that closes an idle kept connection.
+ * Last, a write cut short inside a block: the client must drop the data
+ * connection rather than send the EOF block after a partial block, and the
+ * next transfer must work on a new one.
+ *
+ *   test_ftp_block [--files N]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ftw.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "ftp_loopback.h"
+
+/* Cut the next send of at least s_cut_min bytes in half */
+static int s_cut_min;
+
+static ssize_t cut_send(int fd, const void *buf, size_t len, int flags)
+{
+    if (s_cut_min && len >= (size_t)s_cut_min) {
+        s_cut_min = 0;
+        return send(fd, buf, len / 2, flags);
+    }
+    return send(fd, buf, len, flags);
+}
+
+#define send                                cut_send
+#include "FtpClient.c"
+#undef send
+
+static int s_failed;
+static int s_run;
+
+#define CHECK(cond, ...) do {                               \
+    s_run++;                                                \
+    if (!(cond)) {                                          \
+        s_failed++;                                         \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+        printf(__VA_ARGS__);                                \
+        printf("\n");                                       \
+    }                                                       \
+} while (0)
+
+#define KIB                                 1024L
+
+static char s_root[] = "/tmp/ftp_block.XXXXXX";
+static uint8_t s_buf[256 * KIB];
+
+static int _rm(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+/* Content of file i, so a file landing in another's place is caught */
+static void fill(int i, long size)
+{
+    for (long j = 0; j < size; j++) {
+        s_buf[j] = (uint8_t)(i * 31 + j * 7 + (j >> 11));
+    }
+}
+
+static NetBuf_t *session(ftp_loopback_handle_t srv, int block)
+{
+    FtpClient *ftp = getFtpClient();
+    NetBuf_t *ctrl = NULL;
+    if (!ftp->ftpClientConnect("127.0.0.1", ftp_loopback_port(srv), &ctrl)) {
+        return NULL;
+    }
+    if (!ftp->ftpClientLogin("test", "test", ctrl) || !ftp->ftpClientSetOptions(FTP_CLIENT_BLOCKMODE, block, ctrl)) {
+        ftp->ftpClientQuit(ctrl);
+        return NULL;
+    }
+    return ctrl;
+}
+
+/* Store file i of size bytes, in chunks as the upload worker writes */
+static bool put(NetBuf_t *ctrl, int i, long size)
+{
+    FtpClient *ftp = getFtpClient();
+    NetBuf_t *data = NULL;
+    char name[32];
+    snprintf(name, sizeof(name), "f%04d.bin", i);
+    fill(i, size);
+    if (!ftp->ftpClientAccess(name, FTP_CLIENT_FILE_WRITE, FTP_CLIENT_BINARY, ctrl, &data)) {
+        return false;
+    }
+    bool ok = true;
+    for (long off = 0; ok && off < size; off += FTP_CLIENT_BUFFER_SIZE) {
+        int n = size - off < FTP_CLIENT_BUFFER_SIZE ? size - off : FTP_CLIENT_BUFFER_SIZE;
+        ok = ftp->ftpClientWrite(s_buf + off, n, data) == n;
+    }
+    return ftp->ftpClientClose(data) && ok;
+}
+
+/* Read file i back and compare it */
+static bool get(NetBuf_t *ctrl, int i, long size)
+{
+    FtpClient *ftp = getFtpClient();
+    NetBuf_t *data = NULL;
+    char name[32];
+    static uint8_t in[sizeof(s_buf) + 1];
+    snprintf(name, sizeof(name), "f%04d.bin", i);
+    if (!ftp->ftpClientAccess(name, FTP_CLIENT_FILE_READ, FTP_CLIENT_BINARY, ctrl, &data)) {
+        return false;
+    }
+    long got = 0;
+    int n;
+    while (got < (long)sizeof(in) && (n = ftp->ftpClientRead(in + got, sizeof(in) - got, data)) > 0) {
+        got += n;
+    }
+    bool closed = ftp->ftpClientClose(data);
+    fill(i, size);
+    return closed && got == size && memcmp(in, s_buf, size) == 0;
+}
+
+/* Size of file i on the server, -1 when it is missing */
+static long stored_size(int i)
+{
+    char path[256];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/f%04d.bin", s_root, i);
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+static void bench(ftp_loopback_handle_t srv, int block, long size, int files)
+{
+    FtpClient *ftp = getFtpClient();
+    NetBuf_t *ctrl = session(srv, block);
+    CHECK(ctrl != NULL, "session");
+    if (ctrl == NULL) {
+        return;
+    }
+    int put_ok = 0, get_ok = 0;
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < files; i++) {
+        put_ok += put(ctrl, i, size);
+    }
+    int64_t put_us = esp_timer_get_time() - start;
+    start = esp_timer_get_time();
+    for (int i = 0; i < files; i++) {
+        get_ok += get(ctrl, i, size);
+    }
+    int64_t get_us = esp_timer_get_time() - start;
+    FtpClientTimings_t t;
+    ftp->ftpClientGetTimings(&t, ctrl);
+    ftp->ftpClientQuit(ctrl);
+
+    int intact = 0;
+    for (int i = 0; i < files; i++) {
+        intact += stored_size(i) == size;
+    }
+    CHECK(put_ok == files && intact == files, "%s %ld B: %d stored, %d intact of %d", block ? "block" : "stream",
+          size, put_ok, intact, files);
+    CHECK(get_ok == files, "%s %ld B: %d of %d read back intact", block ? "block" : "stream", size, get_ok, files);
+    if (block) {
+        CHECK(t.dataConnects == 1 && t.dataReused == 2u * files - 1, "block: %u data connections, %u reused",
+              t.dataConnects, t.dataReused);
+    } else {
+        CHECK(t.dataConnects == 2u * files && t.dataReused == 0, "stream: %u data connections", t.dataConnects);
+    }
+    printf("  %-6s %8ld %6d %10.0f %10.0f %8.2f %8u %8u\n", block ? "block" : "stream", size, files,
+           files * 1e6 / put_us, files * 1e6 / get_us, 2.0 * files * size / (put_us + get_us), t.dataConnects,
+           t.dataReused);
+}
+
+/* Store files on a server set up as cfg, count the data connections they took */
+static void fallback(const char *label, const ftp_loopback_cfg_t *cfg, int files, int pause_ms,
+                     uint32_t connects)
+{
+    FtpClient *ftp = getFtpClient();
+    ftp_loopback_handle_t srv = ftp_loopback_start(cfg);
+    NetBuf_t *ctrl = srv ? session(srv, 1) : NULL;
+    CHECK(ctrl != NULL, "%s: session", label);
+    if (ctrl == NULL) {
+        ftp_loopback_stop(srv);
+        return;
+    }
+    int ok = 0;
+    for (int i = 0; i < files; i++) {
+        ok += put(ctrl, i, 3000 + i);
+        if (pause_ms) {
+            vTaskDelay(pdMS_TO_TICKS(pause_ms));
+        }
+    }
+    FtpClientTimings_t t;
+    ftp->ftpClientGetTimings(&t, ctrl);
+    ftp->ftpClientQuit(ctrl);
+    ftp_loopback_stats_t st;
+    ftp_loopback_get_stats(srv, &st);
+    ftp_loopback_stop(srv);
+    int intact = 0;
+    for (int i = 0; i < files; i++) {
+        intact += stored_size(i) == 3000 + i;
+    }
+    CHECK(ok == files && st.stored == (uint32_t)files && intact == files, "%s: %d put, %u stored, %d intact of %d",
+          label, ok, st.stored, intact, files);
+    CHECK(t.dataConnects == connects && st.data_connects == connects, "%s: %u data connections (server %u), %u expected",
+          label, t.dataConnects, st.data_connects, connects);
+    printf("  %-22s %6d %8u %8u\n", label, files, t.dataConnects, t.dataReused);
+}
+
+/* A send cut short inside a block, then a normal transfer */
+static void test_broken_block(void)
+{
+    FtpClient *ftp = getFtpClient();
+    ftp_loopback_cfg_t cfg = FTP_LOOPBACK_CFG_DEFAULT();
+    cfg.root = s_root;
+    ftp_loopback_handle_t srv = ftp_loopback_start(&cfg);
+    NetBuf_t *ctrl = srv ? session(srv, 1) : NULL;
+    CHECK(ctrl != NULL, "broken block: session");
+    if (ctrl == NULL) {
+        ftp_loopback_stop(srv);
+        return;
+    }
+    CHECK(put(ctrl, 0, 8 * KIB), "first put");
+
+    NetBuf_t *data = NULL;
+    fill(1, 16 * KIB);
+    CHECK(ftp->ftpClientAccess("f0001.bin", FTP_CLIENT_FILE_WRITE, FTP_CLIENT_BINARY, ctrl, &data), "access");
+    CHECK(ftp->ftpClientWrite(s_buf, 4096, data) == 4096, "write before the cut");
+    s_cut_min = 1024;
+    CHECK(ftp->ftpClientWrite(s_buf + 4096, 4096, data) == 0, "cut write reported as written");
+    int64_t start = esp_timer_get_time();
+    CHECK(ftp->ftpClientClose(data) == 0, "close after a cut block succeeded: %s", ctrl->response);
+    int64_t close_ms = (esp_timer_get_time() - start) / 1000;
+    /* With an EOF header after the cut the server waited for the rest of the block */
+    CHECK(close_ms < 1000, "close took %lld ms", (long long)close_ms);
+    CHECK(ctrl->idleData == NULL, "data connection kept after a cut block");
+
+    CHECK(put(ctrl, 2, 8 * KIB), "put after the cut");
+    FtpClientTimings_t t;
+    ftp->ftpClientGetTimings(&t, ctrl);
+    ftp->ftpClientQuit(ctrl);
+    ftp_loopback_stats_t st;
+    ftp_loopback_get_stats(srv, &st);
+    ftp_loopback_stop(srv);
+    CHECK(st.aborted == 1 && st.stored == 2, "server: %u aborted, %u stored", st.aborted, st.stored);
+    CHECK(t.dataConnects == 2, "%u data connections", t.dataConnects);
+    CHECK(stored_size(2) == 8 * KIB, "file after the cut has %ld bytes", stored_size(2));
+}
+
+int main(int argc, char **argv)
+{
+    int files = 200;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--files") == 0) {
+            files = atoi(argv[i + 1]);
+        }
+    }
+    if (files < 2 || files > 9999) {
+        fprintf(stderr, "usage: %s [--files 2..9999]\n", argv[0]);
+        return 2;
+    }
+    /* The cut connection is reset by the server */
+    signal(SIGPIPE, SIG_IGN);
+    if (mkdtemp(s_root) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    ftp_loopback_cfg_t cfg = FTP_LOOPBACK_CFG_DEFAULT();
+    cfg.root = s_root;
+    ftp_loopback_handle_t srv = ftp_loopback_start(&cfg);
+    if (srv == NULL) {
+        return 1;
+    }
+    printf("  %-6s %8s %6s %10s %10s %8s %8s %8s\n", "mode", "bytes", "files", "put/s", "get/s", "MB/s",
+           "connects", "reused");
+    static const long sizes[] = {1 * KIB, 16 * KIB, 256 * KIB};
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        bench(srv, 0, sizes[i], files);
+        bench(srv, 1, sizes[i], files);
+    }
+    ftp_loopback_stop(srv);
+
+    printf("  %-22s %6s %8s %8s\n", "fallback", "files", "connects", "reused");
+    cfg = (ftp_loopback_cfg_t)FTP_LOOPBACK_CFG_DEFAULT();
+    cfg.root = s_root;
+    cfg.no_mode_b = true;
+    fallback("MODE B refused", &cfg, 10, 0, 10);
+    cfg.no_mode_b = false;
+    cfg.block_reuse_max = 3;
+    fallback("425 after 3 transfers", &cfg, 10, 0, 4);
+    cfg.block_reuse_max = 0;
+    cfg.block_idle_ms = 20;
+    fallback("idle connection closed", &cfg, 4, 60, 4);
+    test_broken_block();
+
+    nftw(s_root, _rm, 16, FTW_DEPTH | FTW_PHYS);
+    printf("%d checks, %d failed\n", s_run, s_failed);
+    return s_failed ? 1 : 0;
+}
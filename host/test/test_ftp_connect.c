@@ -0,0 +1,320 @@
+/*
+ * test_ftp_connect - DNS cache, connect deadline and fallback server of
+ * FtpClient
+ *
+ * FtpClient.c is included with a resolver of its own in place of
+ * gethostbyname(), which answers from a table after a set lookup time and
+ * counts its calls. Checked:
+ *   - a dotted address skips the resolver
+ *   - a name is resolved once, then served from the RTC cache with no DNS
+ *     time until its TTL runs out; the cache keeps the most recent names
+ *   - a cached address that refuses is evicted and resolved again once
+ *   - a primary that never completes the handshake fails at the connect
+ *     deadline, a server that accepts but sends no banner at the reply
+ *     timeout
+ *   - the fallback starts after the primary's head start when the primary
+ *     is silent, at once when it refuses, and the primary wins when both
+ *     answer
+ *   - ftpClientGetTimings() reports where the time went (DNS, connect,
+ *     banner; the banner behind ftp_loopback's delay_ms takes a round trip)
+ *
+ *   test_ftp_connect [--dns-ms MS]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "ftp_loopback.h"
+
+/* Short enough for the test to wait them out */
+#define FTP_CLIENT_CONNECT_TIMEOUT_MS       1000
+#define FTP_CLIENT_REPLY_TIMEOUT            1
+
+/* Names the resolver knows, the lookup time and the calls it got */
+static struct {
+    const char  *name;
+    const char  *addr;
+} s_names[4];
+static int s_dns_ms = 50;
+static int s_dns_calls;
+
+static struct hostent *fake_gethostbyname(const char *name)
+{
+    static struct hostent he;
+    static struct in_addr addr;
+    static char *list[2];
+    s_dns_calls++;
+    vTaskDelay(pdMS_TO_TICKS(s_dns_ms));
+    for (int i = 0; i < sizeof(s_names) / sizeof(s_names[0]); i++) {
+        if (s_names[i].name && strcmp(s_names[i].name, name) == 0) {
+            inet_pton(AF_INET, s_names[i].addr, &addr);
+            list[0] = (char *)&addr;
+            he.h_addrtype = AF_INET;
+            he.h_length = sizeof(addr);
+            he.h_addr_list = list;
+            return &he;
+        }
+    }
+    return NULL;
+}
+
+#define gethostbyname                       fake_gethostbyname
+#include "FtpClient.c"
+#undef gethostbyname
+
+static int s_failed;
+static int s_run;
+
+#define CHECK(cond, ...) do {                               \
+    s_run++;                                                \
+    if (!(cond)) {                                          \
+        s_failed++;                                         \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+        printf(__VA_ARGS__);                                \
+        printf("\n");                                       \
+    }                                                       \
+} while (0)
+
+static void set_name(int i, const char *name, const char *addr)
+{
+    s_names[i].name = name;
+    s_names[i].addr = addr;
+}
+
+typedef struct {
+    int     ok;
+    double  ms;
+    int     dns_calls;
+    FtpClientTimings_t t;
+} attempt_t;
+
+static attempt_t attempt(const char *case_name, const char *host, uint16_t port, const char *host2, uint16_t port2)
+{
+    attempt_t a = {0};
+    NetBuf_t *ctrl = NULL;
+    int calls = s_dns_calls;
+    int64_t start = esp_timer_get_time();
+    a.ok = host2 ? connectFallbackFtpClient(host, port, host2, port2, &ctrl) : connectFtpClient(host, port, &ctrl);
+    a.ms = (esp_timer_get_time() - start) / 1e3;
+    a.dns_calls = s_dns_calls - calls;
+    if (a.ok) {
+        getTimingsFtpClient(&a.t, ctrl);
+        quitFtpClient(ctrl);
+    }
+    printf("  %-28s %4s %8.1f %6d %6d %9.1f %9.1f %9.1f %6d\n", case_name, a.ok ? "ok" : "fail", a.ms,
+           a.ok ? a.t.server : -1, a.dns_calls, a.t.dnsUs / 1e3, a.t.connectUs / 1e3, a.t.bannerUs / 1e3,
+           a.t.dnsCached);
+    return a;
+}
+
+/*
+ * A listener whose accept queue is full: further SYNs are dropped, so a
+ * connect neither completes nor fails
+ */
+static int blackhole(uint16_t *port, int *fillers, int count)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t len = sizeof(addr);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 0) != 0
+        || getsockname(fd, (struct sockaddr *)&addr, &len) != 0) {
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    for (int i = 0; i < count; i++) {
+        fillers[i] = socket(AF_INET, SOCK_STREAM, 0);
+        fcntl(fillers[i], F_SETFL, O_NONBLOCK);
+        connect(fillers[i], (struct sockaddr *)&addr, sizeof(addr));
+    }
+    /* Let the handshakes that will complete do so */
+    vTaskDelay(pdMS_TO_TICKS(50));
+    return fd;
+}
+
+/* A port nothing listens on: the connect is refused at once */
+static uint16_t closed_port(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t len = sizeof(addr);
+    bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+/* Accepts the TCP connection (the kernel does) and never says a word */
+static int silent(uint16_t *port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t len = sizeof(addr);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0
+        || getsockname(fd, (struct sockaddr *)&addr, &len) != 0) {
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static void test_dns(uint16_t port)
+{
+    printf("\nDNS cache, %d ms per lookup, TTL %d s, %d entries\n", s_dns_ms, FTP_CLIENT_DNS_TTL,
+           FTP_CLIENT_DNS_CACHE_SIZE);
+    printf("  %-28s %4s %8s %6s %6s %9s %9s %9s %6s\n", "", "", "ms", "server", "lookup", "dns ms", "conn ms",
+           "banner ms", "cached");
+    memset(dnsCache, 0, sizeof(dnsCache));
+    set_name(0, "nas.test", "127.0.0.1");
+    set_name(1, "backup.test", "127.0.0.1");
+    set_name(2, "third.test", "127.0.0.1");
+
+    attempt_t a = attempt("dotted address", "127.0.0.1", port, NULL, 0);
+    CHECK(a.ok && a.dns_calls == 0 && a.t.dnsCached == 0, "dotted address: %d lookups", a.dns_calls);
+
+    a = attempt("first lookup", "nas.test", port, NULL, 0);
+    CHECK(a.ok && a.dns_calls == 1 && a.t.dnsCached == 0, "first lookup: %d lookups, cached %d", a.dns_calls,
+          a.t.dnsCached);
+    CHECK(a.t.dnsUs >= s_dns_ms * 1000, "first lookup took %" PRIu32 " us", a.t.dnsUs);
+
+    a = attempt("cached", "nas.test", port, NULL, 0);
+    CHECK(a.ok && a.dns_calls == 0 && a.t.dnsCached == 1, "cached: %d lookups, cached %d", a.dns_calls,
+          a.t.dnsCached);
+    CHECK(a.t.dnsUs < 1000, "cached lookup took %" PRIu32 " us", a.t.dnsUs);
+
+    /* As after a deep sleep longer than the TTL */
+    for (int i = 0; i < FTP_CLIENT_DNS_CACHE_SIZE; i++) {
+        if (strcmp(dnsCache[i].host, "nas.test") == 0) {
+            dnsCache[i].expires = time(NULL) - 1;
+        }
+    }
+    a = attempt("TTL expired", "nas.test", port, NULL, 0);
+    CHECK(a.ok && a.dns_calls == 1 && a.t.dnsCached == 0, "TTL expired: %d lookups", a.dns_calls);
+
+    /* Two more names: the one resolved longest ago (its TTL ends first) makes room */
+    attempt("second name", "backup.test", port, NULL, 0);
+    for (int i = 0; i < FTP_CLIENT_DNS_CACHE_SIZE; i++) {
+        if (strcmp(dnsCache[i].host, "nas.test") == 0) {
+            dnsCache[i].expires -= 60;
+        }
+    }
+    a = attempt("third name", "third.test", port, NULL, 0);
+    CHECK(a.ok && a.dns_calls == 1, "third name: %d lookups", a.dns_calls);
+    a = attempt("second name kept", "backup.test", port, NULL, 0);
+    CHECK(a.ok && a.dns_calls == 0, "second name kept: %d lookups", a.dns_calls);
+    a = attempt("first name evicted", "nas.test", port, NULL, 0);
+    CHECK(a.ok && a.dns_calls == 1, "first name after two others: %d lookups", a.dns_calls);
+
+    /* The server moved: the cached address refuses, the name is resolved again once */
+    for (int i = 0; i < FTP_CLIENT_DNS_CACHE_SIZE; i++) {
+        if (strcmp(dnsCache[i].host, "nas.test") == 0) {
+            dnsCache[i].addr = inet_addr("127.0.0.2");
+        }
+    }
+    a = attempt("stale cached address", "nas.test", port, NULL, 0);
+    CHECK(a.ok && a.dns_calls == 1 && a.t.dnsCached == 0, "stale address: ok %d, %d lookups", a.ok, a.dns_calls);
+    a = attempt("new address cached", "nas.test", port, NULL, 0);
+    CHECK(a.ok && a.dns_calls == 0 && a.t.dnsCached == 1, "new address: %d lookups", a.dns_calls);
+
+    a = attempt("unknown name", "none.test", port, NULL, 0);
+    CHECK(!a.ok && a.dns_calls == 1 && a.ms < s_dns_ms + 100, "unknown name: ok %d in %.1f ms", a.ok, a.ms);
+}
+
+static void test_deadline(uint16_t port)
+{
+    printf("\nConnect deadline %d ms, fallback head start %d ms, reply timeout %d s\n",
+           FTP_CLIENT_CONNECT_TIMEOUT_MS, FTP_CLIENT_FALLBACK_DELAY_MS, FTP_CLIENT_REPLY_TIMEOUT);
+    printf("  %-28s %4s %8s %6s %6s %9s %9s %9s %6s\n", "", "", "ms", "server", "lookup", "dns ms", "conn ms",
+           "banner ms", "cached");
+    int fillers[4];
+    uint16_t hole_port = 0;
+    int hole = blackhole(&hole_port, fillers, 4);
+    uint16_t quiet_port = 0;
+    int quiet = silent(&quiet_port);
+    uint16_t refused = closed_port();
+    CHECK(hole >= 0 && quiet >= 0, "listeners");
+
+    attempt_t a = attempt("no handshake", "127.0.0.1", hole_port, NULL, 0);
+    CHECK(!a.ok && a.ms >= FTP_CLIENT_CONNECT_TIMEOUT_MS && a.ms < FTP_CLIENT_CONNECT_TIMEOUT_MS + 200,
+          "no handshake: ok %d after %.1f ms", a.ok, a.ms);
+
+    a = attempt("refused", "127.0.0.1", refused, NULL, 0);
+    CHECK(!a.ok && a.ms < 100, "refused: ok %d after %.1f ms", a.ok, a.ms);
+
+    a = attempt("no banner", "127.0.0.1", quiet_port, NULL, 0);
+    CHECK(!a.ok && a.ms >= FTP_CLIENT_REPLY_TIMEOUT * 1000 && a.ms < FTP_CLIENT_REPLY_TIMEOUT * 1000 + 200,
+          "no banner: ok %d after %.1f ms", a.ok, a.ms);
+
+    a = attempt("fallback, primary silent", "127.0.0.1", hole_port, "127.0.0.1", port);
+    CHECK(a.ok && a.t.server == 1, "silent primary: ok %d, server %d", a.ok, a.t.server);
+    CHECK(a.ms >= FTP_CLIENT_FALLBACK_DELAY_MS && a.ms < FTP_CLIENT_FALLBACK_DELAY_MS + 100,
+          "silent primary: fallback after %.1f ms", a.ms);
+
+    a = attempt("fallback, primary refuses", "127.0.0.1", refused, "127.0.0.1", port);
+    CHECK(a.ok && a.t.server == 1 && a.ms < 100, "refusing primary: ok %d, server %d after %.1f ms", a.ok,
+          a.t.server, a.ms);
+
+    a = attempt("both answer", "127.0.0.1", port, "127.0.0.1", port);
+    CHECK(a.ok && a.t.server == 0, "both answer: server %d", a.t.server);
+
+    /* An unresolvable primary leaves the fallback as the only, first address */
+    a = attempt("primary name unknown", "none.test", port, "127.0.0.1", port);
+    CHECK(a.ok && a.t.server == 1, "unknown primary: ok %d, server %d", a.ok, a.t.server);
+
+    a = attempt("both silent", "127.0.0.1", hole_port, "127.0.0.1", hole_port);
+    CHECK(!a.ok && a.ms < FTP_CLIENT_CONNECT_TIMEOUT_MS + 200, "both silent: ok %d after %.1f ms", a.ok, a.ms);
+
+    for (int i = 0; i < 4; i++) {
+        close(fillers[i]);
+    }
+    close(hole);
+    close(quiet);
+}
+
+/* The banner behind a delayed link arrives a round trip after the connect */
+static void test_timings(int delay_ms)
+{
+    ftp_loopback_cfg_t cfg = FTP_LOOPBACK_CFG_DEFAULT();
+    cfg.delay_ms = delay_ms;
+    ftp_loopback_handle_t srv = ftp_loopback_start(&cfg);
+    CHECK(srv != NULL, "delayed server");
+    if (srv == NULL) {
+        return;
+    }
+    printf("\nTimings with %d ms each way\n", delay_ms);
+    printf("  %-28s %4s %8s %6s %6s %9s %9s %9s %6s\n", "", "", "ms", "server", "lookup", "dns ms", "conn ms",
+           "banner ms", "cached");
+    attempt_t a = attempt("delayed banner", "127.0.0.1", ftp_loopback_port(srv), NULL, 0);
+    CHECK(a.ok && a.t.bannerUs >= 2 * delay_ms * 1000 && a.t.connectUs < 2 * delay_ms * 1000,
+          "delayed banner: %" PRIu32 " us, connect %" PRIu32 " us", a.t.bannerUs, a.t.connectUs);
+    ftp_loopback_stop(srv);
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--dns-ms") == 0 && i + 1 < argc) {
+            s_dns_ms = atoi(argv[++i]);
+        }
+    }
+    esp_log_level_set("*", ESP_LOG_WARN);
+    ftp_loopback_cfg_t cfg = FTP_LOOPBACK_CFG_DEFAULT();
+    ftp_loopback_handle_t srv = ftp_loopback_start(&cfg);
+    if (srv == NULL) {
+        return 1;
+    }
+    uint16_t port = ftp_loopback_port(srv);
+
+    test_dns(port);
+    test_deadline(port);
+    test_timings(20);
+
+    ftp_loopback_stop(srv);
+    printf("%d checks, %d failed\n", s_run, s_failed);
+    return s_failed ? 1 : 0;
+}
@@ -0,0 +1,268 @@
+/*
+ * test_ftp_rate - FTP_CLIENT_RATELIMIT over the loopback server
+ *
+ * Stores and retrieves through ftp_loopback at several limits and compares
+ * the throughput rateWait() lets through with the limit. A transfer starts
+ * with an empty bucket, so it must take bytes / limit from the first chunk.
+ * Also checked: small writes, the limit changed on the data connection during
+ * a transfer, and the burst (FTP_CLIENT_RATEBURST, rate / 10 by default)
+ * saved up during a stall going out unpaced.
+ *
+ *   test_ftp_rate [--seconds S] [--tolerance PCT]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ftw.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "FtpClient.h"
+#include "ftp_loopback.h"
+
+static int s_failed;
+static int s_run;
+
+#define CHECK(cond, ...) do {                               \
+    s_run++;                                                \
+    if (!(cond)) {                                          \
+        s_failed++;                                         \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+        printf(__VA_ARGS__);                                \
+        printf("\n");                                       \
+    }                                                       \
+} while (0)
+
+#define KIB                                 1024L
+
+typedef struct {
+    const char  *name;
+    int         dir;            /* FTP_CLIENT_FILE_WRITE or FTP_CLIENT_FILE_READ */
+    long        limit;          /* Bytes/s, 0 = unlimited */
+    long        burst;          /* FTP_CLIENT_RATEBURST, 0 = rate / 10 */
+    int         chunk;          /* Bytes per ftpClientWrite() / ftpClientRead() */
+} rate_case_t;
+
+static const rate_case_t s_cases[] = {
+    {"put", FTP_CLIENT_FILE_WRITE, 0, 0, 4096},
+    {"put", FTP_CLIENT_FILE_WRITE, 32 * KIB, 0, 4096},
+    {"put", FTP_CLIENT_FILE_WRITE, 128 * KIB, 0, 4096},
+    {"put", FTP_CLIENT_FILE_WRITE, 512 * KIB, 0, 4096},
+    {"put", FTP_CLIENT_FILE_WRITE, 2048 * KIB, 0, 4096},
+    {"put", FTP_CLIENT_FILE_WRITE, 8192 * KIB, 0, 4096},
+    {"put small", FTP_CLIENT_FILE_WRITE, 128 * KIB, 0, 256},
+    {"get", FTP_CLIENT_FILE_READ, 0, 0, 4096},
+    {"get", FTP_CLIENT_FILE_READ, 32 * KIB, 0, 4096},
+    {"get", FTP_CLIENT_FILE_READ, 128 * KIB, 0, 4096},
+    {"get", FTP_CLIENT_FILE_READ, 512 * KIB, 0, 4096},
+    {"get", FTP_CLIENT_FILE_READ, 2048 * KIB, 0, 4096},
+    {"get", FTP_CLIENT_FILE_READ, 8192 * KIB, 0, 4096},
+};
+
+static char s_buf[64 * KIB];
+
+/* Token bucket depth rateWait() uses for a limit */
+static long effective_burst(long limit, long burst)
+{
+    long b = burst ? burst : limit / 10;
+    return b < FTP_CLIENT_BUFFER_SIZE ? FTP_CLIENT_BUFFER_SIZE : b;
+}
+
+static NetBuf_t *session(uint16_t port, long limit, long burst)
+{
+    FtpClient *ftp = getFtpClient();
+    NetBuf_t *ctrl = NULL;
+    if (!ftp->ftpClientConnect("127.0.0.1", port, &ctrl)) {
+        return NULL;
+    }
+    if (!ftp->ftpClientLogin("test", "test", ctrl)
+        || !ftp->ftpClientSetOptions(FTP_CLIENT_RATELIMIT, limit, ctrl)
+        || !ftp->ftpClientSetOptions(FTP_CLIENT_RATEBURST, burst, ctrl)) {
+        ftp->ftpClientQuit(ctrl);
+        return NULL;
+    }
+    return ctrl;
+}
+
+/* Transfer bytes with the case's limit, returns the seconds from access to close */
+static double transfer(uint16_t port, const rate_case_t *c, const char *path, long bytes, long *moved)
+{
+    FtpClient *ftp = getFtpClient();
+    NetBuf_t *ctrl = session(port, c->limit, c->burst);
+    NetBuf_t *data = NULL;
+    *moved = 0;
+    if (ctrl == NULL) {
+        return -1;
+    }
+    int64_t start = esp_timer_get_time();
+    if (ftp->ftpClientAccess(path, c->dir, FTP_CLIENT_BINARY, ctrl, &data)) {
+        int n;
+        if (c->dir == FTP_CLIENT_FILE_WRITE) {
+            while (*moved < bytes) {
+                n = bytes - *moved < c->chunk ? bytes - *moved : c->chunk;
+                if (ftp->ftpClientWrite(s_buf, n, data) != n) {
+                    break;
+                }
+                *moved += n;
+            }
+        } else {
+            while ((n = ftp->ftpClientRead(s_buf, c->chunk, data)) > 0) {
+                *moved += n;
+            }
+        }
+        ftp->ftpClientClose(data);
+    }
+    double seconds = (esp_timer_get_time() - start) / 1e6;
+    ftp->ftpClientQuit(ctrl);
+    return seconds;
+}
+
+/* A file of bytes on the server for the get cases */
+static void make_file(const char *root, const char *name, long bytes)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    FILE *f = fopen(path, "wb");
+    if (f) {
+        for (long left = bytes; left > 0; left -= sizeof(s_buf)) {
+            fwrite(s_buf, 1, left < sizeof(s_buf) ? left : sizeof(s_buf), f);
+        }
+        fclose(f);
+    }
+}
+
+/* Half the transfer at limit, then the rest at limit / 4 set on the data connection */
+static void test_change(uint16_t port, double seconds, double tolerance)
+{
+    FtpClient *ftp = getFtpClient();
+    long limit = 512 * KIB;
+    long second = limit / 4;
+    NetBuf_t *ctrl = session(port, limit, 0);
+    NetBuf_t *data = NULL;
+    CHECK(ctrl != NULL, "session");
+    if (ctrl == NULL || !ftp->ftpClientAccess("change.bin", FTP_CLIENT_FILE_WRITE, FTP_CLIENT_BINARY, ctrl, &data)) {
+        return;
+    }
+    long half = (long)(limit * seconds / 2);
+    for (long done = 0; done < half; done += 4096) {
+        ftp->ftpClientWrite(s_buf, 4096, data);
+    }
+    CHECK(ftp->ftpClientSetOptions(FTP_CLIENT_RATELIMIT, second, data) == 1, "limit on the data connection");
+    long rest = 0;
+    int64_t start = esp_timer_get_time();
+    int n;
+    while (rest < (long)(second * seconds / 2) && (n = ftp->ftpClientWrite(s_buf, 4096, data)) > 0) {
+        rest += n;
+    }
+    double elapsed = (esp_timer_get_time() - start) / 1e6;
+    ftp->ftpClientClose(data);
+    ftp->ftpClientQuit(ctrl);
+    double rate = rest / elapsed;
+    double err = 100.0 * (rate - second) / second;
+    printf("  %-10s %8ld %6d %9ld %9.1f %9.1f %6.1f%%\n", "put change", second / KIB, 4096, rest / KIB,
+           elapsed * 1000, rate / KIB, err);
+    CHECK(err > -tolerance && err < tolerance, "changed limit %ld KiB/s: %.1f KiB/s", second / KIB, rate / KIB);
+}
+
+/* After a stall of a second the saved burst goes out at once, the rest at the limit */
+static void test_stall(uint16_t port, long burst)
+{
+    FtpClient *ftp = getFtpClient();
+    long limit = 128 * KIB;
+    long bytes = 64 * KIB;
+    NetBuf_t *ctrl = session(port, limit, burst);
+    NetBuf_t *data = NULL;
+    CHECK(ctrl != NULL, "session");
+    if (ctrl == NULL || !ftp->ftpClientAccess("stall.bin", FTP_CLIENT_FILE_WRITE, FTP_CLIENT_BINARY, ctrl, &data)) {
+        return;
+    }
+    ftp->ftpClientWrite(s_buf, 4096, data);
+    vTaskDelay(pdMS_TO_TICKS(1000));
+    int64_t start = esp_timer_get_time();
+    for (long done = 0; done < bytes; done += 4096) {
+        ftp->ftpClientWrite(s_buf, 4096, data);
+    }
+    double elapsed = (esp_timer_get_time() - start) / 1e6;
+    ftp->ftpClientClose(data);
+    ftp->ftpClientQuit(ctrl);
+    /* The first write was slept off before the stall, the bucket is full */
+    long saved = effective_burst(limit, burst);
+    double expect = bytes > saved ? (double)(bytes - saved) / limit : 0;
+    printf("  %-10s %8ld %6d %9ld %9.1f %9.1f  burst %ld KiB, %.0f ms expected\n", "put stall", limit / KIB, 4096,
+           bytes / KIB, elapsed * 1000, bytes / elapsed / KIB, saved / KIB, expect * 1000);
+    CHECK(elapsed > expect * 0.97 - 0.01 && elapsed < expect * 1.03 + 0.01, "64 KiB after a stall with a %ld KiB burst: %.0f ms",
+          saved / KIB, elapsed * 1000);
+}
+
+static int _rm(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+int main(int argc, char **argv)
+{
+    double seconds = 0.5;
+    double tolerance = 3;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        }
+    }
+    esp_log_level_set("*", ESP_LOG_WARN);
+    memset(s_buf, 0x5a, sizeof(s_buf));
+    char root[] = "/tmp/ftp_rate.XXXXXX";
+    if (mkdtemp(root) == NULL) {
+        return 1;
+    }
+    ftp_loopback_cfg_t cfg = FTP_LOOPBACK_CFG_DEFAULT();
+    cfg.root = root;
+    ftp_loopback_handle_t srv = ftp_loopback_start(&cfg);
+    if (srv == NULL) {
+        return 1;
+    }
+    uint16_t port = ftp_loopback_port(srv);
+
+    printf("\nrateWait over the loopback, %.2f s paced per transfer, tick %d ms\n", seconds, portTICK_PERIOD_MS);
+    printf("  %-10s %8s %6s %9s %9s %9s %7s\n", "", "limit", "chunk", "KiB", "ms", "KiB/s", "error");
+    for (int i = 0; i < sizeof(s_cases) / sizeof(s_cases[0]); i++) {
+        const rate_case_t *c = &s_cases[i];
+        /* Unlimited: as much as the paced 2 MiB/s transfer */
+        long limit = c->limit ? c->limit : 2048 * KIB;
+        long bytes = (long)(limit * seconds);
+        char name[32];
+        snprintf(name, sizeof(name), "rate%d.bin", i);
+        if (c->dir == FTP_CLIENT_FILE_READ) {
+            make_file(root, name, bytes);
+        }
+        long moved;
+        double elapsed = transfer(port, c, name, bytes, &moved);
+        CHECK(moved == bytes, "%s %ld KiB/s: %ld of %ld bytes", c->name, c->limit / KIB, moved, bytes);
+        if (elapsed <= 0) {
+            continue;
+        }
+        double rate = moved / elapsed;
+        double err = c->limit ? 100.0 * (rate - c->limit) / c->limit : 0;
+        printf("  %-10s %8ld %6d %9ld %9.1f %9.1f ", c->name, c->limit / KIB, c->chunk, moved / KIB,
+               elapsed * 1000, rate / KIB);
+        if (c->limit) {
+            printf("%6.1f%%\n", err);
+            CHECK(err > -tolerance && err < tolerance, "%s %ld KiB/s chunk %d: %.1f KiB/s",
+                  c->name, c->limit / KIB, c->chunk, rate / KIB);
+        } else {
+            printf("%7s\n", "-");
+            CHECK(moved / elapsed > 4.0 * limit, "%s unlimited: %.1f KiB/s", c->name, moved / elapsed / KIB);
+        }
+    }
+    test_change(port, seconds, tolerance);
+    test_stall(port, 64 * KIB);
+    test_stall(port, 0);
+
+    ftp_loopback_stop(srv);
+    nftw(root, _rm, 16, FTW_DEPTH | FTW_PHYS);
+    printf("%d checks, %d failed\n", s_run, s_failed);
+    return s_failed ? 1 : 0;
+}
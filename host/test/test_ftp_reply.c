@@ -0,0 +1,385 @@
+/*
+ * test_ftp_reply - malformed server replies against the FtpClient parser
+ *
+ * Drives the static readLine(), replyCode(), readResponse(), parsePasv() and
+ * buildCommand() of FtpClient.c through a replayed control connection: well
+ * formed replies, overlong lines, truncated and out of range 227 replies,
+ * CR/LF injection into command arguments. Then times the reply parser on a
+ * stream of ordinary replies.
+ *
+ *   test_ftp_reply [--bench-mb N]
+ */
+
+#include "FtpClient.c"
+#include "ftp_reply_feed.h"
+
+static int s_failed;
+static int s_run;
+
+#define CHECK(cond, ...) do {                               \
+    s_run++;                                                \
+    if (!(cond)) {                                          \
+        s_failed++;                                         \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+        printf(__VA_ARGS__);                                \
+        printf("\n");                                       \
+    }                                                       \
+} while (0)
+
+typedef struct {
+    const char  *name;
+    const char  *input;
+    char        expect;         /* First digit readResponse() is asked for */
+    int         ret;            /* readResponse() result */
+    const char  *response;      /* Response buffer afterwards */
+    const char  *next;          /* Response of a second readResponse(), NULL to skip */
+} reply_case_t;
+
+static const reply_case_t s_reply_cases[] = {
+    {"single line", "220 ready\r\n", '2', 1, "220 ready\n", NULL},
+    {"LF only", "220 ready\n", '2', 1, "220 ready\n", NULL},
+    {"code only", "220\r\n", '2', 1, "220\n", NULL},
+    {"other class", "530 Login incorrect\r\n", '2', 0, "530 Login incorrect\n", NULL},
+    {"multi-line", "220-Welcome\r\n220-to the NAS\r\n220 ready\r\n", '2', 1, "220 ready\n", NULL},
+    {"multi-line text lines", "211-Features:\r\n MDTM\r\n SIZE\r\n211 End\r\n", '2', 1, "211 End\n", NULL},
+    {"multi-line text like a code", "211-x\r\n226 not the end\r\n211 End\r\n", '2', 1, "211 End\n", NULL},
+    {"multi-line with the code as text", "211-x\r\n211-still going\r\n211 End\r\n", '2', 1, "211 End\n", NULL},
+    {"multi-line cut off", "220-Welcome\r\n220-more\r\n", '2', 0, "", NULL},
+    {"two replies", "150 Opening\r\n226 Done\r\n", '1', 1, "150 Opening\n", "226 Done\n"},
+    {"not a reply", "hello\r\n", '2', 0, "hello\n", NULL},
+    {"two digits", "22 ok\r\n", '2', 0, "22 ok\n", NULL},
+    {"letter in code", "2x0 ok\r\n", '2', 0, "2x0 ok\n", NULL},
+    {"bad separator", "220x ok\r\n", '2', 0, "220x ok\n", NULL},
+    {"no line end", "220 ready", '2', 0, "", NULL},
+    {"empty", "", '2', 0, "", NULL},
+    {"blank line", "\r\n", '2', 0, "\n", NULL},
+    {"bare CR inside", "220 a\rb\r\n", '2', 1, "220 a\rb\n", NULL},
+    {"CR CR LF", "220 ok\r\r\n", '2', 1, "220 ok\r\n", NULL},
+    {"LF then reply", "\n226 Done\r\n", '2', 0, "\n", "226 Done\n"},
+};
+
+static int reply(ftp_reply_feed_t *feed, const char *data, size_t len, char expect)
+{
+    NetBuf_t *ctl = ftp_reply_feed_open(feed, data, len);
+    return readResponse(expect, ctl);
+}
+
+static void test_reply_table(void)
+{
+    for (int i = 0; i < sizeof(s_reply_cases) / sizeof(s_reply_cases[0]); i++) {
+        const reply_case_t *c = &s_reply_cases[i];
+        ftp_reply_feed_t feed;
+        int ret = reply(&feed, c->input, strlen(c->input), c->expect);
+        CHECK(ret == c->ret, "%s: readResponse %d, expected %d", c->name, ret, c->ret);
+        CHECK(strcmp(feed.ctl->response, c->response) == 0, "%s: response \"%s\"", c->name, feed.ctl->response);
+        if (c->next) {
+            readResponse('2', feed.ctl);
+            CHECK(strcmp(feed.ctl->response, c->next) == 0, "%s: next response \"%s\"", c->name, feed.ctl->response);
+        }
+        ftp_reply_feed_close(&feed);
+    }
+}
+
+/* "code " + n bytes of fill + CRLF, then "226 next\r\n" */
+static char *long_line(const char *code, int n, int *len)
+{
+    char *s = malloc(n + 64);
+    int l = sprintf(s, "%s ", code);
+    memset(s + l, 'x', n);
+    l += n;
+    l += sprintf(s + l, "\r\n226 next\r\n");
+    *len = l;
+    return s;
+}
+
+static void test_overlong(void)
+{
+    ftp_reply_feed_t feed;
+    int len;
+
+    /* Longest CRLF line that fits: 1023 bytes read, the CR dropped */
+    char *s = long_line("220", FTP_CLIENT_RESPONSE_BUFFER_SIZE - 7, &len);
+    CHECK(reply(&feed, s, len, '2') == 1, "fitting line rejected");
+    size_t l = strlen(feed.ctl->response);
+    CHECK(l == FTP_CLIENT_RESPONSE_BUFFER_SIZE - 2 && feed.ctl->response[l - 1] == '\n', "fitting line %zu bytes", l);
+    readResponse('2', feed.ctl);
+    CHECK(strcmp(feed.ctl->response, "226 next\n") == 0, "after fitting line \"%s\"", feed.ctl->response);
+    ftp_reply_feed_close(&feed);
+    free(s);
+
+    /* Longer: cut to the buffer, the rest dropped, the next reply intact */
+    s = long_line("220", 3000, &len);
+    CHECK(reply(&feed, s, len, '2') == 1, "overlong line rejected");
+    CHECK(strncmp(feed.ctl->response, "220 xxx", 7) == 0, "overlong line start \"%.8s\"", feed.ctl->response);
+    CHECK(strlen(feed.ctl->response) == FTP_CLIENT_RESPONSE_BUFFER_SIZE - 1, "overlong line kept %zu",
+          strlen(feed.ctl->response));
+    readResponse('2', feed.ctl);
+    CHECK(strcmp(feed.ctl->response, "226 next\n") == 0, "after overlong line \"%s\"", feed.ctl->response);
+    ftp_reply_feed_close(&feed);
+    free(s);
+
+    /* Past FTP_CLIENT_REPLY_MAX_DISCARD the line is endless, the call fails */
+    s = long_line("220", FTP_CLIENT_RESPONSE_BUFFER_SIZE + FTP_CLIENT_REPLY_MAX_DISCARD + 100, &len);
+    CHECK(reply(&feed, s, len, '2') == 0, "endless line accepted");
+    CHECK(feed.ctl->response[0] == '\0', "endless line left \"%.8s\"", feed.ctl->response);
+    ftp_reply_feed_close(&feed);
+    free(s);
+
+    /* Overlong line inside a multi-line reply */
+    char *m = malloc(8192);
+    l = sprintf(m, "211-start\r\n 2");
+    memset(m + l, 'y', 4000);
+    l += 4000;
+    l += sprintf(m + l, "\r\n211 End\r\n");
+    CHECK(reply(&feed, m, l, '2') == 1, "multi-line with overlong text rejected");
+    CHECK(strcmp(feed.ctl->response, "211 End\n") == 0, "multi-line with overlong text \"%.16s\"", feed.ctl->response);
+    ftp_reply_feed_close(&feed);
+    free(m);
+
+    /* More lines than FTP_CLIENT_REPLY_MAX_LINES */
+    m = malloc((FTP_CLIENT_REPLY_MAX_LINES + 8) * 8);
+    l = 0;
+    for (int i = 0; i < FTP_CLIENT_REPLY_MAX_LINES + 4; i++) {
+        l += sprintf(m + l, "211-x\r\n");
+    }
+    l += sprintf(m + l, "211 End\r\n");
+    CHECK(reply(&feed, m, l, '2') == 0, "endless multi-line reply accepted");
+    ftp_reply_feed_close(&feed);
+    free(m);
+}
+
+static void test_read_line(void)
+{
+    ftp_reply_feed_t feed;
+    const char *in = "220 hello world\r\n";
+    NetBuf_t *ctl = ftp_reply_feed_open(&feed, in, strlen(in));
+    char buf[8];
+    char line[64] = "";
+    int n;
+    /* A small buffer gets the line in pieces, the last one ends with LF */
+    while ((n = readLine(buf, sizeof(buf), ctl)) > 0) {
+        CHECK(n < (int)sizeof(buf) && buf[n] == '\0', "piece of %d not terminated", n);
+        strcat(line, buf);
+        if (buf[n - 1] == '\n') {
+            break;
+        }
+    }
+    CHECK(strcmp(line, "220 hello world\n") == 0, "pieces \"%s\"", line);
+    CHECK(readLine(buf, sizeof(buf), ctl) == -1, "read past the end");
+    CHECK(readLine(buf, 0, ctl) == 0, "zero sized buffer");
+    ctl->dir = FTP_CLIENT_WRITE;
+    CHECK(readLine(buf, sizeof(buf), ctl) == -1, "read on a write connection");
+    ftp_reply_feed_close(&feed);
+
+    /* CR LF split over two buffer refills */
+    char big[FTP_CLIENT_BUFFER_SIZE + 16];
+    memset(big, 'z', sizeof(big));
+    memcpy(big, "220 ", 4);
+    big[FTP_CLIENT_BUFFER_SIZE - 1] = '\r';
+    big[FTP_CLIENT_BUFFER_SIZE] = '\n';
+    ctl = ftp_reply_feed_open(&feed, big, FTP_CLIENT_BUFFER_SIZE + 1);
+    char *whole = malloc(FTP_CLIENT_BUFFER_SIZE + 8);
+    n = readLine(whole, FTP_CLIENT_BUFFER_SIZE + 8, ctl);
+    CHECK(n == FTP_CLIENT_BUFFER_SIZE && whole[n - 1] == '\n' && whole[n - 2] == 'z',
+          "split CRLF: %d bytes, ends %02x %02x", n, whole[n - 2], whole[n - 1]);
+    free(whole);
+    ftp_reply_feed_close(&feed);
+}
+
+static void test_reply_code(void)
+{
+    char sep = 0;
+    CHECK(replyCode("", &sep) == -1, "empty");
+    CHECK(replyCode("2", &sep) == -1, "one digit");
+    CHECK(replyCode("22", &sep) == -1, "two digits");
+    CHECK(replyCode("220", &sep) == 220 && sep == '\0', "bare code");
+    CHECK(replyCode("220-", &sep) == 220 && sep == '-', "continuation");
+    CHECK(replyCode("220 x", &sep) == 220 && sep == ' ', "final line");
+    CHECK(replyCode("2200 x", &sep) == -1, "four digits");
+    CHECK(replyCode(" 220 x", &sep) == -1, "leading space");
+    CHECK(replyCode("22\xb2 x", &sep) == -1, "Latin-1 digit");
+}
+
+typedef struct {
+    const char      *response;
+    int             ok;
+    unsigned char   addr[6];
+} pasv_case_t;
+
+static const pasv_case_t s_pasv_cases[] = {
+    {"227 Entering Passive Mode (192,168,1,10,195,80)\n", 1, {192, 168, 1, 10, 195, 80}},
+    {"227 Entering Passive Mode (0,0,0,0,0,0)", 1, {0}},
+    {"227 =10,0,0,2,4,1", 1, {10, 0, 0, 2, 4, 1}},
+    {"227 (255,255,255,255,255,255).", 1, {255, 255, 255, 255, 255, 255}},
+    {"227-Entering (1,2,3,4,5,6)", 1, {1, 2, 3, 4, 5, 6}},
+    {"227 Entering Passive Mode (192,168,1,10,195", 0},
+    {"227 Entering Passive Mode (192,168,1,10,195,", 0},
+    {"227 Entering Passive Mode (192,168,1,10)", 0},
+    {"227 Entering Passive Mode", 0},
+    {"227 ", 0},
+    {"227", 0},
+    {"227\n", 0},
+    {"227 (192,168,1,256,0,21)", 0},
+    {"227 (192,168,1,10,0,1000)", 0},
+    {"227 (0192,168,1,10,0,21)", 0},
+    {"227 (192,168,1,10,0,99999999999)", 0},
+    {"227 (192;168;1;10;0;21)", 0},
+    {"227 (192, 168, 1, 10, 0, 21)", 0},
+    {"227 (192,,168,1,10,0)", 0},
+    {"226 (192,168,1,10,0,21)", 0},
+    {"2270 (192,168,1,10,0,21)", 0},
+    {"", 0},
+};
+
+static void test_parse_pasv(void)
+{
+    for (int i = 0; i < sizeof(s_pasv_cases) / sizeof(s_pasv_cases[0]); i++) {
+        const pasv_case_t *c = &s_pasv_cases[i];
+        /* Copy to the exact length, so a read past the terminator shows under ASan */
+        size_t len = strlen(c->response) + 1;
+        char *resp = malloc(len);
+        memcpy(resp, c->response, len);
+        unsigned char addr[6] = {0};
+        int ok = parsePasv(resp, addr);
+        CHECK(ok == c->ok, "parsePasv(\"%s\") %d", c->response, ok);
+        if (ok && c->ok) {
+            CHECK(memcmp(addr, c->addr, 6) == 0, "parsePasv(\"%s\") %u,%u,%u,%u,%u,%u", c->response,
+                  addr[0], addr[1], addr[2], addr[3], addr[4], addr[5]);
+        }
+        free(resp);
+    }
+
+    /* A 227 cut off by the connection ending mid-reply */
+    ftp_reply_feed_t feed;
+    const char *in = "227 Entering Passive Mode (192,168,1,";
+    NetBuf_t *ctl = ftp_reply_feed_open(&feed, in, strlen(in));
+    unsigned char addr[6];
+    CHECK(readResponse('2', ctl) == 0, "truncated 227 accepted");
+    CHECK(parsePasv(ctl->response, addr) == 0, "truncated 227 parsed");
+    ftp_reply_feed_close(&feed);
+}
+
+static void test_build_command(void)
+{
+    NetBuf_t ctl = {0};
+    char buf[32];
+
+    CHECK(buildCommand(buf, sizeof(buf), &ctl, "USER %s", "bob") == 1 && strcmp(buf, "USER bob") == 0,
+          "plain command \"%s\"", buf);
+
+    const char *inject[] = {
+        "x\r\nDELE /important.wav",
+        "x\nDELE y",
+        "x\rDELE y",
+        "\r\n",
+        "name\r",
+    };
+    for (int i = 0; i < sizeof(inject) / sizeof(inject[0]); i++) {
+        ctl.response[0] = 0;
+        CHECK(buildCommand(buf, sizeof(buf), &ctl, "STOR %s", inject[i]) == 0, "CR/LF case %d accepted", i);
+        CHECK(strncmp(ctl.response, "501 ", 4) == 0, "CR/LF case %d response \"%s\"", i, ctl.response);
+    }
+    /* A line break in the format itself is refused too */
+    CHECK(buildCommand(buf, sizeof(buf), &ctl, "NOOP\r\nQUIT") == 0, "CR/LF in the format accepted");
+
+    /* Room for the CRLF and the terminator: 29 characters fit 32 bytes, 30 do not */
+    char arg[40];
+    memset(arg, 'a', sizeof(arg));
+    arg[29 - 5] = 0;
+    CHECK(buildCommand(buf, sizeof(buf), &ctl, "STOR %s", arg) == 1 && strlen(buf) == 29, "29 characters refused");
+    memset(arg, 'a', sizeof(arg));
+    arg[30 - 5] = 0;
+    ctl.response[0] = 0;
+    CHECK(buildCommand(buf, sizeof(buf), &ctl, "STOR %s", arg) == 0, "30 characters accepted");
+    CHECK(strncmp(ctl.response, "501 ", 4) == 0, "too long response \"%s\"", ctl.response);
+    /* A refused command counts as permanent, ftp_retry does not send it again */
+    CHECK(ctl.response[0] == '5', "too long is not permanent");
+}
+
+/* Ordinary replies of a session, one multi-line */
+static const char s_session[] =
+    "220 NAS FTP server ready\r\n"
+    "331 Password required for esp32\r\n"
+    "230 User esp32 logged in\r\n"
+    "200 Type set to I\r\n"
+    "227 Entering Passive Mode (192,168,1,10,195,80)\r\n"
+    "150 Opening BINARY mode data connection\r\n"
+    "226 Transfer complete\r\n"
+    "211-Features:\r\n"
+    " MDTM\r\n"
+    " SIZE\r\n"
+    " REST STREAM\r\n"
+    "211 End\r\n";
+#define SESSION_REPLIES     8
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(int mb)
+{
+    size_t one = sizeof(s_session) - 1;
+    size_t reps = (size_t)mb * 1024 * 1024 / one + 1;
+    char *stream = malloc(reps * one);
+    for (size_t i = 0; i < reps; i++) {
+        memcpy(stream + i * one, s_session, one);
+    }
+    ftp_reply_feed_t feed;
+    NetBuf_t *ctl = ftp_reply_feed_open(&feed, stream, reps * one);
+    size_t replies = 0;
+    double t0 = now_s();
+    while (readResponse('2', ctl) || ctl->response[0]) {
+        replies++;
+    }
+    double t = now_s() - t0;
+    ftp_reply_feed_close(&feed);
+    free(stream);
+    CHECK(replies == reps * SESSION_REPLIES, "bench parsed %zu of %zu replies", replies, reps * SESSION_REPLIES);
+    printf("readResponse: %zu replies, %.1f MB in %.3f s, %.0f replies/s, %.1f MB/s\n",
+           replies, reps * one / 1048576.0, t, replies / t, reps * one / 1048576.0 / t);
+
+    unsigned char addr[6];
+    const char *pasv = "227 Entering Passive Mode (192,168,1,10,195,80)";
+    int n = 2000000;
+    int ok = 0;
+    t0 = now_s();
+    for (int i = 0; i < n; i++) {
+        ok += parsePasv(pasv, addr);
+    }
+    t = now_s() - t0;
+    printf("parsePasv: %.1f M/s\n", ok / t / 1e6);
+
+    NetBuf_t cmd_ctl = {0};
+    char buf[FTP_CLIENT_TEMP_BUFFER_SIZE];
+    ok = 0;
+    t0 = now_s();
+    for (int i = 0; i < n; i++) {
+        ok += buildCommand(buf, sizeof(buf), &cmd_ctl, "STOR %s", "/record/2026.10.19.06.41.26.wav");
+    }
+    t = now_s() - t0;
+    printf("buildCommand: %.1f M/s\n", ok / t / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    int bench_mb = 8;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench-mb") == 0 && i + 1 < argc) {
+            bench_mb = atoi(argv[++i]);
+        }
+    }
+    test_reply_table();
+    test_overlong();
+    test_read_line();
+    test_reply_code();
+    test_parse_pasv();
+    test_build_command();
+    if (bench_mb > 0) {
+        bench(bench_mb);
+    }
+    printf("%d checks, %d failed\n", s_run, s_failed);
+    return s_failed ? 1 : 0;
+}
@@ -0,0 +1,265 @@
+/*
+ * test_ftp_sockopt - the FtpClient socket profile against link delay
+ *
+ * Runs each profile of FTP_CLIENT_SNDBUF, FTP_CLIENT_RCVBUF,
+ * FTP_CLIENT_NODELAY_DATA and FTP_CLIENT_LINGER over ftp_loopback without
+ * delay and with its netem style delay_ms: a STOR and a RETR of one file,
+ * then a run of small STORs as the NAS app uploads clips. Checked:
+ *   - every transfer moves the whole file and is reported complete
+ *   - with the delay a command takes at least a round trip
+ *   - with the delay a larger SNDBUF speeds up STOR and a larger RCVBUF
+ *     speeds up RETR (the window is what a round trip can carry). RETR
+ *     follows RCVBUF closely. On STOR the client refills its send buffer
+ *     while the server drains a window, so small SNDBUFs measure noisy and
+ *     only a clear gain is required
+ *   - linger 0 resets the data connection on close: the client must not
+ *     report a STOR complete that the server did not get whole
+ *
+ *   test_ftp_sockopt [--delay-ms MS] [--kib N] [--files N]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "FtpClient.h"
+#include "ftp_loopback.h"
+
+static int s_failed;
+static int s_run;
+
+#define CHECK(cond, ...) do {                               \
+    s_run++;                                                \
+    if (!(cond)) {                                          \
+        s_failed++;                                         \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+        printf(__VA_ARGS__);                                \
+        printf("\n");                                       \
+    }                                                       \
+} while (0)
+
+#define KIB                                 1024L
+
+/* TCP_MSS of the lwIP build, the sdkconfig send window is 8 of them */
+#define MSS                                 1440
+
+#define SMALL_FILE                          (1 * KIB)
+
+typedef struct {
+    const char  *name;
+    int         sndbuf;         /* FTP_CLIENT_SNDBUF, 0 = stack default */
+    int         rcvbuf;         /* FTP_CLIENT_RCVBUF, 0 = stack default */
+    int         nodelay;        /* FTP_CLIENT_NODELAY_DATA */
+    int         linger;         /* FTP_CLIENT_LINGER, -1 = off */
+} profile_t;
+
+static const profile_t s_profiles[] = {
+    {"default", FTP_CLIENT_DEFAULT_SNDBUF, FTP_CLIENT_DEFAULT_RCVBUF, FTP_CLIENT_DEFAULT_NODELAY_DATA,
+     FTP_CLIENT_DEFAULT_LINGER},
+    {"snd 4 MSS", 4 * MSS, 0, 0, -1},
+    {"snd 8 MSS", 8 * MSS, 0, 0, -1},
+    {"snd 16 MSS", 16 * MSS, 0, 0, -1},
+    {"rcv 4 MSS", 0, 4 * MSS, 0, -1},
+    {"rcv 8 MSS", 0, 8 * MSS, 0, -1},
+    {"rcv 16 MSS", 0, 16 * MSS, 0, -1},
+    {"nodelay", 0, 0, 1, -1},
+    {"linger 5", 0, 0, 0, 5},
+    {"linger 0", 0, 0, 0, 0},
+    {"device", 8 * MSS, 8 * MSS, 1, 5},
+};
+
+#define PROFILES                            (sizeof(s_profiles) / sizeof(s_profiles[0]))
+
+typedef struct {
+    double  stor_kibs;
+    double  retr_kibs;
+    double  file_ms;            /* Per small STOR, PASV to 226 */
+    double  cmd_ms;             /* One PWD */
+} result_t;
+
+static char s_buf[64 * KIB];
+
+static NetBuf_t *session(uint16_t port, const profile_t *p)
+{
+    FtpClient *ftp = getFtpClient();
+    NetBuf_t *ctrl = NULL;
+    if (!ftp->ftpClientConnect("127.0.0.1", port, &ctrl)) {
+        return NULL;
+    }
+    if (!ftp->ftpClientLogin("test", "test", ctrl)
+        || !ftp->ftpClientSetOptions(FTP_CLIENT_SNDBUF, p->sndbuf, ctrl)
+        || !ftp->ftpClientSetOptions(FTP_CLIENT_RCVBUF, p->rcvbuf, ctrl)
+        || !ftp->ftpClientSetOptions(FTP_CLIENT_NODELAY_DATA, p->nodelay, ctrl)
+        || !ftp->ftpClientSetOptions(FTP_CLIENT_LINGER, p->linger, ctrl)) {
+        ftp->ftpClientQuit(ctrl);
+        return NULL;
+    }
+    return ctrl;
+}
+
+static long file_size(const char *root, const char *name)
+{
+    char path[256];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+/* STOR bytes in 4 KiB writes, the seconds from access to the 226, -1 when it is not reported complete */
+static double put(NetBuf_t *ctrl, const char *name, long bytes)
+{
+    FtpClient *ftp = getFtpClient();
+    NetBuf_t *data = NULL;
+    int64_t start = esp_timer_get_time();
+    if (!ftp->ftpClientAccess(name, FTP_CLIENT_FILE_WRITE, FTP_CLIENT_BINARY, ctrl, &data)) {
+        return -1;
+    }
+    bool ok = true;
+    for (long done = 0; ok && done < bytes; done += 4096) {
+        int n = bytes - done < 4096 ? bytes - done : 4096;
+        ok = ftp->ftpClientWrite(s_buf, n, data) == n;
+    }
+    ok = ftp->ftpClientClose(data) == 1 && ok;
+    return ok ? (esp_timer_get_time() - start) / 1e6 : -1;
+}
+
+static double get(NetBuf_t *ctrl, const char *name, long *moved)
+{
+    FtpClient *ftp = getFtpClient();
+    NetBuf_t *data = NULL;
+    int64_t start = esp_timer_get_time();
+    *moved = 0;
+    if (!ftp->ftpClientAccess(name, FTP_CLIENT_FILE_READ, FTP_CLIENT_BINARY, ctrl, &data)) {
+        return -1;
+    }
+    int n;
+    while ((n = ftp->ftpClientRead(s_buf, sizeof(s_buf), data)) > 0) {
+        *moved += n;
+    }
+    bool ok = ftp->ftpClientClose(data) == 1;
+    return ok ? (esp_timer_get_time() - start) / 1e6 : -1;
+}
+
+static void run(uint16_t port, const char *root, int delay_ms, const profile_t *p, long bytes, int files,
+                result_t *r)
+{
+    FtpClient *ftp = getFtpClient();
+    memset(r, 0, sizeof(*r));
+    NetBuf_t *ctrl = session(port, p);
+    CHECK(ctrl != NULL, "%s, %d ms: session", p->name, delay_ms);
+    if (ctrl == NULL) {
+        return;
+    }
+    char dir[256];
+    int64_t start = esp_timer_get_time();
+    CHECK(ftp->ftpClientPwd(dir, sizeof(dir), ctrl) == 1, "%s, %d ms: PWD", p->name, delay_ms);
+    r->cmd_ms = (esp_timer_get_time() - start) / 1e3;
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s_%d.bin", p->name, delay_ms);
+    for (char *c = name; *c; c++) {
+        *c = *c == ' ' ? '_' : *c;
+    }
+    double seconds = put(ctrl, name, bytes);
+    long stored = file_size(root, name);
+    if (p->linger == 0) {
+        /* An abortive close may lose the tail, but then the STOR must not look complete */
+        CHECK(seconds < 0 || stored == bytes, "%s, %d ms: STOR reported complete with %ld of %ld bytes",
+              p->name, delay_ms, stored, bytes);
+    } else {
+        CHECK(seconds > 0 && stored == bytes, "%s, %d ms: STOR %ld of %ld bytes", p->name, delay_ms, stored,
+              bytes);
+    }
+    r->stor_kibs = seconds > 0 ? bytes / seconds / KIB : 0;
+
+    if (stored == bytes) {
+        long moved;
+        seconds = get(ctrl, name, &moved);
+        CHECK(seconds > 0 && moved == bytes, "%s, %d ms: RETR %ld of %ld bytes", p->name, delay_ms, moved,
+              bytes);
+        r->retr_kibs = seconds > 0 ? moved / seconds / KIB : 0;
+    }
+
+    int complete = 0;
+    start = esp_timer_get_time();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "small_%d.bin", i);
+        complete += put(ctrl, name, SMALL_FILE) > 0 && file_size(root, name) == SMALL_FILE;
+    }
+    r->file_ms = (esp_timer_get_time() - start) / 1e3 / files;
+    if (p->linger != 0) {
+        CHECK(complete == files, "%s, %d ms: %d of %d small files", p->name, delay_ms, complete, files);
+    }
+    ftp->ftpClientQuit(ctrl);
+}
+
+static int _rm(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+int main(int argc, char **argv)
+{
+    int delay_ms = 10;
+    long kib = 512;
+    int files = 4;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--delay-ms") == 0 && i + 1 < argc) {
+            delay_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--kib") == 0 && i + 1 < argc) {
+            kib = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--files") == 0 && i + 1 < argc) {
+            files = atoi(argv[++i]);
+        }
+    }
+    esp_log_level_set("*", ESP_LOG_WARN);
+    memset(s_buf, 0x5a, sizeof(s_buf));
+    char root[] = "/tmp/ftp_sockopt.XXXXXX";
+    if (mkdtemp(root) == NULL) {
+        return 1;
+    }
+
+    int delays[] = {0, delay_ms};
+    static result_t results[2][PROFILES];
+    for (int d = 0; d < 2; d++) {
+        ftp_loopback_cfg_t cfg = FTP_LOOPBACK_CFG_DEFAULT();
+        cfg.root = root;
+        cfg.delay_ms = delays[d];
+        ftp_loopback_handle_t srv = ftp_loopback_start(&cfg);
+        if (srv == NULL) {
+            return 1;
+        }
+        printf("\nSocket profiles, %ld KiB STOR and RETR, %d STORs of %ld KiB, delay %d ms each way\n", kib, files,
+               SMALL_FILE / KIB, delays[d]);
+        printf("  %-11s %6s %6s %7s %6s %9s %9s %8s %7s\n", "", "sndbuf", "rcvbuf", "nodelay", "linger",
+               "STOR KiB/s", "RETR KiB/s", "ms/file", "cmd ms");
+        for (int i = 0; i < PROFILES; i++) {
+            const profile_t *p = &s_profiles[i];
+            result_t *r = &results[d][i];
+            run(ftp_loopback_port(srv), root, delays[d], p, kib * KIB, files, r);
+            printf("  %-11s %6d %6d %7d %6d %10.0f %10.0f %8.1f %7.1f\n", p->name, p->sndbuf, p->rcvbuf,
+                   p->nodelay, p->linger, r->stor_kibs, r->retr_kibs, r->file_ms, r->cmd_ms);
+            if (delays[d] > 0) {
+                CHECK(r->cmd_ms >= 2 * delays[d], "%s: PWD in %.1f ms with a %d ms round trip", p->name,
+                      r->cmd_ms, 2 * delays[d]);
+            }
+        }
+        ftp_loopback_stop(srv);
+    }
+
+    if (delay_ms > 0) {
+        /* Rows 1..3 grow SNDBUF, 4..6 RCVBUF */
+        const result_t *r = results[1];
+        CHECK(r[3].stor_kibs > 1.1 * r[1].stor_kibs, "STOR with 16 MSS SNDBUF %.0f KiB/s, 4 MSS %.0f KiB/s",
+              r[3].stor_kibs, r[1].stor_kibs);
+        CHECK(r[6].retr_kibs > 1.5 * r[4].retr_kibs, "RETR with 16 MSS RCVBUF %.0f KiB/s, 4 MSS %.0f KiB/s",
+              r[6].retr_kibs, r[4].retr_kibs);
+    }
+
+    nftw(root, _rm, 16, FTW_DEPTH | FTW_PHYS);
+    printf("%d checks, %d failed\n", s_run, s_failed);
+    return s_failed ? 1 : 0;
+}
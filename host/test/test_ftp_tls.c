@@ -0,0 +1,280 @@
+/*
+ * test_ftp_tls - explicit FTPS (FTP_CLIENT_TLS) over the loopback server
+ *
+ * FtpClient runs its mbedTLS code on the host through the OpenSSL backed
+ * shim in host/shim/mbedtls.c; the server answers AUTH TLS, PBSZ and PROT P
+ * with a self-signed certificate and demands that every data connection
+ * resumes the control connection's session (vsftpd's require_ssl_reuse).
+ *
+ * Throughput: a batch of small files and a few large ones stored and read
+ * back in plaintext and with PROT P, in stream mode and MODE B. Reports
+ * MB/s, the data handshakes with how many resumed, and the handshake times
+ * of the control and the data connections. With PROT P in stream mode every
+ * transfer needs a resumed handshake, in MODE B the batch needs one.
+ *
+ * Then AUTH TLS with the server's certificate as CA, without a CA, with the
+ * certificate of another server and with a CA that does not parse, and a
+ * server without TLS: AUTH is refused and the session goes on in plaintext.
+ *
+ *   test_ftp_tls [--files N] [--mib N]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ftw.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include "esp_timer.h"
+#include "FtpClient.h"
+#include "ftp_loopback.h"
+
+static int s_failed;
+static int s_run;
+
+#define CHECK(cond, ...) do {                               \
+    s_run++;                                                \
+    if (!(cond)) {                                          \
+        s_failed++;                                         \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+        printf(__VA_ARGS__);                                \
+        printf("\n");                                       \
+    }                                                       \
+} while (0)
+
+#define KIB                                 1024L
+#define MIB                                 (1024L * KIB)
+
+static char s_root[] = "/tmp/ftp_tls.XXXXXX";
+static uint8_t *s_buf;
+static uint8_t *s_in;
+
+static int _rm(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+/* Content of file i, so a file landing in another's place is caught */
+static void fill(int i, long size)
+{
+    for (long j = 0; j < size; j++) {
+        s_buf[j] = (uint8_t)(i * 31 + j * 7 + (j >> 11));
+    }
+}
+
+/* Logged in session, with AUTH TLS when ca is not "" */
+static NetBuf_t *session(ftp_loopback_handle_t srv, const char *ca, int block)
+{
+    FtpClient *ftp = getFtpClient();
+    NetBuf_t *ctrl = NULL;
+    if (!ftp->ftpClientConnect("127.0.0.1", ftp_loopback_port(srv), &ctrl)) {
+        return NULL;
+    }
+    if ((ca == NULL || ca[0]) && !ftp->ftpClientAuthTls(ca, ctrl)) {
+        ftp->ftpClientDisconnect(ctrl);
+        return NULL;
+    }
+    if (!ftp->ftpClientLogin("test", "test", ctrl) || !ftp->ftpClientSetOptions(FTP_CLIENT_BLOCKMODE, block, ctrl)) {
+        ftp->ftpClientQuit(ctrl);
+        return NULL;
+    }
+    return ctrl;
+}
+
+static bool put(NetBuf_t *ctrl, int i, long size)
+{
+    FtpClient *ftp = getFtpClient();
+    NetBuf_t *data = NULL;
+    char name[32];
+    snprintf(name, sizeof(name), "f%04d.bin", i);
+    fill(i, size);
+    if (!ftp->ftpClientAccess(name, FTP_CLIENT_FILE_WRITE, FTP_CLIENT_BINARY, ctrl, &data)) {
+        return false;
+    }
+    bool ok = true;
+    for (long off = 0; ok && off < size; off += FTP_CLIENT_BUFFER_SIZE) {
+        int n = size - off < FTP_CLIENT_BUFFER_SIZE ? size - off : FTP_CLIENT_BUFFER_SIZE;
+        ok = ftp->ftpClientWrite(s_buf + off, n, data) == n;
+    }
+    return ftp->ftpClientClose(data) && ok;
+}
+
+static bool get(NetBuf_t *ctrl, int i, long size)
+{
+    FtpClient *ftp = getFtpClient();
+    NetBuf_t *data = NULL;
+    char name[32];
+    snprintf(name, sizeof(name), "f%04d.bin", i);
+    if (!ftp->ftpClientAccess(name, FTP_CLIENT_FILE_READ, FTP_CLIENT_BINARY, ctrl, &data)) {
+        return false;
+    }
+    long got = 0;
+    int n;
+    while (got <= size && (n = ftp->ftpClientRead(s_in + got, size + 1 - got, data)) > 0) {
+        got += n;
+    }
+    bool closed = ftp->ftpClientClose(data);
+    fill(i, size);
+    return closed && got == size && memcmp(s_in, s_buf, size) == 0;
+}
+
+static long stored_size(int i)
+{
+    char path[256];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/f%04d.bin", s_root, i);
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+static void bench(bool tls, int block, long size, int files)
+{
+    ftp_loopback_cfg_t cfg = FTP_LOOPBACK_CFG_DEFAULT();
+    cfg.root = s_root;
+    cfg.tls = true;
+    cfg.tls_require_reuse = true;
+    ftp_loopback_handle_t srv = ftp_loopback_start(&cfg);
+    const char *label = tls ? (block ? "tls B" : "tls") : (block ? "plain B" : "plain");
+    NetBuf_t *ctrl = srv ? session(srv, tls ? ftp_loopback_tls_ca(srv) : "", block) : NULL;
+    CHECK(ctrl != NULL, "%s: session", label);
+    if (ctrl == NULL) {
+        ftp_loopback_stop(srv);
+        return;
+    }
+    FtpClient *ftp = getFtpClient();
+    int put_ok = 0, get_ok = 0;
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < files; i++) {
+        put_ok += put(ctrl, i, size);
+    }
+    int64_t put_us = esp_timer_get_time() - start;
+    start = esp_timer_get_time();
+    for (int i = 0; i < files; i++) {
+        get_ok += get(ctrl, i, size);
+    }
+    int64_t get_us = esp_timer_get_time() - start;
+    FtpClientTimings_t t;
+    ftp->ftpClientGetTimings(&t, ctrl);
+    ftp->ftpClientQuit(ctrl);
+    ftp_loopback_stats_t st;
+    ftp_loopback_get_stats(srv, &st);
+    ftp_loopback_stop(srv);
+
+    int intact = 0;
+    for (int i = 0; i < files; i++) {
+        intact += stored_size(i) == size;
+    }
+    CHECK(put_ok == files && intact == files, "%s %ld B: %d stored, %d intact of %d", label, size, put_ok, intact,
+          files);
+    CHECK(get_ok == files, "%s %ld B: %d of %d read back intact", label, size, get_ok, files);
+    uint32_t handshakes = !tls ? 0 : block ? 1 : 2u * files;
+    CHECK(st.tls_handshakes == handshakes && t.dataTlsCount == handshakes, "%s %ld B: %u data handshakes (server %u), "
+          "%u expected", label, size, t.dataTlsCount, st.tls_handshakes, handshakes);
+    CHECK(st.tls_resumed == st.tls_handshakes, "%s %ld B: %u of %u data handshakes resumed", label, size,
+          st.tls_resumed, st.tls_handshakes);
+    printf("  %-8s %8ld %6d %10.0f %10.0f %8.2f %8u %8u %8.2f %8.2f %8.2f\n", label, size, files, files * 1e6 / put_us,
+           files * 1e6 / get_us, 2.0 * files * size / (put_us + get_us), st.tls_handshakes, st.tls_resumed,
+           t.tlsUs / 1000.0, t.dataTlsCount ? t.dataTlsUs / 1000.0 : 0, t.dataTlsMaxUs / 1000.0);
+}
+
+static void test_auth(void)
+{
+    FtpClient *ftp = getFtpClient();
+    ftp_loopback_cfg_t cfg = FTP_LOOPBACK_CFG_DEFAULT();
+    cfg.root = s_root;
+    cfg.tls = true;
+    ftp_loopback_handle_t srv = ftp_loopback_start(&cfg);
+    ftp_loopback_handle_t other = ftp_loopback_start(&cfg);
+    CHECK(srv && other, "TLS servers");
+    if (srv == NULL || other == NULL) {
+        ftp_loopback_stop(srv);
+        ftp_loopback_stop(other);
+        return;
+    }
+
+    NetBuf_t *ctrl = session(srv, ftp_loopback_tls_ca(srv), 0);
+    CHECK(ctrl && put(ctrl, 1, 5000) && get(ctrl, 1, 5000), "server certificate as CA");
+    if (ctrl) {
+        ftp->ftpClientQuit(ctrl);
+    }
+    ctrl = session(srv, NULL, 0);
+    CHECK(ctrl && put(ctrl, 2, 6000), "no CA");
+    if (ctrl) {
+        ftp->ftpClientQuit(ctrl);
+    }
+
+    /* Same name, another key: the signature does not verify */
+    ctrl = NULL;
+    bool up = ftp->ftpClientConnect("127.0.0.1", ftp_loopback_port(srv), &ctrl);
+    bool auth = up && ftp->ftpClientAuthTls(ftp_loopback_tls_ca(other), ctrl);
+    CHECK(up && !auth && strstr(ftp->ftpClientGetLastResponse(ctrl), "handshake failed"),
+          "certificate of another server accepted: %s", ctrl ? ftp->ftpClientGetLastResponse(ctrl) : "");
+    if (ctrl) {
+        ftp->ftpClientDisconnect(ctrl);
+    }
+
+    ctrl = NULL;
+    up = ftp->ftpClientConnect("127.0.0.1", ftp_loopback_port(srv), &ctrl);
+    auth = up && ftp->ftpClientAuthTls("-----BEGIN CERTIFICATE-----\nnot base64\n-----END CERTIFICATE-----\n", ctrl);
+    CHECK(up && !auth && strstr(ftp->ftpClientGetLastResponse(ctrl), "setup failed"), "bad CA: %s",
+          ctrl ? ftp->ftpClientGetLastResponse(ctrl) : "");
+    if (ctrl) {
+        ftp->ftpClientDisconnect(ctrl);
+    }
+    ftp_loopback_stop(other);
+    ftp_loopback_stop(srv);
+
+    /* A server without TLS refuses AUTH, the session stays usable in plaintext */
+    cfg.tls = false;
+    srv = ftp_loopback_start(&cfg);
+    ctrl = NULL;
+    up = srv && ftp->ftpClientConnect("127.0.0.1", ftp_loopback_port(srv), &ctrl);
+    auth = up && ftp->ftpClientAuthTls(NULL, ctrl);
+    CHECK(up && !auth && strncmp(ftp->ftpClientGetLastResponse(ctrl), "504", 3) == 0, "AUTH on a plain server: %s",
+          ctrl ? ftp->ftpClientGetLastResponse(ctrl) : "");
+    CHECK(up && ftp->ftpClientLogin("test", "test", ctrl) && put(ctrl, 3, 7000) && get(ctrl, 3, 7000),
+          "plaintext after a refused AUTH");
+    if (ctrl) {
+        ftp->ftpClientQuit(ctrl);
+    }
+    ftp_loopback_stop(srv);
+}
+
+int main(int argc, char **argv)
+{
+    int files = 100;
+    int mib = 8;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--files") == 0) {
+            files = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--mib") == 0) {
+            mib = atoi(argv[i + 1]);
+        }
+    }
+    if (files < 1 || files > 9999 || mib < 1 || mib > 1024) {
+        fprintf(stderr, "usage: %s [--files 1..9999] [--mib 1..1024]\n", argv[0]);
+        return 2;
+    }
+    /* A peer that is gone gets close_notify written to it */
+    signal(SIGPIPE, SIG_IGN);
+    if (mkdtemp(s_root) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    s_buf = malloc(mib * MIB);
+    s_in = malloc(mib * MIB + 1);
+
+    printf("  %-8s %8s %6s %10s %10s %8s %8s %8s %8s %8s %8s\n", "mode", "bytes", "files", "put/s", "get/s", "MB/s",
+           "dataTLS", "resumed", "ctrl ms", "data ms", "max ms");
+    for (int tls = 0; tls <= 1; tls++) {
+        bench(tls, 0, 16 * KIB, files);
+        bench(tls, 1, 16 * KIB, files);
+        bench(tls, 0, mib * MIB, 2);
+    }
+    test_auth();
+
+    free(s_buf);
+    free(s_in);
+    nftw(s_root, _rm, 16, FTW_DEPTH | FTW_PHYS);
+    printf("%d checks, %d failed\n", s_run, s_failed);
+    return s_failed ? 1 : 0;
+}
@@ -0,0 +1,456 @@
+/*
+ * test_ota_update - ftp_fetch and ota_update over the loopback server, with
+ * the OTA slots in a flash image file
+ *
+ * ftp_fetch: a file delivered whole and in order, 550 as ESP_ERR_NOT_FOUND,
+ * a sink error ending the transfer with the control connection still
+ * usable, and ftp_fetch_to_buffer() at max - 1, max and an empty file.
+ *
+ * ota_update, each step followed by a simulated reset through the
+ * bootloader (host_ota_restart()):
+ *   - install into the other slot: flash holds the image and erased bytes
+ *     after it, boot slot switched, digest pending with its slot and tries 1
+ *   - confirm on the new image: digest installed, pending keys gone, the
+ *     next run downloads nothing but the .sha256
+ *   - an image that never confirms: rolled back on the next reset, the old
+ *     image leaves the digest pending and installs it again, until
+ *     OTA_UPDATE_MAX_TRIES installs; then it waits for a different digest
+ *   - digest mismatch, an image esp_ota_write() rejects, an image larger
+ *     than the slot: error, handle released, boot slot and NVS unchanged
+ *   - a .sha256 larger than the buffer (sha256sum of many files): the first
+ *     digest is used and the image RETR after it on the same session works
+ *   - no .sha256 on the NAS, and one holding no digest
+ *
+ *   test_ota_update [--image-kib N]
+ */
+
+#include <stdlib.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include "esp_timer.h"
+#include "ftp_loopback.h"
+#include "ota_update.c"
+
+static int s_failed;
+static int s_run;
+
+#define CHECK(cond, ...) do {                               \
+    s_run++;                                                \
+    if (!(cond)) {                                          \
+        s_failed++;                                         \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+        printf(__VA_ARGS__);                                \
+        printf("\n");                                       \
+    }                                                       \
+} while (0)
+
+#define KIB                                 1024L
+#define IMAGE                               "firmware.bin"
+
+static char s_root[] = "/tmp/ota_update.XXXXXX";
+static char s_nas[64];
+static char s_flash[64];
+static ftp_loopback_handle_t s_srv;
+static uint8_t *s_image;
+static long s_image_size;
+
+static int _rm(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static void put_file(const char *name, const void *data, long len)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", s_nas, name);
+    FILE *f = fopen(path, "wb");
+    fwrite(data, 1, len, f);
+    fclose(f);
+}
+
+static void remove_file(const char *name)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", s_nas, name);
+    unlink(path);
+}
+
+static void sha256(const uint8_t *data, long len, uint8_t *digest)
+{
+    EVP_Digest(data, len, digest, NULL, EVP_sha256(), NULL);
+}
+
+/* Image with seed as content, its .sha256 as sha256sum writes it, and its digest */
+static void make_image(uint8_t seed, long size, uint8_t *digest)
+{
+    s_image_size = size;
+    uint32_t x = seed * 2654435761u + 1;
+    for (long i = 0; i < size; i++) {
+        x = x * 1664525u + 1013904223u;
+        s_image[i] = x >> 24;
+    }
+    s_image[0] = HOST_OTA_IMAGE_MAGIC;
+    put_file(IMAGE, s_image, size);
+    sha256(s_image, size, digest);
+    char line[128];
+    int n = 0;
+    for (int i = 0; i < 32; i++) {
+        n += snprintf(line + n, sizeof(line) - n, "%02x", digest[i]);
+    }
+    snprintf(line + n, sizeof(line) - n, "  %s\n", IMAGE);
+    put_file(IMAGE ".sha256", line, strlen(line));
+}
+
+static NetBuf_t *session(void)
+{
+    FtpClient *ftp = getFtpClient();
+    NetBuf_t *ctrl = NULL;
+    if (!ftp->ftpClientConnect("127.0.0.1", ftp_loopback_port(s_srv), &ctrl)) {
+        return NULL;
+    }
+    if (!ftp->ftpClientLogin("test", "test", ctrl)) {
+        ftp->ftpClientQuit(ctrl);
+        return NULL;
+    }
+    return ctrl;
+}
+
+/* ota_update_run() on a session of its own, as the apps call it after an upload */
+static esp_err_t run(uint64_t *bytes_out)
+{
+    ftp_loopback_stats_t before, after;
+    ftp_loopback_get_stats(s_srv, &before);
+    NetBuf_t *ctrl = session();
+    if (ctrl == NULL) {
+        return ESP_FAIL;
+    }
+    esp_err_t ret = ota_update_run(ctrl, IMAGE);
+    getFtpClient()->ftpClientQuit(ctrl);
+    ftp_loopback_get_stats(s_srv, &after);
+    if (bytes_out) {
+        *bytes_out = after.bytes_out - before.bytes_out;
+    }
+    return ret;
+}
+
+/* The image in slot, and erased flash up to the end of its last sector */
+static bool flash_holds_image(const esp_partition_t *part)
+{
+    FILE *f = fopen(s_flash, "rb");
+    if (f == NULL) {
+        return false;
+    }
+    long span = (s_image_size + OTA_UPDATE_WRITE_SIZE - 1) / OTA_UPDATE_WRITE_SIZE * OTA_UPDATE_WRITE_SIZE;
+    uint8_t *buf = malloc(span);
+    fseek(f, part->address, SEEK_SET);
+    bool ok = fread(buf, 1, span, f) == (size_t)span && memcmp(buf, s_image, s_image_size) == 0;
+    for (long i = s_image_size; ok && i < span; i++) {
+        ok = buf[i] == 0xff;
+    }
+    free(buf);
+    fclose(f);
+    return ok;
+}
+
+typedef struct {
+    bool        installed;
+    uint8_t     digest[32];
+    bool        pending;
+    uint8_t     pending_digest[32];
+    uint32_t    pending_at;
+    uint8_t     tries;
+} nvs_view_t;
+
+static void nvs_view(nvs_view_t *v)
+{
+    memset(v, 0, sizeof(*v));
+    nvs_handle_t nvs;
+    if (nvs_open(OTA_UPDATE_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return;
+    }
+    v->installed = _get_digest(nvs, OTA_UPDATE_NVS_KEY, v->digest);
+    v->pending = _get_digest(nvs, OTA_UPDATE_NVS_PENDING, v->pending_digest);
+    nvs_get_u32(nvs, OTA_UPDATE_NVS_PENDING_AT, &v->pending_at);
+    nvs_get_u8(nvs, OTA_UPDATE_NVS_TRIES, &v->tries);
+    nvs_close(nvs);
+}
+
+/* ---- ftp_fetch ---- */
+
+typedef struct {
+    uint8_t     *buf;
+    size_t      len;
+    size_t      max;
+    int         calls;
+    int         fail_at;        /* Call that returns ESP_ERR_INVALID_STATE, 0 never */
+    int         largest;
+} sink_t;
+
+static esp_err_t _sink(const uint8_t *data, int len, void *arg)
+{
+    sink_t *s = arg;
+    if (++s->calls == s->fail_at) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (s->len + len > s->max) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(s->buf + s->len, data, len);
+    s->len += len;
+    if (len > s->largest) {
+        s->largest = len;
+    }
+    return ESP_OK;
+}
+
+static void test_fetch(void)
+{
+    NetBuf_t *ctrl = session();
+    CHECK(ctrl != NULL, "session");
+    if (ctrl == NULL) {
+        return;
+    }
+    uint8_t digest[32];
+    make_image(1, 300 * KIB + 17, digest);
+    sink_t s = {
+        .buf = malloc(s_image_size),
+        .max = s_image_size,
+    };
+    size_t total = 0;
+    esp_err_t ret = ftp_fetch(ctrl, IMAGE, _sink, &s, &total);
+    CHECK(ret == ESP_OK && total == (size_t)s_image_size && s.len == total, "fetch: %s, %zu of %ld bytes",
+          esp_err_to_name(ret), total, s_image_size);
+    CHECK(memcmp(s.buf, s_image, s.len) == 0, "fetch: contents differ");
+    CHECK(s.largest <= FTP_CLIENT_BUFFER_SIZE, "fetch: a piece of %d bytes", s.largest);
+
+    ret = ftp_fetch(ctrl, "missing.bin", _sink, &s, NULL);
+    CHECK(ret == ESP_ERR_NOT_FOUND, "missing file: %s", esp_err_to_name(ret));
+
+    s.len = 0;
+    s.calls = 0;
+    s.fail_at = 3;
+    ret = ftp_fetch(ctrl, IMAGE, _sink, &s, &total);
+    CHECK(ret == ESP_ERR_INVALID_STATE && s.calls == 3, "sink error: %s after %d pieces", esp_err_to_name(ret),
+          s.calls);
+    s.len = 0;
+    s.fail_at = 0;
+    ret = ftp_fetch(ctrl, IMAGE, _sink, &s, &total);
+    CHECK(ret == ESP_OK && s.len == (size_t)s_image_size && memcmp(s.buf, s_image, s.len) == 0,
+          "fetch after a sink error: %s, %zu bytes", esp_err_to_name(ret), s.len);
+    free(s.buf);
+
+    char buf[65];
+    size_t len;
+    put_file("64.txt", s_image, 64);
+    put_file("63.txt", s_image, 63);
+    put_file("empty.txt", "", 0);
+    ret = ftp_fetch_to_buffer(ctrl, "63.txt", buf, sizeof(buf) - 1, &len);
+    CHECK(ret == ESP_OK && len == 63 && memcmp(buf, s_image, 63) == 0 && buf[63] == '\0',
+          "max - 1 bytes: %s, %zu", esp_err_to_name(ret), len);
+    ret = ftp_fetch_to_buffer(ctrl, "64.txt", buf, sizeof(buf) - 1, &len);
+    CHECK(ret == ESP_ERR_INVALID_SIZE && len == 63 && memcmp(buf, s_image, 63) == 0 && buf[63] == '\0',
+          "max bytes: %s, %zu", esp_err_to_name(ret), len);
+    ret = ftp_fetch_to_buffer(ctrl, "empty.txt", buf, sizeof(buf), &len);
+    CHECK(ret == ESP_OK && len == 0 && buf[0] == '\0', "empty file: %s, %zu", esp_err_to_name(ret), len);
+    CHECK(ftp_fetch_to_buffer(ctrl, "63.txt", buf, 0, &len) == ESP_ERR_INVALID_SIZE, "max 0 accepted");
+    getFtpClient()->ftpClientQuit(ctrl);
+    remove_file("64.txt");
+    remove_file("63.txt");
+    remove_file("empty.txt");
+}
+
+/* ---- ota_update ---- */
+
+static void test_install_confirm(long image_size)
+{
+    uint8_t digest[32];
+    nvs_view_t v;
+    make_image(2, image_size, digest);
+    const esp_partition_t *ota_1 = esp_ota_get_next_update_partition(NULL);
+
+    uint64_t out;
+    esp_err_t ret = run(&out);
+    CHECK(ret == ESP_OK, "install: %s", esp_err_to_name(ret));
+    CHECK(flash_holds_image(ota_1), "install: %s does not hold the image", ota_1->label);
+    CHECK(esp_ota_get_boot_partition() == ota_1, "install: boots %s", esp_ota_get_boot_partition()->label);
+    CHECK(host_ota_open_handles() == 0, "install: OTA handle left open");
+    nvs_view(&v);
+    CHECK(!v.installed && v.pending && memcmp(v.pending_digest, digest, 32) == 0 && v.pending_at == ota_1->address
+          && v.tries == 1, "install: installed %d, pending %d at 0x%x, tries %d", v.installed, v.pending,
+          (unsigned)v.pending_at, v.tries);
+
+    host_ota_restart();
+    esp_ota_img_states_t state;
+    CHECK(esp_ota_get_running_partition() == ota_1 && esp_ota_get_state_partition(ota_1, &state) == ESP_OK
+          && state == ESP_OTA_IMG_PENDING_VERIFY, "after the reset: running %s", esp_ota_get_running_partition()->label);
+    ota_update_confirm();
+    nvs_view(&v);
+    CHECK(v.installed && memcmp(v.digest, digest, 32) == 0 && !v.pending && v.tries == 0,
+          "confirm: installed %d, pending %d, tries %d", v.installed, v.pending, v.tries);
+    CHECK(esp_ota_get_state_partition(ota_1, &state) == ESP_OK && state == ESP_OTA_IMG_VALID, "confirm: state %d",
+          state);
+
+    ret = run(&out);
+    CHECK(ret == ESP_ERR_NOT_FOUND && out < 128, "installed image again: %s, %llu bytes read", esp_err_to_name(ret),
+          (unsigned long long)out);
+    host_ota_restart();
+    CHECK(esp_ota_get_running_partition() == ota_1, "confirmed image rolled back");
+}
+
+static void test_rollback(void)
+{
+    uint8_t digest[32];
+    nvs_view_t v;
+    const esp_partition_t *good = esp_ota_get_running_partition();
+    make_image(3, 200 * KIB + 1, digest);
+    for (int i = 1; i <= OTA_UPDATE_MAX_TRIES; i++) {
+        esp_err_t ret = run(NULL);
+        CHECK(ret == ESP_OK, "try %d: %s", i, esp_err_to_name(ret));
+        nvs_view(&v);
+        CHECK(v.pending && memcmp(v.pending_digest, digest, 32) == 0 && v.tries == i, "try %d: pending %d, tries %d",
+              i, v.pending, v.tries);
+        /* Boots once, resets before confirming, the bootloader goes back */
+        host_ota_restart();
+        CHECK(esp_ota_get_running_partition() != good, "try %d: new image did not boot", i);
+        host_ota_restart();
+        CHECK(esp_ota_get_running_partition() == good, "try %d: no rollback", i);
+        ota_update_confirm();
+        nvs_view(&v);
+        CHECK(v.pending && v.tries == i && v.installed && memcmp(v.digest, digest, 32) != 0,
+              "try %d: the old image took over the pending digest", i);
+    }
+    uint64_t out;
+    esp_err_t ret = run(&out);
+    CHECK(ret == ESP_ERR_NOT_FOUND && out < 128, "after %d tries: %s, %llu bytes read", OTA_UPDATE_MAX_TRIES,
+          esp_err_to_name(ret), (unsigned long long)out);
+
+    /* A different image is tried again from 1 */
+    make_image(4, 200 * KIB + 2, digest);
+    ret = run(NULL);
+    nvs_view(&v);
+    CHECK(ret == ESP_OK && v.tries == 1 && memcmp(v.pending_digest, digest, 32) == 0, "next image: %s, tries %d",
+          esp_err_to_name(ret), v.tries);
+    host_ota_restart();
+    ota_update_confirm();
+    host_ota_restart();
+    nvs_view(&v);
+    CHECK(v.installed && memcmp(v.digest, digest, 32) == 0 && !v.pending, "next image not confirmed");
+}
+
+/* run() fails with want and leaves boot slot, NVS and handles as they were */
+static void check_rejected(const char *label, esp_err_t want)
+{
+    nvs_view_t before, after;
+    nvs_view(&before);
+    const esp_partition_t *boot = esp_ota_get_boot_partition();
+    esp_err_t ret = run(NULL);
+    nvs_view(&after);
+    CHECK(ret == want, "%s: %s, %s expected", label, esp_err_to_name(ret), esp_err_to_name(want));
+    CHECK(esp_ota_get_boot_partition() == boot, "%s: boot slot changed", label);
+    CHECK(memcmp(&before, &after, sizeof(before)) == 0, "%s: NVS changed", label);
+    CHECK(host_ota_open_handles() == 0, "%s: OTA handle left open", label);
+}
+
+static void test_rejected(void)
+{
+    uint8_t digest[32];
+    make_image(5, 100 * KIB, digest);
+    /* One bit of the image flipped after the digest was taken */
+    s_image[50 * KIB] ^= 0x10;
+    put_file(IMAGE, s_image, s_image_size);
+    check_rejected("digest mismatch", ESP_ERR_INVALID_CRC);
+
+    make_image(6, 100 * KIB, digest);
+    s_image[0] = 0x00;
+    put_file(IMAGE, s_image, s_image_size);
+    sha256(s_image, s_image_size, digest);
+    char line[80];
+    for (int i = 0; i < 32; i++) {
+        snprintf(line + 2 * i, 3, "%02x", digest[i]);
+    }
+    strcat(line, "  " IMAGE "\n");
+    put_file(IMAGE ".sha256", line, strlen(line));
+    check_rejected("not an app image", ESP_ERR_OTA_VALIDATE_FAILED);
+
+    make_image(7, esp_ota_get_next_update_partition(NULL)->size + 1, digest);
+    check_rejected("larger than the slot", ESP_ERR_INVALID_SIZE);
+
+    remove_file(IMAGE ".sha256");
+    check_rejected("no .sha256", ESP_ERR_NOT_FOUND);
+    put_file(IMAGE ".sha256", "firmware.bin: no such file\n", 27);
+    check_rejected("no digest in .sha256", ESP_ERR_INVALID_ARG);
+    put_file(IMAGE ".sha256", "", 0);
+    check_rejected("empty .sha256", ESP_ERR_INVALID_ARG);
+}
+
+/* sha256sum over a whole release directory, the image first */
+static void test_long_digest_file(void)
+{
+    uint8_t digest[32];
+    make_image(8, 150 * KIB + 3, digest);
+    static char text[64 * KIB];
+    int n = 0;
+    for (int i = 0; i < 32; i++) {
+        n += sprintf(text + n, "%02x", digest[i]);
+    }
+    n += sprintf(text + n, "  %s\n", IMAGE);
+    for (int f = 0; n < (int)sizeof(text) - 128; f++) {
+        for (int i = 0; i < 64; i++) {
+            text[n++] = "0123456789abcdef"[(f * 7 + i) & 15];
+        }
+        n += sprintf(text + n, "  tools/file%04d.bin\n", f);
+    }
+    put_file(IMAGE ".sha256", text, n);
+    const esp_partition_t *next = esp_ota_get_next_update_partition(NULL);
+    esp_err_t ret = run(NULL);
+    CHECK(ret == ESP_OK, "%d byte .sha256: %s", n, esp_err_to_name(ret));
+    CHECK(flash_holds_image(next), "%d byte .sha256: %s does not hold the image", n, next->label);
+    host_ota_restart();
+    ota_update_confirm();
+}
+
+int main(int argc, char **argv)
+{
+    long image_kib = 1024;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--image-kib") == 0) {
+            image_kib = atol(argv[i + 1]);
+        }
+    }
+    if (image_kib < 1 || image_kib > 3 * 1024) {
+        fprintf(stderr, "usage: %s [--image-kib 1..3072]\n", argv[0]);
+        return 2;
+    }
+    if (mkdtemp(s_root) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(s_nas, sizeof(s_nas), "%s/nas", s_root);
+    snprintf(s_flash, sizeof(s_flash), "%s/flash.bin", s_root);
+    mkdir(s_nas, 0755);
+    s_image = malloc(4 * 1024 * KIB);
+    ftp_loopback_cfg_t cfg = FTP_LOOPBACK_CFG_DEFAULT();
+    cfg.root = s_nas;
+    s_srv = ftp_loopback_start(&cfg);
+    if (s_srv == NULL || host_ota_flash_open(s_flash) != ESP_OK) {
+        return 1;
+    }
+
+    test_fetch();
+    int64_t start = esp_timer_get_time();
+    test_install_confirm(image_kib * KIB + 321);
+    int64_t install_us = esp_timer_get_time() - start;
+    test_rollback();
+    test_rejected();
+    test_long_digest_file();
+    printf("  install and confirm of %ld KiB: %.1f ms\n", image_kib, install_us / 1000.0);
+
+    ftp_loopback_stop(s_srv);
+    host_ota_flash_close();
+    free(s_image);
+    nftw(s_root, _rm, 16, FTW_DEPTH | FTW_PHYS);
+    printf("%d checks, %d failed\n", s_run, s_failed);
+    return s_failed ? 1 : 0;
+}
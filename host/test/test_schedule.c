@@ -0,0 +1,250 @@
+/*
+ * test_schedule - schedule windows against a minute-by-minute reference
+ *
+ * For each rule set, every minute of the week is marked open or closed
+ * straight from the rules (weekday mask, start, end, runs past midnight).
+ * schedule_active(), schedule_next_start() and schedule_window_end() are
+ * then checked against scans of that table, at times spread over two weeks
+ * with seconds inside the minute. TZ is the fixed UTC-8 of the apps, so the
+ * reference needs no localtime(). Rule sets: the compiled-in table (record
+ * 05:00-19:00, no upload rules), daytime, weekday nights past midnight,
+ * overlapping and adjoining windows, the nightly NAS upload minute and a
+ * single day a week. Also covered:
+ *   - an override of one kind keeps the table for the other, count 0 goes
+ *     back to the table
+ *   - a kind without rules: never active, next start (time_t)-1
+ *   - an all-week window: next start is now, the end stops after 7 days
+ * Last, ns per call of each function with the nightly rules.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_timer.h"
+
+#define SCHEDULE_RULES_FILE                 "schedule_rules_test.h"
+#include "schedule.c"
+
+static int s_failed;
+static int s_run;
+
+#define CHECK(cond, ...) do {                               \
+    s_run++;                                                \
+    if (!(cond)) {                                          \
+        s_failed++;                                         \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+        printf(__VA_ARGS__);                                \
+        printf("\n");                                       \
+    }                                                       \
+} while (0)
+
+/* 2026-10-19 00:00:00 local (UTC-8), a Monday */
+#define T0                                  1792339200
+#define TZ_OFFSET                           (8 * 3600)
+#define WEEK_MIN                            (7 * 24 * 60)
+#define DAY_MIN                             (24 * 60)
+
+/* Open minutes of the week, index 0 is Sunday 00:00 */
+static bool s_open[WEEK_MIN];
+
+static int week_minute(time_t t)
+{
+    long local_min = (long)((t + TZ_OFFSET) / 60);
+    /* 1970-01-01 was a Thursday */
+    return (int)(((local_min / DAY_MIN + 4) % 7) * DAY_MIN + local_min % DAY_MIN);
+}
+
+static void reference(const schedule_rule_t *rules, int count, schedule_kind_t kind)
+{
+    memset(s_open, 0, sizeof(s_open));
+    for (int i = 0; i < count; i++) {
+        const schedule_rule_t *r = &rules[i];
+        if (r->kind != kind) {
+            continue;
+        }
+        for (int d = 0; d < 7; d++) {
+            if (!(r->weekdays & (1 << d))) {
+                continue;
+            }
+            int end = r->end_min > r->start_min ? r->end_min : r->end_min + DAY_MIN;
+            for (int m = r->start_min; m < end; m++) {
+                s_open[(d * DAY_MIN + m) % WEEK_MIN] = true;
+            }
+        }
+    }
+}
+
+static bool ref_active(time_t t)
+{
+    return s_open[week_minute(t)];
+}
+
+static time_t ref_next_start(time_t t)
+{
+    if (ref_active(t)) {
+        return t;
+    }
+    time_t m = t - (t % 60) + 60;
+    for (int i = 0; i <= WEEK_MIN; i++, m += 60) {
+        if (ref_active(m)) {
+            return m;
+        }
+    }
+    return (time_t)-1;
+}
+
+static time_t ref_window_end(time_t t)
+{
+    if (!ref_active(t)) {
+        return t;
+    }
+    time_t m = t - (t % 60) + 60;
+    while (m < t + 7 * 86400 && ref_active(m)) {
+        m += 60;
+    }
+    return m < t + 7 * 86400 ? m : t + 7 * 86400;
+}
+
+/* Every function at times over two weeks from T0, against the reference */
+static void check_kind(const char *label, schedule_kind_t kind)
+{
+    int bad_active = 0, bad_next = 0, bad_end = 0, points = 0;
+    time_t first_bad = 0;
+    for (time_t t = T0 - 86400; t < T0 + 14 * 86400; t += 7 * 60 + 13) {
+        points++;
+        bool a = schedule_active(kind, t);
+        time_t n = schedule_next_start(kind, t);
+        time_t e = schedule_window_end(kind, t);
+        bad_active += a != ref_active(t);
+        bad_next += n != ref_next_start(t);
+        bad_end += e != ref_window_end(t);
+        if (!first_bad && (a != ref_active(t) || n != ref_next_start(t) || e != ref_window_end(t))) {
+            first_bad = t;
+            printf("  %s at %ld (week minute %d): active %d/%d, next %ld/%ld, end %ld/%ld\n", label, (long)t,
+                   week_minute(t), a, ref_active(t), (long)n, (long)ref_next_start(t), (long)e,
+                   (long)ref_window_end(t));
+        }
+    }
+    CHECK(bad_active == 0, "%s: schedule_active wrong at %d of %d times", label, bad_active, points);
+    CHECK(bad_next == 0, "%s: schedule_next_start wrong at %d of %d times", label, bad_next, points);
+    CHECK(bad_end == 0, "%s: schedule_window_end wrong at %d of %d times", label, bad_end, points);
+}
+
+static void check_rules(const char *label, const schedule_rule_t *rules, int count)
+{
+    schedule_override(rules, count);
+    for (int kind = 0; kind < SCHEDULE_KIND_MAX; kind++) {
+        char name[64];
+        snprintf(name, sizeof(name), "%s, %s", label, s_kind_name[kind]);
+        const schedule_rule_t *in_effect;
+        int n;
+        in_effect = _rules(kind, &n);
+        reference(in_effect, n, kind);
+        check_kind(name, kind);
+    }
+}
+
+static const schedule_rule_t s_daytime[] = {
+    SCHEDULE_RULE(SCHEDULE_RECORD, SCHEDULE_EVERY_DAY, 5, 0, 19, 0),
+    SCHEDULE_RULE(SCHEDULE_UPLOAD, SCHEDULE_EVERY_DAY, 12, 30, 13, 0),
+};
+
+/* Friday's night runs into Saturday, none starts on Saturday or Sunday */
+static const schedule_rule_t s_nights[] = {
+    SCHEDULE_RULE(SCHEDULE_RECORD, SCHEDULE_WEEKDAYS, 22, 0, 4, 0),
+    SCHEDULE_RULE(SCHEDULE_UPLOAD, SCHEDULE_WEEKEND, 20, 0, 2, 30),
+};
+
+static const schedule_rule_t s_overlap[] = {
+    SCHEDULE_RULE(SCHEDULE_RECORD, SCHEDULE_MON, 8, 0, 12, 0),
+    SCHEDULE_RULE(SCHEDULE_RECORD, SCHEDULE_MON, 11, 0, 13, 0),
+    SCHEDULE_RULE(SCHEDULE_RECORD, SCHEDULE_MON, 13, 0, 14, 0),
+    SCHEDULE_RULE(SCHEDULE_RECORD, SCHEDULE_MON, 23, 59, 24, 0),
+    SCHEDULE_RULE(SCHEDULE_RECORD, SCHEDULE_TUE, 0, 0, 24, 0),
+    SCHEDULE_RULE(SCHEDULE_RECORD, SCHEDULE_WED, 23, 0, 1, 0),
+    SCHEDULE_RULE(SCHEDULE_RECORD, SCHEDULE_THU, 0, 30, 2, 0),
+    SCHEDULE_RULE(SCHEDULE_UPLOAD, SCHEDULE_EVERY_DAY, 0, 0, 24, 0),
+};
+
+/* The NAS app's nightly upload, and recording only on Sunday */
+static const schedule_rule_t s_nightly[] = {
+    SCHEDULE_RULE(SCHEDULE_UPLOAD, SCHEDULE_EVERY_DAY, 23, 59, 24, 0),
+    SCHEDULE_RULE(SCHEDULE_RECORD, SCHEDULE_SUN, 6, 0, 6, 10),
+};
+
+static const schedule_rule_t s_upload_only[] = {
+    SCHEDULE_RULE(SCHEDULE_UPLOAD, SCHEDULE_SAT, 3, 0, 3, 30),
+};
+
+static void test_tables(void)
+{
+    check_rules("table", NULL, 0);
+    check_rules("daytime", s_daytime, 2);
+    check_rules("nights", s_nights, 2);
+    check_rules("overlap", s_overlap, 8);
+    check_rules("nightly", s_nightly, 2);
+    check_rules("upload only", s_upload_only, 1);
+
+    /* Only the upload kind was overridden, recording is the table's */
+    int n;
+    CHECK(_rules(SCHEDULE_RECORD, &n) == s_rules && n == 1, "record rules not taken from the table");
+    CHECK(schedule_active(SCHEDULE_RECORD, T0 + 10 * 3600) && !schedule_active(SCHEDULE_RECORD, T0 + 20 * 3600),
+          "record window of the table not in effect");
+
+    schedule_override(NULL, 0);
+    CHECK(!schedule_active(SCHEDULE_UPLOAD, T0 + 3 * 3600), "upload without rules is active");
+    CHECK(schedule_next_start(SCHEDULE_UPLOAD, T0) == (time_t)-1, "upload without rules has a next start");
+    CHECK(schedule_window_end(SCHEDULE_UPLOAD, T0) == T0, "upload without rules has a window end");
+
+    /* Every day, all day: open now, ends 7 days on */
+    schedule_override(s_overlap, 8);
+    time_t t = T0 + 12345;
+    CHECK(schedule_next_start(SCHEDULE_UPLOAD, t) == t, "all-week window not open");
+    CHECK(schedule_window_end(SCHEDULE_UPLOAD, t) == t + 7 * 86400, "all-week window ends at %ld, %ld",
+          (long)schedule_window_end(SCHEDULE_UPLOAD, t), (long)(t + 7 * 86400));
+    /* Monday 08:00 runs through the overlap and the adjoining hour to 14:00 */
+    CHECK(schedule_window_end(SCHEDULE_RECORD, T0 + 8 * 3600) == T0 + 14 * 3600, "merged end %ld",
+          (long)(schedule_window_end(SCHEDULE_RECORD, T0 + 8 * 3600) - T0));
+    schedule_override(NULL, 0);
+}
+
+static void bench(void)
+{
+    schedule_override(s_nightly, 2);
+    static const schedule_kind_t kinds[] = {SCHEDULE_UPLOAD, SCHEDULE_RECORD};
+    printf("  %-8s %10s %10s %10s\n", "kind", "active", "next", "end");
+    for (int k = 0; k < 2; k++) {
+        const int calls = 200000;
+        volatile time_t sink = 0;
+        int64_t us[3];
+        for (int f = 0; f < 3; f++) {
+            int64_t start = esp_timer_get_time();
+            for (int i = 0; i < calls; i++) {
+                time_t t = T0 + (time_t)i * 3;
+                sink += f == 0 ? schedule_active(kinds[k], t)
+                        : f == 1 ? schedule_next_start(kinds[k], t) : schedule_window_end(kinds[k], t);
+            }
+            us[f] = esp_timer_get_time() - start;
+        }
+        (void)sink;
+        printf("  %-8s %10.0f %10.0f %10.0f ns\n", s_kind_name[kinds[k]], us[0] * 1e3 / calls,
+               us[1] * 1e3 / calls, us[2] * 1e3 / calls);
+    }
+    schedule_override(NULL, 0);
+}
+
+int main(void)
+{
+    setenv("TZ", "UTC-8", 1);
+    tzset();
+    struct tm tm;
+    time_t t0 = T0;
+    localtime_r(&t0, &tm);
+    if (tm.tm_wday != 1 || tm.tm_hour != 0 || tm.tm_min != 0 || week_minute(T0) != DAY_MIN) {
+        printf("T0 is not Monday 00:00 local\n");
+        return 1;
+    }
+    test_tables();
+    bench();
+    printf("%d checks, %d failed\n", s_run, s_failed);
+    return s_failed ? 1 : 0;
+}
@@ -0,0 +1,262 @@
+/*
+ * test_site_config - site_config_parse() on good and bad files, and
+ * site_config_fetch() over the loopback server
+ *
+ * Parse, each case a whole file and the result or the error expected:
+ *   - a valid file with comments, CRLF, tabs, blank lines, an unknown key
+ *     and no newline after the last line
+ *   - day lists: names in any case, and ",,", a leading or trailing comma,
+ *     two letter and full names, ';' as separator
+ *   - times: 24:00 as end but not as start, 00:00 as end is midnight,
+ *     24:01, 25:00, 12:60, a missing leading zero, a missing '-'
+ *   - a line of 127 characters and one of 128 (the line buffer)
+ *   - SITE_CONFIG_MAX_RULES rules and one more
+ *   - upload_dir relative, empty and one character too long; mic_gain_db
+ *     outside 0..24, not a multiple of 3, trailing text
+ * Fetch: a good file becomes the config and its rules the schedule, 550
+ * keeps the config, a bad file and one larger than SITE_CONFIG_MAX_SIZE are
+ * rejected with the previous config still in effect.
+ */
+
+#include <stdlib.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include "ftp_loopback.h"
+#include "site_config.c"
+
+static int s_failed;
+static int s_run;
+
+#define CHECK(cond, ...) do {                               \
+    s_run++;                                                \
+    if (!(cond)) {                                          \
+        s_failed++;                                         \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+        printf(__VA_ARGS__);                                \
+        printf("\n");                                       \
+    }                                                       \
+} while (0)
+
+/* 2026-10-19 00:00:00 local (UTC-8), a Monday */
+#define T0                                  1792339200
+
+static char s_root[] = "/tmp/site_config.XXXXXX";
+
+static int _rm(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+typedef struct {
+    const char  *text;
+    esp_err_t   ret;
+} parse_case_t;
+
+static const parse_case_t s_cases[] = {
+    /* Day lists */
+    { "record=Mon,WED,fri 05:00-06:00\n",           ESP_OK },
+    { "record=sun 05:00-06:00\n",                   ESP_OK },
+    { "record=mon,,tue 05:00-06:00\n",              ESP_ERR_INVALID_ARG },
+    { "record=mon, 05:00-06:00\n",                  ESP_ERR_INVALID_ARG },
+    { "record=,mon 05:00-06:00\n",                  ESP_ERR_INVALID_ARG },
+    { "record=mo 05:00-06:00\n",                    ESP_ERR_INVALID_ARG },
+    { "record=monday 05:00-06:00\n",                ESP_ERR_INVALID_ARG },
+    { "record=mon;tue 05:00-06:00\n",               ESP_ERR_INVALID_ARG },
+    { "record=mon,tu 05:00-06:00\n",                ESP_ERR_INVALID_ARG },
+    { "record=everyday 05:00-06:00\n",              ESP_ERR_INVALID_ARG },
+    { "record= 05:00-06:00\n",                      ESP_ERR_INVALID_ARG },
+    /* Times */
+    { "record=daily 22:00-24:00\n",                 ESP_OK },
+    { "record=daily 24:00-01:00\n",                 ESP_ERR_INVALID_ARG },
+    { "record=daily 23:00-24:01\n",                 ESP_ERR_INVALID_ARG },
+    { "record=daily 25:00-01:00\n",                 ESP_ERR_INVALID_ARG },
+    { "record=daily 12:60-13:00\n",                 ESP_ERR_INVALID_ARG },
+    { "record=daily 1:00-02:00\n",                  ESP_ERR_INVALID_ARG },
+    { "record=daily 01:00 02:00\n",                 ESP_ERR_INVALID_ARG },
+    { "record=daily 01:00-02:00x\n",                ESP_ERR_INVALID_ARG },
+    { "record=daily\n",                             ESP_ERR_INVALID_ARG },
+    /* Other keys */
+    { "upload_dir=Lab303\n",                        ESP_ERR_INVALID_ARG },
+    { "upload_dir=\n",                              ESP_ERR_INVALID_ARG },
+    { "mic_gain_db=0\n",                            ESP_OK },
+    { "mic_gain_db=24\n",                           ESP_OK },
+    { "mic_gain_db=27\n",                           ESP_ERR_INVALID_ARG },
+    { "mic_gain_db=-3\n",                           ESP_ERR_INVALID_ARG },
+    { "mic_gain_db=20\n",                           ESP_ERR_INVALID_ARG },
+    { "mic_gain_db=21dB\n",                         ESP_ERR_INVALID_ARG },
+    { "mic_gain_db=\n",                             ESP_ERR_INVALID_ARG },
+    { "no equals sign\n",                           ESP_ERR_INVALID_ARG },
+    { "# only a comment\n\n   \n",                  ESP_OK },
+    { "",                                           ESP_OK },
+};
+
+static void test_cases(void)
+{
+    site_config_t cfg;
+    for (size_t i = 0; i < sizeof(s_cases) / sizeof(s_cases[0]); i++) {
+        esp_err_t ret = site_config_parse(s_cases[i].text, &cfg);
+        CHECK(ret == s_cases[i].ret, "\"%.*s\": %s, %s expected", (int)strcspn(s_cases[i].text, "\n"),
+              s_cases[i].text, esp_err_to_name(ret), esp_err_to_name(s_cases[i].ret));
+    }
+}
+
+static void test_valid(void)
+{
+    static const char text[] =
+        "# Yunlin site\r\n"
+        "\r\n"
+        "upload_dir=/Lab303/esp32/Yunlin/steal1   # the NAS share\r\n"
+        "\tmic_gain_db=21\t\r\n"
+        "colour=blue\n"
+        "record=weekdays 22:00-04:00\n"
+        "record=mon,Tue,sat 12:00-00:00\n"
+        "upload=daily 23:59-24:00";
+    site_config_t cfg;
+    esp_err_t ret = site_config_parse(text, &cfg);
+    CHECK(ret == ESP_OK, "valid file: %s", esp_err_to_name(ret));
+    CHECK(strcmp(cfg.upload_dir, "/Lab303/esp32/Yunlin/steal1") == 0, "upload_dir \"%s\"", cfg.upload_dir);
+    CHECK(cfg.mic_gain_db == 21, "mic_gain_db %d", cfg.mic_gain_db);
+    CHECK(cfg.rule_count == 3, "%d rules", cfg.rule_count);
+    const schedule_rule_t want[3] = {
+        SCHEDULE_RULE(SCHEDULE_RECORD, SCHEDULE_WEEKDAYS, 22, 0, 4, 0),
+        SCHEDULE_RULE(SCHEDULE_RECORD, SCHEDULE_MON | SCHEDULE_TUE | SCHEDULE_SAT, 12, 0, 24, 0),
+        SCHEDULE_RULE(SCHEDULE_UPLOAD, SCHEDULE_EVERY_DAY, 23, 59, 24, 0),
+    };
+    for (int i = 0; i < 3 && i < cfg.rule_count; i++) {
+        const schedule_rule_t *r = &cfg.rules[i];
+        CHECK(r->kind == want[i].kind && r->weekdays == want[i].weekdays && r->start_min == want[i].start_min
+              && r->end_min == want[i].end_min, "rule %d: kind %d, days 0x%02x, %d-%d", i, r->kind, r->weekdays,
+              r->start_min, r->end_min);
+    }
+
+    /* Defaults when the file sets nothing */
+    ret = site_config_parse("colour=blue\n", &cfg);
+    CHECK(ret == ESP_OK && cfg.upload_dir[0] == '\0' && cfg.mic_gain_db == -1 && cfg.rule_count == 0,
+          "defaults: %s, \"%s\", %d, %d rules", esp_err_to_name(ret), cfg.upload_dir, cfg.mic_gain_db,
+          cfg.rule_count);
+}
+
+static void test_limits(void)
+{
+    site_config_t cfg;
+    char text[1024];
+
+    /* The line buffer holds 127 characters and the NUL, CR included */
+    for (int len = 126; len <= 129; len++) {
+        int n = snprintf(text, sizeof(text), "note=");
+        memset(text + n, 'x', len - n);
+        strcpy(text + len, "\r\nmic_gain_db=3\n");
+        esp_err_t ret = site_config_parse(text, &cfg);
+        esp_err_t want = len + 1 < 128 ? ESP_OK : ESP_ERR_INVALID_SIZE;
+        CHECK(ret == want && (ret != ESP_OK || cfg.mic_gain_db == 3), "line of %d characters: %s", len + 1,
+              esp_err_to_name(ret));
+    }
+
+    int n = 0;
+    for (int i = 0; i < SITE_CONFIG_MAX_RULES; i++) {
+        n += snprintf(text + n, sizeof(text) - n, "%s=daily %02d:00-%02d:30\n", i & 1 ? "upload" : "record", i, i);
+    }
+    esp_err_t ret = site_config_parse(text, &cfg);
+    CHECK(ret == ESP_OK && cfg.rule_count == SITE_CONFIG_MAX_RULES, "%d rules: %s", SITE_CONFIG_MAX_RULES,
+          esp_err_to_name(ret));
+    snprintf(text + n, sizeof(text) - n, "record=daily 20:00-21:00\n");
+    ret = site_config_parse(text, &cfg);
+    CHECK(ret == ESP_ERR_INVALID_SIZE, "%d rules: %s", SITE_CONFIG_MAX_RULES + 1, esp_err_to_name(ret));
+
+    n = snprintf(text, sizeof(text), "upload_dir=/");
+    memset(text + n, 'd', sizeof(cfg.upload_dir) - 2);
+    strcpy(text + n + sizeof(cfg.upload_dir) - 2, "\n");
+    ret = site_config_parse(text, &cfg);
+    CHECK(ret == ESP_OK && strlen(cfg.upload_dir) == sizeof(cfg.upload_dir) - 1, "upload_dir of %d: %s",
+          (int)sizeof(cfg.upload_dir) - 1, esp_err_to_name(ret));
+    strcpy(text + n + sizeof(cfg.upload_dir) - 2, "d\n");
+    ret = site_config_parse(text, &cfg);
+    CHECK(ret == ESP_ERR_INVALID_ARG, "upload_dir of %d: %s", (int)sizeof(cfg.upload_dir), esp_err_to_name(ret));
+}
+
+static void put_file(const char *nas, const char *name, const char *text, size_t len)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", nas, name);
+    FILE *f = fopen(path, "wb");
+    fwrite(text, 1, len, f);
+    fclose(f);
+}
+
+static void test_fetch(void)
+{
+    char nas[64];
+    snprintf(nas, sizeof(nas), "%s/nas", s_root);
+    mkdir(nas, 0755);
+    ftp_loopback_cfg_t lcfg = FTP_LOOPBACK_CFG_DEFAULT();
+    lcfg.root = nas;
+    ftp_loopback_handle_t srv = ftp_loopback_start(&lcfg);
+    CHECK(srv != NULL, "loopback server");
+    if (srv == NULL) {
+        return;
+    }
+    FtpClient *ftp = getFtpClient();
+    NetBuf_t *ctrl = NULL;
+    bool up = ftp->ftpClientConnect("127.0.0.1", ftp_loopback_port(srv), &ctrl)
+              && ftp->ftpClientLogin("test", "test", ctrl);
+    CHECK(up, "login");
+    if (!up) {
+        ftp_loopback_stop(srv);
+        return;
+    }
+
+    /* No config fetched yet: defaults, the compiled-in schedule */
+    CHECK(site_config_get() == &s_default, "config before the first fetch");
+    esp_err_t ret = site_config_fetch(ctrl, "site.cfg");
+    CHECK(ret == ESP_ERR_NOT_FOUND && site_config_get() == &s_default, "no file: %s", esp_err_to_name(ret));
+
+    static const char good[] = "mic_gain_db=12\nupload=daily 03:00-03:30\n";
+    put_file(nas, "site.cfg", good, strlen(good));
+    ret = site_config_fetch(ctrl, "site.cfg");
+    CHECK(ret == ESP_OK && site_config_get()->mic_gain_db == 12 && site_config_get()->rule_count == 1,
+          "good file: %s", esp_err_to_name(ret));
+    CHECK(schedule_active(SCHEDULE_UPLOAD, T0 + 3 * 3600 + 60) && !schedule_active(SCHEDULE_UPLOAD, T0 + 4 * 3600),
+          "upload rule of the file not in effect");
+
+    static const char bad[] = "mic_gain_db=6\nupload=daily 03:00-03:30\nrecord=mon, 05:00-06:00\n";
+    put_file(nas, "site.cfg", bad, strlen(bad));
+    ret = site_config_fetch(ctrl, "site.cfg");
+    CHECK(ret == ESP_ERR_INVALID_ARG && site_config_get()->mic_gain_db == 12, "bad file: %s, gain %d",
+          esp_err_to_name(ret), site_config_get()->mic_gain_db);
+
+    /* Comments padding a valid file past the buffer */
+    static char big[SITE_CONFIG_MAX_SIZE + 64];
+    int n = snprintf(big, sizeof(big), "mic_gain_db=6\n");
+    while (n < SITE_CONFIG_MAX_SIZE) {
+        n += snprintf(big + n, sizeof(big) - n, "# %060d\n", n);
+    }
+    put_file(nas, "site.cfg", big, n);
+    ret = site_config_fetch(ctrl, "site.cfg");
+    CHECK(ret == ESP_ERR_INVALID_SIZE && site_config_get()->mic_gain_db == 12, "%d byte file: %s", n,
+          esp_err_to_name(ret));
+
+    /* The session still works after the transfers cut short */
+    put_file(nas, "site.cfg", good, strlen(good) - 1);
+    ret = site_config_fetch(ctrl, "site.cfg");
+    CHECK(ret == ESP_OK, "file without the last newline: %s", esp_err_to_name(ret));
+
+    ftp->ftpClientQuit(ctrl);
+    ftp_loopback_stop(srv);
+}
+
+int main(void)
+{
+    setenv("TZ", "UTC-8", 1);
+    tzset();
+    if (mkdtemp(s_root) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    test_cases();
+    test_valid();
+    test_limits();
+    test_fetch();
+    nftw(s_root, _rm, 16, FTW_DEPTH | FTW_PHYS);
+    printf("%d checks, %d failed\n", s_run, s_failed);
+    return s_failed ? 1 : 0;
+}
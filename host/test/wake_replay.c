@@ -0,0 +1,581 @@
+/*
+ * wake_replay - replay WAV recordings through the wake_detector decision
+ *
+ * Each recording stands for the sound at the microphone while the device
+ * sleeps. The ADC1 pad is modelled from it, either as an envelope detector
+ * (instant attack, release_ms decay) or as a biased preamp output, with
+ * +-2 counts of ADC noise. The pad is then read every period_ms as the ULP
+ * program would. Arming calibrates on calib_samples back-to-back readings,
+ * as wake_on_sound_arm() does. After a wake the device is awake for
+ * awake_ms and then arms again. Arming while a sound is still going raises
+ * the baseline until the next wake, which shows as misses after long events.
+ *
+ * Events come from an Audacity label file next to the WAV ("x.txt" for
+ * "x.wav", lines of "start<TAB>end[<TAB>text]" in seconds). A wake between
+ * the start of an event and tail_ms after its end detects it, with the
+ * latency measured from the start. A wake outside every event is a false
+ * wake. An event that starts while the device is awake is covered.
+ * Otherwise it is missed. With no label file every wake is false.
+ *
+ * Every combination of k, min_threshold and hold is run. The table gives
+ * the missed-wake rate, false wakes per hour of audio outside events, and
+ * the latency. The per-recording rows are for the defaults of
+ * WAKE_ON_SOUND_CFG_DEFAULT().
+ *
+ *   wake_replay [--k 2,4,8] [--min 20,40] [--hold 1,3] [--pad envelope|direct]
+ *               [--period-ms 10] [--release-ms 10] [--awake-ms 1000]
+ *               [--tail-ms 300] [--max-missed PCT] [--max-false N/h]
+ *               file.wav|dir ...
+ *   wake_replay --make-fixtures dir
+ *
+ * --make-fixtures writes the synthetic recordings the host tests replay.
+ * --max-missed and --max-false fail the run when the defaults do worse.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "wake_detector.h"
+#include "wake_on_sound.h"
+
+#define REPLAY_MAX_VALUES               16
+#define REPLAY_ADC_MAX                  4095
+#define REPLAY_ENVELOPE_BIAS            80      /* Detector output with no sound */
+#define REPLAY_ENVELOPE_GAIN            4000    /* Counts at full scale */
+#define REPLAY_DIRECT_BIAS              1900
+#define REPLAY_DIRECT_GAIN              2000
+#define REPLAY_ADC_NOISE                2       /* +- counts */
+
+typedef enum {
+    PAD_ENVELOPE,
+    PAD_DIRECT,
+} pad_t;
+
+typedef struct {
+    double      start;
+    double      end;
+} event_t;
+
+typedef struct {
+    char        name[64];
+    int         rate;
+    int         n;
+    uint16_t    *pad;           /* ADC reading at each audio sample */
+    event_t     *events;
+    int         n_events;
+    double      event_s;        /* Audio inside events */
+} recording_t;
+
+typedef struct {
+    int         events;
+    int         detected;
+    int         covered;
+    int         missed;
+    int         wakes;
+    int         false_wakes;
+    double      quiet_s;        /* Audio outside events, for false wakes per hour */
+    double      latency_sum;
+    double      latency_max;
+} result_t;
+
+typedef struct {
+    int         k[REPLAY_MAX_VALUES], n_k;
+    int         min[REPLAY_MAX_VALUES], n_min;
+    int         hold[REPLAY_MAX_VALUES], n_hold;
+    pad_t       pad;
+    int         period_ms;
+    int         release_ms;
+    int         awake_ms;
+    int         tail_ms;
+    int         calib_samples;
+} replay_cfg_t;
+
+static uint32_t s_rng;
+
+static uint32_t rng_next(void)
+{
+    s_rng = s_rng * 1664525u + 1013904223u;
+    return s_rng >> 8;
+}
+
+/* Uniform in [-1, 1) */
+static double rng_unit(void)
+{
+    return (double)rng_next() / (1 << 23) - 1.0;
+}
+
+static int parse_list(const char *s, int *out)
+{
+    int n = 0;
+    while (*s && n < REPLAY_MAX_VALUES) {
+        out[n++] = strtol(s, (char **)&s, 10);
+        if (*s == ',') {
+            s++;
+        } else {
+            break;
+        }
+    }
+    return n;
+}
+
+/* 16-bit PCM, the first channel */
+static float *read_wav(const char *path, int *rate, int *n)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    uint8_t hdr[12];
+    float *x = NULL;
+    int channels = 0, bits = 0;
+    if (fread(hdr, 1, 12, f) != 12 || memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "WAVE", 4)) {
+        goto done;
+    }
+    uint8_t ck[8];
+    while (fread(ck, 1, 8, f) == 8) {
+        uint32_t size = ck[4] | ck[5] << 8 | ck[6] << 16 | (uint32_t)ck[7] << 24;
+        if (memcmp(ck, "fmt ", 4) == 0 && size >= 16) {
+            uint8_t fmt[16];
+            if (fread(fmt, 1, 16, f) != 16) {
+                goto done;
+            }
+            channels = fmt[2] | fmt[3] << 8;
+            *rate = fmt[4] | fmt[5] << 8 | fmt[6] << 16 | fmt[7] << 24;
+            bits = fmt[14] | fmt[15] << 8;
+            fseek(f, size - 16 + (size & 1), SEEK_CUR);
+        } else if (memcmp(ck, "data", 4) == 0) {
+            if (bits != 16 || channels < 1) {
+                goto done;
+            }
+            int16_t *pcm = malloc(size);
+            size = fread(pcm, 1, size, f);
+            *n = size / 2 / channels;
+            x = malloc(*n * sizeof(float));
+            for (int i = 0; i < *n; i++) {
+                x[i] = pcm[i * channels] / 32768.0f;
+            }
+            free(pcm);
+            goto done;
+        } else {
+            fseek(f, size + (size & 1), SEEK_CUR);
+        }
+    }
+done:
+    fclose(f);
+    return x;
+}
+
+static int read_labels(const char *wav, event_t **events)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%.*s.txt", (int)(strlen(wav) - 4), wav);
+    FILE *f = fopen(path, "r");
+    *events = NULL;
+    if (f == NULL) {
+        return 0;
+    }
+    int n = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        double start, end;
+        if (sscanf(line, "%lf %lf", &start, &end) == 2 && end >= start) {
+            *events = realloc(*events, (n + 1) * sizeof(event_t));
+            (*events)[n++] = (event_t){start, end};
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+/* What the ULP reads off the pad at every audio sample */
+static uint16_t *model_pad(const float *x, int n, int rate, const replay_cfg_t *cfg)
+{
+    uint16_t *pad = malloc(n * sizeof(uint16_t));
+    double decay = exp(-1.0 / (rate * cfg->release_ms / 1000.0));
+    double env = 0;
+    s_rng = 12345;
+    for (int i = 0; i < n; i++) {
+        double v;
+        if (cfg->pad == PAD_ENVELOPE) {
+            double a = fabs(x[i]);
+            env = a > env ? a : env * decay;
+            v = REPLAY_ENVELOPE_BIAS + env * REPLAY_ENVELOPE_GAIN;
+        } else {
+            v = REPLAY_DIRECT_BIAS + x[i] * REPLAY_DIRECT_GAIN;
+        }
+        v += (int)(rng_next() % (2 * REPLAY_ADC_NOISE + 1)) - REPLAY_ADC_NOISE;
+        pad[i] = v < 0 ? 0 : v > REPLAY_ADC_MAX ? REPLAY_ADC_MAX : (uint16_t)lrint(v);
+    }
+    return pad;
+}
+
+static int load(const char *path, const replay_cfg_t *cfg, recording_t *rec)
+{
+    memset(rec, 0, sizeof(*rec));
+    float *x = read_wav(path, &rec->rate, &rec->n);
+    if (x == NULL) {
+        fprintf(stderr, "%s: not a 16-bit PCM WAV\n", path);
+        return -1;
+    }
+    const char *base = strrchr(path, '/');
+    snprintf(rec->name, sizeof(rec->name), "%s", base ? base + 1 : path);
+    rec->pad = model_pad(x, rec->n, rec->rate, cfg);
+    free(x);
+    rec->n_events = read_labels(path, &rec->events);
+    for (int i = 0; i < rec->n_events; i++) {
+        rec->event_s += rec->events[i].end - rec->events[i].start;
+    }
+    return 0;
+}
+
+static void replay(const recording_t *rec, const replay_cfg_t *cfg, int k, int min, int hold, result_t *res)
+{
+    int period = rec->rate * cfg->period_ms / 1000;
+    int awake = rec->rate * cfg->awake_ms / 1000;
+    double tail = cfg->tail_ms / 1000.0;
+    bool *done = calloc(rec->n_events + 1, sizeof(bool));
+    wake_detector_t det;
+
+    res->events += rec->n_events;
+    res->quiet_s += (double)rec->n / rec->rate - rec->event_s;
+    int i = 0;
+    while (i + cfg->calib_samples < rec->n) {
+        wake_detector_calibrate(&det, rec->pad + i, cfg->calib_samples, k, min, hold);
+        i += cfg->calib_samples;
+        for (; i < rec->n; i += period) {
+            if (wake_detector_step(&det, rec->pad[i])) {
+                break;
+            }
+        }
+        if (i >= rec->n) {
+            break;
+        }
+        double t = (double)i / rec->rate;
+        res->wakes++;
+        int e;
+        for (e = 0; e < rec->n_events; e++) {
+            if (t >= rec->events[e].start && t <= rec->events[e].end + tail) {
+                break;
+            }
+        }
+        if (e == rec->n_events) {
+            res->false_wakes++;
+        } else if (!done[e]) {
+            done[e] = true;
+            res->detected++;
+            double latency = t - rec->events[e].start;
+            res->latency_sum += latency;
+            if (latency > res->latency_max) {
+                res->latency_max = latency;
+            }
+        }
+        /* Recording, events starting now are in the clip */
+        double until = t + (double)awake / rec->rate;
+        for (e = 0; e < rec->n_events; e++) {
+            if (!done[e] && rec->events[e].start >= t && rec->events[e].start < until) {
+                done[e] = true;
+                res->covered++;
+            }
+        }
+        i += awake;
+    }
+    for (int e = 0; e < rec->n_events; e++) {
+        res->missed += !done[e];
+    }
+    free(done);
+}
+
+static double missed_pct(const result_t *r)
+{
+    return r->events ? 100.0 * r->missed / r->events : 0;
+}
+
+static double false_per_hour(const result_t *r)
+{
+    return r->quiet_s > 0 ? r->false_wakes * 3600.0 / r->quiet_s : 0;
+}
+
+static void print_row(const char *name, int k, int min, int hold, const result_t *r)
+{
+    printf("%-20s %3d %4d %4d  %6d %6d %6d %6d %7.1f%%  %6d %9.1f  %7.0f %7.0f\n",
+           name, k, min, hold, r->events, r->detected, r->covered, r->missed, missed_pct(r),
+           r->false_wakes, false_per_hour(r),
+           r->detected ? 1000 * r->latency_sum / r->detected : 0, 1000 * r->latency_max);
+}
+
+static void print_header(void)
+{
+    printf("%-20s %3s %4s %4s  %6s %6s %6s %6s %8s  %6s %9s  %7s %7s\n",
+           "", "k", "min", "hold", "events", "woke", "cover", "missed", "missed",
+           "false", "false/h", "lat ms", "max ms");
+}
+
+/* Synthetic recordings ----------------------------------------------------- */
+
+#define FIXTURE_RATE                    16000
+
+static void write_wav(const char *path, const float *x, int n)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        return;
+    }
+    uint32_t data = n * 2;
+    uint8_t hdr[44] = "RIFF\0\0\0\0WAVEfmt \x10\0\0\0\x01\0\x01\0\0\0\0\0\0\0\0\0\x02\0\x10\0data";
+    uint32_t v[] = {36 + data, FIXTURE_RATE, FIXTURE_RATE * 2, data};
+    int at[] = {4, 24, 28, 40};
+    for (int i = 0; i < 4; i++) {
+        for (int b = 0; b < 4; b++) {
+            hdr[at[i] + b] = v[i] >> (8 * b);
+        }
+    }
+    fwrite(hdr, 1, sizeof(hdr), f);
+    for (int i = 0; i < n; i++) {
+        double s = x[i] * 32767;
+        int16_t pcm = s > 32767 ? 32767 : s < -32768 ? -32768 : (int16_t)lrint(s);
+        fwrite(&pcm, 2, 1, f);
+    }
+    fclose(f);
+}
+
+static double db(double dbfs)
+{
+    return pow(10, dbfs / 20);
+}
+
+/* Room noise: low-passed white noise at rms level(t) dBFS */
+static void add_floor(float *x, int n, double from_dbfs, double to_dbfs)
+{
+    double lp = 0;
+    for (int i = 0; i < n; i++) {
+        lp += 0.2 * (rng_unit() - lp);
+        /* A one-pole at 0.2 leaves about a third of the white noise rms */
+        x[i] += lp * 3.0 * db(from_dbfs + (to_dbfs - from_dbfs) * i / n) / sqrt(3.0);
+    }
+}
+
+/* Voiced sound: harmonics of f0 with noise, 20 ms fade in and out */
+static void add_burst(float *x, double start, double len, double dbfs)
+{
+    double f0 = 120 + rng_next() % 200;
+    int i0 = start * FIXTURE_RATE;
+    int n = len * FIXTURE_RATE;
+    int fade = FIXTURE_RATE / 50;
+    double a = db(dbfs);
+    for (int i = 0; i < n; i++) {
+        double t = (double)i / FIXTURE_RATE;
+        double s = 0;
+        for (int h = 1; h <= 5; h++) {
+            s += sin(2 * M_PI * f0 * h * t) / h;
+        }
+        s = s / 1.6 + 0.3 * rng_unit();
+        double g = i < fade ? (double)i / fade : i > n - fade ? (double)(n - i) / fade : 1;
+        x[i0 + i] += a * g * s;
+    }
+}
+
+/* Clicks: a few ms of decaying noise */
+static void add_click(float *x, double start, double dbfs)
+{
+    int i0 = start * FIXTURE_RATE;
+    int n = FIXTURE_RATE * (1 + rng_next() % 4) / 1000;
+    for (int i = 0; i < n; i++) {
+        x[i0 + i] += db(dbfs) * rng_unit() * (1.0 - (double)i / n);
+    }
+}
+
+static void make_fixture(const char *dir, const char *name, double seconds,
+                         double floor_from, double floor_to, int bursts, double burst_dbfs, int clicks)
+{
+    int n = seconds * FIXTURE_RATE;
+    float *x = calloc(n, sizeof(float));
+    add_floor(x, n, floor_from, floor_to);
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s.txt", dir, name);
+    FILE *labels = fopen(path, "w");
+    /* Quiet first 2 s for the first calibration, events spread over the rest */
+    double slot = (seconds - 2) / (bursts > 0 ? bursts : 1);
+    for (int b = 0; b < bursts; b++) {
+        double len = 0.2 + (rng_next() % 1300) / 1000.0;
+        double start = 2 + b * slot + (rng_next() % 1000) / 1000.0 * (slot - len - 0.5);
+        add_burst(x, start, len, burst_dbfs - (rng_next() % 60) / 10.0);
+        if (labels) {
+            fprintf(labels, "%.3f\t%.3f\tburst\n", start, start + len);
+        }
+    }
+    for (int c = 0; c < clicks; c++) {
+        add_click(x, 2 + (seconds - 3) * c / clicks + (rng_next() % 500) / 1000.0, -20);
+    }
+    if (labels) {
+        fclose(labels);
+    }
+    snprintf(path, sizeof(path), "%s/%s.wav", dir, name);
+    write_wav(path, x, n);
+    free(x);
+}
+
+static int make_fixtures(const char *dir)
+{
+    mkdir(dir, 0755);
+    s_rng = 2024;
+    /* Speech-like bursts well over a quiet room */
+    make_fixture(dir, "bursts", 60, -55, -55, 16, -30, 0);
+    /* Bursts 13 to 19 dB over the floor, at the edge of min_threshold */
+    make_fixture(dir, "faint", 60, -55, -55, 16, -36, 0);
+    /* Short clicks only, every wake is false */
+    make_fixture(dir, "clicks", 60, -55, -55, 0, 0, 30);
+    /* Floor rising by 15 dB (rain, a fan), bursts well over it */
+    make_fixture(dir, "rising_floor", 60, -50, -35, 12, -20, 0);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int add_recordings(const char *path, const replay_cfg_t *cfg, recording_t **recs, int *n)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "%s: not found\n", path);
+        return -1;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        struct dirent **list;
+        int count = scandir(path, &list, NULL, alphasort);
+        int ret = 0;
+        for (int i = 0; i < count; i++) {
+            size_t len = strlen(list[i]->d_name);
+            if (len > 4 && strcmp(list[i]->d_name + len - 4, ".wav") == 0) {
+                char file[1024];
+                snprintf(file, sizeof(file), "%s/%s", path, list[i]->d_name);
+                ret |= add_recordings(file, cfg, recs, n);
+            }
+            free(list[i]);
+        }
+        free(list);
+        return ret;
+    }
+    *recs = realloc(*recs, (*n + 1) * sizeof(recording_t));
+    if (load(path, cfg, &(*recs)[*n]) != 0) {
+        return -1;
+    }
+    (*n)++;
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [--k 2,4,8] [--min 20,40] [--hold 1,3] [--pad envelope|direct]\n"
+            "       [--period-ms N] [--release-ms N] [--awake-ms N] [--tail-ms N]\n"
+            "       [--max-missed PCT] [--max-false N] file.wav|dir ...\n"
+            "       %s --make-fixtures dir\n", prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+    wake_on_sound_cfg_t wos = WAKE_ON_SOUND_CFG_DEFAULT();
+    replay_cfg_t cfg = {
+        .k = {2, 4, 6, 8}, .n_k = 4,
+        .min = {20, 40, 80}, .n_min = 3,
+        .hold = {1, 3, 5}, .n_hold = 3,
+        .pad = PAD_ENVELOPE,
+        .period_ms = wos.period_ms,
+        .release_ms = 10,
+        .awake_ms = 1000,
+        .tail_ms = 300,
+        .calib_samples = wos.calib_samples,
+    };
+    double max_missed = -1, max_false = -1;
+    recording_t *recs = NULL;
+    int n_recs = 0;
+    const char **paths = calloc(argc, sizeof(char *));
+    int n_paths = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--make-fixtures") == 0 && val) {
+            return make_fixtures(val);
+        } else if (strcmp(arg, "--k") == 0 && val) {
+            cfg.n_k = parse_list(val, cfg.k);
+        } else if (strcmp(arg, "--min") == 0 && val) {
+            cfg.n_min = parse_list(val, cfg.min);
+        } else if (strcmp(arg, "--hold") == 0 && val) {
+            cfg.n_hold = parse_list(val, cfg.hold);
+        } else if (strcmp(arg, "--pad") == 0 && val) {
+            cfg.pad = strcmp(val, "direct") == 0 ? PAD_DIRECT : PAD_ENVELOPE;
+        } else if (strcmp(arg, "--period-ms") == 0 && val) {
+            cfg.period_ms = atoi(val);
+        } else if (strcmp(arg, "--release-ms") == 0 && val) {
+            cfg.release_ms = atoi(val);
+        } else if (strcmp(arg, "--awake-ms") == 0 && val) {
+            cfg.awake_ms = atoi(val);
+        } else if (strcmp(arg, "--tail-ms") == 0 && val) {
+            cfg.tail_ms = atoi(val);
+        } else if (strcmp(arg, "--max-missed") == 0 && val) {
+            max_missed = atof(val);
+        } else if (strcmp(arg, "--max-false") == 0 && val) {
+            max_false = atof(val);
+        } else if (arg[0] != '-') {
+            paths[n_paths++] = arg;
+            continue;
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+        i++;
+    }
+    if (n_paths == 0 || cfg.period_ms <= 0 || cfg.release_ms <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    for (int i = 0; i < n_paths; i++) {
+        if (add_recordings(paths[i], &cfg, &recs, &n_recs) != 0) {
+            return 2;
+        }
+    }
+    free(paths);
+    if (n_recs == 0) {
+        fprintf(stderr, "no recordings\n");
+        return 2;
+    }
+
+    printf("%s pad, read every %d ms, %d calibration readings, awake %d ms after a wake\n",
+           cfg.pad == PAD_ENVELOPE ? "envelope" : "direct", cfg.period_ms, cfg.calib_samples, cfg.awake_ms);
+    print_header();
+    result_t def = {0};
+    for (int r = 0; r < n_recs; r++) {
+        result_t res = {0};
+        replay(&recs[r], &cfg, wos.k, wos.min_threshold, wos.hold, &res);
+        print_row(recs[r].name, wos.k, wos.min_threshold, wos.hold, &res);
+        replay(&recs[r], &cfg, wos.k, wos.min_threshold, wos.hold, &def);
+    }
+    print_row("all, defaults", wos.k, wos.min_threshold, wos.hold, &def);
+    printf("\n");
+    print_header();
+    for (int a = 0; a < cfg.n_k; a++) {
+        for (int b = 0; b < cfg.n_min; b++) {
+            for (int c = 0; c < cfg.n_hold; c++) {
+                result_t res = {0};
+                for (int r = 0; r < n_recs; r++) {
+                    replay(&recs[r], &cfg, cfg.k[a], cfg.min[b], cfg.hold[c], &res);
+                }
+                print_row("all", cfg.k[a], cfg.min[b], cfg.hold[c], &res);
+            }
+        }
+    }
+
+    for (int r = 0; r < n_recs; r++) {
+        free(recs[r].pad);
+        free(recs[r].events);
+    }
+    free(recs);
+    if ((max_missed >= 0 && missed_pct(&def) > max_missed) || (max_false >= 0 && false_per_hour(&def) > max_false)) {
+        fprintf(stderr, "defaults: %.1f%% missed, %.1f false wakes per hour\n", missed_pct(&def), false_per_hour(&def));
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,400 @@
+/*
+ * live_upload - near real-time copy of the recording on the NAS
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "FtpClient.h"
+#include "task_plan.h"
+#include "ftp_retry.h"
+#include "live_upload.h"
+
+static const char *TAG = "LIVE_UPLOAD";
+
+#define LIVE_UPLOAD_WAV_HEADER_SIZE         44
+
+typedef struct {
+    uint8_t     *data;
+    int         len;
+    int64_t     capture_us;         /* First byte reached the writer */
+    uint32_t    file_seq;
+    bool        first;              /* Starts the live file: STOR with header */
+    char        name[LIVE_UPLOAD_NAME_MAX];
+} live_chunk_t;
+
+static live_upload_cfg_t    s_cfg;
+static uint8_t              *s_pool;
+static live_chunk_t         s_chunks[LIVE_UPLOAD_MAX_CHUNKS];
+static int                  s_chunk_bytes;
+static QueueHandle_t        s_free;
+static QueueHandle_t        s_ready;
+static TaskHandle_t         s_task;
+static volatile bool        s_busy;
+static volatile uint32_t    s_failed_seq;   /* Live copy of this file ended in the sender */
+static NetBuf_t             *s_ctrl;
+static live_upload_stats_t  s_stats;
+static audio_element_info_t s_fmt;
+
+/* Writer task side */
+static struct {
+    char        uri[256];
+    char        name[LIVE_UPLOAD_NAME_MAX];
+    uint32_t    file_seq;
+    bool        live;
+    bool        first;
+    int         cur;                /* Chunk being filled, -1 for none */
+} s_tap = { .cur = -1 };
+
+static void _wr_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void _wr_u32(uint8_t *p, uint32_t v)
+{
+    _wr_u16(p, v & 0xffff);
+    _wr_u16(p + 2, v >> 16);
+}
+
+/* PCM header with unknown lengths, for a file that keeps growing */
+static void _wav_header(uint8_t *h, const audio_element_info_t *fmt)
+{
+    int block_align = fmt->channels * fmt->bits / 8;
+    memcpy(h, "RIFF", 4);
+    _wr_u32(h + 4, 0xffffffff);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    _wr_u32(h + 16, 16);
+    _wr_u16(h + 20, 1);
+    _wr_u16(h + 22, fmt->channels);
+    _wr_u32(h + 24, fmt->sample_rates);
+    _wr_u32(h + 28, fmt->sample_rates * block_align);
+    _wr_u16(h + 32, block_align);
+    _wr_u16(h + 34, fmt->bits);
+    memcpy(h + 36, "data", 4);
+    _wr_u32(h + 40, 0xffffffff);
+}
+
+/* <basename without .wav>.live.wav */
+static void _live_name(const char *uri, char *name, int max)
+{
+    const char *base = strrchr(uri, '/');
+    base = base ? base + 1 : uri;
+    int len = strlen(base);
+    if (len > 4 && strcasecmp(base + len - 4, ".wav") == 0) {
+        len -= 4;
+    }
+    int room = max - (int)sizeof(LIVE_UPLOAD_SUFFIX);
+    snprintf(name, max, "%.*s%s", len < room ? len : room, base, LIVE_UPLOAD_SUFFIX);
+}
+
+static void _session_close(void)
+{
+    if (s_ctrl) {
+        getFtpClient()->ftpClientQuit(s_ctrl);
+        s_ctrl = NULL;
+    }
+}
+
+static esp_err_t _session_open(void)
+{
+    if (s_ctrl) {
+        return ESP_OK;
+    }
+    FtpClient *ftp = getFtpClient();
+    if (!ftp->ftpClientConnectFallback(s_cfg.server, s_cfg.port, s_cfg.server2, s_cfg.port2, &s_ctrl)) {
+        ESP_LOGE(TAG, "Connect to %s:%d failed", s_cfg.server, s_cfg.port);
+        s_ctrl = NULL;
+        return ESP_FAIL;
+    }
+    if (s_cfg.tls && !ftp->ftpClientAuthTls(s_cfg.ca_pem, s_ctrl)) {
+        ESP_LOGE(TAG, "AUTH TLS failed: %s", ftp->ftpClientGetLastResponse(s_ctrl));
+        ftp->ftpClientDisconnect(s_ctrl);
+        s_ctrl = NULL;
+        return ESP_FAIL;
+    }
+    if (!ftp->ftpClientLogin(s_cfg.user, s_cfg.pass, s_ctrl)) {
+        ESP_LOGE(TAG, "Login failed");
+        _session_close();
+        return ESP_FAIL;
+    }
+    /* Chunks are small and latency bound, do not let Nagle hold the tail back */
+    ftp->ftpClientSetOptions(FTP_CLIENT_NODELAY_DATA, 1, s_ctrl);
+    ftp->ftpClientSetOptions(FTP_CLIENT_KEEPALIVE, LIVE_UPLOAD_KEEPALIVE_S, s_ctrl);
+    ftp->ftpClientSetOptions(FTP_CLIENT_BLOCKMODE, s_cfg.block_mode, s_ctrl);
+    return ESP_OK;
+}
+
+static int _write_all(NetBuf_t *data, const uint8_t *buf, int len)
+{
+    FtpClient *ftp = getFtpClient();
+    while (len > 0) {
+        int n = len < FTP_CLIENT_BUFFER_SIZE ? len : FTP_CLIENT_BUFFER_SIZE;
+        if (ftp->ftpClientWrite(buf, n, data) < n) {
+            return 0;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static esp_err_t _send(const live_chunk_t *c)
+{
+    if (_session_open() != ESP_OK) {
+        return ESP_FAIL;
+    }
+    FtpClient *ftp = getFtpClient();
+    char remote[160];
+    snprintf(remote, sizeof(remote), "%s/%s", s_cfg.remote_dir, c->name);
+    NetBuf_t *data = NULL;
+    int ok = ftp->ftpClientAccess(remote, c->first ? FTP_CLIENT_FILE_WRITE : FTP_CLIENT_FILE_APPEND,
+                                  FTP_CLIENT_BINARY, s_ctrl, &data);
+    if (ok) {
+        if (c->first) {
+            uint8_t h[LIVE_UPLOAD_WAV_HEADER_SIZE];
+            _wav_header(h, &s_fmt);
+            ok = _write_all(data, h, sizeof(h));
+        }
+        ok = ok && _write_all(data, c->data, c->len);
+        ok = ftp->ftpClientClose(data) && ok;
+    }
+    char *resp = ftp->ftpClientGetLastResponse(s_ctrl);
+    switch (ftp_retry_classify(ok, resp)) {
+        case FTP_RETRY_OK:
+            return ESP_OK;
+        case FTP_RETRY_RECONNECT:
+            ESP_LOGW(TAG, "%s lost the connection", remote);
+            ftp->ftpClientDisconnect(s_ctrl);
+            s_ctrl = NULL;
+            break;
+        default:
+            ESP_LOGW(TAG, "%s %s refused: %s", c->first ? "STOR" : "APPE", remote, resp);
+            break;
+    }
+    return ESP_FAIL;
+}
+
+static void _account(const live_chunk_t *c)
+{
+    uint32_t ms = (uint32_t)((esp_timer_get_time() - c->capture_us) / 1000);
+    if (s_stats.chunks == 0 || ms < s_stats.latency_min_ms) {
+        s_stats.latency_min_ms = ms;
+    }
+    if (ms > s_stats.latency_max_ms) {
+        s_stats.latency_max_ms = ms;
+    }
+    s_stats.latency_last_ms = ms;
+    s_stats.latency_sum_ms += ms;
+    s_stats.chunks++;
+    s_stats.bytes += c->len;
+}
+
+static void _live_task(void *arg)
+{
+    uint8_t idx;
+    while (1) {
+        /* Left in s_ready until sent, so live_upload_wait_idle() never sees it gone before s_busy */
+        if (xQueuePeek(s_ready, &idx, pdMS_TO_TICKS(LIVE_UPLOAD_IDLE_QUIT_MS)) != pdTRUE) {
+            _session_close();
+            continue;
+        }
+        s_busy = true;
+        live_chunk_t *c = &s_chunks[idx];
+        if (c->file_seq == s_failed_seq) {
+            s_stats.skipped++;
+        } else if (_send(c) == ESP_OK) {
+            _account(c);
+        } else {
+            /* A retried APPE could append the same audio twice, end this live file instead */
+            s_stats.failed++;
+            s_failed_seq = c->file_seq;
+            ESP_LOGW(TAG, "Live copy of %s ends here, the clip follows from the card", c->name);
+        }
+        xQueueReceive(s_ready, &idx, 0);
+        xQueueSend(s_free, &idx, 0);
+        s_busy = false;
+    }
+}
+
+/* Split the pool into chunks of chunk_ms once the format is known */
+static esp_err_t _layout(const audio_element_info_t *info)
+{
+    int block_align = info->channels * info->bits / 8;
+    if (block_align <= 0 || info->sample_rates <= 0) {
+        return ESP_FAIL;
+    }
+    int64_t bytes = (int64_t)info->sample_rates * block_align * s_cfg.chunk_ms / 1000;
+    bytes -= bytes % block_align;
+    int count = bytes > 0 ? s_cfg.queue_bytes / bytes : 0;
+    if (count > LIVE_UPLOAD_MAX_CHUNKS) {
+        count = LIVE_UPLOAD_MAX_CHUNKS;
+    }
+    if (count < 2) {
+        ESP_LOGE(TAG, "%u byte pool holds less than two %d ms chunks, live upload off",
+                 (unsigned)s_cfg.queue_bytes, s_cfg.chunk_ms);
+        heap_caps_free(s_pool);
+        s_pool = NULL;
+        return ESP_FAIL;
+    }
+    s_fmt = *info;
+    s_chunk_bytes = bytes;
+    for (uint8_t i = 0; i < count; i++) {
+        s_chunks[i].data = s_pool + (size_t)i * bytes;
+        xQueueSend(s_free, &i, 0);
+    }
+    ESP_LOGI(TAG, "%d chunks of %d bytes (%d ms), %d ms of audio can wait for the NAS",
+             count, s_chunk_bytes, s_cfg.chunk_ms, count * s_cfg.chunk_ms);
+    return ESP_OK;
+}
+
+static void _queue_current(void)
+{
+    if (s_tap.cur < 0) {
+        return;
+    }
+    uint8_t idx = s_tap.cur;
+    s_tap.cur = -1;
+    xQueueSend(s_ready, &idx, 0);
+    int waiting = uxQueueMessagesWaiting(s_ready);
+    if (waiting > s_stats.queue_peak) {
+        s_stats.queue_peak = waiting;
+    }
+}
+
+void live_upload_tap(const char *uri, const audio_element_info_t *info, const void *data, int len, void *ctx)
+{
+    if (s_pool == NULL || (s_chunk_bytes == 0 && _layout(info) != ESP_OK)) {
+        return;
+    }
+    if (strcmp(uri, s_tap.uri) != 0) {
+        live_upload_file_done(s_tap.uri);
+        snprintf(s_tap.uri, sizeof(s_tap.uri), "%s", uri);
+        _live_name(uri, s_tap.name, sizeof(s_tap.name));
+        s_tap.file_seq++;
+        s_tap.live = true;
+        s_tap.first = true;
+    }
+    if (s_tap.live && s_failed_seq == s_tap.file_seq) {
+        s_tap.live = false;
+        if (s_tap.cur >= 0) {
+            uint8_t idx = s_tap.cur;
+            s_tap.cur = -1;
+            xQueueSend(s_free, &idx, 0);
+        }
+    }
+    const uint8_t *p = data;
+    while (len > 0 && s_tap.live) {
+        if (s_tap.cur < 0) {
+            uint8_t idx;
+            if (xQueueReceive(s_free, &idx, 0) != pdTRUE) {
+                s_tap.live = false;
+                s_stats.overflows++;
+                ESP_LOGW(TAG, "Queue full, rest of %s only on the card", s_tap.uri);
+                break;
+            }
+            live_chunk_t *c = &s_chunks[idx];
+            c->len = 0;
+            c->capture_us = esp_timer_get_time();
+            c->file_seq = s_tap.file_seq;
+            c->first = s_tap.first;
+            strcpy(c->name, s_tap.name);
+            s_tap.first = false;
+            s_tap.cur = idx;
+        }
+        live_chunk_t *c = &s_chunks[s_tap.cur];
+        int n = s_chunk_bytes - c->len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(c->data + c->len, p, n);
+        c->len += n;
+        p += n;
+        len -= n;
+        if (c->len == s_chunk_bytes) {
+            _queue_current();
+        }
+    }
+}
+
+void live_upload_file_done(const char *uri)
+{
+    if (s_pool == NULL || strcmp(uri, s_tap.uri) != 0) {
+        return;
+    }
+    _queue_current();
+    s_tap.live = false;
+    s_tap.uri[0] = '\0';
+}
+
+esp_err_t live_upload_start(const live_upload_cfg_t *config)
+{
+    if (s_task) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (config->chunk_ms <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_cfg = *config;
+    uint8_t *pool = heap_caps_malloc(s_cfg.queue_bytes, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (pool == NULL) {
+        ESP_LOGE(TAG, "No PSRAM for a %u byte queue", (unsigned)s_cfg.queue_bytes);
+        return ESP_ERR_NO_MEM;
+    }
+    s_free = xQueueCreate(LIVE_UPLOAD_MAX_CHUNKS, sizeof(uint8_t));
+    s_ready = xQueueCreate(LIVE_UPLOAD_MAX_CHUNKS, sizeof(uint8_t));
+    if (s_free == NULL || s_ready == NULL
+        || task_plan_create(TASK_ROLE_UPLOAD, _live_task, "live_upload", 6 * 1024, NULL, &s_task) != pdPASS) {
+        if (s_free) {
+            vQueueDelete(s_free);
+        }
+        if (s_ready) {
+            vQueueDelete(s_ready);
+        }
+        s_free = s_ready = NULL;
+        heap_caps_free(pool);
+        return ESP_ERR_NO_MEM;
+    }
+    /* Published last, the tap runs in the writer task */
+    s_pool = pool;
+    return ESP_OK;
+}
+
+esp_err_t live_upload_wait_idle(TickType_t timeout)
+{
+    TickType_t start = xTaskGetTickCount();
+    while (s_ready && (uxQueueMessagesWaiting(s_ready) || s_busy)) {
+        if (xTaskGetTickCount() - start >= timeout) {
+            return ESP_ERR_TIMEOUT;
+        }
+        vTaskDelay(pdMS_TO_TICKS(100));
+    }
+    return ESP_OK;
+}
+
+void live_upload_get_stats(live_upload_stats_t *stats)
+{
+    memcpy(stats, &s_stats, sizeof(*stats));
+}
+
+void live_upload_log_stats(void)
+{
+    live_upload_stats_t st;
+    live_upload_get_stats(&st);
+    if (st.chunks == 0 && st.failed == 0 && st.overflows == 0) {
+        return;
+    }
+    ESP_LOGI(TAG, "%" PRIu32 " chunks (%" PRIu64 " bytes), latency min %" PRIu32 " / avg %" PRIu32 " / max %" PRIu32 " ms, "
+             "%" PRIu32 " failed, %" PRIu32 " skipped, %" PRIu32 " overflows, queue peak %d",
+             st.chunks, st.bytes, st.latency_min_ms,
+             st.chunks ? (uint32_t)(st.latency_sum_ms / st.chunks) : 0, st.latency_max_ms,
+             st.failed, st.skipped, st.overflows, st.queue_peak);
+}
@@ -0,0 +1,105 @@
+/*
+ * live_upload - near real-time copy of the recording on the NAS
+ *
+ * live_upload_tap() is the sd_wav_writer tap: it cuts the audio into chunks
+ * of chunk_ms and queues them in a fixed pool in PSRAM. A task on the upload
+ * core sends every chunk as soon as it is complete over a control session
+ * that stays logged in, to remote_dir/<name>.live.wav: the first chunk of a
+ * file is a STOR of a streaming WAV header (sizes 0xffffffff) and the audio,
+ * every later one an APPE. The NAS has the audio about chunk_ms plus one
+ * PASV/APPE/226 round after it was recorded, and players can open the file
+ * while it grows.
+ *
+ * The SD card still gets the whole clip and upload_worker delivers it as
+ * usual; the live file is a preview. When the pool is full (the NAS stalled
+ * for longer than the pool holds) or a chunk is not taken, the live copy of
+ * that file ends there and the rest is only on the card. The next file starts
+ * a new live copy.
+ *
+ * Latency is measured from the moment the first byte of a chunk reaches the
+ * writer, the closest the element gets to capture (i2s DMA and the ring
+ * buffers before the writer add a few tens of ms), to the 226 of its APPE.
+ */
+
+#ifndef LIVE_UPLOAD_H_
+#define LIVE_UPLOAD_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LIVE_UPLOAD_MAX_CHUNKS              32
+#define LIVE_UPLOAD_NAME_MAX                48
+#define LIVE_UPLOAD_SUFFIX                  ".live.wav"
+
+/* Close the control session after this long without chunks */
+#if !defined LIVE_UPLOAD_IDLE_QUIT_MS
+#define LIVE_UPLOAD_IDLE_QUIT_MS            (60 * 1000)
+#endif
+
+/* TCP keepalive on the control session while it waits for chunks, seconds */
+#if !defined LIVE_UPLOAD_KEEPALIVE_S
+#define LIVE_UPLOAD_KEEPALIVE_S             15
+#endif
+
+typedef struct {
+    const char  *server;
+    uint16_t    port;
+    const char  *server2;           /* Fallback server, may be NULL */
+    uint16_t    port2;
+    const char  *user;
+    const char  *pass;
+    bool        tls;                /* Explicit FTPS (AUTH TLS) */
+    const char  *ca_pem;            /* Server CA for tls, NULL skips verification */
+    const char  *remote_dir;
+    bool        block_mode;         /* Try MODE B, chunks then skip PASV and the TCP handshake */
+    int         chunk_ms;           /* Audio per APPE */
+    size_t      queue_bytes;        /* PSRAM pool, split into at most LIVE_UPLOAD_MAX_CHUNKS chunks */
+} live_upload_cfg_t;
+
+typedef struct {
+    uint32_t chunks;                /* Taken by the server */
+    uint32_t failed;                /* Not taken, the live file ended there */
+    uint32_t skipped;               /* Queued behind a failed chunk of the same file */
+    uint32_t overflows;             /* Live files ended because the pool was full */
+    uint64_t bytes;
+    int      queue_peak;            /* Most chunks waiting at once */
+    uint32_t latency_min_ms;        /* Chunk reaching the writer to its 226 */
+    uint32_t latency_max_ms;
+    uint32_t latency_last_ms;
+    uint64_t latency_sum_ms;
+} live_upload_stats_t;
+
+esp_err_t live_upload_start(const live_upload_cfg_t *config);
+
+/**
+ * @brief  sd_wav_writer_tap_cb_t, set as writer_cfg.tap_cb. Does nothing
+ *         before live_upload_start().
+ */
+void live_upload_tap(const char *uri, const audio_element_info_t *info, const void *data, int len, void *ctx);
+
+/**
+ * @brief  Queue the partial last chunk of uri, call from the segment_cb of
+ *         the writer when uri is closed
+ */
+void live_upload_file_done(const char *uri);
+
+/**
+ * @brief  Block until every queued chunk is sent or timeout expires
+ */
+esp_err_t live_upload_wait_idle(TickType_t timeout);
+
+void live_upload_get_stats(live_upload_stats_t *stats);
+void live_upload_log_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIVE_UPLOAD_H_ */
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "nvs_flash.h"
@@ -9,6 +11,7 @@
 #include "freertos/task.h"
 #include "esp_system.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_sntp.h"
 #include "audio_pipeline.h"
 #include "audio_element.h"
@@ -22,20 +25,33 @@
 #include "periph_sdcard.h"
 #include "esp_sleep.h"
 #include "ftp_client.h"
+#include "task_plan.h"
+#include "schedule.h"
+#include "clip_archive.h"
+#include "clip_store.h"
 
 #define MAX_FILES_TO_UPLOAD 10
+// 1: 待上傳的檔案打包成一個 tar 用一次 STOR 上傳 (NAS 上 tar -xf 解開), 0: 每個檔案各自 STOR
+#define UPLOAD_ARCHIVE 1
 #define RECORD_TIME_SECONDS 10
 #define WAKEUP_TIME_SECONDS 10
-#define UPLOAD_HOUR 23
-#define UPLOAD_MINUTE 59
-#define UPLOAD_SECOND 0
 
 static const char *TAG = "audio_pipeline";
-char upload_files[MAX_FILES_TO_UPLOAD][128];  // 存儲上傳的檔案路徑
-int num_files_to_upload = 0;  // 待上傳的檔案數量
 
+// 上傳完成的錄音從卡上刪除, 並在索引標為 DELETED
+static void clip_done(const clip_store_entry_t *entry) {
+    unlink(entry->path);
+    clip_store_set_state(entry, CLIP_STORE_DELETED);
+}
+
+// 待上傳的錄音由 clip_store 的索引取出 (最舊的優先), 深度睡眠後仍在; 失敗的留在卡上下次再傳
 void upload_files_to_ftp() {
-    ESP_LOGI(TAG, "開始定時上傳");
+    static clip_store_entry_t entries[MAX_FILES_TO_UPLOAD];
+    int num_files_to_upload = clip_store_list(CLIP_STORE_PENDING, entries, MAX_FILES_TO_UPLOAD);
+    if (num_files_to_upload == 0) {
+        return;
+    }
+    ESP_LOGI(TAG, "開始定時上傳, %d 個檔案", num_files_to_upload);
 
     static NetBuf_t* ftpClientNetBuf = NULL;
     FtpClient* ftpClient = getFtpClient();
@@ -43,17 +59,51 @@ void upload_files_to_ftp() {
 
     if (connect == 0) {
         ESP_LOGE(TAG, "FTP 伺服器連接失敗");
-        esp_restart();
+        return;
     }
 
     int login = ftpClient->ftpClientLogin(CONFIG_FTP_USER, CONFIG_FTP_PASSWORD, ftpClientNetBuf);
     if (login == 0) {
         ESP_LOGE(TAG, "FTP 伺服器登錄失敗");
-        esp_restart();
+        ftpClient->ftpClientQuit(ftpClientNetBuf);
+        return;
     }
 
+#if UPLOAD_ARCHIVE
+    const char *paths[MAX_FILES_TO_UPLOAD];
+    bool included[MAX_FILES_TO_UPLOAD];
+    for (int i = 0; i < num_files_to_upload; i++) {
+        paths[i] = entries[i].path;
+    }
+    char archive[128];
+    time_t now = time(NULL);
+    strftime(archive, sizeof(archive), "/Lab303/esp32/test/%Y.%m.%d.%H.%M.%S.tar", localtime(&now));
+    clip_archive_stats_t stats;
+    esp_err_t ret = clip_archive_put(ftpClientNetBuf, archive, paths, num_files_to_upload, included, &stats);
+    if (ret == ESP_OK) {
+        ESP_LOGI(TAG, "檔案打包上傳成功: %s", archive);
+        clip_archive_log_stats("tar", &stats);
+    } else {
+        ESP_LOGE(TAG, "檔案打包上傳失敗: %s", archive);
+    }
+    // 只有確實打包進去的才刪; 不在卡上的從索引移除, 其餘 (含上傳失敗的) 留待下次
+    for (int i = 0; i < num_files_to_upload; i++) {
+        struct stat st;
+        if (included[i] || stat(entries[i].path, &st) != 0) {
+            clip_done(&entries[i]);
+        }
+    }
+#else
+    // 記錄逐檔 STOR 的速度, 和打包上傳比較
+    clip_archive_stats_t stats = { 0 };
+    int64_t start = esp_timer_get_time();
     for (int i = 0; i < num_files_to_upload; i++) {
-        char* file_path = upload_files[i];
+        char* file_path = entries[i].path;
+        struct stat st;
+        if (stat(file_path, &st) != 0) {
+            clip_done(&entries[i]);
+            continue;
+        }
         char new_path[128]; 
         snprintf(new_path, sizeof(new_path), "/Lab303/esp32/test/%s", basename(file_path));
         ftpClient->ftpClientPut(file_path, new_path, FTP_CLIENT_BINARY, ftpClientNetBuf);
@@ -63,18 +113,45 @@ void upload_files_to_ftp() {
             if (sscanf(lastResponse, "%d", &responseCode) == 1) {
                 if (responseCode >= 200 && responseCode < 300) {
                     ESP_LOGI(TAG, "檔案上傳成功: %s", file_path);
+                    stats.files++;
+                    stats.bytes += st.st_size;
+                    clip_done(&entries[i]);
                 } else {
                     ESP_LOGE(TAG, "檔案上傳失敗: %s", file_path);
                 }
             }
         }
     }
+    stats.wire_bytes = stats.bytes;
+    stats.elapsed_us = esp_timer_get_time() - start;
+    clip_archive_log_stats("STOR", &stats);
+#endif
 
     ftpClient->ftpClientQuit(ftpClientNetBuf);
-    num_files_to_upload = 0;  // 清空待上傳的檔案陣列
+}
+
+// 錄音時段內 WAKEUP_TIME_SECONDS 後再錄, 時段外睡到下一個時段開始;
+// 卡上還有待傳的錄音時, 上傳時段比它早開始就先醒來上傳
+static void sleep_until_next_wake(void) {
+    time_t now = time(NULL);
+    time_t wake = schedule_next_start(SCHEDULE_RECORD, now + WAKEUP_TIME_SECONDS);
+    clip_store_entry_t pending;
+    if (clip_store_list(CLIP_STORE_PENDING, &pending, 1) > 0) {
+        time_t upload = schedule_next_start(SCHEDULE_UPLOAD, now + WAKEUP_TIME_SECONDS);
+        if (upload != (time_t)-1 && (wake == (time_t)-1 || upload < wake)) {
+            wake = upload;
+        }
+    }
+    if (wake == (time_t)-1) {
+        wake = now + WAKEUP_TIME_SECONDS;
+    }
+    esp_sleep_enable_timer_wakeup((uint64_t)(wake - now) * 1000000ULL);
+    ESP_LOGI(TAG, "Entering deep sleep for %ld s", (long)(wake - now));
+    esp_deep_sleep_start();
 }
 
 void app_main(void) {
+    task_plan_set_cpu_freq(TASK_PLAN_CPU_FREQ_MHZ);
     init_nvs();
     esp_netif_init();
     esp_event_loop_create_default();
@@ -103,11 +180,14 @@ void app_main(void) {
 
     esp_log_level_set("*", ESP_LOG_WARN);
     esp_log_level_set(TAG, ESP_LOG_INFO);
+    esp_log_level_set("CLIP_ARCHIVE", ESP_LOG_INFO);
 
     ESP_LOGI(TAG, "[1.0] Mount sdcard");
     esp_periph_config_t periph_cfg = DEFAULT_ESP_PERIPH_SET_CONFIG();
     esp_periph_set_handle_t set = esp_periph_set_init(&periph_cfg);
     audio_board_sdcard_init(set, SD_MODE_1_LINE);
+    // 錄音存在 /sdcard/YYYY/MM/DD/, 待上傳的檔案由 /sdcard/clips.idx 記錄
+    clip_store_init("/sdcard");
 
     ESP_LOGI(TAG, "[2.0] Start codec chip");
     audio_board_handle_t board_handle = audio_board_init();
@@ -122,25 +202,30 @@ void app_main(void) {
     i2s_stream_cfg_t i2s_cfg = I2S_STREAM_CFG_DEFAULT();
     i2s_cfg.type = AUDIO_STREAM_READER;
     i2s_cfg.multi_out_num = 1;
-    i2s_cfg.task_core = 1;
+    i2s_cfg.task_core = task_plan_core(TASK_ROLE_CAPTURE);
+    i2s_cfg.task_prio = task_plan_prio(TASK_ROLE_CAPTURE);
     i2s_cfg.i2s_config.channel_format = I2S_CHANNEL_FMT_RIGHT_LEFT;
     i2s_stream_reader = i2s_stream_init(&i2s_cfg);
 
     ESP_LOGI(TAG, "[3.2] Create wav encoder to encode wav format");
     wav_encoder_cfg_t wav_cfg = DEFAULT_WAV_ENCODER_CONFIG();
+    wav_cfg.task_core = task_plan_core(TASK_ROLE_ENCODE);
+    wav_cfg.task_prio = task_plan_prio(TASK_ROLE_ENCODE);
     wav_encoder = wav_encoder_init(&wav_cfg);
 
     ESP_LOGI(TAG, "[3.3] Create fatfs stream to write wav file to sdcard");
     fatfs_stream_cfg_t fs_cfg = FATFS_STREAM_CFG_DEFAULT();
     fs_cfg.type = AUDIO_STREAM_WRITER;
+    fs_cfg.task_core = task_plan_core(TASK_ROLE_STORAGE);
+    fs_cfg.task_prio = task_plan_prio(TASK_ROLE_STORAGE);
     wav_fatfs_stream_writer = fatfs_stream_init(&fs_cfg);
 
-    if (1) {
-        char filename[64];
-        time_t now;
-        time(&now);
-        struct tm *local_time = localtime(&now);
-        strftime(filename, sizeof(filename), "/sdcard/%Y.%m.%d.%H.%M.%S.wav", local_time);
+    // 錄音時段由 schedule_rules.h 設定
+    time_t now = time(NULL);
+    if (schedule_active(SCHEDULE_RECORD, now)) {
+        char filename[CLIP_STORE_PATH_MAX];
+        clip_store_path(now, ".wav", filename, sizeof(filename));
+        clip_store_open(filename);
 
         ESP_LOGI(TAG, "[3.4] File name: %s", filename);
         audio_element_info_t info = AUDIO_ELEMENT_INFO_DEFAULT();
@@ -200,11 +285,8 @@ void app_main(void) {
         audio_pipeline_terminate(pipeline_wav);
                 audio_pipeline_unregister_more(pipeline_wav, i2s_stream_reader, wav_encoder, wav_fatfs_stream_writer, NULL);
 
-        // 將檔案路徑添加到陣列中
-        if (num_files_to_upload < MAX_FILES_TO_UPLOAD) {
-            snprintf(upload_files[num_files_to_upload], sizeof(upload_files[num_files_to_upload]), "%s", filename);
-            num_files_to_upload++;
-        }
+        // 加入索引等待上傳
+        clip_store_add(filename, CLIP_STORE_SCORE_UNKNOWN);
 
         audio_event_iface_remove_listener(esp_periph_set_get_event_iface(set), evt);
         audio_event_iface_destroy(evt);
@@ -212,13 +294,25 @@ void app_main(void) {
         audio_element_deinit(i2s_stream_reader);
         audio_element_deinit(wav_encoder);
         audio_element_deinit(wav_fatfs_stream_writer);
+
+        // 上傳時段內把卡上待傳的錄音 (含這一段) 傳到 NAS
+        if (schedule_active(SCHEDULE_UPLOAD, time(NULL))) {
+            upload_files_to_ftp();
+        }
         esp_periph_set_destroy(set);
 
         ESP_LOGI(TAG, "[7.0] Entering deep sleep after recording for %d seconds", RECORD_TIME_SECONDS);
         vTaskDelay(5 * 1000 / portTICK_PERIOD_MS);
-        esp_sleep_enable_timer_wakeup(WAKEUP_TIME_SECONDS * 1000000);
-        ESP_LOGI(TAG, "Entering deep sleep");
-        esp_deep_sleep_start();
+        sleep_until_next_wake();
+    }
+    else {
+        // 不在錄音時段: 為上傳時段醒來的, 傳完卡上待傳的錄音再睡
+        ESP_LOGI(TAG, "Outside the recording windows");
+        if (schedule_active(SCHEDULE_UPLOAD, now)) {
+            upload_files_to_ftp();
+        }
+        esp_periph_set_destroy(set);
+        sleep_until_next_wake();
     }
 }
 
@@ -255,23 +349,3 @@ void wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id
         ESP_LOGI(TAG, "got ip:%s", ip4addr_ntoa(&event->ip_info.ip));
     }
 }
-
-void set_upload_timer(void) {
-    struct tm timeinfo;
-    time_t now;
-    time(&now);
-    localtime_r(&now, &timeinfo);
-    timeinfo.tm_hour = UPLOAD_HOUR;
-    timeinfo.tm_min = UPLOAD_MINUTE;
-    timeinfo.tm_sec = UPLOAD_SECOND;
-
-    time_t future = mktime(&timeinfo);
-    time_t current = time(NULL);
-    if (current > future) {
-        future += 24 * 60 * 60;
-    }
-    int64_t delay = (future - current) * 1000000;
-    esp_sleep_enable_timer_wakeup(delay);
-    ESP_LOGI(TAG, "Entering deep sleep for next upload");
-    esp_deep_sleep_start();
-}
@@ -0,0 +1,244 @@
+/*
+ * ota_update - firmware update pulled from the NAS
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "nvs.h"
+#include "mbedtls/sha256.h"
+#include "audio_mem.h"
+#include "audio_idf_version.h"
+#include "ftp_fetch.h"
+#include "ota_update.h"
+
+static const char *TAG = "OTA_UPDATE";
+
+#define OTA_UPDATE_NVS_NAMESPACE            "ota_update"
+#define OTA_UPDATE_NVS_KEY                  "sha256"       /* Installed and confirmed */
+#define OTA_UPDATE_NVS_PENDING              "pending"      /* Installed, not confirmed yet */
+#define OTA_UPDATE_NVS_PENDING_AT           "pending_at"   /* Flash address of its partition */
+#define OTA_UPDATE_NVS_TRIES                "tries"
+#define OTA_UPDATE_DIGEST_LEN               32
+
+typedef struct {
+    esp_ota_handle_t        handle;
+    mbedtls_sha256_context  sha;
+    uint8_t                 *sector;
+    int                     fill;
+    size_t                  written;
+} ota_update_ctx_t;
+
+static int _hex(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* First 64 characters of sha256sum output */
+static esp_err_t _parse_digest(const char *text, uint8_t *digest)
+{
+    for (int i = 0; i < OTA_UPDATE_DIGEST_LEN; i++) {
+        int hi = _hex(text[2 * i]);
+        int lo = hi < 0 ? -1 : _hex(text[2 * i + 1]);
+        if (lo < 0) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        digest[i] = (hi << 4) | lo;
+    }
+    return ESP_OK;
+}
+
+static bool _get_digest(nvs_handle_t nvs, const char *key, uint8_t *digest)
+{
+    size_t len = OTA_UPDATE_DIGEST_LEN;
+    return nvs_get_blob(nvs, key, digest, &len) == ESP_OK && len == OTA_UPDATE_DIGEST_LEN;
+}
+
+/* Confirmed by the image itself, or tried OTA_UPDATE_MAX_TRIES times and rolled back each time */
+static bool _installed(const uint8_t *digest)
+{
+    nvs_handle_t nvs;
+    uint8_t last[OTA_UPDATE_DIGEST_LEN];
+    uint8_t tries = 0;
+    if (nvs_open(OTA_UPDATE_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return false;
+    }
+    bool installed = _get_digest(nvs, OTA_UPDATE_NVS_KEY, last) && memcmp(last, digest, sizeof(last)) == 0;
+    if (!installed && _get_digest(nvs, OTA_UPDATE_NVS_PENDING, last) && memcmp(last, digest, sizeof(last)) == 0
+        && nvs_get_u8(nvs, OTA_UPDATE_NVS_TRIES, &tries) == ESP_OK && tries >= OTA_UPDATE_MAX_TRIES) {
+        ESP_LOGW(TAG, "Image rolled back %d times, waiting for a different one", tries);
+        installed = true;
+    }
+    nvs_close(nvs);
+    return installed;
+}
+
+/* Written to part, becomes the installed digest when it confirms itself there */
+static void _set_pending(const uint8_t *digest, const esp_partition_t *part)
+{
+    nvs_handle_t nvs;
+    uint8_t last[OTA_UPDATE_DIGEST_LEN];
+    uint8_t tries = 0;
+    if (nvs_open(OTA_UPDATE_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    if (_get_digest(nvs, OTA_UPDATE_NVS_PENDING, last) && memcmp(last, digest, sizeof(last)) == 0) {
+        nvs_get_u8(nvs, OTA_UPDATE_NVS_TRIES, &tries);
+    }
+    nvs_set_blob(nvs, OTA_UPDATE_NVS_PENDING, digest, OTA_UPDATE_DIGEST_LEN);
+    nvs_set_u32(nvs, OTA_UPDATE_NVS_PENDING_AT, part->address);
+    nvs_set_u8(nvs, OTA_UPDATE_NVS_TRIES, tries + 1);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+static void _abort(esp_ota_handle_t handle)
+{
+#if (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 3, 0))
+    esp_ota_abort(handle);
+#else
+    esp_ota_end(handle);
+#endif
+}
+
+static esp_err_t _flash_sink(const uint8_t *data, int len, void *arg)
+{
+    ota_update_ctx_t *ctx = arg;
+    mbedtls_sha256_update(&ctx->sha, data, len);
+    while (len > 0) {
+        int n = OTA_UPDATE_WRITE_SIZE - ctx->fill;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(ctx->sector + ctx->fill, data, n);
+        ctx->fill += n;
+        data += n;
+        len -= n;
+        if (ctx->fill == OTA_UPDATE_WRITE_SIZE) {
+            esp_err_t ret = esp_ota_write(ctx->handle, ctx->sector, ctx->fill);
+            if (ret != ESP_OK) {
+                ESP_LOGE(TAG, "Flash write at %u failed: %s", (unsigned)ctx->written, esp_err_to_name(ret));
+                return ret;
+            }
+            ctx->written += ctx->fill;
+            ctx->fill = 0;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t ota_update_run(NetBuf_t *ctrl, const char *remote_image)
+{
+    char path[256];
+    char text[96];
+    uint8_t expected[OTA_UPDATE_DIGEST_LEN];
+    snprintf(path, sizeof(path), "%s.sha256", remote_image);
+    esp_err_t ret = ftp_fetch_to_buffer(ctrl, path, text, sizeof(text), NULL);
+    if (ret != ESP_OK && ret != ESP_ERR_INVALID_SIZE) {
+        return ret;
+    }
+    if (_parse_digest(text, expected) != ESP_OK) {
+        ESP_LOGE(TAG, "%s holds no SHA-256 digest", path);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (_installed(expected)) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    const esp_partition_t *part = esp_ota_get_next_update_partition(NULL);
+    if (part == NULL) {
+        ESP_LOGE(TAG, "No OTA partition, flash a two OTA partition table first");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    /* Erase only what the image needs when the server reports its size */
+    unsigned int size = 0;
+    size_t image_size = OTA_SIZE_UNKNOWN;
+    if (getFtpClient()->ftpClientGetFileSize(remote_image, &size, FTP_CLIENT_BINARY, ctrl)) {
+        if (size > part->size) {
+            ESP_LOGE(TAG, "%s is %u bytes, %s holds %u", remote_image, size, part->label, (unsigned)part->size);
+            return ESP_ERR_INVALID_SIZE;
+        }
+        image_size = size;
+    }
+
+    ota_update_ctx_t ctx = {0};
+    ctx.sector = audio_malloc(OTA_UPDATE_WRITE_SIZE);
+    if (ctx.sector == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    ret = esp_ota_begin(part, image_size, &ctx.handle);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_begin %s failed: %s", part->label, esp_err_to_name(ret));
+        audio_free(ctx.sector);
+        return ret;
+    }
+    ESP_LOGI(TAG, "Writing %s to %s", remote_image, part->label);
+    mbedtls_sha256_init(&ctx.sha);
+    mbedtls_sha256_starts(&ctx.sha, 0);
+    ret = ftp_fetch(ctrl, remote_image, _flash_sink, &ctx, NULL);
+    if (ret == ESP_OK && ctx.fill > 0) {
+        ret = esp_ota_write(ctx.handle, ctx.sector, ctx.fill);
+        ctx.written += ctx.fill;
+    }
+    uint8_t digest[OTA_UPDATE_DIGEST_LEN];
+    mbedtls_sha256_finish(&ctx.sha, digest);
+    mbedtls_sha256_free(&ctx.sha);
+    audio_free(ctx.sector);
+
+    if (ret == ESP_OK && memcmp(digest, expected, sizeof(digest)) != 0) {
+        ESP_LOGE(TAG, "SHA-256 mismatch after %u bytes, image dropped", (unsigned)ctx.written);
+        ret = ESP_ERR_INVALID_CRC;
+    }
+    if (ret != ESP_OK) {
+        _abort(ctx.handle);
+        return ret;
+    }
+    ret = esp_ota_end(ctx.handle);
+    if (ret == ESP_OK) {
+        ret = esp_ota_set_boot_partition(part);
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Image rejected: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    _set_pending(expected, part);
+    ESP_LOGI(TAG, "Installed %u bytes to %s, boots after restart", (unsigned)ctx.written, part->label);
+    return ESP_OK;
+}
+
+void ota_update_confirm(void)
+{
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    esp_ota_img_states_t state;
+    if (esp_ota_get_state_partition(running, &state) == ESP_OK && state == ESP_OTA_IMG_PENDING_VERIFY) {
+        esp_ota_mark_app_valid_cancel_rollback();
+        ESP_LOGI(TAG, "New image confirmed");
+    }
+    nvs_handle_t nvs;
+    uint8_t digest[OTA_UPDATE_DIGEST_LEN];
+    uint32_t address;
+    if (nvs_open(OTA_UPDATE_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    /* Only the image that was installed there takes over the digest, after a
+       rollback the old image leaves it pending and fetches the update again */
+    if (_get_digest(nvs, OTA_UPDATE_NVS_PENDING, digest)
+        && nvs_get_u32(nvs, OTA_UPDATE_NVS_PENDING_AT, &address) == ESP_OK && address == running->address) {
+        nvs_set_blob(nvs, OTA_UPDATE_NVS_KEY, digest, OTA_UPDATE_DIGEST_LEN);
+        nvs_erase_key(nvs, OTA_UPDATE_NVS_PENDING);
+        nvs_erase_key(nvs, OTA_UPDATE_NVS_PENDING_AT);
+        nvs_erase_key(nvs, OTA_UPDATE_NVS_TRIES);
+        nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+}
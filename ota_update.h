@@ -0,0 +1,59 @@
+/*
+ * ota_update - firmware update pulled from the NAS
+ *
+ * The image is streamed from RETR (ftp_fetch) straight into the next OTA
+ * partition in flash sector sized writes while its SHA-256 is computed, so it
+ * never touches the SD card and needs no RAM beyond one sector. The expected
+ * digest is read from <image>.sha256 (sha256sum output) first; when it equals
+ * the digest of the image installed and confirmed last (kept in NVS) nothing
+ * is downloaded. On a digest mismatch or an image esp_ota_end() rejects the
+ * boot partition is left unchanged.
+ *
+ * With CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE a new image boots in the pending
+ * verify state: ota_update_confirm() has to be called once it has proven
+ * itself, any reset or deep sleep before that (deep sleep wakes through the
+ * bootloader) boots the previous image again. The digest of a new image is
+ * kept as pending until the image confirms itself, so the previous image
+ * fetches it again after a rollback, up to OTA_UPDATE_MAX_TRIES times.
+ */
+
+#ifndef OTA_UPDATE_H_
+#define OTA_UPDATE_H_
+
+#include "esp_err.h"
+#include "FtpClient.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Flash is erased and written in units of one sector */
+#define OTA_UPDATE_WRITE_SIZE               4096
+
+/* Installs of an image that never confirmed itself before it is skipped */
+#if !defined OTA_UPDATE_MAX_TRIES
+#define OTA_UPDATE_MAX_TRIES                3
+#endif
+
+/**
+ * @brief  Install remote_image if remote_image.sha256 offers a new one
+ *
+ * @return ESP_OK               new image installed and set to boot, restart to run it
+ *         ESP_ERR_NOT_FOUND    no update offered, or already installed
+ *         ESP_ERR_INVALID_CRC  downloaded image does not match the digest
+ *         other                download or flash error, the running image stays
+ */
+esp_err_t ota_update_run(NetBuf_t *ctrl, const char *remote_image);
+
+/**
+ * @brief  Mark the running image good when it still waits for verification,
+ *         cancelling the rollback, and record its digest as installed. Call
+ *         after a local self-test and before the first deep sleep or restart.
+ */
+void ota_update_confirm(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OTA_UPDATE_H_ */
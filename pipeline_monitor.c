@@ -0,0 +1,216 @@
+/*
+ * pipeline_monitor - ring buffer instrumentation for the recording pipeline
+ */
+
+#include <string.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "sd_wav_writer.h"
+#include "pipeline_monitor.h"
+
+static const char *TAG = "PIPELINE_MONITOR";
+
+struct pipeline_monitor {
+    esp_timer_handle_t          timer;
+    int                         period_ms;
+    audio_element_handle_t      writer;
+    int                         count;
+    audio_element_handle_t      el[PIPELINE_MONITOR_MAX_ELEMENTS];
+    bool                        was_full[PIPELINE_MONITOR_MAX_ELEMENTS];
+    bool                        was_empty[PIPELINE_MONITOR_MAX_ELEMENTS];
+    pipeline_monitor_stats_t    stats[PIPELINE_MONITOR_MAX_ELEMENTS];
+    uint32_t                    drops;
+};
+
+/* Survives deep sleep so the next wake-up starts with the learned size */
+RTC_DATA_ATTR static int s_adaptive_rb_size;
+
+static void _record_drop(pipeline_monitor_handle_t mon, int index)
+{
+    mon->drops++;
+    if (mon->writer == NULL) {
+        return;
+    }
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    audio_element_info_t info = {0};
+    audio_element_getinfo(mon->writer, &info);
+    pipeline_monitor_event_t evt = {
+        .time_sec = (uint32_t)tv.tv_sec,
+        .time_ms = (uint16_t)(tv.tv_usec / 1000),
+        .element = (uint8_t)index,
+        .kind = PIPELINE_MONITOR_OVERRUN,
+        .byte_pos = (uint32_t)info.byte_pos,
+    };
+    sd_wav_writer_append_trailer(mon->writer, "drop", &evt, sizeof(evt));
+}
+
+static void _monitor_sample(void *arg)
+{
+    pipeline_monitor_handle_t mon = (pipeline_monitor_handle_t)arg;
+    for (int i = 0; i < mon->count; i++) {
+        ringbuf_handle_t rb = audio_element_get_output_ringbuf(mon->el[i]);
+        if (rb == NULL) {
+            continue;
+        }
+        pipeline_monitor_stats_t *st = &mon->stats[i];
+        int size = rb_get_size(rb);
+        int fill = rb_bytes_filled(rb);
+        st->size = size;
+        st->samples++;
+        st->fill_sum += fill;
+        st->fill_last = fill;
+        if (fill < st->fill_min) {
+            st->fill_min = fill;
+        }
+        if (fill > st->fill_max) {
+            st->fill_max = fill;
+        }
+        bool full = (fill >= size);
+        bool empty = (fill == 0);
+        if (full && !mon->was_full[i]) {
+            st->overruns++;
+            if (i == 0) {
+                _record_drop(mon, i);
+            }
+        }
+        if (empty && !mon->was_empty[i]) {
+            st->underruns++;
+        }
+        mon->was_full[i] = full;
+        mon->was_empty[i] = empty;
+    }
+}
+
+pipeline_monitor_handle_t pipeline_monitor_init(const pipeline_monitor_cfg_t *config)
+{
+    pipeline_monitor_handle_t mon = audio_calloc(1, sizeof(struct pipeline_monitor));
+    AUDIO_MEM_CHECK(TAG, mon, return NULL);
+    mon->period_ms = config->period_ms > 0 ? config->period_ms : PIPELINE_MONITOR_PERIOD_MS;
+    mon->writer = config->writer;
+
+    esp_timer_create_args_t timer_args = {
+        .callback = _monitor_sample,
+        .arg = mon,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "pl_monitor",
+    };
+    if (esp_timer_create(&timer_args, &mon->timer) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create timer");
+        audio_free(mon);
+        return NULL;
+    }
+    return mon;
+}
+
+esp_err_t pipeline_monitor_add(pipeline_monitor_handle_t mon, audio_element_handle_t el)
+{
+    if (mon == NULL || el == NULL || mon->count >= PIPELINE_MONITOR_MAX_ELEMENTS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    mon->el[mon->count++] = el;
+    return ESP_OK;
+}
+
+esp_err_t pipeline_monitor_start(pipeline_monitor_handle_t mon)
+{
+    for (int i = 0; i < mon->count; i++) {
+        memset(&mon->stats[i], 0, sizeof(mon->stats[i]));
+        mon->stats[i].fill_min = INT32_MAX;
+        mon->was_full[i] = false;
+        mon->was_empty[i] = false;
+    }
+    mon->drops = 0;
+    return esp_timer_start_periodic(mon->timer, mon->period_ms * 1000);
+}
+
+esp_err_t pipeline_monitor_stop(pipeline_monitor_handle_t mon)
+{
+    return esp_timer_stop(mon->timer);
+}
+
+esp_err_t pipeline_monitor_get_stats(pipeline_monitor_handle_t mon, int index, pipeline_monitor_stats_t *stats)
+{
+    if (mon == NULL || stats == NULL || index < 0 || index >= mon->count) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(stats, &mon->stats[index], sizeof(*stats));
+    return ESP_OK;
+}
+
+uint32_t pipeline_monitor_get_drops(pipeline_monitor_handle_t mon)
+{
+    return mon->drops;
+}
+
+int pipeline_monitor_fill_percent(pipeline_monitor_handle_t mon, int index)
+{
+    if (mon == NULL || index < 0 || index >= mon->count || mon->stats[index].size == 0) {
+        return 0;
+    }
+    return mon->stats[index].fill_last * 100 / mon->stats[index].size;
+}
+
+void pipeline_monitor_log(pipeline_monitor_handle_t mon)
+{
+    for (int i = 0; i < mon->count; i++) {
+        pipeline_monitor_stats_t *st = &mon->stats[i];
+        if (st->samples == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG, "[%s] rb %d, fill min %d avg %" PRIu64 " max %d, overruns %u, underruns %u",
+                 audio_element_get_tag(mon->el[i]), st->size, st->fill_min,
+                 st->fill_sum / st->samples, st->fill_max, st->overruns, st->underruns);
+    }
+    if (mon->drops) {
+        ESP_LOGW(TAG, "%u drop(s) at the source", mon->drops);
+    }
+}
+
+int pipeline_monitor_adaptive_rb_size(int default_size)
+{
+    if (s_adaptive_rb_size < default_size) {
+        s_adaptive_rb_size = default_size;
+    }
+    return s_adaptive_rb_size;
+}
+
+void pipeline_monitor_adapt(pipeline_monitor_handle_t mon, uint32_t writer_max_latency_us, int default_size)
+{
+    int size = pipeline_monitor_adaptive_rb_size(default_size);
+    /* The link in front of the writer is the output of the element before it */
+    int link = mon->count >= 2 ? mon->count - 2 : 0;
+    pipeline_monitor_stats_t *st = &mon->stats[link];
+
+    if (mon->drops || st->overruns || writer_max_latency_us > PIPELINE_MONITOR_SPIKE_US) {
+        size *= 2;
+        if (size > PIPELINE_MONITOR_RB_MAX_SIZE) {
+            size = PIPELINE_MONITOR_RB_MAX_SIZE;
+        }
+    } else if (st->samples && st->fill_max < size / 4) {
+        size /= 2;
+        if (size < default_size) {
+            size = default_size;
+        }
+    }
+    if (size != s_adaptive_rb_size) {
+        ESP_LOGI(TAG, "Writer ring buffer %d -> %d (max latency %u us)", s_adaptive_rb_size, size, writer_max_latency_us);
+    }
+    s_adaptive_rb_size = size;
+}
+
+esp_err_t pipeline_monitor_deinit(pipeline_monitor_handle_t mon)
+{
+    if (mon == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_timer_stop(mon->timer);
+    esp_timer_delete(mon->timer);
+    audio_free(mon);
+    return ESP_OK;
+}
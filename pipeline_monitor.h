@@ -0,0 +1,116 @@
+/*
+ * pipeline_monitor - ring buffer instrumentation for the recording pipeline
+ *
+ * Samples the output ring buffer of every registered element at a fixed
+ * period, tracks fill levels and counts overruns (ring buffer full, the
+ * producer blocks; for the I2S reader this means the DMA drops samples) and
+ * underruns (ring buffer empty, the consumer starves). Overruns of the first
+ * (source) element are dropped samples; they are stored with a timestamp in a
+ * "drop" chunk of the clip written by sd_wav_writer.
+ *
+ * The adaptive mode sizes the ring buffer in front of the writer from the
+ * previous clip's overruns and SD write latency. The size survives deep
+ * sleep; ring buffers go to PSRAM through audio_calloc() when
+ * CONFIG_SPIRAM_BOOT_INIT is set.
+ */
+
+#ifndef PIPELINE_MONITOR_H_
+#define PIPELINE_MONITOR_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PIPELINE_MONITOR_MAX_ELEMENTS       4
+
+#if !defined PIPELINE_MONITOR_PERIOD_MS
+#define PIPELINE_MONITOR_PERIOD_MS          10
+#endif
+
+/* SD write latency that counts as a spike for the adaptive mode */
+#if !defined PIPELINE_MONITOR_SPIKE_US
+#define PIPELINE_MONITOR_SPIKE_US           (150 * 1000)
+#endif
+
+/* Largest ring buffer the adaptive mode will ask for */
+#if !defined PIPELINE_MONITOR_RB_MAX_SIZE
+#define PIPELINE_MONITOR_RB_MAX_SIZE        (512 * 1024)
+#endif
+
+#define PIPELINE_MONITOR_OVERRUN            1
+#define PIPELINE_MONITOR_UNDERRUN           2
+
+/* One entry of the "drop" chunk, little endian */
+typedef struct __attribute__((packed)) {
+    uint32_t time_sec;      /* Unix time */
+    uint16_t time_ms;
+    uint8_t  element;       /* Index in pipeline_monitor_add() order */
+    uint8_t  kind;          /* PIPELINE_MONITOR_OVERRUN */
+    uint32_t byte_pos;      /* Writer position when it happened */
+} pipeline_monitor_event_t;
+
+typedef struct {
+    int      size;          /* Ring buffer size */
+    uint32_t samples;
+    uint32_t overruns;
+    uint32_t underruns;
+    int      fill_min;
+    int      fill_max;
+    int      fill_last;
+    uint64_t fill_sum;
+} pipeline_monitor_stats_t;
+
+typedef struct {
+    int                     period_ms;
+    audio_element_handle_t  writer;     /* sd_wav_writer receiving the "drop" chunk, may be NULL */
+} pipeline_monitor_cfg_t;
+
+#define PIPELINE_MONITOR_CFG_DEFAULT() {        \
+    .period_ms = PIPELINE_MONITOR_PERIOD_MS,    \
+    .writer = NULL,                             \
+}
+
+typedef struct pipeline_monitor *pipeline_monitor_handle_t;
+
+pipeline_monitor_handle_t pipeline_monitor_init(const pipeline_monitor_cfg_t *config);
+
+/**
+ * @brief  Monitor the output ring buffer of el, call in pipeline order after
+ *         audio_pipeline_link()
+ */
+esp_err_t pipeline_monitor_add(pipeline_monitor_handle_t mon, audio_element_handle_t el);
+
+esp_err_t pipeline_monitor_start(pipeline_monitor_handle_t mon);
+esp_err_t pipeline_monitor_stop(pipeline_monitor_handle_t mon);
+
+esp_err_t pipeline_monitor_get_stats(pipeline_monitor_handle_t mon, int index, pipeline_monitor_stats_t *stats);
+uint32_t pipeline_monitor_get_drops(pipeline_monitor_handle_t mon);
+
+/**
+ * @brief  Fill level of the output ring buffer of element index at the last
+ *         sample, in percent. Cheap enough to poll from other tasks.
+ */
+int pipeline_monitor_fill_percent(pipeline_monitor_handle_t mon, int index);
+void pipeline_monitor_log(pipeline_monitor_handle_t mon);
+
+/**
+ * @brief  Ring buffer size to use in front of the writer for the next clip
+ */
+int pipeline_monitor_adaptive_rb_size(int default_size);
+
+/**
+ * @brief  Update the adaptive size from the clip that just finished
+ */
+void pipeline_monitor_adapt(pipeline_monitor_handle_t mon, uint32_t writer_max_latency_us, int default_size);
+
+esp_err_t pipeline_monitor_deinit(pipeline_monitor_handle_t mon);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PIPELINE_MONITOR_H_ */
@@ -1,5 +1,8 @@
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/stat.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
@@ -32,7 +35,26 @@
 #include "periph_sdcard.h"
 #include "board.h"
 #include "FtpClient.h"
-#include "FtpClient.c"
+#include "sd_wav_writer.h"
+#include "pipeline_monitor.h"
+#include "task_plan.h"
+#include "upload_worker.h"
+#include "ftp_retry.h"
+#include "feature_extractor.h"
+#include "wake_on_sound.h"
+#include "schedule.h"
+#include "clip_stage.h"
+#include "clip_store.h"
+#include "retention.h"
+#include "sim_source.h"
+#include "cycle_prof.h"
+#include "bin_log.h"
+#include "live_upload.h"
+#include "ota_update.h"
+#include "site_config.h"
+#if !defined CONFIG_ESP_LYRAT_MINI_V1_1_BOARD
+#include "es8388.h"
+#endif
 
 #include "audio_idf_version.h"
 
@@ -44,10 +66,133 @@
 
 #define WAKEUP_TIME_SECONDS 5
 
+// 1: 由 ULP 監測 ADC1 上的音量, 有聲音才喚醒錄音 (需外接包絡/前級輸出到 ADC1 腳位)
+#define WAKE_ON_SOUND 0
+#define WAKE_ON_SOUND_ADC_CHANNEL 6
+// 安靜時最長睡眠時間, 到時仍會醒來錄一段並上傳補傳檔案
+#define WAKE_ON_SOUND_MAX_SLEEP_SECONDS 3600
+
 static const char *TAG = "PIPELINE_REC_WAV_SDCARD";
 
 #define RECORD_TIME_SECONDS (47)  
 
+// 1: 預先配置檔案空間並以 cluster 對齊寫入 (sd_wav_writer), 0: 使用 fatfs_stream
+#define WAV_WRITER_PREALLOC 1
+// 1: WAV 檔頭內含 LIST/INFO (裝置 ID, 開始時間, 說明) 與時間索引, NAS 端可用 REST+RETR 只取需要的時段
+#define WAV_CONTAINER 1
+#define WAV_INDEX_INTERVAL_MS 1000
+#define WAV_INFO_COMMENT "mic=ES8388 right channel, site=" FTP_UPLOAD_DIR
+// 錄音中每隔多久把目前長度寫回檔頭第一個 sector 並 sync (0 = 不寫), 電池沒電時最多只少這段時間的錄音
+#define WAV_CHECKPOINT_MS 1000
+// 1: 依上一段錄音的 SD 延遲與溢位自動調整 wav_encoder->writer 的 ring buffer 大小
+#define PIPELINE_ADAPTIVE_RB 1
+// 1: 不用麥克風, 改播 SD 卡上的 WAV 檔 (沒有則用白雜訊) 跑完整個錄音/寫卡/上傳流程, 每次輸入都一樣
+// 錄完印出即時倍率、音源到 writer 的延遲、各 task 的 CPU 與記憶體, 用來比較各項效能修改
+#define SIM_SOURCE 0
+#define SIM_SOURCE_FIXTURE "/sdcard/sim/fixture.wav"
+// 1: 依取樣率送出 (和麥克風一樣, 跟不上就掉資料), 0: 管線收多快就送多快, 測能快過即時幾倍
+#define SIM_SOURCE_REALTIME 1
+// 1: 錄完印出各元素每個音訊 frame 用掉的 CPU cycles 與在 240/160/80 MHz 下佔一個核心的比例, 判斷能否降頻省電
+#define CYCLE_PROF 0
+// 每隔多久印一次並重新計算 (0 = 只在錄音結束時印), 邊錄邊傳長時間錄音時使用
+#define CYCLE_PROF_PERIOD_S 0
+// 1: 錄音中每秒的進度、FTP 指令/回應與短寫等熱路徑 log 以二進位存在 PSRAM, 不在當下格式化輸出到 UART
+// 每段錄音結束寫成 <檔名>.blg 隨錄音上傳, 睡眠前還沒寫出的存到 RTC 記憶體; 用 tools/bin_log_decode.py 配合同一版韌體的 ELF 解碼
+#define BIN_LOG 1
+#define BIN_LOG_RING_BYTES (32 * 1024)
+// 1: 開機時比較 BIN_LOGI 與 ESP_LOGI 每次呼叫花的時間
+#define BIN_LOG_BENCH 0
+// 1: 邊錄邊傳, 錄音不中斷, 每 RECORD_TIME_SECONDS 切一個檔案交給背景上傳 (需 WAV_WRITER_PREALLOC)
+#define CONCURRENT_UPLOAD 0
+// 1: 邊錄邊傳時每段先放在 PSRAM, 連得上 NAS 就直接從記憶體上傳不寫 SD 卡, 斷線或空間不足才寫入 SD 卡
+// 每段 44.1 kHz 單聲道約 88 KB/s, 空間要夠放兩段以上 (一段上傳中, 一段錄音中)
+#define CLIP_STAGE 1
+#define CLIP_STAGE_ARENA_SIZE (3 * 1024 * 1024)
+#define CLIP_STAGE_SEGMENT_SECONDS 15
+// 1: 邊錄邊傳時每 LIVE_UPLOAD_CHUNK_MS 把錄到的音訊 APPE 到 NAS 上的 <檔名>.live.wav, 幾秒內就聽得到
+// 完整的檔案仍照常上傳, 網路卡住超過佇列能存的時間, 該檔案剩下的部分只在 SD 卡上
+#define LIVE_UPLOAD 0
+#define LIVE_UPLOAD_CHUNK_MS 1000
+// PSRAM 佇列, 和 CLIP_STAGE_ARENA_SIZE 共用 PSRAM (44.1 kHz 單聲道約 88 KB/s)
+#define LIVE_UPLOAD_QUEUE_BYTES (768 * 1024)
+
+#define FTP_UPLOAD_DIR "/Lab303/esp32/Yunlin/steal1"
+
+// 1: SD 卡剩餘空間低於 RETENTION_LOW_PCT 時刪除索引中的片段直到 RETENTION_HIGH_PCT, NAS 連不上多天也不會因卡滿停止錄音
+#define RETENTION 1
+// RETENTION_LOWEST_SCORE: 安靜的片段 (mel 頻帶最大能量低) 先刪, RETENTION_OLDEST_FIRST: 最舊的先刪
+#define RETENTION_POLICY RETENTION_LOWEST_SCORE
+#define RETENTION_LOW_PCT 10
+#define RETENTION_HIGH_PCT 15
+// 另外保留給錄音中與 PSRAM 中段落的空間 (44.1 kHz 單聲道約 88 KB/s)
+#define RETENTION_RESERVE_BYTES (4 * RECORD_TIME_SECONDS * 88 * 1024)
+#define RETENTION_PERIOD_MS (30 * 1000)
+
+// 1: 同時從 i2s 的第二個輸出計算 mel 頻帶能量, 存成 .mel 檔一起上傳 (約為 WAV 的 1/100)
+#define FEATURE_EXTRACT 1
+#define FEATURE_FFT_SIZE 1024
+#define FEATURE_MEL_BANDS 40
+#define FEATURE_FRAMES_PER_RECORD 4
+#define FEATURE_RB_SIZE (16 * 1024)
+// 0: 只上傳 .mel, .mel 上傳成功後刪除 WAV (只需要頻帶能量的站點)
+#define FEATURE_UPLOAD_WAV 1
+
+// 備援 FTP 伺服器, 主伺服器 FTP_CLIENT_FALLBACK_DELAY_MS 內沒回應就同時嘗試, 留空字串則停用
+#if !defined FTP_FALLBACK_SERVER
+#define FTP_FALLBACK_SERVER ""
+#define FTP_FALLBACK_PORT CONFIG_FTP_PORT
+#endif
+
+// 上傳限速 (bytes/s, 0 = 不限速), 白天避免佔滿現場共用的上行頻寬
+#define UPLOAD_RATE_DAY_BPS (64 * 1024)
+#define UPLOAD_RATE_NIGHT_BPS 0
+#define UPLOAD_RATE_DAY_START_HOUR 7
+#define UPLOAD_RATE_DAY_END_HOUR 19
+
+// 1: 使用 FTPS (AUTH TLS), 帳密與錄音都加密傳送; NAS 要先開啟 FTPS, 不支援 AUTH TLS 的伺服器會拒絕連線
+#define FTP_USE_TLS 0
+// NAS 憑證的 CA (PEM 字串), FTP_USE_TLS 必須設定, 否則無法確認連到的是自己的 NAS
+// #define FTP_TLS_CA_PEM "-----BEGIN CERTIFICATE-----\n...\n-----END CERTIFICATE-----\n"
+// 1: 沒有 CA 也使用 FTPS, 不驗證伺服器憑證 (只防被動竊聽, 中間人仍可取得帳密與韌體更新)
+#define FTP_TLS_INSECURE 0
+// 1: 試著用 MODE B, 伺服器支援時多個檔案共用一條資料連線, 不支援則自動用一般的 stream mode
+#define FTP_BLOCK_MODE 1
+
+// 每輪上傳的重試時間上限, 超過就把檔案留在 SD 卡下一輪再傳
+#define FTP_RETRY_BUDGET_MS (3 * 60 * 1000)
+// 每輪最多補傳幾個之前沒傳成功的檔案
+#define FTP_BACKLOG_MAX_FILES 4
+
+// 1: 上傳後從 NAS 讀取站點設定 (上傳目錄, 麥克風增益, 時段) 並檢查韌體更新, 不用到現場
+// 韌體旁要放 sha256sum 的輸出 (REMOTE_FIRMWARE_PATH ".sha256"), 更新後第一次錄音存進 SD 卡 (不在錄音時段則是校時成功) 才確認
+// 確認前重置就開回舊版, 舊版之後會再下載同一個更新, 最多 OTA_UPDATE_MAX_TRIES 次
+#define REMOTE_UPDATE 1
+#define REMOTE_CONFIG_PATH FTP_UPLOAD_DIR "/site.cfg"
+#define REMOTE_FIRMWARE_PATH "/Lab303/esp32/update/firmware.bin"
+
+#if FTP_USE_TLS && !defined FTP_TLS_CA_PEM && !FTP_TLS_INSECURE
+#error "FTP_USE_TLS needs FTP_TLS_CA_PEM, or FTP_TLS_INSECURE to skip server verification"
+#endif
+#if !defined FTP_TLS_CA_PEM
+#define FTP_TLS_CA_PEM NULL
+#endif
+
+#if WAV_CONTAINER && !WAV_WRITER_PREALLOC
+#error "WAV_CONTAINER needs WAV_WRITER_PREALLOC"
+#endif
+
+#if CONCURRENT_UPLOAD && !WAV_WRITER_PREALLOC
+#error "CONCURRENT_UPLOAD needs WAV_WRITER_PREALLOC"
+#endif
+
+#if LIVE_UPLOAD && !CONCURRENT_UPLOAD
+#error "LIVE_UPLOAD needs CONCURRENT_UPLOAD"
+#endif
+
+#if FEATURE_EXTRACT && CONCURRENT_UPLOAD
+#error "FEATURE_EXTRACT is not supported with CONCURRENT_UPLOAD"
+#endif
+
 void init_nvs() {
     esp_err_t err = nvs_flash_init();
     if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
@@ -99,8 +244,183 @@ void obtain_time(void) {
     }
 }
 
+static long upload_rate(void *ctx)
+{
+    time_t now;
+    struct tm tm_now;
+    time(&now);
+    localtime_r(&now, &tm_now);
+    if (tm_now.tm_hour >= UPLOAD_RATE_DAY_START_HOUR && tm_now.tm_hour < UPLOAD_RATE_DAY_END_HOUR) {
+        return UPLOAD_RATE_DAY_BPS;
+    }
+    return UPLOAD_RATE_NIGHT_BPS;
+}
+
+// 上傳目錄, 站點設定有指定就用 NAS 上的設定
+static const char *upload_dir(void)
+{
+    const char *dir = site_config_get()->upload_dir;
+    return dir[0] ? dir : FTP_UPLOAD_DIR;
+}
+
+#if !CONCURRENT_UPLOAD || REMOTE_UPDATE
+static void ftp_session_ready(NetBuf_t *ctrl, void *ctx)
+{
+    FtpClient *ftpClient = getFtpClient();
+    ftpClient->ftpClientSetOptions(FTP_CLIENT_RATELIMIT, upload_rate(NULL), ctrl);
+    ftpClient->ftpClientSetOptions(FTP_CLIENT_BLOCKMODE, FTP_BLOCK_MODE, ctrl);
+    FtpClientTimings_t timings;
+    if (ftpClient->ftpClientGetTimings(&timings, ctrl)) {
+        ESP_LOGI(TAG, "ftp server %d: dns %" PRIu32 " us%s, connect %" PRIu32 " us, banner %" PRIu32 " us, login %" PRIu32 " us, tls %" PRIu32 " us",
+                 timings.server, timings.dnsUs, timings.dnsCached ? " (cached)" : "",
+                 timings.connectUs, timings.bannerUs, timings.loginUs, timings.tlsUs);
+    }
+}
+
+// 上傳與遠端更新共用的連線設定與重試預算
+static ftp_retry_handle_t ftp_retry_open(void)
+{
+    ftp_retry_cfg_t retry_cfg = FTP_RETRY_CFG_DEFAULT();
+    retry_cfg.server = CONFIG_FTP_SERVER;
+    retry_cfg.port = CONFIG_FTP_PORT;
+    retry_cfg.server2 = FTP_FALLBACK_SERVER[0] ? FTP_FALLBACK_SERVER : NULL;
+    retry_cfg.port2 = FTP_FALLBACK_PORT;
+    retry_cfg.user = CONFIG_FTP_USER;
+    retry_cfg.pass = CONFIG_FTP_PASSWORD;
+    retry_cfg.tls = FTP_USE_TLS;
+    retry_cfg.ca_pem = FTP_TLS_CA_PEM;
+    retry_cfg.budget_ms = FTP_RETRY_BUDGET_MS;
+    retry_cfg.session_cb = ftp_session_ready;
+    return ftp_retry_init(&retry_cfg);
+}
+#endif
+
+#if !CONCURRENT_UPLOAD
+static bool backlog_wanted(const char *name, int len)
+{
+    if (len < 5) {
+        return false;
+    }
+    if (FEATURE_UPLOAD_WAV && strcasecmp(name + len - 4, ".wav") == 0) {
+        return true;
+    }
+    if (BIN_LOG && strcasecmp(name + len - 4, ".blg") == 0) {
+        return true;
+    }
+    return FEATURE_EXTRACT && strcasecmp(name + len - 4, ".mel") == 0;
+}
+
+// 上傳之前失敗留在 SD 卡上的錄音與特徵檔 (不含本輪的 current), 由 clip_store 的索引依時間順序取出, 不必掃描目錄
+static void upload_backlog(ftp_retry_handle_t ftp_retry, const char *current)
+{
+    // 只傳特徵檔時 WAV 也在索引裡, 多取一些才湊得到 FTP_BACKLOG_MAX_FILES 個
+    static clip_store_entry_t entries[FTP_BACKLOG_MAX_FILES * 2 + 2];
+    int current_len = strlen(current) - 4;
+    int n = clip_store_list(CLIP_STORE_PENDING, entries, sizeof(entries) / sizeof(entries[0]));
+    int count = 0;
+    for (int i = 0; i < n && count < FTP_BACKLOG_MAX_FILES; i++) {
+        char *local = entries[i].path;
+        const char *name = strrchr(local, '/') + 1;
+        if (!backlog_wanted(name, strlen(name))
+            || (strncmp(local, current, current_len) == 0 && strlen(local) == current_len + 4)) {
+            continue;
+        }
+        struct stat st;
+        if (stat(local, &st) != 0) {
+            // 不在卡上 (例如留在 PSRAM 沒寫入的段落), 從索引移除
+            clip_store_set_state(&entries[i], CLIP_STORE_DELETED);
+            continue;
+        }
+        char remote[300];
+        snprintf(remote, sizeof(remote), "%s/%s", upload_dir(), name);
+        count++;
+        esp_err_t ret = ftp_retry_put(ftp_retry, local, remote);
+        if (ret == ESP_OK) {
+            ESP_LOGI(TAG, "補傳成功: %s", local);
+            unlink(local);
+            clip_store_set_state(&entries[i], CLIP_STORE_DELETED);
+            if (!FEATURE_UPLOAD_WAV && strcasecmp(name + strlen(name) - 4, ".mel") == 0) {
+                // 特徵檔已上傳, 對應的 WAV 不再需要
+                strcpy(local + strlen(local) - 4, ".wav");
+                unlink(local);
+                int j = 0;
+                while (j < n && strcmp(entries[j].path, local) != 0) {
+                    j++;
+                }
+                if (j < n) {
+                    clip_store_set_state(&entries[j], CLIP_STORE_DELETED);
+                } else {
+                    clip_store_uploaded(local, true);
+                }
+            }
+        } else if (ret == ESP_ERR_TIMEOUT) {
+            break;
+        }
+    }
+}
+#endif
+
+#if REMOTE_UPDATE
+// 讀取站點設定並檢查韌體更新, 回傳 true 表示新韌體已寫入, 要重新開機
+static bool remote_update(ftp_retry_handle_t ftp_retry)
+{
+    NetBuf_t *ctrl = ftp_retry_session(ftp_retry);
+    if (ctrl == NULL) {
+        return false;
+    }
+    site_config_fetch(ctrl, REMOTE_CONFIG_PATH);
+    return ota_update_run(ctrl, REMOTE_FIRMWARE_PATH) == ESP_OK;
+}
+#endif
+
+#if CONCURRENT_UPLOAD
+static void segment_done(audio_element_handle_t self, const char *closed_uri,
+                         char *next_uri, int next_uri_len, void *ctx)
+{
+    ESP_LOGI(TAG, "Segment done: %s", closed_uri);
+#if LIVE_UPLOAD
+    live_upload_file_done(closed_uri);
+#endif
+    clip_store_add(closed_uri, CLIP_STORE_SCORE_UNKNOWN);
+    upload_worker_enqueue(closed_uri);
+#if RETENTION
+    retention_kick();
+#endif
+    if (next_uri) {
+        clip_store_path(time(NULL), ".wav", next_uri, next_uri_len);
+        clip_store_open(next_uri);
+    }
+}
+
+static int writer_pressure(void *ctx)
+{
+    // monitor 的第 1 個元素是 wav_encoder, 它的輸出就是 writer 的輸入
+    return pipeline_monitor_fill_percent((pipeline_monitor_handle_t)ctx, 1);
+}
+#endif
+
+#if SIM_SOURCE && WAV_WRITER_PREALLOC
+static void sim_writer_tap(const char *uri, const audio_element_info_t *info, const void *data, int len, void *ctx)
+{
+    sim_source_tap(uri, info, data, len, ctx);
+#if CONCURRENT_UPLOAD && LIVE_UPLOAD
+    live_upload_tap(uri, info, data, len, NULL);
+#endif
+}
+#endif
+
 void app_main(void)
 {
+    task_plan_set_cpu_freq(TASK_PLAN_CPU_FREQ_MHZ);
+#if BIN_LOG
+    bin_log_cfg_t bin_log_cfg = BIN_LOG_CFG_DEFAULT();
+    bin_log_cfg.ring_bytes = BIN_LOG_RING_BYTES;
+    bin_log_init(&bin_log_cfg);
+#if BIN_LOG_BENCH
+    esp_log_level_set("BIN_LOG", ESP_LOG_INFO);
+    bin_log_bench(100);
+#endif
+#endif
     init_nvs();
     esp_netif_init();
     esp_event_loop_create_default();
@@ -130,26 +450,87 @@ void app_main(void)
 
     esp_log_level_set("*", ESP_LOG_WARN);
     esp_log_level_set(TAG, ESP_LOG_INFO);
+    esp_log_level_set("SITE_CONFIG", ESP_LOG_INFO);
+    esp_log_level_set("OTA_UPDATE", ESP_LOG_INFO);
+    // 上次從 NAS 取得的時段設定 (存在 RTC 記憶體)
+    site_config_apply();
+
+#if WAKE_ON_SOUND
+    esp_log_level_set("WAKE_ON_SOUND", ESP_LOG_INFO);
+    bool sound_wake = wake_on_sound_triggered();
+    wake_on_sound_disarm();
+    ESP_LOGI(TAG, "Wakeup by %s", sound_wake ? "sound" : "timer");
+#endif
 
     ESP_LOGI(TAG, "[1.0] Mount sdcard");
     esp_periph_config_t periph_cfg = DEFAULT_ESP_PERIPH_SET_CONFIG();
     esp_periph_set_handle_t set = esp_periph_set_init(&periph_cfg);
     audio_board_sdcard_init(set, SD_MODE_1_LINE);
+    // 錄音存在 /sdcard/YYYY/MM/DD/, 待上傳的檔案由 /sdcard/clips.idx 記錄
+    esp_log_level_set("CLIP_STORE", ESP_LOG_INFO);
+    clip_store_init("/sdcard");
+#if WAV_WRITER_PREALLOC
+    // 上次錄到一半斷電 (電池沒電, 重置) 的檔案: 依最後一個檢查點修好檔頭, 排入補傳
+    clip_store_entry_t interrupted;
+    if (clip_store_interrupted(&interrupted) == ESP_OK) {
+        if (sd_wav_writer_recover(interrupted.path, NULL) == ESP_ERR_NOT_FOUND) {
+            // 不在卡上, 或第一個檢查點前就斷電
+            unlink(interrupted.path);
+            clip_store_set_state(&interrupted, CLIP_STORE_DELETED);
+        } else {
+            clip_store_add(interrupted.path, CLIP_STORE_SCORE_UNKNOWN);
+        }
+    }
+#endif
+#if RETENTION
+    esp_log_level_set("RETENTION", ESP_LOG_INFO);
+    retention_cfg_t retention_cfg = RETENTION_CFG_DEFAULT();
+    retention_cfg.drive = SD_WAV_WRITER_FATFS_DRIVE;
+    retention_cfg.policy = RETENTION_POLICY;
+    retention_cfg.low_pct = RETENTION_LOW_PCT;
+    retention_cfg.high_pct = RETENTION_HIGH_PCT;
+    retention_cfg.reserve_bytes = RETENTION_RESERVE_BYTES;
+    if (retention_init(&retention_cfg) == ESP_OK) {
+        // 錄音還沒開始, 一次清到 RETENTION_HIGH_PCT
+        while (retention_step() > 0) {
+        }
+    }
+#endif
 
     ESP_LOGI(TAG, "[2.0] Start codec chip");
     audio_board_handle_t board_handle = audio_board_init();
     audio_hal_ctrl_codec(board_handle->audio_hal, AUDIO_HAL_CODEC_MODE_ENCODE, AUDIO_HAL_CTRL_START);
+#if !defined CONFIG_ESP_LYRAT_MINI_V1_1_BOARD
+    if (site_config_get()->mic_gain_db >= 0) {
+        es8388_set_mic_gain((es_mic_gain_t)(site_config_get()->mic_gain_db / 3));
+    }
+#endif
 
     ESP_LOGI(TAG, "[3.0] Create audio pipeline_wav for recording");
     audio_pipeline_cfg_t pipeline_cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
     pipeline_wav = audio_pipeline_init(&pipeline_cfg);
     mem_assert(pipeline_wav);
 
+#if SIM_SOURCE
+    ESP_LOGI(TAG, "[3.1] Create simulated source playing %s", SIM_SOURCE_FIXTURE);
+    sim_source_cfg_t sim_cfg = SIM_SOURCE_CFG_DEFAULT();
+    sim_cfg.multi_out_num = 1;
+    sim_cfg.task_core = task_plan_core(TASK_ROLE_CAPTURE);
+    sim_cfg.task_prio = task_plan_prio(TASK_ROLE_CAPTURE);
+    sim_cfg.fixture = SIM_SOURCE_FIXTURE;
+    sim_cfg.realtime = SIM_SOURCE_REALTIME;
+    // 邊錄邊傳時一直送到停止為止
+    sim_cfg.duration_ms = CONCURRENT_UPLOAD ? 0 : RECORD_TIME_SECONDS * 1000;
+    i2s_stream_reader = sim_source_init(&sim_cfg);
+    mem_assert(i2s_stream_reader);
+    esp_log_level_set("SIM_SOURCE", ESP_LOG_INFO);
+#else
     ESP_LOGI(TAG, "[3.1] Create i2s stream to read audio data from codec chip");
     i2s_stream_cfg_t i2s_cfg = I2S_STREAM_CFG_DEFAULT();
     i2s_cfg.type = AUDIO_STREAM_READER;
     i2s_cfg.multi_out_num = 1;
-    i2s_cfg.task_core = 1;
+    i2s_cfg.task_core = task_plan_core(TASK_ROLE_CAPTURE);
+    i2s_cfg.task_prio = task_plan_prio(TASK_ROLE_CAPTURE);
     i2s_cfg.i2s_config.channel_format = I2S_CHANNEL_FMT_ONLY_RIGHT;
     // Add your specific configuration based on your board and audio format
 #if defined CONFIG_ESP_LYRAT_MINI_V1_1_BOARD
@@ -161,45 +542,202 @@ void app_main(void)
     i2s_cfg.i2s_config.sample_rate = 44100;
 #endif
     i2s_stream_reader = i2s_stream_init(&i2s_cfg);
+#endif
 
     ESP_LOGI(TAG, "[3.2] Create wav encoder to encode wav format");
     wav_encoder_cfg_t wav_cfg = DEFAULT_WAV_ENCODER_CONFIG();
+    wav_cfg.task_core = task_plan_core(TASK_ROLE_ENCODE);
+    wav_cfg.task_prio = task_plan_prio(TASK_ROLE_ENCODE);
     wav_encoder = wav_encoder_init(&wav_cfg);
 
+#if WAV_WRITER_PREALLOC
+    ESP_LOGI(TAG, "[3.3] Create sd wav writer to write preallocated file to sdcard");
+    sd_wav_writer_cfg_t writer_cfg = SD_WAV_WRITER_CFG_DEFAULT();
+    writer_cfg.expected_seconds = RECORD_TIME_SECONDS;
+    writer_cfg.task_core = task_plan_core(TASK_ROLE_STORAGE);
+    writer_cfg.task_prio = task_plan_prio(TASK_ROLE_STORAGE);
+    writer_cfg.checkpoint_ms = WAV_CHECKPOINT_MS;
+#if CONCURRENT_UPLOAD
+    writer_cfg.segment_seconds = RECORD_TIME_SECONDS;
+    writer_cfg.segment_cb = segment_done;
+#if LIVE_UPLOAD
+    writer_cfg.tap_cb = live_upload_tap;
+#endif
+#if CLIP_STAGE
+    if (clip_stage_init(CLIP_STAGE_ARENA_SIZE) == ESP_OK) {
+        writer_cfg.segment_seconds = CLIP_STAGE_SEGMENT_SECONDS;
+        writer_cfg.expected_seconds = CLIP_STAGE_SEGMENT_SECONDS;
+        writer_cfg.stage = true;
+    }
+    esp_log_level_set("CLIP_STAGE", ESP_LOG_INFO);
+#endif
+#endif
+#if SIM_SOURCE
+    // 量測音源到 writer 的延遲
+    writer_cfg.tap_cb = sim_writer_tap;
+    writer_cfg.tap_ctx = i2s_stream_reader;
+#endif
+#if WAV_CONTAINER
+    uint8_t mac[6] = {0};
+    char device_id[24];
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    snprintf(device_id, sizeof(device_id), "lyrat-%02x%02x%02x%02x%02x%02x",
+             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    writer_cfg.container = true;
+    writer_cfg.index_interval_ms = WAV_INDEX_INTERVAL_MS;
+    writer_cfg.device_id = device_id;
+    writer_cfg.info_comment = WAV_INFO_COMMENT;
+#endif
+    wav_fatfs_stream_writer = sd_wav_writer_init(&writer_cfg);
+    esp_log_level_set("SD_WAV_WRITER", ESP_LOG_INFO);
+#if WAKE_ON_SOUND
+    if (sound_wake) {
+        // 觸發前的音量紀錄存進 WAV 的 "wosh" chunk
+        static wake_on_sound_history_t wos_history;
+        if (wake_on_sound_get_history(&wos_history) == ESP_OK) {
+            sd_wav_writer_append_trailer(wav_fatfs_stream_writer, "wosh", &wos_history, sizeof(wos_history));
+        }
+    }
+#endif
+#else
     ESP_LOGI(TAG, "[3.3] Create fatfs stream to write data to sdcard");
     fatfs_stream_cfg_t fatfs_cfg = FATFS_STREAM_CFG_DEFAULT();
     fatfs_cfg.type = AUDIO_STREAM_WRITER;
+    fatfs_cfg.task_core = task_plan_core(TASK_ROLE_STORAGE);
+    fatfs_cfg.task_prio = task_plan_prio(TASK_ROLE_STORAGE);
     wav_fatfs_stream_writer = fatfs_stream_init(&fatfs_cfg);
+#endif
+
+#if FEATURE_EXTRACT
+    // i2s 的第二個輸出不等待讀取端, 特徵計算跟不上時只會少算幾個 frame, 不影響錄音
+    ESP_LOGI(TAG, "[3.3.1] Create feature extractor on the second i2s output");
+    feature_extractor_cfg_t feature_cfg = FEATURE_EXTRACTOR_CFG_DEFAULT();
+    feature_cfg.task_core = task_plan_core(TASK_ROLE_COMPRESS);
+    feature_cfg.task_prio = task_plan_prio(TASK_ROLE_COMPRESS);
+    feature_cfg.fft_size = FEATURE_FFT_SIZE;
+    feature_cfg.mel_bands = FEATURE_MEL_BANDS;
+    feature_cfg.frames_per_record = FEATURE_FRAMES_PER_RECORD;
+    audio_element_handle_t feature_extractor = feature_extractor_init(&feature_cfg);
+    mem_assert(feature_extractor);
+    ringbuf_handle_t feature_rb = rb_create(FEATURE_RB_SIZE, 1);
+    mem_assert(feature_rb);
+    audio_element_set_input_ringbuf(feature_extractor, feature_rb);
+    audio_element_set_multi_output_ringbuf(i2s_stream_reader, feature_rb, 0);
+    esp_log_level_set("FEATURE_EXTRACTOR", ESP_LOG_INFO);
+#endif
 
     time_t t;
     struct tm *local_time;
     time(&t);
     local_time = localtime(&t);
-    // int next_5am_seconds = (5 - local_time->tm_hour) * 3600 - local_time->tm_min * 60 - local_time->tm_sec;
-    // if (next_5am_seconds <= 0) {
-    //     next_5am_seconds += 24 * 3600;
-    // }
+    esp_log_level_set("SCHEDULE", ESP_LOG_INFO);
+    schedule_log();
 
-    // if (local_time->tm_hour >= 5 && local_time->tm_hour < 19)
-    if (1)
+    // 錄音時段由 schedule_rules.h 設定
+    if (schedule_active(SCHEDULE_RECORD, t))
     {
         char filename[64];
-        strftime(filename, sizeof(filename), "/sdcard/%Y.%m.%d.%H.%M.%S.wav", local_time);
+        clip_store_path(t, ".wav", filename, sizeof(filename));
+#if WAV_WRITER_PREALLOC
+        clip_store_open(filename);
+#endif
 
         ESP_LOGI(TAG, "[3.4] File name: %s", filename);
         audio_element_info_t info = AUDIO_ELEMENT_INFO_DEFAULT();
         audio_element_getinfo(i2s_stream_reader, &info);
         audio_element_setinfo(wav_fatfs_stream_writer, &info);
+#if CYCLE_PROF
+        cycle_prof_cfg_t prof_cfg = {
+            .sample_rate = info.sample_rates,
+            .cpu_mhz = TASK_PLAN_CPU_FREQ_MHZ,
+        };
+        if (cycle_prof_init(&prof_cfg) == ESP_OK) {
+            // ADF 元素的 process 無法包裝, 以 task 名稱 (註冊到 pipeline 的名字) 取執行時間
+            cycle_prof_watch("i2s");
+            cycle_prof_watch("wav");
+            cycle_prof_watch("wav_file");
+#if FEATURE_EXTRACT
+            cycle_prof_watch("feature");
+#endif
+        }
+        esp_log_level_set("CYCLE_PROF", ESP_LOG_INFO);
+#endif
+#if FEATURE_EXTRACT
+        char feature_file[64];
+        strcpy(feature_file, filename);
+        strcpy(feature_file + strlen(feature_file) - 4, ".mel");
+        audio_element_setinfo(feature_extractor, &info);
+        audio_element_set_uri(feature_extractor, feature_file);
+#endif
 
         ESP_LOGI(TAG, "[3.5] Register all elements to audio pipeline");
         audio_pipeline_register(pipeline_wav, i2s_stream_reader, "i2s");
         audio_pipeline_register(pipeline_wav, wav_encoder, "wav");
         audio_pipeline_register(pipeline_wav, wav_fatfs_stream_writer, "wav_file");
 
+        int writer_rb_default = audio_element_get_output_ringbuf_size(wav_encoder);
+#if PIPELINE_ADAPTIVE_RB
+        audio_element_set_output_ringbuf_size(wav_encoder, pipeline_monitor_adaptive_rb_size(writer_rb_default));
+#endif
+
         ESP_LOGI(TAG, "[3.6] Link it together [codec_chip]-->i2s_stream-->wav_encoder-->fatfs_stream-->[sdcard]");
         const char *link_wav[3] = {"i2s", "wav", "wav_file"};
         audio_pipeline_link(pipeline_wav, &link_wav[0], 3);
 
+        pipeline_monitor_cfg_t monitor_cfg = PIPELINE_MONITOR_CFG_DEFAULT();
+#if WAV_WRITER_PREALLOC
+        monitor_cfg.writer = wav_fatfs_stream_writer;
+#endif
+        pipeline_monitor_handle_t monitor = pipeline_monitor_init(&monitor_cfg);
+        pipeline_monitor_add(monitor, i2s_stream_reader);
+        pipeline_monitor_add(monitor, wav_encoder);
+        esp_log_level_set("PIPELINE_MONITOR", ESP_LOG_INFO);
+
+#if CONCURRENT_UPLOAD
+        upload_worker_cfg_t upload_cfg = {
+            .server = CONFIG_FTP_SERVER,
+            .port = CONFIG_FTP_PORT,
+            .server2 = FTP_FALLBACK_SERVER[0] ? FTP_FALLBACK_SERVER : NULL,
+            .port2 = FTP_FALLBACK_PORT,
+            .user = CONFIG_FTP_USER,
+            .pass = CONFIG_FTP_PASSWORD,
+            .tls = FTP_USE_TLS,
+            .ca_pem = FTP_TLS_CA_PEM,
+            .remote_dir = upload_dir(),
+            .block_mode = FTP_BLOCK_MODE,
+            .delete_after_upload = true,
+            .pressure_cb = writer_pressure,
+            .pressure_ctx = monitor,
+            .pressure_high = 50,
+            .pressure_low = 25,
+            .rate_cb = upload_rate,
+        };
+        upload_worker_start(&upload_cfg);
+        esp_log_level_set("UPLOAD_WORKER", ESP_LOG_INFO);
+#if RETENTION
+        // 邊錄邊傳可能連續錄好幾天, 由背景 task 每段結束時檢查空間
+        retention_start(RETENTION_PERIOD_MS);
+#endif
+#if LIVE_UPLOAD
+        live_upload_cfg_t live_cfg = {
+            .server = CONFIG_FTP_SERVER,
+            .port = CONFIG_FTP_PORT,
+            .server2 = FTP_FALLBACK_SERVER[0] ? FTP_FALLBACK_SERVER : NULL,
+            .port2 = FTP_FALLBACK_PORT,
+            .user = CONFIG_FTP_USER,
+            .pass = CONFIG_FTP_PASSWORD,
+            .tls = FTP_USE_TLS,
+            .ca_pem = FTP_TLS_CA_PEM,
+            .remote_dir = upload_dir(),
+            .block_mode = FTP_BLOCK_MODE,
+            .chunk_ms = LIVE_UPLOAD_CHUNK_MS,
+            .queue_bytes = LIVE_UPLOAD_QUEUE_BYTES,
+        };
+        live_upload_start(&live_cfg);
+        esp_log_level_set("LIVE_UPLOAD", ESP_LOG_INFO);
+#endif
+#endif
+
         ESP_LOGI(TAG, "[3.7] Set up uri (file as fatfs_stream, wav as wav encoder)");
         audio_element_set_uri(wav_fatfs_stream_writer, filename);
 
@@ -212,7 +750,18 @@ void app_main(void)
         audio_event_iface_set_listener(esp_periph_set_get_event_iface(set), evt);
 
         ESP_LOGI(TAG, "[5.0] Start audio_pipeline");
+#if FEATURE_EXTRACT
+        audio_element_run(feature_extractor);
+        audio_element_resume(feature_extractor, 0, 0);
+#endif
         audio_pipeline_run(pipeline_wav);
+        pipeline_monitor_start(monitor);
+#if CYCLE_PROF
+        cycle_prof_reset();
+        if (CYCLE_PROF_PERIOD_S > 0) {
+            cycle_prof_start(CYCLE_PROF_PERIOD_S * 1000);
+        }
+#endif
 
         ESP_LOGI(TAG, "[6.0] Listen for all pipeline events, record for %d seconds", RECORD_TIME_SECONDS);
         int second_recorded = 0;
@@ -221,8 +770,8 @@ void app_main(void)
             audio_event_iface_msg_t msg;
             if (audio_event_iface_listen(evt, &msg, 1000 / portTICK_RATE_MS) != ESP_OK){
                 second_recorded++;
-                ESP_LOGI(TAG, "[ * ] Recording ... %d", second_recorded);
-                if (second_recorded >= RECORD_TIME_SECONDS){
+                BIN_LOGI(TAG, "[ * ] Recording ... %d", second_recorded);
+                if (!CONCURRENT_UPLOAD && second_recorded >= RECORD_TIME_SECONDS){
                     ESP_LOGI(TAG, "Finishing recording");
                     audio_element_set_ringbuf_done(i2s_stream_reader);
                 }
@@ -237,114 +786,211 @@ void app_main(void)
                 break;
             }
         }
+        pipeline_monitor_stop(monitor);
+#if CONCURRENT_UPLOAD
+        // 停止取樣後 fill 不再更新, 剩下的段落不用再讓路給 writer
+        upload_worker_set_pressure(NULL, NULL);
+#endif
+#if FEATURE_EXTRACT
+        rb_done_write(feature_rb);
+#endif
 
         vTaskDelay(5 * 1000 / portTICK_PERIOD_MS);
 
+#if FEATURE_EXTRACT
+        audio_element_stop(feature_extractor);
+        audio_element_wait_for_stop(feature_extractor);
+        audio_element_terminate(feature_extractor);
+        feature_extractor_log_stats(feature_extractor);
+#endif
+
         audio_pipeline_stop(pipeline_wav);
         audio_pipeline_wait_for_stop(pipeline_wav);
         audio_pipeline_terminate(pipeline_wav);
         audio_pipeline_unregister_more(pipeline_wav, i2s_stream_reader,
                                         wav_encoder, wav_fatfs_stream_writer, NULL);
-
-        ESP_LOGI(TAG, "開始上傳"); 
-        ESP_LOGI(TAG, "ftp server:%s", CONFIG_FTP_SERVER);
-        ESP_LOGI(TAG, "ftp user  :%s", CONFIG_FTP_USER);
-        static NetBuf_t* ftpClientNetBuf = NULL;
-        FtpClient* ftpClient = getFtpClient();
-        int connect = ftpClient->ftpClientConnect(CONFIG_FTP_SERVER, CONFIG_FTP_PORT, &ftpClientNetBuf);
-        ESP_LOGI(TAG, "connect=%d", connect);
-        if (connect == 0) {
-            ESP_LOGE(TAG, "FTP server connect fail");
-            esp_restart();
+        uint8_t clip_score = CLIP_STORE_SCORE_UNKNOWN;
+#if FEATURE_EXTRACT
+        feature_extractor_stats_t feature_stats;
+        if (feature_extractor_get_stats(feature_extractor, &feature_stats) == ESP_OK && feature_stats.records) {
+            // 最大頻帶能量 (0.5 dB 一級) 當作保留分數, 卡滿時安靜的片段先刪
+            clip_score = feature_stats.peak;
         }
-
-        // 登入 FTP 伺服器
-        int login = ftpClient->ftpClientLogin(CONFIG_FTP_USER, CONFIG_FTP_PASSWORD, ftpClientNetBuf);
-        ESP_LOGI(TAG, "login=%d", login);
-        if (login == 0) {
-            ESP_LOGE(TAG, "FTP server login fail");
-            esp_restart();
+#endif
+#if WAKE_ON_SOUND
+        if (sound_wake) {
+            clip_score = 255;
         }
-
-        char file_path[128];  // 根据实际需要调整数组大小
-        snprintf(file_path, sizeof(file_path), "%s", filename);
-
-        // 開啟文件
-        FILE* file = fopen(file_path, "rb");
-        if (!file) {
-            ESP_LOGE(TAG, "無法打開文件: %s, 錯誤碼: %d", file_path, errno);
-            esp_restart();
+#endif
+#if !CONCURRENT_UPLOAD
+        // 邊錄邊傳時每段已在 segment_done 加入索引
+        clip_store_add(filename, clip_score);
+#endif
+#if FEATURE_EXTRACT
+        clip_store_add(feature_file, clip_score);
+#endif
+        // 本機自我測試: 錄完一段並存進 SD 卡就確認新韌體, 之後 NAS 連不上而睡眠也不會被回滾
+        ota_update_confirm();
+        pipeline_monitor_log(monitor);
+#if SIM_SOURCE
+        sim_source_log_report(i2s_stream_reader);
+#endif
+#if CYCLE_PROF
+        cycle_prof_log();
+#endif
+#if BIN_LOG
+        // 到這裡為止的 log 跟著這段錄音上傳, 之後的 (上傳過程) 跟下一段
+        char log_file[64];
+        strcpy(log_file, filename);
+        strcpy(log_file + strlen(log_file) - 4, ".blg");
+        bool log_drained = bin_log_drain(log_file) == ESP_OK;
+        if (log_drained) {
+            clip_store_add(log_file, clip_score);
         }
+        bin_log_log_stats();
+#endif
+#if WAV_WRITER_PREALLOC
+        sd_wav_writer_log_stats(wav_fatfs_stream_writer);
+        sd_wav_writer_stats_t writer_stats = {0};
+        sd_wav_writer_get_stats(wav_fatfs_stream_writer, &writer_stats);
+#if PIPELINE_ADAPTIVE_RB
+        pipeline_monitor_adapt(monitor, writer_stats.max_us, writer_rb_default);
+#endif
+#endif
+        bool update_installed = false;
 
-        // 獲取文件大小
-        fseek(file, 0, SEEK_END);
-        size_t file_size = ftell(file);
-        rewind(file);
-
-        // 分配緩衝區
-        char* buffer = (char*)malloc(file_size);
-        if (!buffer) {
-            ESP_LOGE(TAG, "內存不足");
-            fclose(file);
-            return;
+#if CONCURRENT_UPLOAD
+#if BIN_LOG
+        if (log_drained) {
+            upload_worker_enqueue(log_file);
         }
+#endif
+        // 最後一段已在 writer 關檔時排入佇列, 等背景上傳完成
+        esp_err_t idle_ret = upload_worker_wait_idle(pdMS_TO_TICKS(5 * 60 * 1000));
+        if (idle_ret != ESP_OK) {
+            ESP_LOGW(TAG, "%d file(s) left on sdcard", upload_worker_pending());
+        }
+        // 上傳中的 writer_pressure 可能還在讀 monitor, 等 worker 閒下來才釋放
+        pipeline_monitor_deinit(monitor);
+#if REMOTE_UPDATE
+        // 和依序上傳一樣, 這一輪都傳完才檢查設定與韌體更新
+        if (idle_ret == ESP_OK && schedule_active(SCHEDULE_UPLOAD, time(NULL))) {
+            ftp_retry_handle_t ftp_retry = ftp_retry_open();
+            if (ftp_retry) {
+                update_installed = remote_update(ftp_retry);
+                ftp_retry_deinit(ftp_retry);
+            }
+        }
+#endif
+#if LIVE_UPLOAD
+        live_upload_wait_idle(pdMS_TO_TICKS(30 * 1000));
+        live_upload_log_stats();
+#endif
+#if CLIP_STAGE
+        // 還在記憶體裡的段落睡眠前寫進 SD 卡, 下次開機由 upload_backlog 補傳
+        clip_stage_spill_all();
+        clip_stage_log_stats();
+#endif
+#else
+        // 不在上傳時段就留在 SD 卡, 之後的時段由 upload_backlog 補傳
+        if (!schedule_active(SCHEDULE_UPLOAD, time(NULL))) {
+            ESP_LOGI(TAG, "Outside upload window, %s stays on the card", filename);
+        } else {
+            ESP_LOGI(TAG, "開始上傳"); 
+            ESP_LOGI(TAG, "ftp server:%s", CONFIG_FTP_SERVER);
+            ESP_LOGI(TAG, "ftp user  :%s", CONFIG_FTP_USER);
+            ftp_retry_handle_t ftp_retry = ftp_retry_open();
+            if (ftp_retry == NULL) {
+                // 記憶體不足, 無法繼續
+                ESP_LOGE(TAG, "FTP retry init fail");
+                esp_restart();
+            }
 
-        // 讀取文件內容到緩衝區
-        fread(buffer, 1, file_size, file);
-        ESP_LOGI(TAG, "文件路徑：%s", file_path);
-        ESP_LOGI(TAG, "文件大小：%d", file_size);
-        ESP_LOGI(TAG, "FTP 開始上傳");
-
-        char new_path[128]; 
-        // sprintf(new_path, "/Lab303/esp32/2024_Taipei-Q3/%04d.%02d.%02d.%02d.%02d.%02d.wav",
-        //     local_time->tm_year + 1900, local_time->tm_mon + 1, local_time->tm_mday,
-        //     local_time->tm_hour, local_time->tm_min, local_time->tm_sec);
-
-        sprintf(new_path, "/Lab303/esp32/Yunlin/steal1/%04d.%02d.%02d.%02d.%02d.%02d.wav",
-            local_time->tm_year + 1900, local_time->tm_mon + 1, local_time->tm_mday,
-            local_time->tm_hour, local_time->tm_min, local_time->tm_sec);
-
-        // sprintf(new_path, "/Lab303/esp32/test/%04d.%02d.%02d.%02d.%02d.%02d.wav",
-        //     local_time->tm_year + 1900, local_time->tm_mon + 1, local_time->tm_mday,
-        //     local_time->tm_hour, local_time->tm_min, local_time->tm_sec);
+            char new_path[128];
+            // sprintf(new_path, "/Lab303/esp32/2024_Taipei-Q3/%04d.%02d.%02d.%02d.%02d.%02d.wav",
+            //     local_time->tm_year + 1900, local_time->tm_mon + 1, local_time->tm_mday,
+            //     local_time->tm_hour, local_time->tm_min, local_time->tm_sec);
 
-        ftpClient->ftpClientPut(file_path, new_path, FTP_CLIENT_BINARY, ftpClientNetBuf);
+            snprintf(new_path, sizeof(new_path), "%s/%04d.%02d.%02d.%02d.%02d.%02d.wav", upload_dir(),
+                local_time->tm_year + 1900, local_time->tm_mon + 1, local_time->tm_mday,
+                local_time->tm_hour, local_time->tm_min, local_time->tm_sec);
 
-        char* lastResponse = getLastResponseFtpClient(ftpClientNetBuf);
-        if (lastResponse != NULL) {
-            printf("FTP 上傳響應: %s\n", lastResponse);
+            // sprintf(new_path, "/Lab303/esp32/test/%04d.%02d.%02d.%02d.%02d.%02d.wav",
+            //     local_time->tm_year + 1900, local_time->tm_mon + 1, local_time->tm_mday,
+            //     local_time->tm_hour, local_time->tm_min, local_time->tm_sec);
 
-            // 提取響應碼
-            int responseCode;
-            if (sscanf(lastResponse, "%d", &responseCode) == 1) {
-                if (responseCode >= 200 && responseCode < 300) {
+            esp_err_t upload_ret = ESP_OK;
+#if FEATURE_EXTRACT
+            char feature_path[128];
+            strcpy(feature_path, new_path);
+            strcpy(feature_path + strlen(feature_path) - 4, ".mel");
+            ESP_LOGI(TAG, "FTP 開始上傳 %s", feature_file);
+            upload_ret = ftp_retry_put(ftp_retry, feature_file, feature_path);
+            if (upload_ret == ESP_OK) {
+                unlink(feature_file);
+                clip_store_uploaded(feature_file, true);
+            } else {
+                printf("FTP 上傳失敗 (%s), 保留 %s\n", esp_err_to_name(upload_ret), feature_file);
+            }
+#endif
+#if FEATURE_UPLOAD_WAV
+            // 時間預算已用完就不再嘗試 WAV
+            if (upload_ret != ESP_ERR_TIMEOUT) {
+                ESP_LOGI(TAG, "FTP 開始上傳 %s", filename);
+                upload_ret = ftp_retry_put(ftp_retry, filename, new_path);
+                if (upload_ret == ESP_OK) {
                     printf("FTP 上傳成功\n");
+                    if (unlink(filename) == 0) {
+                        ESP_LOGI(TAG, "成功删除文件: %s", filename);
+                        clip_store_uploaded(filename, true);
+                    } else {
+                        ESP_LOGE(TAG, "删除文件失败: %s, 错误码: %d", filename, errno);
+                        clip_store_uploaded(filename, false);
+                    }
                 } else {
-                    printf("FTP 上傳失敗\n");
-                    esp_restart();
+                    // 檔案留在 SD 卡, 下一輪再傳
+                    printf("FTP 上傳失敗 (%s), 保留 %s\n", esp_err_to_name(upload_ret), filename);
                 }
-            } else {
-                printf("無法提取響應碼\n");
-                esp_restart();  
             }
-        } else {
-            printf("無法獲取 FTP 響應\n");
-            esp_restart();
-        }
-
-        vTaskDelay(10 * 1000 / portTICK_PERIOD_MS);
+#else
+            if (upload_ret == ESP_OK && unlink(filename) == 0) {
+                ESP_LOGI(TAG, "只保留特徵檔, 删除 %s", filename);
+                clip_store_uploaded(filename, true);
+            }
+#endif
+#if BIN_LOG
+            // log 傳不上去不影響補傳, 留在卡上下一輪再傳
+            if (log_drained && upload_ret != ESP_ERR_TIMEOUT) {
+                char log_path[128];
+                strcpy(log_path, new_path);
+                strcpy(log_path + strlen(log_path) - 4, ".blg");
+                if (ftp_retry_put(ftp_retry, log_file, log_path) == ESP_OK) {
+                    unlink(log_file);
+                    clip_store_uploaded(log_file, true);
+                }
+            }
+#endif
+            if (upload_ret == ESP_OK) {
+                // 連線正常, 補傳之前留在 SD 卡上的檔案
+                upload_backlog(ftp_retry, filename);
+#if REMOTE_UPDATE
+                update_installed = remote_update(ftp_retry);
+#endif
+            }
 
-        free(buffer);
-        fclose(file);
+            ftp_retry_stats_t retry_stats;
+            ftp_retry_get_stats(ftp_retry, &retry_stats);
+            ESP_LOGI(TAG, "ftp attempts %" PRIu32 ", reconnects %" PRIu32 ", transient %" PRIu32 ", permanent %" PRIu32,
+                     retry_stats.attempts, retry_stats.reconnects, retry_stats.transient, retry_stats.permanent);
 
-        if (unlink(file_path) == 0) {
-            ESP_LOGI(TAG, "成功删除文件: %s", file_path);
-        } else {
-            ESP_LOGE(TAG, "删除文件失败: %s, 错误码: %d", file_path, errno);
+            // 關閉 FTP 連接
+            ftp_retry_deinit(ftp_retry);
         }
-
-        // 關閉 FTP 連接
-        ftpClient->ftpClientQuit(ftpClientNetBuf);
+        pipeline_monitor_deinit(monitor);
+#endif
+#if RETENTION
+        retention_log_stats();
+#endif
 
         // 停止 Wi-Fi
         esp_periph_set_stop_all(set);
@@ -355,6 +1001,10 @@ void app_main(void)
         audio_element_deinit(i2s_stream_reader);
         audio_element_deinit(wav_encoder);
         audio_element_deinit(wav_fatfs_stream_writer);
+#if FEATURE_EXTRACT
+        audio_element_deinit(feature_extractor);
+        rb_destroy(feature_rb);
+#endif
         esp_periph_set_destroy(set);
 
         /* Make sure audio_pipeline_remove_listener & audio_event_iface_remove_listener are called before destroying event_iface */
@@ -362,20 +1012,48 @@ void app_main(void)
 
         ESP_LOGI(TAG, "[7.0] Entering deep sleep after recording for %d seconds", RECORD_TIME_SECONDS);
         vTaskDelay(5 * 1000 / portTICK_PERIOD_MS);
-        esp_sleep_enable_timer_wakeup(WAKEUP_TIME_SECONDS * 1000000);
-        ESP_LOGI(TAG, "Entering deep sleep");
+        if (update_installed) {
+            ESP_LOGI(TAG, "Restarting into the new firmware");
+            esp_restart();
+        }
+        // 時段內 WAKEUP_TIME_SECONDS 後再錄, 時段外直接睡到下一個時段開始
+        time_t now = time(NULL);
+        time_t wake = schedule_next_start(SCHEDULE_RECORD, now + WAKEUP_TIME_SECONDS);
+        if (wake == (time_t)-1) {
+            wake = now + WAKEUP_TIME_SECONDS;
+        }
+#if WAKE_ON_SOUND
+        wake_on_sound_cfg_t wos_cfg = WAKE_ON_SOUND_CFG_DEFAULT();
+        wos_cfg.adc_channel = WAKE_ON_SOUND_ADC_CHANNEL;
+        if (wake == now + WAKEUP_TIME_SECONDS && wake_on_sound_arm(&wos_cfg) == ESP_OK) {
+            // 有聲音才醒; 時段結束前沒有聲音就睡到下一個時段開始
+            time_t end = schedule_window_end(SCHEDULE_RECORD, now);
+            wake = now + WAKE_ON_SOUND_MAX_SLEEP_SECONDS;
+            if (end < wake) {
+                time_t next = schedule_next_start(SCHEDULE_RECORD, end);
+                if (next != (time_t)-1 && next < wake) {
+                    wake = next;
+                }
+            }
+        }
+#endif
+        ESP_LOGI(TAG, "Entering deep sleep for %ld s", (long)(wake - now));
+        esp_sleep_enable_timer_wakeup((uint64_t)(wake - now) * 1000000ULL);
+        bin_log_suspend();
         esp_deep_sleep_start();
         // esp_restart();
     }
-    // else {
-    //     char time_str[64];
-    //     strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", local_time);
-    //     ESP_LOGI(TAG, "local_time: %s", time_str);
-    //     ESP_LOGI(TAG, "[4.0] Entering deep sleep after recording for %d seconds", RECORD_TIME_SECONDS);
-    //     char next_5am_seconds_str[10]; 
-    //     snprintf(next_5am_seconds_str, sizeof(next_5am_seconds_str), "%d", next_5am_seconds);
-    //     esp_sleep_enable_timer_wakeup((uint64_t)next_5am_seconds * 1000000);
-    //     ESP_LOGI(TAG, "Entering deep sleep %s seconds", next_5am_seconds_str);
-    //     esp_deep_sleep_start();
-    // }
+    else {
+        // 不在錄音時段 (例如開機或時間校正後), 睡到下一個時段開始
+        time_t next = schedule_next_start(SCHEDULE_RECORD, t);
+        int64_t sleep_seconds = next == (time_t)-1 ? WAKEUP_TIME_SECONDS : next - t;
+        char time_str[64];
+        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", local_time);
+        ESP_LOGI(TAG, "%s is outside the recording windows, sleeping %lld s", time_str, (long long)sleep_seconds);
+        // 連上網路並校時, 已是這條路徑上能做的自我測試; 睡眠前不確認的話醒來會被回滾
+        ota_update_confirm();
+        esp_sleep_enable_timer_wakeup((uint64_t)sleep_seconds * 1000000ULL);
+        bin_log_suspend();
+        esp_deep_sleep_start();
+    }
 }
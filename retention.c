@@ -0,0 +1,248 @@
+/*
+ * retention - keeps room on the SD card for the recording
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "ff.h"
+#include "task_plan.h"
+#include "clip_store.h"
+#include "retention.h"
+
+static const char *TAG = "RETENTION";
+
+#define RETENTION_MAGIC                     0x52455431      /* "RET1" */
+#define RETENTION_MIN_SPAN_S                600             /* Shortest sample span a fill rate is given for */
+
+#if FF_MAX_SS != FF_MIN_SS
+#define RETENTION_SECTOR_SIZE(fs)           ((fs)->ssize)
+#else
+#define RETENTION_SECTOR_SIZE(fs)           (FF_MAX_SS)
+#endif
+
+typedef struct {
+    uint32_t    time;
+    uint64_t    free_bytes;
+    uint64_t    evicted_bytes;              /* evicted_total when the sample was taken */
+} retention_sample_t;
+
+typedef struct {
+    uint32_t            magic;
+    int                 count;
+    int                 head;               /* Next slot */
+    uint64_t            evicted_total;      /* Bytes freed by eviction, across deep sleep */
+    retention_sample_t  samples[RETENTION_TREND_SAMPLES];
+} retention_rtc_t;
+
+RTC_DATA_ATTR static retention_rtc_t s_rtc;
+
+static struct {
+    retention_cfg_t     cfg;
+    SemaphoreHandle_t   lock;
+    TaskHandle_t        task;
+    int                 period_ms;
+    bool                evicting;           /* Went below low, high not reached yet */
+    retention_stats_t   stats;
+} s_ret;
+
+static esp_err_t _free_space(uint64_t *free_bytes, uint64_t *total_bytes)
+{
+    FATFS *fs;
+    DWORD clusters;
+    if (f_getfree(s_ret.cfg.drive, &clusters, &fs) != FR_OK) {
+        return ESP_FAIL;
+    }
+    uint64_t cluster_bytes = (uint64_t)fs->csize * RETENTION_SECTOR_SIZE(fs);
+    *free_bytes = clusters * cluster_bytes;
+    *total_bytes = (uint64_t)(fs->n_fatent - 2) * cluster_bytes;
+    return ESP_OK;
+}
+
+/* Record free space and update the fill rate from the oldest sample */
+static void _trend(uint64_t free_bytes, uint64_t low_bytes)
+{
+    time_t now = time(NULL);
+    if (now < 1600000000) {
+        return;         /* Clock not set */
+    }
+    if (s_rtc.magic != RETENTION_MAGIC) {
+        memset(&s_rtc, 0, sizeof(s_rtc));
+        s_rtc.magic = RETENTION_MAGIC;
+    }
+    int last = (s_rtc.head + RETENTION_TREND_SAMPLES - 1) % RETENTION_TREND_SAMPLES;
+    if (s_rtc.count == 0 || now - (time_t)s_rtc.samples[last].time >= RETENTION_TREND_INTERVAL_S) {
+        retention_sample_t *s = &s_rtc.samples[s_rtc.head];
+        s->time = now;
+        s->free_bytes = free_bytes;
+        s->evicted_bytes = s_rtc.evicted_total;
+        s_rtc.head = (s_rtc.head + 1) % RETENTION_TREND_SAMPLES;
+        if (s_rtc.count < RETENTION_TREND_SAMPLES) {
+            s_rtc.count++;
+        }
+    }
+    const retention_sample_t *oldest = &s_rtc.samples[(s_rtc.head + RETENTION_TREND_SAMPLES - s_rtc.count) % RETENTION_TREND_SAMPLES];
+    int64_t span = now - (time_t)oldest->time;
+    if (span < RETENTION_MIN_SPAN_S) {
+        return;
+    }
+    int64_t used = (int64_t)(oldest->free_bytes - free_bytes) + (int64_t)(s_rtc.evicted_total - oldest->evicted_bytes);
+    s_ret.stats.fill_bph = used * 3600 / span;
+    s_ret.stats.hours_left = -1;
+    if (s_ret.stats.fill_bph > 0) {
+        s_ret.stats.hours_left = free_bytes > low_bytes ? (free_bytes - low_bytes) / s_ret.stats.fill_bph : 0;
+    }
+}
+
+esp_err_t retention_init(const retention_cfg_t *config)
+{
+    if (s_ret.lock) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (config->high_pct < config->low_pct || config->high_pct >= 100) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_ret.lock = xSemaphoreCreateMutex();
+    if (s_ret.lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    s_ret.cfg = *config;
+    s_ret.stats.hours_left = -1;
+    if (_free_space(&s_ret.stats.free_bytes, &s_ret.stats.total_bytes) != ESP_OK) {
+        ESP_LOGE(TAG, "No free space information for %s", config->drive);
+        return ESP_FAIL;
+    }
+    _trend(s_ret.stats.free_bytes,
+           s_ret.stats.total_bytes * config->low_pct / 100 + config->reserve_bytes);
+    return ESP_OK;
+}
+
+int retention_step(void)
+{
+    if (s_ret.lock == NULL) {
+        return 0;
+    }
+    int evicted = 0;
+    int64_t start = esp_timer_get_time();
+    xSemaphoreTake(s_ret.lock, portMAX_DELAY);
+    retention_stats_t *st = &s_ret.stats;
+    uint64_t free_bytes, total;
+    if (_free_space(&free_bytes, &total) != ESP_OK) {
+        xSemaphoreGive(s_ret.lock);
+        return 0;
+    }
+    uint64_t low = total * s_ret.cfg.low_pct / 100 + s_ret.cfg.reserve_bytes;
+    uint64_t high = total * s_ret.cfg.high_pct / 100 + s_ret.cfg.reserve_bytes;
+    if (free_bytes < low && !s_ret.evicting) {
+        ESP_LOGW(TAG, "%" PRIu64 " MB free, evicting up to %" PRIu64 " MB", free_bytes >> 20, high >> 20);
+        s_ret.evicting = true;
+    }
+    time_t newest = time(NULL) - s_ret.cfg.protect_s;
+    while (s_ret.evicting && free_bytes < high
+           && esp_timer_get_time() - start < s_ret.cfg.slice_ms * 1000LL) {
+        clip_store_entry_t victim;
+        if (clip_store_victim(s_ret.cfg.policy == RETENTION_LOWEST_SCORE, newest, &victim) != ESP_OK) {
+            if (!st->blocked) {
+                ESP_LOGE(TAG, "%" PRIu64 " MB free and no clip older than %d s left to evict",
+                         free_bytes >> 20, s_ret.cfg.protect_s);
+            }
+            st->blocked = true;
+            break;
+        }
+        if (unlink(victim.path) != 0 && errno != ENOENT) {
+            /* Drop it from the index anyway, or it would be the victim forever */
+            ESP_LOGE(TAG, "Failed to delete %s (%d)", victim.path, errno);
+        }
+        clip_store_set_state(&victim, CLIP_STORE_DELETED);
+        uint64_t before = free_bytes;
+        if (_free_space(&free_bytes, &total) != ESP_OK) {
+            break;
+        }
+        uint64_t freed = free_bytes > before ? free_bytes - before : 0;
+        st->evicted++;
+        st->evicted_bytes += freed;
+        s_rtc.evicted_total += freed;
+        if (victim.state == CLIP_STORE_PENDING) {
+            st->evicted_pending++;
+        }
+        evicted++;
+        ESP_LOGI(TAG, "Evicted %s (%s, score %u, %" PRIu64 " KB)", victim.path,
+                 victim.state == CLIP_STORE_PENDING ? "not uploaded" : "uploaded",
+                 victim.score, freed >> 10);
+    }
+    if (free_bytes >= high) {
+        s_ret.evicting = false;
+        st->blocked = false;
+    }
+    st->free_bytes = free_bytes;
+    st->total_bytes = total;
+    _trend(free_bytes, low);
+    uint32_t us = esp_timer_get_time() - start;
+    st->slices++;
+    if (us > st->slice_max_us) {
+        st->slice_max_us = us;
+    }
+    xSemaphoreGive(s_ret.lock);
+    return evicted;
+}
+
+static void _retention_task(void *arg)
+{
+    TickType_t wait = pdMS_TO_TICKS(s_ret.period_ms);
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, wait);
+        retention_step();
+        /* Keep slicing until the high watermark, with a gap for other work */
+        wait = pdMS_TO_TICKS(s_ret.evicting && !s_ret.stats.blocked ? RETENTION_SLICE_GAP_MS : s_ret.period_ms);
+    }
+}
+
+esp_err_t retention_start(int period_ms)
+{
+    if (s_ret.lock == NULL || s_ret.task) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_ret.period_ms = period_ms;
+    if (task_plan_create(TASK_ROLE_COMPRESS, _retention_task, "retention", 3 * 1024, NULL, &s_ret.task) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void retention_kick(void)
+{
+    if (s_ret.task) {
+        xTaskNotifyGive(s_ret.task);
+    }
+}
+
+void retention_get_stats(retention_stats_t *stats)
+{
+    memcpy(stats, &s_ret.stats, sizeof(*stats));
+}
+
+void retention_log_stats(void)
+{
+    retention_stats_t st;
+    retention_get_stats(&st);
+    if (st.total_bytes == 0) {
+        return;
+    }
+    char left[24] = "not filling";
+    if (st.hours_left >= 0) {
+        snprintf(left, sizeof(left), "%d h to eviction", (int)st.hours_left);
+    }
+    ESP_LOGI(TAG, "%" PRIu64 " of %" PRIu64 " MB free (%d%%), filling %" PRId64 " MB/day, %s; evicted %u clips (%u not uploaded, %" PRIu64 " MB) in %u slices, longest %u us%s",
+             st.free_bytes >> 20, st.total_bytes >> 20, (int)(st.free_bytes * 100 / st.total_bytes),
+             st.fill_bph * 24 / (1024 * 1024), left, st.evicted, st.evicted_pending,
+             st.evicted_bytes >> 20, st.slices, st.slice_max_us, st.blocked ? ", BLOCKED" : "");
+}
@@ -0,0 +1,115 @@
+/*
+ * retention - keeps room on the SD card for the recording
+ *
+ * When the NAS cannot be reached for days the card fills up, the next
+ * f_expand/f_write of the writer fails and recording stops. retention deletes
+ * clips known to clip_store before that happens:
+ *
+ *   free < low_pct of the card + reserve_bytes     start evicting
+ *   free >= high_pct of the card + reserve_bytes   stop
+ *
+ * reserve_bytes is headroom for what is still being written (the current
+ * segment, staged segments spilled before sleep). Victims come from the
+ * clip_store cursors, no directory is read: the oldest clip
+ * (RETENTION_OLDEST_FIRST) or the oldest clip of the lowest score class
+ * (RETENTION_LOWEST_SCORE). Clips younger than protect_s are never evicted.
+ *
+ * retention_step() evicts for at most slice_ms and leaves the rest to the next
+ * call. retention_start() runs the slices in a task of the compress role
+ * (lowest priority, network core) every period_ms or on retention_kick(), so
+ * deletes never compete with the writer.
+ *
+ * Free space is sampled into RTC memory at most every
+ * RETENTION_TREND_INTERVAL_S. The stats give the fill rate (bytes recorded
+ * per hour, evictions added back) over the last RETENTION_TREND_SAMPLES
+ * samples and the hours left before eviction starts.
+ */
+
+#ifndef RETENTION_H_
+#define RETENTION_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if !defined RETENTION_TREND_INTERVAL_S
+#define RETENTION_TREND_INTERVAL_S          3600
+#endif
+#define RETENTION_TREND_SAMPLES             24
+
+/* Pause between slices until the high watermark is reached */
+#if !defined RETENTION_SLICE_GAP_MS
+#define RETENTION_SLICE_GAP_MS              20
+#endif
+
+typedef enum {
+    RETENTION_OLDEST_FIRST = 0,
+    RETENTION_LOWEST_SCORE,             /* Lowest clip_store score class first, oldest first within it */
+} retention_policy_t;
+
+typedef struct {
+    const char          *drive;         /* FatFs drive of the card */
+    retention_policy_t  policy;
+    int                 low_pct;        /* Start evicting below this much free space, percent of the card */
+    int                 high_pct;       /* Evict until this much is free */
+    uint64_t            reserve_bytes;  /* Added to both watermarks */
+    int                 protect_s;      /* Never evict clips younger than this */
+    int                 slice_ms;       /* Longest time spent per retention_step() */
+} retention_cfg_t;
+
+#define RETENTION_CFG_DEFAULT() {                   \
+    .drive = "0:",                                  \
+    .policy = RETENTION_OLDEST_FIRST,               \
+    .low_pct = 10,                                  \
+    .high_pct = 15,                                 \
+    .reserve_bytes = 16 * 1024 * 1024,              \
+    .protect_s = 10 * 60,                           \
+    .slice_ms = 50,                                 \
+}
+
+typedef struct {
+    uint64_t total_bytes;
+    uint64_t free_bytes;
+    uint32_t evicted;                   /* Clips deleted since boot */
+    uint32_t evicted_pending;           /* ... of which were not on the NAS yet */
+    uint64_t evicted_bytes;
+    uint32_t slices;
+    uint32_t slice_max_us;
+    bool     blocked;                   /* Below the low watermark with nothing old enough to evict */
+    int64_t  fill_bph;                  /* Bytes per hour recorded, 0 until the samples span an interval */
+    int32_t  hours_left;                /* Until eviction starts at fill_bph, -1 when not filling */
+} retention_stats_t;
+
+/**
+ * @brief  Call after clip_store_init(), takes a free space sample
+ */
+esp_err_t retention_init(const retention_cfg_t *config);
+
+/**
+ * @brief  Evict for at most slice_ms when below the low watermark (or still
+ *         short of the high one). Returns the number of clips deleted.
+ */
+int retention_step(void);
+
+/**
+ * @brief  Run retention_step() in a background task every period_ms
+ */
+esp_err_t retention_start(int period_ms);
+
+/**
+ * @brief  Wake the task for a slice now, e.g. after a segment was closed
+ */
+void retention_kick(void);
+
+void retention_get_stats(retention_stats_t *stats);
+void retention_log_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RETENTION_H_ */
@@ -0,0 +1,159 @@
+/*
+ * schedule - recording and upload time windows
+ */
+
+#include <stdio.h>
+#include "esp_log.h"
+#include "schedule.h"
+
+static const char *TAG = "SCHEDULE";
+
+#define SCHEDULE_DAY_SECONDS    (24 * 60 * 60)
+
+static const schedule_rule_t s_rules[] = {
+#include SCHEDULE_RULES_FILE
+};
+
+#define SCHEDULE_RULE_COUNT     ((int)(sizeof(s_rules) / sizeof(s_rules[0])))
+
+static const schedule_rule_t *s_override;
+static int s_override_count;
+static uint32_t s_override_kinds;   /* Bit per kind taken from s_override */
+
+static const char *s_kind_name[SCHEDULE_KIND_MAX] = {
+    [SCHEDULE_RECORD] = "record",
+    [SCHEDULE_UPLOAD] = "upload",
+};
+
+static time_t _midnight(time_t t, struct tm *tm)
+{
+    localtime_r(&t, tm);
+    return t - (tm->tm_hour * 3600 + tm->tm_min * 60 + tm->tm_sec);
+}
+
+/* Rules in effect for kind, entries of other kinds are skipped by the callers */
+static const schedule_rule_t *_rules(schedule_kind_t kind, int *count)
+{
+    if (s_override_kinds & (1u << kind)) {
+        *count = s_override_count;
+        return s_override;
+    }
+    *count = SCHEDULE_RULE_COUNT;
+    return s_rules;
+}
+
+/* [start, end) of rule r on the day beginning at day0, false when r does not run that day */
+static bool _window(const schedule_rule_t *r, time_t day0, int wday, time_t *start, time_t *end)
+{
+    if (!(r->weekdays & (1 << ((wday + 7) % 7)))) {
+        return false;
+    }
+    *start = day0 + r->start_min * 60;
+    *end = day0 + r->end_min * 60;
+    if (r->end_min <= r->start_min) {
+        *end += SCHEDULE_DAY_SECONDS;
+    }
+    return true;
+}
+
+/* Latest end of the windows of kind open at t, t when none is */
+static time_t _open_until(schedule_kind_t kind, time_t t)
+{
+    struct tm tm;
+    time_t day0 = _midnight(t, &tm);
+    time_t until = t;
+    int count;
+    const schedule_rule_t *rules = _rules(kind, &count);
+    for (int d = -1; d <= 0; d++) {
+        for (int i = 0; i < count; i++) {
+            time_t start, end;
+            if (rules[i].kind == kind
+                && _window(&rules[i], day0 + d * SCHEDULE_DAY_SECONDS, tm.tm_wday + d, &start, &end)
+                && start <= t && t < end && end > until) {
+                until = end;
+            }
+        }
+    }
+    return until;
+}
+
+bool schedule_active(schedule_kind_t kind, time_t t)
+{
+    return _open_until(kind, t) > t;
+}
+
+time_t schedule_next_start(schedule_kind_t kind, time_t t)
+{
+    if (schedule_active(kind, t)) {
+        return t;
+    }
+    struct tm tm;
+    time_t day0 = _midnight(t, &tm);
+    time_t next = (time_t)-1;
+    int count;
+    const schedule_rule_t *rules = _rules(kind, &count);
+    for (int d = 0; d <= 7; d++) {
+        for (int i = 0; i < count; i++) {
+            time_t start, end;
+            if (rules[i].kind == kind
+                && _window(&rules[i], day0 + d * SCHEDULE_DAY_SECONDS, tm.tm_wday + d, &start, &end)
+                && start > t && (next == (time_t)-1 || start < next)) {
+                next = start;
+            }
+        }
+        if (next != (time_t)-1) {
+            break;
+        }
+    }
+    return next;
+}
+
+time_t schedule_window_end(schedule_kind_t kind, time_t t)
+{
+    /* Follow overlapping and adjoining windows, an all-week window stops after 7 days */
+    time_t end = t;
+    time_t limit = t + 7 * SCHEDULE_DAY_SECONDS;
+    while (end < limit) {
+        time_t until = _open_until(kind, end);
+        if (until == end) {
+            break;
+        }
+        end = until;
+    }
+    return end < limit ? end : limit;
+}
+
+void schedule_override(const schedule_rule_t *rules, int count)
+{
+    s_override = rules;
+    s_override_count = count;
+    s_override_kinds = 0;
+    for (int i = 0; i < count; i++) {
+        if (rules[i].kind < SCHEDULE_KIND_MAX) {
+            s_override_kinds |= 1u << rules[i].kind;
+        }
+    }
+}
+
+void schedule_log(void)
+{
+    static const char days[] = "SMTWTFS";
+    for (int kind = 0; kind < SCHEDULE_KIND_MAX; kind++) {
+        int count;
+        const schedule_rule_t *rules = _rules(kind, &count);
+        for (int i = 0; i < count; i++) {
+            const schedule_rule_t *r = &rules[i];
+            if (r->kind != kind) {
+                continue;
+            }
+            char mask[8];
+            for (int d = 0; d < 7; d++) {
+                mask[d] = (r->weekdays & (1 << d)) ? days[d] : '-';
+            }
+            mask[7] = '\0';
+            ESP_LOGI(TAG, "%s %s %02d:%02d-%02d:%02d%s", s_kind_name[r->kind], mask,
+                     r->start_min / 60, r->start_min % 60, r->end_min / 60, r->end_min % 60,
+                     rules == s_override ? " (site config)" : "");
+        }
+    }
+}
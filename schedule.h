@@ -0,0 +1,96 @@
+/*
+ * schedule - recording and upload time windows
+ *
+ * The rules are a static const table compiled from SCHEDULE_RULES_FILE
+ * (schedule_rules.h by default), one SCHEDULE_RULE() per window:
+ *
+ *   SCHEDULE_RULE(kind, weekdays, start_hour, start_min, end_hour, end_min)
+ *
+ * Times are local (TZ), the end is exclusive and 24:00 is the end of the day.
+ * A window whose end is not after its start runs past midnight into the next
+ * day; weekdays refers to the day it starts. Windows of the same kind may
+ * overlap.
+ *
+ * schedule_override() replaces the rules of the kinds it contains at run time
+ * (e.g. from the site config on the NAS), the other kinds keep the table.
+ *
+ * schedule_next_start() gives the exact time the next window opens, so the
+ * device can sleep right up to it instead of waking to check the clock. Days
+ * are taken as 86400 s, which is exact for the fixed offset zones in use.
+ */
+
+#ifndef SCHEDULE_H_
+#define SCHEDULE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    SCHEDULE_RECORD = 0,
+    SCHEDULE_UPLOAD,
+    SCHEDULE_KIND_MAX,
+} schedule_kind_t;
+
+#define SCHEDULE_SUN            (1 << 0)
+#define SCHEDULE_MON            (1 << 1)
+#define SCHEDULE_TUE            (1 << 2)
+#define SCHEDULE_WED            (1 << 3)
+#define SCHEDULE_THU            (1 << 4)
+#define SCHEDULE_FRI            (1 << 5)
+#define SCHEDULE_SAT            (1 << 6)
+#define SCHEDULE_WEEKDAYS       (SCHEDULE_MON | SCHEDULE_TUE | SCHEDULE_WED | SCHEDULE_THU | SCHEDULE_FRI)
+#define SCHEDULE_WEEKEND        (SCHEDULE_SAT | SCHEDULE_SUN)
+#define SCHEDULE_EVERY_DAY      (SCHEDULE_WEEKDAYS | SCHEDULE_WEEKEND)
+
+#if !defined SCHEDULE_RULES_FILE
+#define SCHEDULE_RULES_FILE     "schedule_rules.h"
+#endif
+
+typedef struct {
+    uint8_t  kind;
+    uint8_t  weekdays;          /* SCHEDULE_SUN ... SCHEDULE_SAT, tm_wday bits */
+    uint16_t start_min;         /* Minute of the day */
+    uint16_t end_min;           /* 1..1440, <= start_min runs past midnight */
+} schedule_rule_t;
+
+#define SCHEDULE_RULE(kind, weekdays, start_hour, start_min, end_hour, end_min) \
+    { (kind), (weekdays), (start_hour) * 60 + (start_min), (end_hour) * 60 + (end_min) }
+
+/**
+ * @brief  True when t is inside a window of kind
+ */
+bool schedule_active(schedule_kind_t kind, time_t t);
+
+/**
+ * @brief  Start of the first window of kind at or after t: t itself when a
+ *         window is open, (time_t)-1 when kind has no rules
+ */
+time_t schedule_next_start(schedule_kind_t kind, time_t t);
+
+/**
+ * @brief  End of the window of kind open at t (merged with windows overlapping
+ *         or adjoining it), at most 7 days after t; t when none is open
+ */
+time_t schedule_window_end(schedule_kind_t kind, time_t t);
+
+/**
+ * @brief  Use rules instead of the table for every kind that appears in them.
+ *         rules has to stay valid, count 0 goes back to the table.
+ */
+void schedule_override(const schedule_rule_t *rules, int count);
+
+/**
+ * @brief  Log the rules of every kind
+ */
+void schedule_log(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SCHEDULE_H_ */
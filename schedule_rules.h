@@ -0,0 +1,18 @@
+/*
+ * schedule_rules - time windows compiled into the schedule table
+ *
+ * One SCHEDULE_RULE(kind, weekdays, start_hour, start_min, end_hour, end_min)
+ * per line, see schedule.h. Build a site with its own file through
+ * -DSCHEDULE_RULES_FILE='"site_rules.h"'.
+ *
+ * Examples:
+ *   Daytime recording only:
+ *     SCHEDULE_RULE(SCHEDULE_RECORD, SCHEDULE_EVERY_DAY, 5, 0, 19, 0),
+ *   Night recording on weekdays, 22:00 - 04:00:
+ *     SCHEDULE_RULE(SCHEDULE_RECORD, SCHEDULE_WEEKDAYS, 22, 0, 4, 0),
+ *   Nightly upload of the NAS app:
+ *     SCHEDULE_RULE(SCHEDULE_UPLOAD, SCHEDULE_EVERY_DAY, 23, 59, 24, 0),
+ */
+
+SCHEDULE_RULE(SCHEDULE_RECORD, SCHEDULE_EVERY_DAY, 0, 0, 24, 0),
+SCHEDULE_RULE(SCHEDULE_UPLOAD, SCHEDULE_EVERY_DAY, 0, 0, 24, 0),
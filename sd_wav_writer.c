@@ -0,0 +1,960 @@
+/*
+ * sd_wav_writer - WAV writer element for the SD card
+ *
+ * File layout:
+ *   [0, header_size)                 RIFF + fmt + JUNK padding + data chunk header
+ *   [header_size, ...)               PCM data
+ *
+ * header_size is SD_WAV_WRITER_HEADER_SIZE, or a whole number of sectors
+ * holding the metadata and seek index in container mode (see sd_wav_writer.h).
+ *
+ * The header region is part of the first write block, so every block write
+ * lands on a cluster (or SD_WAV_WRITER_MAX_BLOCK_SIZE) boundary of the file.
+ * Only the header region is rewritten on close. With segment_seconds set the
+ * writer closes the file on an exact byte boundary and continues in the next
+ * one without stopping the pipeline. Trailer chunks (e.g. the
+ * pipeline monitor's drop log) are appended after the data chunk.
+ *
+ * A staged segment goes through the same block, which is copied into the
+ * clip_stage arena instead of written with f_write.
+ *
+ * A checkpoint reuses the block right after it was flushed: the header is
+ * built there with the current sizes (and an empty seek index, its entries
+ * are not on the card yet) and only the first sector is written back.
+ */
+
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/time.h>
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "ff.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "audio_element.h"
+#include "sd_wav_writer.h"
+#include "clip_stage.h"
+#include "cycle_prof.h"
+
+static const char *TAG = "SD_WAV_WRITER";
+
+#if FF_MAX_SS != FF_MIN_SS
+#define SD_WAV_WRITER_SECTOR_SIZE(fs)       ((fs)->ssize)
+#else
+#define SD_WAV_WRITER_SECTOR_SIZE(fs)       (FF_MAX_SS)
+#endif
+
+/* Header alignment of a staged clip, it has no file (and no FATFS) until it is spilled */
+#define SD_WAV_WRITER_STAGE_SECTOR_SIZE     512
+
+#define SD_WAV_WRITER_BUFFER_LEN            (4096)
+
+typedef struct {
+    char                    id[4];
+    uint8_t                 *data;
+    int                     len;
+} sd_wav_trailer_t;
+
+typedef struct {
+    FIL                     file;
+    bool                    is_open;
+    uint8_t                 *block;         /* DMA-capable staging block */
+    int                     block_size;
+    int                     fill;
+    uint64_t                data_bytes;
+    int                     expected_seconds;
+    int                     margin_seconds;
+    int                     segment_seconds;
+    uint64_t                segment_bytes;
+    sd_wav_writer_segment_cb_t segment_cb;
+    void                    *segment_ctx;
+    char                    uri[256];       /* Current file, VFS path */
+    sd_wav_writer_stats_t   stats;
+    SemaphoreHandle_t       trailer_lock;
+    sd_wav_trailer_t        trailers[SD_WAV_WRITER_MAX_TRAILERS];
+    int                     trailer_count;
+    int                     header_size;    /* Offset of the first sample */
+    bool                    container;
+    int                     index_interval_ms;
+    char                    device_id[32];
+    char                    info_comment[96];
+    char                    start_time[20]; /* ICRD of the current file */
+    sd_wav_writer_tidx_entry_t *index;
+    int                     index_max;
+    int                     index_count;
+    int                     index_step_ms;  /* Interval used for the current file */
+    uint64_t                index_next;     /* data_bytes of the next entry */
+    uint64_t                index_step;     /* Bytes between entries */
+    bool                    stage;
+    clip_stage_clip_t       *clip;          /* Current file lives in the arena */
+    uint8_t                 *clip_data;
+    size_t                  clip_cap;
+    size_t                  clip_pos;
+    sd_wav_writer_tap_cb_t  tap_cb;
+    void                    *tap_ctx;
+    int                     checkpoint_ms;
+    uint64_t                checkpoint_step;    /* Bytes between checkpoints, 0 when off */
+    uint64_t                checkpoint_next;    /* data_bytes of the next checkpoint */
+    int                     prof;               /* cycle_prof probe */
+} sd_wav_writer_t;
+
+/* RIFF/RF64 + ds64 placeholder + fmt */
+#define SD_WAV_WRITER_DS64_SIZE             28
+#define SD_WAV_WRITER_INFO_SOFTWARE         "sd_wav_writer"
+
+static void _wr_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void _wr_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static void _wr_u64(uint8_t *p, uint64_t v)
+{
+    _wr_u32(p, (uint32_t)v);
+    _wr_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint16_t _rd_u16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t _rd_u32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t _rd_u64(const uint8_t *p)
+{
+    return _rd_u32(p) | ((uint64_t)_rd_u32(p + 4) << 32);
+}
+
+/* One LIST/INFO sub-chunk, returns the bytes used */
+static int _wr_info(uint8_t *p, const char *id, const char *text)
+{
+    int len = strlen(text) + 1;
+    memcpy(p, id, 4);
+    _wr_u32(p + 4, len);
+    memcpy(p + 8, text, len);
+    return 8 + len + (len & 1);
+}
+
+/*
+ * Write the header region into dst, returns the offset where the JUNK
+ * padding starts (the header size needed before sector rounding - 16)
+ */
+static int _build_header(sd_wav_writer_t *writer, uint8_t *dst, const audio_element_info_t *info,
+                         uint64_t data_bytes, uint32_t trailer_bytes)
+{
+    int block_align = info->channels * info->bits / 8;
+    int hs = writer->header_size;
+    uint64_t riff_size = hs - 8 + data_bytes + trailer_bytes;
+    bool rf64 = writer->container && riff_size > UINT32_MAX;
+    memset(dst, 0, hs);
+    memcpy(dst, rf64 ? "RF64" : "RIFF", 4);
+    _wr_u32(dst + 4, rf64 ? UINT32_MAX : (uint32_t)riff_size);
+    memcpy(dst + 8, "WAVE", 4);
+    uint8_t *p = dst + 12;
+    if (writer->container) {
+        /* Reserved for ds64 (EBU Tech 3306), so growing past 4 GB only patches the header */
+        memcpy(p, rf64 ? "ds64" : "JUNK", 4);
+        _wr_u32(p + 4, SD_WAV_WRITER_DS64_SIZE);
+        if (rf64) {
+            _wr_u64(p + 8, riff_size);
+            _wr_u64(p + 16, data_bytes);
+            _wr_u64(p + 24, data_bytes / block_align);
+        }
+        p += 8 + SD_WAV_WRITER_DS64_SIZE;
+    }
+    memcpy(p, "fmt ", 4);
+    _wr_u32(p + 4, 16);
+    _wr_u16(p + 8, 1);
+    _wr_u16(p + 10, info->channels);
+    _wr_u32(p + 12, info->sample_rates);
+    _wr_u32(p + 16, info->sample_rates * block_align);
+    _wr_u16(p + 20, block_align);
+    _wr_u16(p + 22, info->bits);
+    p += 24;
+    if (writer->container) {
+        uint8_t *list = p;
+        memcpy(list, "LIST", 4);
+        memcpy(list + 8, "INFO", 4);
+        p = list + 12;
+        if (writer->device_id[0]) {
+            p += _wr_info(p, "IART", writer->device_id);
+        }
+        p += _wr_info(p, "ICRD", writer->start_time);
+        p += _wr_info(p, "ISFT", SD_WAV_WRITER_INFO_SOFTWARE);
+        if (writer->info_comment[0]) {
+            p += _wr_info(p, "ICMT", writer->info_comment);
+        }
+        _wr_u32(list + 4, p - list - 8);
+
+        /* The chunk always spans index_max entries so the layout does not move */
+        sd_wav_writer_tidx_t tidx = {
+            .version = 1,
+            .interval_ms = writer->index_step_ms,
+            .count = writer->index_count,
+            .data_offset = hs,
+            .block_align = block_align,
+        };
+        int entries = writer->index_max * sizeof(sd_wav_writer_tidx_entry_t);
+        memcpy(p, "tidx", 4);
+        _wr_u32(p + 4, sizeof(tidx) + entries);
+        memcpy(p + 8, &tidx, sizeof(tidx));
+        if (writer->index_count) {
+            memcpy(p + 8 + sizeof(tidx), writer->index, writer->index_count * sizeof(sd_wav_writer_tidx_entry_t));
+        }
+        p += 8 + sizeof(tidx) + entries;
+    }
+    int used = p - dst;
+    /* JUNK pads the header so audio data starts on a sector boundary */
+    if (used + 16 <= hs) {
+        memcpy(p, "JUNK", 4);
+        _wr_u32(p + 4, hs - used - 16);
+    }
+    memcpy(dst + hs - 8, "data", 4);
+    _wr_u32(dst + hs - 4, rf64 ? UINT32_MAX : (uint32_t)data_bytes);
+    return used;
+}
+
+/*
+ * Size the header region and seek index of a new file. max_header is the
+ * write block, the header has to fit into the first block, and is rounded up
+ * to whole sectors.
+ */
+static esp_err_t _plan_header(sd_wav_writer_t *writer, const audio_element_info_t *info, int max_header, int sector)
+{
+    writer->index_count = 0;
+    writer->index_max = 0;
+    writer->index_next = 0;
+    writer->index_step = 0;
+    if (!writer->container) {
+        writer->header_size = SD_WAV_WRITER_HEADER_SIZE;
+        return ESP_OK;
+    }
+    time_t now = time(NULL);
+    struct tm tm_now;
+    localtime_r(&now, &tm_now);
+    strftime(writer->start_time, sizeof(writer->start_time), "%Y-%m-%dT%H:%M:%S", &tm_now);
+
+    if (max_header > SD_WAV_WRITER_MAX_HEADER_SIZE) {
+        max_header = SD_WAV_WRITER_MAX_HEADER_SIZE;
+    }
+    /* Measure the fixed part with an empty index */
+    writer->header_size = max_header;
+    int fixed = _build_header(writer, writer->block, info, 0, 0) + 16;
+    int room = (max_header - fixed) / (int)sizeof(sd_wav_writer_tidx_entry_t);
+    if (room < 2) {
+        ESP_LOGE(TAG, "No room for the seek index in a %d byte header", max_header);
+        return ESP_FAIL;
+    }
+    int clip_seconds = writer->segment_seconds ? writer->segment_seconds
+                       : (writer->expected_seconds ? writer->expected_seconds + writer->margin_seconds : 0);
+    int interval = writer->index_interval_ms > 0 ? writer->index_interval_ms : 1000;
+    int wanted = clip_seconds ? (int)((int64_t)clip_seconds * 1000 / interval) + 1 : room;
+    if (wanted > room) {
+        interval = (int)(((int64_t)clip_seconds * 1000 + room - 2) / (room - 1));
+        wanted = room;
+    }
+    writer->index_max = wanted;
+    writer->index_step_ms = interval;
+    writer->index_step = (uint64_t)info->sample_rates * interval / 1000 * info->channels * (info->bits / 8);
+    writer->index = audio_calloc(wanted, sizeof(sd_wav_writer_tidx_entry_t));
+    AUDIO_MEM_CHECK(TAG, writer->index, return ESP_ERR_NO_MEM);
+    writer->header_size = (fixed + wanted * sizeof(sd_wav_writer_tidx_entry_t) + sector - 1) / sector * sector;
+    return ESP_OK;
+}
+
+/* Add a seek entry for the current position if an interval boundary was crossed */
+static void _index_update(sd_wav_writer_t *writer, int block_align)
+{
+    if (writer->index == NULL || writer->data_bytes < writer->index_next
+        || writer->index_count >= writer->index_max) {
+        return;
+    }
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    sd_wav_writer_tidx_entry_t *e = &writer->index[writer->index_count++];
+    e->time_sec = tv.tv_sec;
+    e->time_ms = tv.tv_usec / 1000;
+    e->reserved = 0;
+    e->frame = writer->data_bytes / block_align;
+    while (writer->index_next <= writer->data_bytes) {
+        writer->index_next += writer->index_step;
+    }
+}
+
+static void _account_write(sd_wav_writer_t *writer, uint32_t us, int bytes)
+{
+    int bucket = 31 - __builtin_clz(us | 1);
+    if (bucket >= SD_WAV_WRITER_HIST_BUCKETS) {
+        bucket = SD_WAV_WRITER_HIST_BUCKETS - 1;
+    }
+    writer->stats.hist[bucket]++;
+    writer->stats.writes++;
+    writer->stats.total_us += us;
+    writer->stats.bytes += bytes;
+    if (us > writer->stats.max_us) {
+        writer->stats.max_us = us;
+    }
+}
+
+/* Append to the staged clip */
+static esp_err_t _stage_put(sd_wav_writer_t *writer, const void *data, size_t len)
+{
+    if (writer->clip_pos + len > writer->clip_cap) {
+        return ESP_FAIL;
+    }
+    memcpy(writer->clip_data + writer->clip_pos, data, len);
+    writer->clip_pos += len;
+    return ESP_OK;
+}
+
+static esp_err_t _flush_block(sd_wav_writer_t *writer)
+{
+    if (writer->clip) {
+        if (_stage_put(writer, writer->block, writer->fill) != ESP_OK) {
+            ESP_LOGE(TAG, "Staged clip overflow at %u bytes", (unsigned)writer->clip_pos);
+            return ESP_FAIL;
+        }
+        writer->fill = 0;
+        return ESP_OK;
+    }
+    UINT bw = 0;
+    int64_t start = esp_timer_get_time();
+    FRESULT res = f_write(&writer->file, writer->block, writer->fill, &bw);
+    _account_write(writer, (uint32_t)(esp_timer_get_time() - start), bw);
+    if (res != FR_OK || bw != writer->fill) {
+        ESP_LOGE(TAG, "f_write failed, res=%d, wrote %u of %d", res, bw, writer->fill);
+        return ESP_FAIL;
+    }
+    writer->fill = 0;
+    return ESP_OK;
+}
+
+/*
+ * Put the current sizes into the first sector and sync, so a file cut short
+ * keeps the audio written so far. Called after a flush, the block is free.
+ */
+static void _checkpoint(sd_wav_writer_t *writer, const audio_element_info_t *info)
+{
+    if (writer->clip || writer->checkpoint_step == 0 || writer->data_bytes < writer->checkpoint_next) {
+        return;
+    }
+    int64_t start = esp_timer_get_time();
+    int sector = SD_WAV_WRITER_SECTOR_SIZE(writer->file.obj.fs);
+    FSIZE_t pos = f_tell(&writer->file);
+    int index_count = writer->index_count;
+    UINT bw = 0;
+    writer->index_count = 0;
+    _build_header(writer, writer->block, info, writer->data_bytes, 0);
+    writer->index_count = index_count;
+    if (f_lseek(&writer->file, 0) != FR_OK
+        || f_write(&writer->file, writer->block, sector, &bw) != FR_OK || bw != sector
+        || f_lseek(&writer->file, pos) != FR_OK
+        || f_sync(&writer->file) != FR_OK) {
+        ESP_LOGW(TAG, "Checkpoint at %" PRIu64 " bytes failed", writer->data_bytes);
+    }
+    uint32_t us = esp_timer_get_time() - start;
+    writer->stats.checkpoints++;
+    if (us > writer->stats.checkpoint_max_us) {
+        writer->stats.checkpoint_max_us = us;
+    }
+    while (writer->checkpoint_next <= writer->data_bytes) {
+        writer->checkpoint_next += writer->checkpoint_step;
+    }
+}
+
+static uint32_t _write_trailers(sd_wav_writer_t *writer)
+{
+    uint32_t total = 0;
+    xSemaphoreTake(writer->trailer_lock, portMAX_DELAY);
+    for (int i = 0; i < writer->trailer_count; i++) {
+        sd_wav_trailer_t *t = &writer->trailers[i];
+        uint8_t hdr[8];
+        uint8_t pad = 0;
+        UINT bw = 0;
+        memcpy(hdr, t->id, 4);
+        _wr_u32(hdr + 4, t->len);
+        if (writer->clip) {
+            if (writer->clip_pos + sizeof(hdr) + t->len + (t->len & 1) > writer->clip_cap) {
+                ESP_LOGW(TAG, "No room for %.4s chunk in the staged clip", t->id);
+                break;
+            }
+            _stage_put(writer, hdr, sizeof(hdr));
+            _stage_put(writer, t->data, t->len);
+            if (t->len & 1) {
+                _stage_put(writer, &pad, 1);
+            }
+        } else if (f_write(&writer->file, hdr, sizeof(hdr), &bw) != FR_OK
+            || f_write(&writer->file, t->data, t->len, &bw) != FR_OK
+            || ((t->len & 1) && f_write(&writer->file, &pad, 1, &bw) != FR_OK)) {
+            ESP_LOGE(TAG, "Failed to write %.4s chunk", t->id);
+            break;
+        }
+        total += sizeof(hdr) + t->len + (t->len & 1);
+    }
+    for (int i = 0; i < writer->trailer_count; i++) {
+        audio_free(writer->trailers[i].data);
+    }
+    memset(writer->trailers, 0, sizeof(writer->trailers));
+    writer->trailer_count = 0;
+    xSemaphoreGive(writer->trailer_lock);
+    return total;
+}
+
+static uint8_t *_alloc_block(int *size)
+{
+    int sz = *size;
+    while (sz >= SD_WAV_WRITER_HEADER_SIZE) {
+        uint8_t *p = heap_caps_malloc(sz, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+        if (p) {
+            *size = sz;
+            return p;
+        }
+        sz /= 2;
+    }
+    return NULL;
+}
+
+/* Reserve the whole segment in the clip_stage arena, fails when it has no room */
+static esp_err_t _stage_open(sd_wav_writer_t *writer, const char *uri, const audio_element_info_t *info)
+{
+    if (writer->block == NULL) {
+        writer->block_size = SD_WAV_WRITER_MAX_BLOCK_SIZE;
+        writer->block = _alloc_block(&writer->block_size);
+        if (writer->block == NULL) {
+            return ESP_FAIL;
+        }
+    }
+    audio_free(writer->index);
+    writer->index = NULL;
+    if (_plan_header(writer, info, writer->block_size, SD_WAV_WRITER_STAGE_SECTOR_SIZE) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    size_t capacity = writer->header_size
+                      + (size_t)writer->segment_seconds * info->sample_rates * info->channels * (info->bits / 8)
+                      + CLIP_STAGE_TRAILER_RESERVE;
+    writer->clip = clip_stage_alloc(uri, capacity);
+    if (writer->clip == NULL) {
+        return ESP_FAIL;
+    }
+    writer->clip_data = clip_stage_data(writer->clip, &writer->clip_cap);
+    writer->clip_pos = 0;
+    writer->stats.staged = true;
+    return ESP_OK;
+}
+
+/* FatFs path of a VFS uri under SD_WAV_WRITER_VFS_PREFIX */
+static esp_err_t _fatfs_path(const char *uri, char *path, int len)
+{
+    int prefix_len = strlen(SD_WAV_WRITER_VFS_PREFIX);
+    if (uri == NULL || strncmp(uri, SD_WAV_WRITER_VFS_PREFIX, prefix_len) != 0) {
+        ESP_LOGE(TAG, "Uri must start with %s", SD_WAV_WRITER_VFS_PREFIX);
+        return ESP_FAIL;
+    }
+    snprintf(path, len, "%s%s", SD_WAV_WRITER_FATFS_DRIVE, uri + prefix_len);
+    return ESP_OK;
+}
+
+static esp_err_t _file_open(sd_wav_writer_t *writer, const char *uri, const audio_element_info_t *info)
+{
+    char path[256];
+    if (_fatfs_path(uri, path, sizeof(path)) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    memset(&writer->stats, 0, sizeof(writer->stats));
+    writer->checkpoint_step = 0;
+    if (writer->stage && writer->segment_seconds > 0 && _stage_open(writer, uri, info) == ESP_OK) {
+        _build_header(writer, writer->block, info, 0, 0);
+        writer->fill = writer->header_size;
+        writer->data_bytes = 0;
+        snprintf(writer->uri, sizeof(writer->uri), "%s", uri);
+        writer->is_open = true;
+        ESP_LOGI(TAG, "Stage %s, header %d, capacity %u", uri, writer->header_size, (unsigned)writer->clip_cap);
+        return ESP_OK;
+    }
+
+    FRESULT res = f_open(&writer->file, path, FA_WRITE | FA_CREATE_ALWAYS);
+    if (res != FR_OK) {
+        ESP_LOGE(TAG, "Failed to open %s, res=%d", path, res);
+        return ESP_FAIL;
+    }
+
+    FATFS *fs = writer->file.obj.fs;
+    uint32_t cluster_size = (uint32_t)fs->csize * SD_WAV_WRITER_SECTOR_SIZE(fs);
+
+    if (writer->block == NULL) {
+        writer->block_size = cluster_size < SD_WAV_WRITER_MAX_BLOCK_SIZE ? cluster_size : SD_WAV_WRITER_MAX_BLOCK_SIZE;
+        writer->block = _alloc_block(&writer->block_size);
+        if (writer->block == NULL) {
+            ESP_LOGE(TAG, "No DMA memory for write block");
+            f_close(&writer->file);
+            f_unlink(path);
+            return ESP_FAIL;
+        }
+    }
+    audio_free(writer->index);
+    writer->index = NULL;
+    if (_plan_header(writer, info, writer->block_size, SD_WAV_WRITER_SECTOR_SIZE(fs)) != ESP_OK) {
+        f_close(&writer->file);
+        f_unlink(path);
+        return ESP_FAIL;
+    }
+
+    if (writer->expected_seconds > 0) {
+        uint64_t expected = writer->header_size
+                            + (uint64_t)(writer->expected_seconds + writer->margin_seconds)
+                            * info->sample_rates * info->channels * (info->bits / 8);
+        expected = (expected + cluster_size - 1) / cluster_size * cluster_size;
+        res = f_expand(&writer->file, (FSIZE_t)expected, 1);
+        if (res == FR_OK) {
+            writer->stats.preallocated = true;
+        } else {
+            ESP_LOGW(TAG, "No contiguous %" PRIu64 " bytes (res=%d), falling back to appends", expected, res);
+        }
+    }
+
+    if (writer->checkpoint_ms > 0) {
+        writer->checkpoint_step = (uint64_t)info->sample_rates * writer->checkpoint_ms / 1000
+                                  * info->channels * (info->bits / 8);
+        writer->checkpoint_next = writer->checkpoint_step;
+    }
+    _build_header(writer, writer->block, info, 0, 0);
+    writer->fill = writer->header_size;
+    writer->data_bytes = 0;
+    snprintf(writer->uri, sizeof(writer->uri), "%s", uri);
+    writer->is_open = true;
+    ESP_LOGI(TAG, "Open %s, cluster %u, block %d, header %d, index %d x %d ms, preallocated %d",
+             path, cluster_size, writer->block_size, writer->header_size,
+             writer->index_max, writer->index_step_ms, writer->stats.preallocated);
+    return ESP_OK;
+}
+
+static void _file_close(sd_wav_writer_t *writer, const audio_element_info_t *info)
+{
+    if (writer->fill > 0) {
+        _flush_block(writer);
+    }
+    uint32_t trailer_bytes = _write_trailers(writer);
+    if (writer->clip) {
+        _build_header(writer, writer->block, info, writer->data_bytes, trailer_bytes);
+        memcpy(writer->clip_data, writer->block, writer->header_size);
+        clip_stage_commit(writer->clip, writer->clip_pos);
+        writer->clip = NULL;
+        writer->is_open = false;
+        return;
+    }
+    /* Drop the unused tail of the preallocated chain */
+    f_truncate(&writer->file);
+
+    UINT bw = 0;
+    _build_header(writer, writer->block, info, writer->data_bytes, trailer_bytes);
+    if (f_lseek(&writer->file, 0) != FR_OK
+        || f_write(&writer->file, writer->block, writer->header_size, &bw) != FR_OK
+        || bw != writer->header_size) {
+        ESP_LOGE(TAG, "Failed to update wav header");
+    }
+    f_close(&writer->file);
+    writer->is_open = false;
+}
+
+/* Close the current segment and continue in the file named by segment_cb */
+static esp_err_t _rotate(audio_element_handle_t self, sd_wav_writer_t *writer, audio_element_info_t *info)
+{
+    char closed[sizeof(writer->uri)];
+    char next[sizeof(writer->uri)] = {0};
+    memcpy(closed, writer->uri, sizeof(closed));
+    _file_close(writer, info);
+    writer->segment_cb(self, closed, next, sizeof(next), writer->segment_ctx);
+    if (next[0] == '\0') {
+        ESP_LOGE(TAG, "No uri for the next segment");
+        return ESP_FAIL;
+    }
+    audio_element_set_uri(self, next);
+    info->byte_pos = 0;
+    return _file_open(writer, next, info);
+}
+
+static esp_err_t _sd_wav_writer_open(audio_element_handle_t self)
+{
+    sd_wav_writer_t *writer = (sd_wav_writer_t *)audio_element_getdata(self);
+    if (writer->is_open) {
+        ESP_LOGE(TAG, "Already opened");
+        return ESP_FAIL;
+    }
+    audio_element_info_t info = {0};
+    audio_element_getinfo(self, &info);
+    if (_file_open(writer, audio_element_get_uri(self), &info) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    writer->segment_bytes = (uint64_t)writer->segment_seconds
+                            * info.sample_rates * info.channels * (info.bits / 8);
+    info.byte_pos = 0;
+    audio_element_setinfo(self, &info);
+    return ESP_OK;
+}
+
+static int _sd_wav_writer_write(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *context)
+{
+    sd_wav_writer_t *writer = (sd_wav_writer_t *)audio_element_getdata(self);
+    audio_element_info_t info;
+    audio_element_getinfo(self, &info);
+    int block_align = info.channels * info.bits / 8;
+    int remain = len;
+    /* Moved forward by the time spent on the card, the probe counts the copy, tap and index */
+    uint32_t prof_start = CYCLE_PROF_BEGIN();
+    while (remain > 0) {
+        _index_update(writer, block_align);
+        int n = writer->block_size - writer->fill;
+        if (n > remain) {
+            n = remain;
+        }
+        if (writer->segment_bytes && writer->data_bytes + n > writer->segment_bytes) {
+            n = writer->segment_bytes - writer->data_bytes;
+        }
+        memcpy(writer->block + writer->fill, buffer, n);
+        if (writer->tap_cb) {
+            writer->tap_cb(writer->uri, &info, buffer, n, writer->tap_ctx);
+        }
+        writer->fill += n;
+        writer->data_bytes += n;
+        info.byte_pos += n;
+        buffer += n;
+        remain -= n;
+        if (writer->fill == writer->block_size) {
+            uint32_t io_start = CYCLE_PROF_BEGIN();
+            if (_flush_block(writer) != ESP_OK) {
+                return AEL_IO_FAIL;
+            }
+            _checkpoint(writer, &info);
+            prof_start += CYCLE_PROF_BEGIN() - io_start;
+        }
+        if (writer->segment_bytes && writer->data_bytes == writer->segment_bytes) {
+            uint32_t io_start = CYCLE_PROF_BEGIN();
+            if (_rotate(self, writer, &info) != ESP_OK) {
+                return AEL_IO_FAIL;
+            }
+            prof_start += CYCLE_PROF_BEGIN() - io_start;
+        }
+    }
+    audio_element_setinfo(self, &info);
+    CYCLE_PROF_END(writer->prof, prof_start, len / block_align);
+    return len;
+}
+
+static int _sd_wav_writer_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    int r_size = audio_element_input(self, in_buffer, in_len);
+    int w_size = 0;
+    if (r_size > 0) {
+        w_size = audio_element_output(self, in_buffer, r_size);
+    } else {
+        w_size = r_size;
+    }
+    return w_size;
+}
+
+static esp_err_t _sd_wav_writer_close(audio_element_handle_t self)
+{
+    sd_wav_writer_t *writer = (sd_wav_writer_t *)audio_element_getdata(self);
+    audio_element_info_t info;
+    audio_element_getinfo(self, &info);
+    if (writer->is_open) {
+        _file_close(writer, &info);
+        if (writer->segment_cb) {
+            writer->segment_cb(self, writer->uri, NULL, 0, writer->segment_ctx);
+        }
+    }
+    heap_caps_free(writer->block);
+    writer->block = NULL;
+    audio_free(writer->index);
+    writer->index = NULL;
+
+    if (AEL_STATE_PAUSED != audio_element_get_state(self)) {
+        info.byte_pos = 0;
+        audio_element_setinfo(self, &info);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t _sd_wav_writer_destroy(audio_element_handle_t self)
+{
+    sd_wav_writer_t *writer = (sd_wav_writer_t *)audio_element_getdata(self);
+    for (int i = 0; i < writer->trailer_count; i++) {
+        audio_free(writer->trailers[i].data);
+    }
+    audio_free(writer->index);
+    vSemaphoreDelete(writer->trailer_lock);
+    audio_free(writer);
+    return ESP_OK;
+}
+
+esp_err_t sd_wav_writer_append_trailer(audio_element_handle_t self, const char *fourcc, const void *data, int len)
+{
+    sd_wav_writer_t *writer = (sd_wav_writer_t *)audio_element_getdata(self);
+    if (writer == NULL || fourcc == NULL || data == NULL || len <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_err_t ret = ESP_OK;
+    xSemaphoreTake(writer->trailer_lock, portMAX_DELAY);
+    sd_wav_trailer_t *t = NULL;
+    for (int i = 0; i < writer->trailer_count; i++) {
+        if (memcmp(writer->trailers[i].id, fourcc, 4) == 0) {
+            t = &writer->trailers[i];
+            break;
+        }
+    }
+    if (t == NULL && writer->trailer_count < SD_WAV_WRITER_MAX_TRAILERS) {
+        t = &writer->trailers[writer->trailer_count++];
+        memcpy(t->id, fourcc, 4);
+    }
+    if (t == NULL) {
+        ret = ESP_ERR_NO_MEM;
+    } else {
+        uint8_t *p = audio_realloc(t->data, t->len + len);
+        if (p == NULL) {
+            ret = ESP_ERR_NO_MEM;
+        } else {
+            memcpy(p + t->len, data, len);
+            t->data = p;
+            t->len += len;
+        }
+    }
+    xSemaphoreGive(writer->trailer_lock);
+    return ret;
+}
+
+static esp_err_t _read_at(FIL *file, FSIZE_t offset, void *buf, UINT len)
+{
+    UINT br = 0;
+    if (f_lseek(file, offset) != FR_OK || f_read(file, buf, len, &br) != FR_OK || br != len) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t _write_at(FIL *file, FSIZE_t offset, const void *buf, UINT len)
+{
+    UINT bw = 0;
+    if (f_lseek(file, offset) != FR_OK || f_write(file, buf, len, &bw) != FR_OK || bw != len) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/*
+ * Walk the header chunks up to "data". A closed file has its data size, a
+ * checkpoint of a container file only the RIFF (or ds64) size, the data
+ * chunk header lives in a later sector.
+ */
+static esp_err_t _recover(FIL *file, uint64_t *data_bytes)
+{
+    uint8_t buf[24];
+    FSIZE_t size = f_size(file);
+    if (_read_at(file, 0, buf, 12) != ESP_OK || memcmp(buf + 8, "WAVE", 4) != 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    bool rf64 = memcmp(buf, "RF64", 4) == 0;
+    uint64_t riff_size = _rd_u32(buf + 4);
+    uint64_t data = 0;
+    FSIZE_t ds64 = 0;
+    FSIZE_t hs = 0;
+    int block_align = 0;
+    for (FSIZE_t off = 12; hs == 0 && off + 8 <= size && off < SD_WAV_WRITER_MAX_HEADER_SIZE; ) {
+        if (_read_at(file, off, buf, 8) != ESP_OK) {
+            return ESP_FAIL;
+        }
+        uint32_t len = _rd_u32(buf + 4);
+        if (memcmp(buf, "data", 4) == 0) {
+            hs = off + 8;
+            if (!rf64) {
+                data = len;     /* 0xffffffff in an RF64 file, ds64 has it */
+            }
+        } else if (memcmp(buf, "fmt ", 4) == 0) {
+            if (_read_at(file, off + 8, buf, 16) != ESP_OK) {
+                return ESP_FAIL;
+            }
+            block_align = _rd_u16(buf + 12);
+        } else if (rf64 && memcmp(buf, "ds64", 4) == 0) {
+            if (_read_at(file, off + 8, buf, 24) != ESP_OK) {
+                return ESP_FAIL;
+            }
+            ds64 = off + 8;
+            riff_size = _rd_u64(buf);
+            data = _rd_u64(buf + 8);
+        }
+        off += 8 + len + (len & 1);
+    }
+    if (hs == 0 || block_align == 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (rf64 && ds64 == 0) {
+        return ESP_FAIL;
+    }
+    uint64_t stored = data;
+    if (data == 0 && riff_size + 8 > hs) {
+        data = riff_size + 8 - hs;
+    }
+    if (hs + data > size) {
+        data = size > hs ? size - hs : 0;
+    }
+    data -= data % block_align;
+    if (data == 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    *data_bytes = data;
+    /* Trailers of a closed file are inside the RIFF size, a checkpoint has none */
+    if (riff_size + 8 == size && data == stored) {
+        return ESP_OK;
+    }
+    uint64_t end = hs + data;
+    if (rf64) {
+        _wr_u64(buf, end - 8);
+        _wr_u64(buf + 8, data);
+        _wr_u64(buf + 16, data / block_align);
+        if (_write_at(file, ds64, buf, 24) != ESP_OK) {
+            return ESP_FAIL;
+        }
+    } else {
+        _wr_u32(buf, end - 8);
+        _wr_u32(buf + 4, data);
+        if (_write_at(file, 4, buf, 4) != ESP_OK || _write_at(file, hs - 4, buf + 4, 4) != ESP_OK) {
+            return ESP_FAIL;
+        }
+    }
+    if (f_lseek(file, end) != FR_OK || f_truncate(file) != FR_OK) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t sd_wav_writer_recover(const char *uri, uint64_t *data_bytes)
+{
+    char path[256];
+    if (_fatfs_path(uri, path, sizeof(path)) != ESP_OK) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    FIL *file = audio_calloc(1, sizeof(FIL));
+    AUDIO_MEM_CHECK(TAG, file, return ESP_ERR_NO_MEM);
+    int64_t start = esp_timer_get_time();
+    if (f_open(file, path, FA_READ | FA_WRITE) != FR_OK) {
+        audio_free(file);
+        return ESP_ERR_NOT_FOUND;
+    }
+    FSIZE_t size = f_size(file);
+    uint64_t data = 0;
+    esp_err_t ret = _recover(file, &data);
+    FSIZE_t kept = f_size(file);
+    if (f_close(file) != FR_OK && ret == ESP_OK) {
+        ret = ESP_FAIL;
+    }
+    audio_free(file);
+    if (ret == ESP_OK) {
+        ESP_LOGI(TAG, "Recovered %s: %" PRIu64 " bytes of audio, %" PRIu64 " bytes dropped, %lld ms", path,
+                 data, (uint64_t)(size - kept), (long long)(esp_timer_get_time() - start) / 1000);
+    } else {
+        ESP_LOGW(TAG, "Cannot recover %s (%s)", path, esp_err_to_name(ret));
+    }
+    if (data_bytes) {
+        *data_bytes = data;
+    }
+    return ret;
+}
+
+esp_err_t sd_wav_writer_get_stats(audio_element_handle_t self, sd_wav_writer_stats_t *stats)
+{
+    sd_wav_writer_t *writer = (sd_wav_writer_t *)audio_element_getdata(self);
+    if (writer == NULL || stats == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(stats, &writer->stats, sizeof(*stats));
+    return ESP_OK;
+}
+
+void sd_wav_writer_log_stats(audio_element_handle_t self)
+{
+    sd_wav_writer_stats_t stats;
+    if (sd_wav_writer_get_stats(self, &stats) != ESP_OK || stats.writes == 0) {
+        return;
+    }
+    ESP_LOGI(TAG, "%u writes, %" PRIu64 " bytes, avg %" PRIu64 " us, max %u us, preallocated %d",
+             stats.writes, stats.bytes, stats.total_us / stats.writes, stats.max_us, stats.preallocated);
+    if (stats.checkpoints) {
+        ESP_LOGI(TAG, "%u checkpoints, max %u us", stats.checkpoints, stats.checkpoint_max_us);
+    }
+    for (int i = 0; i < SD_WAV_WRITER_HIST_BUCKETS; i++) {
+        if (stats.hist[i]) {
+            ESP_LOGI(TAG, "  %7u - %7u us: %u", 1u << i, (2u << i) - 1, stats.hist[i]);
+        }
+    }
+}
+
+audio_element_handle_t sd_wav_writer_init(sd_wav_writer_cfg_t *config)
+{
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    sd_wav_writer_t *writer = audio_calloc(1, sizeof(sd_wav_writer_t));
+    AUDIO_MEM_CHECK(TAG, writer, return NULL);
+
+    cfg.open = _sd_wav_writer_open;
+    cfg.close = _sd_wav_writer_close;
+    cfg.process = _sd_wav_writer_process;
+    cfg.destroy = _sd_wav_writer_destroy;
+    cfg.write = _sd_wav_writer_write;
+    cfg.task_stack = config->task_stack;
+    cfg.task_prio = config->task_prio;
+    cfg.task_core = config->task_core;
+    cfg.stack_in_ext = config->ext_stack;
+    cfg.buffer_len = SD_WAV_WRITER_BUFFER_LEN;
+    cfg.tag = "wav_file";
+
+    writer->expected_seconds = config->expected_seconds;
+    writer->margin_seconds = config->margin_seconds;
+    writer->segment_seconds = config->segment_seconds;
+    writer->segment_cb = config->segment_cb;
+    writer->segment_ctx = config->segment_ctx;
+    writer->container = config->container;
+    writer->index_interval_ms = config->index_interval_ms;
+    writer->stage = config->stage;
+    writer->tap_cb = config->tap_cb;
+    writer->tap_ctx = config->tap_ctx;
+    writer->checkpoint_ms = config->checkpoint_ms;
+    writer->prof = cycle_prof_probe("wav_file");
+    if (config->device_id) {
+        snprintf(writer->device_id, sizeof(writer->device_id), "%s", config->device_id);
+    }
+    if (config->info_comment) {
+        snprintf(writer->info_comment, sizeof(writer->info_comment), "%s", config->info_comment);
+    }
+    if (writer->segment_seconds > 0 && writer->segment_cb == NULL) {
+        ESP_LOGW(TAG, "segment_seconds needs segment_cb, segmenting disabled");
+        writer->segment_seconds = 0;
+    }
+    writer->trailer_lock = xSemaphoreCreateMutex();
+    AUDIO_MEM_CHECK(TAG, writer->trailer_lock, {
+        audio_free(writer);
+        return NULL;
+    });
+
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, {
+        audio_free(writer);
+        return NULL;
+    });
+    audio_element_setdata(el, writer);
+    return el;
+}
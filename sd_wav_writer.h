@@ -0,0 +1,199 @@
+/*
+ * sd_wav_writer - WAV writer element for the SD card
+ *
+ * Drop-in replacement for fatfs_stream (AUDIO_STREAM_WRITER) that talks to
+ * FatFs directly. The file is preallocated as one contiguous cluster chain
+ * with f_expand(), audio is written in cluster-aligned blocks from a
+ * DMA-capable buffer and the file is truncated to its real length on close,
+ * so no cluster allocation happens while recording.
+ *
+ * With container set the header region also carries the clip metadata and
+ * a seek index, so tools on the NAS can read the first header_size bytes and
+ * fetch any time range with REST + RETR:
+ *
+ *   RIFF/RF64 "WAVE"
+ *   JUNK (28 bytes)      becomes ds64 if the file grows past 4 GB
+ *   fmt
+ *   LIST "INFO"          IART device_id, ICRD start time, ISFT, ICMT info_comment
+ *   tidx                 sd_wav_writer_tidx_t followed by sd_wav_writer_tidx_entry_t[]
+ *   JUNK                 pads to a sector boundary
+ *   data
+ *
+ * The header region is written once when the file is opened and patched in
+ * place on close, the audio data is never read back or moved.
+ *
+ * With stage and segment_seconds set each segment is first offered to
+ * clip_stage: when the PSRAM arena has room the whole file is built there
+ * under the same path and the card is not touched, otherwise it is written
+ * to the card as usual.
+ *
+ * tap_cb gets a copy of the audio as the writer takes it, e.g. for
+ * live_upload.
+ *
+ * With checkpoint_ms set the sizes reached so far are written into the first
+ * sector of the header and the file is synced about every checkpoint_ms of
+ * audio, right after a block write. That is one sector plus the directory
+ * entry, and a file cut short by power loss keeps everything up to the last
+ * checkpoint: sd_wav_writer_recover() takes the sizes from there, patches the
+ * data chunk and drops the preallocated tail. The seek index of a recovered
+ * file is empty.
+ */
+
+#ifndef SD_WAV_WRITER_H_
+#define SD_WAV_WRITER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* VFS mount point of the card and the matching FatFs logical drive */
+#if !defined SD_WAV_WRITER_VFS_PREFIX
+#define SD_WAV_WRITER_VFS_PREFIX            "/sdcard"
+#endif
+#if !defined SD_WAV_WRITER_FATFS_DRIVE
+#define SD_WAV_WRITER_FATFS_DRIVE           "0:"
+#endif
+
+/* Header region at the start of the file, data chunk starts right after it */
+#define SD_WAV_WRITER_HEADER_SIZE           512
+
+/* Upper bound for the container header region (metadata + seek index) */
+#define SD_WAV_WRITER_MAX_HEADER_SIZE       (8 * 1024)
+
+/* Upper bound for one write block, clusters larger than this are split */
+#define SD_WAV_WRITER_MAX_BLOCK_SIZE        (32 * 1024)
+
+/* Trailer chunks per file, see sd_wav_writer_append_trailer() */
+#define SD_WAV_WRITER_MAX_TRAILERS          4
+
+/* Write latency histogram: bucket i counts writes of [2^i, 2^(i+1)) us */
+#define SD_WAV_WRITER_HIST_BUCKETS          21
+
+/**
+ * @brief  Called after a file is closed. When next_uri is not NULL the writer
+ *         is segmenting and continues in the file the callback writes there.
+ */
+typedef void (*sd_wav_writer_segment_cb_t)(audio_element_handle_t self, const char *closed_uri,
+                                           char *next_uri, int next_uri_len, void *ctx);
+
+/**
+ * @brief  Sees every piece of audio as the writer takes it, uri is the file
+ *         it goes to. Runs in the writer task and must not block.
+ */
+typedef void (*sd_wav_writer_tap_cb_t)(const char *uri, const audio_element_info_t *info,
+                                       const void *data, int len, void *ctx);
+
+/* Payload of the "tidx" chunk, little endian */
+typedef struct __attribute__((packed)) {
+    uint32_t version;               /* 1 */
+    uint32_t interval_ms;           /* Nominal audio time between entries */
+    uint32_t count;                 /* Valid entries */
+    uint32_t data_offset;           /* File offset of the first sample */
+    uint16_t block_align;           /* Bytes per sample frame */
+    uint16_t reserved;
+} sd_wav_writer_tidx_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t time_sec;              /* Unix time the frame reached the writer */
+    uint16_t time_ms;
+    uint16_t reserved;
+    uint32_t frame;                 /* Sample frame, file offset = data_offset + frame * block_align */
+} sd_wav_writer_tidx_entry_t;
+
+typedef struct {
+    int     task_stack;             /* Element task stack */
+    int     task_core;              /* Element task core */
+    int     task_prio;              /* Element task priority */
+    bool    ext_stack;              /* Allocate task stack in PSRAM */
+    int     expected_seconds;       /* Recording length used for preallocation, 0 disables it */
+    int     margin_seconds;         /* Extra seconds preallocated on top of expected_seconds */
+    int     segment_seconds;        /* Start a new file every segment_seconds, 0 disables it */
+    sd_wav_writer_segment_cb_t segment_cb;  /* Closed file notification / next file name */
+    void    *segment_ctx;           /* Argument passed to segment_cb */
+    bool    container;              /* INFO metadata and seek index in the header region */
+    int     index_interval_ms;      /* Seek index spacing, raised if the clip needs more entries than fit */
+    const char *device_id;          /* IART, may be NULL */
+    const char *info_comment;       /* ICMT (e.g. gain), may be NULL */
+    bool    stage;                  /* Build segments in the clip_stage arena when it has room */
+    sd_wav_writer_tap_cb_t tap_cb;  /* Copy of the audio as it is written, may be NULL */
+    void    *tap_ctx;               /* Argument passed to tap_cb */
+    int     checkpoint_ms;          /* Header checkpoint spacing in audio time, 0 disables it */
+} sd_wav_writer_cfg_t;
+
+#define SD_WAV_WRITER_TASK_STACK            (3072)
+#define SD_WAV_WRITER_TASK_CORE             (0)
+#define SD_WAV_WRITER_TASK_PRIO             (4)
+
+#define SD_WAV_WRITER_CFG_DEFAULT() {               \
+    .task_stack = SD_WAV_WRITER_TASK_STACK,         \
+    .task_core = SD_WAV_WRITER_TASK_CORE,           \
+    .task_prio = SD_WAV_WRITER_TASK_PRIO,           \
+    .ext_stack = false,                             \
+    .expected_seconds = 0,                          \
+    .margin_seconds = 2,                            \
+    .segment_seconds = 0,                           \
+    .segment_cb = NULL,                             \
+    .segment_ctx = NULL,                            \
+    .container = false,                             \
+    .index_interval_ms = 1000,                      \
+    .device_id = NULL,                              \
+    .info_comment = NULL,                           \
+    .stage = false,                                 \
+    .tap_cb = NULL,                                 \
+    .tap_ctx = NULL,                                \
+    .checkpoint_ms = 0,                             \
+}
+
+typedef struct {
+    uint32_t writes;                                /* Block writes issued */
+    uint32_t max_us;                                /* Slowest block write */
+    uint64_t total_us;                              /* Sum of all block write times */
+    uint64_t bytes;                                 /* Audio bytes written */
+    uint32_t hist[SD_WAV_WRITER_HIST_BUCKETS];      /* Block write latency histogram */
+    uint32_t checkpoints;                           /* Header checkpoints written */
+    uint32_t checkpoint_max_us;                     /* Slowest checkpoint, sector write and sync */
+    bool     preallocated;                          /* f_expand succeeded for this file */
+    bool     staged;                                /* File was built in the clip_stage arena */
+} sd_wav_writer_stats_t;
+
+/**
+ * @brief  Create the writer element, uri is set with audio_element_set_uri()
+ *         like for fatfs_stream ("/sdcard/xxx.wav")
+ */
+audio_element_handle_t sd_wav_writer_init(sd_wav_writer_cfg_t *config);
+
+/**
+ * @brief  Copy the statistics of the current (or last closed) file
+ */
+esp_err_t sd_wav_writer_get_stats(audio_element_handle_t self, sd_wav_writer_stats_t *stats);
+
+/**
+ * @brief  Append bytes to a chunk written after the data chunk on close.
+ *         Calls with the same fourcc extend the same chunk. Safe to call from
+ *         other tasks while recording.
+ */
+esp_err_t sd_wav_writer_append_trailer(audio_element_handle_t self, const char *fourcc, const void *data, int len);
+
+/**
+ * @brief  Repair a file whose recording was cut short (power loss, reset) from
+ *         its last header checkpoint: patch the sizes, truncate the
+ *         preallocated tail. A file that was closed is left as it is.
+ *         data_bytes (may be NULL) gets the audio kept. ESP_ERR_NOT_FOUND when
+ *         the file is missing or holds no checkpointed audio.
+ */
+esp_err_t sd_wav_writer_recover(const char *uri, uint64_t *data_bytes);
+
+/**
+ * @brief  Print the write latency histogram of the current (or last closed) file
+ */
+void sd_wav_writer_log_stats(audio_element_handle_t self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SD_WAV_WRITER_H_ */
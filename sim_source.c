@@ -0,0 +1,453 @@
+/*
+ * sim_source - simulated audio source for benchmarking the recording path
+ *
+ * The position counts audio time, dropped audio included, so pacing does not
+ * drift after a drop; the capture stamps count the bytes actually produced,
+ * which is what the writer sees.
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "audio_element.h"
+#include "sim_source.h"
+#include "cycle_prof.h"
+
+static const char *TAG = "SIM_SOURCE";
+
+#define SIM_SOURCE_BUFFER_LEN               (2048)
+#define SIM_SOURCE_NOISE_DIV                10          /* Full scale / 10, -20 dBFS */
+
+typedef struct {
+    uint64_t                end;            /* Produced bytes up to the end of the chunk */
+    int64_t                 time_us;        /* Capture time of its last sample */
+} sim_mark_t;
+
+typedef struct {
+    char                    fixture[128];
+    int                     max_fixture_bytes;
+    bool                    realtime;
+    int64_t                 dma_us;
+    uint64_t                total_bytes;    /* Audio time to produce in bytes, 0 = no end */
+    int                     duration_ms;
+    uint8_t                 *data;          /* Fixture samples, NULL for noise */
+    int                     data_len;
+    int                     data_pos;
+    uint32_t                noise;          /* LCG state */
+    int                     byte_rate;
+    int                     block_align;
+    uint64_t                pos;            /* Audio time in bytes, drops included */
+    SemaphoreHandle_t       lock;
+    sim_mark_t              marks[SIM_SOURCE_MARKS];
+    uint32_t                mark_head;
+    uint32_t                mark_tail;
+    TaskStatus_t            *tasks;         /* Snapshot at the first read */
+    int                     task_count;
+    uint32_t                run_start;
+    size_t                  internal_start; /* Free heap at the first read */
+    size_t                  spiram_start;
+    sim_source_stats_t      stats;
+    int                     prof;           /* cycle_prof probe */
+} sim_source_t;
+
+static uint16_t _rd_u16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t _rd_u32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Load the data chunk of the fixture, a missing fixture leaves noise */
+static esp_err_t _load_fixture(sim_source_t *sim, const audio_element_info_t *info)
+{
+    FILE *fp = fopen(sim->fixture, "rb");
+    if (fp == NULL) {
+        ESP_LOGW(TAG, "No fixture %s, playing noise", sim->fixture);
+        return ESP_OK;
+    }
+    uint8_t hdr[24];
+    uint32_t data_len = 0;
+    int rate = 0, channels = 0, bits = 0;
+    bool found = false;
+    if (fread(hdr, 1, 12, fp) == 12 && memcmp(hdr, "RIFF", 4) == 0 && memcmp(hdr + 8, "WAVE", 4) == 0) {
+        while (!found && fread(hdr, 1, 8, fp) == 8) {
+            uint32_t len = _rd_u32(hdr + 4);
+            long skip = len + (len & 1);
+            if (memcmp(hdr, "data", 4) == 0) {
+                data_len = len;
+                found = true;
+            } else if (memcmp(hdr, "fmt ", 4) == 0 && len >= 16) {
+                if (fread(hdr + 8, 1, 16, fp) != 16) {
+                    break;
+                }
+                channels = _rd_u16(hdr + 10);
+                rate = _rd_u32(hdr + 12);
+                bits = _rd_u16(hdr + 22);
+                skip -= 16;
+            }
+            if (!found && fseek(fp, skip, SEEK_CUR) != 0) {
+                break;
+            }
+        }
+    }
+    if (!found || rate != info->sample_rates || channels != info->channels || bits != info->bits) {
+        ESP_LOGE(TAG, "%s is %d Hz %d ch %d bits, the stream is %d Hz %d ch %d bits", sim->fixture,
+                 rate, channels, bits, info->sample_rates, info->channels, info->bits);
+        fclose(fp);
+        return ESP_FAIL;
+    }
+    if (data_len > sim->max_fixture_bytes) {
+        data_len = sim->max_fixture_bytes;
+    }
+    data_len -= data_len % sim->block_align;
+    /* In PSRAM with CONFIG_SPIRAM_BOOT_INIT, the card is left to the writer */
+    sim->data = audio_malloc(data_len);
+    if (sim->data == NULL || fread(sim->data, 1, data_len, fp) != data_len) {
+        ESP_LOGE(TAG, "Cannot load %u bytes of %s", (unsigned)data_len, sim->fixture);
+        audio_free(sim->data);
+        sim->data = NULL;
+        fclose(fp);
+        return ESP_FAIL;
+    }
+    fclose(fp);
+    sim->data_len = data_len;
+    sim->data_pos = 0;
+    ESP_LOGI(TAG, "Fixture %s, %u ms", sim->fixture, (unsigned)((uint64_t)data_len * 1000 / sim->byte_rate));
+    return ESP_OK;
+}
+
+/* Take len bytes of the fixture (or noise), or only move past them when dst is NULL */
+static void _fill(sim_source_t *sim, uint8_t *dst, uint64_t len)
+{
+    if (sim->data == NULL) {
+        if (dst) {
+            for (int i = 0; i + 1 < len; i += 2) {
+                sim->noise = sim->noise * 1664525 + 1013904223;
+                int16_t s = ((int32_t)(sim->noise >> 16) - 32768) / SIM_SOURCE_NOISE_DIV;
+                dst[i] = s & 0xff;
+                dst[i + 1] = (s >> 8) & 0xff;
+            }
+        }
+        return;
+    }
+    while (len > 0) {
+        uint64_t n = sim->data_len - sim->data_pos;
+        if (n > len) {
+            n = len;
+        }
+        if (dst) {
+            memcpy(dst, sim->data + sim->data_pos, n);
+            dst += n;
+        }
+        sim->data_pos += n;
+        len -= n;
+        if (sim->data_pos == sim->data_len) {
+            sim->data_pos = 0;
+            sim->stats.loops++;
+        }
+    }
+}
+
+static void _snapshot(sim_source_t *sim)
+{
+    sim->internal_start = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    sim->spiram_start = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    if (sim->tasks == NULL) {
+        sim->tasks = audio_calloc(SIM_SOURCE_MAX_TASKS, sizeof(TaskStatus_t));
+    }
+    if (sim->tasks) {
+        sim->task_count = uxTaskGetSystemState(sim->tasks, SIM_SOURCE_MAX_TASKS, &sim->run_start);
+    }
+}
+
+static esp_err_t _sim_source_open(audio_element_handle_t self)
+{
+    sim_source_t *sim = (sim_source_t *)audio_element_getdata(self);
+    audio_element_info_t info = {0};
+    audio_element_getinfo(self, &info);
+    sim->block_align = info.channels * info.bits / 8;
+    sim->byte_rate = info.sample_rates * sim->block_align;
+    if (sim->block_align <= 0 || sim->byte_rate <= 0) {
+        ESP_LOGE(TAG, "Unsupported format %d Hz, %d bits, %d ch", info.sample_rates, info.bits, info.channels);
+        return ESP_FAIL;
+    }
+    if (sim->data == NULL && sim->fixture[0] && _load_fixture(sim, &info) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    sim->total_bytes = (uint64_t)sim->byte_rate * sim->duration_ms / 1000;
+    sim->total_bytes -= sim->total_bytes % sim->block_align;
+    sim->pos = 0;
+    info.byte_pos = 0;
+    info.total_bytes = sim->total_bytes;
+    audio_element_setinfo(self, &info);
+    return ESP_OK;
+}
+
+static int _sim_source_read(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *context)
+{
+    sim_source_t *sim = (sim_source_t *)audio_element_getdata(self);
+    if (sim->total_bytes && sim->pos >= sim->total_bytes) {
+        return AEL_IO_DONE;
+    }
+    len -= len % sim->block_align;
+    if (sim->total_bytes && len > sim->total_bytes - sim->pos) {
+        len = sim->total_bytes - sim->pos;
+    }
+    int64_t now = esp_timer_get_time();
+    if (sim->stats.start_us == 0) {
+        _snapshot(sim);
+        sim->stats.start_us = now;
+    }
+    int64_t due = sim->stats.start_us + (int64_t)((sim->pos + len) * 1000000 / sim->byte_rate);
+    if (sim->realtime && now < due) {
+        int ms = (due - now + 999) / 1000;
+        vTaskDelay((ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS);
+    } else if (sim->realtime && now - due > sim->dma_us) {
+        /* The DMA would have overwritten what came in while we were late */
+        uint64_t lost = (uint64_t)(now - due - sim->dma_us) * sim->byte_rate / 1000000;
+        lost -= lost % sim->block_align;
+        if (sim->total_bytes && lost > sim->total_bytes - sim->pos - len) {
+            lost = sim->total_bytes - sim->pos - len;
+        }
+        if (lost) {
+            _fill(sim, NULL, lost);
+            sim->pos += lost;
+            sim->stats.drops++;
+            sim->stats.dropped_bytes += lost;
+            due = sim->stats.start_us + (int64_t)((sim->pos + len) * 1000000 / sim->byte_rate);
+        }
+    }
+    uint32_t prof_start = CYCLE_PROF_BEGIN();
+    _fill(sim, (uint8_t *)buffer, len);
+    CYCLE_PROF_END(sim->prof, prof_start, len / sim->block_align);
+    sim->pos += len;
+
+    xSemaphoreTake(sim->lock, portMAX_DELAY);
+    sim->stats.bytes += len;
+    sim_mark_t *m = &sim->marks[sim->mark_head % SIM_SOURCE_MARKS];
+    m->end = sim->stats.bytes;
+    m->time_us = sim->realtime ? due : esp_timer_get_time();
+    sim->mark_head++;
+    xSemaphoreGive(sim->lock);
+
+    audio_element_info_t info;
+    audio_element_getinfo(self, &info);
+    info.byte_pos += len;
+    audio_element_setinfo(self, &info);
+    return len;
+}
+
+static int _sim_source_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    int r_size = audio_element_input(self, in_buffer, in_len);
+    int w_size = 0;
+    if (r_size > 0) {
+        w_size = audio_element_output(self, in_buffer, r_size);
+    } else {
+        w_size = r_size;
+    }
+    return w_size;
+}
+
+static esp_err_t _sim_source_close(audio_element_handle_t self)
+{
+    if (AEL_STATE_PAUSED != audio_element_get_state(self)) {
+        audio_element_info_t info;
+        audio_element_getinfo(self, &info);
+        info.byte_pos = 0;
+        audio_element_setinfo(self, &info);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t _sim_source_destroy(audio_element_handle_t self)
+{
+    sim_source_t *sim = (sim_source_t *)audio_element_getdata(self);
+    audio_free(sim->data);
+    audio_free(sim->tasks);
+    vSemaphoreDelete(sim->lock);
+    audio_free(sim);
+    return ESP_OK;
+}
+
+void sim_source_tap(const char *uri, const audio_element_info_t *info, const void *data, int len, void *ctx)
+{
+    sim_source_t *sim = (sim_source_t *)audio_element_getdata((audio_element_handle_t)ctx);
+    if (sim == NULL) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(sim->lock, portMAX_DELAY);
+    sim_source_stats_t *st = &sim->stats;
+    st->tapped_bytes += len;
+    st->last_tap_us = now;
+    /* Stamp of the chunk holding the last byte of this write */
+    if (sim->mark_head - sim->mark_tail > SIM_SOURCE_MARKS) {
+        sim->mark_tail = sim->mark_head - SIM_SOURCE_MARKS;
+        st->unmatched++;
+    } else {
+        while (sim->mark_tail != sim->mark_head
+               && sim->marks[sim->mark_tail % SIM_SOURCE_MARKS].end < st->tapped_bytes) {
+            sim->mark_tail++;
+        }
+        if (sim->mark_tail != sim->mark_head) {
+            int64_t us = now - sim->marks[sim->mark_tail % SIM_SOURCE_MARKS].time_us;
+            uint32_t lat = us > 0 ? us : 0;
+            if (st->latency_count == 0 || lat < st->latency_min_us) {
+                st->latency_min_us = lat;
+            }
+            if (lat > st->latency_max_us) {
+                st->latency_max_us = lat;
+            }
+            st->latency_sum_us += lat;
+            st->latency_count++;
+        }
+    }
+    xSemaphoreGive(sim->lock);
+}
+
+esp_err_t sim_source_get_stats(audio_element_handle_t self, sim_source_stats_t *stats)
+{
+    sim_source_t *sim = (sim_source_t *)audio_element_getdata(self);
+    if (sim == NULL || stats == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    xSemaphoreTake(sim->lock, portMAX_DELAY);
+    memcpy(stats, &sim->stats, sizeof(*stats));
+    xSemaphoreGive(sim->lock);
+    return ESP_OK;
+}
+
+static void _log_tasks(sim_source_t *sim)
+{
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    TaskStatus_t *now = audio_calloc(SIM_SOURCE_MAX_TASKS, sizeof(TaskStatus_t));
+    if (now == NULL || sim->tasks == NULL) {
+        audio_free(now);
+        return;
+    }
+    uint32_t run_end;
+    int count = uxTaskGetSystemState(now, SIM_SOURCE_MAX_TASKS, &run_end);
+    /* Every core has its own run time, the counters of all tasks add up to cores * elapsed */
+    uint64_t total = (uint64_t)(run_end - sim->run_start) * portNUM_PROCESSORS;
+    if (total == 0) {
+        audio_free(now);
+        return;
+    }
+    ESP_LOGI(TAG, "CPU by task (%% of %d cores):", portNUM_PROCESSORS);
+    for (int i = 0; i < count; i++) {
+        uint32_t start = 0;
+        for (int j = 0; j < sim->task_count; j++) {
+            if (sim->tasks[j].xHandle == now[i].xHandle) {
+                start = sim->tasks[j].ulRunTimeCounter;
+                break;
+            }
+        }
+        uint32_t permille = (uint64_t)(now[i].ulRunTimeCounter - start) * 1000 / total;
+        if (permille) {
+            ESP_LOGI(TAG, "  %-16s %3u.%u%%", now[i].pcTaskName, (unsigned)permille / 10, (unsigned)permille % 10);
+        }
+    }
+    audio_free(now);
+#else
+    ESP_LOGI(TAG, "CPU by task needs CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS");
+#endif
+}
+
+void sim_source_log_report(audio_element_handle_t self)
+{
+    sim_source_t *sim = (sim_source_t *)audio_element_getdata(self);
+    sim_source_stats_t st;
+    if (sim_source_get_stats(self, &st) != ESP_OK || st.start_us == 0) {
+        return;
+    }
+    /* Audio the writer took per wall time; without the tap, what was produced */
+    uint64_t bytes = st.tapped_bytes ? st.tapped_bytes : st.bytes;
+    int64_t end = st.tapped_bytes ? st.last_tap_us : esp_timer_get_time();
+    int64_t wall_ms = (end - st.start_us) / 1000;
+    uint64_t audio_ms = bytes * 1000 / sim->byte_rate;
+    uint32_t rtf = wall_ms > 0 ? audio_ms * 100 / wall_ms : 0;
+    ESP_LOGI(TAG, "%s: %" PRIu64 " ms of audio produced, %" PRIu64 " ms written in %lld ms, real-time factor %u.%02u",
+             sim->realtime ? "Realtime" : "Unpaced", st.bytes * 1000 / sim->byte_rate, audio_ms,
+             (long long)wall_ms, (unsigned)rtf / 100, (unsigned)rtf % 100);
+    if (st.drops) {
+        ESP_LOGW(TAG, "%u drops, %" PRIu64 " ms of audio lost", st.drops, st.dropped_bytes * 1000 / sim->byte_rate);
+    }
+    if (st.latency_count) {
+        ESP_LOGI(TAG, "Source -> writer latency min %u, avg %" PRIu64 ", max %u ms (%u writes, %u unmatched)",
+                 st.latency_min_us / 1000, st.latency_sum_us / st.latency_count / 1000,
+                 st.latency_max_us / 1000, st.latency_count, st.unmatched);
+    }
+    ESP_LOGI(TAG, "Internal heap %u free at start, %u now, %u lowest since boot, largest block %u",
+             (unsigned)sim->internal_start, (unsigned)heap_caps_get_free_size(MALLOC_CAP_INTERNAL),
+             (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL),
+             (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL));
+    if (sim->spiram_start) {
+        ESP_LOGI(TAG, "PSRAM %u free at start, %u now, %u lowest since boot", (unsigned)sim->spiram_start,
+                 (unsigned)heap_caps_get_free_size(MALLOC_CAP_SPIRAM),
+                 (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM));
+    }
+    _log_tasks(sim);
+}
+
+audio_element_handle_t sim_source_init(sim_source_cfg_t *config)
+{
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    sim_source_t *sim = audio_calloc(1, sizeof(sim_source_t));
+    AUDIO_MEM_CHECK(TAG, sim, return NULL);
+
+    cfg.open = _sim_source_open;
+    cfg.close = _sim_source_close;
+    cfg.process = _sim_source_process;
+    cfg.destroy = _sim_source_destroy;
+    cfg.read = _sim_source_read;
+    cfg.task_stack = config->task_stack;
+    cfg.task_prio = config->task_prio;
+    cfg.task_core = config->task_core;
+    cfg.stack_in_ext = config->ext_stack;
+    cfg.multi_out_rb_num = config->multi_out_num;
+    cfg.buffer_len = SIM_SOURCE_BUFFER_LEN;
+    cfg.tag = "sim";
+
+    if (config->fixture) {
+        snprintf(sim->fixture, sizeof(sim->fixture), "%s", config->fixture);
+    }
+    sim->max_fixture_bytes = config->max_fixture_bytes;
+    sim->realtime = config->realtime;
+    sim->dma_us = (int64_t)config->dma_ms * 1000;
+    sim->duration_ms = config->duration_ms;
+    sim->noise = 1;
+    sim->prof = cycle_prof_probe("sim");
+    sim->lock = xSemaphoreCreateMutex();
+    AUDIO_MEM_CHECK(TAG, sim->lock, {
+        audio_free(sim);
+        return NULL;
+    });
+
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, {
+        vSemaphoreDelete(sim->lock);
+        audio_free(sim);
+        return NULL;
+    });
+    audio_element_setdata(el, sim);
+    audio_element_info_t info = {0};
+    audio_element_getinfo(el, &info);
+    info.sample_rates = config->sample_rate;
+    info.channels = config->channels;
+    info.bits = config->bits;
+    audio_element_setinfo(el, &info);
+    return el;
+}
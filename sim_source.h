@@ -0,0 +1,115 @@
+/*
+ * sim_source - simulated audio source for benchmarking the recording path
+ *
+ * Stands in for i2s_stream_reader so the whole record -> encode -> write ->
+ * upload flow runs on the board without a microphone signal, with the same
+ * input every time. The source plays a WAV fixture (loaded into PSRAM at
+ * open, so the card only sees the writer) over and over, or white noise at
+ * -20 dBFS when there is none, for duration_ms of audio:
+ *
+ *   realtime     paced at the sample rate like the I2S DMA. A read more than
+ *                dma_ms late drops the audio it missed, as the DMA would, and
+ *                counts it.
+ *   !realtime    as fast as the pipeline takes it, the real-time factor of
+ *                the report is how much faster than real time it keeps up.
+ *
+ * Every chunk is stamped with the time it was captured (its due time, or the
+ * time it was read when not paced). sim_source_tap() as the tap of
+ * sd_wav_writer matches the audio reaching the writer against the stamps.
+ *
+ * sim_source_log_report() prints, from the first open:
+ *   - audio produced, taken by the writer and dropped, and the sustained
+ *     real-time factor (writer audio time / wall time)
+ *   - source -> writer latency, min / avg / max
+ *   - CPU share of every task (needs CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS)
+ *   - internal and PSRAM heap now and the lowest since boot
+ */
+
+#ifndef SIM_SOURCE_H_
+#define SIM_SOURCE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Capture stamps kept for the latency tap, one per chunk */
+#define SIM_SOURCE_MARKS                    256
+
+/* Tasks tracked for the CPU report */
+#define SIM_SOURCE_MAX_TASKS                32
+
+typedef struct {
+    int         task_stack;             /* Element task stack */
+    int         task_core;              /* Element task core */
+    int         task_prio;              /* Element task priority */
+    bool        ext_stack;              /* Allocate task stack in PSRAM */
+    int         multi_out_num;          /* Extra outputs, as i2s_stream_cfg_t.multi_out_num */
+    int         sample_rate;            /* Stream format, the fixture has to match */
+    int         channels;
+    int         bits;
+    const char  *fixture;               /* WAV file ("/sdcard/sim/x.wav"), NULL for noise */
+    int         max_fixture_bytes;      /* Longer fixtures are cut */
+    bool        realtime;               /* Pace at the sample rate */
+    int         dma_ms;                 /* Realtime: lateness absorbed before audio is dropped */
+    int         duration_ms;            /* Audio to produce, 0 until stopped */
+} sim_source_cfg_t;
+
+#define SIM_SOURCE_TASK_STACK               (3072)
+#define SIM_SOURCE_TASK_CORE                (1)
+#define SIM_SOURCE_TASK_PRIO                (23)
+
+#define SIM_SOURCE_CFG_DEFAULT() {                  \
+    .task_stack = SIM_SOURCE_TASK_STACK,            \
+    .task_core = SIM_SOURCE_TASK_CORE,              \
+    .task_prio = SIM_SOURCE_TASK_PRIO,              \
+    .ext_stack = false,                             \
+    .multi_out_num = 0,                             \
+    .sample_rate = 44100,                           \
+    .channels = 1,                                  \
+    .bits = 16,                                     \
+    .fixture = NULL,                                \
+    .max_fixture_bytes = 2 * 1024 * 1024,           \
+    .realtime = true,                               \
+    .dma_ms = 90,                                   \
+    .duration_ms = 0,                               \
+}
+
+typedef struct {
+    uint64_t bytes;                     /* Produced */
+    uint64_t dropped_bytes;             /* Realtime: missed by a late read */
+    uint32_t drops;
+    uint32_t loops;                     /* Fixture restarts */
+    uint64_t tapped_bytes;              /* Seen by sim_source_tap() */
+    uint32_t latency_count;
+    uint32_t latency_min_us;            /* Capture stamp to the writer */
+    uint32_t latency_max_us;
+    uint64_t latency_sum_us;
+    uint32_t unmatched;                 /* Tapped chunks whose stamp was overwritten */
+    int64_t  start_us;                  /* First read */
+    int64_t  last_tap_us;
+} sim_source_stats_t;
+
+audio_element_handle_t sim_source_init(sim_source_cfg_t *config);
+
+/**
+ * @brief  sd_wav_writer_tap_cb_t, ctx is the sim_source element
+ */
+void sim_source_tap(const char *uri, const audio_element_info_t *info, const void *data, int len, void *ctx);
+
+esp_err_t sim_source_get_stats(audio_element_handle_t self, sim_source_stats_t *stats);
+
+/**
+ * @brief  Print the benchmark report for everything since the first open
+ */
+void sim_source_log_report(audio_element_handle_t self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SIM_SOURCE_H_ */
@@ -0,0 +1,210 @@
+/*
+ * site_config - runtime settings fetched from the NAS
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <ctype.h>
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "audio_mem.h"
+#include "ftp_fetch.h"
+#include "site_config.h"
+
+static const char *TAG = "SITE_CONFIG";
+
+#define SITE_CONFIG_MAGIC                   0x53434647      /* "SCFG" */
+
+typedef struct {
+    uint32_t        magic;
+    site_config_t   cfg;
+} site_config_rtc_t;
+
+RTC_DATA_ATTR static site_config_rtc_t s_rtc;
+
+static const site_config_t s_default = {
+    .upload_dir = "",
+    .mic_gain_db = -1,
+    .rule_count = 0,
+};
+
+static const char *s_day_name[7] = { "sun", "mon", "tue", "wed", "thu", "fri", "sat" };
+
+static int _days(const char *s, int len)
+{
+    if (len == 5 && strncasecmp(s, "daily", 5) == 0) {
+        return SCHEDULE_EVERY_DAY;
+    }
+    if (len == 8 && strncasecmp(s, "weekdays", 8) == 0) {
+        return SCHEDULE_WEEKDAYS;
+    }
+    if (len == 7 && strncasecmp(s, "weekend", 7) == 0) {
+        return SCHEDULE_WEEKEND;
+    }
+    int mask = 0;
+    for (int i = 0; i < len; i += 4) {
+        int d = 0;
+        while (d < 7 && strncasecmp(s + i, s_day_name[d], 3) != 0) {
+            d++;
+        }
+        /* Each name is followed by a comma and another name, or ends the list */
+        if (d == 7 || i + 3 > len || (i + 3 < len && s[i + 3] != ',') || i + 4 == len) {
+            return 0;
+        }
+        mask |= 1 << d;
+    }
+    return mask;
+}
+
+/* HH:MM, 24:00 allowed, returns minutes or -1 */
+static int _minute(const char *s)
+{
+    if (!isdigit((unsigned char)s[0]) || !isdigit((unsigned char)s[1]) || s[2] != ':'
+        || !isdigit((unsigned char)s[3]) || !isdigit((unsigned char)s[4])) {
+        return -1;
+    }
+    int h = (s[0] - '0') * 10 + s[1] - '0';
+    int m = (s[3] - '0') * 10 + s[4] - '0';
+    if (m > 59 || h > 24 || (h == 24 && m != 0)) {
+        return -1;
+    }
+    return h * 60 + m;
+}
+
+/* "<days> HH:MM-HH:MM" */
+static esp_err_t _rule(schedule_kind_t kind, const char *value, schedule_rule_t *r)
+{
+    const char *sp = strchr(value, ' ');
+    if (sp == NULL || strlen(sp + 1) != 11 || sp[6] != '-') {
+        return ESP_ERR_INVALID_ARG;
+    }
+    int days = _days(value, sp - value);
+    int start = _minute(sp + 1);
+    int end = _minute(sp + 7);
+    if (days == 0 || start < 0 || start == 24 * 60 || end < 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (end == 0) {
+        end = 24 * 60;
+    }
+    r->kind = kind;
+    r->weekdays = days;
+    r->start_min = start;
+    r->end_min = end;
+    return ESP_OK;
+}
+
+static esp_err_t _set(site_config_t *cfg, const char *key, const char *value)
+{
+    if (strcmp(key, "upload_dir") == 0) {
+        if (value[0] != '/' || strlen(value) >= sizeof(cfg->upload_dir)) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        strcpy(cfg->upload_dir, value);
+        return ESP_OK;
+    }
+    if (strcmp(key, "mic_gain_db") == 0) {
+        char *end;
+        long db = strtol(value, &end, 10);
+        if (*end != '\0' || end == value || db < 0 || db > 24 || db % 3) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        cfg->mic_gain_db = db;
+        return ESP_OK;
+    }
+    schedule_kind_t kind;
+    if (strcmp(key, "record") == 0) {
+        kind = SCHEDULE_RECORD;
+    } else if (strcmp(key, "upload") == 0) {
+        kind = SCHEDULE_UPLOAD;
+    } else {
+        ESP_LOGW(TAG, "Unknown key %s skipped", key);
+        return ESP_OK;
+    }
+    if (cfg->rule_count == SITE_CONFIG_MAX_RULES) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return _rule(kind, value, &cfg->rules[cfg->rule_count++]);
+}
+
+esp_err_t site_config_parse(const char *text, site_config_t *cfg)
+{
+    *cfg = s_default;
+    int line_no = 0;
+    while (*text) {
+        char line[128];
+        int len = strcspn(text, "\n");
+        line_no++;
+        if (len >= sizeof(line)) {
+            ESP_LOGE(TAG, "Line %d too long", line_no);
+            return ESP_ERR_INVALID_SIZE;
+        }
+        memcpy(line, text, len);
+        line[len] = '\0';
+        text += len + (text[len] == '\n');
+        /* Strip comments, CR and surrounding blanks */
+        line[strcspn(line, "#\r")] = '\0';
+        char *p = line;
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        char *e = p + strlen(p);
+        while (e > p && (e[-1] == ' ' || e[-1] == '\t')) {
+            *--e = '\0';
+        }
+        if (*p == '\0') {
+            continue;
+        }
+        char *eq = strchr(p, '=');
+        if (eq == NULL) {
+            ESP_LOGE(TAG, "Line %d: no '='", line_no);
+            return ESP_ERR_INVALID_ARG;
+        }
+        *eq = '\0';
+        esp_err_t ret = _set(cfg, p, eq + 1);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Line %d: bad value for %s", line_no, p);
+            return ret;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t site_config_fetch(NetBuf_t *ctrl, const char *remote)
+{
+    char *text = audio_malloc(SITE_CONFIG_MAX_SIZE);
+    if (text == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    site_config_t cfg;
+    esp_err_t ret = ftp_fetch_to_buffer(ctrl, remote, text, SITE_CONFIG_MAX_SIZE, NULL);
+    if (ret == ESP_OK) {
+        ret = site_config_parse(text, &cfg);
+    }
+    audio_free(text);
+    if (ret != ESP_OK) {
+        if (ret != ESP_ERR_NOT_FOUND) {
+            ESP_LOGE(TAG, "%s rejected (%s), keeping the current config", remote, esp_err_to_name(ret));
+        }
+        return ret;
+    }
+    s_rtc.cfg = cfg;
+    s_rtc.magic = SITE_CONFIG_MAGIC;
+    site_config_apply();
+    ESP_LOGI(TAG, "Loaded %s: upload_dir %s, mic gain %d dB, %d rule(s)", remote,
+             cfg.upload_dir[0] ? cfg.upload_dir : "(default)", cfg.mic_gain_db, cfg.rule_count);
+    return ESP_OK;
+}
+
+const site_config_t *site_config_get(void)
+{
+    return s_rtc.magic == SITE_CONFIG_MAGIC ? &s_rtc.cfg : &s_default;
+}
+
+void site_config_apply(void)
+{
+    const site_config_t *cfg = site_config_get();
+    schedule_override(cfg->rules, cfg->rule_count);
+}
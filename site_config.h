@@ -0,0 +1,66 @@
+/*
+ * site_config - runtime settings fetched from the NAS
+ *
+ * A small text file on the NAS overrides build-time settings without a site
+ * visit. One key=value per line, '#' starts a comment:
+ *
+ *   upload_dir=/Lab303/esp32/Yunlin/steal1
+ *   mic_gain_db=21                     0 ... 24 in 3 dB steps (ES8388 PGA)
+ *   record=weekdays 22:00-04:00        one window per line, replaces the
+ *   upload=daily 23:59-24:00           schedule_rules.h rules of that kind
+ *
+ * Days are daily, weekdays, weekend or a list like mon,wed,fri. Unknown keys
+ * are skipped so older firmware accepts newer files; a malformed value
+ * rejects the whole file and the previous settings stay. The settings live
+ * in RTC memory, they survive deep sleep and are fetched again every upload
+ * cycle.
+ */
+
+#ifndef SITE_CONFIG_H_
+#define SITE_CONFIG_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "FtpClient.h"
+#include "schedule.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SITE_CONFIG_MAX_SIZE                2048
+#define SITE_CONFIG_MAX_RULES               8
+
+typedef struct {
+    char            upload_dir[96];     /* Empty: build default */
+    int             mic_gain_db;        /* -1: codec default */
+    int             rule_count;
+    schedule_rule_t rules[SITE_CONFIG_MAX_RULES];
+} site_config_t;
+
+/**
+ * @brief  Parse the text of a config file into cfg
+ */
+esp_err_t site_config_parse(const char *text, site_config_t *cfg);
+
+/**
+ * @brief  RETR remote and make it the current config, ESP_ERR_NOT_FOUND when
+ *         the NAS has none
+ */
+esp_err_t site_config_fetch(NetBuf_t *ctrl, const char *remote);
+
+/**
+ * @brief  Current config, all defaults until one was fetched
+ */
+const site_config_t *site_config_get(void);
+
+/**
+ * @brief  Hand the schedule rules of the current config to schedule, call at boot
+ */
+void site_config_apply(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SITE_CONFIG_H_ */
@@ -0,0 +1,52 @@
+/*
+ * task_plan - core affinity and priority plan for all long running tasks
+ */
+
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "task_plan.h"
+
+static const char *TAG = "TASK_PLAN";
+
+typedef struct {
+    int core;
+    int prio;
+} task_plan_entry_t;
+
+static const task_plan_entry_t s_plan[TASK_ROLE_MAX] = {
+    [TASK_ROLE_CAPTURE]  = { TASK_PLAN_CAPTURE_CORE,  TASK_PLAN_CAPTURE_PRIO  },
+    [TASK_ROLE_ENCODE]   = { TASK_PLAN_ENCODE_CORE,   TASK_PLAN_ENCODE_PRIO   },
+    [TASK_ROLE_STORAGE]  = { TASK_PLAN_STORAGE_CORE,  TASK_PLAN_STORAGE_PRIO  },
+    [TASK_ROLE_UPLOAD]   = { TASK_PLAN_UPLOAD_CORE,   TASK_PLAN_UPLOAD_PRIO   },
+    [TASK_ROLE_COMPRESS] = { TASK_PLAN_COMPRESS_CORE, TASK_PLAN_COMPRESS_PRIO },
+};
+
+int task_plan_core(task_role_t role)
+{
+    return s_plan[role].core;
+}
+
+int task_plan_prio(task_role_t role)
+{
+    return s_plan[role].prio;
+}
+
+BaseType_t task_plan_create(task_role_t role, TaskFunction_t fn, const char *name,
+                            uint32_t stack, void *arg, TaskHandle_t *handle)
+{
+    return xTaskCreatePinnedToCore(fn, name, stack, arg, s_plan[role].prio, handle, s_plan[role].core);
+}
+
+esp_err_t task_plan_set_cpu_freq(int mhz)
+{
+    esp_pm_config_esp32_t pm_cfg = {
+        .max_freq_mhz = mhz,
+        .min_freq_mhz = mhz,
+        .light_sleep_enable = false,
+    };
+    esp_err_t ret = esp_pm_configure(&pm_cfg);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to set CPU to %d MHz: %s", mhz, esp_err_to_name(ret));
+    }
+    return ret;
+}
@@ -0,0 +1,85 @@
+/*
+ * task_plan - core affinity and priority plan for all long running tasks
+ *
+ * The audio path (capture, encode, storage) is pinned to core 1, everything
+ * that talks to the network (Wi-Fi and lwIP are pinned in sdkconfig, FTP
+ * upload, compression) runs on core 0. Priorities are ordered so the writer
+ * always preempts the uploader. Every value can be overridden at build time.
+ */
+
+#ifndef TASK_PLAN_H_
+#define TASK_PLAN_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    TASK_ROLE_CAPTURE = 0,      /* i2s_stream_reader */
+    TASK_ROLE_ENCODE,           /* wav_encoder and other DSP elements */
+    TASK_ROLE_STORAGE,          /* fatfs_stream / sd_wav_writer */
+    TASK_ROLE_UPLOAD,           /* FTP transfers */
+    TASK_ROLE_COMPRESS,         /* Packing / compression before upload */
+    TASK_ROLE_MAX,
+} task_role_t;
+
+#if !defined TASK_PLAN_CAPTURE_CORE
+#define TASK_PLAN_CAPTURE_CORE          1
+#endif
+#if !defined TASK_PLAN_CAPTURE_PRIO
+#define TASK_PLAN_CAPTURE_PRIO          23
+#endif
+#if !defined TASK_PLAN_ENCODE_CORE
+#define TASK_PLAN_ENCODE_CORE           1
+#endif
+#if !defined TASK_PLAN_ENCODE_PRIO
+#define TASK_PLAN_ENCODE_PRIO           10
+#endif
+#if !defined TASK_PLAN_STORAGE_CORE
+#define TASK_PLAN_STORAGE_CORE          1
+#endif
+#if !defined TASK_PLAN_STORAGE_PRIO
+#define TASK_PLAN_STORAGE_PRIO          9
+#endif
+#if !defined TASK_PLAN_UPLOAD_CORE
+#define TASK_PLAN_UPLOAD_CORE           0
+#endif
+#if !defined TASK_PLAN_UPLOAD_PRIO
+#define TASK_PLAN_UPLOAD_PRIO           5
+#endif
+#if !defined TASK_PLAN_COMPRESS_CORE
+#define TASK_PLAN_COMPRESS_CORE         0
+#endif
+#if !defined TASK_PLAN_COMPRESS_PRIO
+#define TASK_PLAN_COMPRESS_PRIO         3
+#endif
+
+/* CPU clock while recording, 160 saves power if the monitor shows no drops */
+#if !defined TASK_PLAN_CPU_FREQ_MHZ
+#define TASK_PLAN_CPU_FREQ_MHZ          240
+#endif
+
+int task_plan_core(task_role_t role);
+int task_plan_prio(task_role_t role);
+
+/**
+ * @brief  xTaskCreatePinnedToCore() with the core and priority of role
+ */
+BaseType_t task_plan_create(task_role_t role, TaskFunction_t fn, const char *name,
+                            uint32_t stack, void *arg, TaskHandle_t *handle);
+
+/**
+ * @brief  Lock the CPU clock to mhz (80, 160 or 240) through esp_pm
+ */
+esp_err_t task_plan_set_cpu_freq(int mhz);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TASK_PLAN_H_ */
@@ -0,0 +1,202 @@
+#!/usr/bin/env python3
+"""Print the .blg files written by bin_log_drain() as text.
+
+usage: bin_log_decode.py --elf build/app.elf clip.blg [more.blg ...]
+
+Records keep the flash address of their format and tag, the ELF of the
+firmware that wrote the file turns them back into text. The file header holds
+the first bytes of the ELF SHA-256 (esp_app_desc_t.app_elf_sha256), a
+different ELF is reported and used anyway.
+
+Timestamps are ms since boot. Every boot starts with a boot mark; a sync mark
+(drain or deep sleep) gives the wall clock of the records before it in the
+same boot, records after the last one are printed relative to boot.
+"""
+
+import argparse
+import datetime
+import hashlib
+import re
+import struct
+import sys
+
+MAGIC = b"BLG1"
+MARK_BOOT, MARK_SYNC, MARK_DROPPED = 1, 2, 3
+RECORD = struct.Struct("<IIIHBB")
+
+LEVELS = "NEWIDV"
+RESET_REASONS = ["unknown", "power-on", "external", "software", "panic", "interrupt watchdog",
+                 "task watchdog", "other watchdog", "deep sleep", "brownout", "sdio"]
+WAKEUP_CAUSES = ["undefined", "all", "ext0", "ext1", "timer", "touchpad", "ulp", "gpio", "uart"]
+
+SPEC = re.compile(r"%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d+))?(hh|h|ll|l|L|j|z|t)?([diouxXcsfeEgGaAp%])")
+
+
+class Elf:
+    """Allocated sections of an ELF32/ELF64 little endian file, to read strings by address"""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.data = f.read()
+        self.sha256 = hashlib.sha256(self.data).digest()
+        d = self.data
+        if d[:4] != b"\x7fELF" or d[5] != 1:
+            raise ValueError("%s is not a little endian ELF file" % path)
+        if d[4] == 1:
+            shoff, = struct.unpack_from("<I", d, 0x20)
+            shentsize, shnum = struct.unpack_from("<HH", d, 0x2e)
+            sh = struct.Struct("<IIIIIIIIII")
+        else:
+            shoff, = struct.unpack_from("<Q", d, 0x28)
+            shentsize, shnum = struct.unpack_from("<HH", d, 0x3a)
+            sh = struct.Struct("<IIQQQQIIQQ")
+        self.sections = []
+        for i in range(shnum):
+            _, typ, flags, addr, offset, size = sh.unpack_from(d, shoff + i * shentsize)[:6]
+            # SHT_PROGBITS with SHF_ALLOC: .flash.rodata, .dram0.data, ...
+            if typ == 1 and flags & 2 and size:
+                self.sections.append((addr, size, offset))
+
+    def string(self, addr):
+        for base, size, offset in self.sections:
+            if base <= addr < base + size:
+                start = offset + addr - base
+                end = self.data.index(b"\0", start, offset + size)
+                return self.data[start:end].decode("utf-8", "replace")
+        return None
+
+
+def format_args(fmt, args):
+    """printf fmt with the arguments packed by _pack() in bin_log.c"""
+    pos = 0
+    missing = False
+
+    def take(n):
+        nonlocal pos, missing
+        if pos + n > len(args):
+            missing = True
+            return None
+        v = args[pos:pos + n]
+        pos += n
+        return v
+
+    def word(signed=False):
+        v = take(4)
+        return None if v is None else struct.unpack("<i" if signed else "<I", v)[0]
+
+    def convert(m):
+        flags, width, prec, length, conv = m.groups()
+        if conv == "%":
+            return "%"
+        if width == "*":
+            width = word(signed=True)
+        if prec == "*":
+            prec = word(signed=True)
+        spec = "%" + flags + ("" if width is None else str(width)) + ("" if prec is None else "." + str(prec))
+        wide = length in ("ll", "j", "L")
+        if conv == "s":
+            n = take(1)
+            if n is None:
+                return "?"
+            text = take((1 + n[0] + 3) // 4 * 4 - 1)
+            if text is None:
+                return "?"
+            return (spec + "s") % text[:n[0]].decode("utf-8", "replace")
+        if conv in "feEgGaA":
+            v = take(8)
+            if v is None:
+                return "?"
+            v = struct.unpack("<d", v)[0]
+            return v.hex() if conv in "aA" else (spec + conv) % v
+        if wide:
+            v = take(8)
+            if v is None:
+                return "?"
+            v = struct.unpack("<q" if conv in "di" else "<Q", v)[0]
+        else:
+            v = word(signed=conv in "di")
+            if v is None:
+                return "?"
+        if conv == "p":
+            return "0x%08x" % v
+        if conv == "c":
+            return chr(v & 0xff)
+        return (spec + {"i": "d", "u": "d"}.get(conv, conv)) % v
+
+    text = SPEC.sub(convert, fmt)
+    return text + (" <args cut>" if missing else "")
+
+
+def records(data):
+    pos = 0
+    while pos + RECORD.size <= len(data):
+        fmt, tag, ms, length, level, _ = RECORD.unpack_from(data, pos)
+        args = data[pos + RECORD.size:pos + RECORD.size + length]
+        if len(args) < length:
+            print("-- truncated record at offset %d" % pos, file=sys.stderr)
+            return
+        yield fmt, tag, ms, level, args
+        pos += RECORD.size + length
+
+
+def decode(path, elf):
+    with open(path, "rb") as f:
+        data = f.read()
+    if data[:4] != MAGIC:
+        print("%s: not a bin_log file" % path, file=sys.stderr)
+        return
+    version, header_size = struct.unpack_from("<HH", data, 4)
+    sha = data[8:16]
+    if elf.sha256[:len(sha)] != sha:
+        print("%s: written by firmware %s, ELF is %s, formats may be wrong"
+              % (path, sha.hex(), elf.sha256[:len(sha)].hex()), file=sys.stderr)
+
+    # Split into boots, each anchored at its last sync mark
+    boots = [[]]
+    for rec in records(data[header_size:]):
+        if rec[0] == MARK_BOOT and boots[-1]:
+            boots.append([])
+        boots[-1].append(rec)
+
+    for boot in boots:
+        anchor = None
+        for fmt, _, ms, _, args in boot:
+            if fmt == MARK_SYNC:
+                anchor = (struct.unpack_from("<I", args)[0], ms)
+        for fmt, tag, ms, level, args in boot:
+            if anchor and anchor[0] > 1600000000 and ms <= anchor[1]:
+                t = datetime.datetime.fromtimestamp(anchor[0] - (anchor[1] - ms) / 1000.0)
+                stamp = t.strftime("%Y-%m-%d %H:%M:%S.") + "%03d" % (t.microsecond // 1000)
+            else:
+                stamp = "boot+%d.%03d" % (ms // 1000, ms % 1000)
+            if fmt == MARK_BOOT:
+                reason, cause = struct.unpack_from("<II", args)
+                print("%s ==== boot, reset: %s, wakeup: %s ====" % (stamp,
+                      RESET_REASONS[reason] if reason < len(RESET_REASONS) else reason,
+                      WAKEUP_CAUSES[cause] if cause < len(WAKEUP_CAUSES) else cause))
+            elif fmt == MARK_SYNC:
+                continue
+            elif fmt == MARK_DROPPED:
+                print("%s ---- %d records dropped ----" % (stamp, struct.unpack_from("<I", args)[0]))
+            else:
+                text = elf.string(fmt)
+                if text is None:
+                    text = "<format 0x%08x not in ELF> %s" % (fmt, args.hex())
+                else:
+                    text = format_args(text, args).rstrip()
+                print("%s %s %s: %s" % (stamp, LEVELS[level] if level < len(LEVELS) else "?",
+                                        elf.string(tag) or "0x%08x" % tag, text))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--elf", required=True, help="ELF of the firmware that wrote the files")
+    parser.add_argument("files", nargs="+", help=".blg files")
+    args = parser.parse_args()
+    elf = Elf(args.elf)
+    for path in args.files:
+        decode(path, elf)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,292 @@
+/*
+ * upload_worker - background FTP uploader for completed recordings
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "FtpClient.h"
+#include "task_plan.h"
+#include "upload_worker.h"
+#include "ftp_retry.h"
+#include "clip_stage.h"
+#include "clip_store.h"
+
+static const char *TAG = "UPLOAD_WORKER";
+
+static upload_worker_cfg_t      s_cfg;
+static QueueHandle_t            s_queue;
+static TaskHandle_t             s_task;
+static volatile bool            s_busy;
+static upload_worker_stats_t    s_stats;
+static NetBuf_t                 *s_ctrl;
+static portMUX_TYPE             s_pressure_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* Writer fill in percent, 0 once the pressure callback is cleared */
+static int _pressure(void)
+{
+    portENTER_CRITICAL(&s_pressure_mux);
+    upload_worker_pressure_cb_t cb = s_cfg.pressure_cb;
+    void *ctx = s_cfg.pressure_ctx;
+    portEXIT_CRITICAL(&s_pressure_mux);
+    return cb ? cb(ctx) : 0;
+}
+
+static int _shape_cb(NetBuf_t *nData, uint32_t xfered, void *arg)
+{
+    if (s_cfg.rate_cb) {
+        getFtpClient()->ftpClientSetOptions(FTP_CLIENT_RATELIMIT, s_cfg.rate_cb(s_cfg.rate_ctx), nData);
+    }
+    if (_pressure() < s_cfg.pressure_high) {
+        return 1;
+    }
+    s_stats.throttled++;
+    /* A fill level that stops moving (sampling stopped) must not hold the upload forever */
+    TickType_t start = xTaskGetTickCount();
+    while (_pressure() > s_cfg.pressure_low
+           && xTaskGetTickCount() - start < pdMS_TO_TICKS(UPLOAD_WORKER_PAUSE_MAX_MS)) {
+        vTaskDelay(pdMS_TO_TICKS(20));
+    }
+    return 1;
+}
+
+static void _session_close(void)
+{
+    if (s_ctrl) {
+        FtpClientTimings_t t;
+        if (getFtpClient()->ftpClientGetTimings(&t, s_ctrl) && t.dataReused) {
+            ESP_LOGI(TAG, "%" PRIu32 " data connections for %" PRIu32 " transfers (MODE B)",
+                     t.dataConnects, t.dataConnects + t.dataReused);
+        }
+        getFtpClient()->ftpClientQuit(s_ctrl);
+        s_ctrl = NULL;
+    }
+}
+
+static esp_err_t _session_open(void)
+{
+    if (s_ctrl) {
+        return ESP_OK;
+    }
+    FtpClient *ftp = getFtpClient();
+    if (!ftp->ftpClientConnectFallback(s_cfg.server, s_cfg.port, s_cfg.server2, s_cfg.port2, &s_ctrl)) {
+        ESP_LOGE(TAG, "Connect to %s:%d failed", s_cfg.server, s_cfg.port);
+        s_ctrl = NULL;
+        return ESP_FAIL;
+    }
+    if (s_cfg.tls && !ftp->ftpClientAuthTls(s_cfg.ca_pem, s_ctrl)) {
+        ESP_LOGE(TAG, "AUTH TLS failed: %s", ftp->ftpClientGetLastResponse(s_ctrl));
+        ftp->ftpClientDisconnect(s_ctrl);
+        s_ctrl = NULL;
+        return ESP_FAIL;
+    }
+    if (!ftp->ftpClientLogin(s_cfg.user, s_cfg.pass, s_ctrl)) {
+        ESP_LOGE(TAG, "Login failed");
+        _session_close();
+        return ESP_FAIL;
+    }
+    FtpClientTimings_t t;
+    if (ftp->ftpClientGetTimings(&t, s_ctrl)) {
+        ESP_LOGI(TAG, "Session to server %d: dns %" PRIu32 " us%s, connect %" PRIu32 " us, banner %" PRIu32 " us, login %" PRIu32 " us, tls %" PRIu32 " us",
+                 t.server, t.dnsUs, t.dnsCached ? " (cached)" : "", t.connectUs, t.bannerUs, t.loginUs, t.tlsUs);
+    }
+    FtpClientCallbackOptions_t opt = {
+        .cbFunc = _shape_cb,
+        .cbArg = NULL,
+        .bytesXferred = UPLOAD_WORKER_SHAPE_BYTES,
+        .idleTime = 0,
+    };
+    ftp->ftpClientSetCallback(&opt, s_ctrl);
+    ftp->ftpClientSetOptions(FTP_CLIENT_BLOCKMODE, s_cfg.block_mode, s_ctrl);
+    if (s_cfg.rate_cb) {
+        ftp->ftpClientSetOptions(FTP_CLIENT_RATELIMIT, s_cfg.rate_cb(s_cfg.rate_ctx), s_ctrl);
+    }
+    return ESP_OK;
+}
+
+/* STOR a clip staged in PSRAM, returns 1 like ftpClientPut() */
+static int _put_staged(const uint8_t *data, size_t size, const char *remote)
+{
+    FtpClient *ftp = getFtpClient();
+    NetBuf_t *nData;
+    if (!ftp->ftpClientAccess(remote, FTP_CLIENT_FILE_WRITE, FTP_CLIENT_BINARY, s_ctrl, &nData)) {
+        return 0;
+    }
+    int ok = 1;
+    while (size > 0) {
+        int n = size < FTP_CLIENT_BUFFER_SIZE ? size : FTP_CLIENT_BUFFER_SIZE;
+        if (ftp->ftpClientWrite(data, n, nData) < n) {
+            ok = 0;
+            break;
+        }
+        data += n;
+        size -= n;
+    }
+    return ftp->ftpClientClose(nData) && ok;
+}
+
+static esp_err_t _upload_one(const char *path)
+{
+    const uint8_t *data = NULL;
+    size_t staged_size = 0;
+    clip_stage_clip_t *clip = clip_stage_take(path, &data, &staged_size);
+    if (_session_open() != ESP_OK) {
+        /* NAS unreachable, free the arena and retry from the card */
+        if (clip) {
+            clip_stage_spill(clip);
+        }
+        return ESP_FAIL;
+    }
+    FtpClient *ftp = getFtpClient();
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    char remote[UPLOAD_WORKER_PATH_MAX + 64];
+    snprintf(remote, sizeof(remote), "%s/%s", s_cfg.remote_dir, base);
+
+    long size = staged_size;
+    if (clip == NULL) {
+        FILE *f = fopen(path, "rb");
+        if (f == NULL) {
+            ESP_LOGE(TAG, "Missing %s, dropped", path);
+            return ESP_ERR_NOT_FOUND;
+        }
+        fseek(f, 0, SEEK_END);
+        size = ftell(f);
+        fclose(f);
+    }
+
+    int ok = clip ? _put_staged(data, staged_size, remote)
+             : ftp->ftpClientPut(path, remote, FTP_CLIENT_BINARY, s_ctrl);
+    char *resp = ftp->ftpClientGetLastResponse(s_ctrl);
+    switch (ftp_retry_classify(ok, resp)) {
+        case FTP_RETRY_OK:
+            break;
+        case FTP_RETRY_PERMANENT:
+            ESP_LOGE(TAG, "Upload %s refused: %s, it stays on the card", path, resp);
+            if (clip) {
+                clip_stage_spill(clip);
+            }
+            return ESP_ERR_INVALID_RESPONSE;
+        case FTP_RETRY_TRANSIENT:
+            ESP_LOGW(TAG, "Upload %s failed: %s", path, resp);
+            if (clip) {
+                clip_stage_put_back(clip);
+            }
+            return ESP_FAIL;
+        case FTP_RETRY_RECONNECT:
+            ESP_LOGW(TAG, "Upload %s lost the connection", path);
+            if (clip) {
+                clip_stage_spill(clip);
+            }
+            /* Dead control channel, start over with a new session */
+            ftp->ftpClientDisconnect(s_ctrl);
+            s_ctrl = NULL;
+            return ESP_FAIL;
+    }
+    s_stats.uploaded++;
+    s_stats.bytes += size;
+    ESP_LOGI(TAG, "Uploaded %s -> %s (%ld bytes%s)", path, remote, size, clip ? ", from memory" : "");
+    if (clip) {
+        clip_stage_uploaded(clip);
+        clip_store_uploaded(path, true);
+    } else if (s_cfg.delete_after_upload && unlink(path) != 0) {
+        ESP_LOGW(TAG, "Failed to delete %s", path);
+        clip_store_uploaded(path, false);
+    } else {
+        clip_store_uploaded(path, s_cfg.delete_after_upload);
+    }
+    return ESP_OK;
+}
+
+static void _upload_task(void *arg)
+{
+    char path[UPLOAD_WORKER_PATH_MAX];
+    int attempt = 0;
+    while (1) {
+        if (xQueuePeek(s_queue, path, pdMS_TO_TICKS(UPLOAD_WORKER_IDLE_QUIT_MS)) != pdTRUE) {
+            _session_close();
+            continue;
+        }
+        s_busy = true;
+        esp_err_t ret = _upload_one(path);
+        if (ret == ESP_FAIL) {
+            s_stats.failed++;
+            vTaskDelay(pdMS_TO_TICKS(ftp_retry_backoff_ms(++attempt, 1000, 60000)));
+        } else {
+            if (ret != ESP_OK && ret != ESP_ERR_NOT_FOUND) {
+                s_stats.failed++;
+            }
+            xQueueReceive(s_queue, path, 0);
+            attempt = 0;
+        }
+        s_busy = false;
+    }
+}
+
+esp_err_t upload_worker_start(const upload_worker_cfg_t *config)
+{
+    if (s_task) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_cfg = *config;
+    s_queue = xQueueCreate(UPLOAD_WORKER_QUEUE_LEN, UPLOAD_WORKER_PATH_MAX);
+    if (s_queue == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (task_plan_create(TASK_ROLE_UPLOAD, _upload_task, "upload_worker", 6 * 1024, NULL, &s_task) != pdPASS) {
+        vQueueDelete(s_queue);
+        s_queue = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void upload_worker_set_pressure(upload_worker_pressure_cb_t cb, void *ctx)
+{
+    portENTER_CRITICAL(&s_pressure_mux);
+    s_cfg.pressure_cb = cb;
+    s_cfg.pressure_ctx = ctx;
+    portEXIT_CRITICAL(&s_pressure_mux);
+}
+
+esp_err_t upload_worker_enqueue(const char *local_path)
+{
+    char path[UPLOAD_WORKER_PATH_MAX];
+    if (s_queue == NULL || strlen(local_path) >= sizeof(path)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    strcpy(path, local_path);
+    if (xQueueSend(s_queue, path, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Queue full, %s stays on the card", local_path);
+        return ESP_ERR_TIMEOUT;
+    }
+    return ESP_OK;
+}
+
+int upload_worker_pending(void)
+{
+    return s_queue ? uxQueueMessagesWaiting(s_queue) : 0;
+}
+
+esp_err_t upload_worker_wait_idle(TickType_t timeout)
+{
+    TickType_t start = xTaskGetTickCount();
+    while (upload_worker_pending() || s_busy) {
+        if (xTaskGetTickCount() - start >= timeout) {
+            return ESP_ERR_TIMEOUT;
+        }
+        vTaskDelay(pdMS_TO_TICKS(100));
+    }
+    return ESP_OK;
+}
+
+void upload_worker_get_stats(upload_worker_stats_t *stats)
+{
+    memcpy(stats, &s_stats, sizeof(*stats));
+}
@@ -0,0 +1,115 @@
+/*
+ * upload_worker - background FTP uploader for completed recordings
+ *
+ * Runs on the upload core of task_plan and drains a queue of local files over
+ * ftpClientPut() while the pipeline keeps recording. The control session is
+ * kept open between files. A byte callback on the data connection pauses the
+ * transfer while the writer's ring buffer is above pressure_high percent and
+ * resumes below pressure_low (or after UPLOAD_WORKER_PAUSE_MAX_MS), so
+ * uploads never starve the SD writer. The
+ * same callback re-reads rate_cb and updates the client's token bucket, so
+ * the upload rate can follow the time of day within a transfer.
+ *
+ * Files staged in clip_stage are sent from PSRAM and only reach the card when
+ * the NAS cannot be reached or refuses them.
+ *
+ * Uploaded files are marked in the clip_store index (DELETED when they are no
+ * longer on the card), files the index does not know are just uploaded.
+ */
+
+#ifndef UPLOAD_WORKER_H_
+#define UPLOAD_WORKER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UPLOAD_WORKER_PATH_MAX              128
+
+#if !defined UPLOAD_WORKER_QUEUE_LEN
+#define UPLOAD_WORKER_QUEUE_LEN             16
+#endif
+
+/* Check writer pressure every this many uploaded bytes */
+#if !defined UPLOAD_WORKER_SHAPE_BYTES
+#define UPLOAD_WORKER_SHAPE_BYTES           (8 * 1024)
+#endif
+
+/* Longest single pause for writer pressure */
+#if !defined UPLOAD_WORKER_PAUSE_MAX_MS
+#define UPLOAD_WORKER_PAUSE_MAX_MS          (5 * 1000)
+#endif
+
+/* Close the control session after this long without work */
+#if !defined UPLOAD_WORKER_IDLE_QUIT_MS
+#define UPLOAD_WORKER_IDLE_QUIT_MS          (120 * 1000)
+#endif
+
+typedef int (*upload_worker_pressure_cb_t)(void *ctx);
+typedef long (*upload_worker_rate_cb_t)(void *ctx);
+
+typedef struct {
+    const char                  *server;
+    uint16_t                    port;
+    const char                  *server2;           /* Fallback server, may be NULL */
+    uint16_t                    port2;
+    const char                  *user;
+    const char                  *pass;
+    bool                        tls;                /* Explicit FTPS (AUTH TLS) */
+    const char                  *ca_pem;            /* Server CA for tls, NULL skips verification */
+    const char                  *remote_dir;        /* Files go to remote_dir/<basename> */
+    bool                        block_mode;         /* Try MODE B to keep one data connection for all files */
+    bool                        delete_after_upload;
+    upload_worker_pressure_cb_t pressure_cb;        /* Writer ring buffer fill in percent, may be NULL */
+    void                        *pressure_ctx;
+    int                         pressure_high;
+    int                         pressure_low;
+    upload_worker_rate_cb_t     rate_cb;            /* Upload rate in bytes/s (0 = unlimited), polled during transfers, may be NULL */
+    void                        *rate_ctx;
+} upload_worker_cfg_t;
+
+typedef struct {
+    uint32_t uploaded;
+    uint32_t failed;
+    uint32_t throttled;         /* Times the transfer paused for the writer */
+    uint64_t bytes;
+} upload_worker_stats_t;
+
+esp_err_t upload_worker_start(const upload_worker_cfg_t *config);
+
+/**
+ * @brief  Replace the pressure callback, NULL stops pausing (e.g. when the
+ *         recording stops and the worker drains the last segments). A call
+ *         of the old callback may still be running, keep its ctx alive until
+ *         upload_worker_wait_idle().
+ */
+void upload_worker_set_pressure(upload_worker_pressure_cb_t cb, void *ctx);
+
+/**
+ * @brief  Queue a local file for upload, returns ESP_ERR_TIMEOUT when the
+ *         queue is full (the file stays on the card)
+ */
+esp_err_t upload_worker_enqueue(const char *local_path);
+
+/**
+ * @brief  Files queued or in flight
+ */
+int upload_worker_pending(void);
+
+/**
+ * @brief  Block until the queue is drained or timeout expires
+ */
+esp_err_t upload_worker_wait_idle(TickType_t timeout);
+
+void upload_worker_get_stats(upload_worker_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* UPLOAD_WORKER_H_ */
@@ -0,0 +1,44 @@
+/*
+ * wake_detector - sound level decision of the wake-on-sound mode
+ */
+
+#include "wake_detector.h"
+
+void wake_detector_calibrate(wake_detector_t *det, const uint16_t *samples, int n,
+                             int k, uint16_t min_threshold, uint16_t hold)
+{
+    uint32_t sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += samples[i];
+    }
+    det->baseline = n > 0 ? (uint16_t)(sum / n) : 0;
+    uint32_t dev = 0;
+    for (int i = 0; i < n; i++) {
+        dev += wake_detector_level(det, samples[i]);
+    }
+    uint32_t threshold = n > 0 ? (uint32_t)k * dev / n : 0;
+    if (threshold < min_threshold) {
+        threshold = min_threshold;
+    }
+    det->threshold = threshold > UINT16_MAX ? UINT16_MAX : (uint16_t)threshold;
+    det->hold = hold > 0 ? hold : 1;
+    det->count = 0;
+}
+
+uint16_t wake_detector_level(const wake_detector_t *det, uint16_t sample)
+{
+    return sample >= det->baseline ? sample - det->baseline : det->baseline - sample;
+}
+
+bool wake_detector_step(wake_detector_t *det, uint16_t sample)
+{
+    if (wake_detector_level(det, sample) < det->threshold) {
+        det->count = 0;
+        return false;
+    }
+    if (++det->count < det->hold) {
+        return false;
+    }
+    det->count = 0;
+    return true;
+}
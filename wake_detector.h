@@ -0,0 +1,52 @@
+/*
+ * wake_detector - sound level decision of the wake-on-sound mode
+ *
+ * Plain integer C with no ESP-IDF dependency, so recorded ADC traces can be
+ * replayed through it on a host. wake_on_sound.c runs the same decision on
+ * the ULP coprocessor; wake_detector_step() is the reference for that program
+ * and both must be changed together.
+ *
+ * A sample is loud when |sample - baseline| >= threshold. The detector
+ * triggers after hold consecutive loud samples, a quiet sample resets the
+ * count. Calibration takes the baseline as the mean of a quiet stretch and the
+ * threshold as k times its mean absolute deviation, at least min_threshold.
+ */
+
+#ifndef WAKE_DETECTOR_H_
+#define WAKE_DETECTOR_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint16_t baseline;          /* Quiet ADC level */
+    uint16_t threshold;         /* Deviation from baseline that counts as loud */
+    uint16_t hold;              /* Consecutive loud samples needed to trigger */
+    uint16_t count;             /* Current run of loud samples */
+} wake_detector_t;
+
+/**
+ * @brief  Set baseline and threshold from n samples of a quiet input
+ */
+void wake_detector_calibrate(wake_detector_t *det, const uint16_t *samples, int n,
+                             int k, uint16_t min_threshold, uint16_t hold);
+
+/**
+ * @brief  |sample - baseline|, the value the ULP keeps in its history ring
+ */
+uint16_t wake_detector_level(const wake_detector_t *det, uint16_t sample);
+
+/**
+ * @brief  Feed one sample, returns true when the detector triggers
+ */
+bool wake_detector_step(wake_detector_t *det, uint16_t sample);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WAKE_DETECTOR_H_ */
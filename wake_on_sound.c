@@ -0,0 +1,161 @@
+/*
+ * wake_on_sound - wake from deep sleep on sound instead of only on a timer
+ *
+ * RTC slow memory (words, low 16 bits used by the ULP):
+ *   [WOS_BASELINE .. WOS_PERIOD]                   detector state, see wake_detector_t
+ *   [WOS_HISTORY, WOS_HISTORY + HISTORY)           level ring, WOS_POS is the next slot
+ *   [WOS_PROG, ...)                                ULP program
+ */
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_sleep.h"
+#include "driver/adc.h"
+#include "soc/rtc_cntl_reg.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "audio_idf_version.h"
+#if (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 1, 0))
+#include "esp32/ulp.h"
+#else
+#include "ulp.h"
+#endif
+#include "wake_detector.h"
+#include "wake_on_sound.h"
+
+static const char *TAG = "WAKE_ON_SOUND";
+
+#if CONFIG_ESP32_ULP_COPROC_RESERVE_MEM < WAKE_ON_SOUND_RESERVE_MEM
+#error "wake_on_sound needs CONFIG_ESP32_ULP_COPROC_RESERVE_MEM >= WAKE_ON_SOUND_RESERVE_MEM"
+#endif
+
+enum {
+    WOS_BASELINE = 0,
+    WOS_THRESHOLD,
+    WOS_HOLD,
+    WOS_COUNT,
+    WOS_POS,
+    WOS_TRIGGERED,
+    WOS_PERIOD,
+    WOS_HISTORY = 8,
+    WOS_PROG = WOS_HISTORY + WAKE_ON_SOUND_HISTORY,
+};
+
+enum {
+    LBL_NEGATIVE = 1,
+    LBL_LEVEL,
+    LBL_QUIET,
+    LBL_DONE,
+};
+
+/* wake_detector_step() on the ULP: R1 sample, R0 level, R3 = 0 as base address */
+#define WOS_PROGRAM(channel) {                                              \
+    I_ADC(R1, 0, channel),                                                  \
+    I_MOVI(R3, 0),                                                          \
+    I_LD(R2, R3, WOS_BASELINE),                                             \
+    I_SUBR(R0, R1, R2),                                                     \
+    M_BXF(LBL_NEGATIVE),                                                    \
+    M_BX(LBL_LEVEL),                                                        \
+    M_LABEL(LBL_NEGATIVE),                                                  \
+    I_SUBR(R0, R2, R1),                                                     \
+    M_LABEL(LBL_LEVEL),                                                     \
+    I_LD(R2, R3, WOS_POS),                                                  \
+    I_ST(R0, R2, WOS_HISTORY),                                              \
+    I_ADDI(R2, R2, 1),                                                      \
+    I_ANDI(R2, R2, WAKE_ON_SOUND_HISTORY - 1),                              \
+    I_ST(R2, R3, WOS_POS),                                                  \
+    I_LD(R2, R3, WOS_THRESHOLD),                                            \
+    I_SUBR(R0, R0, R2),                                                     \
+    M_BXF(LBL_QUIET),                                                       \
+    I_LD(R0, R3, WOS_COUNT),                                                \
+    I_ADDI(R0, R0, 1),                                                      \
+    I_ST(R0, R3, WOS_COUNT),                                                \
+    I_LD(R2, R3, WOS_HOLD),                                                 \
+    I_SUBR(R0, R0, R2),                                                     \
+    M_BXF(LBL_DONE),                                                        \
+    I_MOVI(R0, 1),                                                          \
+    I_ST(R0, R3, WOS_TRIGGERED),                                            \
+    I_WAKE(),                                                               \
+    I_END(),                                                                \
+    I_HALT(),                                                               \
+    M_LABEL(LBL_QUIET),                                                     \
+    I_MOVI(R0, 0),                                                          \
+    I_ST(R0, R3, WOS_COUNT),                                                \
+    M_LABEL(LBL_DONE),                                                      \
+    I_HALT(),                                                               \
+}
+
+esp_err_t wake_on_sound_arm(const wake_on_sound_cfg_t *config)
+{
+    if (config->calib_samples <= 0 || config->period_ms <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    uint16_t *samples = audio_calloc(config->calib_samples, sizeof(uint16_t));
+    AUDIO_MEM_CHECK(TAG, samples, return ESP_ERR_NO_MEM);
+    adc1_config_width(ADC_WIDTH_BIT_12);
+    adc1_config_channel_atten(config->adc_channel, ADC_ATTEN_DB_11);
+    for (int i = 0; i < config->calib_samples; i++) {
+        samples[i] = (uint16_t)adc1_get_raw(config->adc_channel);
+    }
+    wake_detector_t det;
+    wake_detector_calibrate(&det, samples, config->calib_samples, config->k,
+                            config->min_threshold, config->hold);
+    audio_free(samples);
+
+    memset(RTC_SLOW_MEM, 0, WOS_PROG * sizeof(uint32_t));
+    RTC_SLOW_MEM[WOS_BASELINE] = det.baseline;
+    RTC_SLOW_MEM[WOS_THRESHOLD] = det.threshold;
+    RTC_SLOW_MEM[WOS_HOLD] = det.hold;
+    RTC_SLOW_MEM[WOS_PERIOD] = config->period_ms;
+
+    const ulp_insn_t program[] = WOS_PROGRAM(config->adc_channel);
+    size_t size = sizeof(program) / sizeof(ulp_insn_t);
+    esp_err_t ret = ulp_process_macros_and_load(WOS_PROG, program, &size);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "ULP load failed: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    adc1_ulp_enable();
+    ulp_set_wakeup_period(0, config->period_ms * 1000);
+    ret = ulp_run(WOS_PROG);
+    if (ret == ESP_OK) {
+        ret = esp_sleep_enable_ulp_wakeup();
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "ULP start failed: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    ESP_LOGI(TAG, "Armed on ADC1 ch%d: baseline %u, threshold %u, hold %u x %d ms",
+             config->adc_channel, det.baseline, det.threshold, det.hold, config->period_ms);
+    return ESP_OK;
+}
+
+void wake_on_sound_disarm(void)
+{
+    CLEAR_PERI_REG_MASK(RTC_CNTL_STATE0_REG, RTC_CNTL_ULP_CP_SLP_TIMER_EN);
+}
+
+bool wake_on_sound_triggered(void)
+{
+    return esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_ULP
+           && (RTC_SLOW_MEM[WOS_TRIGGERED] & 0xffff);
+}
+
+esp_err_t wake_on_sound_get_history(wake_on_sound_history_t *history)
+{
+    if (!wake_on_sound_triggered()) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    memset(history, 0, sizeof(*history));
+    history->period_ms = RTC_SLOW_MEM[WOS_PERIOD] & 0xffff;
+    history->baseline = RTC_SLOW_MEM[WOS_BASELINE] & 0xffff;
+    history->threshold = RTC_SLOW_MEM[WOS_THRESHOLD] & 0xffff;
+    history->hold = RTC_SLOW_MEM[WOS_HOLD] & 0xffff;
+    history->count = WAKE_ON_SOUND_HISTORY;
+    int pos = RTC_SLOW_MEM[WOS_POS] & (WAKE_ON_SOUND_HISTORY - 1);
+    for (int i = 0; i < WAKE_ON_SOUND_HISTORY; i++) {
+        history->level[i] = RTC_SLOW_MEM[WOS_HISTORY + ((pos + i) & (WAKE_ON_SOUND_HISTORY - 1))] & 0xffff;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,90 @@
+/*
+ * wake_on_sound - wake from deep sleep on sound instead of only on a timer
+ *
+ * The ULP coprocessor samples an ADC1 pad every period_ms while the main
+ * CPUs sleep and runs the wake_detector decision on each sample. The codec
+ * is off in deep sleep, so the pad needs an analog level of its own (an
+ * envelope detector or a mic preamp output). The last WAKE_ON_SOUND_HISTORY
+ * levels are kept in RTC slow memory as pre-trigger history; after the wake
+ * they can be stored with the clip ("wosh" trailer chunk of sd_wav_writer).
+ *
+ * Trigger latency is hold * period_ms plus the boot up to the first I2S
+ * sample. A timer wakeup is normally armed as well, so the device still checks
+ * in during long quiet periods.
+ *
+ * Needs CONFIG_ESP32_ULP_COPROC_ENABLED with WAKE_ON_SOUND_RESERVE_MEM bytes
+ * of reserved RTC slow memory.
+ */
+
+#ifndef WAKE_ON_SOUND_H_
+#define WAKE_ON_SOUND_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Power of two, the ULP wraps the ring with an AND */
+#define WAKE_ON_SOUND_HISTORY               128
+
+/* Data words, history ring and the ULP program */
+#define WAKE_ON_SOUND_RESERVE_MEM           1024
+
+typedef struct {
+    int         adc_channel;    /* ADC1 channel of the level input */
+    int         period_ms;      /* ULP sampling period */
+    int         hold;           /* Consecutive loud samples to wake */
+    int         k;              /* Threshold in mean absolute deviations of the quiet input */
+    int         min_threshold;  /* Raw 12-bit ADC counts */
+    int         calib_samples;  /* Quiet samples taken before sleeping */
+} wake_on_sound_cfg_t;
+
+#define WAKE_ON_SOUND_CFG_DEFAULT() {   \
+    .adc_channel = 6,                   \
+    .period_ms = 10,                    \
+    .hold = 3,                          \
+    .k = 4,                             \
+    .min_threshold = 40,                \
+    .calib_samples = 256,               \
+}
+
+/* "wosh" trailer chunk, little endian */
+typedef struct __attribute__((packed)) {
+    uint16_t period_ms;
+    uint16_t baseline;
+    uint16_t threshold;
+    uint16_t hold;
+    uint16_t count;                             /* Entries in level[], zero before the first ULP sample */
+    uint16_t reserved;
+    uint16_t level[WAKE_ON_SOUND_HISTORY];      /* |sample - baseline|, oldest first, trigger last */
+} wake_on_sound_history_t;
+
+/**
+ * @brief  Calibrate on the current (quiet) input, load the ULP program and
+ *         enable the ULP wakeup. Call right before esp_deep_sleep_start().
+ */
+esp_err_t wake_on_sound_arm(const wake_on_sound_cfg_t *config);
+
+/**
+ * @brief  Stop the ULP after a wakeup so it does not sample during recording
+ */
+void wake_on_sound_disarm(void);
+
+/**
+ * @brief  True when this boot was caused by the ULP detector
+ */
+bool wake_on_sound_triggered(void);
+
+/**
+ * @brief  Pre-trigger history of the last ULP run
+ */
+esp_err_t wake_on_sound_get_history(wake_on_sound_history_t *history);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WAKE_ON_SOUND_H_ */